@@ -0,0 +1,172 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Split a stream of CRLF lines with iobuf_getline(), fed in chunks the
+ * way reads from a socket fill the buffer, and report the throughput.
+ * With -b, lines are split with the former byte by byte loop instead.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iobuf.h"
+
+#define	BUFSIZE		65536
+
+static char	*getline_bytewise(struct iobuf *, size_t *);
+static void	 feed(struct iobuf *, const char *, size_t);
+static void	 usage(void);
+
+static char *
+getline_bytewise(struct iobuf *io, size_t *rlen)
+{
+	char	*buf;
+	size_t	 len, i;
+
+	buf = iobuf_data(io);
+	len = iobuf_len(io);
+
+	for (i = 0; i < len; i++)
+		if (buf[i] == '\n') {
+			iobuf_drop(io, i + 1);
+			len = (i && buf[i - 1] == '\r') ? i - 1 : i;
+			buf[len] = '\0';
+			*rlen = len;
+			return (buf);
+		}
+
+	return (NULL);
+}
+
+/* append data as iobuf_read() would */
+static void
+feed(struct iobuf *io, const char *data, size_t len)
+{
+	if (iobuf_left(io) < len)
+		errx(1, "feed: buffer full");
+	memcpy(io->buf + io->wpos, data, len);
+	io->wpos += len;
+}
+
+static void
+usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-b] [-c chunk] [-l linelen] [-s megabytes]\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct iobuf	 io;
+	struct timespec	 t0, t1;
+	const char	*errstr;
+	char		*data, *line;
+	size_t		 datalen, linelen, chunk, total, off, n, len, i;
+	size_t		 nlines, bytes;
+	double		 dt;
+	int		 ch, bytewise;
+
+	bytewise = 0;
+	chunk = 4096;
+	linelen = 80;
+	total = 256;
+
+	while ((ch = getopt(argc, argv, "bc:l:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bytewise = 1;
+			break;
+		case 'c':
+			chunk = strtonum(optarg, 1, BUFSIZE / 4, &errstr);
+			if (errstr)
+				errx(1, "chunk size is %s", errstr);
+			break;
+		case 'l':
+			linelen = strtonum(optarg, 0, BUFSIZE / 4, &errstr);
+			if (errstr)
+				errx(1, "line length is %s", errstr);
+			break;
+		case 's':
+			total = strtonum(optarg, 1, 65536, &errstr);
+			if (errstr)
+				errx(1, "size is %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	if (argc)
+		usage();
+
+	/* some whole number of lines, about a megabyte */
+	n = (1024 * 1024) / (linelen + 2) + 1;
+	datalen = n * (linelen + 2);
+	if ((data = malloc(datalen)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < n; i++) {
+		memset(data + i * (linelen + 2), 'x', linelen);
+		memcpy(data + i * (linelen + 2) + linelen, "\r\n", 2);
+	}
+
+	if (iobuf_init(&io, BUFSIZE, BUFSIZE) == -1)
+		err(1, "iobuf_init");
+
+	nlines = 0;
+	bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (bytes < total * 1024 * 1024) {
+		for (off = 0; off < datalen; off += n) {
+			n = datalen - off < chunk ? datalen - off : chunk;
+			feed(&io, data + off, n);
+			for (;;) {
+				if (bytewise)
+					line = getline_bytewise(&io, &len);
+				else
+					line = iobuf_getline(&io, &len);
+				if (line == NULL)
+					break;
+				nlines++;
+			}
+			iobuf_normalize(&io);
+		}
+		bytes += datalen;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%s: line %zu, chunk %zu: %zu lines, %zu MB in %.3fs, "
+	    "%.1f MB/s\n", bytewise ? "bytewise" : "iobuf_getline",
+	    linelen, chunk, nlines, bytes / (1024 * 1024), dt,
+	    bytes / (1024 * 1024) / dt);
+
+	iobuf_clear(&io);
+	free(data);
+
+	return (0);
+}
@@ -0,0 +1,39 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* lka_expand_format() and lka_format_run() are static, reach them from
+ * inside lka_session.c */
+
+#include "lka_session.c"
+
+size_t	bench_expand_format(char *, size_t, const struct envelope *,
+    const struct userinfo *);
+size_t	bench_format_run(const struct expand_format *, char *, size_t,
+    const struct envelope *, const struct userinfo *);
+
+size_t
+bench_expand_format(char *buf, size_t len, const struct envelope *ep,
+    const struct userinfo *ui)
+{
+	return (lka_expand_format(buf, len, ep, ui));
+}
+
+size_t
+bench_format_run(const struct expand_format *f, char *buf, size_t len,
+    const struct envelope *ep, const struct userinfo *ui)
+{
+	return (lka_format_run(f, buf, len, ep, ui));
+}
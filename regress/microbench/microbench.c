@@ -0,0 +1,982 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Time the hot functions of the daemon one at a time, built from the
+ * smtpd sources, and report ns/op and allocations/op for each.  The
+ * Makefile renames the allocator calls of every file to the counting
+ * wrappers below.  Benchmarks whose name starts with one of the given
+ * arguments are run, all of them otherwise.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/* the real allocator, under the names the Makefile took away */
+#undef malloc
+#undef calloc
+#undef realloc
+#undef reallocarray
+#undef strdup
+void	*malloc(size_t);
+void	*calloc(size_t, size_t);
+void	*realloc(void *, size_t);
+void	*reallocarray(void *, size_t, size_t);
+char	*strdup(const char *);
+
+void	*bench_malloc(size_t);
+void	*bench_calloc(size_t, size_t);
+void	*bench_realloc(void *, size_t);
+void	*bench_reallocarray(void *, size_t, size_t);
+char	*bench_strdup(const char *);
+
+size_t	bench_expand_format(char *, size_t, const struct envelope *,
+    const struct userinfo *);
+size_t	bench_format_run(const struct expand_format *, char *, size_t,
+    const struct envelope *, const struct userinfo *);
+
+#define	TABLE_KEYS	1000
+#define	EXPAND_NODES	64
+#define	EXPAND_LARGE	4096
+#define	CONTAINER_KEYS	10000
+#define	RUNQ_JOBS	50000
+#define	FUZZ_LINE	128
+
+struct bench {
+	const char	*name;
+	void		(*setup)(void);
+	void		(*run)(size_t);
+};
+
+static void	envelope_fill(struct envelope *);
+static void	setup_envelope(void);
+static void	run_envelope_dump(size_t);
+static void	run_envelope_load(size_t);
+static void	run_envelope_dump_binary(size_t);
+static void	run_envelope_load_binary(size_t);
+static void	setup_expand(void);
+static void	run_expand_insert(size_t);
+static void	setup_expand_large(void);
+static void	run_expand_insert_large(size_t);
+static void	run_expand_line(size_t);
+static void	setup_format(void);
+static void	run_format(size_t);
+static void	setup_format_compiled(void);
+static void	run_format_compiled(size_t);
+static void	run_netaddr_match(size_t);
+static void	run_netaddr_match6(size_t);
+static void	setup_static(void);
+static void	run_static_alias(size_t);
+static void	run_static_domain(size_t);
+static void	run_static_netaddr(size_t);
+static void	setup_getline(void);
+static void	setup_containers(void);
+static void	run_tree_lookup(size_t);
+static void	run_tree_churn(size_t);
+static void	run_dict_lookup(size_t);
+static void	run_dict_churn(size_t);
+static void	run_getline(size_t);
+static void	setup_runq(void);
+static void	run_runq_reschedule(size_t);
+static void	run_runq_pending(size_t);
+static void	runq_job(struct runq *, void *);
+static void	run_command_mail(size_t);
+static void	run_command_rcpt(size_t);
+static void	run_command_unknown(size_t);
+static int	command_reference(char *, char **);
+static void	run_command_fuzz(size_t);
+static void	usage(void);
+
+struct smtpd	*env;
+struct mproc	*p_parent;
+struct mproc	*p_queue;
+
+static size_t	allocs;
+
+static struct bench benches[] = {
+	{ "envelope_dump_buffer",	setup_envelope,	run_envelope_dump },
+	{ "envelope_load_buffer",	setup_envelope,	run_envelope_load },
+	{ "envelope_dump_binary",	setup_envelope,
+	    run_envelope_dump_binary },
+	{ "envelope_load_buffer/binary", setup_envelope,
+	    run_envelope_load_binary },
+	{ "expand_insert",		setup_expand,	run_expand_insert },
+	{ "expand_insert/large",	setup_expand_large,
+	    run_expand_insert_large },
+	{ "expand_line",		setup_expand,	run_expand_line },
+	{ "lka_expand_format",		setup_format,	run_format },
+	{ "lka_expand_format/compiled",	setup_format_compiled,
+	    run_format_compiled },
+	{ "table_netaddr_match",	NULL,		run_netaddr_match },
+	{ "table_netaddr_match/inet6",	NULL,		run_netaddr_match6 },
+	{ "table_static_lookup/alias",	setup_static,	run_static_alias },
+	{ "table_static_lookup/domain",	setup_static,	run_static_domain },
+	{ "table_static_lookup/netaddr", setup_static,	run_static_netaddr },
+	{ "iobuf_getline",		setup_getline,	run_getline },
+	{ "tree_lookup/session",	setup_containers, run_tree_lookup },
+	{ "tree_churn/evpid",		setup_containers, run_tree_churn },
+	{ "dict_lookup/stat",		setup_containers, run_dict_lookup },
+	{ "dict_churn/stat",		setup_containers, run_dict_churn },
+	{ "runq_reschedule/route",	setup_runq,	run_runq_reschedule },
+	{ "runq_pending/route",		setup_runq,	run_runq_pending },
+	{ "smtp_command_parse/mail",	NULL,		run_command_mail },
+	{ "smtp_command_parse/rcpt",	NULL,		run_command_rcpt },
+	{ "smtp_command_parse/unknown",	NULL,		run_command_unknown },
+	{ "smtp_command_parse/fuzz",	NULL,		run_command_fuzz },
+};
+
+static struct envelope	 evp;
+static char		 evpbuf[8192];
+static size_t		 evplen;
+static char		 evpbin[8192];
+static size_t		 evpbinlen;
+
+static struct expand	 expand;
+static struct expandnode nodes[EXPAND_NODES];
+static struct expandnode *largenodes;
+static const char	*expandline = "gilles, eric@example.org, "
+    "/var/mail/shared, \"|/usr/local/bin/procmail -d %{user.username}\", "
+    ":include:/etc/mail/list, charles";
+
+static struct userinfo	 userinfo;
+static const char	*format = "/var/mail/%{user.username}/%{rcpt.domain}/"
+    "%{rcpt.user:lowercase}-%{sender.domain[0:3]}";
+
+static struct expand_format *compiled;
+
+static struct table	*aliases;
+static struct table	*domains;
+static struct table	*networks;
+
+static struct iobuf	 iobuf;
+
+static uint64_t		 ids[CONTAINER_KEYS];
+static char		*keys[CONTAINER_KEYS];
+static struct tree	 sessions;
+static struct tree	 evpids;
+static uint64_t		 evpid_next;
+static struct dict	 stats;
+static char		*lines;
+static size_t		 lineslen;
+
+static struct runq	*runq;
+static char		 routes[RUNQ_JOBS];
+
+static const char	*mailline = "MAIL FROM:<eric@example.org> "
+    "BODY=8BITMIME SIZE=4096";
+static const char	*rcptline = "RCPT TO:<gilles+hackers@example.org> "
+    "NOTIFY=SUCCESS,FAILURE";
+static const char	*unknownline = "XCLIENT ADDR=192.168.17.42";
+static const char	*fuzzlines[] = {
+	"HELO mx.example.org",
+	"EHLO [192.168.17.42]",
+	"MAIL FROM:<@relay.example.org:eric@example.org> RET=HDRS",
+	"MAIL FROM:<>",
+	"RCPT TO:<postmaster>",
+	"RCPT TO: <gilles@example.org> ORCPT=rfc822;gilles@example.org",
+	"BDAT 4096 LAST",
+	"AUTH PLAIN dGVzdAB0ZXN0AHRlc3Q=",
+	"STARTTLS",
+	"DATA",
+	"RSET",
+	"NOOP",
+	"HELP",
+	"WIZ",
+	"QUIT",
+};
+
+int
+main(int argc, char **argv)
+{
+	struct bench	*b;
+	struct timespec	 t0, t1;
+	const char	*errstr;
+	size_t		 i, n, a;
+	double		 dt;
+	int		 ch, j, match;
+
+	n = 1000000;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtonum(optarg, 1, 1000000000, &errstr);
+			if (errstr)
+				errx(1, "iterations is %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	log_init(1);
+	log_verbose(0);
+	env = xcalloc(1, sizeof *env, "main");
+	env->sc_tables_dict = xcalloc(1, sizeof *env->sc_tables_dict, "main");
+	dict_init(env->sc_tables_dict);
+	strlcpy(env->sc_hostname, "mx.example.org", sizeof env->sc_hostname);
+
+	for (i = 0; i < nitems(benches); i++) {
+		b = &benches[i];
+		match = (argc == 0);
+		for (j = 0; j < argc; j++)
+			if (!strncmp(b->name, argv[j], strlen(argv[j])))
+				match = 1;
+		if (!match)
+			continue;
+
+		if (b->setup)
+			b->setup();
+		/* once untimed, so that lazy indexes are built */
+		b->run(1);
+
+		a = allocs;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		b->run(n);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		a = allocs - a;
+
+		dt = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+		printf("%-32s %10zu ops %10.1f ns/op %8.2f allocs/op\n",
+		    b->name, n, dt / n, (double)a / n);
+	}
+
+	return (0);
+}
+
+static void
+envelope_fill(struct envelope *ep)
+{
+	struct sockaddr_in	*sin;
+
+	memset(ep, 0, sizeof *ep);
+	ep->version = SMTPD_ENVELOPE_VERSION;
+	ep->id = 0x7f3e2a1c00000001ULL;
+	ep->type = D_MTA;
+	strlcpy(ep->tag, "submission", sizeof ep->tag);
+	strlcpy(ep->smtpname, "mx.example.org", sizeof ep->smtpname);
+	strlcpy(ep->helo, "client.example.net", sizeof ep->helo);
+	strlcpy(ep->hostname, "client.example.net", sizeof ep->hostname);
+	strlcpy(ep->errorline, "421 4.7.0 Try again later",
+	    sizeof ep->errorline);
+
+	sin = (struct sockaddr_in *)&ep->ss;
+	sin->sin_len = sizeof *sin;
+	sin->sin_family = AF_INET;
+	inet_pton(AF_INET, "192.0.2.42", &sin->sin_addr);
+
+	strlcpy(ep->sender.user, "gilles", sizeof ep->sender.user);
+	strlcpy(ep->sender.domain, "example.net", sizeof ep->sender.domain);
+	strlcpy(ep->rcpt.user, "Eric.Faurot", sizeof ep->rcpt.user);
+	strlcpy(ep->rcpt.domain, "example.org", sizeof ep->rcpt.domain);
+	ep->dest = ep->rcpt;
+	strlcpy(ep->dsn_envid, "QQ314159", sizeof ep->dsn_envid);
+
+	strlcpy(ep->agent.mta.relay.hostname, "relay.example.org",
+	    sizeof ep->agent.mta.relay.hostname);
+	ep->agent.mta.relay.port = 25;
+
+	ep->creation = 1400000000;
+	ep->expire = 4 * 24 * 3600;
+	ep->lasttry = 1400000600;
+	ep->retry = 2;
+}
+
+static void
+setup_envelope(void)
+{
+	envelope_fill(&evp);
+	if ((evplen = envelope_dump_buffer(&evp, evpbuf, sizeof evpbuf)) == 0)
+		errx(1, "envelope_dump_buffer");
+	if ((evpbinlen = envelope_dump_binary(&evp, evpbin, sizeof evpbin)) == 0)
+		errx(1, "envelope_dump_binary");
+}
+
+static void
+run_envelope_dump(size_t n)
+{
+	while (n--)
+		if (envelope_dump_buffer(&evp, evpbuf, sizeof evpbuf) == 0)
+			errx(1, "envelope_dump_buffer");
+}
+
+static void
+run_envelope_load(size_t n)
+{
+	struct envelope	ep;
+
+	while (n--)
+		if (! envelope_load_buffer(&ep, evpbuf, evplen))
+			errx(1, "envelope_load_buffer");
+}
+
+static void
+run_envelope_dump_binary(size_t n)
+{
+	while (n--)
+		if (envelope_dump_binary(&evp, evpbin, sizeof evpbin) == 0)
+			errx(1, "envelope_dump_binary");
+}
+
+static void
+run_envelope_load_binary(size_t n)
+{
+	struct envelope	ep;
+
+	while (n--)
+		if (! envelope_load_buffer(&ep, evpbin, evpbinlen))
+			errx(1, "envelope_load_buffer");
+}
+
+static void
+setup_expand(void)
+{
+	size_t	i;
+
+	memset(&expand, 0, sizeof expand);
+	RB_INIT(&expand.tree);
+	for (i = 0; i < EXPAND_NODES; i++) {
+		nodes[i].type = EXPAND_USERNAME;
+		snprintf(nodes[i].u.user, sizeof nodes[i].u.user, "user%zu", i);
+	}
+}
+
+/* fill the tree with distinct users, clear it once full */
+static void
+run_expand_insert(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++) {
+		expand_insert(&expand, &nodes[i % EXPAND_NODES]);
+		if (i % EXPAND_NODES == EXPAND_NODES - 1)
+			expand_clear(&expand);
+	}
+	expand_clear(&expand);
+}
+
+static void
+setup_expand_large(void)
+{
+	size_t	i;
+
+	memset(&expand, 0, sizeof expand);
+	RB_INIT(&expand.tree);
+	if (largenodes)
+		return;
+	largenodes = xcalloc(EXPAND_LARGE, sizeof *largenodes,
+	    "setup_expand_large");
+	for (i = 0; i < EXPAND_LARGE; i++) {
+		largenodes[i].type = EXPAND_ADDRESS;
+		snprintf(largenodes[i].u.mailaddr.user,
+		    sizeof largenodes[i].u.mailaddr.user, "member%zu", i);
+		strlcpy(largenodes[i].u.mailaddr.domain, "lists.example.org",
+		    sizeof largenodes[i].u.mailaddr.domain);
+	}
+}
+
+/* a large alias list, every member offered twice */
+static void
+run_expand_insert_large(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++) {
+		expand_insert(&expand, &largenodes[(i / 2) % EXPAND_LARGE]);
+		if (i % (EXPAND_LARGE * 2) == EXPAND_LARGE * 2 - 1)
+			expand_clear(&expand);
+	}
+	expand_clear(&expand);
+}
+
+static void
+run_expand_line(size_t n)
+{
+	while (n--) {
+		if (! expand_line(&expand, expandline, 0))
+			errx(1, "expand_line");
+		expand_clear(&expand);
+	}
+}
+
+static void
+setup_format(void)
+{
+	envelope_fill(&evp);
+	strlcpy(userinfo.username, "eric", sizeof userinfo.username);
+	strlcpy(userinfo.directory, "/home/eric", sizeof userinfo.directory);
+}
+
+static void
+run_format(size_t n)
+{
+	char	buf[EXPAND_BUFFER];
+
+	while (n--) {
+		strlcpy(buf, format, sizeof buf);
+		if (bench_expand_format(buf, sizeof buf, &evp, &userinfo) == 0)
+			errx(1, "lka_expand_format");
+	}
+}
+
+static void
+setup_format_compiled(void)
+{
+	setup_format();
+	if ((compiled = lka_format_compile(format)) == NULL)
+		errx(1, "lka_format_compile");
+}
+
+static void
+run_format_compiled(size_t n)
+{
+	char	buf[EXPAND_BUFFER];
+
+	while (n--)
+		if (bench_format_run(compiled, buf, sizeof buf, &evp,
+		    &userinfo) == 0)
+			errx(1, "lka_format_run");
+}
+
+static void
+run_netaddr_match(size_t n)
+{
+	while (n--)
+		if (! table_netaddr_match("192.168.17.42", "192.168.0.0/16"))
+			errx(1, "table_netaddr_match");
+}
+
+static void
+run_netaddr_match6(size_t n)
+{
+	while (n--)
+		if (! table_netaddr_match("2001:db8:17::42", "2001:db8::/32"))
+			errx(1, "table_netaddr_match");
+}
+
+static void
+setup_static(void)
+{
+	char	key[64], val[128];
+	size_t	i;
+
+	if (aliases)
+		return;
+
+	aliases = table_create("static", "aliases", NULL, NULL);
+	domains = table_create("static", "domains", NULL, NULL);
+	networks = table_create("static", "networks", NULL, NULL);
+	for (i = 0; i < TABLE_KEYS; i++) {
+		snprintf(key, sizeof key, "user%zu", i);
+		snprintf(val, sizeof val, "user%zu@example.org, archive", i);
+		table_add(aliases, key, val);
+		snprintf(key, sizeof key, "domain%zu.example.org", i);
+		table_add(domains, key, NULL);
+		snprintf(key, sizeof key, "*.wild%zu.example.net", i);
+		table_add(domains, key, NULL);
+		snprintf(key, sizeof key, "10.%zu.%zu.0/24", i / 256, i % 256);
+		table_add(networks, key, NULL);
+	}
+	if (! table_open(aliases) || ! table_open(domains) ||
+	    ! table_open(networks))
+		errx(1, "table_open");
+}
+
+static void
+run_static_alias(size_t n)
+{
+	union lookup	lk;
+	char		key[64];
+	size_t		i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(key, sizeof key, "user%zu", i % TABLE_KEYS);
+		if (aliases->t_backend->lookup(aliases->t_handle, key, K_ALIAS,
+		    &lk) != 1)
+			errx(1, "table_static_lookup");
+		expand_free(lk.expand);
+	}
+}
+
+static void
+run_static_domain(size_t n)
+{
+	char	key[64];
+	size_t	i;
+
+	for (i = 0; i < n; i++) {
+		if (i & 1)
+			snprintf(key, sizeof key, "mx.wild%zu.example.net",
+			    i % TABLE_KEYS);
+		else
+			snprintf(key, sizeof key, "domain%zu.example.org",
+			    i % TABLE_KEYS);
+		if (domains->t_backend->lookup(domains->t_handle, key,
+		    K_DOMAIN, NULL) != 1)
+			errx(1, "table_static_lookup");
+	}
+}
+
+static void
+run_static_netaddr(size_t n)
+{
+	char	key[64];
+	size_t	i, k;
+
+	for (i = 0; i < n; i++) {
+		k = i % TABLE_KEYS;
+		snprintf(key, sizeof key, "10.%zu.%zu.%zu", k / 256, k % 256,
+		    i % 250 + 1);
+		if (networks->t_backend->lookup(networks->t_handle, key,
+		    K_NETADDR, NULL) != 1)
+			errx(1, "table_static_lookup");
+	}
+}
+
+/*
+ * Random ids as for sessions, sequential ones as for the envelopes of the
+ * scheduler, and stat-like names for the string keys.
+ */
+static void
+setup_containers(void)
+{
+	char	key[64];
+	size_t	i;
+
+	if (keys[0])
+		return;
+
+	tree_init(&sessions);
+	tree_init(&evpids);
+	dict_init(&stats);
+	for (i = 0; i < CONTAINER_KEYS; i++) {
+		ids[i] = (uint64_t)arc4random() << 32 | arc4random();
+		tree_xset(&sessions, ids[i], &ids[i]);
+		tree_xset(&evpids, ++evpid_next, &ids[i]);
+		snprintf(key, sizeof key, "mta.relay.%zu.connector.%zu",
+		    i / 100, i % 100);
+		keys[i] = xstrdup(key, "setup_containers");
+		dict_xset(&stats, keys[i], keys[i]);
+	}
+}
+
+static void
+run_tree_lookup(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (tree_get(&sessions, ids[i % CONTAINER_KEYS]) == NULL)
+			errx(1, "tree_get");
+}
+
+/* the oldest envelope leaves as a new one comes in */
+static void
+run_tree_churn(size_t n)
+{
+	while (n--) {
+		tree_xpop(&evpids, evpid_next - CONTAINER_KEYS + 1);
+		tree_xset(&evpids, ++evpid_next, ids);
+	}
+}
+
+static void
+run_dict_lookup(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (dict_get(&stats, keys[i % CONTAINER_KEYS]) == NULL)
+			errx(1, "dict_get");
+}
+
+static void
+run_dict_churn(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++) {
+		dict_xpop(&stats, keys[i % CONTAINER_KEYS]);
+		dict_xset(&stats, keys[i % CONTAINER_KEYS], keys);
+	}
+}
+
+/*
+ * A runq holding the timeouts of many routes, as the mta one does, the
+ * jobs are never due during the run.
+ */
+static void
+setup_runq(void)
+{
+	time_t	now;
+	size_t	i;
+
+	if (runq)
+		return;
+
+	event_init();
+	if (! runq_init(&runq, runq_job))
+		errx(1, "runq_init");
+	now = time(NULL);
+	for (i = 0; i < RUNQ_JOBS; i++)
+		if (! runq_schedule(runq, now + 3600 + arc4random_uniform(3600),
+		    NULL, &routes[i]))
+			errx(1, "runq_schedule");
+}
+
+static void
+runq_job(struct runq *rq, void *arg)
+{
+	errx(1, "runq_job");
+}
+
+/* a route timeout is pushed back as the route gets used */
+static void
+run_runq_reschedule(size_t n)
+{
+	time_t	now;
+	size_t	i;
+
+	now = time(NULL);
+	for (i = 0; i < n; i++) {
+		if (! runq_cancel(runq, NULL, &routes[i % RUNQ_JOBS]))
+			errx(1, "runq_cancel");
+		if (! runq_schedule(runq, now + 3600 + i % 3600, NULL,
+		    &routes[i % RUNQ_JOBS]))
+			errx(1, "runq_schedule");
+	}
+}
+
+static void
+run_runq_pending(size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (! runq_pending(runq, NULL, &routes[i % RUNQ_JOBS], NULL))
+			errx(1, "runq_pending");
+}
+
+static void
+run_command_mail(size_t n)
+{
+	struct mailaddr	 maddr;
+	char		 line[SMTPD_MAXLINESIZE], *args;
+
+	while (n--) {
+		strlcpy(line, mailline, sizeof line);
+		if (smtp_command_parse(line, &args) != CMD_MAIL_FROM ||
+		    smtp_mailaddr(&maddr, args, 1, &args, "example.org") == 0)
+			errx(1, "smtp_command_parse");
+	}
+}
+
+static void
+run_command_rcpt(size_t n)
+{
+	struct mailaddr	 maddr;
+	char		 line[SMTPD_MAXLINESIZE], *args;
+
+	while (n--) {
+		strlcpy(line, rcptline, sizeof line);
+		if (smtp_command_parse(line, &args) != CMD_RCPT_TO ||
+		    smtp_mailaddr(&maddr, args, 0, &args, "example.org") == 0)
+			errx(1, "smtp_command_parse");
+	}
+}
+
+static void
+run_command_unknown(size_t n)
+{
+	char	line[SMTPD_MAXLINESIZE], *args;
+
+	while (n--) {
+		strlcpy(line, unknownline, sizeof line);
+		if (smtp_command_parse(line, &args) != -1)
+			errx(1, "smtp_command_parse");
+	}
+}
+
+/* the lookup smtp_command_parse() replaced, to compare against it */
+static int
+command_reference(char *line, char **args)
+{
+	static const char *verbs[] = {
+		"HELO", "EHLO", "STARTTLS", "AUTH", "MAIL FROM", "RCPT TO",
+		"DATA", "BDAT", "RSET", "QUIT", "HELP", "WIZ", "NOOP",
+	};
+	size_t	i;
+
+	if (strncasecmp("mail from:", line, 10) == 0 ||
+	    strncasecmp("rcpt to:", line, 8) == 0)
+		*args = strchr(line, ':');
+	else
+		*args = strchr(line, ' ');
+
+	if (*args) {
+		*(*args)++ = '\0';
+		while (isspace((unsigned char)**args))
+			(*args)++;
+	}
+
+	for (i = 0; i < nitems(verbs); i++)
+		if (!strcasecmp(line, verbs[i]))
+			return (i);
+	return (-1);
+}
+
+/*
+ * Mutate known commands at random and check that the parser agrees
+ * with the former lookup, and that the address parser keeps within the
+ * line.  Build with -fsanitize=address to catch what it reads past.
+ */
+static void
+run_command_fuzz(size_t n)
+{
+	static const char	 bytes[] = "<>@:,. \t\"aAlLmMrRtToO0+=%";
+	struct mailaddr		 maddr;
+	char			 line[FUZZ_LINE], ref[FUZZ_LINE];
+	char			*args, *refargs;
+	size_t			 len, i, m;
+	int			 cmd, refcmd;
+
+	while (n--) {
+		len = strlcpy(line, fuzzlines[arc4random_uniform(
+		    nitems(fuzzlines))], sizeof line);
+		for (m = arc4random_uniform(4); m; m--) {
+			i = arc4random_uniform(len + 1);
+			switch (arc4random_uniform(3)) {
+			case 0:		/* change a byte */
+				if (i < len)
+					line[i] = bytes[arc4random_uniform(
+					    sizeof(bytes) - 1)];
+				break;
+			case 1:		/* cut the line */
+				line[i] = '\0';
+				len = i;
+				break;
+			default:	/* insert a byte */
+				if (len + 1 >= sizeof line)
+					break;
+				memmove(line + i + 1, line + i, len - i + 1);
+				line[i] = arc4random_uniform(256) ?
+				    bytes[arc4random_uniform(sizeof(bytes) - 1)] :
+				    (char)arc4random_uniform(256);
+				if (line[i] == '\0')
+					line[i] = ' ';
+				len++;
+				break;
+			}
+		}
+		memcpy(ref, line, sizeof ref);
+
+		cmd = smtp_command_parse(line, &args);
+		refcmd = command_reference(ref, &refargs);
+		if (cmd != refcmd)
+			errx(1, "fuzz: \"%s\": %d, expected %d", ref, cmd,
+			    refcmd);
+		if (cmd == -1)
+			continue;
+		if ((args == NULL) != (refargs == NULL) ||
+		    (args && args - line != refargs - ref))
+			errx(1, "fuzz: \"%s\": arguments differ", ref);
+
+		if (cmd != CMD_MAIL_FROM && cmd != CMD_RCPT_TO)
+			continue;
+		if (smtp_mailaddr(&maddr, args, cmd == CMD_MAIL_FROM, &args,
+		    "example.org") && (args < line || args > line + len))
+			errx(1, "fuzz: \"%s\": arguments out of line", ref);
+	}
+}
+
+/* a block of 80 byte lines, appended again each time it is consumed */
+static void
+setup_getline(void)
+{
+	size_t	i, nlines;
+
+	nlines = 512;
+	lineslen = nlines * 82;
+	lines = xmalloc(lineslen, "setup_getline");
+	for (i = 0; i < nlines; i++) {
+		memset(lines + i * 82, 'x', 80);
+		memcpy(lines + i * 82 + 80, "\r\n", 2);
+	}
+	if (iobuf.buf == NULL && iobuf_init(&iobuf, 65536, 65536) == -1)
+		err(1, "iobuf_init");
+}
+
+static void
+run_getline(size_t n)
+{
+	size_t	len;
+
+	while (n) {
+		if (iobuf_getline(&iobuf, &len)) {
+			n--;
+			continue;
+		}
+		iobuf_normalize(&iobuf);
+		if (iobuf_left(&iobuf) < lineslen)
+			errx(1, "iobuf_getline: buffer full");
+		memcpy(iobuf.buf + iobuf.wpos, lines, lineslen);
+		iobuf.wpos += lineslen;
+	}
+}
+
+static void
+usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-n iterations] [benchmark ...]\n",
+	    __progname);
+	exit(1);
+}
+
+/* what the Makefile maps the allocator to */
+
+void *
+bench_malloc(size_t size)
+{
+	allocs++;
+	return (malloc(size));
+}
+
+void *
+bench_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return (calloc(nmemb, size));
+}
+
+void *
+bench_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return (realloc(ptr, size));
+}
+
+void *
+bench_reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	allocs++;
+	return (reallocarray(ptr, nmemb, size));
+}
+
+char *
+bench_strdup(const char *s)
+{
+	allocs++;
+	return (strdup(s));
+}
+
+/* stubs for what the sources pull from the rest of smtpd */
+
+struct table_backend	table_backend_db;
+struct table_backend	table_backend_cdb;
+struct table_backend	table_backend_getpwnam;
+struct table_backend	table_backend_proc;
+
+int
+aliases_get(struct expand *e, const char *username)
+{
+	return (0);
+}
+
+int
+aliases_virtual_get(struct expand *e, const struct mailaddr *maddr)
+{
+	return (0);
+}
+
+int
+forwards_get(int fd, struct expand *e)
+{
+	return (0);
+}
+
+struct rule *
+ruleset_match(const struct envelope *ep)
+{
+	return (NULL);
+}
+
+struct mproc *
+smtp_peer(uint64_t id)
+{
+	return (NULL);
+}
+
+void
+m_compose(struct mproc *p, uint32_t type, uint32_t peerid, pid_t pid, int fd,
+    void *data, size_t len)
+{
+}
+
+void
+m_create(struct mproc *p, uint32_t type, uint32_t peerid, pid_t pid, int fd)
+{
+}
+
+void
+m_add_int(struct mproc *p, int v)
+{
+}
+
+void
+m_add_string(struct mproc *p, const char *v)
+{
+}
+
+void
+m_add_id(struct mproc *p, uint64_t v)
+{
+}
+
+void
+m_add_envelope(struct mproc *p, const struct envelope *v)
+{
+}
+
+void
+m_close(struct mproc *p)
+{
+}
+
+void
+stat_increment(const char *key, size_t count)
+{
+}
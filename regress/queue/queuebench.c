@@ -0,0 +1,528 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Drive a queue backend through queue_backend.c the way the queue
+ * process does, and report the latency of each operation and the rate
+ * of fsyncs.  Messages are created, written, given their envelopes and
+ * committed, then delivered once more than -q of them are queued: each
+ * envelope is loaded, some tempfail and are updated and loaded again,
+ * the content is read back and the envelopes are deleted, which removes
+ * the message as in smtpd.  With -k, the last -q messages are left in the
+ * queue; the next run with -w walks them as smtpd does at startup, then
+ * deletes them.
+ *
+ * Like the queue process, this runs chrooted in the spool, so it must
+ * be run as root on a host where smtpd is not running.  The proc
+ * backend is whatever is installed as /usr/libexec/smtpd/backend-queue.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/* the Makefile renames fsync() everywhere to count the calls */
+#undef fsync
+int	fsync(int);
+int	bench_fsync(int);
+
+#define	BUCKETS		24
+
+enum op {
+	OP_MESSAGE_CREATE,
+	OP_MESSAGE_WRITE,
+	OP_MESSAGE_COMMIT,
+	OP_MESSAGE_FD_R,
+	OP_ENVELOPE_CREATE,
+	OP_ENVELOPE_LOAD,
+	OP_ENVELOPE_UPDATE,
+	OP_ENVELOPE_DELETE,
+	OP_ENVELOPE_WALK,
+	OP_COUNT
+};
+
+static struct opstat {
+	const char	*name;
+	size_t		 n;
+	uint64_t	 total;		/* in microseconds */
+	uint64_t	 max;
+	size_t		 hist[BUCKETS];	/* < 2^n us, the last is open */
+} ops[OP_COUNT] = {
+	{ "message_create" },
+	{ "message_write" },
+	{ "message_commit" },
+	{ "message_fd_r" },
+	{ "envelope_create" },
+	{ "envelope_load" },
+	{ "envelope_update" },
+	{ "envelope_delete" },
+	{ "envelope_walk" },
+};
+
+struct bmsg {
+	uint32_t	 msgid;
+	uint64_t	*evpids;
+};
+
+static void	op_start(void);
+static void	op_done(enum op);
+static void	envelope_fill(struct envelope *, uint32_t, int);
+static void	inject(struct bmsg *);
+static void	deliver(struct bmsg *);
+static void	walk(void);
+static void	report(double, size_t);
+static size_t	bucket_pct(struct opstat *, double);
+static void	usage(void);
+
+struct smtpd	*env;
+
+static struct timespec	 op_t0;
+static size_t		 fsyncs;
+
+static char		*body;
+static size_t		 bodylen = 4096;
+static int		 rcpts = 2;
+static int		 tempfail = 20;
+static int		 histograms;
+static int		 discard;
+
+int
+main(int argc, char **argv)
+{
+	struct passwd	*pw;
+	struct bmsg	*pending;
+	struct timespec	 t0, t1;
+	const char	*errstr, *backend, *algo;
+	size_t		 i, n, depth, head;
+	double		 dt;
+	int		 ch, dowalk, keep, verbose;
+
+	backend = "fs";
+	algo = NULL;
+	n = 10000;
+	depth = 1000;
+	dowalk = 0;
+	keep = 0;
+	verbose = 0;
+
+	env = xcalloc(1, sizeof *env, "main");
+
+	while ((ch = getopt(argc, argv, "Bb:c:egHkn:q:r:s:t:vw")) != -1) {
+		switch (ch) {
+		case 'B':
+			env->sc_queue_flags |= QUEUE_BINARY;
+			break;
+		case 'b':
+			backend = optarg;
+			break;
+		case 'c':
+			algo = optarg;
+			break;
+		case 'e':
+			env->sc_queue_flags |= QUEUE_ENCRYPTION;
+			break;
+		case 'g':
+			env->sc_queue_flags |= QUEUE_GROUPCOMMIT;
+			break;
+		case 'H':
+			histograms = 1;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'n':
+			n = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr)
+				errx(1, "messages is %s", errstr);
+			break;
+		case 'q':
+			depth = strtonum(optarg, 0, 10000000, &errstr);
+			if (errstr)
+				errx(1, "queue depth is %s", errstr);
+			break;
+		case 'r':
+			rcpts = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr)
+				errx(1, "recipients is %s", errstr);
+			break;
+		case 's':
+			bodylen = strtonum(optarg, 1, 64 * 1024 * 1024, &errstr);
+			if (errstr)
+				errx(1, "size is %s", errstr);
+			break;
+		case 't':
+			tempfail = strtonum(optarg, 0, 100, &errstr);
+			if (errstr)
+				errx(1, "tempfail rate is %s", errstr);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w':
+			dowalk = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	if (argc)
+		usage();
+
+	if (geteuid())
+		errx(1, "need root privileges");
+
+	log_init(1);
+	log_verbose(verbose ? TRACE_DEBUG | TRACE_QUEUE : 0);
+
+	if (algo) {
+		env->sc_queue_flags |= QUEUE_COMPRESSION;
+		if ((env->sc_comp = compress_backend_lookup(algo)) == NULL)
+			errx(1, "unsupported compression algorithm \"%s\"",
+			    algo);
+	}
+
+	/* what smtpd does in the parent, then in the queue process */
+	discard = strcmp(backend, "null") == 0;
+	if (! queue_init(backend, 1))
+		errx(1, "could not initialize queue backend \"%s\"", backend);
+
+	if ((pw = getpwnam(SMTPD_QUEUE_USER)) == NULL)
+		if ((pw = getpwnam(SMTPD_USER)) == NULL)
+			errx(1, "unknown user " SMTPD_USER);
+	if (chroot(PATH_SPOOL) == -1)
+		err(1, "chroot");
+	if (chdir("/") == -1)
+		err(1, "chdir");
+	if ((env->sc_queue_flags & QUEUE_ENCRYPTION) &&
+	    ! crypto_setup("queuebench-not-a-secret-key-0123", 32))
+		errx(1, "crypto_setup");
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
+		err(1, "cannot drop privileges");
+
+	/* text that compresses about as well as mail does */
+	body = xmalloc(bodylen, "main");
+	for (i = 0; i < bodylen; i++)
+		body[i] = (i % 78 == 77) ? '\n' :
+		    "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJ0123456789"[
+		    arc4random_uniform(47)];
+
+	pending = xcalloc(depth + 1, sizeof *pending, "main");
+	for (i = 0; i < depth + 1; i++)
+		pending[i].evpids = xcalloc(rcpts, sizeof(uint64_t), "main");
+
+	printf("queuebench: %s backend, %zu messages of %zu bytes to %d "
+	    "recipients, %d%% tempfail, queue depth %zu\n", backend, n,
+	    bodylen, rcpts, tempfail, depth);
+	printf("queuebench: compression %s, encryption %s, group commit %s, "
+	    "%s envelopes\n", algo ? algo : "off",
+	    (env->sc_queue_flags & QUEUE_ENCRYPTION) ? "on" : "off",
+	    (env->sc_queue_flags & QUEUE_GROUPCOMMIT) ? "on" : "off",
+	    (env->sc_queue_flags & QUEUE_BINARY) ? "binary" : "ascii");
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	fflush(stdout);
+	if (dowalk)
+		walk();
+	for (i = 0, head = 0; i < n; i++) {
+		inject(&pending[i % (depth + 1)]);
+		if (i - head == depth) {
+			deliver(&pending[head % (depth + 1)]);
+			head++;
+		}
+	}
+	for (; ! keep && head < n; head++)
+		deliver(&pending[head % (depth + 1)]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("queuebench: %zu messages in %.3fs, %.1f msgs/s%s\n", n, dt,
+	    n / dt, keep ? ", the last ones kept" : "");
+	report(dt, n);
+
+	return (0);
+}
+
+static void
+op_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &op_t0);
+}
+
+static void
+op_done(enum op op)
+{
+	struct opstat	*o = &ops[op];
+	struct timespec	 t1;
+	uint64_t	 us;
+	size_t		 b;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	us = (uint64_t)(t1.tv_sec - op_t0.tv_sec) * 1000000 +
+	    (t1.tv_nsec - op_t0.tv_nsec) / 1000;
+
+	for (b = 0; b < BUCKETS - 1 && us >> b; b++)
+		;
+	o->hist[b]++;
+	o->n++;
+	o->total += us;
+	if (us > o->max)
+		o->max = us;
+}
+
+static void
+envelope_fill(struct envelope *ep, uint32_t msgid, int rcpt)
+{
+	memset(ep, 0, sizeof *ep);
+	ep->version = SMTPD_ENVELOPE_VERSION;
+	ep->id = msgid_to_evpid(msgid);
+	ep->type = D_MTA;
+	strlcpy(ep->smtpname, "mx.example.org", sizeof ep->smtpname);
+	strlcpy(ep->helo, "client.example.net", sizeof ep->helo);
+	strlcpy(ep->hostname, "client.example.net", sizeof ep->hostname);
+	strlcpy(ep->sender.user, "sender", sizeof ep->sender.user);
+	strlcpy(ep->sender.domain, "example.net", sizeof ep->sender.domain);
+	snprintf(ep->rcpt.user, sizeof ep->rcpt.user, "rcpt%d", rcpt);
+	strlcpy(ep->rcpt.domain, "example.org", sizeof ep->rcpt.domain);
+	ep->dest = ep->rcpt;
+	ep->expire = 4 * 24 * 3600;
+}
+
+static void
+inject(struct bmsg *m)
+{
+	struct envelope	 ep;
+	size_t		 off;
+	ssize_t		 w;
+	int		 fd, i;
+
+	op_start();
+	if (! queue_message_create(&m->msgid))
+		errx(1, "queue_message_create");
+	op_done(OP_MESSAGE_CREATE);
+
+	op_start();
+	if ((fd = queue_message_fd_rw(m->msgid)) == -1)
+		err(1, "queue_message_fd_rw");
+	for (off = 0; off < bodylen; off += w)
+		if ((w = write(fd, body + off, bodylen - off)) == -1)
+			err(1, "write");
+	close(fd);
+	op_done(OP_MESSAGE_WRITE);
+
+	for (i = 0; i < rcpts; i++) {
+		envelope_fill(&ep, m->msgid, i);
+		op_start();
+		if (! queue_envelope_create(&ep))
+			errx(1, "queue_envelope_create");
+		op_done(OP_ENVELOPE_CREATE);
+		m->evpids[i] = ep.id;
+	}
+
+	op_start();
+	if (! queue_message_commit(m->msgid))
+		errx(1, "queue_message_commit");
+	op_done(OP_MESSAGE_COMMIT);
+}
+
+static void
+deliver(struct bmsg *m)
+{
+	struct envelope	 ep;
+	char		 buf[8192];
+	ssize_t		 r;
+	int		 fd, i;
+
+	/* the null backend keeps nothing to load or read back */
+	if (discard)
+		goto remove;
+
+	for (i = 0; i < rcpts; i++) {
+		op_start();
+		if (! queue_envelope_load(m->evpids[i], &ep))
+			errx(1, "queue_envelope_load");
+		op_done(OP_ENVELOPE_LOAD);
+
+		if ((int)arc4random_uniform(100) >= tempfail)
+			continue;
+
+		/* tempfail, then the next attempt */
+		ep.retry++;
+		ep.lasttry = time(NULL);
+		strlcpy(ep.errorline, "421 4.7.0 Try again later",
+		    sizeof ep.errorline);
+		op_start();
+		if (! queue_envelope_update(&ep))
+			errx(1, "queue_envelope_update");
+		op_done(OP_ENVELOPE_UPDATE);
+
+		op_start();
+		if (! queue_envelope_load(m->evpids[i], &ep))
+			errx(1, "queue_envelope_load");
+		op_done(OP_ENVELOPE_LOAD);
+	}
+
+	op_start();
+	if ((fd = queue_message_fd_r(m->msgid)) == -1)
+		errx(1, "queue_message_fd_r");
+	while ((r = read(fd, buf, sizeof buf)) > 0)
+		;
+	if (r == -1)
+		err(1, "read");
+	close(fd);
+	op_done(OP_MESSAGE_FD_R);
+
+remove:
+	for (i = 0; i < rcpts; i++) {
+		op_start();
+		if (! queue_envelope_delete(m->evpids[i]))
+			errx(1, "queue_envelope_delete");
+		op_done(OP_ENVELOPE_DELETE);
+	}
+}
+
+/* only what was in the queue before we started is walked */
+static void
+walk(void)
+{
+	struct envelope	 ep;
+	uint64_t	*evpids;
+	size_t		 i, n, sz;
+	int		 r;
+
+	evpids = NULL;
+	n = sz = 0;
+	for (;;) {
+		op_start();
+		r = queue_envelope_walk(&ep);
+		op_done(OP_ENVELOPE_WALK);
+		if (r == -1)
+			break;
+		if (r == 0)
+			continue;
+		if (n == sz) {
+			sz = sz ? sz * 2 : 1024;
+			evpids = reallocarray(evpids, sz, sizeof *evpids);
+			if (evpids == NULL)
+				err(1, "reallocarray");
+		}
+		evpids[n++] = ep.id;
+	}
+	printf("queuebench: walked %zu envelopes\n", n);
+
+	for (i = 0; i < n; i++) {
+		op_start();
+		if (! queue_envelope_delete(evpids[i]))
+			errx(1, "queue_envelope_delete");
+		op_done(OP_ENVELOPE_DELETE);
+	}
+	free(evpids);
+}
+
+/* the upper bound of the bucket holding the given percentile */
+static size_t
+bucket_pct(struct opstat *o, double pct)
+{
+	size_t	b, sum;
+
+	for (b = 0, sum = 0; b < BUCKETS - 1; b++) {
+		sum += o->hist[b];
+		if (sum >= o->n * pct / 100)
+			break;
+	}
+	return ((size_t)1 << b);
+}
+
+static void
+report(double dt, size_t n)
+{
+	struct opstat	*o;
+	size_t		 i, b;
+
+	printf("queuebench: %zu fsyncs, %.1f fsyncs/s, %.2f fsyncs/msg\n",
+	    fsyncs, fsyncs / dt, (double)fsyncs / n);
+
+	for (i = 0; i < OP_COUNT; i++) {
+		o = &ops[i];
+		if (o->n == 0)
+			continue;
+		printf("%-16s %9zu ops, avg %9.1fus, p50 <%zuus, p90 <%zuus, "
+		    "p99 <%zuus, max %lluus\n", o->name, o->n,
+		    (double)o->total / o->n, bucket_pct(o, 50),
+		    bucket_pct(o, 90), bucket_pct(o, 99),
+		    (unsigned long long)o->max);
+		if (! histograms)
+			continue;
+		for (b = 0; b < BUCKETS; b++) {
+			if (o->hist[b] == 0)
+				continue;
+			if (b == BUCKETS - 1)
+				printf("\t    >=%8zuus %9zu\n", (size_t)1 << (b - 1),
+				    o->hist[b]);
+			else
+				printf("\t    < %8zuus %9zu\n", (size_t)1 << b,
+				    o->hist[b]);
+		}
+	}
+}
+
+static void
+usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-BegHkvw] [-b backend] [-c algorithm] "
+	    "[-n messages] [-q depth]\n"
+	    "                  [-r recipients] [-s size] [-t tempfail%%]\n",
+	    __progname);
+	exit(1);
+}
+
+int
+bench_fsync(int fd)
+{
+	fsyncs++;
+	return (fsync(fd));
+}
+
+/* stubs for what the queue code pulls from the rest of smtpd */
+
+void
+stat_increment(const char *key, size_t count)
+{
+}
+
+void
+stat_decrement(const char *key, size_t count)
+{
+}
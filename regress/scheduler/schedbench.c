@@ -0,0 +1,578 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2014 Gilles Chehade <gilles@poolp.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Drive the ramqueue scheduler backend directly, under a fake clock.
+ *
+ * The synthetic workload loads N envelopes spread over the last few days
+ * with a few retries behind them, then pulls batches the way the
+ * scheduler does: most envelopes are delivered and replaced by new
+ * messages, the others tempfail and are pushed back.  The clock moves
+ * one second per batch and jumps to the next wakeup when idle.
+ *
+ * Every backend call can be written to a trace with -w, and a trace can
+ * be replayed with -r.  One operation per line:
+ *
+ *	clock	<time>
+ *	insert	<evpid> <type> <creation> <expire> <retry> <destkey>
+ *	commit	<msgid>
+ *	batch	<typemask> <count>
+ *	update	<evpid> <type> <creation> <expire> <retry>
+ *	delete	<evpid>
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define	RCPT_PER_MSG	4
+#define	BATCH_SIZE	256
+#define	BATCH_COUNT	20000
+#define	DEST_COUNT	5000
+#define	CLOCK_START	1400000000
+#define	LINE_MAX_LEN	256
+
+#define	SCHED_ALL	(SCHED_REMOVE | SCHED_EXPIRE | SCHED_UPDATE | \
+			 SCHED_BOUNCE | SCHED_MDA | SCHED_MTA)
+
+enum {
+	OP_CLOCK,
+	OP_INSERT,
+	OP_COMMIT,
+	OP_BATCH,
+	OP_UPDATE,
+	OP_DELETE,
+	OP_MAX
+};
+
+struct op {
+	int			type;
+	time_t			clock;
+	uint32_t		msgid;
+	int			typemask;
+	size_t			count;
+	struct scheduler_info	si;
+};
+
+struct opstat {
+	const char	*name;
+	size_t		 count;
+	double		 total;
+};
+
+/* what the synthetic workload remembers of an envelope */
+struct bevp {
+	time_t		creation;
+	uint16_t	retry;
+	uint8_t		type;
+};
+
+extern struct scheduler_backend	scheduler_backend_ramqueue;
+
+struct smtpd	*env;
+int		 verbose = 0;
+
+static struct scheduler_backend	*backend = &scheduler_backend_ramqueue;
+static time_t			 fakeclock = CLOCK_START;
+static FILE			*trace;
+static struct opstat		 stats[OP_MAX] = {
+	{ "clock" }, { "insert" }, { "commit" },
+	{ "batch" }, { "update" }, { "delete" },
+};
+static uint64_t			 evpids[BATCH_SIZE];
+static struct scheduler_batch	 batch;
+static double			*lat;
+static size_t			 nlat, latsz;
+
+static struct bevp		*bevps;
+static uint32_t			 nmsg, msgsz;
+
+static void	op_run(struct op *);
+static void	op_trace(struct op *);
+static int	op_parse(char *, struct op *);
+static void	replay(const char *);
+static void	synthetic(size_t, size_t);
+static void	inject(time_t, int);
+static void	report(double);
+static double	elapsed(struct timespec *, struct timespec *);
+static int	cmp_double(const void *, const void *);
+static void	usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec	 t0, t1;
+	const char	*errstr, *rfile = NULL;
+	size_t		 n = 0, batches = BATCH_COUNT;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "n:r:w:")) != -1) {
+		switch (ch) {
+		case 'n':
+			batches = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr)
+				errx(1, "batch count is %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			rfile = optarg;
+			break;
+		case 'w':
+			if ((trace = fopen(optarg, "w")) == NULL)
+				err(1, "%s", optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (rfile == NULL) {
+		if (argc != 1)
+			usage();
+		n = strtonum(argv[0], RCPT_PER_MSG, 100000000, &errstr);
+		if (errstr)
+			errx(1, "count is %s: %s", errstr, argv[0]);
+		n -= n % RCPT_PER_MSG;
+	}
+	else if (argc != 0)
+		usage();
+
+	if ((env = calloc(1, sizeof *env)) == NULL)
+		err(1, "calloc");
+
+	backend->init();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (rfile)
+		replay(rfile);
+	else
+		synthetic(n, batches);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (trace && fclose(trace) == EOF)
+		err(1, "trace");
+
+	report(elapsed(&t0, &t1));
+
+	return (0);
+}
+
+/* the ramqueue reads the clock through time(3) */
+time_t
+time(time_t *tp)
+{
+	if (tp)
+		*tp = fakeclock;
+	return (fakeclock);
+}
+
+static void
+op_run(struct op *op)
+{
+	struct timespec	t0, t1;
+	double		t;
+
+	if (trace)
+		op_trace(op);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	switch (op->type) {
+	case OP_CLOCK:
+		fakeclock = op->clock;
+		break;
+	case OP_INSERT:
+		backend->insert(&op->si);
+		break;
+	case OP_COMMIT:
+		backend->commit(op->msgid);
+		break;
+	case OP_BATCH:
+		batch.evpids = evpids;
+		batch.evpcount = op->count;
+		backend->batch(op->typemask, &batch);
+		break;
+	case OP_UPDATE:
+		backend->update(&op->si);
+		break;
+	case OP_DELETE:
+		backend->delete(op->si.evpid);
+		break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	t = elapsed(&t0, &t1);
+	stats[op->type].count++;
+	stats[op->type].total += t;
+
+	if (op->type != OP_BATCH)
+		return;
+	if (nlat == latsz) {
+		latsz = latsz ? latsz * 2 : 1024;
+		if ((lat = reallocarray(lat, latsz, sizeof *lat)) == NULL)
+			err(1, "reallocarray");
+	}
+	lat[nlat++] = t * 1000000;
+}
+
+static void
+op_trace(struct op *op)
+{
+	struct scheduler_info	*si = &op->si;
+
+	switch (op->type) {
+	case OP_CLOCK:
+		fprintf(trace, "clock %lld\n", (long long)op->clock);
+		break;
+	case OP_INSERT:
+		fprintf(trace, "insert %016"PRIx64" %d %lld %lld %d %"PRIu32"\n",
+		    si->evpid, si->type, (long long)si->creation,
+		    (long long)si->expire, si->retry, si->destkey);
+		break;
+	case OP_COMMIT:
+		fprintf(trace, "commit %08"PRIx32"\n", op->msgid);
+		break;
+	case OP_BATCH:
+		fprintf(trace, "batch %d %zu\n", op->typemask, op->count);
+		break;
+	case OP_UPDATE:
+		fprintf(trace, "update %016"PRIx64" %d %lld %lld %d\n",
+		    si->evpid, si->type, (long long)si->creation,
+		    (long long)si->expire, si->retry);
+		break;
+	case OP_DELETE:
+		fprintf(trace, "delete %016"PRIx64"\n", si->evpid);
+		break;
+	}
+}
+
+static int
+op_parse(char *line, struct op *op)
+{
+	struct scheduler_info	*si = &op->si;
+	char			 name[16];
+	long long		 a, b;
+	int			 type, retry;
+
+	memset(op, 0, sizeof *op);
+	if (sscanf(line, "%15s", name) != 1)
+		return (0);
+
+	if (!strcmp(name, "clock")) {
+		op->type = OP_CLOCK;
+		if (sscanf(line, "%*s %lld", &a) != 1)
+			return (0);
+		op->clock = a;
+	}
+	else if (!strcmp(name, "insert")) {
+		op->type = OP_INSERT;
+		if (sscanf(line, "%*s %"SCNx64" %d %lld %lld %d %"SCNu32,
+		    &si->evpid, &type, &a, &b, &retry, &si->destkey) != 6)
+			return (0);
+		si->type = type;
+		si->retry = retry;
+		si->creation = a;
+		si->expire = b;
+	}
+	else if (!strcmp(name, "commit")) {
+		op->type = OP_COMMIT;
+		if (sscanf(line, "%*s %"SCNx32, &op->msgid) != 1)
+			return (0);
+	}
+	else if (!strcmp(name, "batch")) {
+		op->type = OP_BATCH;
+		if (sscanf(line, "%*s %d %zu", &op->typemask, &op->count) != 2)
+			return (0);
+		if (op->count > BATCH_SIZE)
+			op->count = BATCH_SIZE;
+	}
+	else if (!strcmp(name, "update")) {
+		op->type = OP_UPDATE;
+		if (sscanf(line, "%*s %"SCNx64" %d %lld %lld %d",
+		    &si->evpid, &type, &a, &b, &retry) != 5)
+			return (0);
+		si->type = type;
+		si->retry = retry;
+		si->creation = a;
+		si->expire = b;
+	}
+	else if (!strcmp(name, "delete")) {
+		op->type = OP_DELETE;
+		if (sscanf(line, "%*s %"SCNx64, &si->evpid) != 1)
+			return (0);
+	}
+	else
+		return (0);
+
+	return (1);
+}
+
+static void
+replay(const char *path)
+{
+	FILE		*fp;
+	struct op	 op;
+	char		 line[LINE_MAX_LEN];
+	size_t		 lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	while (fgets(line, sizeof line, fp)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (!op_parse(line, &op))
+			errx(1, "%s:%zu: bad line", path, lineno);
+		op_run(&op);
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	fclose(fp);
+}
+
+static void
+synthetic(size_t n, size_t batches)
+{
+	struct op	 op;
+	struct bevp	*b;
+	size_t		 i, j, delivered = 0;
+
+	srandom(1);
+
+	memset(&op, 0, sizeof op);
+	op.type = OP_CLOCK;
+	op.clock = fakeclock;
+	op_run(&op);
+
+	for (i = 0; i < n; i += RCPT_PER_MSG)
+		inject(fakeclock - random() % (3 * 24 * 3600), random() % 8);
+
+	for (i = 0; i < batches; i++) {
+		memset(&op, 0, sizeof op);
+		op.type = OP_BATCH;
+		op.typemask = SCHED_ALL;
+		op.count = BATCH_SIZE;
+		op_run(&op);
+
+		if (batch.type == SCHED_NONE)
+			break;
+
+		memset(&op, 0, sizeof op);
+		op.type = OP_CLOCK;
+		op.clock = fakeclock + 1;
+		if (batch.type == SCHED_DELAY && batch.delay > 1)
+			op.clock = fakeclock + batch.delay;
+		op_run(&op);
+
+		if (!(batch.type & (SCHED_BOUNCE | SCHED_MDA | SCHED_MTA)))
+			continue;
+
+		for (j = 0; j < batch.evpcount; j++) {
+			b = &bevps[(evpid_to_msgid(evpids[j]) - 1) *
+			    RCPT_PER_MSG + (evpids[j] & 0xffffffff)];
+
+			memset(&op, 0, sizeof op);
+			op.si.evpid = evpids[j];
+			if (random() % 4) {
+				op.type = OP_DELETE;
+				op_run(&op);
+				if (++delivered % RCPT_PER_MSG == 0)
+					inject(fakeclock, 0);
+				continue;
+			}
+			op.type = OP_UPDATE;
+			op.si.type = b->type;
+			op.si.creation = b->creation;
+			op.si.expire = 4 * 24 * 3600;
+			op.si.retry = ++b->retry;
+			op_run(&op);
+		}
+	}
+}
+
+/* insert and commit a new message */
+static void
+inject(time_t creation, int retry)
+{
+	struct op	 op;
+	struct bevp	*b;
+	uint32_t	 j;
+	size_t		 newsz;
+
+	if (nmsg == msgsz) {
+		newsz = msgsz ? msgsz * 2 : 1024;
+		b = reallocarray(bevps, newsz * RCPT_PER_MSG, sizeof *bevps);
+		if (b == NULL)
+			err(1, "reallocarray");
+		bevps = b;
+		msgsz = newsz;
+	}
+	nmsg++;
+
+	for (j = 0; j < RCPT_PER_MSG; j++) {
+		b = &bevps[(nmsg - 1) * RCPT_PER_MSG + j];
+		b->creation = creation;
+		b->retry = retry;
+		b->type = (random() % 10) ? D_MTA : D_MDA;
+
+		memset(&op, 0, sizeof op);
+		op.type = OP_INSERT;
+		op.si.evpid = ((uint64_t)nmsg << 32) | j;
+		op.si.type = b->type;
+		op.si.creation = b->creation;
+		op.si.expire = 4 * 24 * 3600;
+		op.si.retry = b->retry;
+		op.si.destkey = random() % DEST_COUNT;
+		op_run(&op);
+	}
+
+	memset(&op, 0, sizeof op);
+	op.type = OP_COMMIT;
+	op.msgid = nmsg;
+	op_run(&op);
+}
+
+static void
+report(double wall)
+{
+	struct rusage	ru;
+	size_t		i, total = 0;
+	double		busy = 0, sum = 0;
+
+	for (i = OP_INSERT; i < OP_MAX; i++) {
+		if (stats[i].count == 0)
+			continue;
+		total += stats[i].count;
+		busy += stats[i].total;
+		printf("%-8s %10zu ops %12.0f ops/s\n", stats[i].name,
+		    stats[i].count, stats[i].count / stats[i].total);
+	}
+	printf("%zu ops in %.3fs spent in the backend, %.0f ops/s, "
+	    "%.3fs wall\n", total, busy, total / busy, wall);
+
+	if (nlat) {
+		for (i = 0; i < nlat; i++)
+			sum += lat[i];
+		qsort(lat, nlat, sizeof *lat, cmp_double);
+		printf("batch latency: avg %.1fus p50 %.1fus p99 %.1fus "
+		    "max %.1fus\n", sum / nlat, lat[nlat / 2],
+		    lat[nlat * 99 / 100], lat[nlat - 1]);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("maxrss %ldKB\n", ru.ru_maxrss);
+}
+
+static double
+elapsed(struct timespec *t0, struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) +
+	    (t1->tv_nsec - t0->tv_nsec) / 1000000000.0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	const double	*d1 = a, *d2 = b;
+
+	if (*d1 == *d2)
+		return (0);
+	return (*d1 < *d2) ? -1 : 1;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: schedbench [-n batches] [-w trace] count\n"
+	    "       schedbench [-w trace] -r trace\n");
+	exit(1);
+}
+
+/* stubs for what the scheduler pulls from the rest of smtpd */
+
+time_t
+scheduler_compute_schedule(struct scheduler_info *sched)
+{
+	time_t		delay;
+
+	delay = (sched->type == D_MTA) ? 800 : 10;
+	return (sched->creation + delay * sched->retry * sched->retry / 2);
+}
+
+void *
+xcalloc(size_t nmemb, size_t size, const char *where)
+{
+	void	*r;
+
+	if ((r = calloc(nmemb, size)) == NULL)
+		err(1, "%s: calloc", where);
+	return (r);
+}
+
+const char *
+duration_to_text(time_t t)
+{
+	static char	buf[32];
+
+	(void)snprintf(buf, sizeof buf, "%llds", (long long)t);
+	return (buf);
+}
+
+void
+stat_increment(const char *key, size_t count)
+{
+}
+
+void
+stat_decrement(const char *key, size_t count)
+{
+}
+
+void
+log_debug(const char *emsg, ...)
+{
+}
+
+void
+fatal(const char *emsg)
+{
+	err(1, "%s", emsg);
+}
+
+void
+fatalx(const char *emsg)
+{
+	errx(1, "%s", emsg);
+}
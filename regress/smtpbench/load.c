@@ -0,0 +1,551 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Load generator: -c sessions at once, each sending up to -m messages of
+ * -s bytes to -r recipients, until -n messages have been tried.  Every
+ * message carries the time it was started at, for the sink.  Nothing is
+ * random, so that runs with the same options can be compared.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "smtpbench.h"
+
+#define	LOAD_TIMEOUT	60
+
+enum lstate {
+	L_BANNER,
+	L_EHLO,
+	L_STARTTLS,
+	L_TLS,
+	L_MAIL,
+	L_RCPT,
+	L_DATA,
+	L_BODY,
+	L_QUIT
+};
+
+struct lsession {
+	int		 fd;
+	struct event	 ev;
+	SSL		*ssl;
+	enum lstate	 state;
+	short		 want;
+	char		 rbuf[BENCH_LINE_MAX * 4];
+	size_t		 rlen;
+	char		*wbuf;
+	size_t		 wlen;
+	size_t		 wsize;
+	size_t		 wpos;
+	int		 rcpt;
+	int		 msgs;
+	uint64_t	 start;		/* of the current message */
+};
+
+static void	load_usage(void);
+static void	session_new(void);
+static void	session_close(struct lsession *);
+static void	session_fail(struct lsession *, const char *);
+static void	session_wait(struct lsession *, short);
+static void	session_io(int, short, void *);
+static void	session_parse(struct lsession *);
+static int	session_reply(struct lsession *, int);
+static void	session_printf(struct lsession *, const char *, ...)
+    __attribute__((__format__ (printf, 2, 3)));
+static void	session_message(struct lsession *);
+static ssize_t	lio_read(struct lsession *, char *, size_t);
+static ssize_t	lio_write(struct lsession *, const char *, size_t);
+
+static struct addrinfo	*server;
+static SSL_CTX		*ssl_ctx;
+static char		*body;
+static size_t		 bodylen;
+static const char	*domain = "bench.test";
+static int		 msgs_total = 1000;
+static int		 msgs_session = 10;
+static int		 rcpts = 1;
+static int		 size = 1024;
+static int		 use_tls;
+
+static int		 started;	/* messages */
+static int		 accepted;
+static int		 failed;
+static int		 sessions;	/* open now */
+static uint64_t		 t_start, t_end;
+static struct samples	 lat;		/* from MAIL FROM to the 250 */
+
+static void
+load_usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s load [-t] [-c sessions] [-d domain] "
+	    "[-m msgs/session] [-n msgs]\n"
+	    "           [-p port] [-r rcpts] [-s size] [host]\n", __progname);
+	exit(1);
+}
+
+static ssize_t
+lio_read(struct lsession *s, char *buf, size_t len)
+{
+	int	n;
+
+	s->want = EV_READ;
+	if (s->ssl == NULL)
+		return (read(s->fd, buf, len));
+
+	if ((n = SSL_read(s->ssl, buf, len)) > 0)
+		return (n);
+	switch (SSL_get_error(s->ssl, n)) {
+	case SSL_ERROR_WANT_WRITE:
+		s->want = EV_WRITE;
+		/* FALLTHROUGH */
+	case SSL_ERROR_WANT_READ:
+		errno = EAGAIN;
+		return (-1);
+	case SSL_ERROR_ZERO_RETURN:
+		return (0);
+	default:
+		errno = EIO;
+		return (-1);
+	}
+}
+
+static ssize_t
+lio_write(struct lsession *s, const char *buf, size_t len)
+{
+	int	n;
+
+	s->want = EV_WRITE;
+	if (s->ssl == NULL)
+		return (write(s->fd, buf, len));
+
+	if ((n = SSL_write(s->ssl, buf, len)) > 0)
+		return (n);
+	switch (SSL_get_error(s->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+		s->want = EV_READ;
+		/* FALLTHROUGH */
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return (-1);
+	default:
+		errno = EIO;
+		return (-1);
+	}
+}
+
+static void
+session_new(void)
+{
+	struct lsession	*s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		err(1, "calloc");
+	if ((s->fd = socket(server->ai_family, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (sock_nonblock(s->fd) == -1)
+		err(1, "fcntl");
+	if (connect(s->fd, server->ai_addr, server->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS)
+		err(1, "connect");
+
+	sessions++;
+	s->state = L_BANNER;
+	event_set(&s->ev, s->fd, EV_READ, session_io, s);
+	session_wait(s, EV_READ);
+}
+
+static void
+session_close(struct lsession *s)
+{
+	event_del(&s->ev);
+	if (s->ssl)
+		SSL_free(s->ssl);
+	close(s->fd);
+	free(s->wbuf);
+	free(s);
+	sessions--;
+
+	if (started < msgs_total)
+		session_new();
+}
+
+static void
+session_fail(struct lsession *s, const char *why)
+{
+	/* no point in going on if the server cannot even be reached */
+	if (s->msgs == 0 && s->state < L_MAIL)
+		errx(1, "session failed: %s", why);
+
+	warnx("session failed: %s", why);
+	/* the message in progress, if any, is lost */
+	if (s->state >= L_MAIL && s->state <= L_BODY)
+		failed++;
+	session_close(s);
+}
+
+static void
+session_wait(struct lsession *s, short ev)
+{
+	struct timeval	tv;
+
+	tv.tv_sec = LOAD_TIMEOUT;
+	tv.tv_usec = 0;
+	event_del(&s->ev);
+	event_set(&s->ev, s->fd, ev, session_io, s);
+	event_add(&s->ev, &tv);
+}
+
+static void
+session_printf(struct lsession *s, const char *fmt, ...)
+{
+	va_list	 ap;
+	char	*tmp;
+	int	 n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(s->wbuf + s->wlen, s->wsize - s->wlen, fmt, ap);
+		va_end(ap);
+		if (n == -1)
+			err(1, "vsnprintf");
+		if ((size_t)n < s->wsize - s->wlen)
+			break;
+		if ((tmp = realloc(s->wbuf, s->wsize + n + 1024)) == NULL)
+			err(1, "realloc");
+		s->wbuf = tmp;
+		s->wsize += n + 1024;
+	}
+	s->wlen += n;
+	session_wait(s, EV_WRITE);
+}
+
+/* start the next message on this session, or leave */
+static void
+session_message(struct lsession *s)
+{
+	if (started == msgs_total || s->msgs == msgs_session) {
+		session_printf(s, "QUIT\r\n");
+		s->state = L_QUIT;
+		return;
+	}
+
+	started++;
+	s->msgs++;
+	s->rcpt = 0;
+	s->start = now_usec();
+	session_printf(s, "MAIL FROM:<bench@%s>\r\n", domain);
+	s->state = L_MAIL;
+}
+
+/* handle a complete reply, 0 if the session is gone */
+static int
+session_reply(struct lsession *s, int code)
+{
+	switch (s->state) {
+	case L_BANNER:
+		if (code != 220)
+			break;
+		session_printf(s, "EHLO smtpbench\r\n");
+		s->state = L_EHLO;
+		return (1);
+
+	case L_EHLO:
+		if (code != 250)
+			break;
+		if (use_tls && s->ssl == NULL) {
+			session_printf(s, "STARTTLS\r\n");
+			s->state = L_STARTTLS;
+		}
+		else
+			session_message(s);
+		return (1);
+
+	case L_STARTTLS:
+		if (code != 220)
+			break;
+		if ((s->ssl = SSL_new(ssl_ctx)) == NULL ||
+		    !SSL_set_fd(s->ssl, s->fd))
+			errx(1, "SSL_new");
+		SSL_set_connect_state(s->ssl);
+		s->state = L_TLS;
+		session_wait(s, EV_WRITE);
+		return (1);
+
+	case L_MAIL:
+	case L_RCPT:
+		if (code != 250)
+			break;
+		if (s->rcpt < rcpts) {
+			session_printf(s, "RCPT TO:<rcpt%d@%s>\r\n", s->rcpt,
+			    domain);
+			s->rcpt++;
+			s->state = L_RCPT;
+		}
+		else {
+			session_printf(s, "DATA\r\n");
+			s->state = L_DATA;
+		}
+		return (1);
+
+	case L_DATA:
+		if (code != 354)
+			break;
+		session_printf(s, "From: <bench@%s>\r\n"
+		    "To: <rcpt0@%s>\r\n"
+		    "Subject: smtpbench\r\n"
+		    BENCH_HEADER "%llu\r\n"
+		    "\r\n"
+		    "%.*s"
+		    ".\r\n", domain, domain, (unsigned long long)s->start,
+		    (int)bodylen, body);
+		s->state = L_BODY;
+		return (1);
+
+	case L_BODY:
+		if (code != 250)
+			break;
+		accepted++;
+		t_end = now_usec();
+		samples_add(&lat, t_end - s->start);
+		session_message(s);
+		return (1);
+
+	case L_QUIT:
+		session_close(s);
+		return (0);
+
+	case L_TLS:
+		break;
+	}
+
+	session_fail(s, "unexpected reply");
+	return (0);
+}
+
+static void
+session_parse(struct lsession *s)
+{
+	char	*nl;
+	size_t	 len;
+	int	 more;
+
+	while ((nl = memchr(s->rbuf, '\n', s->rlen))) {
+		len = nl - s->rbuf + 1;
+		more = (len > 4 && s->rbuf[3] == '-');
+		s->rbuf[3] = '\0';
+		if (!more && !session_reply(s, atoi(s->rbuf)))
+			return;
+		memmove(s->rbuf, s->rbuf + len, s->rlen - len);
+		s->rlen -= len;
+	}
+	if (s->rlen == sizeof(s->rbuf)) {
+		session_fail(s, "line too long");
+		return;
+	}
+	if (s->state != L_TLS && s->wpos == s->wlen)
+		session_wait(s, EV_READ);
+}
+
+static void
+session_io(int fd, short event, void *arg)
+{
+	struct lsession	*s = arg;
+	ssize_t		 n;
+	int		 r;
+
+	if (event & EV_TIMEOUT) {
+		session_fail(s, "timeout");
+		return;
+	}
+
+	if (s->state == L_TLS) {
+		if ((r = SSL_connect(s->ssl)) != 1) {
+			switch (SSL_get_error(s->ssl, r)) {
+			case SSL_ERROR_WANT_READ:
+				session_wait(s, EV_READ);
+				return;
+			case SSL_ERROR_WANT_WRITE:
+				session_wait(s, EV_WRITE);
+				return;
+			default:
+				session_fail(s, "TLS handshake");
+				return;
+			}
+		}
+		session_printf(s, "EHLO smtpbench\r\n");
+		s->state = L_EHLO;
+		return;
+	}
+
+	if (s->wpos < s->wlen) {
+		n = lio_write(s, s->wbuf + s->wpos, s->wlen - s->wpos);
+		if (n == -1 && errno == EAGAIN) {
+			session_wait(s, s->want);
+			return;
+		}
+		if (n <= 0) {
+			session_fail(s, "write");
+			return;
+		}
+		s->wpos += n;
+		if (s->wpos < s->wlen) {
+			session_wait(s, EV_WRITE);
+			return;
+		}
+		s->wpos = s->wlen = 0;
+		session_wait(s, EV_READ);
+		return;
+	}
+
+	n = lio_read(s, s->rbuf + s->rlen, sizeof(s->rbuf) - s->rlen);
+	if (n == -1 && errno == EAGAIN) {
+		session_wait(s, s->want);
+		return;
+	}
+	if (n <= 0 && s->state == L_QUIT) {
+		/* the server may hang up without waiting for us to read 221 */
+		session_close(s);
+		return;
+	}
+	if (n <= 0) {
+		session_fail(s, n ? strerror(errno) : "connection closed");
+		return;
+	}
+	s->rlen += n;
+	session_parse(s);
+}
+
+int
+load_main(int argc, char **argv)
+{
+	struct addrinfo	 hints;
+	const char	*errstr, *host, *port;
+	double		 dt;
+	size_t		 i;
+	int		 ch, concurrency, n, e;
+
+	host = "127.0.0.1";
+	port = "25";
+	concurrency = 10;
+
+	while ((ch = getopt(argc, argv, "c:d:m:n:p:r:s:t")) != -1) {
+		switch (ch) {
+		case 'c':
+			concurrency = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr)
+				errx(1, "sessions is %s", errstr);
+			break;
+		case 'd':
+			domain = optarg;
+			break;
+		case 'm':
+			msgs_session = strtonum(optarg, 1, INT32_MAX, &errstr);
+			if (errstr)
+				errx(1, "messages per session is %s", errstr);
+			break;
+		case 'n':
+			msgs_total = strtonum(optarg, 1, INT32_MAX, &errstr);
+			if (errstr)
+				errx(1, "messages is %s", errstr);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'r':
+			rcpts = strtonum(optarg, 1, 100000, &errstr);
+			if (errstr)
+				errx(1, "recipients is %s", errstr);
+			break;
+		case 's':
+			size = strtonum(optarg, 0, 512 * 1024 * 1024, &errstr);
+			if (errstr)
+				errx(1, "size is %s", errstr);
+			break;
+		case 't':
+			use_tls = 1;
+			break;
+		default:
+			load_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		load_usage();
+	if (argc)
+		host = argv[0];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((e = getaddrinfo(host, port, &hints, &server)))
+		errx(1, "%s: %s", host, gai_strerror(e));
+
+	if (use_tls) {
+		SSL_library_init();
+		SSL_load_error_strings();
+		if ((ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL)
+			errx(1, "SSL_CTX_new");
+		SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+	}
+
+	/* lines of 76 x, none starting with a dot */
+	bodylen = size - size % 78;
+	if ((body = malloc(bodylen + 1)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < bodylen; i += 78) {
+		memset(body + i, 'x', 76);
+		memcpy(body + i + 76, "\r\n", 2);
+	}
+
+	event_init();
+	t_start = now_usec();
+	for (n = 0; n < concurrency && n < msgs_total; n++)
+		session_new();
+	event_dispatch();
+
+	dt = accepted ? (t_end - t_start) / 1e6 : 0;
+	printf("load: %d sessions, %d messages of %d bytes to %d "
+	    "recipient%s\n", n, msgs_total, size, rcpts,
+	    rcpts > 1 ? "s" : "");
+	printf("load: %d accepted, %d failed in %.3fs, %.1f msgs/s\n",
+	    accepted, failed, dt, dt > 0 ? accepted / dt : 0);
+	samples_report("load: accept latency", &lat);
+
+	freeaddrinfo(server);
+	free(body);
+	return (failed ? 1 : 0);
+}
@@ -0,0 +1,109 @@
+#!/bin/sh
+#	$OpenBSD$
+#
+# Run the smtpbench scenarios against a local smtpd relaying to the sink:
+#
+#	smtpbench load -> smtpd :2525 -> smtpbench sink :2526
+#
+# smtpd runs in the foreground with its own configuration but the
+# system queue, so this must be run as root on a host where no other
+# smtpd is running.  Each scenario prints one line of results, the same
+# scenarios on two builds give comparable numbers.
+
+SMTPBENCH=${SMTPBENCH:-./smtpbench}
+SMTPD=${SMTPD:-/usr/sbin/smtpd}
+FILTER=${FILTER:-/usr/libexec/smtpd/filter-void}
+
+DIR=$(mktemp -d /tmp/smtpbench.XXXXXXXXXX) || exit 1
+trap 'kill $SMTPD_PID $SINK_PID 2>/dev/null; rm -rf $DIR' EXIT
+
+certificate() {
+	[ -f $DIR/bench.crt ] && return
+	openssl req -x509 -newkey rsa:2048 -nodes -days 1 \
+	    -subj /CN=bench.test -keyout $DIR/bench.key \
+	    -out $DIR/bench.crt 2>/dev/null || exit 1
+	chmod 600 $DIR/bench.key
+}
+
+# configure name: writes the smtpd.conf of a scenario
+configure() {
+	listen="listen on 127.0.0.1 port 2525"
+	via="smtp://127.0.0.1:2526"
+	: > $DIR/smtpd.conf
+	case $1 in
+	tls)
+		certificate
+		echo "pki bench.test certificate \"$DIR/bench.crt\"" \
+		    >> $DIR/smtpd.conf
+		echo "pki bench.test key \"$DIR/bench.key\"" >> $DIR/smtpd.conf
+		listen="$listen tls pki bench.test hostname bench.test"
+		;;
+	filter)
+		echo "filter void \"$FILTER\"" >> $DIR/smtpd.conf
+		;;
+	lmtp)
+		via="lmtp://127.0.0.1:2526"
+		;;
+	esac
+	echo "$listen" >> $DIR/smtpd.conf
+	echo "accept from any for domain bench.test relay via \"$via\"" \
+	    >> $DIR/smtpd.conf
+}
+
+# cpu: the cpu time of each smtpd process, as "name=time"
+cpu() {
+	ps -axo time=,command= | awk '$2 ~ /^smtpd:/ {
+		sub(/^smtpd: /, "", $0); t = $1; $1 = "";
+		sub(/^ /, "", $0); gsub(/ /, "-", $0);
+		printf("%s%s=%s", n++ ? " " : "", $0, t) }
+		END { printf("\n") }'
+}
+
+# scenario name load-options
+scenario() {
+	name=$1
+	shift
+	case $name in
+	lmtp)	sinkopt=-l ;;
+	*)	sinkopt= ;;
+	esac
+
+	# the sink stops once it got every recipient of every message
+	n=$(echo "$@" | sed -n 's/.*-n \([0-9]*\).*/\1/p')
+	r=$(echo "$@" | sed -n 's/.*-r \([0-9]*\).*/\1/p')
+
+	configure $name
+	$SMTPD -n -f $DIR/smtpd.conf >/dev/null || exit 1
+
+	$SMTPBENCH sink $sinkopt -n $((n * ${r:-1})) > $DIR/sink.out &
+	SINK_PID=$!
+	$SMTPD -d -f $DIR/smtpd.conf > $DIR/smtpd.log 2>&1 &
+	SMTPD_PID=$!
+	sleep 2
+
+	$SMTPBENCH load -p 2525 "$@" > $DIR/load.out
+	wait $SINK_PID
+	SINK_PID=
+
+	echo "== $name: $*"
+	cat $DIR/load.out $DIR/sink.out
+	echo "cpu: $(cpu)"
+
+	kill $SMTPD_PID
+	wait $SMTPD_PID
+	SMTPD_PID=
+}
+
+[ $# -eq 0 ] && set -- small large fanout tls filter lmtp
+
+for s; do
+	case $s in
+	small)	scenario small -c 50 -n 20000 -m 10 -r 1 -s 1024 ;;
+	large)	scenario large -c 4 -n 40 -m 1 -r 1 -s 10485760 ;;
+	fanout)	scenario fanout -c 10 -n 500 -m 5 -r 100 -s 4096 ;;
+	tls)	scenario tls -t -c 50 -n 5000 -m 10 -r 1 -s 1024 ;;
+	filter)	scenario filter -c 50 -n 20000 -m 10 -r 1 -s 1024 ;;
+	lmtp)	scenario lmtp -c 50 -n 20000 -m 10 -r 1 -s 1024 ;;
+	*)	echo "unknown scenario: $s" >&2; exit 1 ;;
+	esac
+done
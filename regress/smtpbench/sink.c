@@ -0,0 +1,338 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Sink: accept every command, throw the data away and answer as soon as
+ * possible, over SMTP or, with -l, LMTP.  The stamp put in the headers
+ * by the load generator gives the end-to-end latency of each message.
+ * The sink exits once -n recipients were received, or when nothing came
+ * in for -T seconds.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "smtpbench.h"
+
+struct ssession {
+	int		 fd;
+	struct event	 ev;
+	int		 data;		/* in DATA, 2 while in the headers */
+	int		 rcpts;
+	uint64_t	 stamp;
+	char		 rbuf[BENCH_LINE_MAX * 4];
+	size_t		 rlen;
+	char		 wbuf[BENCH_LINE_MAX * 4];
+	size_t		 wlen;
+};
+
+static void	sink_usage(void);
+static void	sink_accept(int, short, void *);
+static void	sink_io(int, short, void *);
+static void	sink_close(struct ssession *);
+static void	sink_line(struct ssession *, char *);
+static void	sink_reply(struct ssession *, const char *);
+static void	sink_flush(struct ssession *);
+static void	sink_message(struct ssession *);
+static void	sink_idle(int, short, void *);
+
+static int		 lmtp;
+static size_t		 expected;
+static struct timeval	 idletv;
+static struct event	 idleev;
+
+static size_t		 messages;
+static size_t		 recipients;
+static uint64_t		 t_first, t_last;
+static struct samples	 lat;
+
+static void
+sink_usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s sink [-l] [-n rcpts] [-p port] "
+	    "[-T timeout] [host]\n", __progname);
+	exit(1);
+}
+
+static void
+sink_accept(int fd, short event, void *arg)
+{
+	struct ssession	*s;
+	int		 sock;
+
+	if ((sock = accept(fd, NULL, NULL)) == -1) {
+		if (errno != EINTR && errno != EWOULDBLOCK &&
+		    errno != ECONNABORTED)
+			warn("accept");
+		return;
+	}
+	if (sock_nonblock(sock) == -1)
+		err(1, "fcntl");
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		err(1, "calloc");
+	s->fd = sock;
+	event_set(&s->ev, s->fd, EV_READ | EV_PERSIST, sink_io, s);
+	event_add(&s->ev, NULL);
+	sink_reply(s, "220 smtpbench sink");
+}
+
+static void
+sink_close(struct ssession *s)
+{
+	event_del(&s->ev);
+	close(s->fd);
+	free(s);
+}
+
+static void
+sink_reply(struct ssession *s, const char *line)
+{
+	size_t	len;
+
+	len = strlen(line);
+	if (s->wlen + len + 2 <= sizeof(s->wbuf)) {
+		memcpy(s->wbuf + s->wlen, line, len);
+		memcpy(s->wbuf + s->wlen + len, "\r\n", 2);
+		s->wlen += len + 2;
+	}
+	sink_flush(s);
+}
+
+/* replies are small, what a full socket refuses goes on the next read */
+static void
+sink_flush(struct ssession *s)
+{
+	ssize_t	n;
+
+	if ((n = write(s->fd, s->wbuf, s->wlen)) > 0) {
+		memmove(s->wbuf, s->wbuf + n, s->wlen - n);
+		s->wlen -= n;
+	}
+}
+
+static void
+sink_message(struct ssession *s)
+{
+	uint64_t	now;
+	int		i;
+
+	now = now_usec();
+	if (t_first == 0)
+		t_first = now;
+	t_last = now;
+	messages++;
+	recipients += s->rcpts;
+	if (s->stamp && now > s->stamp)
+		samples_add(&lat, now - s->stamp);
+
+	if (lmtp)
+		for (i = 0; i < s->rcpts; i++)
+			sink_reply(s, "250 2.0.0 Ok");
+	else
+		sink_reply(s, "250 2.0.0 Ok");
+
+	s->data = 0;
+	s->rcpts = 0;
+	s->stamp = 0;
+
+	evtimer_add(&idleev, &idletv);
+	if (expected && recipients >= expected)
+		event_loopexit(NULL);
+}
+
+static void
+sink_line(struct ssession *s, char *line)
+{
+	if (s->data) {
+		if (!strcmp(line, "."))
+			sink_message(s);
+		else if (s->data == 2 && line[0] == '\0')
+			s->data = 1;
+		else if (s->data == 2 && !strncasecmp(line, BENCH_HEADER,
+		    strlen(BENCH_HEADER)))
+			s->stamp = strtoull(line + strlen(BENCH_HEADER),
+			    NULL, 10);
+		return;
+	}
+
+	if (!strncasecmp(line, "EHLO", 4) || !strncasecmp(line, "LHLO", 4))
+		sink_reply(s, "250-smtpbench sink\r\n250-PIPELINING\r\n"
+		    "250-8BITMIME\r\n250 SIZE 0");
+	else if (!strncasecmp(line, "RCPT", 4)) {
+		s->rcpts++;
+		sink_reply(s, "250 2.1.5 Ok");
+	}
+	else if (!strncasecmp(line, "DATA", 4)) {
+		s->data = 2;
+		sink_reply(s, "354 Go ahead");
+	}
+	else if (!strncasecmp(line, "RSET", 4)) {
+		s->rcpts = 0;
+		sink_reply(s, "250 2.0.0 Ok");
+	}
+	else if (!strncasecmp(line, "QUIT", 4)) {
+		sink_reply(s, "221 2.0.0 Bye");
+		sink_close(s);
+	}
+	else
+		sink_reply(s, "250 2.0.0 Ok");
+}
+
+static void
+sink_io(int fd, short event, void *arg)
+{
+	struct ssession	*s = arg;
+	char		*line, *nl;
+	size_t		 len;
+	ssize_t		 n;
+
+	n = read(fd, s->rbuf + s->rlen, sizeof(s->rbuf) - s->rlen);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		sink_close(s);
+		return;
+	}
+	s->rlen += n;
+
+	line = s->rbuf;
+	while ((nl = memchr(line, '\n', s->rlen - (line - s->rbuf)))) {
+		len = nl - line;
+		if (len && line[len - 1] == '\r')
+			len--;
+		line[len] = '\0';
+		/* QUIT closes the session */
+		if (!s->data && !strncasecmp(line, "QUIT", 4)) {
+			sink_line(s, line);
+			return;
+		}
+		sink_line(s, line);
+		line = nl + 1;
+	}
+	len = s->rlen - (line - s->rbuf);
+
+	/* a data line longer than the buffer is of no interest */
+	if (len == sizeof(s->rbuf)) {
+		if (!s->data) {
+			sink_close(s);
+			return;
+		}
+		len = 0;
+	}
+	memmove(s->rbuf, line, len);
+	s->rlen = len;
+
+	if (s->wlen)
+		sink_flush(s);
+}
+
+static void
+sink_idle(int fd, short event, void *arg)
+{
+	event_loopexit(NULL);
+}
+
+int
+sink_main(int argc, char **argv)
+{
+	struct addrinfo	 hints, *res;
+	struct event	 ev;
+	const char	*errstr, *host, *port;
+	double		 dt;
+	int		 ch, e, fd, on;
+
+	host = "127.0.0.1";
+	port = "2526";
+	idletv.tv_sec = 30;
+
+	while ((ch = getopt(argc, argv, "ln:p:T:")) != -1) {
+		switch (ch) {
+		case 'l':
+			lmtp = 1;
+			break;
+		case 'n':
+			expected = strtonum(optarg, 1, INT64_MAX, &errstr);
+			if (errstr)
+				errx(1, "recipients is %s", errstr);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'T':
+			idletv.tv_sec = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr)
+				errx(1, "timeout is %s", errstr);
+			break;
+		default:
+			sink_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		sink_usage();
+	if (argc)
+		host = argv[0];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((e = getaddrinfo(host, port, &hints, &res)))
+		errx(1, "%s: %s", host, gai_strerror(e));
+	if ((fd = socket(res->ai_family, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+		err(1, "setsockopt");
+	if (bind(fd, res->ai_addr, res->ai_addrlen) == -1)
+		err(1, "bind");
+	if (listen(fd, 128) == -1)
+		err(1, "listen");
+	if (sock_nonblock(fd) == -1)
+		err(1, "fcntl");
+	freeaddrinfo(res);
+
+	event_init();
+	event_set(&ev, fd, EV_READ | EV_PERSIST, sink_accept, NULL);
+	event_add(&ev, NULL);
+	evtimer_set(&idleev, sink_idle, NULL);
+	evtimer_add(&idleev, &idletv);
+	event_dispatch();
+
+	dt = (t_last - t_first) / 1e6;
+	printf("sink: %zu messages, %zu recipients in %.3fs, %.1f msgs/s\n",
+	    messages, recipients, dt, dt > 0 ? messages / dt : 0);
+	samples_report("sink: end-to-end latency", &lat);
+
+	return (expected && recipients < expected) ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * SMTP throughput benchmark.  "smtpbench load" runs many concurrent
+ * sessions against a server and reports the accepted messages per
+ * second, "smtpbench sink" is a fast SMTP or LMTP server that accepts
+ * everything and reports the end-to-end latency of what it receives,
+ * from the time stamped in each message by the load generator.  See
+ * run.sh for the scenarios.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smtpbench.h"
+
+static int	cmp_u64(const void *, const void *);
+static void	usage(void);
+
+uint64_t
+now_usec(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+int
+sock_nonblock(int fd)
+{
+	int	flags;
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
+		return (-1);
+	return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+void
+samples_add(struct samples *s, uint64_t v)
+{
+	uint64_t	*tmp;
+	size_t		 size;
+
+	if (s->n == s->size) {
+		size = s->size ? s->size * 2 : 1024;
+		if ((tmp = reallocarray(s->v, size, sizeof(*tmp))) == NULL)
+			err(1, "reallocarray");
+		s->v = tmp;
+		s->size = size;
+	}
+	s->v[s->n++] = v;
+	s->sorted = 0;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t	x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/* the value under which pct of the samples are, 0 if there are none */
+uint64_t
+samples_pct(struct samples *s, double pct)
+{
+	size_t	i;
+
+	if (s->n == 0)
+		return (0);
+	if (!s->sorted) {
+		qsort(s->v, s->n, sizeof(*s->v), cmp_u64);
+		s->sorted = 1;
+	}
+	i = pct * (s->n - 1) / 100;
+	return (s->v[i]);
+}
+
+void
+samples_report(const char *what, struct samples *s)
+{
+	printf("%s: p50 %.3fms, p90 %.3fms, p99 %.3fms, max %.3fms\n", what,
+	    samples_pct(s, 50) / 1000.0, samples_pct(s, 90) / 1000.0,
+	    samples_pct(s, 99) / 1000.0, samples_pct(s, 100) / 1000.0);
+}
+
+static void
+usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s load | sink [options]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage();
+
+	if (!strcmp(argv[1], "load"))
+		return (load_main(argc - 1, argv + 1));
+	if (!strcmp(argv[1], "sink"))
+		return (sink_main(argc - 1, argv + 1));
+	usage();
+	return (1);
+}
@@ -0,0 +1,40 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* the header the load generator stamps, the sink reads it back */
+#define	BENCH_HEADER	"X-Bench-Time: "
+
+#define	BENCH_LINE_MAX	1024
+
+struct samples {
+	uint64_t	*v;
+	size_t		 n;
+	size_t		 size;
+	int		 sorted;
+};
+
+/* smtpbench.c */
+uint64_t	 now_usec(void);
+void		 samples_add(struct samples *, uint64_t);
+uint64_t	 samples_pct(struct samples *, double);
+void		 samples_report(const char *, struct samples *);
+int		 sock_nonblock(int);
+
+/* load.c */
+int		 load_main(int, char **);
+
+/* sink.c */
+int		 sink_main(int, char **);
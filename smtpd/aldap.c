@@ -39,6 +39,8 @@ char				*utoa(char *);
 char				*parseval(char *, size_t);
 int				aldap_create_page_control(struct ber_element *,
 				    int, struct aldap_page_control *);
+static int			 aldap_readn(int, u_char *, size_t);
+static u_char			*aldap_read_pdu(struct aldap *, size_t *);
 
 #ifdef DEBUG
 void			 ldap_debug_elements(struct ber_element *);
@@ -52,6 +54,8 @@ void			 ldap_debug_elements(struct ber_element *);
 #define LDAP_DEBUG(x, y)	do { } while (0)
 #endif
 
+size_t	aldap_pdu_max = LDAP_PDU_MAX;
+
 int
 aldap_close(struct aldap *al)
 {
@@ -244,6 +248,92 @@ fail:
 	return (-1);
 }
 
+/*
+ * Return the length of the LDAP message starting the buffer, 0 if its
+ * header is not complete yet, or -1 if it does not look like one.
+ */
+size_t
+aldap_pdulen(const void *buf, size_t len)
+{
+	const u_char	*p = buf;
+	size_t		 i, n, sz;
+
+	if (len < 2)
+		return (0);
+	if (p[0] != 0x30)	/* universal, constructed, sequence */
+		return ((size_t)-1);
+	if ((p[1] & 0x80) == 0)
+		return (2 + p[1]);
+
+	n = p[1] & 0x7f;
+	if (n == 0 || n > 4)
+		return ((size_t)-1);
+	if (len < 2 + n)
+		return (0);
+	for (sz = 0, i = 0; i < n; i++)
+		sz = sz << 8 | p[2 + i];
+	if (sz > aldap_pdu_max)
+		return ((size_t)-1);
+	return (2 + n + sz);
+}
+
+static int
+aldap_readn(int fd, u_char *buf, size_t len)
+{
+	ssize_t	r;
+
+	while (len > 0) {
+		if ((r = read(fd, buf, len)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return (-1);
+		}
+		if (r == 0)
+			return (-1);
+		buf += r;
+		len -= r;
+	}
+	return (0);
+}
+
+/*
+ * Read one whole message from the socket: the header a byte at a time
+ * so that nothing past the message is consumed, then the rest at once.
+ */
+static u_char *
+aldap_read_pdu(struct aldap *ldap, size_t *lenp)
+{
+	u_char	 hdr[6], *buf;
+	size_t	 off, len;
+
+	off = 0;
+	while ((len = aldap_pdulen(hdr, off)) == 0) {
+		if (off == sizeof(hdr) ||
+		    aldap_readn(ldap->ber.fd, hdr + off, 1) == -1)
+			return NULL;
+		off++;
+	}
+	if (len == (size_t)-1)
+		return NULL;
+
+	if ((buf = malloc(len)) == NULL)
+		return NULL;
+	memcpy(buf, hdr, off);
+	if (aldap_readn(ldap->ber.fd, buf + off, len - off) == -1) {
+		free(buf);
+		return NULL;
+	}
+
+	*lenp = len;
+	return buf;
+}
+
+/*
+ * The message is decoded into an arena, its strings point into the
+ * buffer it was read from: the one set on the ber, which must be kept
+ * until the message is freed, or one read from the socket and owned by
+ * the message.
+ */
 struct aldap_message *
 aldap_parse(struct aldap *ldap)
 {
@@ -252,11 +342,28 @@ aldap_parse(struct aldap *ldap)
 	long long		 msgid = 0;
 	struct aldap_message	*m;
 	struct ber_element	*a = NULL, *ep;
+	struct ber		 b, *ber;
+	size_t			 len;
 
 	if ((m = calloc(1, sizeof(struct aldap_message))) == NULL)
 		return NULL;
 
-	if ((m->msg = ber_read_elements(&ldap->ber, NULL)) == NULL)
+	ber = &ldap->ber;
+	if (ldap->ber.fd != -1) {
+		if ((m->buf = aldap_read_pdu(ldap, &len)) == NULL)
+			goto parsefail;
+		memset(&b, 0, sizeof(b));
+		b.fd = -1;
+		ber_set_readbuf(&b, m->buf, len);
+		ber = &b;
+	}
+
+	if ((m->arena = ber_arena_new()) == NULL)
+		goto parsefail;
+	ber_set_arena(ber, m->arena);
+	m->msg = ber_read_elements(ber, NULL);
+	ber_set_arena(ber, NULL);
+	if (m->msg == NULL)
 		goto parsefail;
 
 	LDAP_DEBUG("message", m->msg);
@@ -318,7 +425,7 @@ aldap_parse_page_control(struct ber_element *control, size_t len)
 	struct ber_element *elm;
 	struct aldap_page_control *page;
 
-	b.br_wbuf = NULL;
+	memset(&b, 0, sizeof(b));
 	b.fd = -1;
 	ber_scanf_elements(control, "ss", &oid, &encoded);
 	ber_set_readbuf(&b, encoded, control->be_next->be_len);
@@ -361,8 +468,9 @@ aldap_freepage(struct aldap_page_control *page)
 void
 aldap_freemsg(struct aldap_message *msg)
 {
-	if (msg->msg)
-		ber_free_elements(msg->msg);
+	/* the elements go with the arena */
+	ber_arena_free(msg->arena);
+	free(msg->buf);
 	free(msg);
 }
 
@@ -23,6 +23,9 @@
 #define LDAP_URL "ldap://"
 #define LDAP_PORT 389
 #define LDAP_PAGED_OID  "1.2.840.113556.1.4.319"
+/* default and ceiling of the max_pdu_size setting of table-ldap */
+#define LDAP_PDU_MAX	(1024 * 1024)
+#define LDAP_PDU_LIMIT	(64 * 1024 * 1024)
 
 struct aldap {
 #define ALDAP_ERR_SUCCESS		0
@@ -45,6 +48,8 @@ struct aldap_message {
 	int message_type;
 
 	struct ber_element	*msg;
+	struct ber_arena	*arena;
+	void			*buf;	/* read from the socket */
 
 	struct ber_element	*header;
 	struct ber_element	*protocol_op;
@@ -188,8 +193,11 @@ enum ldap_subfilter {
 	LDAP_FILT_SUBS_FIN	= 2,
 };
 
+extern size_t		 aldap_pdu_max;
+
 struct aldap		*aldap_init(int fd);
 int			 aldap_close(struct aldap *);
+size_t			 aldap_pdulen(const void *, size_t);
 struct aldap_message	*aldap_parse(struct aldap *);
 void			 aldap_freemsg(struct aldap_message *);
 
@@ -33,6 +33,10 @@
 #include "smtpd.h"
 #include "log.h"
 
+#define	VIRTUAL_KEYS	4
+
+static int aliases_virtual_keys(const struct mailaddr *, char *, size_t,
+    const char *[VIRTUAL_KEYS]);
 static int aliases_expand_include(struct expand *, const char *);
 
 int
@@ -74,103 +78,98 @@ aliases_get(struct expand *expand, const char *username)
 	return nbaliases;
 }
 
+/*
+ * The keys a virtual address is looked up with, most specific first:
+ * user@domain, user, @domain and the global catch all.
+ */
+static int
+aliases_virtual_keys(const struct mailaddr *maddr, char *buf, size_t len,
+    const char *keys[VIRTUAL_KEYS])
+{
+	char	*pbuf, *ubuf;
+	size_t	 n;
+
+	if (! bsnprintf(buf, len / 2, "%s@%s", maddr->user, maddr->domain))
+		return 0;
+	xlowercase(buf, buf, len / 2);
+
+	/* the user part is copied after the full address */
+	pbuf = strchr(buf, '@');
+	n = pbuf - buf;
+	ubuf = buf + strlen(buf) + 1;
+	memcpy(ubuf, buf, n);
+	ubuf[n] = '\0';
+
+	keys[0] = buf;
+	keys[1] = ubuf;
+	keys[2] = pbuf;
+	keys[3] = "@";
+	return 1;
+}
+
 int
 aliases_virtual_check(struct table *table, const struct mailaddr *maddr)
 {
-	char			buf[SMTPD_MAXLINESIZE];
-	char		       *pbuf;
-	int			ret;
-
-	if (! bsnprintf(buf, sizeof(buf), "%s@%s", maddr->user,
-		maddr->domain))
-		return 0;	
-	xlowercase(buf, buf, sizeof(buf));
+	char			buf[SMTPD_MAXLINESIZE * 2];
+	const char	       *keys[VIRTUAL_KEYS];
+	int			res[VIRTUAL_KEYS];
+	int			i;
 
-	/* First, we lookup for full entry: user@domain */
-	ret = table_lookup(table, buf, K_ALIAS, NULL);
-	if (ret < 0)
-		return (-1);
-	if (ret)
-		return 1;
+	if (! aliases_virtual_keys(maddr, buf, sizeof(buf), keys))
+		return 0;
 
-	/* Failed ? We lookup for username only */
-	pbuf = strchr(buf, '@');
-	*pbuf = '\0';
-	ret = table_lookup(table, buf, K_ALIAS, NULL);
-	if (ret < 0)
-		return (-1);
-	if (ret)
-		return 1;
-
-	*pbuf = '@';
-	/* Failed ? We lookup for catch all for virtual domain */
-	ret = table_lookup(table, pbuf, K_ALIAS, NULL);
-	if (ret < 0)
-		return (-1);
-	if (ret)
-		return 1;
-
-	/* Failed ? We lookup for a *global* catch all */
-	ret = table_lookup(table, "@", K_ALIAS, NULL);
-	if (ret <= 0)
-		return (ret);
+	/* all in one go, the first answer in order of preference wins */
+	table_lookup_batch(table, keys, VIRTUAL_KEYS, K_ALIAS, NULL, res);
+	for (i = 0; i < VIRTUAL_KEYS; i++) {
+		if (res[i] < 0)
+			return (-1);
+		if (res[i])
+			return 1;
+	}
 
-	return 1;
+	return 0;
 }
 
 int
 aliases_virtual_get(struct expand *expand, const struct mailaddr *maddr)
 {
 	struct expandnode      *xn;
-	union lookup		lk;
-	char			buf[SMTPD_MAXLINESIZE];
-	char		       *pbuf;
+	union lookup		lks[VIRTUAL_KEYS];
+	char			buf[SMTPD_MAXLINESIZE * 2];
+	const char	       *keys[VIRTUAL_KEYS];
+	int			res[VIRTUAL_KEYS];
 	int			nbaliases;
-	int			ret;
+	int			i, found, ret;
 	struct table	       *mapping = NULL;
 	struct table	       *userbase = NULL;
 
 	mapping = expand->rule->r_mapping;
 	userbase = expand->rule->r_userbase;
 
-	if (! bsnprintf(buf, sizeof(buf), "%s@%s", maddr->user,
-		maddr->domain))
-		return 0;	
-	xlowercase(buf, buf, sizeof(buf));
-
-	/* First, we lookup for full entry: user@domain */
-	ret = table_lookup(mapping, buf, K_ALIAS, &lk);
-	if (ret < 0)
-		return (-1);
-	if (ret)
-		goto expand;
+	if (! aliases_virtual_keys(maddr, buf, sizeof(buf), keys))
+		return 0;
 
-	/* Failed ? We lookup for username only */
-	pbuf = strchr(buf, '@');
-	*pbuf = '\0';
-	ret = table_lookup(mapping, buf, K_ALIAS, &lk);
-	if (ret < 0)
-		return (-1);
-	if (ret)
-		goto expand;
-
-	*pbuf = '@';
-	/* Failed ? We lookup for catch all for virtual domain */
-	ret = table_lookup(mapping, pbuf, K_ALIAS, &lk);
-	if (ret < 0)
-		return (-1);
-	if (ret)
-		goto expand;
-
-	/* Failed ? We lookup for a *global* catch all */
-	ret = table_lookup(mapping, "@", K_ALIAS, &lk);
+	/* all in one go, the first answer in order of preference wins */
+	table_lookup_batch(mapping, keys, VIRTUAL_KEYS, K_ALIAS, lks, res);
+	found = -1;
+	ret = 0;
+	for (i = 0; i < VIRTUAL_KEYS; i++) {
+		if (ret == 0 && res[i] < 0)
+			ret = -1;
+		else if (ret == 0 && res[i] > 0) {
+			ret = 1;
+			found = i;
+		}
+		else if (res[i] > 0)
+			expand_free(lks[i].expand);
+	}
 	if (ret <= 0)
 		return (ret);
+	i = found;
 
-expand:
 	/* foreach node in table_virtual expand, we merge */
 	nbaliases = 0;
-	RB_FOREACH(xn, expandtree, &lk.expand->tree) {
+	RB_FOREACH(xn, expandtree, &lks[i].expand->tree) {
 		if (xn->type == EXPAND_INCLUDE)
 			nbaliases += aliases_expand_include(expand,
 			    xn->u.buffer);
@@ -182,10 +181,10 @@ expand:
 		}
 	}
 
-	expand_free(lk.expand);
+	expand_free(lks[i].expand);
 
 	log_debug("debug: aliases_virtual_get: '%s' resolved to %d nodes",
-	    buf, nbaliases);
+	    keys[i], nbaliases);
 
 	return nbaliases;
 }
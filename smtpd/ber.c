@@ -29,6 +29,7 @@
 #include <strings.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "ber.h"
 
@@ -40,6 +41,17 @@
 #define BER_TAG_TYPE_MASK	0x7f
 #define BER_CLASS_SHIFT		6
 
+/*
+ * Elements decoded with an arena are carved out of blocks freed all at
+ * once with it, and their values point into the read buffer.
+ */
+#define BER_ARENA_ELEMENTS	128
+
+struct ber_arena {
+	struct ber_arena	*ba_next;	/* newest block, then older */
+	size_t			 ba_used;
+	struct ber_element	 ba_elm[BER_ARENA_ELEMENTS];
+};
 static int	ber_dump_element(struct ber *ber, struct ber_element *root);
 static void	ber_dump_header(struct ber *ber, struct ber_element *root);
 static void	ber_putc(struct ber *ber, u_char c);
@@ -51,6 +63,9 @@ static ssize_t	ber_read_element(struct ber *ber, struct ber_element *elm);
 static ssize_t	ber_readbuf(struct ber *b, void *buf, size_t nbytes);
 static ssize_t	ber_getc(struct ber *b, u_char *c);
 static ssize_t	ber_read(struct ber *ber, void *buf, size_t len);
+static struct ber_element *ber_read_get_element(struct ber *ber);
+static int	ber_read_inplace(struct ber *ber, struct ber_element *elm,
+		    size_t len, int nul);
 
 #ifdef DEBUG
 #define DPRINTF(...)	printf(__VA_ARGS__)
@@ -792,7 +807,7 @@ ber_read_elements(struct ber *ber, struct ber_element *elm)
 	struct ber_element *root = elm;
 
 	if (root == NULL) {
-		if ((root = ber_get_element(0)) == NULL)
+		if ((root = ber_read_get_element(ber)) == NULL)
 			return NULL;
 	}
 
@@ -800,7 +815,7 @@ ber_read_elements(struct ber *ber, struct ber_element *elm)
 
 	if (ber_read_element(ber, root) == -1) {
 		/* Cleanup if root was allocated by us */
-		if (elm == NULL)
+		if (elm == NULL && ber->br_arena == NULL)
 			ber_free_elements(root);
 		return NULL;
 	}
@@ -1109,6 +1124,11 @@ ber_read_element(struct ber *ber, struct ber_element *elm)
 		elm->be_numeric = val;
 		break;
 	case BER_TYPE_BITSTRING:
+		if (ber->br_arena) {
+			if (ber_read_inplace(ber, elm, len, 0) == -1)
+				return -1;
+			break;
+		}
 		elm->be_val = malloc(len);
 		if (elm->be_val == NULL)
 			return -1;
@@ -1118,6 +1138,11 @@ ber_read_element(struct ber *ber, struct ber_element *elm)
 		break;
 	case BER_TYPE_OCTETSTRING:
 	case BER_TYPE_OBJECT:
+		if (ber->br_arena) {
+			if (ber_read_inplace(ber, elm, len, 1) == -1)
+				return -1;
+			break;
+		}
 		elm->be_val = malloc(len + 1);
 		if (elm->be_val == NULL)
 			return -1;
@@ -1133,7 +1158,7 @@ ber_read_element(struct ber *ber, struct ber_element *elm)
 	case BER_TYPE_SEQUENCE:
 	case BER_TYPE_SET:
 		if (elm->be_sub == NULL) {
-			if ((elm->be_sub = ber_get_element(0)) == NULL)
+			if ((elm->be_sub = ber_read_get_element(ber)) == NULL)
 				return -1;
 		}
 		next = elm->be_sub;
@@ -1143,7 +1168,7 @@ ber_read_element(struct ber *ber, struct ber_element *elm)
 				return -1;
 			len -= r;
 			if (len > 0 && next->be_next == NULL) {
-				if ((next->be_next = ber_get_element(0)) ==
+				if ((next->be_next = ber_read_get_element(ber)) ==
 				    NULL)
 					return -1;
 			}
@@ -1154,6 +1179,96 @@ ber_read_element(struct ber *ber, struct ber_element *elm)
 	return totlen;
 }
 
+static struct ber_element *
+ber_read_get_element(struct ber *ber)
+{
+	struct ber_arena	*a, *b;
+	struct ber_element	*elm;
+
+	if ((a = ber->br_arena) == NULL)
+		return ber_get_element(0);
+
+	b = a->ba_next ? a->ba_next : a;
+	if (b->ba_used == BER_ARENA_ELEMENTS) {
+		if ((b = malloc(sizeof(*b))) == NULL)
+			return NULL;
+		b->ba_used = 0;
+		b->ba_next = a->ba_next;
+		a->ba_next = b;
+	}
+
+	elm = &b->ba_elm[b->ba_used++];
+	memset(elm, 0, sizeof(*elm));
+	ber_set_header(elm, BER_CLASS_UNIVERSAL, BER_TYPE_DEFAULT);
+
+	return elm;
+}
+
+/*
+ * Point the element to its value in the read buffer.  Strings are moved
+ * one byte back, over the end of their own header, to make room for
+ * the terminating NUL without touching the next element.
+ */
+static int
+ber_read_inplace(struct ber *ber, struct ber_element *elm, size_t len,
+    int nul)
+{
+	u_char	*v;
+
+	if (ber->br_rbuf == NULL || (size_t)(ber->br_rend - ber->br_rptr) < len)
+		return -1;
+
+	v = ber->br_rptr;
+	if (nul) {
+		memmove(v - 1, v, len);
+		v--;
+		v[len] = '\0';
+	}
+	elm->be_val = v;
+	elm->be_len = len;
+	elm->be_free = 0;
+	ber->br_rptr += len;
+
+	return 0;
+}
+
+struct ber_arena *
+ber_arena_new(void)
+{
+	struct ber_arena	*a;
+
+	if ((a = malloc(sizeof(*a))) == NULL)
+		return NULL;
+	a->ba_next = NULL;
+	a->ba_used = 0;
+
+	return a;
+}
+
+void
+ber_arena_free(struct ber_arena *a)
+{
+	struct ber_arena	*b;
+
+	if (a == NULL)
+		return;
+	while ((b = a->ba_next) != NULL) {
+		a->ba_next = b->ba_next;
+		free(b);
+	}
+	free(a);
+}
+
+/*
+ * Decode the following elements into the arena, until it is reset with
+ * NULL.  The read buffer must be set and outlive the elements.
+ */
+void
+ber_set_arena(struct ber *b, struct ber_arena *a)
+{
+	b->br_arena = a;
+}
+
 static ssize_t
 ber_readbuf(struct ber *b, void *buf, size_t nbytes)
 {
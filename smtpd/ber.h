@@ -34,6 +34,8 @@ struct ber_element {
 #define be_numeric	be_union.bv_numeric
 };
 
+struct ber_arena;
+
 struct ber {
 	int	 fd;
 	u_char	*br_wbuf;
@@ -44,6 +46,7 @@ struct ber {
 	u_char	*br_rend;
 
 	unsigned long	(*br_application)(struct ber_element *);
+	struct ber_arena *br_arena;
 };
 
 /* well-known ber_element types */
@@ -125,4 +128,7 @@ size_t			 ber_calc_len(struct ber_element *);
 void			 ber_set_application(struct ber *,
 			    unsigned long (*)(struct ber_element *));
 void			 ber_free(struct ber *);
+struct ber_arena	*ber_arena_new(void);
+void			 ber_arena_free(struct ber_arena *);
+void			 ber_set_arena(struct ber *, struct ber_arena *);
 __END_DECLS
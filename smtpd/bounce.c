@@ -40,7 +40,13 @@
 #include "log.h"
 
 #define BOUNCE_MAXRUN	2
+#define BOUNCE_MAXRUN_MAX	8
+#define BOUNCE_MSG_PER_RUN	64	/* pending messages for one more session */
 #define BOUNCE_HIWAT	65535
+#define BOUNCE_CHUNK	16384
+/* reports for a message are collected for this long, more if busy */
+#define BOUNCE_WINDOW		1
+#define BOUNCE_WINDOW_MAX	30
 
 enum {
 	BOUNCE_EHLO,
@@ -75,6 +81,8 @@ struct bounce_session {
 	char				*smtpname;
 	struct bounce_message		*msg;
 	FILE				*msgfp;
+	int				 headers;	/* only up to the body */
+	int				 midline;
 	int				 state;
 	struct iobuf			 iobuf;
 	struct io			 io;
@@ -87,7 +95,9 @@ SPLAY_PROTOTYPE(bounce_message_tree, bounce_message, sp_entry,
     bounce_message_cmp);
 
 static void bounce_drain(void);
+static int  bounce_maxrun(void);
 static void bounce_send(struct bounce_session *, const char *, ...);
+static int  bounce_queue_chunk(struct bounce_session *, const char *, size_t);
 static int  bounce_next_message(struct bounce_session *);
 static int  bounce_next(struct bounce_session *);
 static void bounce_delivery(struct bounce_message *, int, const char *);
@@ -126,6 +136,7 @@ bounce_add(uint64_t evpid)
 	struct envelope		 evp;
 	struct bounce_message	 key, *msg;
 	struct bounce_envelope	*be;
+	time_t			 window;
 
 	bounce_init();
 
@@ -145,6 +156,14 @@ bounce_add(uint64_t evpid)
 	key.smtpname = evp.smtpname;
 	msg = SPLAY_FIND(bounce_message_tree, &messages, &key);
 	if (msg == NULL) {
+		/*
+		 * Hold new messages longer when the reports pile up, so
+		 * an outage yields one notice per message, not per report.
+		 */
+		window = BOUNCE_WINDOW + nmessage / BOUNCE_MSG_PER_RUN;
+		if (window > BOUNCE_WINDOW_MAX)
+			window = BOUNCE_WINDOW_MAX;
+
 		msg = xcalloc(1, sizeof(*msg), "bounce_add");
 		msg->msgid = key.msgid;
 		msg->bounce = key.bounce;
@@ -155,6 +174,7 @@ bounce_add(uint64_t evpid)
 		snprintf(buf, sizeof(buf), "%s@%s", evp.sender.user,
 		    evp.sender.domain);
 		msg->to = xstrdup(buf, "bounce_add");
+		msg->timeout = time(NULL) + window;
 		nmessage += 1;
 		SPLAY_INSERT(bounce_message_tree, &messages, msg);
 		log_debug("debug: bounce: new message %08" PRIx32,
@@ -176,7 +196,6 @@ bounce_add(uint64_t evpid)
 	buf[strcspn(buf, "\n")] = '\0';
 	log_debug("debug: bounce: adding report %16"PRIx64": %s", be->id, buf);
 
-	msg->timeout = time(NULL) + 1;
 	TAILQ_INSERT_TAIL(&pending, msg, entry);
 
 	stat_increment("bounce.envelope", 1);
@@ -222,6 +241,16 @@ bounce_timeout(int fd, short ev, void *arg)
 	bounce_drain();
 }
 
+/* one more session for each batch of pending messages, up to a limit */
+static int
+bounce_maxrun(void)
+{
+	int	n;
+
+	n = BOUNCE_MAXRUN + nmessage / BOUNCE_MSG_PER_RUN;
+	return (n > BOUNCE_MAXRUN_MAX ? BOUNCE_MAXRUN_MAX : n);
+}
+
 static void
 bounce_drain()
 {
@@ -233,7 +262,7 @@ bounce_drain()
 	    nmessage, running);
 
 	while (1) {
-		if (running >= BOUNCE_MAXRUN) {
+		if (running >= bounce_maxrun()) {
 			log_debug("debug: bounce: max session reached");
 			return;
 		}
@@ -360,7 +389,15 @@ bounce_next_message(struct bounce_session *s)
 	TAILQ_REMOVE(&pending, msg, entry);
 	SPLAY_REMOVE(bounce_message_tree, &messages, msg);
 
-	if ((fd = queue_message_fd_r(msg->msgid)) == -1) {
+	/* a delay warning does not need more than the headers */
+	s->headers = (msg->bounce.type == B_WARNING ||
+	    (msg->bounce.type == B_DSN && msg->bounce.dsn_ret == DSN_RETHDRS));
+	s->midline = 0;
+	if (s->headers)
+		fd = queue_message_fd_r_head(msg->msgid);
+	else
+		fd = queue_message_fd_r(msg->msgid);
+	if (fd == -1) {
 		bounce_delivery(msg, IMSG_DELIVERY_TEMPFAIL,
 		    "Could not open message fd");
 		goto again;		
@@ -381,9 +418,10 @@ bounce_next_message(struct bounce_session *s)
 static int
 bounce_next(struct bounce_session *s)
 {
+	static char		 buf[BOUNCE_CHUNK];
 	struct bounce_envelope	*evp;
-	char			*line;
 	size_t			 len, n;
+	int			 eom;
 
 	switch (s->state) {
 	case BOUNCE_EHLO:
@@ -477,23 +515,11 @@ bounce_next(struct bounce_session *s)
 
 		n = iobuf_queued(&s->iobuf);
 
-		while (iobuf_queued(&s->iobuf) < BOUNCE_HIWAT) {
-			line = fgetln(s->msgfp, &len);
-			if (line == NULL)
+		eom = 0;
+		while (! eom && iobuf_queued(&s->iobuf) < BOUNCE_HIWAT) {
+			if ((len = fread(buf, 1, sizeof buf, s->msgfp)) == 0)
 				break;
-			if (len == 1 && line[0] == '\n' && /* end of headers */
-			    s->msg->bounce.type == B_DSN &&
-			    s->msg->bounce.dsn_ret ==  DSN_RETHDRS) {
-				fclose(s->msgfp);
-				s->msgfp = NULL;
-				bounce_send(s, ".");
-				s->state = BOUNCE_DATA_END;
-				return (0);
-			}
-			line[len - 1] = '\0';
-			iobuf_xfqueue(&s->iobuf,
-			    "bounce_next: DATA_MESSAGE", "%s%s\n",
-			    (len == 2 && line[0] == '.') ? "." : "", line);
+			eom = bounce_queue_chunk(s, buf, len);
 		}
 
 		if (ferror(s->msgfp)) {
@@ -508,9 +534,12 @@ bounce_next(struct bounce_session *s)
 		log_trace(TRACE_BOUNCE, "bounce: %p: >>> [... %zu bytes ...]",
 		    s, iobuf_queued(&s->iobuf) - n);
 
-		if (feof(s->msgfp)) {
+		if (eom || feof(s->msgfp)) {
 			fclose(s->msgfp);
 			s->msgfp = NULL;
+			if (s->midline)
+				iobuf_xfqueue(&s->iobuf,
+				    "bounce_next: DATA_MESSAGE", "\n");
 			bounce_send(s, ".");
 			s->state = BOUNCE_DATA_END;
 		}
@@ -528,6 +557,56 @@ bounce_next(struct bounce_session *s)
 	return (0);
 }
 
+/*
+ * Queue a block of the original message, dot-stuffing the lines.  When
+ * only the headers are returned, stop at the empty line and return 1.
+ */
+static int
+bounce_queue_chunk(struct bounce_session *s, const char *data, size_t len)
+{
+	const char	*p, *nl, *end;
+	char		*out;
+	size_t		 extra;
+	int		 eoh = 0;
+
+	if (s->headers) {
+		for (p = data; p < data + len; p = nl + 1) {
+			if (*p == '\n' && (p > data || ! s->midline)) {
+				len = p - data;
+				eoh = 1;
+				break;
+			}
+			if ((nl = memchr(p, '\n', data + len - p)) == NULL)
+				break;
+		}
+		if (len == 0) {
+			s->midline = 0;
+			return (eoh);
+		}
+	}
+	end = data + len;
+
+	extra = (! s->midline && *data == '.');
+	for (p = data; (nl = memchr(p, '\n', end - p)); p = nl + 1)
+		if (nl + 1 < end && nl[1] == '.')
+			extra++;
+
+	if ((out = iobuf_reserve(&s->iobuf, len + extra)) == NULL)
+		fatal("bounce: iobuf_reserve");
+
+	if (! s->midline && *data == '.')
+		*out++ = '.';
+	for (p = data; (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		memcpy(out, p, nl - p + 1);
+		out += nl - p + 1;
+		if (nl + 1 < end && nl[1] == '.')
+			*out++ = '.';
+	}
+	memcpy(out, p, end - p);
+
+	s->midline = (end[-1] != '\n');
+	return (eoh);
+}
 
 static void
 bounce_delivery(struct bounce_message *msg, int delivery, const char *status)
@@ -17,13 +17,80 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <imsg.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
 #include <openssl/ssl.h>
+#ifdef SSL_MODE_ASYNC
+#include <openssl/async.h>
+#define CA_ASYNC
+#endif
 
+#include "smtpd.h"
 #include "log.h"
+#include "ssl.h"
+
+static void ca_imsg(struct mproc *, struct imsg *);
+static void ca_shutdown(void);
+static void ca_sig_handler(int, short, void *);
+static RSA *ca_key(const char *);
+static int ca_rsa_op(struct mproc *, uint32_t, struct msg *);
+static void ca_pki_op(struct mproc *, struct msg *);
+static int ca_request(uint32_t, uint64_t, struct imsg *, struct msg *);
+static void ca_sync(struct imsg *);
+static int ca_rsa_send(int, const unsigned char *, unsigned char *, RSA *,
+    int, uint32_t);
+static int ca_rsa_priv_enc(int, const unsigned char *, unsigned char *,
+    RSA *, int);
+static int ca_rsa_priv_dec(int, const unsigned char *, unsigned char *,
+    RSA *, int);
+
+/* private keys, in the ca process only, parsed on first use */
+static struct dict	ca_keys;
 
-int	ca_X509_verify(X509 *, STACK_OF(X509) *, const char *, const char *, const char **);
+/* in the smtp and mta processes, RSA keys whose private part is in the ca */
+#ifndef CA_ASYNC
+static RSA_METHOD	ca_rsa_method_store;
+#endif
+static RSA_METHOD	*ca_rsa_method;
+static int		 ca_rsa_idx = -1;
+static uint64_t		 ca_reqid;
+
+/*
+ * With SSL_MODE_ASYNC, the handshakes run as jobs and a request to the
+ * ca pauses its job: SSL_accept() or SSL_connect() returns
+ * SSL_ERROR_WANT_ASYNC, the io attaches itself to the request and is
+ * resumed once the reply came through the event loop.  The requests of
+ * all the handshakes in progress go out together, and the ca serves
+ * them in one go.
+ */
+struct ca_op {
+	uint64_t	 id;
+	int		 done;
+	int		 orphan;	/* its io went away */
+	struct imsg	 imsg;
+	void		(*cb)(void *);
+	void		*arg;
+};
+
+static struct tree	 ca_ops;
+static struct ca_op	*ca_op_last;	/* what the last paused job waits for */
 
 static int
 verify_cb(int ok, X509_STORE_CTX *ctx)
@@ -50,7 +117,7 @@ verify_cb(int ok, X509_STORE_CTX *ctx)
 }
 
 int
-ca_X509_verify(X509 *certificate, STACK_OF(X509) *chain, const char *CAfile,
+ca_X509_verify(void *certificate, void *chain, const char *CAfile,
     const char *CRLfile, const char **errstr)
 {
 	X509_STORE     *store = NULL;
@@ -69,7 +136,8 @@ ca_X509_verify(X509 *certificate, STACK_OF(X509) *chain, const char *CAfile,
 	if ((xsc = X509_STORE_CTX_new()) == NULL)
 		goto end;
 
-	if (X509_STORE_CTX_init(xsc, store, certificate, chain) != 1)
+	if (X509_STORE_CTX_init(xsc, store, (X509 *)certificate,
+	    (STACK_OF(X509) *)chain) != 1)
 		goto end;
 
 	X509_STORE_CTX_set_verify_cb(xsc, verify_cb);
@@ -80,7 +148,8 @@ end:
 	*errstr = NULL;
 	if (ret != 1) {
 		if (xsc)
-			*errstr = X509_verify_cert_error_string(xsc->error);
+			*errstr = X509_verify_cert_error_string(
+			    X509_STORE_CTX_get_error(xsc));
 		else if (ERR_peek_last_error())
 			*errstr = ERR_error_string(ERR_peek_last_error(), NULL);
 	}
@@ -92,3 +161,558 @@ end:
 
 	return ret > 0 ? 1 : 0;
 }
+
+pid_t
+ca(void)
+{
+	pid_t		 pid;
+	struct passwd	*pw;
+	struct event	 ev_sigint;
+	struct event	 ev_sigterm;
+
+	switch (pid = fork()) {
+	case -1:
+		fatal("ca: cannot fork");
+	case 0:
+		post_fork(PROC_CA);
+		break;
+	default:
+		return (pid);
+	}
+
+	dict_init(&ca_keys);
+
+	/* the pki are kept to serve SNI certificates and parse keys lazily */
+	purge_config(PURGE_EVERYTHING & ~PURGE_PKI);
+
+	if ((pw = getpwnam(SMTPD_USER)) == NULL)
+		fatalx("unknown user " SMTPD_USER);
+
+	if (chroot(PATH_CHROOT) == -1)
+		fatal("ca: chroot");
+	if (chdir("/") == -1)
+		fatal("ca: chdir(\"/\")");
+
+	config_process(PROC_CA);
+
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
+		fatal("ca: cannot drop privileges");
+
+	imsg_callback = ca_imsg;
+	event_init();
+
+	signal_set(&ev_sigint, SIGINT, ca_sig_handler, NULL);
+	signal_set(&ev_sigterm, SIGTERM, ca_sig_handler, NULL);
+	signal_add(&ev_sigint, NULL);
+	signal_add(&ev_sigterm, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	config_peer(PROC_CONTROL);
+	config_peer(PROC_SMTP);
+	config_peer(PROC_MTA);
+	config_done();
+
+	if (event_dispatch() < 0)
+		fatal("event_dispatch");
+	ca_shutdown();
+
+	return (0);
+}
+
+static void
+ca_sig_handler(int sig, short event, void *p)
+{
+	switch (sig) {
+	case SIGINT:
+	case SIGTERM:
+		ca_shutdown();
+		break;
+	default:
+		fatalx("ca_sig_handler: unexpected signal");
+	}
+}
+
+static void
+ca_shutdown(void)
+{
+	log_info("info: ca agent exiting");
+	_exit(0);
+}
+
+static RSA *
+ca_key(const char *name)
+{
+	struct pki	*pki;
+	BIO		*bio;
+	RSA		*rsa;
+
+	if ((rsa = dict_get(&ca_keys, name)) != NULL)
+		return (rsa);
+
+	if ((pki = dict_get(env->sc_pki_dict, name)) == NULL ||
+	    pki->pki_key == NULL)
+		return (NULL);
+	if ((bio = BIO_new_mem_buf(pki->pki_key, pki->pki_key_len)) == NULL)
+		fatalx("ca_key: BIO_new_mem_buf");
+	rsa = PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (rsa == NULL) {
+		log_warnx("warn: ca: no RSA key for pki %s", name);
+		return (NULL);
+	}
+
+	/* the parsed key is all we need from now on */
+	memset(pki->pki_key, 0, pki->pki_key_len);
+	free(pki->pki_key);
+	pki->pki_key = NULL;
+	pki->pki_key_len = 0;
+
+	dict_xset(&ca_keys, name, rsa);
+	return (rsa);
+}
+
+/*
+ * All requests read from a peer in one go are served before the
+ * replies are flushed, so a burst of handshakes costs one write back.
+ */
+static void
+ca_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct msg	m;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CA_PRIVENC:
+	case IMSG_CA_PRIVDEC:
+		m_msg(&m, imsg);
+		ca_rsa_op(p, imsg->hdr.type, &m);
+		stat_increment(imsg->hdr.type == IMSG_CA_PRIVENC ?
+		    "ca.rsa.privenc" : "ca.rsa.privdec", 1);
+		return;
+
+	case IMSG_CA_PKI:
+		m_msg(&m, imsg);
+		ca_pki_op(p, &m);
+		stat_increment("ca.pki", 1);
+		return;
+	}
+
+	log_warnx("ca_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
+	fatalx(NULL);
+}
+
+static int
+ca_rsa_op(struct mproc *p, uint32_t type, struct msg *m)
+{
+	char		 name[SMTPD_MAXPATHLEN];
+	const char	*pkiname;
+	const void	*from;
+	unsigned char	*to;
+	uint64_t	 id;
+	size_t		 flen;
+	int		 padding, ret;
+	RSA		*rsa;
+
+	m_get_id(m, &id);
+	m_get_string(m, &pkiname);
+	m_get_data(m, &from, &flen);
+	m_get_int(m, &padding);
+	m_end(m);
+
+	xlowercase(name, pkiname, sizeof name);
+	to = NULL;
+	ret = -1;
+	if ((rsa = ca_key(name)) == NULL)
+		log_warnx("warn: ca: no key for pki %s", name);
+	else {
+		to = xcalloc(1, RSA_size(rsa), "ca_rsa_op");
+		if (type == IMSG_CA_PRIVENC)
+			ret = RSA_private_encrypt(flen, from, to, rsa, padding);
+		else
+			ret = RSA_private_decrypt(flen, from, to, rsa, padding);
+		if (ret <= 0)
+			ssl_error("ca_rsa_op");
+	}
+
+	m_create(p, type, 0, 0, -1);
+	m_add_id(p, id);
+	m_add_int(p, ret);
+	if (ret > 0)
+		m_add_data(p, to, ret);
+	m_close(p);
+
+	if (to) {
+		memset(to, 0, RSA_size(rsa));
+		free(to);
+	}
+
+	return (ret);
+}
+
+/* the certificate and dhparams of a pki, for a context built on demand */
+static void
+ca_pki_op(struct mproc *p, struct msg *m)
+{
+	char		 name[SMTPD_MAXPATHLEN];
+	const char	*pkiname;
+	struct pki	*pki;
+	uint64_t	 id;
+
+	m_get_id(m, &id);
+	m_get_string(m, &pkiname);
+	m_end(m);
+
+	xlowercase(name, pkiname, sizeof name);
+	pki = dict_get(env->sc_pki_dict, name);
+
+	m_create(p, IMSG_CA_PKI, 0, 0, -1);
+	m_add_id(p, id);
+	m_add_int(p, pki != NULL);
+	if (pki) {
+		m_add_data(p, pki->pki_cert, pki->pki_cert_len);
+		m_add_data(p, pki->pki_dhparams, pki->pki_dhparams_len);
+	}
+	m_close(p);
+}
+
+/*
+ * In the smtp and mta processes: make the private key operations of
+ * the SSL contexts go through the ca process.
+ */
+void
+ca_init(void)
+{
+	const RSA_METHOD	*def;
+
+	if ((def = RSA_get_default_method()) == NULL)
+		fatalx("ca_init: no default RSA method");
+
+#ifdef CA_ASYNC
+	if ((ca_rsa_method = RSA_meth_dup(def)) == NULL ||
+	    !RSA_meth_set1_name(ca_rsa_method, "RSA privsep") ||
+	    !RSA_meth_set_priv_enc(ca_rsa_method, ca_rsa_priv_enc) ||
+	    !RSA_meth_set_priv_dec(ca_rsa_method, ca_rsa_priv_dec))
+		fatalx("ca_init: cannot set up the RSA method");
+	tree_init(&ca_ops);
+#else
+	ca_rsa_method_store = *def;
+	ca_rsa_method = &ca_rsa_method_store;
+	ca_rsa_method->name = "RSA privsep";
+	ca_rsa_method->rsa_priv_enc = ca_rsa_priv_enc;
+	ca_rsa_method->rsa_priv_dec = ca_rsa_priv_dec;
+#endif
+
+	if ((ca_rsa_idx = RSA_get_ex_new_index(0, NULL, NULL, NULL, NULL)) == -1)
+		fatalx("ca_init: RSA_get_ex_new_index");
+}
+
+/*
+ * Use the public key of the certificate as private key for the context,
+ * with the private operations done by the ca process from its copy of
+ * the key for the pki.  Only RSA keys can be used this way, the others
+ * are refused.
+ */
+int
+ca_use_private_key(SSL_CTX *ctx, const char *pkiname, char *cert,
+    off_t cert_len)
+{
+	BIO		*bio = NULL;
+	X509		*x509 = NULL;
+	EVP_PKEY	*pkey = NULL;
+	RSA		*rsa = NULL;
+	int		 ret = 0;
+
+	if ((bio = BIO_new_mem_buf(cert, cert_len)) == NULL)
+		goto end;
+	if ((x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL)) == NULL)
+		goto end;
+	if ((pkey = X509_get_pubkey(x509)) == NULL)
+		goto end;
+	if (EVP_PKEY_id(pkey) != EVP_PKEY_RSA) {
+		log_warnx("warn: pki %s: only RSA keys are supported "
+		    "by the ca", pkiname);
+		ret = -1;
+		goto end;
+	}
+	if ((rsa = EVP_PKEY_get1_RSA(pkey)) == NULL)
+		goto end;
+
+	if (!RSA_set_method(rsa, ca_rsa_method))
+		goto end;
+	if (!RSA_set_ex_data(rsa, ca_rsa_idx, xstrdup(pkiname, "ca_use_key")))
+		goto end;
+
+	ret = SSL_CTX_use_PrivateKey(ctx, pkey);
+#ifdef CA_ASYNC
+	SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+#endif
+
+end:
+	if (ret == 0)
+		ssl_error("ca_use_private_key");
+	if (rsa)
+		RSA_free(rsa);
+	if (pkey)
+		EVP_PKEY_free(pkey);
+	if (x509)
+		X509_free(x509);
+	if (bio)
+		BIO_free(bio);
+
+	return (ret == -1 ? 0 : ret);
+}
+
+/*
+ * Get the reply to request reqid just queued for p_ca.  A handshake
+ * running as a job waits for it paused, otherwise the reply is waited
+ * for synchronously.  Returns -1 if the session went away meanwhile.
+ */
+static int
+ca_request(uint32_t type, uint64_t reqid, struct imsg *imsg, struct msg *m)
+{
+	uint64_t	 id;
+#ifdef CA_ASYNC
+	struct ca_op	*op;
+
+	if (ASYNC_get_current_job() != NULL) {
+		op = xcalloc(1, sizeof *op, "ca_request");
+		op->id = reqid;
+		tree_xset(&ca_ops, op->id, op);
+		ca_op_last = op;
+		while (! op->done)
+			ASYNC_pause_job();
+		if (op->orphan)
+			/* freed when the reply comes in */
+			return (-1);
+		*imsg = op->imsg;
+		free(op);
+	}
+	else
+#endif
+		ca_sync(imsg);
+
+	if (imsg->hdr.type != type)
+		fatalx("ca_request: unexpected imsg");
+	m_msg(m, imsg);
+	m_get_id(m, &id);
+	if (id != reqid)
+		fatalx("ca_request: unexpected reply");
+	return (0);
+}
+
+/*
+ * OpenSSL without SSL_MODE_ASYNC cannot suspend a handshake in the
+ * middle of a private key operation or of the SNI callback: flush the
+ * request and wait for the reply of request ca_reqid on the ca pipe
+ * without going through the event loop.  The replies of paused
+ * handshakes read meanwhile are dispatched.
+ */
+static void
+ca_sync(struct imsg *imsg)
+{
+	struct imsgbuf	*ibuf = &p_ca->imsgbuf;
+	struct pollfd	 pfd;
+	struct msg	 m;
+	uint64_t	 id;
+	ssize_t		 n;
+
+	if (imsg_flush(ibuf) == -1)
+		fatal("ca_sync: imsg_flush");
+
+	for (;;) {
+		if ((n = imsg_get(ibuf, imsg)) == -1)
+			fatalx("ca_sync: imsg_get");
+		if (n) {
+			m_msg(&m, imsg);
+			m_get_id(&m, &id);
+			if (id == ca_reqid)
+				break;
+			ca_reply(imsg);
+			imsg_free(imsg);
+			continue;
+		}
+
+		pfd.fd = ibuf->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("ca_sync: poll");
+		}
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			fatal("ca_sync: imsg_read");
+		if (n == 0)
+			fatalx("ca_sync: pipe closed");
+	}
+
+	/* rearm the event for the pipe */
+	mproc_enable(p_ca);
+}
+
+/*
+ * A reply of the ca read by the event loop, for a paused handshake.
+ */
+void
+ca_reply(struct imsg *imsg)
+{
+#ifdef CA_ASYNC
+	struct ca_op	*op;
+	struct msg	 m;
+	uint64_t	 id;
+
+	if (imsg == NULL)
+		fatalx("ca_reply: ca pipe closed");
+
+	m_msg(&m, imsg);
+	m_get_id(&m, &id);
+	if ((op = tree_pop(&ca_ops, id)) == NULL)
+		fatalx("ca_reply: unexpected reply");
+	if (op->orphan) {
+		free(op);
+		return;
+	}
+
+	op->imsg = *imsg;
+	op->imsg.data = xmemdup(imsg->data, imsg->hdr.len - IMSG_HEADER_SIZE,
+	    "ca_reply");
+	op->done = 1;
+	if (op->cb)
+		op->cb(op->arg);
+#else
+	fatalx("ca_reply: unexpected reply");
+#endif
+}
+
+/*
+ * Called by the io whose handshake just paused, to be resumed with
+ * cb(arg) when the reply is in.
+ */
+int
+ca_async_attach(void (*cb)(void *), void *arg)
+{
+	if (ca_op_last == NULL)
+		return (-1);
+	ca_op_last->cb = cb;
+	ca_op_last->arg = arg;
+	ca_op_last = NULL;
+	return (0);
+}
+
+/*
+ * The io of arg goes away with its handshake paused: fail its request,
+ * the reply will be dropped.  Returns 1 if the job must be run to its
+ * end before the SSL is freed.
+ */
+int
+ca_async_detach(void *arg)
+{
+#ifdef CA_ASYNC
+	struct ca_op	*op;
+	void		*iter;
+
+	iter = NULL;
+	while (tree_iter(&ca_ops, &iter, NULL, (void **)&op)) {
+		if (op->arg != arg || op->done)
+			continue;
+		op->orphan = 1;
+		op->done = 1;
+		op->cb = NULL;
+		op->arg = NULL;
+		return (1);
+	}
+#endif
+	return (0);
+}
+
+static int
+ca_rsa_send(int flen, const unsigned char *from, unsigned char *to,
+    RSA *rsa, int padding, uint32_t type)
+{
+	struct imsg	 imsg;
+	struct msg	 m;
+	const char	*pkiname;
+	const void	*data;
+	uint64_t	 reqid;
+	size_t		 len;
+	int		 ret;
+
+	if ((pkiname = RSA_get_ex_data(rsa, ca_rsa_idx)) == NULL)
+		return (-1);
+
+	reqid = ++ca_reqid;
+	m_create(p_ca, type, 0, 0, -1);
+	m_add_id(p_ca, reqid);
+	m_add_string(p_ca, pkiname);
+	m_add_data(p_ca, from, flen);
+	m_add_int(p_ca, padding);
+	m_close(p_ca);
+
+	if (ca_request(type, reqid, &imsg, &m) == -1)
+		return (-1);
+	m_get_int(&m, &ret);
+	if (ret > 0) {
+		m_get_data(&m, &data, &len);
+		memcpy(to, data, len);
+	}
+	m_end(&m);
+	imsg_free(&imsg);
+
+	return (ret);
+}
+
+/*
+ * Fetch the certificate and dhparams of a pki from the ca, for the
+ * smtp process to build a context when a client asks for it by SNI.
+ */
+int
+ca_fetch_pki(const char *pkiname, struct pki *pki)
+{
+	struct imsg	 imsg;
+	struct msg	 m;
+	const void	*data;
+	uint64_t	 reqid;
+	size_t		 len;
+	int		 found;
+
+	reqid = ++ca_reqid;
+	m_create(p_ca, IMSG_CA_PKI, 0, 0, -1);
+	m_add_id(p_ca, reqid);
+	m_add_string(p_ca, pkiname);
+	m_close(p_ca);
+
+	if (ca_request(IMSG_CA_PKI, reqid, &imsg, &m) == -1)
+		return (0);
+	m_get_int(&m, &found);
+	if (found) {
+		memset(pki, 0, sizeof *pki);
+		xlowercase(pki->pki_name, pkiname, sizeof pki->pki_name);
+		m_get_data(&m, &data, &len);
+		pki->pki_cert = xmemdup(data, len, "ca_fetch_pki");
+		pki->pki_cert_len = len;
+		m_get_data(&m, &data, &len);
+		if (len) {
+			pki->pki_dhparams = xmemdup(data, len, "ca_fetch_pki");
+			pki->pki_dhparams_len = len;
+		}
+	}
+	m_end(&m);
+	imsg_free(&imsg);
+
+	return (found);
+}
+
+static int
+ca_rsa_priv_enc(int flen, const unsigned char *from, unsigned char *to,
+    RSA *rsa, int padding)
+{
+	return (ca_rsa_send(flen, from, to, rsa, padding, IMSG_CA_PRIVENC));
+}
+
+static int
+ca_rsa_priv_dec(int flen, const unsigned char *from, unsigned char *to,
+    RSA *rsa, int padding)
+{
+	return (ca_rsa_send(flen, from, to, rsa, padding, IMSG_CA_PRIVDEC));
+}
@@ -34,16 +34,56 @@
 #define	BUFFER_SIZE	16364
 
 extern struct compress_backend compress_gzip;
+#ifdef HAVE_LZ4
+extern struct compress_backend compress_lz4;
+#endif
+#ifdef HAVE_ZSTD
+extern struct compress_backend compress_zstd;
+#endif
+
+static struct compress_backend *compress_backend_detect(int);
 
 struct compress_backend *
 compress_backend_lookup(const char *name)
 {
 	if (!strcmp(name, "gzip"))
 		return &compress_gzip;
+#ifdef HAVE_LZ4
+	if (!strcmp(name, "lz4"))
+		return &compress_lz4;
+#endif
+#ifdef HAVE_ZSTD
+	if (!strcmp(name, "zstd"))
+		return &compress_zstd;
+#endif
 
 	return NULL;
 }
 
+/*
+ * All backends write self-describing frames, so data is uncompressed by
+ * the backend which produced it, whatever the current setting.  The first
+ * byte of the gzip, lz4 and zstd magics is enough to tell them apart.
+ */
+static struct compress_backend *
+compress_backend_detect(int c)
+{
+	switch (c) {
+	case 0x1f:
+		return &compress_gzip;
+#ifdef HAVE_LZ4
+	case 0x04:
+		return &compress_lz4;
+#endif
+#ifdef HAVE_ZSTD
+	case 0x28:
+		return &compress_zstd;
+#endif
+	default:
+		return (env->sc_comp);
+	}
+}
+
 size_t
 compress_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 {
@@ -53,7 +93,13 @@ compress_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 size_t
 uncompress_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 {
-	return (env->sc_comp->uncompress_chunk(ib, ibsz, ob, obsz));
+	struct compress_backend	*comp;
+
+	if (ibsz == 0)
+		return (0);
+	comp = compress_backend_detect(*(unsigned char *)ib);
+
+	return (comp->uncompress_chunk(ib, ibsz, ob, obsz));
 }
 
 int
@@ -65,5 +111,14 @@ compress_file(FILE *ifile, FILE *ofile)
 int
 uncompress_file(FILE *ifile, FILE *ofile)
 {
-	return (env->sc_comp->uncompress_file(ifile, ofile));
+	struct compress_backend	*comp;
+	int			 c;
+
+	if ((c = getc(ifile)) == EOF)
+		return (0);
+	if (ungetc(c, ifile) == EOF)
+		return (0);
+	comp = compress_backend_detect(c);
+
+	return (comp->uncompress_file(ifile, ofile));
 }
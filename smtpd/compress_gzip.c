@@ -156,28 +156,46 @@ end:
 static int
 uncompress_gzip_file(FILE *in, FILE *out)
 {
-	gzFile  gzf;
-	char  obuf[GZIP_BUFFER_SIZE];
-	int  r, w;
-	int  ret = 0;
+	z_stream	strm;
+	unsigned char	ibuf[GZIP_BUFFER_SIZE];
+	unsigned char	obuf[GZIP_BUFFER_SIZE];
+	size_t		r, n;
+	int		zr = Z_OK;
+	int		ret = 0;
 
 	if (in == NULL || out == NULL)
 		return (0);
 
-	gzf = gzdopen(fileno(in), "r");
-	if (gzf == NULL)
+	/*
+	 * Read through stdio rather than gzdopen(), the caller may
+	 * already have buffered the beginning of the stream.
+	 */
+	memset(&strm, 0, sizeof strm);
+	if (inflateInit2(&strm, (15+16)) != Z_OK)
 		return (0);
 
-	while ((r = gzread(gzf, obuf, sizeof(obuf))) > 0) {
-		if  ((w = fwrite(obuf, r, 1, out)) != 1)
-			goto end;
+	while (zr != Z_STREAM_END &&
+	    (r = fread(ibuf, 1, sizeof ibuf, in)) != 0) {
+		strm.next_in = ibuf;
+		strm.avail_in = r;
+		do {
+			strm.next_out = obuf;
+			strm.avail_out = sizeof obuf;
+			zr = inflate(&strm, Z_NO_FLUSH);
+			if (zr != Z_OK && zr != Z_STREAM_END)
+				goto end;
+			n = sizeof obuf - strm.avail_out;
+			if (n && fwrite(obuf, n, 1, out) != 1)
+				goto end;
+		} while (zr != Z_STREAM_END &&
+		    (strm.avail_in || strm.avail_out == 0));
 	}
-	if (! gzeof(gzf))
+	if (zr != Z_STREAM_END)
 		goto end;
 
 	ret = 1;
 
 end:
-	gzclose(gzf);
+	inflateEnd(&strm);
 	return (ret);
 }
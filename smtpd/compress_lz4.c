@@ -0,0 +1,187 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2014 Gilles Chehade <gilles@poolp.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lz4frame.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+
+#define	LZ4_BUFFER_SIZE		16384
+
+
+static size_t	compress_lz4_chunk(void *, size_t, void *, size_t);
+static size_t	uncompress_lz4_chunk(void *, size_t, void *, size_t);
+static int	compress_lz4_file(FILE *, FILE *);
+static int	uncompress_lz4_file(FILE *, FILE *);
+
+
+struct compress_backend	compress_lz4 = {
+	compress_lz4_chunk,
+	uncompress_lz4_chunk,
+
+	compress_lz4_file,
+	uncompress_lz4_file,
+};
+
+static size_t
+compress_lz4_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	size_t	ret;
+
+	if (LZ4F_compressFrameBound(ibsz, NULL) > obsz)
+		return (0);
+
+	ret = LZ4F_compressFrame(ob, obsz, ib, ibsz, NULL);
+	if (LZ4F_isError(ret))
+		return (0);
+
+	return (ret);
+}
+
+static size_t
+uncompress_lz4_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	LZ4F_decompressionContext_t	 dctx;
+	size_t				 ipos, opos, isz, osz, hint;
+	size_t				 ret = 0;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+		return (0);
+
+	ipos = opos = 0;
+	do {
+		isz = ibsz - ipos;
+		osz = obsz - opos;
+		hint = LZ4F_decompress(dctx, (char *)ob + opos, &osz,
+		    (char *)ib + ipos, &isz, NULL);
+		if (LZ4F_isError(hint))
+			goto end;
+		ipos += isz;
+		opos += osz;
+		if (hint && opos == obsz)
+			goto end;
+	} while (hint && ipos < ibsz);
+
+	/* a zero hint means the frame was fully decoded */
+	if (hint == 0)
+		ret = opos;
+
+end:
+	LZ4F_freeDecompressionContext(dctx);
+	return (ret);
+}
+
+static int
+compress_lz4_file(FILE *in, FILE *out)
+{
+	LZ4F_compressionContext_t	 cctx;
+	char				 ibuf[LZ4_BUFFER_SIZE];
+	char				*obuf;
+	size_t				 obufsz, r, n;
+	int				 ret = 0;
+
+	if (in == NULL || out == NULL)
+		return (0);
+
+	obufsz = LZ4F_compressBound(sizeof ibuf, NULL);
+	if ((obuf = malloc(obufsz)) == NULL)
+		return (0);
+	if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION))) {
+		free(obuf);
+		return (0);
+	}
+
+	n = LZ4F_compressBegin(cctx, obuf, obufsz, NULL);
+	if (LZ4F_isError(n) || fwrite(obuf, n, 1, out) != 1)
+		goto end;
+
+	while ((r = fread(ibuf, 1, sizeof ibuf, in)) != 0) {
+		n = LZ4F_compressUpdate(cctx, obuf, obufsz, ibuf, r, NULL);
+		if (LZ4F_isError(n))
+			goto end;
+		if (n && fwrite(obuf, n, 1, out) != 1)
+			goto end;
+	}
+	if (! feof(in))
+		goto end;
+
+	n = LZ4F_compressEnd(cctx, obuf, obufsz, NULL);
+	if (LZ4F_isError(n) || fwrite(obuf, n, 1, out) != 1)
+		goto end;
+
+	ret = 1;
+
+end:
+	LZ4F_freeCompressionContext(cctx);
+	free(obuf);
+	return (ret);
+}
+
+static int
+uncompress_lz4_file(FILE *in, FILE *out)
+{
+	LZ4F_decompressionContext_t	 dctx;
+	char				 ibuf[LZ4_BUFFER_SIZE];
+	char				 obuf[LZ4_BUFFER_SIZE];
+	size_t				 r, pos, isz, osz, hint = 1;
+	int				 ret = 0;
+
+	if (in == NULL || out == NULL)
+		return (0);
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+		return (0);
+
+	while ((r = fread(ibuf, 1, sizeof ibuf, in)) != 0) {
+		pos = 0;
+		/* a full output buffer may leave more data to flush */
+		do {
+			isz = r - pos;
+			osz = sizeof obuf;
+			hint = LZ4F_decompress(dctx, obuf, &osz, ibuf + pos,
+			    &isz, NULL);
+			if (LZ4F_isError(hint))
+				goto end;
+			if (osz && fwrite(obuf, osz, 1, out) != 1)
+				goto end;
+			pos += isz;
+		} while (pos < r || osz == sizeof obuf);
+	}
+	/* a zero hint means the frame was fully decoded */
+	if (! feof(in) || hint != 0)
+		goto end;
+
+	ret = 1;
+
+end:
+	LZ4F_freeDecompressionContext(dctx);
+	return (ret);
+}
@@ -0,0 +1,177 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2014 Gilles Chehade <gilles@poolp.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zstd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+
+#define	ZSTD_BUFFER_SIZE	16384
+#define	ZSTD_LEVEL		3
+
+
+static size_t	compress_zstd_chunk(void *, size_t, void *, size_t);
+static size_t	uncompress_zstd_chunk(void *, size_t, void *, size_t);
+static int	compress_zstd_file(FILE *, FILE *);
+static int	uncompress_zstd_file(FILE *, FILE *);
+
+
+struct compress_backend	compress_zstd = {
+	compress_zstd_chunk,
+	uncompress_zstd_chunk,
+
+	compress_zstd_file,
+	uncompress_zstd_file,
+};
+
+static size_t
+compress_zstd_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	size_t	ret;
+
+	ret = ZSTD_compress(ob, obsz, ib, ibsz, ZSTD_LEVEL);
+	if (ZSTD_isError(ret))
+		return (0);
+
+	return (ret);
+}
+
+static size_t
+uncompress_zstd_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	size_t	ret;
+
+	ret = ZSTD_decompress(ob, obsz, ib, ibsz);
+	if (ZSTD_isError(ret))
+		return (0);
+
+	return (ret);
+}
+
+static int
+compress_zstd_file(FILE *in, FILE *out)
+{
+	ZSTD_CStream	*cs;
+	ZSTD_inBuffer	 zin;
+	ZSTD_outBuffer	 zout;
+	char		 ibuf[ZSTD_BUFFER_SIZE];
+	char		 obuf[ZSTD_BUFFER_SIZE];
+	size_t		 r;
+	int		 ret = 0;
+
+	if (in == NULL || out == NULL)
+		return (0);
+
+	if ((cs = ZSTD_createCStream()) == NULL)
+		return (0);
+	if (ZSTD_isError(ZSTD_initCStream(cs, ZSTD_LEVEL)))
+		goto end;
+
+	while ((r = fread(ibuf, 1, sizeof ibuf, in)) != 0) {
+		zin.src = ibuf;
+		zin.size = r;
+		zin.pos = 0;
+		while (zin.pos < zin.size) {
+			zout.dst = obuf;
+			zout.size = sizeof obuf;
+			zout.pos = 0;
+			if (ZSTD_isError(ZSTD_compressStream(cs, &zout, &zin)))
+				goto end;
+			if (zout.pos && fwrite(obuf, zout.pos, 1, out) != 1)
+				goto end;
+		}
+	}
+	if (! feof(in))
+		goto end;
+
+	do {
+		zout.dst = obuf;
+		zout.size = sizeof obuf;
+		zout.pos = 0;
+		r = ZSTD_endStream(cs, &zout);
+		if (ZSTD_isError(r))
+			goto end;
+		if (zout.pos && fwrite(obuf, zout.pos, 1, out) != 1)
+			goto end;
+	} while (r);
+
+	ret = 1;
+
+end:
+	ZSTD_freeCStream(cs);
+	return (ret);
+}
+
+static int
+uncompress_zstd_file(FILE *in, FILE *out)
+{
+	ZSTD_DStream	*ds;
+	ZSTD_inBuffer	 zin;
+	ZSTD_outBuffer	 zout;
+	char		 ibuf[ZSTD_BUFFER_SIZE];
+	char		 obuf[ZSTD_BUFFER_SIZE];
+	size_t		 r, hint = 1;
+	int		 ret = 0;
+
+	if (in == NULL || out == NULL)
+		return (0);
+
+	if ((ds = ZSTD_createDStream()) == NULL)
+		return (0);
+	if (ZSTD_isError(ZSTD_initDStream(ds)))
+		goto end;
+
+	while ((r = fread(ibuf, 1, sizeof ibuf, in)) != 0) {
+		zin.src = ibuf;
+		zin.size = r;
+		zin.pos = 0;
+		/* a full output buffer may leave more data to flush */
+		do {
+			zout.dst = obuf;
+			zout.size = sizeof obuf;
+			zout.pos = 0;
+			hint = ZSTD_decompressStream(ds, &zout, &zin);
+			if (ZSTD_isError(hint))
+				goto end;
+			if (zout.pos && fwrite(obuf, zout.pos, 1, out) != 1)
+				goto end;
+		} while (zin.pos < zin.size || zout.pos == zout.size);
+	}
+	/* a zero hint means the frame was fully decoded */
+	if (! feof(in) || hint != 0)
+		goto end;
+
+	ret = 1;
+
+end:
+	ZSTD_freeDStream(ds);
+	return (ret);
+}
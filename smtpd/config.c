@@ -37,6 +37,40 @@
 
 static int pipes[PROC_COUNT][PROC_COUNT];
 
+/*
+ * Transfer and smtp processes past the first one get their own
+ * socketpairs with every other process: [shard][peer][0] is the
+ * sharded end, [1] the peer end.
+ */
+static int mta_pipes[MTA_PROCS_MAX][PROC_COUNT][2];
+static int smtp_pipes[SMTP_PROCS_MAX][PROC_COUNT][2];
+static int lka_pipes[LKA_PROCS_MAX][PROC_COUNT][2];
+
+/*
+ * lka processes past the first one also need a socketpair with each of
+ * the other smtp and transfer processes: [lka][shard][0] is the lka end.
+ */
+static int lka_smtp_pipes[LKA_PROCS_MAX][SMTP_PROCS_MAX][2];
+static int lka_mta_pipes[LKA_PROCS_MAX][MTA_PROCS_MAX][2];
+
+/*
+ * With ipc-ring-size, the busiest channels also get a pair of shared
+ * rings: rings[i][j] is written by i and read by j, and mta_rings[shard]
+ * is indexed like the queue entry of mta_pipes.
+ */
+static struct mproc_ring *rings[PROC_COUNT][PROC_COUNT];
+static struct mproc_ring *mta_rings[MTA_PROCS_MAX][2];
+
+static void init_shard_pipes(int (*)[PROC_COUNT][2], size_t, size_t,
+    enum smtp_proc_type);
+static void close_shard_pipes(int (*)[PROC_COUNT][2], size_t);
+static void init_pair(int *, int);
+static void close_pair(int *);
+static int *lka_peer_fd(size_t);
+static void init_rings(enum smtp_proc_type, enum smtp_proc_type);
+static struct mproc *config_mproc(enum smtp_proc_type, int *,
+    struct mproc_ring **, struct mproc_ring **);
+
 void
 purge_config(uint8_t what)
 {
@@ -95,6 +129,97 @@ init_pipes(void)
 			session_socket_blockmode(pipes[i][j], BM_NONBLOCK);
 			session_socket_blockmode(pipes[j][i], BM_NONBLOCK);
 		}
+
+	init_shard_pipes(mta_pipes, MTA_PROCS_MAX, env->sc_mta_procs, PROC_MTA);
+	init_shard_pipes(smtp_pipes, SMTP_PROCS_MAX, env->sc_smtp_procs,
+	    PROC_SMTP);
+	init_shard_pipes(lka_pipes, LKA_PROCS_MAX, env->sc_lka_procs, PROC_LKA);
+	for (i = 0; i < LKA_PROCS_MAX; i++) {
+		for (j = 0; j < SMTP_PROCS_MAX; j++)
+			init_pair(lka_smtp_pipes[i][j],
+			    i && j && (size_t)i < env->sc_lka_procs &&
+			    (size_t)j < env->sc_smtp_procs);
+		for (j = 0; j < MTA_PROCS_MAX; j++)
+			init_pair(lka_mta_pipes[i][j],
+			    i && j && (size_t)i < env->sc_lka_procs &&
+			    (size_t)j < env->sc_mta_procs);
+	}
+
+	if (env->sc_ipc_ring) {
+		init_rings(PROC_QUEUE, PROC_SCHEDULER);
+		init_rings(PROC_QUEUE, PROC_MTA);
+		for (i = 1; i < (int)env->sc_mta_procs; i++) {
+			mta_rings[i][0] = mproc_ring_new(env->sc_ipc_ring);
+			mta_rings[i][1] = mproc_ring_new(env->sc_ipc_ring);
+		}
+	}
+}
+
+static void
+init_rings(enum smtp_proc_type a, enum smtp_proc_type b)
+{
+	rings[a][b] = mproc_ring_new(env->sc_ipc_ring);
+	rings[b][a] = mproc_ring_new(env->sc_ipc_ring);
+}
+
+static void
+init_shard_pipes(int (*shards)[PROC_COUNT][2], size_t max, size_t count,
+    enum smtp_proc_type proc)
+{
+	size_t	 i, j;
+	int	 sockpair[2];
+
+	for (i = 0; i < max; i++)
+		for (j = 0; j < PROC_COUNT; j++) {
+			shards[i][j][0] = shards[i][j][1] = -1;
+			if (i == 0 || i >= count || j == proc)
+				continue;
+			if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC,
+			    sockpair) == -1)
+				fatal("socketpair");
+			shards[i][j][0] = sockpair[0];
+			shards[i][j][1] = sockpair[1];
+			session_socket_blockmode(sockpair[0], BM_NONBLOCK);
+			session_socket_blockmode(sockpair[1], BM_NONBLOCK);
+		}
+}
+
+static void
+init_pair(int *fds, int needed)
+{
+	fds[0] = fds[1] = -1;
+	if (! needed)
+		return;
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fds) == -1)
+		fatal("socketpair");
+	session_socket_blockmode(fds[0], BM_NONBLOCK);
+	session_socket_blockmode(fds[1], BM_NONBLOCK);
+}
+
+static void
+close_pair(int *fds)
+{
+	if (fds[0] != -1)
+		close(fds[0]);
+	if (fds[1] != -1)
+		close(fds[1]);
+	fds[0] = fds[1] = -1;
+}
+
+static void
+close_shard_pipes(int (*shards)[PROC_COUNT][2], size_t max)
+{
+	size_t	i, j;
+
+	for (i = 0; i < max; i++) {
+		for (j = 0; j < PROC_COUNT; j++) {
+			if (shards[i][j][0] != -1)
+				close(shards[i][j][0]);
+			if (shards[i][j][1] != -1)
+				close(shards[i][j][1]);
+			shards[i][j][0] = shards[i][j][1] = -1;
+		}
+	}
 }
 
 void
@@ -112,45 +237,108 @@ config_process(enum smtp_proc_type proc)
 		fatal("fdlimit: setrlimit");
 }
 
-void
-config_peer(enum smtp_proc_type proc)
+static struct mproc *
+config_mproc(enum smtp_proc_type proc, int *fd, struct mproc_ring **out,
+    struct mproc_ring **in)
 {
 	struct mproc	*p;
 
-	if (proc == smtpd_process)
-		fatal("config_peers: cannot peer with oneself");
-
 	p = xcalloc(1, sizeof *p, "config_peer");
 	p->proc = proc;
 	p->name = xstrdup(proc_name(proc), "config_peer");
 	p->handler = imsg_dispatch;
 
-	mproc_init(p, pipes[smtpd_process][proc]);
+	mproc_init(p, *fd);
+	if (out && *out) {
+		mproc_set_ring(p, *out, *in);
+		*out = *in = NULL;
+	}
 	mproc_enable(p);
-	pipes[smtpd_process][proc] = -1;
+	*fd = -1;
+
+	return (p);
+}
 
-	if (proc == PROC_CONTROL)
+void
+config_peer(enum smtp_proc_type proc)
+{
+	struct mproc	*p;
+	size_t		 i;
+
+	if (proc == smtpd_process)
+		fatal("config_peers: cannot peer with oneself");
+
+	if (smtpd_process == PROC_MTA && mta_shard)
+		p = config_mproc(proc, &mta_pipes[mta_shard][proc][0],
+		    proc == PROC_QUEUE ? &mta_rings[mta_shard][0] : NULL,
+		    &mta_rings[mta_shard][1]);
+	else if (smtpd_process == PROC_SMTP && smtp_shard)
+		p = config_mproc(proc, &smtp_pipes[smtp_shard][proc][0],
+		    NULL, NULL);
+	else if (smtpd_process == PROC_LKA && lka_shard)
+		p = config_mproc(proc, &lka_pipes[lka_shard][proc][0],
+		    NULL, NULL);
+	else
+		p = config_mproc(proc, &pipes[smtpd_process][proc],
+		    &rings[smtpd_process][proc], &rings[proc][smtpd_process]);
+
+	if (proc == PROC_CA)
+		p_ca = p;
+	else if (proc == PROC_CONTROL)
 		p_control = p;
-	else if (proc == PROC_LKA)
-		p_lka = p;
+	else if (proc == PROC_LKA) {
+		p_lka = p_lkas[0] = p;
+		for (i = 1; i < env->sc_lka_procs; i++)
+			p_lkas[i] = config_mproc(proc, lka_peer_fd(i), NULL,
+			    NULL);
+	}
 	else if (proc == PROC_MDA)
 		p_mda = p;
 	else if (proc == PROC_MFA)
 		p_mfa = p;
-	else if (proc == PROC_MTA)
-		p_mta = p;
+	else if (proc == PROC_MTA) {
+		p_mta = p_mtas[0] = p;
+		for (i = 1; i < env->sc_mta_procs; i++)
+			p_mtas[i] = config_mproc(proc,
+			    smtpd_process == PROC_LKA && lka_shard ?
+			    &lka_mta_pipes[lka_shard][i][0] :
+			    &mta_pipes[i][smtpd_process][1],
+			    smtpd_process == PROC_QUEUE ? &mta_rings[i][1] : NULL,
+			    &mta_rings[i][0]);
+	}
 	else if (proc == PROC_PARENT)
 		p_parent = p;
 	else if (proc == PROC_QUEUE)
 		p_queue = p;
 	else if (proc == PROC_SCHEDULER)
 		p_scheduler = p;
-	else if (proc == PROC_SMTP)
-		p_smtp = p;
+	else if (proc == PROC_SMTP) {
+		p_smtp = p_smtps[0] = p;
+		for (i = 1; i < env->sc_smtp_procs; i++)
+			p_smtps[i] = config_mproc(proc,
+			    smtpd_process == PROC_LKA && lka_shard ?
+			    &lka_smtp_pipes[lka_shard][i][0] :
+			    &smtp_pipes[i][smtpd_process][1], NULL, NULL);
+	}
 	else
 		fatalx("bad peer");
 }
 
+/* our end of the socketpair with the given lka process */
+static int *
+lka_peer_fd(size_t shard)
+{
+	if (smtpd_process == PROC_SMTP && smtp_shard)
+		return (&lka_smtp_pipes[shard][smtp_shard][1]);
+	if (smtpd_process == PROC_MTA && mta_shard)
+		return (&lka_mta_pipes[shard][mta_shard][1]);
+	return (&lka_pipes[shard][smtpd_process][1]);
+}
+
+static void pool_stat(void);
+static void io_stat_set(const char *, uint64_t);
+static void io_stat(void);
+static void process_stat(struct mproc **, size_t);
 static void process_stat_event(int, short, void *);
 
 void
@@ -169,6 +357,28 @@ config_done(void)
 		}
 	}
 
+	close_shard_pipes(mta_pipes, MTA_PROCS_MAX);
+	close_shard_pipes(smtp_pipes, SMTP_PROCS_MAX);
+	close_shard_pipes(lka_pipes, LKA_PROCS_MAX);
+	for (i = 0; i < LKA_PROCS_MAX; i++) {
+		for (j = 0; j < SMTP_PROCS_MAX; j++)
+			close_pair(lka_smtp_pipes[i][j]);
+		for (j = 0; j < MTA_PROCS_MAX; j++)
+			close_pair(lka_mta_pipes[i][j]);
+	}
+
+	/* unmap the rings of other processes */
+	for (i = 0; i < PROC_COUNT; i++)
+		for (j = 0; j < PROC_COUNT; j++) {
+			mproc_ring_free(rings[i][j]);
+			rings[i][j] = NULL;
+		}
+	for (i = 0; i < MTA_PROCS_MAX; i++)
+		for (j = 0; j < 2; j++) {
+			mproc_ring_free(mta_rings[i][j]);
+			mta_rings[i][j] = NULL;
+		}
+
 	if (smtpd_process == PROC_CONTROL)
 		return;
 
@@ -178,22 +388,104 @@ config_done(void)
 	evtimer_add(&ev, &tv);
 }
 
+/*
+ * The shards of a process type are reported as one, their counters
+ * summed and the peak buffer taken over all of them.
+ */
 static void
-process_stat(struct mproc *p)
+process_stat(struct mproc **ps, size_t n)
 {
 	char			buf[1024];
 	struct stat_value	value;
+	struct mproc		*p;
+	const char		*name;
+	size_t			i, queued, calls, msgs;
 
-	if (p == NULL)
+	name = NULL;
+	queued = calls = msgs = 0;
+	for (i = 0; i < n; i++) {
+		if ((p = ps[i]) == NULL)
+			continue;
+		name = proc_name(p->proc);
+		if (p->bytes_queued_max > queued)
+			queued = p->bytes_queued_max;
+		p->bytes_queued_max = p->bytes_queued;
+		calls += p->w_calls;
+		msgs += p->w_msgs;
+		p->w_calls = p->w_msgs = 0;
+	}
+	if (name == NULL)
 		return;
 
 	value.type = STAT_COUNTER;
 	snprintf(buf, sizeof buf, "buffer.%s.%s",
-	    proc_name(smtpd_process),
-	    proc_name(p->proc));
-	value.u.counter = p->bytes_queued_max;
-	p->bytes_queued_max = p->bytes_queued;
+	    proc_name(smtpd_process), name);
+	value.u.counter = queued;
+	stat_set(buf, &value);
+
+	if (calls == 0)
+		return;
+	snprintf(buf, sizeof buf, "imsg.%s.%s.writes",
+	    proc_name(smtpd_process), name);
+	value.u.counter = calls;
 	stat_set(buf, &value);
+	snprintf(buf, sizeof buf, "imsg.%s.%s.per-write",
+	    proc_name(smtpd_process), name);
+	value.u.counter = (msgs + calls / 2) / calls;
+	stat_set(buf, &value);
+}
+
+static void
+pool_stat(void)
+{
+	char			buf[1024];
+	struct stat_value	value;
+	size_t			i, size, nfree, inuse;
+
+	value.type = STAT_COUNTER;
+	for (i = 0; iobuf_pool_stat(i, &size, &nfree, &inuse); i++) {
+		snprintf(buf, sizeof buf, "iobuf.%s.pool.%zu.free",
+		    proc_name(smtpd_process), size);
+		value.u.counter = nfree;
+		stat_set(buf, &value);
+		snprintf(buf, sizeof buf, "iobuf.%s.pool.%zu.inuse",
+		    proc_name(smtpd_process), size);
+		value.u.counter = inuse;
+		stat_set(buf, &value);
+	}
+}
+
+static void
+io_stat_set(const char *name, uint64_t counter)
+{
+	char			buf[1024];
+	struct stat_value	value;
+
+	snprintf(buf, sizeof buf, "io.%s.%s", proc_name(smtpd_process), name);
+	value.type = STAT_COUNTER;
+	value.u.counter = counter;
+	stat_set(buf, &value);
+}
+
+static void
+io_stat(void)
+{
+	const struct io_stats	*st;
+
+	io_set_profile(profiling & PROFILE_IO);
+
+	st = io_stats_get();
+	io_stat_set("in.bytes", st->bytes_in);
+	io_stat_set("in.reads", st->reads);
+	io_stat_set("out.bytes", st->bytes_out);
+	io_stat_set("out.writes", st->writes);
+	io_stat_set("eagain", st->eagain);
+	io_stat_set("tls.retry", st->tls_retry);
+	io_stat_set("tls.ktls.in", st->ktls_in);
+	io_stat_set("tls.ktls.out", st->ktls_out);
+	io_stat_set("callbacks", st->callbacks);
+	if (profiling & PROFILE_IO)
+		io_stat_set("callbacks.usec", st->cb_usec);
 }
 
 static void
@@ -202,15 +494,18 @@ process_stat_event(int fd, short ev, void *arg)
 	struct event	*e = arg;
 	struct timeval	 tv;
 
-	process_stat(p_control);
-	process_stat(p_lka);
-	process_stat(p_mda);
-	process_stat(p_mfa);
-	process_stat(p_mda);
-	process_stat(p_parent);
-	process_stat(p_queue);
-	process_stat(p_scheduler);
-	process_stat(p_smtp);
+	process_stat(&p_ca, 1);
+	process_stat(&p_control, 1);
+	process_stat(p_lkas, env->sc_lka_procs);
+	process_stat(&p_mda, 1);
+	process_stat(&p_mfa, 1);
+	process_stat(p_mtas, env->sc_mta_procs);
+	process_stat(&p_parent, 1);
+	process_stat(&p_queue, 1);
+	process_stat(&p_scheduler, 1);
+	process_stat(p_smtps, env->sc_smtp_procs);
+	pool_stat();
+	io_stat();
 
 	tv.tv_sec = 1;
 	tv.tv_usec = 0;
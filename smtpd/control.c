@@ -25,6 +25,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <event.h>
@@ -32,6 +33,7 @@
 #include <imsg.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,9 +49,19 @@ struct ctl_conn {
 	uint32_t		 id;
 	uint8_t			 flags;
 #define CTL_CONN_NOTIFY		 0x01
+#define CTL_CONN_MTAFAIL	 0x02
+#define CTL_CONN_MONITOR	 0x04
 	struct mproc		 mproc;
+	size_t			 mtapending;
+	size_t			 profpending;
 	uid_t			 euid;
 	gid_t			 egid;
+
+	TAILQ_ENTRY(ctl_conn)	 monentry;
+	struct event		 monev;
+	struct timeval		 montv;
+	struct stat_digest	 monlast;	/* as of the last frame */
+	uint32_t		 mondirty;	/* counters changed since */
 };
 
 struct {
@@ -57,6 +69,28 @@ struct {
 	int			 fd;
 } control_state;
 
+/* OpenMetrics samples of one family, sent after a single TYPE line */
+struct metric_family {
+	const char		*type;
+	char			*buf;
+	size_t			 len;
+	size_t			 alloc;
+};
+
+/* key prefixes whose next components become a label */
+static const struct metric_label {
+	const char		*prefix;
+	const char		*label;
+	int			 keep;	/* components left for the name */
+} metric_labels[] = {
+	{ "mta.relay.",		"relay",	1 },
+	{ "table.",		"table",	2 },
+	{ "queue.latency.",	"operation",	1 },
+};
+
+#define	METRICS_CHUNK	8192
+
+
 static void control_imsg(struct mproc *, struct imsg *);
 static void control_shutdown(void);
 static void control_listen(void);
@@ -65,6 +99,15 @@ static void control_close(struct ctl_conn *);
 static void control_sig_handler(int, short, void *);
 static void control_dispatch_ext(struct mproc *, struct imsg *);
 static void control_digest_update(const char *, size_t, int);
+static void control_monitor_timeout(int, short, void *);
+static void control_profile_request(struct ctl_conn *, struct mproc *);
+static void control_metrics(struct mproc *);
+static void control_metrics_sample(struct dict *, const char *,
+    const struct stat_value *);
+static struct metric_family *control_metrics_family(struct dict *,
+    const char *, const char *);
+static void control_metrics_printf(struct metric_family *, const char *, ...)
+    __attribute__((__format__ (printf, 2, 3)));
 
 static struct stat_backend *stat_backend = NULL;
 extern const char *backend_stat;
@@ -72,9 +115,17 @@ extern const char *backend_stat;
 static uint32_t			connid = 0;
 static struct tree		ctl_conns;
 static struct stat_digest	digest;
+static TAILQ_HEAD(, ctl_conn)	monitors = TAILQ_HEAD_INITIALIZER(monitors);
 
 #define	CONTROL_FD_RESERVE	5
 
+static void
+control_profile_request(struct ctl_conn *c, struct mproc *p)
+{
+	m_compose(p, IMSG_CTL_SHOW_IMSG_PROFILE, c->id, 0, -1, NULL, 0);
+	c->profpending++;
+}
+
 static void
 control_imsg(struct mproc *p, struct imsg *imsg)
 {
@@ -83,7 +134,27 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 	struct msg		 m;
 	const char		*key;
 	const void		*data;
-	size_t			 sz;
+	size_t			 sz, count;
+	uint64_t		 sample;
+
+	if (imsg->hdr.type == IMSG_CTL_SHOW_IMSG_PROFILE) {
+		c = tree_get(&ctl_conns, imsg->hdr.peerid);
+		if (c == NULL)
+			return;
+		/*
+		 * Every process ends its lines with an empty message, the
+		 * control process adds its own after the last one.
+		 */
+		if (imsg->hdr.len == IMSG_HEADER_SIZE) {
+			if (c->profpending && --c->profpending)
+				return;
+			imsg_profile_show(&c->mproc, 0);
+			return;
+		}
+		imsg->hdr.peerid = 0;
+		m_forward(&c->mproc, imsg);
+		return;
+	}
 
 	if (p->proc == PROC_SMTP) {
 		switch (imsg->hdr.type) {
@@ -112,6 +183,7 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 	if (p->proc == PROC_QUEUE) {
 		switch (imsg->hdr.type) {
 		case IMSG_CTL_LIST_ENVELOPES:
+		case IMSG_CTL_QUERY_ENVELOPES:
 			c = tree_get(&ctl_conns, imsg->hdr.peerid);
 			if (c == NULL)
 				return;
@@ -119,6 +191,19 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 		}
 	}
+	/* the answer to a limit change */
+	if (p->proc == PROC_QUEUE || p->proc == PROC_MDA) {
+		switch (imsg->hdr.type) {
+		case IMSG_CTL_OK:
+		case IMSG_CTL_FAIL:
+			c = tree_get(&ctl_conns, imsg->hdr.peerid);
+			if (c == NULL)
+				return;
+			imsg->hdr.peerid = 0;
+			m_forward(&c->mproc, imsg);
+			return;
+		}
+	}
 	if (p->proc == PROC_MTA) {
 		switch (imsg->hdr.type) {
 		case IMSG_CTL_OK:
@@ -131,6 +216,23 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 			c = tree_get(&ctl_conns, imsg->hdr.peerid);
 			if (c == NULL)
 				return;
+			/*
+			 * Every transfer process ends its answer with a
+			 * status or an empty message, only the last one
+			 * is passed on.
+			 */
+			if (imsg->hdr.type == IMSG_CTL_OK ||
+			    imsg->hdr.type == IMSG_CTL_FAIL ||
+			    imsg->hdr.len == IMSG_HEADER_SIZE) {
+				if (imsg->hdr.type == IMSG_CTL_FAIL)
+					c->flags |= CTL_CONN_MTAFAIL;
+				if (c->mtapending && --c->mtapending)
+					return;
+				if (imsg->hdr.type == IMSG_CTL_OK &&
+				    c->flags & CTL_CONN_MTAFAIL)
+					imsg->hdr.type = IMSG_CTL_FAIL;
+				c->flags &= ~CTL_CONN_MTAFAIL;
+			}
 			imsg->hdr.peerid = 0;
 			m_forward(&c->mproc, imsg);
 			return;
@@ -167,6 +269,28 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 		if (stat_backend)
 			stat_backend->set(key, &val);
 		return;
+	case IMSG_STAT_HISTOGRAM:
+		m_msg(&m, imsg);
+		m_get_string(&m, &key);
+		m_get_data(&m, &data, &sz);
+		m_end(&m);
+		if (sz != sizeof(sample))
+			fatalx("control_imsg: bad histogram sample");
+		memmove(&sample, data, sz);
+		if (stat_backend && stat_backend->histogram)
+			stat_backend->histogram(key, sample);
+		return;
+	case IMSG_STAT_RATE:
+		m_msg(&m, imsg);
+		m_get_string(&m, &key);
+		m_get_data(&m, &data, &sz);
+		m_end(&m);
+		if (sz != sizeof(count))
+			fatalx("control_imsg: bad rate count");
+		memmove(&count, data, sz);
+		if (stat_backend && stat_backend->rate)
+			stat_backend->rate(key, count);
+		return;
 	}
 
 	errx(1, "control_imsg: unexpected %s imsg",
@@ -289,6 +413,7 @@ control(void)
 	config_peer(PROC_LKA);
 	config_peer(PROC_MDA);
 	config_peer(PROC_MTA);
+	config_peer(PROC_CA);
 	config_done();
 
 	control_listen();
@@ -365,6 +490,10 @@ pause:
 static void
 control_close(struct ctl_conn *c)
 {
+	if (c->flags & CTL_CONN_MONITOR) {
+		evtimer_del(&c->monev);
+		TAILQ_REMOVE(&monitors, c, monentry);
+	}
 	tree_xpop(&ctl_conns, c->id);
 	mproc_clear(&c->mproc);
 	free(c);
@@ -383,21 +512,27 @@ control_close(struct ctl_conn *c)
 static void
 control_digest_update(const char *key, size_t value, int incr)
 {
-	size_t	*p;
+	struct ctl_conn	*c;
+	size_t		*p;
+	uint32_t	 bit;
 
 	p = NULL;
 
 	if (!strcmp(key, "smtp.session")) {
 		if (incr)
 			p = &digest.clt_connect;
-		else
-			digest.clt_disconnect += value;
+		else {
+			p = &digest.clt_disconnect;
+			incr = 1;
+		}
 	}
 	else if (!strcmp(key, "scheduler.envelope")) {
 		if (incr)
 			p = &digest.evp_enqueued;
-		else
-			digest.evp_dequeued += value;
+		else {
+			p = &digest.evp_dequeued;
+			incr = 1;
+		}
 	}
 	else if  (!strcmp(key, "scheduler.envelope.expired"))
 		p = &digest.evp_expired;
@@ -420,7 +555,255 @@ control_digest_update(const char *key, size_t value, int incr)
 			*p = *p + value;
 		else
 			*p = *p - value;
+
+		/* tell the monitors what to send in their next frame */
+		bit = 1 << (p - STAT_DIGEST_COUNTER(&digest, 0));
+		TAILQ_FOREACH(c, &monitors, monentry)
+			c->mondirty |= bit;
+	}
+}
+
+/* push the deltas of the counters that changed since the last frame */
+static void
+control_monitor_timeout(int fd, short event, void *arg)
+{
+	struct ctl_conn	*c = arg;
+	char		 buf[sizeof(uint32_t) + STAT_DIGEST_COUNTERS * sizeof(size_t)];
+	size_t		*cur, *last, delta, len;
+	int		 i;
+
+	len = sizeof(c->mondirty);
+	for (i = 0; i < STAT_DIGEST_COUNTERS; i++) {
+		if (!(c->mondirty & (1 << i)))
+			continue;
+		cur = STAT_DIGEST_COUNTER(&digest, i);
+		last = STAT_DIGEST_COUNTER(&c->monlast, i);
+		delta = *cur - *last;
+		*last = *cur;
+		memmove(buf + len, &delta, sizeof(delta));
+		len += sizeof(delta);
 	}
+	memmove(buf, &c->mondirty, sizeof(c->mondirty));
+	c->mondirty = 0;
+
+	m_compose(&c->mproc, IMSG_CTL_MONITOR, 0, 0, -1, buf, len);
+	evtimer_add(&c->monev, &c->montv);
+}
+
+static struct metric_family *
+control_metrics_family(struct dict *families, const char *name,
+    const char *type)
+{
+	struct metric_family	*f;
+
+	if ((f = dict_get(families, name)) == NULL) {
+		f = xcalloc(1, sizeof(*f), "control_metrics_family");
+		f->type = type;
+		dict_xset(families, name, f);
+	}
+	return (f);
+}
+
+static void
+control_metrics_printf(struct metric_family *f, const char *fmt, ...)
+{
+	va_list	 ap;
+	char	*tmp;
+	int	 n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(f->buf + f->len, f->alloc - f->len, fmt, ap);
+		va_end(ap);
+		if (n == -1)
+			fatal("control_metrics_printf: vsnprintf");
+		if ((size_t)n < f->alloc - f->len)
+			break;
+		tmp = realloc(f->buf, f->alloc + n + 1024);
+		if (tmp == NULL)
+			fatal("control_metrics_printf: realloc");
+		f->buf = tmp;
+		f->alloc += n + 1024;
+	}
+	f->len += n;
+}
+
+/*
+ * Turn a stat key into a metric name and label set: dots and other
+ * characters not allowed in a name become underscores, and the variable
+ * part of the keys listed in metric_labels, such as the relay domain or
+ * table name, moves to a label.  A trailing pNNms quantile stays in the
+ * name.
+ */
+static void
+control_metrics_sample(struct dict *families, const char *key,
+    const struct stat_value *val)
+{
+	const struct metric_label	*ml;
+	struct metric_family		*f;
+	const char			*rest, *last, *s, *sep;
+	char				 name[STAT_KEY_SIZE + 16];
+	char				 labels[2 * STAT_KEY_SIZE + 32];
+	char				 mname[sizeof(name) + 8];
+	size_t				 i, n, plen;
+	int				 keep;
+
+	ml = NULL;
+	for (i = 0; i < nitems(metric_labels); i++)
+		if (!strncmp(key, metric_labels[i].prefix,
+		    strlen(metric_labels[i].prefix))) {
+			ml = &metric_labels[i];
+			break;
+		}
+
+	rest = key;
+	labels[0] = '\0';
+	plen = 0;
+	if (ml) {
+		plen = strlen(ml->prefix);
+		keep = ml->keep;
+		if ((last = strrchr(key, '.')) && last[1] == 'p' &&
+		    strlen(last) > 4 && !strcmp(last + strlen(last) - 2, "ms") &&
+		    strspn(last + 2, "0123456789") == strlen(last) - 4)
+			keep++;
+		for (s = key + strlen(key); s > key + plen; s--)
+			if (s[-1] == '.' && --keep == 0)
+				break;
+		if (keep == 0 && s - 1 > key + plen) {
+			n = strlcpy(labels, ml->label, sizeof(labels));
+			labels[n++] = '=';
+			labels[n++] = '"';
+			for (rest = key + plen; rest < s - 1; rest++) {
+				if (*rest == '\\' || *rest == '"')
+					labels[n++] = '\\';
+				labels[n++] = *rest;
+			}
+			labels[n++] = '"';
+			labels[n] = '\0';
+			rest = s;
+		}
+		else
+			plen = 0;
+	}
+
+	/* smtpd_ + prefix without its label + what is left of the key */
+	n = strlcpy(name, "smtpd_", sizeof(name));
+	for (s = key; s < key + plen; s++)
+		name[n++] = *s;
+	for (s = rest; *s; s++)
+		name[n++] = *s;
+	name[n] = '\0';
+	for (i = strlen("smtpd_"); i < n; i++)
+		if (!isalnum((unsigned char)name[i]))
+			name[i] = '_';
+
+	sep = labels[0] ? "," : "";
+	switch (val->type) {
+	case STAT_COUNTER:
+		f = control_metrics_family(families, name, "gauge");
+		control_metrics_printf(f, "%s%s%s%s %zu\n", name,
+		    labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		    val->u.counter);
+		break;
+	case STAT_TIMESTAMP:
+		f = control_metrics_family(families, name, "gauge");
+		control_metrics_printf(f, "%s%s%s%s %lld\n", name,
+		    labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		    (long long)val->u.timestamp);
+		break;
+	case STAT_TIMEVAL:
+		f = control_metrics_family(families, name, "gauge");
+		control_metrics_printf(f, "%s%s%s%s %lld.%06ld\n", name,
+		    labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		    (long long)val->u.tv.tv_sec, (long)val->u.tv.tv_usec);
+		break;
+	case STAT_TIMESPEC:
+		f = control_metrics_family(families, name, "gauge");
+		control_metrics_printf(f, "%s%s%s%s %lld.%09ld\n", name,
+		    labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		    (long long)val->u.ts.tv_sec, (long)val->u.ts.tv_nsec);
+		break;
+	case STAT_RATE:
+		f = control_metrics_family(families, name, "gauge");
+		control_metrics_printf(f, "%s%s%s%s %.3f\n", name,
+		    labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		    val->u.rate);
+		break;
+	case STAT_HISTOGRAM:
+		f = control_metrics_family(families, name, "summary");
+		control_metrics_printf(f,
+		    "%s{%s%squantile=\"0.5\"} %llu\n"
+		    "%s{%s%squantile=\"0.9\"} %llu\n"
+		    "%s{%s%squantile=\"0.99\"} %llu\n",
+		    name, labels, sep, (unsigned long long)val->u.hist.p50,
+		    name, labels, sep, (unsigned long long)val->u.hist.p90,
+		    name, labels, sep, (unsigned long long)val->u.hist.p99);
+		control_metrics_printf(f, "%s_sum%s%s%s %llu\n", name,
+		    labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		    (unsigned long long)val->u.hist.sum);
+		control_metrics_printf(f, "%s_count%s%s%s %zu\n", name,
+		    labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		    val->u.hist.count);
+
+		(void)snprintf(mname, sizeof(mname), "%s_max", name);
+		f = control_metrics_family(families, mname, "gauge");
+		control_metrics_printf(f, "%s%s%s%s %llu\n", mname,
+		    labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		    (unsigned long long)val->u.hist.max);
+		break;
+	}
+}
+
+/*
+ * Send all stats in the OpenMetrics text format, in one pass over the
+ * backend.  The text goes in chunks cut at line ends, each one a string
+ * without its last newline, and an empty message ends the reply.
+ */
+static void
+control_metrics(struct mproc *p)
+{
+	struct dict		 families;
+	struct metric_family	 out, *f;
+	struct stat_value	 val;
+	const char		*name;
+	char			*key, *nl;
+	void			*iter;
+	size_t			 pos, n;
+
+	dict_init(&families);
+	iter = NULL;
+	while (stat_backend->iter(&iter, &key, &val))
+		control_metrics_sample(&families, key, &val);
+
+	memset(&out, 0, sizeof(out));
+	iter = NULL;
+	while (dict_iter(&families, &iter, &name, (void **)&f)) {
+		control_metrics_printf(&out, "# TYPE %s %s\n", name, f->type);
+		if (f->len)
+			control_metrics_printf(&out, "%.*s", (int)f->len,
+			    f->buf);
+	}
+	while (dict_poproot(&families, (void **)&f)) {
+		free(f->buf);
+		free(f);
+	}
+	control_metrics_printf(&out, "# EOF\n");
+
+	for (pos = 0; pos < out.len; pos += n) {
+		n = out.len - pos;
+		if (n > METRICS_CHUNK) {
+			n = METRICS_CHUNK;
+			while (n && out.buf[pos + n - 1] != '\n')
+				n--;
+			if (n == 0)
+				fatalx("control_metrics: line too long");
+		}
+		nl = out.buf + pos + n - 1;
+		*nl = '\0';
+		m_compose(p, IMSG_CTL_SHOW_METRICS, 0, 0, -1, out.buf + pos, n);
+	}
+	m_compose(p, IMSG_CTL_SHOW_METRICS, 0, 0, -1, NULL, 0);
+	free(out.buf);
 }
 
 /* ARGSUSED */
@@ -429,11 +812,12 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 {
 	struct sockaddr_storage	 ss;
 	struct ctl_conn		*c;
+	struct ctl_limit	 limit;
 	int			 v;
 	struct stat_kv		*kvp;
 	char			*key;
 	struct stat_value	 val;
-	size_t			 len;
+	size_t			 len, i;
 
 	c = p->data;
 
@@ -470,6 +854,33 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		m_compose(p, IMSG_DIGEST, 0, 0, -1, &digest, sizeof digest);
 		return;
 
+	case IMSG_CTL_MONITOR:
+		if (c->euid)
+			goto badcred;
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof(v))
+			goto invalid;
+		memcpy(&v, imsg->data, sizeof(v));
+		if (v < 1 || v > 3600)
+			goto invalid;
+
+		/* the current digest, then a frame of deltas every interval */
+		digest.timestamp = time(NULL);
+		m_compose(p, IMSG_DIGEST, 0, 0, -1, &digest, sizeof digest);
+
+		if (c->flags & CTL_CONN_MONITOR)
+			evtimer_del(&c->monev);
+		else {
+			c->flags |= CTL_CONN_MONITOR;
+			TAILQ_INSERT_TAIL(&monitors, c, monentry);
+			evtimer_set(&c->monev, control_monitor_timeout, c);
+		}
+		c->monlast = digest;
+		c->mondirty = 0;
+		c->montv.tv_sec = v;
+		c->montv.tv_usec = 0;
+		evtimer_add(&c->monev, &c->montv);
+		return;
+
 	case IMSG_STATS_GET:
 		if (c->euid)
 			goto badcred;
@@ -483,6 +894,12 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		m_compose(p, IMSG_STATS_GET, 0, 0, -1, kvp, sizeof *kvp);
 		return;
 
+	case IMSG_CTL_SHOW_METRICS:
+		if (c->euid)
+			goto badcred;
+		control_metrics(p);
+		return;
+
 	case IMSG_CTL_SHUTDOWN:
 		/* NEEDS_FIX */
 		log_debug("debug: received shutdown request");
@@ -633,7 +1050,7 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp paused");
 		env->sc_flags |= SMTPD_SMTP_PAUSED;
-		m_compose(p_smtp, IMSG_CTL_PAUSE_SMTP, 0, 0, -1, NULL, 0);
+		smtp_forward(imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -683,7 +1100,7 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp resumed");
 		env->sc_flags &= ~SMTPD_SMTP_PAUSED;
-		m_forward(p_smtp, imsg);
+		smtp_forward(imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -691,7 +1108,7 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (c->euid)
 			goto badcred;
 
-		m_forward(p_mta, imsg);
+		mta_forward(imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -709,6 +1126,13 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
 		return;
 
+	case IMSG_CTL_QUERY_ENVELOPES:
+		if (c->euid)
+			goto badcred;
+		m_compose(p_scheduler, IMSG_CTL_QUERY_ENVELOPES, c->id, 0, -1,
+		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
+		return;
+
 	case IMSG_CTL_MTA_SHOW_HOSTS:
 	case IMSG_CTL_MTA_SHOW_RELAYS:
 	case IMSG_CTL_MTA_SHOW_ROUTES:
@@ -718,7 +1142,27 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 			goto badcred;
 
 		imsg->hdr.peerid = c->id;
-		m_forward(p_mta, imsg);
+		c->mtapending = env->sc_mta_procs;
+		mta_forward(imsg);
+		return;
+
+	case IMSG_CTL_SHOW_IMSG_PROFILE:
+		if (c->euid)
+			goto badcred;
+
+		c->profpending = 0;
+		control_profile_request(c, p_ca);
+		for (i = 0; i < env->sc_lka_procs; i++)
+			control_profile_request(c, p_lkas[i]);
+		control_profile_request(c, p_mda);
+		control_profile_request(c, p_mfa);
+		control_profile_request(c, p_parent);
+		control_profile_request(c, p_queue);
+		control_profile_request(c, p_scheduler);
+		for (i = 0; i < env->sc_mta_procs; i++)
+			control_profile_request(c, p_mtas[i]);
+		for (i = 0; i < env->sc_smtp_procs; i++)
+			control_profile_request(c, p_smtps[i]);
 		return;
 
 	case IMSG_CTL_SHOW_STATUS:
@@ -737,10 +1181,45 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (imsg->hdr.len - IMSG_HEADER_SIZE <= sizeof(ss))
 			goto invalid;
 		memmove(&ss, imsg->data, sizeof(ss));
-		m_create(p_mta, imsg->hdr.type, c->id, 0, -1);
-		m_add_sockaddr(p_mta, (struct sockaddr *)&ss);
-		m_add_string(p_mta, (char *)imsg->data + sizeof(ss));
-		m_close(p_mta);
+		c->mtapending = env->sc_mta_procs;
+		for (i = 0; i < env->sc_mta_procs; i++) {
+			m_create(p_mtas[i], imsg->hdr.type, c->id, 0, -1);
+			m_add_sockaddr(p_mtas[i], (struct sockaddr *)&ss);
+			m_add_string(p_mtas[i], (char *)imsg->data + sizeof(ss));
+			m_close(p_mtas[i]);
+		}
+		return;
+
+	case IMSG_CTL_SET_LIMIT:
+		if (c->euid)
+			goto badcred;
+
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof(limit))
+			goto invalid;
+		memmove(&limit, imsg->data, sizeof(limit));
+		limit.name[sizeof(limit.name) - 1] = '\0';
+
+		switch (limit_process(limit.name)) {
+		case PROC_MDA:
+			m_compose(p_mda, IMSG_CTL_SET_LIMIT, c->id, 0, -1,
+			    &limit, sizeof(limit));
+			return;
+		case PROC_MTA:
+			c->mtapending = env->sc_mta_procs;
+			for (i = 0; i < env->sc_mta_procs; i++)
+				m_compose(p_mtas[i], IMSG_CTL_SET_LIMIT, c->id,
+				    0, -1, &limit, sizeof(limit));
+			return;
+		case PROC_QUEUE:
+			m_compose(p_queue, IMSG_CTL_SET_LIMIT, c->id, 0, -1,
+			    &limit, sizeof(limit));
+			return;
+		case PROC_SCHEDULER:
+			m_compose(p_scheduler, IMSG_CTL_SET_LIMIT, c->id, 0, -1,
+			    &limit, sizeof(limit));
+			return;
+		}
+		m_compose(p, IMSG_CTL_FAIL, 0, 0, -1, NULL, 0);
 		return;
 
 	case IMSG_CTL_SCHEDULE:
@@ -768,7 +1247,7 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (len >= SMTPD_MAXLINESIZE)
 			goto invalid;
 
-		m_forward(p_lka, imsg);
+		lka_forward(imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -34,13 +35,33 @@
 /* bump if we ever switch from aes-256-gcm to anything else */
 #define	API_VERSION    		1
 
+/*
+ * Files are encrypted in chunks of CHUNK_SIZE bytes, each with its own
+ * tag, so that any part of a file can be authenticated and decrypted on
+ * its own.  The nonce of a chunk is the file IV with the chunk index
+ * xored into its last four bytes, and the index and a final chunk marker
+ * are authenticated as additional data so chunks can neither be
+ * reordered nor dropped from the end.
+ */
+#define	CHUNKED_VERSION		2
+#define	CHUNK_SIZE		65536
+#define	CHUNK_HDR_SIZE		(1 + IV_SIZE)
+
 
 int	crypto_setup(const char *, size_t);
 int	crypto_encrypt_file(FILE *, FILE *);
 int	crypto_decrypt_file(FILE *, FILE *);
+int	crypto_decrypt_file_range(FILE *, FILE *, off_t, size_t);
+int	crypto_decrypt_file_headers(FILE *, FILE *);
 size_t	crypto_encrypt_buffer(const char *, size_t, char *, size_t);
 size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
 
+static int	crypto_chunk(EVP_CIPHER_CTX *, int, const uint8_t *, uint32_t,
+    int, const uint8_t *, size_t, uint8_t *, uint8_t *);
+static int	crypto_decrypt_chunks(FILE *, FILE *, off_t, size_t, int);
+static int	crypto_decrypt_file_v1(FILE *, FILE *);
+static int	crypto_at_eof(FILE *);
+
 static struct crypto_ctx {
 	const EVP_CIPHER       *cipher;
 	unsigned char  		key[KEY_SIZE];
@@ -61,70 +82,239 @@ crypto_setup(const char *key, size_t len)
 	return 1;
 }
 
+static int
+crypto_chunk(EVP_CIPHER_CTX *ctx, int enc, const uint8_t *fileiv,
+    uint32_t idx, int final, const uint8_t *in, size_t len, uint8_t *out,
+    uint8_t *tag)
+{
+	uint8_t		iv[IV_SIZE];
+	uint8_t		aad[5];
+	int		olen, i;
+
+	memcpy(iv, fileiv, sizeof iv);
+	for (i = 0; i < 4; i++)
+		iv[IV_SIZE - 1 - i] ^= (idx >> (i * 8)) & 0xff;
+
+	aad[0] = (idx >> 24) & 0xff;
+	aad[1] = (idx >> 16) & 0xff;
+	aad[2] = (idx >> 8) & 0xff;
+	aad[3] = idx & 0xff;
+	aad[4] = final ? 1 : 0;
+
+	if (!EVP_CipherInit(ctx, cp.cipher, cp.key, iv, enc))
+		return 0;
+	if (!enc &&
+	    !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, tag))
+		return 0;
+	if (!EVP_CipherUpdate(ctx, NULL, &olen, aad, sizeof aad))
+		return 0;
+	if (len && !EVP_CipherUpdate(ctx, out, &olen, in, len))
+		return 0;
+	if (!EVP_CipherFinal(ctx, out + len, &olen))
+		return 0;
+	if (enc &&
+	    !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE, tag))
+		return 0;
+
+	return 1;
+}
+
+static int
+crypto_at_eof(FILE *fp)
+{
+	int	c;
+
+	if ((c = getc(fp)) == EOF)
+		return 1;
+	ungetc(c, fp);
+	return 0;
+}
+
 int
 crypto_encrypt_file(FILE * in, FILE * out)
 {
 	EVP_CIPHER_CTX	ctx;
-	uint8_t		ibuf[CRYPTO_BUFFER_SIZE];
-	uint8_t		obuf[CRYPTO_BUFFER_SIZE];
+	uint8_t	       *ibuf = NULL;
+	uint8_t	       *obuf = NULL;
 	uint8_t		iv[IV_SIZE];
 	uint8_t		tag[GCM_TAG_SIZE];
-	uint8_t		version = API_VERSION;
-	size_t		r, w;
-	int		len;
+	uint8_t		version = CHUNKED_VERSION;
+	uint32_t	idx;
+	size_t		r;
+	int		final;
 	int		ret = 0;
-	struct stat	sb;
-
-	/* XXX - Do NOT encrypt files bigger than 64GB */
-	if (fstat(fileno(in), &sb) < 0)
-		return 0;
-	if (sb.st_size >= 0x1000000000LL)
-		return 0;
 
 	/* prepend version byte*/
-	if ((w = fwrite(&version, 1, sizeof version, out)) != sizeof version)
+	if (fwrite(&version, 1, sizeof version, out) != sizeof version)
 		return 0;
 
 	/* generate and prepend IV */
 	memset(iv, 0, sizeof iv);
 	arc4random_buf(iv, sizeof iv);
-	if ((w = fwrite(iv, 1, sizeof iv, out)) != sizeof iv)
+	if (fwrite(iv, 1, sizeof iv, out) != sizeof iv)
 		return 0;
 
+	if ((ibuf = malloc(CHUNK_SIZE)) == NULL ||
+	    (obuf = malloc(CHUNK_SIZE)) == NULL) {
+		free(ibuf);
+		return 0;
+	}
+
 	EVP_CIPHER_CTX_init(&ctx);
-	EVP_EncryptInit(&ctx, cp.cipher, cp.key, iv);
 
-	/* encrypt until end of file */
-	while ((r = fread(ibuf, 1, CRYPTO_BUFFER_SIZE, in)) != 0) {
-		if (!EVP_EncryptUpdate(&ctx, obuf, &len, ibuf, r))
+	/* an empty file still has a final chunk */
+	for (idx = 0, final = 0; !final; idx++) {
+		/* at 2^32 chunks the nonces would wrap */
+		if (idx == 0xffffffff)
 			goto end;
-		if (len && (w = fwrite(obuf, len, 1, out)) != 1)
+		r = fread(ibuf, 1, CHUNK_SIZE, in);
+		if (ferror(in))
+			goto end;
+		final = (r < CHUNK_SIZE) || crypto_at_eof(in);
+		if (!crypto_chunk(&ctx, 1, iv, idx, final, ibuf, r, obuf, tag))
+			goto end;
+		if (r && fwrite(obuf, r, 1, out) != 1)
+			goto end;
+		if (fwrite(tag, sizeof tag, 1, out) != 1)
 			goto end;
 	}
-	if (!feof(in))
-		goto end;
-
-	/* finalize and write last chunk if any */
-	if (!EVP_EncryptFinal(&ctx, obuf, &len))
-		goto end;
-	if (len && (w = fwrite(obuf, len, 1, out)) != 1)
-		goto end;
-
-	/* get and append tag */
-	EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_GET_TAG, sizeof tag, tag);
-	if ((w = fwrite(tag, sizeof tag, 1, out)) != 1)
-		goto end;
 
 	fflush(out);
 	ret = 1;
 
 end:
 	EVP_CIPHER_CTX_cleanup(&ctx);
+	free(ibuf);
+	free(obuf);
 	return ret;
 }
 
 int
 crypto_decrypt_file(FILE * in, FILE * out)
+{
+	uint8_t		version;
+
+	if (fread(&version, 1, sizeof version, in) != sizeof version)
+		return 0;
+	if (version == API_VERSION) {
+		if (fseek(in, 0, SEEK_SET) == -1)
+			return 0;
+		return crypto_decrypt_file_v1(in, out);
+	}
+	if (fseek(in, 0, SEEK_SET) == -1)
+		return 0;
+
+	return crypto_decrypt_file_range(in, out, 0, SIZE_MAX);
+}
+
+/*
+ * Decrypt len bytes at offset off of a chunked file, only reading and
+ * authenticating the chunks that hold them.
+ */
+int
+crypto_decrypt_file_range(FILE *in, FILE *out, off_t off, size_t len)
+{
+	return crypto_decrypt_chunks(in, out, off, len, 0);
+}
+
+/*
+ * Decrypt a chunked file up to the chunk holding the empty line that
+ * ends the message headers, however far into the file that is.
+ */
+int
+crypto_decrypt_file_headers(FILE *in, FILE *out)
+{
+	return crypto_decrypt_chunks(in, out, 0, SIZE_MAX, 1);
+}
+
+static int
+crypto_decrypt_chunks(FILE *in, FILE *out, off_t off, size_t len,
+    int headers)
+{
+	EVP_CIPHER_CTX	ctx;
+	uint8_t	       *ibuf = NULL;
+	uint8_t	       *obuf = NULL;
+	uint8_t		iv[IV_SIZE];
+	uint8_t		version;
+	uint32_t	idx;
+	size_t		r, skip, n, i;
+	int		final, bol;
+	int		ret = 0;
+
+	if (off < 0)
+		return 0;
+
+	if (fseek(in, 0, SEEK_SET) == -1)
+		return 0;
+	if (fread(&version, 1, sizeof version, in) != sizeof version)
+		return 0;
+	if (version != CHUNKED_VERSION)
+		return 0;
+	if (fread(iv, 1, sizeof iv, in) != sizeof iv)
+		return 0;
+
+	if (off / CHUNK_SIZE >= 0xffffffff)
+		return 0;
+	idx = off / CHUNK_SIZE;
+	skip = off % CHUNK_SIZE;
+	if (fseeko(in, CHUNK_HDR_SIZE +
+	    (off_t)idx * (CHUNK_SIZE + GCM_TAG_SIZE), SEEK_SET) == -1)
+		return 0;
+
+	if ((ibuf = malloc(CHUNK_SIZE + GCM_TAG_SIZE)) == NULL ||
+	    (obuf = malloc(CHUNK_SIZE)) == NULL) {
+		free(ibuf);
+		return 0;
+	}
+
+	EVP_CIPHER_CTX_init(&ctx);
+
+	bol = 1;
+	for (final = 0; !final && len; idx++) {
+		r = fread(ibuf, 1, CHUNK_SIZE + GCM_TAG_SIZE, in);
+		if (ferror(in) || r < GCM_TAG_SIZE)
+			goto end;
+		final = (r < CHUNK_SIZE + GCM_TAG_SIZE) || crypto_at_eof(in);
+		r -= GCM_TAG_SIZE;
+		if (!crypto_chunk(&ctx, 0, iv, idx, final, ibuf, r, obuf,
+		    ibuf + r))
+			goto end;
+		if (skip >= r) {
+			/* offset past the end of file */
+			skip = 0;
+			continue;
+		}
+		n = r - skip;
+		if (n > len)
+			n = len;
+		if (fwrite(obuf + skip, n, 1, out) != 1)
+			goto end;
+		len -= n;
+		skip = 0;
+
+		/* stop after the chunk holding the end of headers */
+		for (i = 0; headers && i < n; i++) {
+			if (obuf[i] == '\n') {
+				if (bol)
+					len = 0;
+				bol = 1;
+			} else if (obuf[i] != '\r')
+				bol = 0;
+		}
+	}
+
+	fflush(out);
+	ret = 1;
+
+end:
+	EVP_CIPHER_CTX_cleanup(&ctx);
+	free(ibuf);
+	free(obuf);
+	return ret;
+}
+
+static int
+crypto_decrypt_file_v1(FILE * in, FILE * out)
 {
 	EVP_CIPHER_CTX	ctx;
 	uint8_t		ibuf[CRYPTO_BUFFER_SIZE];
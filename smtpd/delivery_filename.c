@@ -42,20 +42,36 @@ extern char	**environ;
 
 /* filename backend */
 static void delivery_filename_open(struct deliver *);
+static int delivery_filename_deliver(struct deliver *, int, char *, size_t);
 
 struct delivery_backend delivery_backend_filename = {
-	0, delivery_filename_open
+	0, delivery_filename_open, delivery_filename_deliver
 };
 
 
 static void
 delivery_filename_open(struct deliver *deliver)
+{
+	char	ebuf[SMTPD_MAXLINESIZE];
+
+	setproctitle("file delivery");
+	if (delivery_filename_deliver(deliver, STDIN_FILENO, ebuf,
+	    sizeof ebuf) == -1) {
+		fprintf(stderr, "%s\n", ebuf);
+		_exit(1);
+	}
+	_exit(0);
+}
+
+static int
+delivery_filename_deliver(struct deliver *deliver, int in, char *ebuf,
+    size_t ebufsz)
 {
 	struct stat	 sb;
 	time_t		 now;
 	size_t		 len;
 	int		 fd;
-	FILE		*fp;
+	FILE		*fin, *fp;
 	char		*ln;
 	char		*msg;
 	int		 n;
@@ -63,7 +79,12 @@ delivery_filename_open(struct deliver *deliver)
 #define error(m)	{ msg = m; goto err; }
 #define error2(m)	{ msg = m; goto err2; }
 
-	setproctitle("file delivery");
+	fd = -1;
+	fp = NULL;
+	if ((fin = fdopen(in, "r")) == NULL) {
+		close(in);
+		error("fdopen");
+	}
 	fd = open(deliver->to, O_CREAT | O_APPEND | O_WRONLY, 0600);
 	if (fd < 0)
 		error("open");
@@ -77,7 +98,7 @@ delivery_filename_open(struct deliver *deliver)
 	time(&now);
 	fprintf(fp, "From %s@%s %s", SMTPD_USER, env->sc_hostname,
 	    ctime(&now));
-	while ((ln = fgetln(stdin, &len)) != NULL) {
+	while ((ln = fgetln(fin, &len)) != NULL) {
 		if (ln[len - 1] == '\n')
 			len--;
 		if (len >= 5 && memcmp(ln, "From ", 5) == 0)
@@ -86,7 +107,7 @@ delivery_filename_open(struct deliver *deliver)
 		if (ferror(fp))
 			break;
 	}
-	if (ferror(stdin))
+	if (ferror(fin))
 		error2("read error");
 	putc('\n', fp);
 	if (fflush(fp) == EOF || ferror(fp))
@@ -95,16 +116,27 @@ delivery_filename_open(struct deliver *deliver)
 		if (errno != EINVAL)
 			error2("fsync");
 	}
-	if (fclose(fp) == EOF)
+	n = fclose(fp);
+	fp = NULL;
+	fd = -1;
+	if (n == EOF)
 		error2("fclose");
-	_exit(0);
+	fclose(fin);
+	return (0);
 
 err2:
 	n = errno;
-	ftruncate(fd, sb.st_size);
+	if (fd != -1)
+		ftruncate(fd, sb.st_size);
 	errno = n;
 
 err:
-	perror(msg);
-	_exit(1);
+	snprintf(ebuf, ebufsz, "%s: %s", msg, strerror(errno));
+	if (fp)
+		fclose(fp);
+	else if (fd != -1)
+		close(fd);
+	if (fin)
+		fclose(fin);
+	return (-1);
 }
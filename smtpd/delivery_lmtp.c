@@ -23,11 +23,12 @@
 #include <sys/un.h>
 
 #include <ctype.h>
-#include <err.h>
+#include <errno.h>
 #include <event.h>
 #include <fcntl.h>
 #include <imsg.h>
-#include <paths.h>
+#include <inttypes.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,205 +37,695 @@
 #include "smtpd.h"
 #include "log.h"
 
+/*
+ * LMTP sessions run in the mda process.  Connections are kept per
+ * destination and reused, the envelopes of a message that are ready
+ * together go in a single transaction, with a reply per recipient after
+ * the data, and the commands are pipelined when the server allows it,
+ * which LMTP servers must.  The sockets are out of the chroot, so the
+ * parent forks a helper running as the user to make each connection,
+ * and connections are kept per user and destination.
+ */
 
-/* mda backend */
-static void delivery_lmtp_open(struct deliver *);
+#define	LMTP_CONN_MAX		4	/* per destination */
+#define	LMTP_RCPT_MAX		100	/* per transaction */
+#define	LMTP_TIMEOUT		300000
+#define	LMTP_IDLE_TIMEOUT	30000
+#define	LMTP_HIWAT		65535
+#define	LMTP_DATA_CHUNK		16384
 
-static int inet_socket(char *);
-static int unix_socket(char *);
-static char* lmtp_getline(FILE *);
+enum lmtp_state {
+	LMTP_CONNECT,
+	LMTP_BANNER,
+	LMTP_LHLO,
+	LMTP_READY,
+	LMTP_MAIL,
+	LMTP_RCPT,
+	LMTP_DATA,
+	LMTP_BODY,
+	LMTP_EOM,
+	LMTP_RSET,
+	LMTP_QUIT,
+};
 
-struct delivery_backend delivery_backend_lmtp = {
-	 0, delivery_lmtp_open
+struct lmtp_rcpt {
+	TAILQ_ENTRY(lmtp_rcpt)	 entry;
+	uint64_t		 id;
+	uint32_t		 msgid;
+	char			*sender;
+	char			*rcpt;
+	FILE			*fp;
+	int			 accepted;
 };
 
-enum lmtp_state {
-	 LMTP_BANNER,
-	 LMTP_LHLO,
-	 LMTP_MAIL_FROM,
-	 LMTP_RCPT_TO,
-	 LMTP_DATA,
-	 LMTP_QUIT,
-	 LMTP_BYE
+TAILQ_HEAD(lmtp_rcptq, lmtp_rcpt);
+
+struct lmtp_conn;
+
+struct lmtp_dest {
+	char			*key;
+	char			*name;
+	struct userinfo		 userinfo;
+	struct lmtp_rcptq	 queue;
+	TAILQ_HEAD(, lmtp_conn)	 conns;
+	size_t			 nconn;
+	size_t			 nconnecting;
+	struct event		 ev;
 };
 
-static int
-inet_socket (char *address)
+struct lmtp_conn {
+	TAILQ_ENTRY(lmtp_conn)	 entry;
+	uint64_t		 id;
+	struct lmtp_dest	*dest;
+	enum lmtp_state		 state;
+	int			 ready;		/* got through LHLO once */
+	int			 pipelining;
+	struct io		 io;
+	struct iobuf		 iobuf;
+
+	struct lmtp_rcptq	 rcpts;
+	struct lmtp_rcpt	*reply;		/* RCPT awaiting its reply */
+	size_t			 naccepted;
+	int			 mailok;
+	char			 mailerr[SMTPD_MAXLINESIZE];
+	FILE			*datafp;
+	int			 midline;
+};
+
+static void lmtp_dest_run(int, short, void *);
+static void lmtp_dest_schedule(struct lmtp_dest *);
+static void lmtp_dest_fail(struct lmtp_dest *, const char *);
+static void lmtp_open(struct lmtp_dest *);
+static void lmtp_start(struct lmtp_conn *);
+static void lmtp_send_rcpt(struct lmtp_conn *);
+static void lmtp_response(struct lmtp_conn *, char *);
+static void lmtp_ready(struct lmtp_conn *);
+static void lmtp_queue_data(struct lmtp_conn *);
+static void lmtp_queue_chunk(struct lmtp_conn *, const char *, size_t);
+static void lmtp_io(struct io *, int);
+static void lmtp_rcpt_done(struct lmtp_conn *, struct lmtp_rcpt *,
+    const char *);
+static void lmtp_rcpt_free(struct lmtp_rcpt *);
+static void lmtp_free(struct lmtp_conn *, const char *);
+
+static struct dict	lmtp_dests;
+static struct tree	lmtp_conns;
+static int		lmtp_init;
+
+/*
+ * Open a connection for mda, in the helper forked by the parent with the
+ * credentials of the user.  The socket is returned while still
+ * connecting, mda learns the outcome on its first read.
+ */
+int
+lmtp_connect(const char *dest, char *err, size_t errsz)
 {
-	 int s, n;
-	 char *hostname, *servname;
-	 struct addrinfo hints;
-	 struct addrinfo *result0, *result;
+	struct sockaddr_un	 sun;
+	struct addrinfo		 hints, *res0, *res;
+	char			 buf[SMTPD_MAXPATHLEN], *port;
+	int			 fd, n;
+
+	if (dest[0] == '/') {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlcpy(sun.sun_path, dest, sizeof(sun.sun_path))
+		    >= sizeof(sun.sun_path)) {
+			snprintf(err, errsz, "socket path too long");
+			return (-1);
+		}
+		if ((fd = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1) {
+			snprintf(err, errsz, "socket: %s", strerror(errno));
+			return (-1);
+		}
+		io_set_blocking(fd, 0);
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 &&
+		    errno != EINPROGRESS) {
+			snprintf(err, errsz, "connect: %s", strerror(errno));
+			close(fd);
+			return (-1);
+		}
+		return (fd);
+	}
 
-	 servname = strchr(address, ':');
-	 if (servname == NULL)
-		 errx(1, "invalid address: %s", address);
+	if (strlcpy(buf, dest, sizeof(buf)) >= sizeof(buf) ||
+	    (port = strrchr(buf, ':')) == NULL) {
+		snprintf(err, errsz, "invalid address");
+		return (-1);
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if ((n = getaddrinfo(buf, port, &hints, &res0))) {
+		snprintf(err, errsz, "%s", gai_strerror(n));
+		return (-1);
+	}
 
-	 *servname++ = '\0';
-	 hostname = address;
-	 s = -1;
+	fd = -1;
+	snprintf(err, errsz, "no address");
+	for (res = res0; res; res = res->ai_next) {
+		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd == -1) {
+			snprintf(err, errsz, "socket: %s", strerror(errno));
+			continue;
+		}
+		io_set_blocking(fd, 0);
+		if (connect(fd, res->ai_addr, res->ai_addrlen) == -1 &&
+		    errno != EINPROGRESS) {
+			snprintf(err, errsz, "connect: %s", strerror(errno));
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		break;
+	}
+	freeaddrinfo(res0);
 
-	 memset(&hints, 0, sizeof(hints));
-	 hints.ai_family = PF_UNSPEC;
-	 hints.ai_socktype = SOCK_STREAM;
-	 hints.ai_flags = AI_NUMERICSERV;
+	return (fd);
+}
 
-	 n = getaddrinfo(hostname, servname, &hints, &result0);
-	 if (n)
-		 errx(1, "%s", gai_strerror(n));
+/*
+ * Take the message fp for the envelope of mda session id.  The outcome
+ * comes back through mda_lmtp_done().
+ */
+void
+lmtp_deliver(uint64_t id, const char *dest, const char *sender,
+    const struct userinfo *userinfo, uint32_t msgid, FILE *fp)
+{
+	struct lmtp_dest	*d;
+	struct lmtp_rcpt	*r;
+	char			 key[SMTPD_MAXPATHLEN + 32];
+
+	if (! lmtp_init) {
+		dict_init(&lmtp_dests);
+		tree_init(&lmtp_conns);
+		lmtp_init = 1;
+	}
 
-	 for (result = result0; s < 0 && result; result = result->ai_next) {
-		 if ((s = socket(result->ai_family, result->ai_socktype,
-			     result->ai_protocol)) == -1) {
-			 warn("socket");
-			 continue;
-		 }
-		 if (connect(s, result->ai_addr, result->ai_addrlen) == -1) {
-			 warn("connect");
-			 close(s);
-			 s = -1;
-			 continue;
-		 }
-		 break;
-	 }
+	(void)snprintf(key, sizeof key, "%u:%u:%s", userinfo->uid,
+	    userinfo->gid, dest);
+	if ((d = dict_get(&lmtp_dests, key)) == NULL) {
+		d = xcalloc(1, sizeof *d, "lmtp_deliver");
+		d->key = xstrdup(key, "lmtp_deliver");
+		d->name = xstrdup(dest, "lmtp_deliver");
+		d->userinfo = *userinfo;
+		TAILQ_INIT(&d->queue);
+		TAILQ_INIT(&d->conns);
+		evtimer_set(&d->ev, lmtp_dest_run, d);
+		dict_xset(&lmtp_dests, d->key, d);
+	}
 
-	 freeaddrinfo(result0);
+	r = xcalloc(1, sizeof *r, "lmtp_deliver");
+	r->id = id;
+	r->msgid = msgid;
+	r->sender = xstrdup(sender, "lmtp_deliver");
+	r->rcpt = xstrdup(userinfo->username, "lmtp_deliver");
+	r->fp = fp;
+	TAILQ_INSERT_TAIL(&d->queue, r, entry);
 
-	 return s;
+	/* let the other envelopes of the message join in */
+	lmtp_dest_schedule(d);
 }
 
-static int
-unix_socket(char *path) {
-	 struct sockaddr_un addr;
-	 int s;
+void
+lmtp_connected(uint64_t id, int fd, const char *error)
+{
+	struct lmtp_conn	*c;
+
+	c = tree_xget(&lmtp_conns, id);
+	c->dest->nconnecting--;
+
+	if (fd == -1) {
+		log_warnx("warn: lmtp: cannot connect to %s: %s",
+		    c->dest->name, error);
+		lmtp_free(c, error);
+		return;
+	}
+
+	log_debug("debug: lmtp: %016"PRIx64": connecting to %s", c->id,
+	    c->dest->name);
+
+	io_set_blocking(fd, 0);
+	io_init(&c->io, fd, c, lmtp_io, &c->iobuf);
+	io_set_timeout(&c->io, LMTP_TIMEOUT);
+	io_set_read(&c->io);
+	c->state = LMTP_BANNER;
+}
+
+static void
+lmtp_dest_schedule(struct lmtp_dest *d)
+{
+	struct timeval	tv;
+
+	if (evtimer_pending(&d->ev, NULL))
+		return;
+	timerclear(&tv);
+	evtimer_add(&d->ev, &tv);
+}
+
+static void
+lmtp_dest_run(int fd, short event, void *arg)
+{
+	struct lmtp_dest	*d = arg;
+	struct lmtp_conn	*c;
+
+	while (! TAILQ_EMPTY(&d->queue)) {
+		TAILQ_FOREACH(c, &d->conns, entry)
+			if (c->state == LMTP_READY)
+				break;
+		if (c == NULL)
+			break;
+		lmtp_start(c);
+	}
+
+	if (! TAILQ_EMPTY(&d->queue) && d->nconnecting == 0 &&
+	    d->nconn < LMTP_CONN_MAX)
+		lmtp_open(d);
+}
+
+/* nothing reaches the destination, fail what waits for it */
+static void
+lmtp_dest_fail(struct lmtp_dest *d, const char *error)
+{
+	struct lmtp_rcpt	*r;
+	char			 buf[SMTPD_MAXLINESIZE];
+
+	snprintf(buf, sizeof buf, "421 LMTP %s: %s", d->name, error);
+	while ((r = TAILQ_FIRST(&d->queue))) {
+		TAILQ_REMOVE(&d->queue, r, entry);
+		mda_lmtp_done(r->id, buf);
+		lmtp_rcpt_free(r);
+	}
+}
+
+static void
+lmtp_open(struct lmtp_dest *d)
+{
+	struct lmtp_conn	*c;
+
+	c = xcalloc(1, sizeof *c, "lmtp_open");
+	c->id = generate_uid();
+	c->dest = d;
+	c->state = LMTP_CONNECT;
+	TAILQ_INIT(&c->rcpts);
+	if (iobuf_init(&c->iobuf, 0, 0) == -1)
+		fatal("lmtp_open");
+	tree_xset(&lmtp_conns, c->id, c);
+	TAILQ_INSERT_TAIL(&d->conns, c, entry);
+	d->nconn++;
+	d->nconnecting++;
+
+	m_create(p_parent, IMSG_PARENT_LMTP_CONNECT, 0, 0, -1);
+	m_add_id(p_parent, c->id);
+	m_add_string(p_parent, d->name);
+	m_add_data(p_parent, &d->userinfo, sizeof d->userinfo);
+	m_close(p_parent);
+}
 
-	 memset(&addr, 0, sizeof(addr));
+/* start a transaction with the first envelope and those of its message */
+static void
+lmtp_start(struct lmtp_conn *c)
+{
+	struct lmtp_dest	*d = c->dest;
+	struct lmtp_rcpt	*first, *r, *next;
+	size_t			 n;
+
+	first = TAILQ_FIRST(&d->queue);
+	TAILQ_REMOVE(&d->queue, first, entry);
+	TAILQ_INSERT_TAIL(&c->rcpts, first, entry);
+	c->datafp = first->fp;
+	first->fp = NULL;
+
+	for (n = 1, r = TAILQ_FIRST(&d->queue); r && n < LMTP_RCPT_MAX;
+	    r = next) {
+		next = TAILQ_NEXT(r, entry);
+		if (r->msgid != first->msgid || strcmp(r->sender, first->sender))
+			continue;
+		TAILQ_REMOVE(&d->queue, r, entry);
+		TAILQ_INSERT_TAIL(&c->rcpts, r, entry);
+		fclose(r->fp);
+		r->fp = NULL;
+		n++;
+	}
 
-	 if ((s = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1) {
-		 warn("socket");
-		 return -1;
-	 }
+	log_debug("debug: lmtp: %016"PRIx64": msgid %08"PRIx32
+	    " for %zu recipient%s", c->id, first->msgid, n, n > 1 ? "s" : "");
+
+	c->naccepted = 0;
+	c->mailok = 0;
+	c->midline = 0;
+	c->reply = first;
+	io_set_timeout(&c->io, LMTP_TIMEOUT);
+
+	c->state = LMTP_MAIL;
+	iobuf_xfqueue(&c->iobuf, "lmtp_start", "MAIL FROM:<%s>\r\n",
+	    first->sender);
+	if (c->pipelining) {
+		TAILQ_FOREACH(r, &c->rcpts, entry)
+			iobuf_xfqueue(&c->iobuf, "lmtp_start",
+			    "RCPT TO:<%s>\r\n", r->rcpt);
+		iobuf_xfqueue(&c->iobuf, "lmtp_start", "DATA\r\n");
+	}
+	io_set_write(&c->io);
+}
 
-	 addr.sun_family = AF_UNIX;
-	 strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+/* without pipelining, the next RCPT or DATA once the reply is in */
+static void
+lmtp_send_rcpt(struct lmtp_conn *c)
+{
+	if (c->pipelining)
+		return;
+
+	if (c->reply)
+		iobuf_xfqueue(&c->iobuf, "lmtp_send_rcpt", "RCPT TO:<%s>\r\n",
+		    c->reply->rcpt);
+	else if (c->naccepted) {
+		c->state = LMTP_DATA;
+		iobuf_xfqueue(&c->iobuf, "lmtp_send_rcpt", "DATA\r\n");
+	}
+	else {
+		c->state = LMTP_RSET;
+		iobuf_xfqueue(&c->iobuf, "lmtp_send_rcpt", "RSET\r\n");
+	}
+	io_set_write(&c->io);
+}
 
-	 if (connect(s, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
-		 warn("connect");
-		 close(s);
-		 return -1;
-	 }
+static void
+lmtp_response(struct lmtp_conn *c, char *line)
+{
+	struct lmtp_rcpt	*r, *next;
+	uint64_t		 id;
+
+	switch (c->state) {
+	case LMTP_BANNER:
+		if (line[0] != '2') {
+			lmtp_free(c, line);
+			return;
+		}
+		c->state = LMTP_LHLO;
+		iobuf_xfqueue(&c->iobuf, "lmtp_response", "LHLO %s\r\n",
+		    env->sc_hostname);
+		io_set_write(&c->io);
+		break;
+
+	case LMTP_LHLO:
+		if (line[0] != '2') {
+			lmtp_free(c, line);
+			return;
+		}
+		c->ready = 1;
+		lmtp_ready(c);
+		break;
+
+	case LMTP_MAIL:
+		c->mailok = (line[0] == '2');
+		if (! c->mailok)
+			strlcpy(c->mailerr, line, sizeof c->mailerr);
+		c->state = LMTP_RCPT;
+		if (! c->mailok && ! c->pipelining) {
+			/* nothing else was sent */
+			while ((r = TAILQ_FIRST(&c->rcpts)))
+				lmtp_rcpt_done(c, r, line);
+			c->reply = NULL;
+			c->state = LMTP_RSET;
+			iobuf_xfqueue(&c->iobuf, "lmtp_response", "RSET\r\n");
+			io_set_write(&c->io);
+			break;
+		}
+		lmtp_send_rcpt(c);
+		break;
+
+	case LMTP_RCPT:
+		r = c->reply;
+		next = TAILQ_NEXT(r, entry);
+		if (c->mailok && line[0] == '2') {
+			r->accepted = 1;
+			c->naccepted++;
+		}
+		else
+			lmtp_rcpt_done(c, r, c->mailok ? line : c->mailerr);
+		c->reply = next;
+		if (next == NULL)
+			c->state = LMTP_DATA;
+		lmtp_send_rcpt(c);
+		break;
+
+	case LMTP_DATA:
+		if (strncmp(line, "354", 3) == 0 && c->naccepted) {
+			c->state = LMTP_BODY;
+			id = c->id;
+			lmtp_queue_data(c);
+			if (tree_get(&lmtp_conns, id) == NULL)
+				return;
+			io_set_write(&c->io);
+			break;
+		}
+		if (strncmp(line, "354", 3) == 0) {
+			lmtp_free(c, "Protocol error");
+			return;
+		}
+		while ((r = TAILQ_FIRST(&c->rcpts)))
+			lmtp_rcpt_done(c, r, line);
+		c->state = LMTP_RSET;
+		iobuf_xfqueue(&c->iobuf, "lmtp_response", "RSET\r\n");
+		io_set_write(&c->io);
+		break;
+
+	case LMTP_EOM:
+		/* one reply for each accepted recipient, in order */
+		lmtp_rcpt_done(c, TAILQ_FIRST(&c->rcpts), line);
+		if (TAILQ_EMPTY(&c->rcpts))
+			lmtp_ready(c);
+		break;
+
+	case LMTP_RSET:
+		lmtp_ready(c);
+		break;
+
+	case LMTP_QUIT:
+		lmtp_free(c, NULL);
+		return;
+
+	default:
+		fatalx("lmtp_response: bad state");
+	}
+}
 
-	 return s;
+static void
+lmtp_ready(struct lmtp_conn *c)
+{
+	if (c->datafp) {
+		fclose(c->datafp);
+		c->datafp = NULL;
+	}
+	c->state = LMTP_READY;
+	io_set_timeout(&c->io, LMTP_IDLE_TIMEOUT);
+	io_set_read(&c->io);
+	if (! TAILQ_EMPTY(&c->dest->queue))
+		lmtp_dest_schedule(c->dest);
 }
 
 static void
-delivery_lmtp_open(struct deliver *deliver)
-{
-	 char *buffer;
-	 char *lbuf;
-	 char lhloname[255];
-	 int s;
-	 FILE	*fp;
-	 enum lmtp_state state = LMTP_BANNER;
-	 size_t	len;
-
-	 fp = NULL;
-
-	 if (deliver->to[0] == '/')
-		 s = unix_socket(deliver->to);
-	 else
-		 s = inet_socket(deliver->to);
-
-	 if (s == -1 || (fp = fdopen(s, "r+")) == NULL)
-		 err(1, "couldn't establish connection");
-
-	 while (!feof(fp) && !ferror(fp) && state != LMTP_BYE) {
-		 buffer = lmtp_getline(fp);
-		 if (buffer == NULL)
-			 err(1, "No input received");
-
-		 switch (state) {
-		 case LMTP_BANNER:
-			 if (strncmp("220 ", buffer, 4) != 0)
-				 errx(1, "Invalid LMTP greeting: %s\n", buffer);
-			 gethostname(lhloname, sizeof lhloname );
-			 fprintf(fp, "LHLO %s\r\n", lhloname);
-			 state = LMTP_LHLO;
-			 break;
-
-		 case LMTP_LHLO:
-			 if (buffer[0] != '2')
-				 errx(1, "LHLO rejected: %s\n", buffer);
-			 if (strlen(buffer) < 4)
-				 errx(1, "Invalid LMTP LHLO answer: %s\n", buffer);
-			 if (buffer[3] == '-')
-				 continue; /* multi-line */
-			 fprintf(fp, "MAIL FROM:<%s>\r\n", deliver->from);
-			 state = LMTP_MAIL_FROM;
-			 break;
-
-		 case LMTP_MAIL_FROM:
-			 if (buffer[0] != '2')
-				 errx(1, "MAIL FROM rejected: %s\n", buffer);
-			 fprintf(fp, "RCPT TO:<%s>\r\n", deliver->user);
-			 state = LMTP_RCPT_TO;
-			 break;
-			 
-		 case LMTP_RCPT_TO:
-			 if (buffer[0] != '2')
-				 errx(1, "RCPT TO rejected: %s\n", buffer);
-			 fprintf(fp, "DATA\r\n");
-			 state = LMTP_DATA;
-			 break;
-			 
-		 case LMTP_DATA:
-			 if (buffer[0] != '3')
-				 errx(1, "DATA rejected: %s\n", buffer);
-			 lbuf = NULL;
-			 while ((buffer = fgetln(stdin, &len))) {
-				 if (buffer[len- 1] == '\n')
-					 buffer[len - 1] = '\0';
-				 else {
-					 if ((lbuf = malloc(len + 1)) == NULL)
-						 err(1, NULL);
-					 memcpy(lbuf, buffer, len);
-					 lbuf[len] = '\0';
-					 buffer = lbuf;
-				 }
-				 fprintf(fp, "%s%s\r\n",
-				     *buffer == '.' ? "." : "", buffer);
-			 }
-			 free(lbuf);
-			 fprintf(fp, ".\r\n");
-			 state = LMTP_QUIT;
-			 break;
-
-		 case LMTP_QUIT:
-			 if (buffer[0] != '2')
-				 errx(1, "Delivery error: %s\n", buffer);
-			 fprintf(fp, "QUIT\r\n");
-			 state = LMTP_BYE;
-			 break;
-
-		 default:
-			errx(1, "Bogus state %d", state);
-		 }
-	 }
-
-	 _exit(0);
-}
-
-static char*
-lmtp_getline(FILE *fp)
-{
-	char   *buffer;
+lmtp_queue_data(struct lmtp_conn *c)
+{
+	char	buf[LMTP_DATA_CHUNK];
 	size_t	len;
-	
-	if ((buffer = fgetln(fp, &len)) != NULL) {
-		if (len >= 2 && buffer[len-2] == '\r')
-			buffer[len-2] = '\0';
-		buffer[len-1] = '\0';
+
+	while (iobuf_queued(&c->iobuf) < LMTP_HIWAT) {
+		if ((len = fread(buf, 1, sizeof buf, c->datafp)) == 0)
+			break;
+		lmtp_queue_chunk(c, buf, len);
 	}
 
-	return buffer;
+	if (ferror(c->datafp)) {
+		lmtp_free(c, "Error reading content file");
+		return;
+	}
+
+	if (feof(c->datafp)) {
+		if (c->midline)
+			iobuf_xfqueue(&c->iobuf, "lmtp_queue_data", "\r\n");
+		iobuf_xfqueue(&c->iobuf, "lmtp_queue_data", ".\r\n");
+		fclose(c->datafp);
+		c->datafp = NULL;
+		c->state = LMTP_EOM;
+	}
+}
+
+/* as mta_queue_chunk(), CRLF line endings and dot-stuffing */
+static void
+lmtp_queue_chunk(struct lmtp_conn *c, const char *data, size_t len)
+{
+	const char	*p, *nl, *end = data + len;
+	char		*out;
+	size_t		 extra = 0;
+
+	if (! c->midline && *data == '.')
+		extra++;
+	for (p = data; (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		extra++;
+		if (nl + 1 < end && nl[1] == '.')
+			extra++;
+	}
+
+	if ((out = iobuf_reserve(&c->iobuf, len + extra)) == NULL) {
+		log_warnx("lmtp_queue_chunk: iobuf_reserve(%p, %zu)",
+		    &c->iobuf, len + extra);
+		fatalx("exiting");
+	}
+
+	if (! c->midline && *data == '.')
+		*out++ = '.';
+	for (p = data; (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		memcpy(out, p, nl - p);
+		out += nl - p;
+		*out++ = '\r';
+		*out++ = '\n';
+		if (nl + 1 < end && nl[1] == '.')
+			*out++ = '.';
+	}
+	memcpy(out, p, end - p);
+
+	c->midline = (end[-1] != '\n');
+}
+
+static void
+lmtp_io(struct io *io, int evt)
+{
+	struct lmtp_conn	*c = io->arg;
+	char			*line, *msg;
+	size_t			 len;
+	const char		*error;
+	int			 cont;
+
+	log_trace(TRACE_IO, "lmtp: %p: %s %s", c, io_strevent(evt),
+	    io_strio(io));
+
+	switch (evt) {
+	case IO_DATAIN:
+	    nextline:
+		line = iobuf_getline(&c->iobuf, &len);
+		if (line == NULL) {
+			if (iobuf_len(&c->iobuf) >= SMTPD_MAXLINESIZE) {
+				lmtp_free(c, "Input too long");
+				return;
+			}
+			iobuf_normalize(&c->iobuf);
+			break;
+		}
+
+		log_trace(TRACE_IO, "lmtp: %p: <<< %s", c, line);
+
+		if ((error = parse_smtp_response(line, len, &msg, &cont))) {
+			lmtp_free(c, error);
+			return;
+		}
+		if (c->state == LMTP_LHLO && strcmp(msg, "PIPELINING") == 0)
+			c->pipelining = 1;
+		if (cont)
+			goto nextline;
+
+		if (c->state == LMTP_READY) {
+			/* unsolicited, likely the server going away */
+			lmtp_free(c, NULL);
+			return;
+		}
+		lmtp_response(c, line);
+		if (tree_get(&lmtp_conns, c->id) == NULL)
+			return;
+		goto nextline;
+
+	case IO_LOWAT:
+		if (c->state == LMTP_BODY) {
+			lmtp_queue_data(c);
+			if (tree_get(&lmtp_conns, c->id) == NULL)
+				return;
+			if (iobuf_queued(&c->iobuf))
+				break;
+		}
+		io_set_read(io);
+		break;
+
+	case IO_TIMEOUT:
+		if (c->state == LMTP_READY) {
+			c->state = LMTP_QUIT;
+			iobuf_xfqueue(&c->iobuf, "lmtp_io", "QUIT\r\n");
+			io_set_write(io);
+			break;
+		}
+		lmtp_free(c, "Connection timeout");
+		break;
+
+	case IO_ERROR:
+		lmtp_free(c, io->error);
+		break;
+
+	case IO_DISCONNECTED:
+		lmtp_free(c, c->state == LMTP_READY ||
+		    c->state == LMTP_QUIT ? NULL : "Connection closed");
+		break;
+
+	default:
+		fatalx("lmtp_io()");
+	}
+}
+
+/* the reply of the server, or a 4xx one made up for local errors */
+static void
+lmtp_rcpt_done(struct lmtp_conn *c, struct lmtp_rcpt *r, const char *reply)
+{
+	TAILQ_REMOVE(&c->rcpts, r, entry);
+	log_debug("debug: lmtp: %016"PRIx64": <%s>: %s", c->id, r->rcpt,
+	    reply);
+	mda_lmtp_done(r->id, reply);
+	lmtp_rcpt_free(r);
+}
+
+static void
+lmtp_rcpt_free(struct lmtp_rcpt *r)
+{
+	if (r->fp)
+		fclose(r->fp);
+	free(r->sender);
+	free(r->rcpt);
+	free(r);
+}
+
+static void
+lmtp_free(struct lmtp_conn *c, const char *error)
+{
+	struct lmtp_dest	*d = c->dest;
+	struct lmtp_rcpt	*r;
+	char			 buf[SMTPD_MAXLINESIZE];
+	int			 ready = c->ready;
+
+	if (error == NULL)
+		error = "Connection closed";
+	if (isdigit((unsigned char)error[0]))
+		strlcpy(buf, error, sizeof buf);
+	else
+		snprintf(buf, sizeof buf, "421 LMTP %s: %s", d->name, error);
+
+	log_debug("debug: lmtp: %016"PRIx64": closing: %s", c->id, buf);
+
+	while ((r = TAILQ_FIRST(&c->rcpts)))
+		lmtp_rcpt_done(c, r, buf);
+
+	tree_xpop(&lmtp_conns, c->id);
+	TAILQ_REMOVE(&d->conns, c, entry);
+	d->nconn--;
+	if (c->datafp)
+		fclose(c->datafp);
+	if (c->state != LMTP_CONNECT)
+		io_clear(&c->io);
+	iobuf_clear(&c->iobuf);
+	free(c);
+
+	/* a server that cannot be reached fails what waits for it */
+	if (! ready && d->nconn == 0)
+		lmtp_dest_fail(d, error);
+	else if (! TAILQ_EMPTY(&d->queue))
+		lmtp_dest_schedule(d);
 }
@@ -42,25 +42,42 @@ extern char	**environ;
 
 /* maildir backend */
 static void delivery_maildir_open(struct deliver *);
+static int delivery_maildir_deliver(struct deliver *, int, char *, size_t);
 
 struct delivery_backend delivery_backend_maildir = {
-	1, delivery_maildir_open
+	1, delivery_maildir_open, delivery_maildir_deliver
 };
 
 
 static void
 delivery_maildir_open(struct deliver *deliver)
 {
+	char	ebuf[SMTPD_MAXLINESIZE];
+
+	setproctitle("maildir delivery");
+	if (delivery_maildir_deliver(deliver, STDIN_FILENO, ebuf,
+	    sizeof ebuf) == -1) {
+		fprintf(stderr, "%s\n", ebuf);
+		_exit(1);
+	}
+	_exit(0);
+}
+
+static int
+delivery_maildir_deliver(struct deliver *deliver, int in, char *ebuf,
+    size_t ebufsz)
+{
+	static unsigned int	 seq;
 	char	 tmp[SMTPD_MAXPATHLEN], new[SMTPD_MAXPATHLEN];
-	int	 ch, fd;
-	FILE	*fp;
+	char	 buf[8192];
 	char	*msg;
-	int	 n;
+	ssize_t	 len, w, off;
+	int	 fd, n;
 
 #define error(m)	{ msg = m; goto err; }
 #define error2(m)	{ msg = m; goto err2; }
 
-	setproctitle("maildir delivery");
+	fd = -1;
 	if (mkdirs(deliver->to, 0700) < 0 && errno != EEXIST)
 		error("cannot mkdir maildir");
 	if (chdir(deliver->to) < 0)
@@ -71,36 +88,52 @@ delivery_maildir_open(struct deliver *deliver)
 		error("mkdir tmp failed");
 	if (mkdir("new", 0700) < 0 && errno != EEXIST)
 		error("mkdir new failed");
-	snprintf(tmp, sizeof tmp, "tmp/%lld.%d.%s",
+	/* a worker delivers many messages within the same second */
+	snprintf(tmp, sizeof tmp, "tmp/%lld.%d_%u.%s",
 	    (long long int) time(NULL),
-	    getpid(), env->sc_hostname);
+	    getpid(), seq++, env->sc_hostname);
 	fd = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0600);
 	if (fd < 0)
 		error("cannot open tmp file");
-	fp = fdopen(fd, "w");
-	if (fp == NULL)
-		error2("fdopen");
-	while ((ch = getc(stdin)) != EOF)
-		if (putc(ch, fp) == EOF)
-			break;
-	if (ferror(stdin))
+
+	/*
+	 * The message comes on a pipe, the kernel can move it to the
+	 * file without going through here.
+	 */
+#ifdef __linux__
+	while ((len = splice(in, NULL, fd, NULL, sizeof buf * 8,
+	    SPLICE_F_MOVE)) > 0)
+		;
+	if (len == -1 && errno != EINVAL && errno != ENOSYS)
+		error2("splice");
+	if (len == -1)
+#endif
+	while ((len = read(in, buf, sizeof buf)) > 0)
+		for (off = 0; off < len; off += w)
+			if ((w = write(fd, buf + off, len - off)) == -1)
+				error2("write error");
+	if (len == -1)
 		error2("read error");
-	if (fflush(fp) == EOF || ferror(fp))
-		error2("write error");
 	if (fsync(fd) < 0)
 		error2("fsync");
-	if (fclose(fp) == EOF)
-		error2("fclose");
+	n = close(fd);
+	fd = -1;
+	if (n == -1)
+		error2("close");
 	snprintf(new, sizeof new, "new/%s", tmp + 4);
 	if (rename(tmp, new) < 0)
 		error2("cannot rename tmp->new");
-	_exit(0);
+	close(in);
+	return (0);
 
 err2:
 	n = errno;
 	unlink(tmp);
 	errno = n;
 err:
-	perror(msg);
-	_exit(1);
+	snprintf(ebuf, ebufsz, "%s: %s", msg, strerror(errno));
+	if (fd != -1)
+		close(fd);
+	close(in);
+	return (-1);
 }
@@ -36,19 +36,25 @@ struct dictentry {
 	SPLAY_ENTRY(dictentry)	entry;
 	const char	       *key;
 	void		       *data;
+	uint64_t		hash;
 };
 
+/* see tree.c */
+#define	DICT_HASH_MIN	32
+
 static int dictentry_cmp(struct dictentry *, struct dictentry *);
+static struct dictentry *dict_find(struct dict *, const char *);
+static int dict_insert(struct dict *, struct dictentry *);
+static void dict_remove(struct dict *, struct dictentry *);
+static uint64_t dict_hash(const char *);
+static void dict_index(struct dict *);
 
 SPLAY_PROTOTYPE(_dict, dictentry, entry, dictentry_cmp);
 
 int
 dict_check(struct dict *d, const char *k)
 {
-	struct dictentry	key;
-
-	key.key = k;
-	return (SPLAY_FIND(_dict, &d->dict, &key) != NULL);
+	return (dict_find(d, k) != NULL);
 }
 
 static inline struct dictentry *
@@ -63,6 +69,7 @@ dict_alloc(const char *k, void *data)
 
 	e->key = t = (char*)(e) + sizeof(*e);
 	e->data = data;
+	e->hash = dict_hash(k);
 	memmove(t, k, s);
 
 	return (e);
@@ -71,16 +78,14 @@ dict_alloc(const char *k, void *data)
 void *
 dict_set(struct dict *d, const char *k, void *data)
 {
-	struct dictentry	*entry, key;
+	struct dictentry	*entry;
 	char			*old;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL) {
+	if ((entry = dict_find(d, k)) == NULL) {
 		if ((entry = dict_alloc(k, data)) == NULL)
 			err(1, "dict_set: malloc");
-		SPLAY_INSERT(_dict, &d->dict, entry);
+		dict_insert(d, entry);
 		old = NULL;
-		d->count += 1;
 	} else {
 		old = entry->data;
 		entry->data = data;
@@ -96,18 +101,16 @@ dict_xset(struct dict *d, const char * k, void *data)
 
 	if ((entry = dict_alloc(k, data)) == NULL)
 		err(1, "dict_xset: malloc");
-	if (SPLAY_INSERT(_dict, &d->dict, entry))
+	if (! dict_insert(d, entry))
 		errx(1, "dict_xset(%p, %s)", d, k);
-	d->count += 1;
 }
 
 void *
 dict_get(struct dict *d, const char *k)
 {
-	struct dictentry	key, *entry;
+	struct dictentry	*entry;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL)
+	if ((entry = dict_find(d, k)) == NULL)
 		return (NULL);
 
 	return (entry->data);
@@ -116,10 +119,9 @@ dict_get(struct dict *d, const char *k)
 void *
 dict_xget(struct dict *d, const char *k)
 {
-	struct dictentry	key, *entry;
+	struct dictentry	*entry;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL)
+	if ((entry = dict_find(d, k)) == NULL)
 		errx(1, "dict_xget(%p, %s)", d, k);
 
 	return (entry->data);
@@ -128,17 +130,15 @@ dict_xget(struct dict *d, const char *k)
 void *
 dict_pop(struct dict *d, const char *k)
 {
-	struct dictentry	key, *entry;
+	struct dictentry	*entry;
 	void			*data;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL)
+	if ((entry = dict_find(d, k)) == NULL)
 		return (NULL);
 
 	data = entry->data;
-	SPLAY_REMOVE(_dict, &d->dict, entry);
+	dict_remove(d, entry);
 	free(entry);
-	d->count -= 1;
 
 	return (data);
 }
@@ -146,17 +146,15 @@ dict_pop(struct dict *d, const char *k)
 void *
 dict_xpop(struct dict *d, const char *k)
 {
-	struct dictentry	key, *entry;
+	struct dictentry	*entry;
 	void			*data;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL)
+	if ((entry = dict_find(d, k)) == NULL)
 		errx(1, "dict_xpop(%p, %s)", d, k);
 
 	data = entry->data;
-	SPLAY_REMOVE(_dict, &d->dict, entry);
+	dict_remove(d, entry);
 	free(entry);
-	d->count -= 1;
 
 	return (data);
 }
@@ -171,9 +169,8 @@ dict_poproot(struct dict *d, void **data)
 		return (0);
 	if (data)
 		*data = entry->data;
-	SPLAY_REMOVE(_dict, &d->dict, entry);
+	dict_remove(d, entry);
 	free(entry);
-	d->count -= 1;
 
 	return (1);
 }
@@ -253,14 +250,130 @@ dict_merge(struct dict *dst, struct dict *src)
 {
 	struct dictentry	*entry;
 
-	while (!SPLAY_EMPTY(&src->dict)) {
-		entry = SPLAY_ROOT(&src->dict);
-		SPLAY_REMOVE(_dict, &src->dict, entry);
-		if (SPLAY_INSERT(_dict, &dst->dict, entry))
+	while ((entry = SPLAY_ROOT(&src->dict)) != NULL) {
+		dict_remove(src, entry);
+		if (! dict_insert(dst, entry))
 			errx(1, "dict_merge: duplicate");
 	}
-	dst->count += src->count;
-	src->count = 0;
+}
+
+static struct dictentry *
+dict_find(struct dict *d, const char *k)
+{
+	struct dictentry	*entry, key;
+	uint64_t		 h;
+	size_t			 i;
+
+	if (d->slots == NULL) {
+		key.key = k;
+		return (SPLAY_FIND(_dict, &d->dict, &key));
+	}
+
+	h = dict_hash(k);
+	for (i = h & (d->nslots - 1); (entry = d->slots[i]) != NULL;
+	    i = (i + 1) & (d->nslots - 1))
+		if (entry->hash == h && !strcmp(entry->key, k))
+			return (entry);
+	return (NULL);
+}
+
+/* return 0 if the key is already there */
+static int
+dict_insert(struct dict *d, struct dictentry *entry)
+{
+	size_t	i;
+
+	if (SPLAY_INSERT(_dict, &d->dict, entry))
+		return (0);
+	d->count += 1;
+
+	if (d->slots == NULL) {
+		if (d->count >= DICT_HASH_MIN)
+			dict_index(d);
+		return (1);
+	}
+	if (d->count * 2 > d->nslots) {
+		dict_index(d);
+		return (1);
+	}
+	for (i = entry->hash & (d->nslots - 1); d->slots[i];
+	    i = (i + 1) & (d->nslots - 1))
+		;
+	d->slots[i] = entry;
+	return (1);
+}
+
+static void
+dict_remove(struct dict *d, struct dictentry *entry)
+{
+	struct dictentry	*e;
+	size_t			 i, j, k, mask;
+
+	SPLAY_REMOVE(_dict, &d->dict, entry);
+	d->count -= 1;
+
+	if (d->slots == NULL)
+		return;
+	if (d->count < DICT_HASH_MIN / 2 || d->count * 8 < d->nslots) {
+		dict_index(d);
+		return;
+	}
+
+	mask = d->nslots - 1;
+	for (i = entry->hash & mask; d->slots[i] != entry; i = (i + 1) & mask)
+		;
+	d->slots[i] = NULL;
+
+	/* move back the entries that probed past the hole */
+	for (j = (i + 1) & mask; (e = d->slots[j]) != NULL; j = (j + 1) & mask) {
+		k = e->hash & mask;
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && k <= i && k > j)) {
+			d->slots[i] = e;
+			d->slots[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+/* FNV-1a */
+static uint64_t
+dict_hash(const char *k)
+{
+	uint64_t	h = 0xcbf29ce484222325ULL;
+
+	for (; *k; k++) {
+		h ^= (unsigned char)*k;
+		h *= 0x100000001b3ULL;
+	}
+	return (h ^ (h >> 32));
+}
+
+/* size the index for the current count, or drop it */
+static void
+dict_index(struct dict *d)
+{
+	struct dictentry	*entry;
+	size_t			 i, n;
+
+	free(d->slots);
+	d->slots = NULL;
+	d->nslots = 0;
+	if (d->count < DICT_HASH_MIN)
+		return;
+
+	for (n = DICT_HASH_MIN * 2; n < d->count * 4; n *= 2)
+		;
+	if ((d->slots = calloc(n, sizeof *d->slots)) == NULL)
+		err(1, "dict_index: calloc");
+	d->nslots = n;
+
+	SPLAY_FOREACH(entry, _dict, &d->dict) {
+		for (i = entry->hash & (n - 1); d->slots[i];
+		    i = (i + 1) & (n - 1))
+			;
+		d->slots[i] = entry;
+	}
 }
 
 static int
@@ -30,9 +30,11 @@
 
 #include <event.h>
 #include <imsg.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "asr.h"
 #include "asr_private.h"
@@ -52,6 +54,55 @@ struct dns_session {
 	size_t			 mxfound;
 	int			 error;
 	int			 refcount;
+	int			 ttl;
+};
+
+/*
+ * Results are cached by query type and name, for their TTL when the
+ * answer carries one.  Identical queries running at the same time
+ * share one resolution, and an entry used again near its expiry is
+ * refreshed in the background while it keeps answering.  The cache
+ * owns the results: callbacks must not free them nor keep them.
+ */
+#define	DNS_CACHE_MAX		4096
+#define	DNS_CACHE_MAXTTL	86400
+#define	DNS_CACHE_NEGTTL	60	/* NXDOMAIN or no data, without SOA */
+#define	DNS_CACHE_NEGMAXTTL	3600
+#define	DNS_CACHE_FAILTTL	5	/* SERVFAIL, timeouts */
+#define	DNS_CACHE_ADDRTTL	60	/* getaddrinfo/getnameinfo, no TTL */
+#define	DNS_CACHE_HOT		2	/* hits before prefetching */
+
+enum dns_cache_type {
+	DNS_CACHE_MX,
+	DNS_CACHE_HOST,
+	DNS_CACHE_PTR,
+};
+
+struct dns_cache;
+
+struct dns_waiter {
+	TAILQ_ENTRY(dns_waiter)	 entry;
+	void			(*cb)(struct dns_cache *, void *);
+	void			*arg;
+};
+
+struct dns_cache {
+	TAILQ_ENTRY(dns_cache)	 entry;
+	TAILQ_HEAD(, dns_waiter) waiters;
+	struct event		 ev;
+	char			*key;
+	enum dns_cache_type	 type;
+	char			 name[SMTPD_MAXHOSTNAMELEN];
+	struct sockaddr_storage	 ss;
+	struct async_res	 ar;
+	char			 ptrname[SMTPD_MAXHOSTNAMELEN];
+	time_t			 expire;
+	int			 ttl;
+	int			 hits;
+	int			 valid;		/* ar holds a result */
+	int			 running;	/* a query is in flight */
+	int			 cached;	/* in the dict */
+	int			 delivering;	/* waiters being called */
 };
 
 struct async_event;
@@ -59,48 +110,78 @@ struct async_event * async_run_event(struct async *,
 	void (*)(int, struct async_res *, void *), void *);
 
 static void dns_lookup_host(struct dns_session *, const char *, int);
-static void dns_dispatch_host(int, struct async_res *, void *);
-static void dns_dispatch_ptr(int, struct async_res *, void *);
-static void dns_dispatch_mx(int, struct async_res *, void *);
-static void dns_dispatch_mx_preference(int, struct async_res *, void *);
+static void dns_dispatch_host(struct dns_cache *, void *);
+static void dns_dispatch_ptr(struct dns_cache *, void *);
+static void dns_dispatch_mx(struct dns_cache *, void *);
+static void dns_dispatch_mx_preference(struct dns_cache *, void *);
+
+static void dns_cache_query(enum dns_cache_type, const char *,
+    const struct sockaddr *, void (*)(struct dns_cache *, void *), void *);
+static struct dns_cache *dns_cache_new(enum dns_cache_type, const char *,
+    const char *, const struct sockaddr *);
+static int dns_cache_start(struct dns_cache *);
+static void dns_cache_fail(struct dns_cache *, time_t);
+static void dns_cache_done(int, struct async_res *, void *);
+static void dns_cache_deliver(int, short, void *);
+static void dns_cache_clear(struct dns_cache *);
+static void dns_cache_evict(struct dns_cache *);
+static void dns_cache_unref(struct dns_cache *);
+static int dns_cache_ttl_mx(struct async_res *);
+static int dns_cache_ttl(struct dns_cache *);
+
+static struct dict			dns_cache;
+static TAILQ_HEAD(dns_cachelru, dns_cache) dns_cache_lru =
+    TAILQ_HEAD_INITIALIZER(dns_cache_lru);
 
 #define print_dname(a,b,c) asr_strdname(a, b, c)
 
 void
 dns_query_host(uint64_t id, const char *host)
 {
-	m_create(p_lka,  IMSG_DNS_HOST, 0, 0, -1);
-	m_add_id(p_lka, id);
-	m_add_string(p_lka, host);
-	m_close(p_lka);
+	struct mproc	*p;
+
+	p = lka_peer(id);
+	m_create(p,  IMSG_DNS_HOST, 0, 0, -1);
+	m_add_id(p, id);
+	m_add_string(p, host);
+	m_close(p);
 }
 
 void
 dns_query_ptr(uint64_t id, const struct sockaddr *sa)
 {
-	m_create(p_lka,  IMSG_DNS_PTR, 0, 0, -1);
-	m_add_id(p_lka, id);
-	m_add_sockaddr(p_lka, sa);
-	m_close(p_lka);
+	struct mproc	*p;
+
+	p = lka_peer(id);
+	m_create(p,  IMSG_DNS_PTR, 0, 0, -1);
+	m_add_id(p, id);
+	m_add_sockaddr(p, sa);
+	m_close(p);
 }
 
 void
 dns_query_mx(uint64_t id, const char *domain)
 {
-	m_create(p_lka,  IMSG_DNS_MX, 0, 0, -1);
-	m_add_id(p_lka, id);
-	m_add_string(p_lka, domain);
-	m_close(p_lka);
+	struct mproc	*p;
+
+	p = lka_peer(id);
+	m_create(p,  IMSG_DNS_MX, 0, 0, -1);
+	m_add_id(p, id);
+	m_add_string(p, domain);
+	m_close(p);
 }
 
 void
 dns_query_mx_preference(uint64_t id, const char *domain, const char *mx)
 {
-	m_create(p_lka,  IMSG_DNS_MX_PREFERENCE, 0, 0, -1);
-	m_add_id(p_lka, id);
-	m_add_string(p_lka, domain);
-	m_add_string(p_lka, mx);
-	m_close(p_lka);
+	struct mproc	*p;
+
+	p = lka_peer(id);
+	m_create(p,  IMSG_DNS_MX_PREFERENCE, 0, 0, -1);
+	m_add_id(p, id);
+	m_add_string(p, domain);
+	m_add_string(p, mx);
+	m_close(p);
 }
 
 static int
@@ -155,7 +236,6 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 	struct sockaddr_storage	 ss;
 	struct dns_session	*s;
 	struct sockaddr		*sa;
-	struct async		*as;
 	struct msg		 m;
 	const char		*domain, *mx, *host;
 	socklen_t		 sl;
@@ -163,6 +243,7 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 	s = xcalloc(1, sizeof *s, "dns_imsg");
 	s->type = imsg->hdr.type;
 	s->p = p;
+	s->ttl = -1;
 
 	m_msg(&m, imsg);
 	m_get_id(&m, &s->reqid);
@@ -179,9 +260,7 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 		sa = (struct sockaddr *)&ss;
 		m_get_sockaddr(&m, sa);
 		m_end(&m);
-		as = getnameinfo_async(sa, sa->sa_len, s->name, sizeof(s->name),
-		    NULL, 0, 0, NULL);
-		async_run_event(as, dns_dispatch_ptr, s);
+		dns_cache_query(DNS_CACHE_PTR, NULL, sa, dns_dispatch_ptr, s);
 		return;
 
 	case IMSG_DNS_MX:
@@ -202,23 +281,13 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 			m_create(s->p, IMSG_DNS_HOST_END, 0, 0, -1);
 			m_add_id(s->p, s->reqid);
 			m_add_int(s->p, DNS_OK);
+			m_add_int(s->p, s->ttl);
 			m_close(s->p);
 			free(s);
 			return;
 		}
 
-		as = res_query_async(s->name, C_IN, T_MX, NULL);
-		if (as ==  NULL) {
-			log_warn("warn: req_query_async: %s", s->name);
-			m_create(s->p, IMSG_DNS_HOST_END, 0, 0, -1);
-			m_add_id(s->p, s->reqid);
-			m_add_int(s->p, DNS_EINVAL);
-			m_close(s->p);
-			free(s);
-			return;
-		}
-
-		async_run_event(as, dns_dispatch_mx, s);
+		dns_cache_query(DNS_CACHE_MX, s->name, NULL, dns_dispatch_mx, s);
 		return;
 
 	case IMSG_DNS_MX_PREFERENCE:
@@ -227,20 +296,8 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 		strlcpy(s->name, mx, sizeof(s->name));
 
-		sa = (struct sockaddr *)&ss;
-		sl = sizeof(ss);
-
-		as = res_query_async(domain, C_IN, T_MX, NULL);
-		if (as == NULL) {
-			m_create(s->p, IMSG_DNS_MX_PREFERENCE, 0, 0, -1);
-			m_add_id(s->p, s->reqid);
-			m_add_int(s->p, DNS_ENOTFOUND);
-			m_close(s->p);
-			free(s);
-			return;
-		}
-
-		async_run_event(as, dns_dispatch_mx_preference, s);
+		dns_cache_query(DNS_CACHE_MX, domain, NULL,
+		    dns_dispatch_mx_preference, s);
 		return;
 
 	default:
@@ -250,10 +307,11 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 }
 
 static void
-dns_dispatch_host(int ev, struct async_res *ar, void *arg)
+dns_dispatch_host(struct dns_cache *e, void *arg)
 {
 	struct dns_session	*s;
 	struct dns_lookup	*lookup = arg;
+	struct async_res	*ar = &e->ar;
 	struct addrinfo		*ai;
 
 	s = lookup->session;
@@ -267,8 +325,6 @@ dns_dispatch_host(int ev, struct async_res *ar, void *arg)
 		m_close(s->p);
 	}
 	free(lookup);
-	if (ar->ar_addrinfo)
-		freeaddrinfo(ar->ar_addrinfo);
 
 	if (ar->ar_gai_errno)
 		s->error = ar->ar_gai_errno;
@@ -279,29 +335,32 @@ dns_dispatch_host(int ev, struct async_res *ar, void *arg)
 	m_create(s->p, IMSG_DNS_HOST_END, 0, 0, -1);
 	m_add_id(s->p, s->reqid);
 	m_add_int(s->p, s->mxfound ? DNS_OK : DNS_ENOTFOUND);
+	m_add_int(s->p, s->ttl);
 	m_close(s->p);
 	free(s);
 }
 
 static void
-dns_dispatch_ptr(int ev, struct async_res *ar, void *arg)
+dns_dispatch_ptr(struct dns_cache *e, void *arg)
 {
 	struct dns_session	*s = arg;
+	struct async_res	*ar = &e->ar;
 
 	/* The error code could be more precise, but we don't currently care */
 	m_create(s->p,  IMSG_DNS_PTR, 0, 0, -1);
 	m_add_id(s->p, s->reqid);
 	m_add_int(s->p, ar->ar_gai_errno ? DNS_ENOTFOUND : DNS_OK);
 	if (ar->ar_gai_errno == 0)
-		m_add_string(s->p, s->name);
+		m_add_string(s->p, e->ptrname);
 	m_close(s->p);
 	free(s);
 }
 
 static void
-dns_dispatch_mx(int ev, struct async_res *ar, void *arg)
+dns_dispatch_mx(struct dns_cache *e, void *arg)
 {
 	struct dns_session	*s = arg;
+	struct async_res	*ar = &e->ar;
 	struct unpack		 pack;
 	struct header		 h;
 	struct query		 q;
@@ -319,9 +378,9 @@ dns_dispatch_mx(int ev, struct async_res *ar, void *arg)
 			m_add_int(s->p, DNS_EINVAL);
 		else
 			m_add_int(s->p, DNS_RETRY);
+		m_add_int(s->p, s->ttl);
 		m_close(s->p);
 		free(s);
-		free(ar->ar_data);
 		return;
 	}
 
@@ -336,10 +395,15 @@ dns_dispatch_mx(int ev, struct async_res *ar, void *arg)
 			continue;
 		print_dname(rr.rr.mx.exchange, buf, sizeof(buf));
 		buf[strlen(buf) - 1] = '\0';
+		/* the set expires with its shortest-lived record */
+		if (s->ttl == -1 || rr.rr_ttl < (uint32_t)s->ttl)
+			s->ttl = rr.rr_ttl > INT_MAX ? INT_MAX : rr.rr_ttl;
 		dns_lookup_host(s, buf, rr.rr.mx.preference);
 		found++;
 	}
-	free(ar->ar_data);
+	/* a cached answer has aged since its TTLs were set */
+	if (s->ttl > dns_cache_ttl(e))
+		s->ttl = dns_cache_ttl(e);
 
 	/* fallback to host if no MX is found. */
 	if (found == 0)
@@ -347,9 +411,10 @@ dns_dispatch_mx(int ev, struct async_res *ar, void *arg)
 }
 
 static void
-dns_dispatch_mx_preference(int ev, struct async_res *ar, void *arg)
+dns_dispatch_mx_preference(struct dns_cache *e, void *arg)
 {
 	struct dns_session	*s = arg;
+	struct async_res	*ar = &e->ar;
 	struct unpack		 pack;
 	struct header		 h;
 	struct query		 q;
@@ -384,8 +449,6 @@ dns_dispatch_mx_preference(int ev, struct async_res *ar, void *arg)
 		}
 	}
 
-	free(ar->ar_data);
-
 	m_create(s->p, IMSG_DNS_MX_PREFERENCE, 0, 0, -1);
 	m_add_id(s->p, s->reqid);
 	m_add_int(s->p, error);
@@ -399,19 +462,293 @@ static void
 dns_lookup_host(struct dns_session *s, const char *host, int preference)
 {
 	struct dns_lookup	*lookup;
-	struct addrinfo		 hints;
-	struct async		*as;
 
 	lookup = xcalloc(1, sizeof *lookup, "dns_lookup_host");
 	lookup->preference = preference;
 	lookup->session = s;
 	s->refcount++;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	as = getaddrinfo_async(host, NULL, &hints, NULL);
-	async_run_event(as, dns_dispatch_host, lookup);
+	dns_cache_query(DNS_CACHE_HOST, host, NULL, dns_dispatch_host, lookup);
+}
+
+static void
+dns_cache_query(enum dns_cache_type type, const char *name,
+    const struct sockaddr *sa, void (*cb)(struct dns_cache *, void *),
+    void *arg)
+{
+	struct dns_cache	*e;
+	struct dns_waiter	*w;
+	char			 key[SMTPD_MAXHOSTNAMELEN + 16];
+	char			 lname[SMTPD_MAXHOSTNAMELEN];
+	struct timeval		 tv;
+	time_t			 now;
+
+	if (sa)
+		name = sa_to_text(sa);
+
+	now = time(NULL);
+	w = xcalloc(1, sizeof *w, "dns_cache_query");
+	w->cb = cb;
+	w->arg = arg;
+
+	/* a name that does not fit cannot be valid, and is never cached */
+	if (! lowercase(lname, name, sizeof lname) ||
+	    (size_t)snprintf(key, sizeof key, "%d:%s", type, lname) >=
+	    sizeof key) {
+		e = dns_cache_new(type, "", name, sa);
+		TAILQ_INSERT_TAIL(&e->waiters, w, entry);
+		dns_cache_fail(e, now);
+		return;
+	}
+
+	if ((e = dict_get(&dns_cache, key)) == NULL) {
+		while (dict_count(&dns_cache) >= DNS_CACHE_MAX &&
+		    (e = TAILQ_LAST(&dns_cache_lru, dns_cachelru)))
+			dns_cache_evict(e);
+		e = dns_cache_new(type, key, name, sa);
+		dict_xset(&dns_cache, e->key, e);
+		e->cached = 1;
+	}
+	else
+		TAILQ_REMOVE(&dns_cache_lru, e, entry);
+	TAILQ_INSERT_HEAD(&dns_cache_lru, e, entry);
+	TAILQ_INSERT_TAIL(&e->waiters, w, entry);
+
+	if (e->valid && e->expire <= now && !e->running) {
+		dns_cache_clear(e);
+		e->valid = 0;
+	}
+
+	if (e->valid) {
+		/* hot and about to expire, refresh it meanwhile */
+		if (++e->hits >= DNS_CACHE_HOT && !e->running &&
+		    e->expire - now <= e->ttl / 10) {
+			log_debug("debug: dns: prefetching %s", e->key);
+			dns_cache_start(e);
+		}
+		/* answer from the event loop, as a query would */
+		if (! evtimer_pending(&e->ev, NULL)) {
+			timerclear(&tv);
+			evtimer_add(&e->ev, &tv);
+		}
+		return;
+	}
+
+	if (! e->running && ! dns_cache_start(e))
+		dns_cache_fail(e, now);
+}
+
+static struct dns_cache *
+dns_cache_new(enum dns_cache_type type, const char *key, const char *name,
+    const struct sockaddr *sa)
+{
+	struct dns_cache	*e;
+
+	e = xcalloc(1, sizeof *e, "dns_cache_new");
+	e->key = xstrdup(key, "dns_cache_new");
+	e->type = type;
+	(void)strlcpy(e->name, name, sizeof e->name);
+	if (sa)
+		memmove(&e->ss, sa, sa->sa_len);
+	TAILQ_INIT(&e->waiters);
+	evtimer_set(&e->ev, dns_cache_deliver, e);
+
+	return (e);
+}
+
+/* fail the waiters as an unreachable server would */
+static void
+dns_cache_fail(struct dns_cache *e, time_t now)
+{
+	memset(&e->ar, 0, sizeof e->ar);
+	e->ar.ar_h_errno = NO_RECOVERY;
+	e->ar.ar_gai_errno = EAI_FAIL;
+	e->valid = 1;
+	e->expire = now;
+	dns_cache_deliver(-1, 0, e);
+}
+
+static int
+dns_cache_start(struct dns_cache *e)
+{
+	struct addrinfo		 hints;
+	struct async		*as;
+	struct sockaddr		*sa;
+
+	switch (e->type) {
+	case DNS_CACHE_MX:
+		as = res_query_async(e->name, C_IN, T_MX, NULL);
+		break;
+	case DNS_CACHE_HOST:
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = PF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		as = getaddrinfo_async(e->name, NULL, &hints, NULL);
+		break;
+	case DNS_CACHE_PTR:
+		sa = (struct sockaddr *)&e->ss;
+		as = getnameinfo_async(sa, sa->sa_len, e->ptrname,
+		    sizeof(e->ptrname), NULL, 0, 0, NULL);
+		break;
+	default:
+		as = NULL;
+	}
+	if (as == NULL) {
+		log_warn("warn: dns: cannot query %s", e->name);
+		return (0);
+	}
+
+	e->running = 1;
+	e->hits = 0;
+	async_run_event(as, dns_cache_done, e);
+	return (1);
+}
+
+static void
+dns_cache_done(int ev, struct async_res *ar, void *arg)
+{
+	struct dns_cache	*e = arg;
+	int			 ttl;
+
+	dns_cache_clear(e);
+	e->ar = *ar;
+	e->valid = 1;
+	e->running = 0;
+
+	switch (e->type) {
+	case DNS_CACHE_MX:
+		ttl = dns_cache_ttl_mx(ar);
+		break;
+	default:
+		if (ar->ar_gai_errno == EAI_AGAIN ||
+		    ar->ar_gai_errno == EAI_FAIL)
+			ttl = DNS_CACHE_FAILTTL;
+		else if (ar->ar_gai_errno)
+			ttl = DNS_CACHE_NEGTTL;
+		else
+			ttl = DNS_CACHE_ADDRTTL;
+	}
+	e->ttl = ttl;
+	e->expire = time(NULL) + ttl;
+
+	if (! TAILQ_EMPTY(&e->waiters))
+		dns_cache_deliver(-1, 0, e);
+	else
+		dns_cache_unref(e);
+}
+
+static void
+dns_cache_deliver(int fd, short event, void *arg)
+{
+	struct dns_cache	*e = arg;
+	struct dns_waiter	*w;
+
+	/* a callback may start lookups that evict this very entry */
+	evtimer_del(&e->ev);
+	e->delivering = 1;
+	while ((w = TAILQ_FIRST(&e->waiters))) {
+		TAILQ_REMOVE(&e->waiters, w, entry);
+		w->cb(e, w->arg);
+		free(w);
+	}
+	e->delivering = 0;
+	dns_cache_unref(e);
+}
+
+/*
+ * The TTL of an MX answer is the shortest of its records, that of a
+ * negative answer comes from the SOA of the authority section.
+ */
+static int
+dns_cache_ttl_mx(struct async_res *ar)
+{
+	struct unpack	 pack;
+	struct header	 h;
+	struct query	 q;
+	struct rr	 rr;
+	uint32_t	 ttl;
+	int		 neg;
+
+	if (ar->ar_h_errno == TRY_AGAIN || ar->ar_rcode == SERVFAIL ||
+	    ar->ar_data == NULL)
+		return (DNS_CACHE_FAILTTL);
+
+	asr_unpack_init(&pack, ar->ar_data, ar->ar_datalen);
+	asr_unpack_header(&pack, &h);
+	asr_unpack_query(&pack, &q);
+
+	ttl = DNS_CACHE_MAXTTL;
+	neg = (ar->ar_h_errno != 0);
+	for (; h.ancount; h.ancount--) {
+		if (asr_unpack_rr(&pack, &rr) == -1)
+			return (DNS_CACHE_FAILTTL);
+		if (rr.rr_type == T_MX && rr.rr_ttl < ttl)
+			ttl = rr.rr_ttl;
+	}
+	if (! neg)
+		return (ttl);
+
+	ttl = DNS_CACHE_NEGTTL;
+	for (; h.nscount; h.nscount--) {
+		if (asr_unpack_rr(&pack, &rr) == -1)
+			break;
+		if (rr.rr_type != T_SOA)
+			continue;
+		ttl = rr.rr_ttl;
+		if (rr.rr.soa.minimum < ttl)
+			ttl = rr.rr.soa.minimum;
+		if (ttl > DNS_CACHE_NEGMAXTTL)
+			ttl = DNS_CACHE_NEGMAXTTL;
+		break;
+	}
+	return (ttl);
+}
+
+/* what is left of the TTL of an entry */
+static int
+dns_cache_ttl(struct dns_cache *e)
+{
+	time_t	now;
+
+	now = time(NULL);
+	return (e->expire > now ? e->expire - now : 0);
+}
+
+static void
+dns_cache_clear(struct dns_cache *e)
+{
+	if (! e->valid)
+		return;
+	if (e->type == DNS_CACHE_MX)
+		free(e->ar.ar_data);
+	else if (e->ar.ar_addrinfo)
+		freeaddrinfo(e->ar.ar_addrinfo);
+	memset(&e->ar, 0, sizeof e->ar);
+	e->valid = 0;
+}
+
+static void
+dns_cache_evict(struct dns_cache *e)
+{
+	if (! e->cached)
+		return;
+	TAILQ_REMOVE(&dns_cache_lru, e, entry);
+	dict_xpop(&dns_cache, e->key);
+	e->cached = 0;
+	dns_cache_unref(e);
+}
+
+/* free an entry out of the cache once nothing refers to it */
+static void
+dns_cache_unref(struct dns_cache *e)
+{
+	if (e->cached || e->running || e->delivering ||
+	    ! TAILQ_EMPTY(&e->waiters))
+		return;
+	evtimer_del(&e->ev);
+	dns_cache_clear(e);
+	free(e->key);
+	free(e);
 }
 
 /* Generic libevent glue for asr */
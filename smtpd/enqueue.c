@@ -31,6 +31,7 @@
 #include <imsg.h>
 #include <inttypes.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,6 +54,8 @@ static void rcpt_add(char *);
 static int open_connection(void);
 static void get_responses(FILE *, int);
 static int send_line(FILE *, int, char *, ...);
+static void send_body(FILE *, FILE *, int, int);
+static int count_write(void *, const char *, int);
 static int enqueue_offline(int, char *[], FILE *);
 
 extern int srv_connect(void);
@@ -102,6 +105,10 @@ char	  host[SMTPD_MAXHOSTNAMELEN];
 char	 *user = NULL;
 time_t	  timestamp;
 
+/* extensions advertised by the server */
+int	  srv_pipelining = 0;
+int	  srv_chunking = 0;
+
 struct {
 	int	  fd;
 	char	 *from;
@@ -110,6 +117,7 @@ struct {
 	char	 *dsn_notify;
 	char	 *dsn_ret;
 	char	 *dsn_envid;
+	char	 *msgid;
 	int	  rcpt_cnt;
 	int	  need_linesplit;
 	int	  saw_date;
@@ -163,15 +171,13 @@ int
 enqueue(int argc, char *argv[])
 {
 	int			 i, ch, tflag = 0, noheader;
-	char			*fake_from = NULL, *buf;
+	char			*fake_from = NULL;
 	struct passwd		*pw;
-	FILE			*fp, *fout;
-	size_t			 len, envid_sz = 0;
-	int			 fd;
+	FILE			*fp, *fout, *fcount;
+	size_t			 envid_sz = 0;
+	off_t			 size;
+	int			 fd, pending;
 	char			 sfn[] = "/tmp/smtpd.XXXXXXXXXX";
-	char			*line;
-	int			 dotted;
-	int			 inheaders = 0;
 	int			 save_argc;
 	char			**save_argv;
 
@@ -274,10 +280,8 @@ enqueue(int argc, char *argv[])
 	if (fout == NULL)
 		err(EX_UNAVAILABLE, "fdopen");
 
-	/* 
-	 * We need to call get_responses after every command because we don't
-	 * support PIPELINING on the server-side yet.
-	 */
+	/* the body may be cut short by a refusal, whose reply tells why */
+	signal(SIGPIPE, SIG_IGN);
 
 	/* banner */
 	get_responses(fout, 1);
@@ -288,24 +292,84 @@ enqueue(int argc, char *argv[])
 	if (msg.dsn_envid != NULL)
 		envid_sz = strlen(msg.dsn_envid);
 
+	/*
+	 * With PIPELINING the envelope goes in one round-trip, and with
+	 * CHUNKING as well the body follows in a single BDAT chunk.  A
+	 * single recipient is sent along with the body: if it is refused,
+	 * so is the chunk.  Several must all be accepted first.
+	 */
+	pending = 0;
 	send_line(fout, verbose, "MAIL FROM:<%s> %s%s %s%s\n",
 	    msg.from,
 	    msg.dsn_ret ? "RET=" : "",
 	    msg.dsn_ret ? msg.dsn_ret : "",
 	    envid_sz ? "ENVID=" : "",
 	    envid_sz ? msg.dsn_envid : "");
-	get_responses(fout, 1);
+	if (srv_pipelining)
+		pending++;
+	else
+		get_responses(fout, 1);
 
 	for (i = 0; i < msg.rcpt_cnt; i++) {
 		send_line(fout, verbose, "RCPT TO:<%s> %s%s\n",
 		    msg.rcpts[i],
 		    msg.dsn_notify ? "NOTIFY=" : "",
 		    msg.dsn_notify ? msg.dsn_notify : "");
-		get_responses(fout, 1);
+		if (srv_pipelining)
+			pending++;
+		else
+			get_responses(fout, 1);
 	}
 
-	send_line(fout, verbose, "DATA\n");
-	get_responses(fout, 1);
+	if (asprintf(&msg.msgid, "<%"PRIu64".enqueue@%s>", generate_uid(),
+	    host) == -1)
+		err(EX_UNAVAILABLE, "asprintf");
+
+	if (srv_pipelining && srv_chunking) {
+		if (msg.rcpt_cnt > 1) {
+			get_responses(fout, pending);
+			pending = 0;
+		}
+		size = 0;
+		if ((fcount = funopen(&size, NULL, count_write, NULL,
+		    NULL)) == NULL)
+			err(EX_UNAVAILABLE, "funopen");
+		send_body(fcount, fp, noheader, 0);
+		fclose(fcount);
+		rewind(fp);
+
+		send_line(fout, verbose, "BDAT %lld LAST\n", (long long)size);
+		send_body(fout, fp, noheader, 0);
+		pending++;
+	}
+	else {
+		send_line(fout, verbose, "DATA\n");
+		get_responses(fout, pending + 1);
+		send_body(fout, fp, noheader, 1);
+		send_line(fout, verbose, ".\n");
+		pending = 1;
+	}
+
+	send_line(fout, verbose, "QUIT\n");
+	get_responses(fout, pending + 1);
+
+	fclose(fp);
+	fclose(fout);
+
+	exit(EX_OK);
+}
+
+/*
+ * Write the body of the message, with the missing headers, to fout.  The
+ * lines are dot-stuffed for DATA, not for BDAT.
+ */
+static void
+send_body(FILE *fout, FILE *fp, int noheader, int dotstuff)
+{
+	char	*buf, *line;
+	size_t	 len;
+	int	 dotted;
+	int	 inheaders = 0;
 
 	/* add From */
 	if (!msg.saw_from)
@@ -320,8 +384,7 @@ enqueue(int argc, char *argv[])
 
 	/* add Message-Id */
 	if (!msg.saw_msgid)
-		send_line(fout, 0, "Message-Id: <%"PRIu64".enqueue@%s>\n",
-		    generate_uid(), host);
+		send_line(fout, 0, "Message-Id: %s\n", msg.msgid);
 
 	if (msg.need_linesplit) {
 		/* we will always need to mime encode for long lines */
@@ -357,7 +420,7 @@ enqueue(int argc, char *argv[])
 			errx(EX_SOFTWARE, "expect EOL");
 
 		dotted = 0;
-		if (buf[0] == '.') {
+		if (dotstuff && buf[0] == '.') {
 			fputc('.', fout);
 			dotted = 1;
 		}
@@ -387,16 +450,14 @@ enqueue(int argc, char *argv[])
 			}
 		} while (len);
 	}
-	send_line(fout, verbose, ".\n");
-	get_responses(fout, 1);
-
-	send_line(fout, verbose, "QUIT\n");
-	get_responses(fout, 1);
-
-	fclose(fp);
-	fclose(fout);
+}
 
-	exit(EX_OK);
+/* sizes the BDAT chunk */
+static int
+count_write(void *arg, const char *buf, int len)
+{
+	*(off_t *)arg += len;
+	return (len);
 }
 
 static void
@@ -406,9 +467,10 @@ get_responses(FILE *fin, int n)
 	size_t	 len;
 	int	 e;
 
+	/* a failed write is reported after the reply that explains it */
 	fflush(fin);
 	if ((e = ferror(fin)))
-		errx(1, "ferror: %d", e);
+		clearerr(fin);
 
 	while (n) {
 		buf = fgetln(fin, &len);
@@ -429,12 +491,22 @@ get_responses(FILE *fin, int n)
 		if (verbose)
 			printf("<<< %.*s", (int)len, buf);
 
+		if (buf[0] == '2' && len == 15 &&
+		    !strncasecmp(buf + 4, "PIPELINING", 10))
+			srv_pipelining = 1;
+		if (buf[0] == '2' && len == 13 &&
+		    !strncasecmp(buf + 4, "CHUNKING", 8))
+			srv_chunking = 1;
+
 		if (buf[3] == '-')
 			continue;
 		if (buf[0] != '2' && buf[0] != '3')
 			errx(1, "command failed: %.*s", (int)len, buf);
 		n--;
 	}
+
+	if (e)
+		errx(1, "ferror: %d", e);
 }
 
 static int
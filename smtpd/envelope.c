@@ -44,10 +44,74 @@
 #include "smtpd.h"
 #include "log.h"
 
+/*
+ * Binary envelope format: a magic and a format version, followed by a
+ * list of fields, each encoded as a one-byte tag, a two-byte length and
+ * the value.  Integers are in network byte order, strings are not
+ * NUL-terminated and fields with an unknown tag are skipped.  Enum values
+ * are stored as is, so they must never be renumbered.
+ */
+#define	ENVELOPE_BINARY_MAGIC	"\377EVP"
+#define	ENVELOPE_BINARY_VERSION	1
+
+enum envelope_field {
+	EVF_CLEAR = 0,		/* wire deltas only, tags to drop */
+	EVF_TAG,
+	EVF_TYPE,
+	EVF_SMTPNAME,
+	EVF_HELO,
+	EVF_HOSTNAME,
+	EVF_ERRORLINE,
+	EVF_SOCKADDR,
+	EVF_SENDER,
+	EVF_RCPT,
+	EVF_DEST,
+	EVF_CTIME,
+	EVF_LASTTRY,
+	EVF_LASTBOUNCE,
+	EVF_EXPIRE,
+	EVF_RETRY,
+	EVF_FLAGS,
+	EVF_DSN_NOTIFY,
+	EVF_DSN_RET,
+	EVF_DSN_ENVID,
+	EVF_DSN_ORCPT,
+	EVF_ESC_CLASS,
+	EVF_ESC_CODE,
+	EVF_MDA_BUFFER,
+	EVF_MDA_METHOD,
+	EVF_MDA_USER,
+	EVF_MDA_USERTABLE,
+	EVF_MTA_RELAY_FLAGS,
+	EVF_MTA_RELAY_HOST,
+	EVF_MTA_RELAY_PORT,
+	EVF_MTA_RELAY_CERT,
+	EVF_MTA_RELAY_AUTH,
+	EVF_MTA_RELAY_AUTHLABEL,
+	EVF_MTA_RELAY_SOURCE,
+	EVF_MTA_RELAY_HELONAME,
+	EVF_MTA_RELAY_HELOTABLE,
+	EVF_BOUNCE_TYPE,
+	EVF_BOUNCE_DELAY,
+	EVF_BOUNCE_EXPIRE,
+	EVF_PRIORITY,
+};
+
+struct binbuf {
+	char	*buf;
+	size_t	 len;
+	size_t	 pos;
+	int	 err;
+};
+
 static int envelope_upgrade_v1(struct dict *);
 static int envelope_ascii_load(struct envelope *, struct dict *);
 static void envelope_ascii_dump(const struct envelope *, char **, size_t *,
     const char *);
+static int envelope_binary_load(struct envelope *, const char *, size_t);
+static int binary_next(const char **, const char *, int *, const char **,
+    size_t *);
+static const char *binary_find(const char *, const char *, int, size_t *);
 
 void
 envelope_set_errormsg(struct envelope *e, char *fmt, ...)
@@ -133,6 +197,11 @@ envelope_load_buffer(struct envelope *ep, const char *ibuf, size_t buflen)
 	long long	 version;
 	int	 	 ret = 0;
 
+	if (buflen >= sizeof(ENVELOPE_BINARY_MAGIC) - 1 &&
+	    memcmp(ibuf, ENVELOPE_BINARY_MAGIC,
+	    sizeof(ENVELOPE_BINARY_MAGIC) - 1) == 0)
+		return (envelope_binary_load(ep, ibuf, buflen));
+
 	dict_init(&d);
 	if (! envelope_buffer_to_dict(&d, ibuf, buflen)) {
 		log_debug("debug: cannot parse envelope to dict");
@@ -206,6 +275,7 @@ envelope_dump_buffer(const struct envelope *ep, char *dest, size_t len)
 	envelope_ascii_dump(ep, &dest, &len, "dsn-orcpt");
 	envelope_ascii_dump(ep, &dest, &len, "esc-class");
 	envelope_ascii_dump(ep, &dest, &len, "esc-code");
+	envelope_ascii_dump(ep, &dest, &len, "priority");
 
 	switch (ep->type) {
 	case D_MDA:
@@ -238,6 +308,605 @@ envelope_dump_buffer(const struct envelope *ep, char *dest, size_t len)
 	return (dest - p);
 }
 
+static void
+binary_add(struct binbuf *b, uint8_t tag, const void *data, size_t len)
+{
+	uint16_t	n;
+
+	if (b->err)
+		return;
+	if (len > 0xffff || b->len - b->pos < 3 + len) {
+		b->err = 1;
+		return;
+	}
+	n = htons(len);
+	b->buf[b->pos++] = tag;
+	memmove(b->buf + b->pos, &n, 2);
+	memmove(b->buf + b->pos + 2, data, len);
+	b->pos += 2 + len;
+}
+
+static void
+binary_add_string(struct binbuf *b, uint8_t tag, const char *str)
+{
+	if (str[0] == '\0')
+		return;
+	binary_add(b, tag, str, strlen(str));
+}
+
+static void
+binary_add_uint8(struct binbuf *b, uint8_t tag, uint8_t v)
+{
+	binary_add(b, tag, &v, sizeof v);
+}
+
+static void
+binary_add_uint16(struct binbuf *b, uint8_t tag, uint16_t v)
+{
+	v = htons(v);
+	binary_add(b, tag, &v, sizeof v);
+}
+
+static void
+binary_add_uint32(struct binbuf *b, uint8_t tag, uint32_t v)
+{
+	v = htonl(v);
+	binary_add(b, tag, &v, sizeof v);
+}
+
+static void
+binary_add_time(struct binbuf *b, uint8_t tag, time_t t)
+{
+	uint32_t	v[2];
+
+	v[0] = htonl((uint64_t)t >> 32);
+	v[1] = htonl((uint64_t)t & 0xffffffff);
+	binary_add(b, tag, v, sizeof v);
+}
+
+static void
+binary_add_mailaddr(struct binbuf *b, uint8_t tag, const struct mailaddr *a)
+{
+	char	buf[sizeof(a->user) + sizeof(a->domain)];
+	size_t	ulen, dlen;
+
+	if (a->user[0] == '\0' && a->domain[0] == '\0')
+		return;
+	ulen = strlen(a->user);
+	dlen = strlen(a->domain);
+	memmove(buf, a->user, ulen + 1);
+	memmove(buf + ulen + 1, a->domain, dlen);
+	binary_add(b, tag, buf, ulen + 1 + dlen);
+}
+
+static void
+binary_add_sockaddr(struct binbuf *b, uint8_t tag,
+    const struct sockaddr_storage *ss)
+{
+	char	buf[1 + sizeof(struct in6_addr)];
+	size_t	len;
+
+	buf[0] = ss->ss_family;
+	switch (ss->ss_family) {
+	case AF_INET:
+		len = sizeof(struct in_addr);
+		memmove(buf + 1, &((const struct sockaddr_in *)ss)->sin_addr,
+		    len);
+		break;
+	case AF_INET6:
+		len = sizeof(struct in6_addr);
+		memmove(buf + 1, &((const struct sockaddr_in6 *)ss)->sin6_addr,
+		    len);
+		break;
+	default:
+		len = 0;
+		break;
+	}
+	binary_add(b, tag, buf, 1 + len);
+}
+
+int
+envelope_dump_binary(const struct envelope *ep, char *dest, size_t len)
+{
+	const struct relayhost	*relay = &ep->agent.mta.relay;
+	struct binbuf		 b;
+
+	if (len < sizeof(ENVELOPE_BINARY_MAGIC))
+		return (0);
+
+	b.buf = dest;
+	b.len = len;
+	b.err = 0;
+	memmove(dest, ENVELOPE_BINARY_MAGIC, sizeof(ENVELOPE_BINARY_MAGIC) - 1);
+	dest[sizeof(ENVELOPE_BINARY_MAGIC) - 1] = ENVELOPE_BINARY_VERSION;
+	b.pos = sizeof(ENVELOPE_BINARY_MAGIC);
+
+	binary_add_string(&b, EVF_TAG, ep->tag);
+	binary_add_uint8(&b, EVF_TYPE, ep->type);
+	binary_add_string(&b, EVF_SMTPNAME, ep->smtpname);
+	binary_add_string(&b, EVF_HELO, ep->helo);
+	binary_add_string(&b, EVF_HOSTNAME, ep->hostname);
+	binary_add_string(&b, EVF_ERRORLINE, ep->errorline);
+	binary_add_sockaddr(&b, EVF_SOCKADDR, &ep->ss);
+	binary_add_mailaddr(&b, EVF_SENDER, &ep->sender);
+	binary_add_mailaddr(&b, EVF_RCPT, &ep->rcpt);
+	binary_add_mailaddr(&b, EVF_DEST, &ep->dest);
+	binary_add_time(&b, EVF_CTIME, ep->creation);
+	binary_add_time(&b, EVF_LASTTRY, ep->lasttry);
+	binary_add_time(&b, EVF_LASTBOUNCE, ep->lastbounce);
+	binary_add_time(&b, EVF_EXPIRE, ep->expire);
+	binary_add_uint16(&b, EVF_RETRY, ep->retry);
+	binary_add_uint32(&b, EVF_FLAGS,
+	    ep->flags & (EF_AUTHENTICATED | EF_BOUNCE | EF_INTERNAL));
+	binary_add_uint8(&b, EVF_DSN_NOTIFY, ep->dsn_notify);
+	if (ep->dsn_ret)
+		binary_add_uint8(&b, EVF_DSN_RET, ep->dsn_ret);
+	binary_add_string(&b, EVF_DSN_ENVID, ep->dsn_envid);
+	if (ep->dsn_orcpt.user[0] && ep->dsn_orcpt.domain[0])
+		binary_add_mailaddr(&b, EVF_DSN_ORCPT, &ep->dsn_orcpt);
+	if (ep->esc_class) {
+		binary_add_uint8(&b, EVF_ESC_CLASS, ep->esc_class);
+		binary_add_uint8(&b, EVF_ESC_CODE, ep->esc_code);
+	}
+	if (ep->priority)
+		binary_add_uint8(&b, EVF_PRIORITY, ep->priority);
+
+	switch (ep->type) {
+	case D_MDA:
+		binary_add_string(&b, EVF_MDA_BUFFER, ep->agent.mda.buffer);
+		binary_add_uint8(&b, EVF_MDA_METHOD, ep->agent.mda.method);
+		binary_add_string(&b, EVF_MDA_USER, ep->agent.mda.username);
+		binary_add_string(&b, EVF_MDA_USERTABLE,
+		    ep->agent.mda.usertable);
+		break;
+	case D_MTA:
+		binary_add_uint16(&b, EVF_MTA_RELAY_FLAGS, relay->flags);
+		binary_add_string(&b, EVF_MTA_RELAY_HOST, relay->hostname);
+		binary_add_uint16(&b, EVF_MTA_RELAY_PORT, relay->port);
+		binary_add_string(&b, EVF_MTA_RELAY_CERT, relay->pki_name);
+		binary_add_string(&b, EVF_MTA_RELAY_AUTH, relay->authtable);
+		binary_add_string(&b, EVF_MTA_RELAY_AUTHLABEL, relay->authlabel);
+		binary_add_string(&b, EVF_MTA_RELAY_SOURCE, relay->sourcetable);
+		binary_add_string(&b, EVF_MTA_RELAY_HELONAME, relay->heloname);
+		binary_add_string(&b, EVF_MTA_RELAY_HELOTABLE, relay->helotable);
+		break;
+	case D_BOUNCE:
+		binary_add_uint8(&b, EVF_BOUNCE_TYPE, ep->agent.bounce.type);
+		if (ep->agent.bounce.type == B_WARNING) {
+			binary_add_time(&b, EVF_BOUNCE_DELAY,
+			    ep->agent.bounce.delay);
+			binary_add_time(&b, EVF_BOUNCE_EXPIRE,
+			    ep->agent.bounce.expire);
+		}
+		break;
+	default:
+		return (0);
+	}
+
+	if (b.err)
+		return (0);
+
+	return (b.pos);
+}
+
+/*
+ * For imsgs, an envelope may be sent as the fields that differ from a
+ * previous binary envelope of the same message: the changed fields as
+ * they are, then an EVF_CLEAR field with the tags the template has but
+ * the envelope does not.
+ */
+int
+envelope_delta_binary(const char *tmpl, size_t tlen, const char *cur,
+    size_t clen, char *dest, size_t len)
+{
+	const char	*pos, *end, *v, *tv;
+	size_t		 n, tn, nclear;
+	uint8_t		 clear[256];
+	struct binbuf	 b;
+	int		 tag, r;
+
+	if (tlen < sizeof(ENVELOPE_BINARY_MAGIC) ||
+	    clen < sizeof(ENVELOPE_BINARY_MAGIC))
+		return (-1);
+
+	b.buf = dest;
+	b.len = len;
+	b.pos = 0;
+	b.err = 0;
+
+	pos = cur + sizeof(ENVELOPE_BINARY_MAGIC);
+	end = cur + clen;
+	while ((r = binary_next(&pos, end, &tag, &v, &n)) == 1) {
+		tv = binary_find(tmpl + sizeof(ENVELOPE_BINARY_MAGIC),
+		    tmpl + tlen, tag, &tn);
+		if (tv == NULL || tn != n || memcmp(tv, v, n))
+			binary_add(&b, tag, v, n);
+	}
+	if (r == -1)
+		return (-1);
+
+	nclear = 0;
+	pos = tmpl + sizeof(ENVELOPE_BINARY_MAGIC);
+	end = tmpl + tlen;
+	while ((r = binary_next(&pos, end, &tag, &v, &n)) == 1)
+		if (binary_find(cur + sizeof(ENVELOPE_BINARY_MAGIC),
+		    cur + clen, tag, &tn) == NULL)
+			clear[nclear++] = tag;
+	if (r == -1)
+		return (-1);
+	if (nclear)
+		binary_add(&b, EVF_CLEAR, clear, nclear);
+
+	if (b.err)
+		return (-1);
+
+	return (b.pos);
+}
+
+/* Rebuild the binary envelope for a delta against its template. */
+int
+envelope_patch_binary(const char *tmpl, size_t tlen, const char *delta,
+    size_t dlen, char *dest, size_t len)
+{
+	const char	*pos, *end, *v, *clear;
+	size_t		 n, nclear;
+	struct binbuf	 b;
+	int		 tag, r;
+
+	if (tlen < sizeof(ENVELOPE_BINARY_MAGIC) ||
+	    len < sizeof(ENVELOPE_BINARY_MAGIC))
+		return (0);
+
+	b.buf = dest;
+	b.len = len;
+	b.err = 0;
+	memmove(dest, tmpl, sizeof(ENVELOPE_BINARY_MAGIC));
+	b.pos = sizeof(ENVELOPE_BINARY_MAGIC);
+
+	clear = binary_find(delta, delta + dlen, EVF_CLEAR, &nclear);
+
+	pos = tmpl + sizeof(ENVELOPE_BINARY_MAGIC);
+	end = tmpl + tlen;
+	while ((r = binary_next(&pos, end, &tag, &v, &n)) == 1) {
+		if (binary_find(delta, delta + dlen, tag, NULL))
+			continue;
+		if (clear && memchr(clear, tag, nclear))
+			continue;
+		binary_add(&b, tag, v, n);
+	}
+	if (r == -1)
+		return (0);
+
+	pos = delta;
+	end = delta + dlen;
+	while ((r = binary_next(&pos, end, &tag, &v, &n)) == 1)
+		if (tag != EVF_CLEAR)
+			binary_add(&b, tag, v, n);
+	if (r == -1 || b.err)
+		return (0);
+
+	return (b.pos);
+}
+
+/* Step over one field, returns 0 at the end and -1 if truncated. */
+static int
+binary_next(const char **pos, const char *end, int *tag, const char **v,
+    size_t *n)
+{
+	uint16_t	len;
+
+	if (*pos == end)
+		return (0);
+	if (end - *pos < 3)
+		return (-1);
+	*tag = (unsigned char)(*pos)[0];
+	memmove(&len, *pos + 1, 2);
+	len = ntohs(len);
+	if (end - *pos - 3 < len)
+		return (-1);
+	*v = *pos + 3;
+	*n = len;
+	*pos += 3 + len;
+	return (1);
+}
+
+static const char *
+binary_find(const char *pos, const char *end, int tag, size_t *n)
+{
+	const char	*v;
+	size_t		 len;
+	int		 t;
+
+	while (binary_next(&pos, end, &t, &v, &len) == 1)
+		if (t == tag) {
+			if (n)
+				*n = len;
+			return (v);
+		}
+	return (NULL);
+}
+
+static int
+binary_load_string(char *dest, size_t size, const char *v, size_t len)
+{
+	if (len >= size || memchr(v, '\0', len))
+		return (0);
+	memmove(dest, v, len);
+	dest[len] = '\0';
+	return (1);
+}
+
+static int
+binary_load_uint(void *dest, size_t size, const char *v, size_t len)
+{
+	uint8_t		u8;
+	uint16_t	u16;
+	uint32_t	u32[2];
+
+	if (len != size)
+		return (0);
+
+	switch (size) {
+	case 1:
+		memmove(&u8, v, 1);
+		*(uint8_t *)dest = u8;
+		break;
+	case 2:
+		memmove(&u16, v, 2);
+		*(uint16_t *)dest = ntohs(u16);
+		break;
+	case 4:
+		memmove(u32, v, 4);
+		*(uint32_t *)dest = ntohl(u32[0]);
+		break;
+	case 8:
+		memmove(u32, v, 8);
+		*(uint64_t *)dest = ((uint64_t)ntohl(u32[0]) << 32) |
+		    ntohl(u32[1]);
+		break;
+	default:
+		return (0);
+	}
+	return (1);
+}
+
+static int
+binary_load_enum(int *dest, const char *v, size_t len)
+{
+	uint8_t	u8;
+
+	if (! binary_load_uint(&u8, 1, v, len))
+		return (0);
+	*dest = u8;
+	return (1);
+}
+
+static int
+binary_load_time(time_t *dest, const char *v, size_t len)
+{
+	uint64_t	t;
+
+	if (! binary_load_uint(&t, sizeof t, v, len))
+		return (0);
+	*dest = (time_t)t;
+	return (1);
+}
+
+static int
+binary_load_mailaddr(struct mailaddr *dest, const char *v, size_t len)
+{
+	const char	*sep;
+
+	if ((sep = memchr(v, '\0', len)) == NULL)
+		return (0);
+	if (! binary_load_string(dest->user, sizeof dest->user, v, sep - v))
+		return (0);
+	sep++;
+	return binary_load_string(dest->domain, sizeof dest->domain, sep,
+	    len - (sep - v));
+}
+
+static int
+binary_load_sockaddr(struct sockaddr_storage *ss, const char *v, size_t len)
+{
+	struct sockaddr_in	*sin = (struct sockaddr_in *)ss;
+	struct sockaddr_in6	*sin6 = (struct sockaddr_in6 *)ss;
+
+	if (len == 0)
+		return (0);
+
+	memset(ss, 0, sizeof *ss);
+	switch (v[0]) {
+	case AF_INET:
+		if (len != 1 + sizeof(struct in_addr))
+			return (0);
+		memmove(&sin->sin_addr, v + 1, sizeof(struct in_addr));
+		sin->sin_family = AF_INET;
+		ss->ss_len = sizeof(struct sockaddr_in);
+		break;
+	case AF_INET6:
+		if (len != 1 + sizeof(struct in6_addr))
+			return (0);
+		memmove(&sin6->sin6_addr, v + 1, sizeof(struct in6_addr));
+		sin6->sin6_family = AF_INET6;
+		ss->ss_len = sizeof(struct sockaddr_in6);
+		break;
+	default:
+		ss->ss_family = v[0];
+		break;
+	}
+	return (1);
+}
+
+static int
+binary_load_field(struct envelope *ep, int tag, const char *v, size_t len)
+{
+	struct relayhost	*relay = &ep->agent.mta.relay;
+	int			 i;
+
+	switch (tag) {
+	case EVF_TAG:
+		return binary_load_string(ep->tag, sizeof ep->tag, v, len);
+	case EVF_TYPE:
+		if (! binary_load_enum(&i, v, len))
+			return (0);
+		ep->type = i;
+		return (1);
+	case EVF_SMTPNAME:
+		return binary_load_string(ep->smtpname, sizeof ep->smtpname,
+		    v, len);
+	case EVF_HELO:
+		return binary_load_string(ep->helo, sizeof ep->helo, v, len);
+	case EVF_HOSTNAME:
+		return binary_load_string(ep->hostname, sizeof ep->hostname,
+		    v, len);
+	case EVF_ERRORLINE:
+		return binary_load_string(ep->errorline, sizeof ep->errorline,
+		    v, len);
+	case EVF_SOCKADDR:
+		return binary_load_sockaddr(&ep->ss, v, len);
+	case EVF_SENDER:
+		return binary_load_mailaddr(&ep->sender, v, len);
+	case EVF_RCPT:
+		return binary_load_mailaddr(&ep->rcpt, v, len);
+	case EVF_DEST:
+		return binary_load_mailaddr(&ep->dest, v, len);
+	case EVF_CTIME:
+		return binary_load_time(&ep->creation, v, len);
+	case EVF_LASTTRY:
+		return binary_load_time(&ep->lasttry, v, len);
+	case EVF_LASTBOUNCE:
+		return binary_load_time(&ep->lastbounce, v, len);
+	case EVF_EXPIRE:
+		return binary_load_time(&ep->expire, v, len);
+	case EVF_RETRY:
+		return binary_load_uint(&ep->retry, sizeof ep->retry, v, len);
+	case EVF_FLAGS:
+		if (! binary_load_uint(&i, sizeof i, v, len))
+			return (0);
+		ep->flags = i;
+		return (1);
+	case EVF_DSN_NOTIFY:
+		return binary_load_uint(&ep->dsn_notify, sizeof ep->dsn_notify,
+		    v, len);
+	case EVF_DSN_RET:
+		if (! binary_load_enum(&i, v, len))
+			return (0);
+		ep->dsn_ret = i;
+		return (1);
+	case EVF_DSN_ENVID:
+		return binary_load_string(ep->dsn_envid, sizeof ep->dsn_envid,
+		    v, len);
+	case EVF_DSN_ORCPT:
+		return binary_load_mailaddr(&ep->dsn_orcpt, v, len);
+	case EVF_ESC_CLASS:
+		return binary_load_uint(&ep->esc_class, sizeof ep->esc_class,
+		    v, len);
+	case EVF_ESC_CODE:
+		return binary_load_uint(&ep->esc_code, sizeof ep->esc_code,
+		    v, len);
+	case EVF_MDA_BUFFER:
+		return binary_load_string(ep->agent.mda.buffer,
+		    sizeof ep->agent.mda.buffer, v, len);
+	case EVF_MDA_METHOD:
+		if (! binary_load_enum(&i, v, len))
+			return (0);
+		ep->agent.mda.method = i;
+		return (1);
+	case EVF_MDA_USER:
+		return binary_load_string(ep->agent.mda.username,
+		    sizeof ep->agent.mda.username, v, len);
+	case EVF_MDA_USERTABLE:
+		return binary_load_string(ep->agent.mda.usertable,
+		    sizeof ep->agent.mda.usertable, v, len);
+	case EVF_MTA_RELAY_FLAGS:
+		return binary_load_uint(&relay->flags, sizeof relay->flags,
+		    v, len);
+	case EVF_MTA_RELAY_HOST:
+		return binary_load_string(relay->hostname,
+		    sizeof relay->hostname, v, len);
+	case EVF_MTA_RELAY_PORT:
+		return binary_load_uint(&relay->port, sizeof relay->port,
+		    v, len);
+	case EVF_MTA_RELAY_CERT:
+		return binary_load_string(relay->pki_name,
+		    sizeof relay->pki_name, v, len);
+	case EVF_MTA_RELAY_AUTH:
+		return binary_load_string(relay->authtable,
+		    sizeof relay->authtable, v, len);
+	case EVF_MTA_RELAY_AUTHLABEL:
+		return binary_load_string(relay->authlabel,
+		    sizeof relay->authlabel, v, len);
+	case EVF_MTA_RELAY_SOURCE:
+		return binary_load_string(relay->sourcetable,
+		    sizeof relay->sourcetable, v, len);
+	case EVF_MTA_RELAY_HELONAME:
+		return binary_load_string(relay->heloname,
+		    sizeof relay->heloname, v, len);
+	case EVF_MTA_RELAY_HELOTABLE:
+		return binary_load_string(relay->helotable,
+		    sizeof relay->helotable, v, len);
+	case EVF_BOUNCE_TYPE:
+		if (! binary_load_enum(&i, v, len))
+			return (0);
+		ep->agent.bounce.type = i;
+		return (1);
+	case EVF_BOUNCE_DELAY:
+		return binary_load_time(&ep->agent.bounce.delay, v, len);
+	case EVF_BOUNCE_EXPIRE:
+		return binary_load_time(&ep->agent.bounce.expire, v, len);
+	case EVF_PRIORITY:
+		if (! binary_load_uint(&ep->priority, sizeof ep->priority,
+		    v, len) || ep->priority >= PRIO_COUNT)
+			return (0);
+		return (1);
+	default:
+		/* field from a newer format, ignore */
+		return (1);
+	}
+}
+
+static int
+envelope_binary_load(struct envelope *ep, const char *buf, size_t len)
+{
+	const char	*end = buf + len;
+	uint16_t	 n;
+	int		 tag;
+
+	buf += sizeof(ENVELOPE_BINARY_MAGIC) - 1;
+	if (buf >= end || *buf != ENVELOPE_BINARY_VERSION) {
+		log_debug("debug: bad binary envelope version");
+		return (0);
+	}
+	buf++;
+
+	memset(ep, 0, sizeof *ep);
+	while (buf < end) {
+		if (end - buf < 3)
+			goto err;
+		tag = (unsigned char)buf[0];
+		memmove(&n, buf + 1, 2);
+		n = ntohs(n);
+		buf += 3;
+		if (end - buf < n)
+			goto err;
+		if (! binary_load_field(ep, tag, buf, n)) {
+			log_warnx("envelope: invalid binary field %d", tag);
+			return (0);
+		}
+		buf += n;
+	}
+
+	if (ep->smtpname[0] == '\0')
+		strlcpy(ep->smtpname, env->sc_hostname, sizeof ep->smtpname);
+	ep->version = SMTPD_ENVELOPE_VERSION;
+	return (1);
+
+err:
+	log_warnx("envelope: truncated binary envelope");
+	return (0);
+}
+
 static int
 ascii_load_uint8(uint8_t *dest, char *buf)
 {
@@ -430,6 +1099,20 @@ ascii_load_dsn_ret(enum dsn_ret *ret, char *buf)
 	return 1;
 }
 
+static int
+ascii_load_priority(uint8_t *dest, char *buf)
+{
+	if (strcasecmp(buf, "high") == 0)
+		*dest = PRIO_HIGH;
+	else if (strcasecmp(buf, "normal") == 0)
+		*dest = PRIO_NORMAL;
+	else if (strcasecmp(buf, "bulk") == 0)
+		*dest = PRIO_BULK;
+	else
+		return 0;
+	return 1;
+}
+
 static int
 ascii_load_field(const char *field, struct envelope *ep, char *buf)
 {
@@ -561,6 +1244,9 @@ ascii_load_field(const char *field, struct envelope *ep, char *buf)
 	if (strcasecmp("esc-code", field) == 0)
 		return ascii_load_uint8(&ep->esc_code, buf);
 
+	if (strcasecmp("priority", field) == 0)
+		return ascii_load_priority(&ep->priority, buf);
+
 	return (0);
 }
 
@@ -758,6 +1444,20 @@ ascii_dump_dsn_ret(enum dsn_ret flag, char *dest, size_t len)
         return cpylen < len ? 1 : 0;
 }
 
+static int
+ascii_dump_priority(uint8_t prio, char *dest, size_t len)
+{
+	size_t cpylen = 0;
+
+	dest[0] = '\0';
+	if (prio == PRIO_HIGH)
+		cpylen = strlcat(dest, "high", len);
+	else if (prio == PRIO_BULK)
+		cpylen = strlcat(dest, "bulk", len);
+
+	return cpylen < len ? 1 : 0;
+}
+
 static int
 ascii_dump_field(const char *field, const struct envelope *ep,
     char *buf, size_t len)
@@ -897,6 +1597,9 @@ ascii_dump_field(const char *field, const struct envelope *ep,
 		return 1;
 	}
 
+	if (strcasecmp(field, "priority") == 0)
+		return ascii_dump_priority(ep->priority, buf, len);
+
 	return (0);
 }
 
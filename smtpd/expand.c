@@ -32,12 +32,49 @@
 #include "smtpd.h"
 #include "log.h"
 
+/*
+ * Chunks double in size, so a single recipient costs one small
+ * allocation and a large alias list a handful of big ones.
+ */
+#define	EXPAND_CHUNK_MAX	64
+
+/*
+ * Past EXPAND_HASH_MIN nodes, duplicates are looked up in an open
+ * addressing index kept at most half full.  Nodes are never removed
+ * one by one, so there is no deletion.
+ */
+#define	EXPAND_HASH_MIN		16
+
+struct expandchunk {
+	struct expandchunk	*next;
+	size_t			 count;
+	size_t			 size;
+	struct expandnode	 nodes[];
+};
+
 static const char *expandnode_info(struct expandnode *);
+static void expand_record(struct expandrecord *, struct expandnode *);
+static struct expandnode *expand_alloc(struct expand *);
+static uint64_t expand_hash(struct expandnode *);
+static uint64_t expand_hash_add(uint64_t, const void *, size_t);
+static void expand_index(struct expand *);
+static void expand_index_add(struct expand *, struct expandnode *);
 
 struct expandnode *
 expand_lookup(struct expand *expand, struct expandnode *key)
 {
-	return RB_FIND(expandtree, &expand->tree, key);
+	struct expandnode	*xn;
+	size_t			 i, mask;
+
+	if (expand->slots == NULL)
+		return RB_FIND(expandtree, &expand->tree, key);
+
+	mask = expand->nslots - 1;
+	for (i = expand_hash(key) & mask; (xn = expand->slots[i]);
+	    i = (i + 1) & mask)
+		if (expand_cmp(xn, key) == 0)
+			return (xn);
+	return (NULL);
 }
 
 int
@@ -65,6 +102,8 @@ expand_insert(struct expand *expand, struct expandnode *node)
 
 	log_trace(TRACE_EXPAND, "expand: %p: expand_insert() called for %s",
 	    expand, expandnode_info(node));
+	if (expand->record)
+		expand_record(expand->record, node);
 	if (node->type == EXPAND_USERNAME &&
 	    expand->parent &&
 	    expand->parent->type == EXPAND_USERNAME &&
@@ -80,7 +119,8 @@ expand_insert(struct expand *expand, struct expandnode *node)
 		return;
 	}
 
-	xn = xmemdup(node, sizeof *xn, "expand_insert");
+	xn = expand_alloc(expand);
+	*xn = *node;
 	xn->rule = expand->rule;
 	xn->parent = expand->parent;
 	xn->alias = expand->alias;
@@ -92,22 +132,149 @@ expand_insert(struct expand *expand, struct expandnode *node)
 	if (expand->queue)
 		TAILQ_INSERT_TAIL(expand->queue, xn, tq_entry);
 	expand->nb_nodes++;
+	if (expand->slots == NULL) {
+		if (expand->nb_nodes >= EXPAND_HASH_MIN)
+			expand_index(expand);
+	} else if (expand->nb_nodes * 2 > expand->nslots)
+		expand_index(expand);
+	else
+		expand_index_add(expand, xn);
 	log_trace(TRACE_EXPAND, "expand: %p: inserted node %p", expand, xn);
 }
 
+static void
+expand_record(struct expandrecord *rec, struct expandnode *node)
+{
+	struct expandnode	*tmp;
+
+	if (rec->count == rec->size) {
+		rec->size = rec->size ? rec->size * 2 : 8;
+		tmp = reallocarray(rec->nodes, rec->size, sizeof *rec->nodes);
+		if (tmp == NULL)
+			fatal("expand_record: reallocarray");
+		rec->nodes = tmp;
+	}
+	rec->nodes[rec->count++] = *node;
+}
+
+static struct expandnode *
+expand_alloc(struct expand *expand)
+{
+	struct expandchunk	*c = expand->chunks;
+	size_t			 size;
+
+	if (c == NULL || c->count == c->size) {
+		size = c ? c->size * 2 : 1;
+		if (size > EXPAND_CHUNK_MAX)
+			size = EXPAND_CHUNK_MAX;
+		c = xmalloc(sizeof(*c) + size * sizeof(c->nodes[0]),
+		    "expand_alloc");
+		c->count = 0;
+		c->size = size;
+		c->next = expand->chunks;
+		expand->chunks = c;
+	}
+
+	return (&c->nodes[c->count++]);
+}
+
+static uint64_t
+expand_hash_add(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char	*s = p;
+
+	while (len--) {
+		h ^= *s++;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+/* hash what expand_cmp() compares, so that equal nodes collide */
+static uint64_t
+expand_hash(struct expandnode *xn)
+{
+	struct expandnode	*p;
+	uint64_t		 h = 0xcbf29ce484222325ULL;
+
+	h = expand_hash_add(h, &xn->type, sizeof xn->type);
+	h = expand_hash_add(h, &xn->sameuser, sizeof xn->sameuser);
+	h = expand_hash_add(h, &xn->mapping, sizeof xn->mapping);
+	h = expand_hash_add(h, &xn->userbase, sizeof xn->userbase);
+
+	switch (xn->type) {
+	case EXPAND_USERNAME:
+		h = expand_hash_add(h, xn->u.user,
+		    strnlen(xn->u.user, sizeof xn->u.user));
+		break;
+	case EXPAND_ADDRESS:
+		h = expand_hash_add(h, xn->u.mailaddr.user,
+		    strnlen(xn->u.mailaddr.user, sizeof xn->u.mailaddr.user));
+		h = expand_hash_add(h, xn->u.mailaddr.domain,
+		    strnlen(xn->u.mailaddr.domain,
+		    sizeof xn->u.mailaddr.domain));
+		break;
+	default:
+		h = expand_hash_add(h, xn->u.buffer,
+		    strnlen(xn->u.buffer, sizeof xn->u.buffer));
+		break;
+	}
+
+	if (xn->parent == NULL)
+		return (h);
+	for (p = xn->parent; p && p->type != EXPAND_ADDRESS; p = p->parent)
+		;
+	h = expand_hash_add(h, &p, sizeof p);
+	if (xn->type != EXPAND_FILENAME && xn->type != EXPAND_FILTER)
+		return (h);
+	for (p = xn->parent; p && p->type != EXPAND_USERNAME; p = p->parent)
+		;
+	return (expand_hash_add(h, &p, sizeof p));
+}
+
+static void
+expand_index(struct expand *expand)
+{
+	struct expandnode	*xn;
+	size_t			 n;
+
+	free(expand->slots);
+	for (n = EXPAND_HASH_MIN * 4; n < expand->nb_nodes * 4; n *= 2)
+		;
+	expand->slots = xcalloc(n, sizeof *expand->slots, "expand_index");
+	expand->nslots = n;
+	RB_FOREACH(xn, expandtree, &expand->tree)
+		expand_index_add(expand, xn);
+}
+
+static void
+expand_index_add(struct expand *expand, struct expandnode *xn)
+{
+	size_t	i, mask;
+
+	mask = expand->nslots - 1;
+	for (i = expand_hash(xn) & mask; expand->slots[i]; i = (i + 1) & mask)
+		;
+	expand->slots[i] = xn;
+}
+
 void
 expand_clear(struct expand *expand)
 {
-	struct expandnode *xn;
+	struct expandchunk *c;
 
 	log_trace(TRACE_EXPAND, "expand: %p: clearing expand tree", expand);
 	if (expand->queue)
-		while ((xn = TAILQ_FIRST(expand->queue)))
-			TAILQ_REMOVE(expand->queue, xn, tq_entry);
-
-	while ((xn = RB_ROOT(&expand->tree)) != NULL) {
-		RB_REMOVE(expandtree, &expand->tree, xn);
-		free(xn);
+		TAILQ_INIT(expand->queue);
+	RB_INIT(&expand->tree);
+	expand->nb_nodes = 0;
+
+	free(expand->slots);
+	expand->slots = NULL;
+	expand->nslots = 0;
+	while ((c = expand->chunks)) {
+		expand->chunks = c->next;
+		free(c);
 	}
 }
 
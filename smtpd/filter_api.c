@@ -35,6 +35,8 @@
 #include "log.h"
 
 #define FILTER_HIWAT 65536
+#define FILTER_CHUNK 65536
+#define FILTER_TIMEOUT 300000	/* msec */
 
 static struct tree	queries;
 static struct tree	sessions;
@@ -43,6 +45,7 @@ struct filter_session {
 	uint64_t	id;
 	uint64_t	qid;
 	int		qhook;
+	struct event	qev;
 
 	struct {
 		size_t		 datalen;
@@ -63,6 +66,16 @@ struct filter_session {
 	} response;
 };
 
+/* a query received while the filter was at its concurrency limit */
+struct filter_waiting {
+	TAILQ_ENTRY(filter_waiting)	entry;
+	uint64_t			id;
+	struct imsg			imsg;
+};
+
+static TAILQ_HEAD(, filter_waiting)	waiting;
+static struct event			ev_waiting;
+
 static int		 register_done;
 static const char	*filter_name;
 
@@ -76,6 +89,10 @@ static struct filter_internals {
 	gid_t		gid;
 	const char     *rootpath;
 
+	int		passthrough;	/* data goes out as it comes in */
+	int		concurrency;	/* max queries in progress, 0 for any */
+	int		timeout;	/* msec before a pending query fails */
+
 	struct {
 		int  (*connect)(uint64_t, struct filter_connect *);
 		int  (*helo)(uint64_t, const char *);
@@ -83,7 +100,9 @@ static struct filter_internals {
 		int  (*rcpt)(uint64_t, struct mailaddr *);
 		int  (*data)(uint64_t);
 		void (*dataline)(uint64_t, const char *);
+		void (*datachunk)(uint64_t, const char *, size_t);
 		int  (*eom)(uint64_t);
+		int  (*message)(uint64_t, int, size_t);
 
 		void (*disconnect)(uint64_t);
 		void (*reset)(uint64_t);
@@ -97,9 +116,15 @@ static void filter_response(struct filter_session *, int, int, const char *);
 static void filter_send_response(struct filter_session *);
 static void filter_register_query(uint64_t, uint64_t, enum filter_hook);
 static void filter_dispatch(struct mproc *, struct imsg *);
+static void filter_dispatch_query(struct imsg *);
+static void filter_wait_query(struct imsg *);
+static void filter_drop_waiting(uint64_t);
+static void filter_run_waiting(int, short, void *);
+static void filter_query_timeout(int, short, void *);
 static void filter_dispatch_dataline(uint64_t, const char *);
+static void filter_dispatch_datachunk(struct filter_session *);
 static void filter_dispatch_data(uint64_t);
-static void filter_dispatch_eom(uint64_t, size_t);
+static void filter_dispatch_eom(uint64_t, size_t, int);
 static void filter_dispatch_connect(uint64_t, struct filter_connect *);
 static void filter_dispatch_helo(uint64_t, const char *);
 static void filter_dispatch_mail(uint64_t, struct mailaddr *);
@@ -109,6 +134,7 @@ static void filter_dispatch_commit(uint64_t);
 static void filter_dispatch_rollback(uint64_t);
 static void filter_dispatch_disconnect(uint64_t);
 
+static struct filter_session *filter_answering(uint64_t);
 static void filter_trigger_eom(struct filter_session *);
 static void filter_io_in(struct io *, int);
 static void filter_io_out(struct io *, int);
@@ -149,6 +175,8 @@ filter_response(struct filter_session *s, int status, int code, const char *line
 static void
 filter_send_response(struct filter_session *s)
 {
+	struct timeval	tv;
+
 	log_debug("debug: filter-api:%s: sending response %s for %016"PRIx64" %d %d %s",
 	    filter_name, query_to_str(s->qhook), s->id,
 	    s->response.status,
@@ -156,6 +184,7 @@ filter_send_response(struct filter_session *s)
 	    s->response.line);
 
 	tree_xpop(&queries, s->qid);
+	evtimer_del(&s->qev);
 
 	m_create(&fi.p, IMSG_FILTER_RESPONSE, 0, 0, -1);
 	m_add_id(&fi.p, s->qid);
@@ -174,19 +203,24 @@ filter_send_response(struct filter_session *s)
 
 	s->qid = 0;
 	s->response.ready = 0;
+
+	/* a slot is free, let the next query in outside of the callbacks */
+	if (!TAILQ_EMPTY(&waiting) && !evtimer_pending(&ev_waiting, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_waiting, &tv);
+	}
 }
 
 static void
 filter_dispatch(struct mproc *p, struct imsg *imsg)
 {
 	struct filter_session	*s;
-	struct filter_connect	 q_connect;
-	struct mailaddr		 maddr;
 	struct msg		 m;
-	const char		*line, *name;
-	uint32_t		 v, datalen;
-	uint64_t		 id, qid;
-	int			 status, event, hook;
+	const char		*name;
+	uint32_t		 v;
+	uint64_t		 id;
+	int			 event;
 	int			 fds[2], fdin, fdout;
 
 	log_debug("debug: filter-api:%s: imsg %s", filter_name,
@@ -203,6 +237,11 @@ filter_dispatch(struct mproc *p, struct imsg *imsg)
 			log_warnx("warn: filter-api:%s: API mismatch", filter_name);
 			fatalx("filter-api: exiting");
 		}
+		/* a filter that does not look at the data stays off the chain */
+		if (fi.cb.dataline == NULL && fi.cb.datachunk == NULL)
+			fi.hooks &= ~HOOK_DATALINE;
+		if (fi.cb.message == NULL)
+			fi.hooks &= ~HOOK_MESSAGE;
 		m_create(p, IMSG_FILTER_REGISTER, 0, 0, -1);
 		m_add_int(p, fi.hooks);
 		m_add_int(p, fi.flags);
@@ -220,11 +259,19 @@ filter_dispatch(struct mproc *p, struct imsg *imsg)
 			s->id = id;
 			s->pipe.iev.sock = -1;
 			s->pipe.oev.sock = -1;
+			evtimer_set(&s->qev, filter_query_timeout, s);
 			tree_xset(&sessions, id, s);
 			break;
 		case EVENT_DISCONNECT:
 			filter_dispatch_disconnect(id);
+			filter_drop_waiting(id);
 			s = tree_xpop(&sessions, id);
+			/* an answer that comes later for it is ignored */
+			if (s->qid) {
+				tree_xpop(&queries, s->qid);
+				evtimer_del(&s->qev);
+				free(s->response.line);
+			}
 			free(s);
 			break;
 		case EVENT_RESET:
@@ -240,52 +287,11 @@ filter_dispatch(struct mproc *p, struct imsg *imsg)
 		break;
 
 	case IMSG_FILTER_QUERY:
-		m_msg(&m, imsg);
-		m_get_id(&m, &id);
-		m_get_id(&m, &qid);
-		m_get_int(&m, &hook);
-		switch(hook) {
-		case QUERY_CONNECT:
-			m_get_sockaddr(&m, (struct sockaddr*)&q_connect.local);
-			m_get_sockaddr(&m, (struct sockaddr*)&q_connect.remote);
-			m_get_string(&m, &q_connect.hostname);
-			m_end(&m);
-			filter_register_query(id, qid, hook);
-			filter_dispatch_connect(id, &q_connect);
-			break;
-		case QUERY_HELO:
-			m_get_string(&m, &line);
-			m_end(&m);
-			filter_register_query(id, qid, hook);
-			filter_dispatch_helo(id, line);
-			break;
-		case QUERY_MAIL:
-			m_get_mailaddr(&m, &maddr);
-			m_end(&m);
-			filter_register_query(id, qid, hook);
-			filter_dispatch_mail(id, &maddr);
-			break;
-		case QUERY_RCPT:
-			m_get_mailaddr(&m, &maddr);
-			m_end(&m);
-			filter_register_query(id, qid, hook);
-			filter_dispatch_rcpt(id, &maddr);
-			break;
-		case QUERY_DATA:
-			m_end(&m);
-			filter_register_query(id, qid, hook);
-			filter_dispatch_data(id);
-			break;
-		case QUERY_EOM:
-			m_get_u32(&m, &datalen);
-			m_end(&m);
-			filter_register_query(id, qid, hook);
-			filter_dispatch_eom(id, datalen);
-			break;
-		default:
-			log_warnx("warn: filter-api:%s: bad hook %d", filter_name, hook);
-			fatalx("filter-api: exiting");
-		}
+		if (fi.concurrency && ((int)queries.count >= fi.concurrency ||
+		    !TAILQ_EMPTY(&waiting)))
+			filter_wait_query(imsg);
+		else
+			filter_dispatch_query(imsg);
 		break;
 
 	case IMSG_FILTER_PIPE_SETUP:
@@ -306,7 +312,8 @@ filter_dispatch(struct mproc *p, struct imsg *imsg)
 			io_init(&s->pipe.oev, fdout, s, filter_io_out, &s->pipe.obuf);
 			io_set_write(&s->pipe.oev);
 
-			iobuf_init(&s->pipe.ibuf, 0, 0);
+			iobuf_init(&s->pipe.ibuf, fi.cb.dataline ? 0 :
+			    FILTER_CHUNK, 0);
 			io_init(&s->pipe.iev, fds[0], s, filter_io_in, &s->pipe.ibuf);
 			io_set_read(&s->pipe.iev);
 
@@ -337,10 +344,151 @@ filter_dispatch(struct mproc *p, struct imsg *imsg)
 	}
 }
 
+static void
+filter_dispatch_query(struct imsg *imsg)
+{
+	struct filter_connect	 q_connect;
+	struct mailaddr		 maddr;
+	struct msg		 m;
+	const char		*line;
+	uint32_t		 datalen;
+	uint64_t		 id, qid;
+	int			 hook;
+
+	m_msg(&m, imsg);
+	m_get_id(&m, &id);
+	m_get_id(&m, &qid);
+	m_get_int(&m, &hook);
+	switch(hook) {
+	case QUERY_CONNECT:
+		m_get_sockaddr(&m, (struct sockaddr*)&q_connect.local);
+		m_get_sockaddr(&m, (struct sockaddr*)&q_connect.remote);
+		m_get_string(&m, &q_connect.hostname);
+		m_end(&m);
+		filter_register_query(id, qid, hook);
+		filter_dispatch_connect(id, &q_connect);
+		break;
+	case QUERY_HELO:
+		m_get_string(&m, &line);
+		m_end(&m);
+		filter_register_query(id, qid, hook);
+		filter_dispatch_helo(id, line);
+		break;
+	case QUERY_MAIL:
+		m_get_mailaddr(&m, &maddr);
+		m_end(&m);
+		filter_register_query(id, qid, hook);
+		filter_dispatch_mail(id, &maddr);
+		break;
+	case QUERY_RCPT:
+		m_get_mailaddr(&m, &maddr);
+		m_end(&m);
+		filter_register_query(id, qid, hook);
+		filter_dispatch_rcpt(id, &maddr);
+		break;
+	case QUERY_DATA:
+		m_end(&m);
+		filter_register_query(id, qid, hook);
+		filter_dispatch_data(id);
+		break;
+	case QUERY_EOM:
+		m_get_u32(&m, &datalen);
+		m_end(&m);
+		filter_register_query(id, qid, hook);
+		filter_dispatch_eom(id, datalen, imsg->fd);
+		break;
+	default:
+		log_warnx("warn: filter-api:%s: bad hook %d", filter_name, hook);
+		fatalx("filter-api: exiting");
+	}
+}
+
+/*
+ * Keep a copy of the query for later and stop reading from the mfa
+ * until the queries in progress make room for it.
+ */
+static void
+filter_wait_query(struct imsg *imsg)
+{
+	struct filter_waiting	*w;
+	struct msg		 m;
+	size_t			 len;
+
+	w = xcalloc(1, sizeof(*w), "filter_wait_query");
+	m_msg(&m, imsg);
+	m_get_id(&m, &w->id);
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	w->imsg.hdr = imsg->hdr;
+	w->imsg.fd = imsg->fd;
+	w->imsg.data = len ? xmemdup(imsg->data, len, "filter_wait_query") : NULL;
+	TAILQ_INSERT_TAIL(&waiting, w, entry);
+
+	log_debug("debug: filter-api:%s: query for %016"PRIx64" waiting, "
+	    "%zu in progress", filter_name, w->id, queries.count);
+
+	mproc_disable(&fi.p);
+}
+
+static void
+filter_drop_waiting(uint64_t id)
+{
+	struct filter_waiting	*w;
+
+	TAILQ_FOREACH(w, &waiting, entry)
+		if (w->id == id)
+			break;
+	if (w == NULL)
+		return;
+	TAILQ_REMOVE(&waiting, w, entry);
+	if (w->imsg.fd != -1)
+		close(w->imsg.fd);
+	free(w->imsg.data);
+	free(w);
+}
+
+static void
+filter_run_waiting(int fd, short event, void *p)
+{
+	struct filter_waiting	*w;
+
+	while ((int)queries.count < fi.concurrency &&
+	    (w = TAILQ_FIRST(&waiting))) {
+		TAILQ_REMOVE(&waiting, w, entry);
+		filter_dispatch_query(&w->imsg);
+		free(w->imsg.data);
+		free(w);
+	}
+	if (TAILQ_EMPTY(&waiting))
+		mproc_enable(&fi.p);
+}
+
+static void
+filter_query_timeout(int fd, short event, void *p)
+{
+	struct filter_session	*s = p;
+
+	log_warnx("warn: filter-api:%s: %s for %016"PRIx64" timed out",
+	    filter_name, query_to_str(s->qhook), s->id);
+
+	/* do not wait for the data either */
+	if (s->pipe.iev.sock != -1) {
+		io_clear(&s->pipe.iev);
+		iobuf_clear(&s->pipe.ibuf);
+	}
+	if (s->pipe.oev.sock != -1) {
+		io_clear(&s->pipe.oev);
+		iobuf_clear(&s->pipe.obuf);
+	}
+	s->pipe.error = 1;
+	free(s->response.line);
+	filter_response(s, FILTER_CLOSE, 421, "Filter timeout");
+}
+
 static void
 filter_register_query(uint64_t id, uint64_t qid, enum filter_hook hook)
 {
 	struct filter_session	*s;
+	struct timeval		 tv;
 
 	log_debug("debug: filter-api:%s: query %s for %016"PRIx64,
 		filter_name, query_to_str(hook), id);
@@ -356,6 +504,12 @@ filter_register_query(uint64_t id, uint64_t qid, enum filter_hook hook)
 	s->response.ready = 0;
 
 	tree_xset(&queries, qid, s);
+
+	if (fi.timeout) {
+		tv.tv_sec = fi.timeout / 1000;
+		tv.tv_usec = (fi.timeout % 1000) * 1000;
+		evtimer_add(&s->qev, &tv);
+	}
 }
 
 static void
@@ -433,13 +587,21 @@ filter_dispatch_disconnect(uint64_t id)
 
 
 static void
-filter_dispatch_eom(uint64_t id, size_t datalen)
+filter_dispatch_eom(uint64_t id, size_t datalen, int fd)
 {
 	struct filter_session	*s;
 
 	s = tree_xget(&sessions, id);
 	s->pipe.datalen = datalen;
 
+	/* the callback owns the fd, -1 if the file could not be shared */
+	if (fi.cb.message && !(fi.hooks & HOOK_DATALINE)) {
+		fi.cb.message(s->id, fd, datalen);
+		return;
+	}
+	if (fd != -1)
+		close(fd);
+
 	if (fi.hooks & HOOK_DATALINE) {
 		/* wait for the io to be done  */
 		if (s->pipe.iev.sock != -1) {
@@ -460,10 +622,51 @@ filter_dispatch_eom(uint64_t id, size_t datalen)
 static void
 filter_dispatch_dataline(uint64_t id, const char *data)
 {
-	if (fi.cb.dataline)
-		fi.cb.dataline(id, data);
-	else
+	if (fi.passthrough)
 		filter_api_writeln(id, data);
+	fi.cb.dataline(id, data);
+}
+
+/*
+ * Hand the input over as it is, cut after the last complete line unless
+ * there is none in a full buffer.
+ */
+static void
+filter_dispatch_datachunk(struct filter_session *s)
+{
+	char	*data, *nl;
+	size_t	 len;
+
+	data = iobuf_data(&s->pipe.ibuf);
+	len = iobuf_len(&s->pipe.ibuf);
+	if (len == 0)
+		return;
+	if ((nl = memrchr(data, '\n', len)))
+		len = nl - data + 1;
+	else if (len < SMTPD_MAXLINESIZE)
+		return;
+
+	s->pipe.idatalen += len;
+	if (fi.passthrough || fi.cb.datachunk == NULL)
+		filter_api_write(s->id, data, len);
+	if (fi.cb.datachunk)
+		fi.cb.datachunk(s->id, data, len);
+	iobuf_drop(&s->pipe.ibuf, len);
+}
+
+/* the session if it still waits for an answer, a late one is dropped */
+static struct filter_session *
+filter_answering(uint64_t id)
+{
+	struct filter_session	*s;
+
+	s = tree_get(&sessions, id);
+	if (s == NULL || s->qid == 0 || s->response.ready) {
+		log_debug("debug: filter-api:%s: late answer for %016"PRIx64
+		    " ignored", filter_name, id);
+		return NULL;
+	}
+	return s;
 }
 
 static void
@@ -517,6 +720,11 @@ filter_io_in(struct io *io, int evt)
 
 	switch (evt) {
 	case IO_DATAIN:
+		if (fi.cb.dataline == NULL) {
+			filter_dispatch_datachunk(s);
+			iobuf_normalize(&s->pipe.ibuf);
+			goto flowcontrol;
+		}
 	    nextline:
 		line = iobuf_getline(&s->pipe.ibuf, &len);
 		if ((line == NULL && iobuf_len(&s->pipe.ibuf) >= SMTPD_MAXLINESIZE) ||
@@ -529,9 +737,10 @@ filter_io_in(struct io *io, int evt)
 		/* No complete line received */
 		if (line == NULL) {
 			iobuf_normalize(&s->pipe.ibuf);
-			/* flow control */
-			if (iobuf_queued(&s->pipe.obuf) >= FILTER_HIWAT)
-				io_pause(&s->pipe.oev, IO_PAUSE_IN);
+		    flowcontrol:
+			if (s->pipe.oev.sock != -1 &&
+			    iobuf_queued(&s->pipe.obuf) >= FILTER_HIWAT)
+				io_pause(&s->pipe.iev, IO_PAUSE_IN);
 			return;
 		}
 		s->pipe.idatalen += len + 1;
@@ -539,6 +748,15 @@ filter_io_in(struct io *io, int evt)
 		goto nextline;
 
 	case IO_DISCONNECTED:
+		/* what is left of an unterminated last line */
+		if (fi.cb.datachunk && iobuf_len(&s->pipe.ibuf)) {
+			len = iobuf_len(&s->pipe.ibuf);
+			s->pipe.idatalen += len;
+			if (fi.passthrough)
+				filter_api_write(s->id,
+				    iobuf_data(&s->pipe.ibuf), len);
+			fi.cb.datachunk(s->id, iobuf_data(&s->pipe.ibuf), len);
+		}
 		if (s->qhook == QUERY_EOM)
 			filter_trigger_eom(s);
 		else {
@@ -628,6 +846,7 @@ hook_to_str(int hook)
 	CASE(HOOK_COMMIT);
 	CASE(HOOK_ROLLBACK);
 	CASE(HOOK_DATALINE);
+	CASE(HOOK_MESSAGE);
 	default:
 		return "HOOK_???";
 	}
@@ -751,7 +970,9 @@ filter_api_init(void)
 
 	tree_init(&queries);
 	tree_init(&sessions);
+	TAILQ_INIT(&waiting);
 	event_init();
+	evtimer_set(&ev_waiting, filter_run_waiting, NULL);
 
 	memset(&fi, 0, sizeof(fi));
 	fi.p.proc = PROC_MFA;
@@ -760,6 +981,7 @@ filter_api_init(void)
 	fi.uid = pw->pw_uid;
 	fi.gid = pw->pw_gid;
 	fi.rootpath = PATH_CHROOT;
+	fi.timeout = FILTER_TIMEOUT;
 
 	/* XXX just for now */
 	fi.hooks = ~0;
@@ -819,6 +1041,30 @@ filter_api_on_dataline(void(*cb)(uint64_t, const char *))
 
 	fi.hooks |= HOOK_DATALINE | HOOK_EOM;
 	fi.cb.dataline = cb;
+	fi.cb.datachunk = NULL;
+}
+
+/*
+ * The data comes in blocks of complete lines, as they are read from the
+ * pipe, and goes out with filter_api_write().
+ */
+void
+filter_api_on_datachunk(void(*cb)(uint64_t, const char *, size_t))
+{
+	filter_api_init();
+
+	fi.hooks |= HOOK_DATALINE | HOOK_EOM;
+	fi.cb.datachunk = cb;
+	fi.cb.dataline = NULL;
+}
+
+/* the data callback only inspects, the data is forwarded unchanged */
+void
+filter_api_data_passthrough(void)
+{
+	filter_api_init();
+
+	fi.passthrough = 1;
 }
 
 void
@@ -830,6 +1076,20 @@ filter_api_on_eom(int(*cb)(uint64_t))
 	fi.cb.eom = cb;
 }
 
+/*
+ * At eom, the callback gets a read-only fd on the spooled message, to
+ * scan with pread() or mmap() rather than line by line over the pipe.
+ * It is shared with the other filters, so the file offset is not ours.
+ */
+void
+filter_api_on_message(int(*cb)(uint64_t, int, size_t))
+{
+	filter_api_init();
+
+	fi.hooks |= HOOK_MESSAGE | HOOK_EOM;
+	fi.cb.message = cb;
+}
+
 void
 filter_api_on_reset(void(*cb)(uint64_t))
 {
@@ -866,6 +1126,45 @@ filter_api_on_rollback(void(*cb)(uint64_t))
 	fi.cb.rollback = cb;
 }
 
+/*
+ * A callback that cannot answer right away returns filter_api_pending()
+ * and calls filter_api_accept() or filter_api_reject() later on, from
+ * an event of the filter's own.
+ */
+int
+filter_api_pending(uint64_t id)
+{
+	struct filter_session	*s;
+
+	s = tree_xget(&sessions, id);
+	if (s->qid == 0) {
+		log_warnx("warn: filter-api:%s: no query in progress",
+		    filter_name);
+		fatalx("filter-api: exiting");
+	}
+	log_debug("debug: filter-api:%s: %s for %016"PRIx64" pending",
+	    filter_name, query_to_str(s->qhook), id);
+	return 1;
+}
+
+/* at most n queries in progress, the others wait in order */
+void
+filter_api_set_concurrency(int n)
+{
+	filter_api_init();
+
+	fi.concurrency = n > 0 ? n : 0;
+}
+
+/* a query not answered within msec closes the session, 0 for never */
+void
+filter_api_set_timeout(int msec)
+{
+	filter_api_init();
+
+	fi.timeout = msec > 0 ? msec : 0;
+}
+
 void
 filter_api_loop(void)
 {
@@ -909,7 +1208,8 @@ filter_api_accept(uint64_t id)
 {
 	struct filter_session	*s;
 
-	s = tree_xget(&sessions, id);
+	if ((s = filter_answering(id)) == NULL)
+		return 0;
 	filter_response(s, FILTER_OK, 0, NULL);
 	return 1;
 }
@@ -919,7 +1219,8 @@ filter_api_reject(uint64_t id, enum filter_status status)
 {
 	struct filter_session	*s;
 
-	s = tree_xget(&sessions, id);
+	if ((s = filter_answering(id)) == NULL)
+		return 0;
 
 	/* This is NOT an acceptable status for a failure */
 	if (status == FILTER_OK)
@@ -935,7 +1236,8 @@ filter_api_reject_code(uint64_t id, enum filter_status status, uint32_t code,
 {
 	struct filter_session	*s;
 
-	s = tree_xget(&sessions, id);
+	if ((s = filter_answering(id)) == NULL)
+		return 0;
 
 	/* This is NOT an acceptable status for a failure */
 	if (status == FILTER_OK)
@@ -962,6 +1264,23 @@ filter_api_writeln(uint64_t id, const char *line)
 	io_reload(&s->pipe.oev);
 }
 
+void
+filter_api_write(uint64_t id, const char *data, size_t len)
+{
+	struct filter_session	*s;
+
+	s = tree_xget(&sessions, id);
+
+	if (s->pipe.oev.sock == -1) {
+		log_warnx("warn: filter:%s: cannot write at this point", filter_name);
+		fatalx("exiting");
+	}
+
+	s->pipe.odatalen += len;
+	iobuf_queue(&s->pipe.obuf, data, len);
+	io_reload(&s->pipe.oev);
+}
+
 const char *
 filter_api_sockaddr_to_text(const struct sockaddr *sa)
 {
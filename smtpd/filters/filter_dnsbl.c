@@ -17,10 +17,19 @@
  */
  
 #include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/nameser.h>
 
 #include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "smtpd-defines.h"
@@ -28,83 +37,335 @@
 #include "log.h"
 #include "asr_event.h"
 #include "asr.h"
+#include "asr_private.h"
 
-const char * dnsbl_host = "dnsbl.sorbs.net";
+/*
+ * Each client address is looked up in all zones at once, and the
+ * session is answered as soon as the weights of the zones listing it
+ * reach the threshold, or can no longer do so.  The outcome is cached
+ * per address for the TTL of the answers, so that clients connecting
+ * again, or several times at once, cost a single set of queries.
+ */
+#define	DNSBL_ZONE		"dnsbl.sorbs.net"
+#define	DNSBL_CACHE_MAX		8192
+#define	DNSBL_MAXTTL		86400
+#define	DNSBL_NEGTTL		300	/* not listed, without SOA */
+#define	DNSBL_FAILTTL		60	/* resolver errors */
 
-static void
-dnsbl_event_dispatch(int ret, struct async_res *ar, void *arg)
-{
-	uint64_t *q = arg;
+struct dnsbl_zone {
+	const char	*name;
+	int		 weight;
+};
 
-	if (ar->ar_addrinfo)
-		freeaddrinfo(ar->ar_addrinfo);
+struct dnsbl_waiter {
+	TAILQ_ENTRY(dnsbl_waiter)	 entry;
+	uint64_t			 id;
+};
 
-	if (ar->ar_gai_errno != EAI_NODATA)
-		filter_api_reject(*q, FILTER_CLOSE);
-	else
-		filter_api_accept(*q);
-	free(q);
-}
+struct dnsbl_host {
+	TAILQ_ENTRY(dnsbl_host)		 entry;
+	TAILQ_HEAD(, dnsbl_waiter)	 waiters;
+	uint32_t			 addr;
+	int				 score;
+	int				 left;		/* weight still queried */
+	int				 running;
+	int				 cached;
+	time_t				 expire;
+};
+
+struct dnsbl_query {
+	struct dnsbl_host	*host;
+	struct dnsbl_zone	*zone;
+};
+
+static int dnsbl_on_connect(uint64_t, struct filter_connect *);
+static int dnsbl_query(struct dnsbl_host *, struct dnsbl_zone *);
+static void dnsbl_event_dispatch(int, struct async_res *, void *);
+static int dnsbl_answer(struct async_res *, int *);
+static void dnsbl_decide(struct dnsbl_host *);
+static void dnsbl_evict(void);
+static void dnsbl_free(struct dnsbl_host *);
+
+static struct dnsbl_zone	*zones;
+static size_t			 nzones;
+static int			 threshold = 1;
+static size_t			 cachemax = DNSBL_CACHE_MAX;
+
+static struct tree		 hosts;
+static TAILQ_HEAD(dnsbl_lru, dnsbl_host) lru = TAILQ_HEAD_INITIALIZER(lru);
 
 static int
 dnsbl_on_connect(uint64_t id, struct filter_connect *conn)
 {
-	struct addrinfo		 hints;
-	struct sockaddr_in	*sain;
-	in_addr_t		 in_addr;
-	struct async		*as;
-	uint64_t		*q;
-	char			 buf[512];
+	struct dnsbl_host	*h;
+	struct dnsbl_waiter	*w;
+	uint32_t		 addr;
+	time_t			 now;
+	size_t			 i;
 
 	if (conn->remote.ss_family != AF_INET)
 		return filter_api_accept(id);
-	
-	in_addr = ((const struct sockaddr_in *)&conn->remote)->sin_addr.s_addr;
 
-	in_addr = ntohl(in_addr);
-	if (snprintf(buf, sizeof(buf), "%d.%d.%d.%d.%s.",
-	    in_addr & 0xff,
-	    (in_addr >> 8) & 0xff,
-	    (in_addr >> 16) & 0xff,
-	    (in_addr >> 24) & 0xff,
-	    dnsbl_host) >= sizeof(buf)) {
-		log_warnx("filter-dnsbl: host name too long: %s", buf);
+	addr = ntohl(((const struct sockaddr_in *)&conn->remote)->sin_addr.s_addr);
+	now = time(NULL);
+
+	if ((h = tree_get(&hosts, addr))) {
+		TAILQ_REMOVE(&lru, h, entry);
+		TAILQ_INSERT_HEAD(&lru, h, entry);
+		if (h->running || h->expire > now) {
+			/* known, or at least already decided */
+			if (h->score >= threshold)
+				return filter_api_reject(id, FILTER_CLOSE);
+			if (h->score + h->left < threshold)
+				return filter_api_accept(id);
+			goto wait;
+		}
+	}
+	else {
+		dnsbl_evict();
+		if ((h = calloc(1, sizeof *h)) == NULL) {
+			log_warn("filter-dnsbl: calloc");
+			return filter_api_reject(id, FILTER_FAIL);
+		}
+		h->addr = addr;
+		TAILQ_INIT(&h->waiters);
+		tree_xset(&hosts, addr, h);
+		TAILQ_INSERT_HEAD(&lru, h, entry);
+		h->cached = 1;
+	}
+
+	h->score = 0;
+	h->left = 0;
+	h->expire = now + DNSBL_MAXTTL;
+	for (i = 0; i < nzones; i++)
+		if (dnsbl_query(h, &zones[i]))
+			h->left += zones[i].weight;
+	if (h->running == 0) {
+		/* nothing could be asked, do not remember it */
+		h->expire = now;
 		return filter_api_reject(id, FILTER_FAIL);
 	}
 
-	q = calloc(1, sizeof *q);
-	if (q == NULL) {
+    wait:
+	if ((w = calloc(1, sizeof *w)) == NULL) {
 		log_warn("filter-dnsbl: calloc");
 		return filter_api_reject(id, FILTER_FAIL);
 	}
-	*q = id;
+	w->id = id;
+	TAILQ_INSERT_TAIL(&h->waiters, w, entry);
+	return filter_api_pending(id);
+}
 
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	as = getaddrinfo_async(buf, NULL, &hints, NULL);
+static int
+dnsbl_query(struct dnsbl_host *h, struct dnsbl_zone *zone)
+{
+	struct dnsbl_query	*q;
+	struct async		*as;
+	char			 buf[512];
+
+	if (snprintf(buf, sizeof(buf), "%d.%d.%d.%d.%s.",
+	    h->addr & 0xff,
+	    (h->addr >> 8) & 0xff,
+	    (h->addr >> 16) & 0xff,
+	    (h->addr >> 24) & 0xff,
+	    zone->name) >= (int)sizeof(buf)) {
+		log_warnx("filter-dnsbl: host name too long: %s", buf);
+		return 0;
+	}
+
+	if ((q = calloc(1, sizeof *q)) == NULL) {
+		log_warn("filter-dnsbl: calloc");
+		return 0;
+	}
+	q->host = h;
+	q->zone = zone;
+
+	as = res_query_async(buf, C_IN, T_A, NULL);
 	if (as == NULL) {
-		log_warn("filter-dnsbl: getaddrinfo_async");
+		log_warn("filter-dnsbl: res_query_async");
 		free(q);
-		return filter_api_reject(id, FILTER_FAIL);
+		return 0;
 	}
 
 	log_debug("debug: filter-dnsbl: checking %s", buf);
 
+	h->running++;
 	async_run_event(as, dnsbl_event_dispatch, q);
 	return 1;
 }
 
+static void
+dnsbl_event_dispatch(int ret, struct async_res *ar, void *arg)
+{
+	struct dnsbl_query	*q = arg;
+	struct dnsbl_host	*h = q->host;
+	time_t			 expire;
+	int			 ttl;
+
+	if (dnsbl_answer(ar, &ttl)) {
+		log_debug("debug: filter-dnsbl: %08x listed in %s", h->addr,
+		    q->zone->name);
+		h->score += q->zone->weight;
+	}
+	free(ar->ar_data);
+
+	h->left -= q->zone->weight;
+	expire = time(NULL) + ttl;
+	if (expire < h->expire)
+		h->expire = expire;
+	h->running--;
+	free(q);
+
+	dnsbl_decide(h);
+	if (h->running == 0 && ! h->cached)
+		dnsbl_free(h);
+}
+
+/*
+ * Tell whether the answer lists the address and for how long it holds.
+ */
+static int
+dnsbl_answer(struct async_res *ar, int *ttl)
+{
+	struct unpack	 pack;
+	struct header	 h;
+	struct query	 q;
+	struct rr	 rr;
+	uint32_t	 t;
+	int		 listed;
+
+	*ttl = DNSBL_FAILTTL;
+	if (ar->ar_data == NULL || ar->ar_rcode == SERVFAIL ||
+	    ar->ar_h_errno == TRY_AGAIN || ar->ar_h_errno == NO_RECOVERY)
+		return 0;
+
+	asr_unpack_init(&pack, ar->ar_data, ar->ar_datalen);
+	asr_unpack_header(&pack, &h);
+	asr_unpack_query(&pack, &q);
+
+	listed = 0;
+	t = DNSBL_MAXTTL;
+	for (; h.ancount; h.ancount--) {
+		if (asr_unpack_rr(&pack, &rr) == -1)
+			return 0;
+		if (rr.rr_type != T_A)
+			continue;
+		listed = 1;
+		if (rr.rr_ttl < t)
+			t = rr.rr_ttl;
+	}
+	if (! listed) {
+		t = DNSBL_NEGTTL;
+		for (; h.nscount; h.nscount--) {
+			if (asr_unpack_rr(&pack, &rr) == -1)
+				break;
+			if (rr.rr_type != T_SOA)
+				continue;
+			t = rr.rr_ttl;
+			if (rr.rr.soa.minimum < t)
+				t = rr.rr.soa.minimum;
+			break;
+		}
+	}
+	*ttl = t;
+	return listed;
+}
+
+static void
+dnsbl_decide(struct dnsbl_host *h)
+{
+	struct dnsbl_waiter	*w;
+	int			 listed;
+
+	if (h->score >= threshold)
+		listed = 1;
+	else if (h->score + h->left < threshold)
+		listed = 0;
+	else
+		return;
+
+	while ((w = TAILQ_FIRST(&h->waiters))) {
+		TAILQ_REMOVE(&h->waiters, w, entry);
+		if (listed)
+			filter_api_reject(w->id, FILTER_CLOSE);
+		else
+			filter_api_accept(w->id);
+		free(w);
+	}
+}
+
+/* make room for one more address, least recently used first */
+static void
+dnsbl_evict(void)
+{
+	struct dnsbl_host	*h;
+
+	while (hosts.count >= cachemax && (h = TAILQ_LAST(&lru, dnsbl_lru))) {
+		TAILQ_REMOVE(&lru, h, entry);
+		tree_xpop(&hosts, h->addr);
+		h->cached = 0;
+		if (h->running == 0)
+			dnsbl_free(h);
+	}
+}
+
+static void
+dnsbl_free(struct dnsbl_host *h)
+{
+	struct dnsbl_waiter	*w;
+
+	while ((w = TAILQ_FIRST(&h->waiters))) {
+		TAILQ_REMOVE(&h->waiters, w, entry);
+		free(w);
+	}
+	free(h);
+}
+
 int
 main(int argc, char **argv)
 {
-	int	ch;
+	struct dnsbl_zone	*z;
+	const char		*errstr;
+	char			*weight;
+	int			 ch;
 
 	log_init(-1);
 
-	while ((ch = getopt(argc, argv, "h:")) != -1) {
+	while ((ch = getopt(argc, argv, "c:h:s:")) != -1) {
 		switch (ch) {
+		case 'c':
+			cachemax = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr) {
+				log_warnx("warn: filter-dnsbl: cache size is %s",
+				    errstr);
+				return (1);
+			}
+			break;
 		case 'h':
-			dnsbl_host = optarg;
+			z = reallocarray(zones, nzones + 1, sizeof *zones);
+			if (z == NULL)
+				fatal("filter-dnsbl: reallocarray");
+			zones = z;
+			z = &zones[nzones++];
+			z->weight = 1;
+			if ((weight = strchr(optarg, ':'))) {
+				*weight++ = '\0';
+				z->weight = strtonum(weight, 1, 1000, &errstr);
+				if (errstr) {
+					log_warnx("warn: filter-dnsbl: "
+					    "weight is %s: %s", errstr, weight);
+					return (1);
+				}
+			}
+			z->name = optarg;
+			break;
+		case 's':
+			threshold = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr) {
+				log_warnx("warn: filter-dnsbl: score is %s",
+				    errstr);
+				return (1);
+			}
 			break;
 		default:
 			log_warnx("warn: filter-dnsbl: bad option");
@@ -115,6 +376,15 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (nzones == 0) {
+		if ((zones = calloc(1, sizeof *zones)) == NULL)
+			fatal("filter-dnsbl: calloc");
+		zones[0].name = DNSBL_ZONE;
+		zones[0].weight = 1;
+		nzones = 1;
+	}
+	tree_init(&hosts);
+
 	log_debug("debug: filter-dnsbl: starting...");
 
 	filter_api_on_connect(dnsbl_on_connect);
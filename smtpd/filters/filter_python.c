@@ -36,6 +36,8 @@ static PyObject	*py_on_rcpt;
 static PyObject	*py_on_data;
 static PyObject	*py_on_eom;
 static PyObject	*py_on_dataline;
+static PyObject	*py_on_datachunk;
+static PyObject	*py_on_message;
 
 static PyObject	*py_on_commit;
 static PyObject	*py_on_rollback;
@@ -105,11 +107,25 @@ py_filter_writeln(PyObject *self, PyObject *args)
 	Py_RETURN_TRUE;
 }
 
+static PyObject *
+py_filter_write(PyObject *self, PyObject *args)
+{
+	uint64_t	id;
+	const char     *data;
+	int		len;
+
+	if (! PyArg_ParseTuple(args, "Ks#", &id, &data, &len))
+		return NULL;
+	filter_api_write(id, data, len);
+	Py_RETURN_TRUE;
+}
+
 static PyMethodDef py_methods[] = {
 	{ "accept", py_filter_accept, METH_VARARGS, "accept" },
 	{ "reject", py_filter_reject, METH_VARARGS, "reject" },
 	{ "reject_code", py_filter_reject_code, METH_VARARGS, "reject_code" },
 	{ "writeln", py_filter_writeln, METH_VARARGS, "writeln" },
+	{ "write", py_filter_write, METH_VARARGS, "write" },
 	{ NULL, NULL, 0, NULL }
 };
 
@@ -366,6 +382,58 @@ on_dataline(uint64_t id, const char *line)
 	}
 }
 
+/* a block of whole lines, one call instead of one per line */
+static void
+on_datachunk(uint64_t id, const char *data, size_t len)
+{
+	PyObject *py_args;
+	PyObject *py_ret;
+	PyObject *py_id;
+	PyObject *py_data;
+
+	py_args = PyTuple_New(2);
+	py_id   = PyLong_FromUnsignedLongLong(id);
+	py_data = PyString_FromStringAndSize(data, len);
+
+	PyTuple_SetItem(py_args, 0, py_id);
+	PyTuple_SetItem(py_args, 1, py_data);
+
+	py_ret = PyObject_CallObject(py_on_datachunk, py_args);
+	Py_DECREF(py_args);
+
+	if (py_ret == NULL) {
+		PyErr_Print();
+		log_warnx("warn: filter-python: call to on_datachunk handler failed");
+		exit(1);
+	}
+	Py_DECREF(py_ret);
+}
+
+/* the whole message at eom, the script owns the fd */
+static int
+on_message(uint64_t id, int fd, size_t len)
+{
+	PyObject *py_args;
+	PyObject *py_ret;
+
+	py_args = PyTuple_New(3);
+	PyTuple_SetItem(py_args, 0, PyLong_FromUnsignedLongLong(id));
+	PyTuple_SetItem(py_args, 1, PyInt_FromLong(fd));
+	PyTuple_SetItem(py_args, 2, PyLong_FromSize_t(len));
+
+	py_ret = PyObject_CallObject(py_on_message, py_args);
+	Py_DECREF(py_args);
+
+	if (py_ret == NULL) {
+		PyErr_Print();
+		log_warnx("warn: filter-python: call to on_message handler failed");
+		exit(1);
+	}
+	Py_DECREF(py_ret);
+
+	return 1;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -374,6 +442,7 @@ main(int argc, char **argv)
 	PyObject	*name;
 	PyObject	*self;
 	PyObject	*module;
+	PyObject	*attr;
 
 	log_init(-1);
 
@@ -441,10 +510,28 @@ main(int argc, char **argv)
 	if (py_on_rollback && PyCallable_Check(py_on_rollback))
 		filter_api_on_rollback(on_rollback);
 
+	/*
+	 * Scripts that do not need the data line by line get it in
+	 * blocks, or as a file at eom, at a fraction of the calls.
+	 */
+	py_on_message = PyObject_GetAttrString(module, "on_message");
+	py_on_datachunk = PyObject_GetAttrString(module, "on_datachunk");
 	py_on_dataline = PyObject_GetAttrString(module, "on_dataline");
-	if (py_on_dataline && PyCallable_Check(py_on_dataline))
+	PyErr_Clear();
+	if (py_on_message && PyCallable_Check(py_on_message))
+		filter_api_on_message(on_message);
+	else if (py_on_datachunk && PyCallable_Check(py_on_datachunk))
+		filter_api_on_datachunk(on_datachunk);
+	else if (py_on_dataline && PyCallable_Check(py_on_dataline))
 		filter_api_on_dataline(on_dataline);
 
+	/* the script only looks at the data, it goes out unchanged */
+	attr = PyObject_GetAttrString(module, "passthrough");
+	PyErr_Clear();
+	if (attr && PyObject_IsTrue(attr))
+		filter_api_data_passthrough();
+	Py_XDECREF(attr);
+
 	py_on_disconnect = PyObject_GetAttrString(module, "on_disconnect");
 	if (py_on_disconnect && PyCallable_Check(py_on_disconnect))
 		filter_api_on_disconnect(on_disconnect);
@@ -48,3 +48,16 @@ def on_dataline(id, line):
     filter.writeln(id, line)
     filter.writeln(id, line.upper())
 
+
+# Defining on_datachunk instead of on_dataline gets the data in blocks of
+# whole lines, to be written out with filter.write().  Defining on_message
+# gets a read-only fd on the whole message at eom instead.  Setting
+# passthrough = True forwards the data unchanged for scripts that only
+# look at it.
+#
+#def on_datachunk(id, data):
+#    filter.write(id, data)
+#
+#def on_message(id, fd, size):
+#    os.close(fd)
+#    return filter.accept(id)
@@ -31,13 +31,41 @@
 #include <openssl/ssl.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "iobuf.h"
 
 #define IOBUF_MAX	65536
+#define IOBUF_MIN	256
 #define IOBUFQ_MIN	4096
 
 struct ioqbuf	*ioqbuf_alloc(struct iobuf *, size_t);
+void		 ioqbuf_free(struct ioqbuf *);
 void		 iobuf_drain(struct iobuf *, size_t);
+void		 iobuf_grow(struct iobuf *);
+static const char *iobuf_findnl(const char *, size_t);
+
+/*
+ * Queue buffers come in a few fixed sizes, and each size keeps a free
+ * list of at most cap unused buffers.  Bigger requests use malloc.
+ */
+static struct ioqpool {
+	size_t		 size;
+	size_t		 cap;
+	struct ioqbuf	*free;
+	size_t		 nfree;
+	size_t		 inuse;
+} ioqbuf_pools[] = {
+	{ IOBUFQ_MIN,		256 },
+	{ IOBUFQ_MIN * 4,	64 },
+	{ IOBUFQ_MIN * 16,	16 },
+};
+
+#define IOBUFQ_NPOOL	(sizeof(ioqbuf_pools) / sizeof(ioqbuf_pools[0]))
 
 int
 iobuf_init(struct iobuf *io, size_t size, size_t max)
@@ -47,8 +75,9 @@ iobuf_init(struct iobuf *io, size_t size, size_t max)
 	if (max == 0)
 		max = IOBUF_MAX;
 
+	/* start small, the buffer grows up to max as needed */
 	if (size == 0)
-		size = max;
+		size = max < IOBUF_MIN ? max : IOBUF_MIN;
 
 	if (size > max)
 		return (-1);
@@ -72,7 +101,7 @@ iobuf_clear(struct iobuf *io)
 
 	while ((q = io->outq)) {
 		io->outq = q->next;
-		free(q);
+		ioqbuf_free(q);
 	}
 
 	memset(io, 0, sizeof (*io));
@@ -91,7 +120,7 @@ iobuf_drain(struct iobuf *io, size_t n)
 		} else {
 			left -= q->wpos - q->rpos;
 			io->outq = q->next;
-			free(q);
+			ioqbuf_free(q);
 		}
 	}
 
@@ -121,6 +150,21 @@ iobuf_extend(struct iobuf *io, size_t n)
 	return (0);
 }
 
+/*
+ * Double the buffer when it is full, up to its maximum size.
+ */
+void
+iobuf_grow(struct iobuf *io)
+{
+	if (iobuf_left(io) || io->size >= io->max)
+		return;
+
+	if (io->max - io->size < io->size)
+		iobuf_extend(io, io->max - io->size);
+	else
+		iobuf_extend(io, io->size);
+}
+
 size_t
 iobuf_left(struct iobuf *io)
 {
@@ -149,40 +193,73 @@ void
 iobuf_drop(struct iobuf *io, size_t n)
 {
 	if (n >= iobuf_len(io)) {
-		io->rpos = io->wpos = 0;
+		io->rpos = io->wpos = io->spos = 0;
 		return;
 	}
 
 	io->rpos += n;
 }
 
+/*
+ * Find the first newline, 16 bytes at a time where the cpu allows.
+ */
+static const char *
+iobuf_findnl(const char *p, size_t len)
+{
+#if defined(__SSE2__)
+	const __m128i	nl = _mm_set1_epi8('\n');
+	int		m;
+
+	for (; len >= 16; p += 16, len -= 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const __m128i *)p), nl));
+		if (m)
+			return (p + __builtin_ctz(m));
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t nl = vdupq_n_u8('\n');
+
+	for (; len >= 16; p += 16, len -= 16)
+		if (vmaxvq_u8(vceqq_u8(vld1q_u8((const uint8_t *)p), nl)))
+			break;
+#endif
+	return (memchr(p, '\n', len));
+}
+
 char *
 iobuf_getline(struct iobuf *iobuf, size_t *rlen)
 {
-	char	*buf;
-	size_t	 len, i;
+	const char	*nl;
+	char		*buf;
+	size_t		 len, i, skip;
 
 	buf = iobuf_data(iobuf);
 	len = iobuf_len(iobuf);
 
-	for (i = 0; i + 1 <= len; i++)
-		if (buf[i] == '\n') {
-			/* Note: the returned address points into the iobuf
-			 * buffer.  We NUL-end it for convenience, and discard
-			 * the data from the iobuf, so that the caller doesn't
-			 * have to do it.  The data remains "valid" as long
-			 * as the iobuf does not overwrite it, that is until
-			 * the next call to iobuf_normalize() or iobuf_extend().
-			 */
-			iobuf_drop(iobuf, i + 1);
-			len = (i && buf[i - 1] == '\r') ? i - 1 : i;
-			buf[len] = '\0';
-			if (rlen)
-				*rlen = len;
-			return (buf);
-		}
+	/* the bytes scanned by the last call hold no newline */
+	skip = 0;
+	if (iobuf->spos > iobuf->rpos && iobuf->spos <= iobuf->wpos)
+		skip = iobuf->spos - iobuf->rpos;
 
-	return (NULL);
+	if ((nl = iobuf_findnl(buf + skip, len - skip)) == NULL) {
+		iobuf->spos = iobuf->wpos;
+		return (NULL);
+	}
+	i = nl - buf;
+
+	/* Note: the returned address points into the iobuf
+	 * buffer.  We NUL-end it for convenience, and discard
+	 * the data from the iobuf, so that the caller doesn't
+	 * have to do it.  The data remains "valid" as long
+	 * as the iobuf does not overwrite it, that is until
+	 * the next call to iobuf_normalize() or iobuf_extend().
+	 */
+	iobuf_drop(iobuf, i + 1);
+	len = (i && buf[i - 1] == '\r') ? i - 1 : i;
+	buf[len] = '\0';
+	if (rlen)
+		*rlen = len;
+	return (buf);
 }
 
 void
@@ -192,12 +269,20 @@ iobuf_normalize(struct iobuf *io)
 		return;
 
 	if (io->rpos == io->wpos) {
-		io->rpos = io->wpos = 0;
+		io->rpos = io->wpos = io->spos = 0;
 		return;
 	}
 
+	/*
+	 * Leave the data in place while a quarter of the buffer is still
+	 * free at the end, lines are returned from where they were read.
+	 */
+	if (iobuf_left(io) >= io->size / 4)
+		return;
+
 	memmove(io->buf, io->buf + io->rpos, io->wpos - io->rpos);
 	io->wpos -= io->rpos;
+	io->spos = io->spos > io->rpos ? io->spos - io->rpos : 0;
 	io->rpos = 0;
 }
 
@@ -206,6 +291,8 @@ iobuf_read(struct iobuf *io, int fd)
 {
 	ssize_t	n;
 
+	iobuf_grow(io);
+
 	n = read(fd, io->buf + io->wpos, iobuf_left(io));
 	if (n == -1) {
 		/* XXX is this really what we want? */
@@ -225,12 +312,24 @@ struct ioqbuf *
 ioqbuf_alloc(struct iobuf *io, size_t len)
 {
 	struct ioqbuf   *q;
+	struct ioqpool	*p;
+	size_t		 i;
 
-	if (len < IOBUFQ_MIN)
-		len = IOBUFQ_MIN;
+	for (p = NULL, i = 0; i < IOBUFQ_NPOOL; i++)
+		if (len <= ioqbuf_pools[i].size) {
+			p = &ioqbuf_pools[i];
+			len = p->size;
+			break;
+		}
 
-	if ((q = malloc(sizeof(*q) + len)) == NULL)
+	if (p && (q = p->free)) {
+		p->free = q->next;
+		p->nfree--;
+	}
+	else if ((q = malloc(sizeof(*q) + len)) == NULL)
 		return (NULL);
+	if (p)
+		p->inuse++;
 
 	q->rpos = 0;
 	q->wpos = 0;
@@ -247,6 +346,47 @@ ioqbuf_alloc(struct iobuf *io, size_t len)
 	return (q);
 }
 
+void
+ioqbuf_free(struct ioqbuf *q)
+{
+	struct ioqpool	*p;
+	size_t		 i;
+
+	for (p = NULL, i = 0; i < IOBUFQ_NPOOL; i++)
+		if (q->size == ioqbuf_pools[i].size) {
+			p = &ioqbuf_pools[i];
+			break;
+		}
+
+	if (p)
+		p->inuse--;
+	if (p == NULL || p->nfree >= p->cap) {
+		free(q);
+		return;
+	}
+
+	q->next = p->free;
+	p->free = q;
+	p->nfree++;
+}
+
+/*
+ * Report the buffer size, free and used counts of the i-th pool.
+ * Return 0 past the last pool.
+ */
+int
+iobuf_pool_stat(size_t i, size_t *size, size_t *nfree, size_t *inuse)
+{
+	if (i >= IOBUFQ_NPOOL)
+		return (0);
+
+	*size = ioqbuf_pools[i].size;
+	*nfree = ioqbuf_pools[i].nfree;
+	*inuse = ioqbuf_pools[i].inuse;
+
+	return (1);
+}
+
 size_t
 iobuf_queued(struct iobuf *io)
 {
@@ -439,6 +579,8 @@ iobuf_read_ssl(struct iobuf *io, void *ssl)
 	ssize_t	n;
 	int	r;
 
+	iobuf_grow(io);
+
 	n = SSL_read(ssl, io->buf + io->wpos, iobuf_left(io));
 	if (n < 0) {
 		switch ((r = SSL_get_error(ssl, n))) {
@@ -33,6 +33,7 @@ struct iobuf {
 	size_t		 size;
 	size_t		 wpos;
 	size_t		 rpos;
+	size_t		 spos;	/* no newline in [rpos, spos) */
 
 	size_t		 queued;
 	struct ioqbuf	*outq;
@@ -69,3 +70,5 @@ int	iobuf_flush(struct iobuf *, int);
 int	iobuf_flush_ssl(struct iobuf *, void *);
 ssize_t	iobuf_write(struct iobuf *, int);
 ssize_t	iobuf_write_ssl(struct iobuf *, void *);
+
+int	iobuf_pool_stat(size_t, size_t *, size_t *, size_t *);
@@ -18,6 +18,16 @@
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef IO_NATIVE
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+#endif
 
 #include <err.h>
 #include <errno.h>
@@ -26,6 +36,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ioev.h"
@@ -34,6 +45,9 @@
 #ifdef IO_SSL
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define IO_KTLS
+#endif
 #endif
 
 enum {
@@ -57,27 +71,89 @@ void	io_dispatch(int, short, void *);
 void	io_dispatch_connect(int, short, void *);
 size_t	io_pending(struct io *);
 size_t	io_queued(struct io*);
+static ssize_t	io_write_source(struct io *);
 void	io_reset(struct io *, short, void (*)(int, short, void*));
 void	io_frame_enter(const char *, struct io *, int);
 void	io_frame_leave(struct io *);
+static time_t	io_timer_now(void);
+static void	io_timer_set(struct io *);
+static void	io_timer_del(struct io *);
+static void	io_timer_tick(int, short, void *);
+static void	io_event_del(struct io *);
+static void	io_blocked(struct io *, short);
+
+#ifdef IO_NATIVE
+static void	io_engine_init(void);
+static void	io_engine_add(struct io *, short);
+static void	io_engine_queue(struct io *);
+static void	io_engine_poll(int, short, void *);
+static void	io_engine_run(int, short, void *);
+#endif
 
 #ifdef IO_SSL
 void	ssl_error(const char *); /* XXX external */
+int	ca_async_attach(void (*)(void *), void *); /* XXX external */
+int	ca_async_detach(void *); /* XXX external */
 
 static const char* io_ssl_error(void);
 void	io_dispatch_accept_ssl(int, short, void *);
 void	io_dispatch_connect_ssl(int, short, void *);
+static void	io_resume_ssl(void *);
 void	io_dispatch_read_ssl(int, short, void *);
 void	io_dispatch_write_ssl(int, short, void *);
 void	io_reload_ssl(struct io *io);
+static void	io_ktls_check(struct io *);
+static ssize_t	io_write_source_ssl(struct io *);
 #endif
 
 static struct io	*current = NULL;
 static uint64_t		 frame = 0;
 static int		_io_debug = 0;
 
+/* counters of all ios of the process, and of each io */
+static struct io_stats	 io_stats;
+static int		 io_profile = 0;
+
+#define IO_STAT(io, f, n) do {			\
+		(io)->stats.f += (n);		\
+		io_stats.f += (n);		\
+	} while (0)
+
 #define io_debug(args...) do { if (_io_debug) printf(args); } while(0)
 
+/*
+ * Timeouts of all ios share a wheel of one second slots, ticked by a
+ * single event.  Activity on an io only moves its deadline forward,
+ * it is put in the right slot when its current one comes up.
+ */
+#define	IO_TIMER_SLOTS	64
+
+#define	IO_SOURCE_CHUNK	65536
+
+TAILQ_HEAD(io_timerq, io);
+
+static struct io_timerq	 io_timers[IO_TIMER_SLOTS];
+static struct event	 io_timer_ev;
+static size_t		 io_timer_count;
+static time_t		 io_timer_last;
+
+#ifdef IO_NATIVE
+/*
+ * Native engine: each socket is registered once, edge-triggered, for
+ * both directions.  The kernel only reports readiness changes, which
+ * are kept in the io until a read or write would block.  Ios that want
+ * what they are ready for are dispatched from a run queue, libevent
+ * only watches the engine descriptor.
+ */
+#define	IO_ENGINE_EVENTS	256
+
+static int		 io_engine_fd = -1;
+static struct event	 io_engine_ev;
+static struct event	 io_engine_runev;
+static TAILQ_HEAD(, io)	 io_engine_runq;
+static size_t		 io_engine_runlen;
+#endif
+
 
 const char*
 io_strio(struct io *io)
@@ -101,9 +177,11 @@ io_strio(struct io *io)
 		    io, io->sock, io->timeout, io_strflags(io->flags), ssl);
 	else
 		snprintf(buf, sizeof buf,
-		    "<io:%p fd=%d to=%d fl=%s%s ib=%zu ob=%zu>",
+		    "<io:%p fd=%d to=%d fl=%s%s ib=%zu ob=%zu"
+		    " in=%" PRIu64 " out=%" PRIu64 ">",
 		    io, io->sock, io->timeout, io_strflags(io->flags), ssl,
-		    io_pending(io), io_queued(io));
+		    io_pending(io), io_queued(io),
+		    io->stats.bytes_in, io->stats.bytes_out);
 
 	return (buf);
 }
@@ -221,12 +299,16 @@ void
 _io_init()
 {
 	static int init = 0;
+	int	   i;
 
 	if (init)
 		return;
 
 	init = 1;
 	_io_debug = getenv("IO_DEBUG") != NULL;
+
+	for (i = 0; i < IO_TIMER_SLOTS; i++)
+		TAILQ_INIT(&io_timers[i]);
 }
 
 void
@@ -239,6 +321,8 @@ io_init(struct io *io, int sock, void *arg,
 
 	io->sock = sock;
 	io->timeout = -1;
+	io->n_fd = -1;
+	io->src = -1;
 	io->arg = arg;
 	io->iobuf = iobuf;
 	io->cb = cb;
@@ -258,17 +342,27 @@ io_clear(struct io *io)
 
 #ifdef IO_SSL
 	if (io->ssl) {
+		/* let a handshake waiting for the ca fail before freeing */
+		if (ca_async_detach(io))
+			(void)SSL_do_handshake(io->ssl);
 		SSL_free(io->ssl);
 		io->ssl = NULL;
 	}
 #endif
 
-	if (event_initialized(&io->ev))
-		event_del(&io->ev);
+	io_event_del(io);
+	io_timer_del(io);
+	/* a calloc'd io never initialized has src 0, not to be closed */
+	if (io->flags & IO_SOURCE) {
+		close(io->src);
+		io->src = -1;
+		io->flags &= ~IO_SOURCE;
+	}
 	if (io->sock != -1) {
 		close(io->sock);
 		io->sock = -1;
 	}
+	io->n_fd = -1;
 }
 
 void
@@ -310,6 +404,26 @@ io_set_lowat(struct io *io, size_t lowat)
 	io->lowat = lowat;
 }
 
+/*
+ * Once the output queue is empty, send the file from the given offset
+ * to its end, then report IO_LOWAT.  The io owns the descriptor.
+ */
+void
+io_set_source(struct io *io, int fd, off_t off)
+{
+	io_debug("io_set_source(%p, %d, %lld)\n", io, fd, (long long)off);
+
+	if (io->flags & IO_SOURCE)
+		close(io->src);
+	io->src = fd;
+	io->srcoff = off;
+	if (fd != -1)
+		io->flags |= IO_SOURCE;
+	else
+		io->flags &= ~IO_SOURCE;
+	io_reload(io);
+}
+
 void
 io_pause(struct io *io, int dir)
 {
@@ -388,7 +502,8 @@ io_reload(struct io *io)
 	events = 0;
 	if (IO_READING(io) && !(io->flags & IO_PAUSE_IN))
 		events = EV_READ;
-	if (IO_WRITING(io) && !(io->flags & IO_PAUSE_OUT) && io_queued(io))
+	if (IO_WRITING(io) && !(io->flags & IO_PAUSE_OUT) &&
+	    (io_queued(io) || io->src != -1))
 		events |= EV_WRITE;
 
 	io_reset(io, events, io_dispatch);
@@ -398,7 +513,6 @@ io_reload(struct io *io)
 void
 io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 {
-	struct timeval	tv, *ptv;
 
 	io_debug("io_reset(%p, %s, %p) -> %s\n",
 	    io, io_evstr(events), dispatch, io_strio(io));
@@ -409,27 +523,311 @@ io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 	 */
 	io->flags |= IO_RESET;
 
-	if (event_initialized(&io->ev))
-		event_del(&io->ev);
-
 	/*
 	 * The io is paused by the user, so we don't want the timeout to be
 	 * effective.
 	 */
-	if (events == 0)
+	if (events == 0) {
+		io_event_del(io);
+		io_timer_del(io);
+		return;
+	}
+
+#ifdef IO_NATIVE
+	io->t_dispatch = dispatch;
+	io_engine_add(io, events);
+#else
+	/* leave the event alone if it is already waiting for that */
+	if (!event_initialized(&io->ev) ||
+	    io->t_dispatch != dispatch ||
+	    EVENT_FD(&io->ev) != io->sock ||
+	    event_pending(&io->ev, EV_READ|EV_WRITE, NULL) != events) {
+		if (event_initialized(&io->ev))
+			event_del(&io->ev);
+		event_set(&io->ev, io->sock, events, dispatch, io);
+		event_add(&io->ev, NULL);
+	}
+	io->t_dispatch = dispatch;
+#endif
+
+	if (io->timeout >= 0)
+		io_timer_set(io);
+	else
+		io_timer_del(io);
+}
+
+static time_t
+io_timer_now(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (ts.tv_sec);
+}
+
+static void
+io_timer_set(struct io *io)
+{
+	struct timeval	tv;
+	time_t		now, expire;
+
+	now = io_timer_now();
+	expire = now + (io->timeout + 999) / 1000;
+
+	/* a later deadline is fixed up when the slot comes up */
+	if (io->t_queue && expire >= io->t_expire) {
+		io->t_expire = expire;
+		return;
+	}
+	io_timer_del(io);
+
+	if (io_timer_count++ == 0) {
+		io_timer_last = now;
+		evtimer_set(&io_timer_ev, io_timer_tick, NULL);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		evtimer_add(&io_timer_ev, &tv);
+	}
+
+	io->t_expire = expire;
+	io->t_queue = &io_timers[expire % IO_TIMER_SLOTS];
+	TAILQ_INSERT_TAIL(io->t_queue, io, t_entry);
+}
+
+static void
+io_timer_del(struct io *io)
+{
+	if (io->t_queue == NULL)
+		return;
+
+	TAILQ_REMOVE(io->t_queue, io, t_entry);
+	io->t_queue = NULL;
+	if (--io_timer_count == 0)
+		evtimer_del(&io_timer_ev);
+}
+
+static void
+io_timer_tick(int fd, short ev, void *arg)
+{
+	struct io_timerq	 expired, *slot;
+	struct io		*io, *next;
+	struct timeval		 tv;
+	time_t			 now, t;
+
+	now = io_timer_now();
+	TAILQ_INIT(&expired);
+
+	for (t = io_timer_last + 1;
+	    t <= now && t <= io_timer_last + IO_TIMER_SLOTS; t++) {
+		slot = &io_timers[t % IO_TIMER_SLOTS];
+		for (io = TAILQ_FIRST(slot); io; io = next) {
+			next = TAILQ_NEXT(io, t_entry);
+			if (io->t_expire <= now) {
+				TAILQ_REMOVE(slot, io, t_entry);
+				io->t_queue = &expired;
+				TAILQ_INSERT_TAIL(&expired, io, t_entry);
+			}
+			else if (&io_timers[io->t_expire % IO_TIMER_SLOTS] != slot) {
+				TAILQ_REMOVE(slot, io, t_entry);
+				io->t_queue = &io_timers[io->t_expire %
+				    IO_TIMER_SLOTS];
+				TAILQ_INSERT_TAIL(io->t_queue, io, t_entry);
+			}
+		}
+	}
+	io_timer_last = now;
+
+	/* callbacks may clear other expired ios */
+	while ((io = TAILQ_FIRST(&expired))) {
+		io_timer_del(io);
+		io_event_del(io);
+		io->t_dispatch(io->sock, EV_TIMEOUT, io);
+	}
+
+	if (io_timer_count) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		evtimer_add(&io_timer_ev, &tv);
+	}
+}
+
+/* Stop waiting for events on the io. */
+static void
+io_event_del(struct io *io)
+{
+#ifdef IO_NATIVE
+	io->n_want = 0;
+	if (io->n_queued) {
+		TAILQ_REMOVE(&io_engine_runq, io, n_entry);
+		io->n_queued = 0;
+		io_engine_runlen--;
+	}
+#else
+	if (event_initialized(&io->ev))
+		event_del(&io->ev);
+#endif
+}
+
+/* The last read or write on the io would have blocked. */
+static void
+io_blocked(struct io *io, short events)
+{
+	if (io->ssl)
+		IO_STAT(io, tls_retry, 1);
+	else
+		IO_STAT(io, eagain, 1);
+#ifdef IO_NATIVE
+	io->n_ready &= ~events;
+#endif
+}
+
+#ifdef IO_NATIVE
+
+static void
+io_engine_init(void)
+{
+#ifdef __linux__
+	if ((io_engine_fd = epoll_create(IO_ENGINE_EVENTS)) == -1)
+		err(1, "epoll_create");
+#else
+	if ((io_engine_fd = kqueue()) == -1)
+		err(1, "kqueue");
+#endif
+	TAILQ_INIT(&io_engine_runq);
+	event_set(&io_engine_ev, io_engine_fd, EV_READ|EV_PERSIST,
+	    io_engine_poll, NULL);
+	event_add(&io_engine_ev, NULL);
+	evtimer_set(&io_engine_runev, io_engine_run, NULL);
+}
+
+static void
+io_engine_add(struct io *io, short events)
+{
+#ifdef __linux__
+	struct epoll_event	ee;
+#else
+	struct kevent		kev[2];
+#endif
+
+	if (io_engine_fd == -1)
+		io_engine_init();
+
+	/* first time this socket is seen */
+	if (io->n_fd != io->sock) {
+#ifdef __linux__
+		memset(&ee, 0, sizeof ee);
+		ee.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ee.data.ptr = io;
+		if (epoll_ctl(io_engine_fd, EPOLL_CTL_ADD, io->sock, &ee) == -1)
+			err(1, "io_engine_add: epoll_ctl");
+#else
+		EV_SET(&kev[0], io->sock, EVFILT_READ, EV_ADD | EV_CLEAR,
+		    0, 0, io);
+		EV_SET(&kev[1], io->sock, EVFILT_WRITE, EV_ADD | EV_CLEAR,
+		    0, 0, io);
+		if (kevent(io_engine_fd, kev, 2, NULL, 0, NULL) == -1)
+			err(1, "io_engine_add: kevent");
+#endif
+		io->n_fd = io->sock;
+		io->n_ready = 0;
+	}
+
+	io->n_want = events;
+	io_engine_queue(io);
+}
+
+static void
+io_engine_queue(struct io *io)
+{
+	if (io->n_queued || !(io->n_want & io->n_ready))
 		return;
 
-	event_set(&io->ev, io->sock, events, dispatch, io);
-	if (io->timeout >= 0) {
-		tv.tv_sec = io->timeout / 1000;
-		tv.tv_usec = (io->timeout % 1000) * 1000;
-		ptv = &tv;
-	} else
-		ptv = NULL;
+	TAILQ_INSERT_TAIL(&io_engine_runq, io, n_entry);
+	io->n_queued = 1;
+	if (io_engine_runlen++ == 0)
+		event_active(&io_engine_runev, EV_TIMEOUT, 1);
+}
+
+static void
+io_engine_poll(int fd, short event, void *arg)
+{
+#ifdef __linux__
+	struct epoll_event	ee[IO_ENGINE_EVENTS];
+#else
+	struct kevent		kev[IO_ENGINE_EVENTS];
+	struct timespec		ts;
+#endif
+	struct io		*io;
+	int			 i, n;
+
+#ifdef __linux__
+	if ((n = epoll_wait(io_engine_fd, ee, IO_ENGINE_EVENTS, 0)) == -1) {
+		if (errno == EINTR)
+			return;
+		err(1, "io_engine_poll: epoll_wait");
+	}
+	for (i = 0; i < n; i++) {
+		io = ee[i].data.ptr;
+		if (ee[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			io->n_ready |= EV_READ;
+		if (ee[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			io->n_ready |= EV_WRITE;
+		io_engine_queue(io);
+	}
+#else
+	ts.tv_sec = 0;
+	ts.tv_nsec = 0;
+	if ((n = kevent(io_engine_fd, NULL, 0, kev, IO_ENGINE_EVENTS, &ts)) == -1) {
+		if (errno == EINTR)
+			return;
+		err(1, "io_engine_poll: kevent");
+	}
+	for (i = 0; i < n; i++) {
+		io = kev[i].udata;
+		if (kev[i].filter == EVFILT_READ)
+			io->n_ready |= EV_READ;
+		else if (kev[i].filter == EVFILT_WRITE)
+			io->n_ready |= EV_WRITE;
+		io_engine_queue(io);
+	}
+#endif
+
+	io_engine_run(-1, 0, NULL);
+}
+
+/*
+ * Dispatch the ios queued so far.  As with libevent, the interest is
+ * dropped before the dispatch and set again when the io is reloaded,
+ * which queues it for the next run if it is still ready.
+ */
+static void
+io_engine_run(int fd, short event, void *arg)
+{
+	struct io	*io;
+	size_t		 n;
+	short		 events;
+
+	for (n = io_engine_runlen; n; n--) {
+		if ((io = TAILQ_FIRST(&io_engine_runq)) == NULL)
+			break;
+		TAILQ_REMOVE(&io_engine_runq, io, n_entry);
+		io->n_queued = 0;
+		io_engine_runlen--;
+
+		events = io->n_want & io->n_ready;
+		if (events == 0)
+			continue;
+		io->n_want = 0;
+		io->t_dispatch(io->sock, events, io);
+	}
 
-	event_add(&io->ev, ptv);
+	if (io_engine_runlen)
+		event_active(&io_engine_runev, EV_TIMEOUT, 1);
 }
 
+#endif /* IO_NATIVE */
+
 size_t
 io_pending(struct io *io)
 {
@@ -544,9 +942,12 @@ io_dispatch(int fd, short ev, void *humppa)
 	}
 
 	if (ev & EV_WRITE && (w = io_queued(io))) {
+		IO_STAT(io, writes, 1);
 		if ((n = iobuf_write(io->iobuf, io->sock)) < 0) {
-			if (n == IOBUF_WANT_WRITE) /* kqueue bug? */
+			if (n == IOBUF_WANT_WRITE) { /* kqueue bug? */
+				io_blocked(io, EV_WRITE);
 				goto read;
+			}
 			if (n == IOBUF_CLOSED)
 				io_callback(io, IO_DISCONNECTED);
 			else {
@@ -557,13 +958,40 @@ io_dispatch(int fd, short ev, void *humppa)
 			}
 			goto leave;
 		}
-		if (w > io->lowat && w - n <= io->lowat)
+		IO_STAT(io, bytes_out, n);
+		if (io->src == -1 && w > io->lowat && w - n <= io->lowat)
 			io_callback(io, IO_LOWAT);
 	}
+	else if (ev & EV_WRITE && io->src != -1) {
+		IO_STAT(io, writes, 1);
+		if ((n = io_write_source(io)) < 0) {
+			if (n == IOBUF_WANT_WRITE) {
+				io_blocked(io, EV_WRITE);
+				goto read;
+			}
+			saved_errno = errno;
+			io->error = strerror(errno);
+			errno = saved_errno;
+			io_callback(io, IO_ERROR);
+			goto leave;
+		}
+		IO_STAT(io, bytes_out, n);
+		if (n == 0) {
+			close(io->src);
+			io->src = -1;
+			io->flags &= ~IO_SOURCE;
+			io_callback(io, IO_LOWAT);
+		}
+	}
     read:
 
 	if (ev & EV_READ) {
+		IO_STAT(io, reads, 1);
 		if ((n = iobuf_read(io->iobuf, io->sock)) < 0) {
+			if (n == IOBUF_WANT_READ) {
+				io_blocked(io, EV_READ);
+				goto leave;
+			}
 			if (n == IOBUF_CLOSED)
 				io_callback(io, IO_DISCONNECTED);
 			else {
@@ -574,6 +1002,7 @@ io_dispatch(int fd, short ev, void *humppa)
 			}
 			goto leave;
 		}
+		IO_STAT(io, bytes_in, n);
 		if (n)
 			io_callback(io, IO_DATAIN);
 	}
@@ -582,10 +1011,74 @@ leave:
 	io_frame_leave(io);
 }
 
+/*
+ * Send the next part of the source file.  The kernel moves the data
+ * itself where it can, otherwise a block is read and written, and what
+ * the socket does not take goes to the output queue.
+ */
+static ssize_t
+io_write_source(struct io *io)
+{
+	static char	 buf[IO_SOURCE_CHUNK];
+	ssize_t		 n, w;
+
+#ifdef __linux__
+	if ((n = sendfile(io->sock, io->src, &io->srcoff,
+	    IO_SOURCE_CHUNK)) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (IOBUF_WANT_WRITE);
+		if (errno != EINVAL && errno != ENOSYS)
+			return (IOBUF_ERROR);
+		/* not supported between these two, copy */
+	}
+	else
+		return (n);
+#endif
+
+	if ((n = pread(io->src, buf, sizeof buf, io->srcoff)) <= 0)
+		return (n == 0 ? 0 : IOBUF_ERROR);
+	if ((w = write(io->sock, buf, n)) == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			return (IOBUF_ERROR);
+		w = 0;
+	}
+	if (w < n && iobuf_queue(io->iobuf, buf + w, n - w) == -1)
+		return (IOBUF_ERROR);
+	io->srcoff += n;
+
+	return (n);
+}
+
 void
 io_callback(struct io *io, int evt)
 {
+	struct timespec	t0, t1;
+
+	IO_STAT(io, callbacks, 1);
+	if (!io_profile) {
+		io->cb(io, evt);
+		return;
+	}
+
+	/* the io may be gone on return, only the process total is kept */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 	io->cb(io, evt);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	io_stats.cb_usec += (t1.tv_sec - t0.tv_sec) * 1000000 +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000;
+}
+
+const struct io_stats *
+io_stats_get(void)
+{
+	return (&io_stats);
+}
+
+/* Measure the time spent in callbacks. */
+void
+io_set_profile(int on)
+{
+	io_profile = on;
 }
 
 int
@@ -607,6 +1100,7 @@ io_connect(struct io *io, const struct sockaddr *sa, const struct sockaddr *bsa)
 			goto fail;
 
 	io->sock = sock;
+	io->n_fd = -1;
 	io_reset(io, EV_WRITE, io_dispatch_connect);
 
 	return (sock);
@@ -691,6 +1185,11 @@ io_start_tls(struct io *io, void *ssl)
 		return (-1);
 	}
 
+#ifdef IO_KTLS
+	/* OpenSSL falls back to userland if the kernel can't do the cipher */
+	SSL_set_options(io->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
 	if (mode == IO_WRITE) {
 		io->state = IO_STATE_CONNECT_SSL;
 		SSL_set_connect_state(io->ssl);
@@ -719,17 +1218,29 @@ io_dispatch_accept_ssl(int fd, short event, void *humppa)
 
 	if ((ret = SSL_accept(io->ssl)) > 0) {
 		io->state = IO_STATE_UP;
+		io_ktls_check(io);
 		io_callback(io, IO_TLSREADY);
 		goto leave;
 	}
 
 	switch ((e = SSL_get_error(io->ssl, ret))) {
 	case SSL_ERROR_WANT_READ:
+		io_blocked(io, EV_READ);
 		io_reset(io, EV_READ, io_dispatch_accept_ssl);
 		break;
 	case SSL_ERROR_WANT_WRITE:
+		io_blocked(io, EV_WRITE);
 		io_reset(io, EV_WRITE, io_dispatch_accept_ssl);
 		break;
+#ifdef SSL_ERROR_WANT_ASYNC
+	case SSL_ERROR_WANT_ASYNC:
+		/* waiting for the ca, resumed by io_resume_ssl() */
+		if (ca_async_attach(io_resume_ssl, io) == 0) {
+			io_reset(io, 0, NULL);
+			break;
+		}
+		/* FALLTHROUGH */
+#endif
 	default:
 		io->error = io_ssl_error();
 		ssl_error("io_dispatch_accept_ssl:SSL_accept");
@@ -756,17 +1267,29 @@ io_dispatch_connect_ssl(int fd, short event, void *humppa)
 
 	if ((ret = SSL_connect(io->ssl)) > 0) {
 		io->state = IO_STATE_UP;
+		io_ktls_check(io);
 		io_callback(io, IO_TLSREADY);
 		goto leave;
 	}
 
 	switch ((e = SSL_get_error(io->ssl, ret))) {
 	case SSL_ERROR_WANT_READ:
+		io_blocked(io, EV_READ);
 		io_reset(io, EV_READ, io_dispatch_connect_ssl);
 		break;
 	case SSL_ERROR_WANT_WRITE:
+		io_blocked(io, EV_WRITE);
 		io_reset(io, EV_WRITE, io_dispatch_connect_ssl);
 		break;
+#ifdef SSL_ERROR_WANT_ASYNC
+	case SSL_ERROR_WANT_ASYNC:
+		/* waiting for the ca, resumed by io_resume_ssl() */
+		if (ca_async_attach(io_resume_ssl, io) == 0) {
+			io_reset(io, 0, NULL);
+			break;
+		}
+		/* FALLTHROUGH */
+#endif
 	default:
 		io->error = io_ssl_error();
 		ssl_error("io_dispatch_connect_ssl:SSL_connect");
@@ -778,6 +1301,20 @@ io_dispatch_connect_ssl(int fd, short event, void *humppa)
 	io_frame_leave(io);
 }
 
+/*
+ * The ca replied to the request a paused handshake waits for.
+ */
+static void
+io_resume_ssl(void *arg)
+{
+	struct io	*io = arg;
+
+	if (io->state == IO_STATE_CONNECT_SSL)
+		io_dispatch_connect_ssl(io->sock, EV_WRITE, io);
+	else
+		io_dispatch_accept_ssl(io->sock, EV_READ, io);
+}
+
 void
 io_dispatch_read_ssl(int fd, short event, void *humppa)
 {
@@ -792,11 +1329,14 @@ io_dispatch_read_ssl(int fd, short event, void *humppa)
 	}
 
 again:
+	IO_STAT(io, reads, 1);
 	switch ((n = iobuf_read_ssl(io->iobuf, (SSL*)io->ssl))) {
 	case IOBUF_WANT_READ:
+		io_blocked(io, EV_READ);
 		io_reset(io, EV_READ, io_dispatch_read_ssl);
 		break;
 	case IOBUF_WANT_WRITE:
+		io_blocked(io, EV_WRITE);
 		io_reset(io, EV_WRITE, io_dispatch_read_ssl);
 		break;
 	case IOBUF_CLOSED:
@@ -815,6 +1355,7 @@ again:
 		break;
 	default:
 		io_debug("io_dispatch_read_ssl(...) -> r=%d\n", n);
+		IO_STAT(io, bytes_in, n);
 		io_callback(io, IO_DATAIN);
 		if (current == io && IO_READING(io) && SSL_pending(io->ssl))
 			goto again;
@@ -839,11 +1380,27 @@ io_dispatch_write_ssl(int fd, short event, void *humppa)
 	}
 
 	w = io_queued(io);
-	switch ((n = iobuf_write_ssl(io->iobuf, (SSL*)io->ssl))) {
+	IO_STAT(io, writes, 1);
+	if (w == 0 && io->src != -1) {
+		n = io_write_source_ssl(io);
+		if (n == 0) {
+			close(io->src);
+			io->src = -1;
+			io->flags &= ~IO_SOURCE;
+			io_callback(io, IO_LOWAT);
+			goto leave;
+		}
+	}
+	else
+		n = iobuf_write_ssl(io->iobuf, (SSL*)io->ssl);
+
+	switch (n) {
 	case IOBUF_WANT_READ:
+		io_blocked(io, EV_READ);
 		io_reset(io, EV_READ, io_dispatch_write_ssl);
 		break;
 	case IOBUF_WANT_WRITE:
+		io_blocked(io, EV_WRITE);
 		io_reset(io, EV_WRITE, io_dispatch_write_ssl);
 		break;
 	case IOBUF_CLOSED:
@@ -862,6 +1419,7 @@ io_dispatch_write_ssl(int fd, short event, void *humppa)
 		break;
 	default:
 		io_debug("io_dispatch_write_ssl(...) -> w=%d\n", n);
+		IO_STAT(io, bytes_out, n);
 		w2 = io_queued(io);
 		if (w > io->lowat && w2 <= io->lowat)
 			io_callback(io, IO_LOWAT);
@@ -893,7 +1451,8 @@ io_reload_ssl(struct io *io)
 			ev = EV_READ;
 			dispatch = io_dispatch_read_ssl;
 		}
-		else if (IO_WRITING(io) && !(io->flags & IO_PAUSE_OUT) && io_queued(io)) {
+		else if (IO_WRITING(io) && !(io->flags & IO_PAUSE_OUT) &&
+		    (io_queued(io) || io->src != -1)) {
 			ev = EV_WRITE;
 			dispatch = io_dispatch_write_ssl;
 		}
@@ -907,4 +1466,61 @@ io_reload_ssl(struct io *io)
 	io_reset(io, ev, dispatch);
 }
 
+/*
+ * See whether OpenSSL handed the record layer of the session to the
+ * kernel once the handshake is done.
+ */
+static void
+io_ktls_check(struct io *io)
+{
+#ifdef IO_KTLS
+	if (BIO_get_ktls_send(SSL_get_wbio(io->ssl))) {
+		io->flags |= IO_KTLS_OUT;
+		IO_STAT(io, ktls_out, 1);
+	}
+	if (BIO_get_ktls_recv(SSL_get_rbio(io->ssl))) {
+		io->flags |= IO_KTLS_IN;
+		IO_STAT(io, ktls_in, 1);
+	}
+#endif
+}
+
+/*
+ * Send the next part of the source file on a TLS session.  The kernel
+ * encrypts the file pages itself when it has the session, otherwise a
+ * block is read into the output queue for SSL_write().
+ */
+static ssize_t
+io_write_source_ssl(struct io *io)
+{
+	static char	 buf[IO_SOURCE_CHUNK];
+	ssize_t		 n;
+
+#ifdef IO_KTLS
+	if (io->flags & IO_KTLS_OUT) {
+		if ((n = SSL_sendfile(io->ssl, io->src, io->srcoff,
+		    IO_SOURCE_CHUNK, 0)) < 0) {
+			switch (SSL_get_error(io->ssl, n)) {
+			case SSL_ERROR_WANT_WRITE:
+				return (IOBUF_WANT_WRITE);
+			case SSL_ERROR_SYSCALL:
+				return (IOBUF_ERROR);
+			default:
+				return (IOBUF_SSLERROR);
+			}
+		}
+		io->srcoff += n;
+		return (n);
+	}
+#endif
+
+	if ((n = pread(io->src, buf, sizeof buf, io->srcoff)) <= 0)
+		return (n == 0 ? 0 : IOBUF_ERROR);
+	if (iobuf_queue(io->iobuf, buf, n) == -1)
+		return (IOBUF_ERROR);
+	io->srcoff += n;
+
+	return (iobuf_write_ssl(io->iobuf, (SSL*)io->ssl));
+}
+
 #endif /* IO_SSL */
@@ -35,8 +35,24 @@ enum {
 #define IO_PAUSE_OUT		0x08
 #define IO_RESET		0x10  /* internal */
 #define IO_HELD			0x20  /* internal */
+#define IO_KTLS_IN		0x40  /* internal */
+#define IO_KTLS_OUT		0x80  /* internal */
+#define IO_SOURCE		0x100 /* internal, src is ours to close */
 
 struct iobuf;
+
+struct io_stats {
+	uint64_t	 bytes_in;
+	uint64_t	 bytes_out;
+	uint64_t	 reads;
+	uint64_t	 writes;
+	uint64_t	 eagain;	/* read or write would block */
+	uint64_t	 tls_retry;	/* TLS wants to read or write again */
+	uint64_t	 ktls_in;	/* TLS sessions received by the kernel */
+	uint64_t	 ktls_out;	/* TLS sessions sent by the kernel */
+	uint64_t	 callbacks;
+	uint64_t	 cb_usec;	/* time in callbacks, when profiling */
+};
 struct io {
 	int		 sock;
 	void		*arg;
@@ -49,6 +65,22 @@ struct io {
 	struct event	 ev;
 	void		*ssl;
 	const char	*error; /* only valid immediatly on callback */
+	int		 src;	/* file sent once the queue is empty */
+	off_t		 srcoff;
+	struct io_stats	 stats;
+
+	/* shared timer wheel, internal */
+	TAILQ_ENTRY(io)	 t_entry;
+	struct io_timerq *t_queue;
+	time_t		 t_expire;
+	void		(*t_dispatch)(int, short, void *);
+
+	/* native engine, internal */
+	TAILQ_ENTRY(io)	 n_entry;
+	int		 n_fd;		/* registered socket */
+	int		 n_queued;
+	short		 n_want;
+	short		 n_ready;
 };
 
 void io_set_blocking(int, int);
@@ -60,10 +92,13 @@ void io_set_read(struct io *);
 void io_set_write(struct io *);
 void io_set_timeout(struct io *, int);
 void io_set_lowat(struct io *, size_t);
+void io_set_source(struct io *, int, off_t);
 void io_pause(struct io *, int);
 void io_resume(struct io *, int);
 void io_reload(struct io *);
 int io_connect(struct io *, const struct sockaddr *, const struct sockaddr *);
 int io_start_tls(struct io *, void *);
 const char* io_strio(struct io *);
+const struct io_stats *io_stats_get(void);
+void io_set_profile(int);
 const char* io_strevent(int);
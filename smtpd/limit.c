@@ -26,6 +26,8 @@
 #include <event.h>
 #include <fcntl.h>
 #include <imsg.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +35,57 @@
 #include "smtpd.h"
 #include "log.h"
 
+/*
+ * Limits that smtpctl can change at runtime, named after the process
+ * that owns them and their keyword in smtpd.conf.  The "mta." names
+ * not listed here are the limit_mta_set() keywords, applied to the
+ * default mta limits.  Values outside of [min, max] are refused.
+ */
+#define	LIMIT_ENV(field)	offsetof(struct smtpd, field)
+
+/* upper bounds for the limits that size an allocation */
+#define	LIMIT_BATCH_MAX		1000000
+#define	LIMIT_CACHE_MAX		(1LL << 30)
+
+static struct limit_runtime {
+	const char	*name;
+	int		 proc;
+	size_t		 offset;
+	int64_t		 min;
+	int64_t		 max;
+} limit_runtime[] = {
+	{ "mda.max-session",		PROC_MDA,
+	    LIMIT_ENV(sc_mda_max_session),		1, INT_MAX },
+	{ "mda.max-session-per-user",	PROC_MDA,
+	    LIMIT_ENV(sc_mda_max_user_session),		1, INT_MAX },
+	{ "mda.task-hiwat",		PROC_MDA,
+	    LIMIT_ENV(sc_mda_task_hiwat),		1, INT_MAX },
+	{ "mda.task-lowat",		PROC_MDA,
+	    LIMIT_ENV(sc_mda_task_lowat),		0, INT_MAX },
+	{ "mda.task-release",		PROC_MDA,
+	    LIMIT_ENV(sc_mda_task_release),		1, INT_MAX },
+	{ "mta.max-deferred",		PROC_MTA,
+	    LIMIT_ENV(sc_mta_max_deferred),		0, INT_MAX },
+	{ "queue.envelope-cache-size",	PROC_QUEUE,
+	    LIMIT_ENV(sc_queue_evpcache_size),		0, LIMIT_CACHE_MAX },
+	{ "scheduler.max-inflight",	PROC_SCHEDULER,
+	    LIMIT_ENV(sc_scheduler_max_inflight),	1, INT_MAX },
+	{ "scheduler.max-inflight-high", PROC_SCHEDULER,
+	    LIMIT_ENV(sc_scheduler_max_inflight_prio[PRIO_HIGH]), 0, INT_MAX },
+	{ "scheduler.max-inflight-normal", PROC_SCHEDULER,
+	    LIMIT_ENV(sc_scheduler_max_inflight_prio[PRIO_NORMAL]), 0, INT_MAX },
+	{ "scheduler.max-inflight-bulk", PROC_SCHEDULER,
+	    LIMIT_ENV(sc_scheduler_max_inflight_prio[PRIO_BULK]), 0, INT_MAX },
+	{ "scheduler.max-evp-batch-size", PROC_SCHEDULER,
+	    LIMIT_ENV(sc_scheduler_max_evp_batch_size),	1, LIMIT_BATCH_MAX },
+	{ "scheduler.max-msg-batch-size", PROC_SCHEDULER,
+	    LIMIT_ENV(sc_scheduler_max_msg_batch_size),	1, LIMIT_BATCH_MAX },
+	{ "scheduler.max-schedule",	PROC_SCHEDULER,
+	    LIMIT_ENV(sc_scheduler_max_schedule),	1, LIMIT_BATCH_MAX },
+};
+
+static struct limit_runtime *limit_runtime_find(const char *);
+
 void
 limit_mta_set_defaults(struct mta_limits *limits)
 {
@@ -60,9 +113,14 @@ limit_mta_set_defaults(struct mta_limits *limits)
 
 	limits->family = AF_UNSPEC;
 
+	limits->adaptive = 0;
+
 	limits->task_hiwat = 50;
 	limits->task_lowat = 30;
 	limits->task_release = 10;
+
+	limits->shape_rate = 0;
+	limits->shape_burst = 0;
 }
 
 int
@@ -107,6 +165,9 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 	else if (!strcmp(key, "max-failures-per-session"))
 		limits->max_failures_per_session = value;
 
+	else if (!strcmp(key, "adaptive-conn"))
+		limits->adaptive = value;
+
 	else if (!strcmp(key, "task-hiwat"))
 		limits->task_hiwat = value;
 	else if (!strcmp(key, "task-lowat"))
@@ -114,8 +175,63 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 	else if (!strcmp(key, "task-release"))
 		limits->task_release = value;
 
+	else if (!strcmp(key, "shape-rate"))
+		limits->shape_rate = value;
+	else if (!strcmp(key, "shape-burst"))
+		limits->shape_burst = value;
+
 	else
 		return (0);
 
 	return (1);
 }
+
+static struct limit_runtime *
+limit_runtime_find(const char *name)
+{
+	size_t	i;
+
+	for (i = 0; i < nitems(limit_runtime); i++)
+		if (!strcmp(name, limit_runtime[i].name))
+			return (&limit_runtime[i]);
+	return (NULL);
+}
+
+/*
+ * The process owning a runtime limit, or -1 if there is no such limit.
+ */
+int
+limit_process(const char *name)
+{
+	struct limit_runtime	*lr;
+	struct mta_limits	 limits;
+
+	if ((lr = limit_runtime_find(name)))
+		return (lr->proc);
+	if (!strncmp(name, "mta.", 4) && limit_mta_set(&limits, name + 4, 0))
+		return (PROC_MTA);
+	return (-1);
+}
+
+/*
+ * Change a runtime limit in the owning process, which then applies it.
+ */
+int
+limit_set(const char *name, int64_t value)
+{
+	struct limit_runtime	*lr;
+	struct mta_limits	*limits;
+
+	if ((lr = limit_runtime_find(name))) {
+		if (value < lr->min || value > lr->max)
+			return (0);
+		*(size_t *)((char *)env + lr->offset) = value;
+		return (1);
+	}
+
+	if (strncmp(name, "mta.", 4) || value < 0 || value > INT_MAX)
+		return (0);
+	if ((limits = dict_get(env->sc_limits_dict, "default")) == NULL)
+		return (0);
+	return (limit_mta_set(limits, name + 4, value));
+}
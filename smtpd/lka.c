@@ -33,6 +33,7 @@
 #include <event.h>
 #include <imsg.h>
 #include <openssl/err.h>
+#include <openssl/sha.h>
 #include <openssl/ssl.h>
 #include <pwd.h>
 #include <resolv.h>
@@ -46,16 +47,57 @@
 #include "log.h"
 #include "ssl.h"
 
+/*
+ * Recent successful authentications, keyed by "table:user".  Only a
+ * salted hash of the password is kept.
+ */
+#define	LKA_AUTHCACHE_MAX	1024
+#define	LKA_AUTHCACHE_TTL	60
+
+struct lka_authcache {
+	TAILQ_ENTRY(lka_authcache)	 entry;
+	char				*key;
+	time_t				 expire;
+	uint8_t				 salt[16];
+	uint8_t				 hash[SHA512_DIGEST_LENGTH];
+};
+
 static void lka_imsg(struct mproc *, struct imsg *);
 static void lka_shutdown(void);
 static void lka_sig_handler(int, short, void *);
 static int lka_authenticate(const char *, const char *, const char *);
+static void lka_authcache_hash(uint8_t *, const uint8_t *, const char *);
+static int lka_authcache_check(const char *, const char *, const char *);
+static void lka_authcache_add(const char *, const char *, const char *);
+static void lka_authcache_remove(struct lka_authcache *);
+static void lka_authcache_flush(void);
+static void lka_table_update(struct table *);
+static void lka_table_update_step(int, short, void *);
 static int lka_credentials(const char *, const char *, char *, size_t);
 static int lka_userinfo(const char *, const char *, struct userinfo *);
 static int lka_addrname(const char *, const struct sockaddr *,
     struct addrname *);
+static int lka_sources(const char *, struct source *, size_t *);
+static int lka_mtastate(const char *, const char *, struct mtastate *);
+static void lka_mtastate_update(const char *, const char *, const char *);
 static int lka_X509_verify(struct ca_vrfy_req_msg *, const char *, const char *);
 
+/* certificates being received, one per peer as there may be several */
+static struct tree	ca_vrfy_reqs;
+
+/* authentication cache, oldest entries first in authcache_lru */
+static struct dict			 authcache;
+static TAILQ_HEAD(, lka_authcache)	 authcache_lru;
+static size_t				 authcache_count;
+
+/* tables being updated in steps, by name */
+struct lka_update {
+	struct table	*table;
+	int		 again;		/* requested again meanwhile */
+};
+static struct dict			 updating;
+static struct event			 ev_updating;
+
 static void
 lka_imsg(struct mproc *p, struct imsg *imsg)
 {
@@ -63,8 +105,8 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 	int			 ret;
 	struct pki		*pki;
 	struct iovec		iov[3];
-	static struct ca_vrfy_req_msg	*req_ca_vrfy_smtp = NULL;
-	static struct ca_vrfy_req_msg	*req_ca_vrfy_mta = NULL;
+	struct ca_vrfy_req_msg		*req_ca_vrfy_smtp;
+	struct ca_vrfy_req_msg		*req_ca_vrfy_mta;
 	struct ca_vrfy_req_msg		*req_ca_vrfy_chain;
 	struct ca_vrfy_resp_msg		resp_ca_vrfy;
 	struct ca_cert_req_msg		*req_ca_cert;
@@ -72,13 +114,15 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 	struct sockaddr_storage	 ss;
 	struct userinfo		 userinfo;
 	struct addrname		 addrname;
+	struct source		 sources[SOURCE_MAX];
+	struct mtastate		 mtastate;
 	struct envelope		 evp;
 	struct msg		 m;
-	union lookup		 lk;
 	char			 buf[SMTPD_MAXLINESIZE];
 	const char		*tablename, *username, *password, *label;
+	const char		*key, *value;
 	uint64_t		 reqid;
-	size_t			 i;
+	size_t			 i, nsources;
 	int			 v;
 	const char	        *cafile = NULL;
 
@@ -133,13 +177,15 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			}
 			resp_ca_cert.status = CA_OK;
 			resp_ca_cert.cert_len = pki->pki_cert_len;
-			resp_ca_cert.key_len = pki->pki_key_len;
+			resp_ca_cert.key_len = 0;
+			resp_ca_cert.dhparams_len = pki->pki_dhparams_len;
+			/* enough for the smtp process to build the context */
 			iov[0].iov_base = &resp_ca_cert;
 			iov[0].iov_len = sizeof(resp_ca_cert);
 			iov[1].iov_base = pki->pki_cert;
 			iov[1].iov_len = pki->pki_cert_len;
-			iov[2].iov_base = pki->pki_key;
-			iov[2].iov_len = pki->pki_key_len;
+			iov[2].iov_base = pki->pki_dhparams;
+			iov[2].iov_len = pki->pki_dhparams_len;
 			m_composev(p, IMSG_LKA_SSL_INIT, 0, 0, -1, iov, nitems(iov));
 			return;
 
@@ -151,9 +197,11 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			    sizeof (unsigned char *), "lka:ca_vrfy");
 			req_ca_vrfy_smtp->chain_cert_len = xcalloc(req_ca_vrfy_smtp->n_chain,
 			    sizeof (off_t), "lka:ca_vrfy");
+			tree_xset(&ca_vrfy_reqs, (uintptr_t)p, req_ca_vrfy_smtp);
 			return;
 
 		case IMSG_LKA_SSL_VERIFY_CHAIN:
+			req_ca_vrfy_smtp = tree_get(&ca_vrfy_reqs, (uintptr_t)p);
 			if (req_ca_vrfy_smtp == NULL)
 				fatalx("lka:ca_vrfy: chain without a certificate");
 			req_ca_vrfy_chain = imsg->data;
@@ -164,6 +212,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 
 		case IMSG_LKA_SSL_VERIFY:
+			req_ca_vrfy_smtp = tree_pop(&ca_vrfy_reqs, (uintptr_t)p);
 			if (req_ca_vrfy_smtp == NULL)
 				fatalx("lka:ca_vrfy: verify without a certificate");
 
@@ -255,14 +304,13 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			}
 			resp_ca_cert.status = CA_OK;
 			resp_ca_cert.cert_len = pki->pki_cert_len;
-			resp_ca_cert.key_len = pki->pki_key_len;
+			resp_ca_cert.key_len = 0;
+			resp_ca_cert.dhparams_len = 0;
 			iov[0].iov_base = &resp_ca_cert;
 			iov[0].iov_len = sizeof(resp_ca_cert);
 			iov[1].iov_base = pki->pki_cert;
 			iov[1].iov_len = pki->pki_cert_len;
-			iov[2].iov_base = pki->pki_key;
-			iov[2].iov_len = pki->pki_key_len;
-			m_composev(p, IMSG_LKA_SSL_INIT, 0, 0, -1, iov, nitems(iov));
+			m_composev(p, IMSG_LKA_SSL_INIT, 0, 0, -1, iov, 2);
 			return;
 
 		case IMSG_LKA_SSL_VERIFY_CERT:
@@ -273,9 +321,11 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			    sizeof (unsigned char *), "lka:ca_vrfy");
 			req_ca_vrfy_mta->chain_cert_len = xcalloc(req_ca_vrfy_mta->n_chain,
 			    sizeof (off_t), "lka:ca_vrfy");
+			tree_xset(&ca_vrfy_reqs, (uintptr_t)p, req_ca_vrfy_mta);
 			return;
 
 		case IMSG_LKA_SSL_VERIFY_CHAIN:
+			req_ca_vrfy_mta = tree_get(&ca_vrfy_reqs, (uintptr_t)p);
 			if (req_ca_vrfy_mta == NULL)
 				fatalx("lka:ca_vrfy: verify without a certificate");
 
@@ -287,6 +337,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 
 		case IMSG_LKA_SSL_VERIFY:
+			req_ca_vrfy_mta = tree_pop(&ca_vrfy_reqs, (uintptr_t)p);
 			if (req_ca_vrfy_mta == NULL)
 				fatalx("lka:ca_vrfy: verify without a certificate");
 
@@ -333,26 +384,18 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_string(&m, &tablename);
 			m_end(&m);
 
-			table = table_find(tablename, NULL);
+			ret = lka_sources(tablename, sources, &nsources);
 
+			/* the mta picks one, see mta_source_select() */
 			m_create(p, IMSG_LKA_SOURCE, 0, 0, -1);
 			m_add_id(p, reqid);
-
-			if (table == NULL) {
-				log_warn("warn: source address table %s missing",
-				    tablename);
-				m_add_int(p, LKA_TEMPFAIL);
-			}
-			else {
-				ret = table_fetch(table, K_SOURCE, &lk);
-				if (ret == -1)
-					m_add_int(p, LKA_TEMPFAIL);
-				else if (ret == 0)
-					m_add_int(p, LKA_PERMFAIL);
-				else {
-					m_add_int(p, LKA_OK);
+			m_add_int(p, ret);
+			if (ret == LKA_OK) {
+				m_add_int(p, nsources);
+				for (i = 0; i < nsources; i++) {
 					m_add_sockaddr(p,
-					    (struct sockaddr *)&lk.source.addr);
+					    (struct sockaddr *)&sources[i].addr);
+					m_add_int(p, sources[i].weight);
 				}
 			}
 			m_close(p);
@@ -376,6 +419,35 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			m_close(p);
 			return;
 
+		case IMSG_LKA_MTASTATE:
+			m_msg(&m, imsg);
+			m_get_id(&m, &reqid);
+			m_get_string(&m, &tablename);
+			m_get_string(&m, &key);
+			m_end(&m);
+
+			ret = lka_mtastate(tablename, key, &mtastate);
+
+			m_create(p, IMSG_LKA_MTASTATE, 0, 0, -1);
+			m_add_id(p, reqid);
+			m_add_int(p, ret);
+			if (ret == LKA_OK) {
+				m_add_time(p, mtastate.until);
+				m_add_u32(p, mtastate.window);
+				m_add_u32(p, mtastate.failures);
+			}
+			m_close(p);
+			return;
+
+		case IMSG_LKA_MTASTATE_UPDATE:
+			m_msg(&m, imsg);
+			m_get_string(&m, &tablename);
+			m_get_string(&m, &key);
+			m_get_string(&m, &value);
+			m_end(&m);
+
+			lka_mtastate_update(tablename, key, value);
+			return;
 		}
 	}
 
@@ -388,11 +460,12 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			if (verbose & TRACE_TABLES)
 				table_dump_all();
 			table_open_all();
+			lka_format_compile_rules();
 
 			/* Start fulfilling requests */
 			mproc_enable(p_mda);
-			mproc_enable(p_mta);
-			mproc_enable(p_smtp);
+			mta_enable(1);
+			smtp_enable(1);
 			return;
 
 		case IMSG_CTL_VERBOSE:
@@ -414,7 +487,11 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 
 		case IMSG_LKA_AUTHENTICATE:
-			m_forward(p_smtp, imsg);
+			m_msg(&m, imsg);
+			m_get_id(&m, &reqid);
+			m_get_int(&m, &ret);
+			m_end(&m);
+			m_forward(smtp_peer(reqid), imsg);
 			return;
 		}
 	}
@@ -428,7 +505,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 				    "\"%s\"", (char *)imsg->data);
 				return;
 			}
-			table_update(table);
+			lka_table_update(table);
 			return;
 		}
 	}
@@ -465,7 +542,7 @@ lka_shutdown(void)
 }
 
 pid_t
-lka(void)
+lka(int shard)
 {
 	pid_t		 pid;
 	struct passwd	*pw;
@@ -478,6 +555,7 @@ lka(void)
 		fatal("lka: cannot fork");
 	case 0:
 		post_fork(PROC_LKA);
+		lka_shard = shard;
 		break;
 	default:
 		return (pid);
@@ -490,13 +568,21 @@ lka(void)
 
 	config_process(PROC_LKA);
 
+	ruleset_compile();
+
 	if (setgroups(1, &pw->pw_gid) ||
 	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
 	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
 		fatal("lka: cannot drop privileges");
 
+	tree_init(&ca_vrfy_reqs);
+	dict_init(&authcache);
+	TAILQ_INIT(&authcache_lru);
+	dict_init(&updating);
+
 	imsg_callback = lka_imsg;
 	event_init();
+	evtimer_set(&ev_updating, lka_table_update_step, NULL);
 
 	signal_set(&ev_sigint, SIGINT, lka_sig_handler, NULL);
 	signal_set(&ev_sigterm, SIGTERM, lka_sig_handler, NULL);
@@ -517,8 +603,8 @@ lka(void)
 
 	/* Ignore them until we get our config */
 	mproc_disable(p_mda);
-	mproc_disable(p_mta);
-	mproc_disable(p_smtp);
+	mta_enable(0);
+	smtp_enable(0);
 
 	if (event_dispatch() < 0)
 		fatal("event_dispatch");
@@ -527,6 +613,42 @@ lka(void)
 	return (0);
 }
 
+/*
+ * Requests are spread by session id, so that all the requests of a
+ * session, and its expansion state, stay in one process.  smtp ids end
+ * with their own process number, which is skipped.
+ */
+struct mproc *
+lka_peer(uint64_t reqid)
+{
+	if (env->sc_lka_procs <= 1)
+		return (p_lka);
+
+	return (p_lkas[(reqid / env->sc_smtp_procs) % env->sc_lka_procs]);
+}
+
+void
+lka_forward(struct imsg *imsg)
+{
+	size_t	i;
+
+	for (i = 0; i < env->sc_lka_procs; i++)
+		m_forward(p_lkas[i], imsg);
+}
+
+void
+lka_enable(int on)
+{
+	size_t	i;
+
+	for (i = 0; i < env->sc_lka_procs; i++) {
+		if (on)
+			mproc_enable(p_lkas[i]);
+		else
+			mproc_disable(p_lkas[i]);
+	}
+}
+
 static int
 lka_authenticate(const char *tablename, const char *user, const char *password)
 {
@@ -534,6 +656,13 @@ lka_authenticate(const char *tablename, const char *user, const char *password)
 	union lookup		 lk;
 
 	log_debug("debug: lka: authenticating for %s:%s", tablename, user);
+
+	if (lka_authcache_check(tablename, user, password)) {
+		stat_increment("lka.authcache.hit", 1);
+		return (LKA_OK);
+	}
+	stat_increment("lka.authcache.miss", 1);
+
 	table = table_find(tablename, NULL);
 	if (table == NULL) {
 		log_warnx("warn: could not find table %s needed for authentication",
@@ -549,12 +678,168 @@ lka_authenticate(const char *tablename, const char *user, const char *password)
 	case 0:
 		return (LKA_PERMFAIL);
 	default:
-		if (!strcmp(lk.creds.password, crypt(password, lk.creds.password)))
+		if (!strcmp(lk.creds.password, crypt(password, lk.creds.password))) {
+			lka_authcache_add(tablename, user, password);
 			return (LKA_OK);
+		}
 		return (LKA_PERMFAIL);
 	}
 }
 
+static void
+lka_authcache_hash(uint8_t *hash, const uint8_t *salt, const char *password)
+{
+	SHA512_CTX	ctx;
+
+	SHA512_Init(&ctx);
+	SHA512_Update(&ctx, salt, sizeof(((struct lka_authcache *)0)->salt));
+	SHA512_Update(&ctx, password, strlen(password));
+	SHA512_Final(hash, &ctx);
+	memset(&ctx, 0, sizeof ctx);
+}
+
+/*
+ * Return 1 if the same password was accepted for this user recently.
+ * A mismatch is not a failure, the password may have changed: the
+ * entry is dropped and the backend decides.
+ */
+static int
+lka_authcache_check(const char *tablename, const char *user,
+    const char *password)
+{
+	struct lka_authcache	*ac;
+	uint8_t			 hash[SHA512_DIGEST_LENGTH];
+	char			 key[SMTPD_MAXLINESIZE];
+	int			 ret;
+
+	if (! bsnprintf(key, sizeof key, "%s:%s", tablename, user))
+		return (0);
+	if ((ac = dict_get(&authcache, key)) == NULL)
+		return (0);
+
+	if (ac->expire <= time(NULL)) {
+		lka_authcache_remove(ac);
+		return (0);
+	}
+
+	lka_authcache_hash(hash, ac->salt, password);
+	ret = timingsafe_bcmp(hash, ac->hash, sizeof hash) == 0;
+	memset(hash, 0, sizeof hash);
+	if (! ret)
+		lka_authcache_remove(ac);
+
+	return (ret);
+}
+
+static void
+lka_authcache_add(const char *tablename, const char *user,
+    const char *password)
+{
+	struct lka_authcache	*ac;
+	char			 key[SMTPD_MAXLINESIZE];
+
+	if (! bsnprintf(key, sizeof key, "%s:%s", tablename, user))
+		return;
+
+	if ((ac = dict_get(&authcache, key)) != NULL)
+		lka_authcache_remove(ac);
+	else if (authcache_count == LKA_AUTHCACHE_MAX)
+		lka_authcache_remove(TAILQ_FIRST(&authcache_lru));
+
+	ac = xcalloc(1, sizeof *ac, "lka_authcache_add");
+	ac->key = xstrdup(key, "lka_authcache_add");
+	ac->expire = time(NULL) + LKA_AUTHCACHE_TTL;
+	arc4random_buf(ac->salt, sizeof ac->salt);
+	lka_authcache_hash(ac->hash, ac->salt, password);
+
+	dict_xset(&authcache, ac->key, ac);
+	TAILQ_INSERT_TAIL(&authcache_lru, ac, entry);
+	authcache_count++;
+}
+
+static void
+lka_authcache_remove(struct lka_authcache *ac)
+{
+	dict_xpop(&authcache, ac->key);
+	TAILQ_REMOVE(&authcache_lru, ac, entry);
+	authcache_count--;
+
+	memset(ac->hash, 0, sizeof ac->hash);
+	free(ac->key);
+	free(ac);
+}
+
+static void
+lka_authcache_flush(void)
+{
+	struct lka_authcache	*ac;
+
+	while ((ac = TAILQ_FIRST(&authcache_lru)) != NULL)
+		lka_authcache_remove(ac);
+}
+
+static void
+lka_table_update(struct table *table)
+{
+	struct lka_update	*u;
+	struct timeval		 tv;
+
+	if ((u = dict_get(&updating, table->t_name))) {
+		u->again = 1;
+		return;
+	}
+
+	if (table_update(table) == TABLE_UPDATE_AGAIN) {
+		u = xcalloc(1, sizeof *u, "lka_table_update");
+		u->table = table;
+		dict_xset(&updating, table->t_name, u);
+		if (! evtimer_pending(&ev_updating, NULL)) {
+			timerclear(&tv);
+			evtimer_add(&ev_updating, &tv);
+		}
+	}
+
+	/* credentials may have changed in any table */
+	lka_authcache_flush();
+}
+
+/* run one step of each table update, letting the requests in between */
+static void
+lka_table_update_step(int fd, short event, void *p)
+{
+	struct lka_update	*u;
+	struct timeval		 tv;
+	void			*iter;
+	const char		*name;
+
+	iter = NULL;
+	while (dict_iter(&updating, &iter, NULL, (void **)&u)) {
+		if (table_update(u->table) == TABLE_UPDATE_AGAIN)
+			continue;
+		if (u->again) {
+			u->again = 0;
+			if (table_update(u->table) == TABLE_UPDATE_AGAIN)
+				continue;
+		}
+		u->table = NULL;
+	}
+
+	/* drop the completed ones */
+	iter = NULL;
+	while (dict_iter(&updating, &iter, &name, (void **)&u))
+		if (u->table == NULL) {
+			free(dict_xpop(&updating, name));
+			iter = NULL;
+		}
+
+	lka_authcache_flush();
+
+	if (! dict_empty(&updating)) {
+		timerclear(&tv);
+		evtimer_add(&ev_updating, &tv);
+	}
+}
+
 static int
 lka_credentials(const char *tablename, const char *label, char *dst, size_t sz)
 {
@@ -655,6 +940,83 @@ lka_addrname(const char *tablename, const struct sockaddr *sa,
 	}
 }      
 
+/*
+ * All the addresses of a source table, in the order the table rotates
+ * through them: fetch until the first one comes back.
+ */
+static int
+lka_sources(const char *tablename, struct source *res, size_t *n)
+{
+	struct table	*table;
+	union lookup	 lk;
+	struct sockaddr	*sa, *first;
+
+	table = table_find(tablename, NULL);
+	if (table == NULL) {
+		log_warnx("warn: source address table %s missing", tablename);
+		return (LKA_TEMPFAIL);
+	}
+
+	first = (struct sockaddr *)&res[0].addr;
+	for (*n = 0; *n < SOURCE_MAX; (*n)++) {
+		switch (table_fetch(table, K_SOURCE, &lk)) {
+		case -1:
+			return (LKA_TEMPFAIL);
+		case 0:
+			return (*n ? LKA_OK : LKA_PERMFAIL);
+		}
+		sa = (struct sockaddr *)&lk.source.addr;
+		if (*n && sa->sa_len == first->sa_len &&
+		    memcmp(sa, first, sa->sa_len) == 0)
+			break;
+		res[*n] = lk.source;
+	}
+
+	return (LKA_OK);
+}
+
+static int
+lka_mtastate(const char *tablename, const char *key, struct mtastate *res)
+{
+	struct table	*table;
+	union lookup	 lk;
+
+	table = table_find(tablename, NULL);
+	if (table == NULL) {
+		log_warnx("warn: cannot find mta state table %s", tablename);
+		return (LKA_TEMPFAIL);
+	}
+
+	switch (table_lookup(table, key, K_MTASTATE, &lk)) {
+	case -1:
+		log_warnx("warn: failure during mta state lookup %s:%s",
+		    tablename, key);
+		return (LKA_TEMPFAIL);
+	case 0:
+		return (LKA_PERMFAIL);
+	default:
+		*res = lk.mtastate;
+		return (LKA_OK);
+	}
+}
+
+/* the mta does not wait for this, a lost update is refreshed later */
+static void
+lka_mtastate_update(const char *tablename, const char *key, const char *value)
+{
+	struct table	*table;
+
+	table = table_find(tablename, NULL);
+	if (table == NULL) {
+		log_warnx("warn: cannot find mta state table %s", tablename);
+		return;
+	}
+
+	if (table_store(table, key, K_MTASTATE, value) == -1)
+		log_warnx("warn: failure during mta state update %s:%s",
+		    tablename, key);
+}
+
 static int
 lka_X509_verify(struct ca_vrfy_req_msg *vrfy,
     const char *CAfile, const char *CRLfile)
@@ -46,6 +46,11 @@
 
 #define	F_WAITING	0x01
 
+#define	EXPANSION_TTL	60
+#define	EXPANSION_MAX	1024
+
+#define	MAXTOKENLEN	128
+
 struct lka_session {
 	uint64_t		 id; /* given by smtp */
 
@@ -62,11 +67,85 @@ struct lka_session {
 	struct expandnode	*node;
 };
 
+/*
+ * Alias, virtual and forward expansions are remembered for a short
+ * while, for the other recipients of the same message.  The recorded
+ * nodes are inserted again, so expand_insert() deduplicates them as if
+ * the lookups had been done.
+ */
+struct lka_expansion {
+	TAILQ_ENTRY(lka_expansion)	 entry;
+	char				*key;
+	time_t				 expire;
+	int				 ret;
+	int				 nofile;
+	struct expandrecord		*record;
+};
+
+/*
+ * A delivery format compiled into a list of operations: literal runs,
+ * the user directory for a leading ~/, and the %{} tokens with their
+ * offsets and modifiers.
+ */
+enum format_op {
+	FORMAT_LITERAL,
+	FORMAT_HOMEDIR,
+	FORMAT_TOKEN,
+};
+
+enum format_field {
+	FIELD_SENDER,
+	FIELD_DEST,
+	FIELD_RCPT,
+	FIELD_SENDER_USER,
+	FIELD_SENDER_DOMAIN,
+	FIELD_USER_USERNAME,
+	FIELD_USER_DIRECTORY,
+	FIELD_DEST_USER,
+	FIELD_DEST_DOMAIN,
+	FIELD_RCPT_USER,
+	FIELD_RCPT_DOMAIN,
+};
+
+struct expand_op {
+	enum format_op		 op;
+	const char		*text;
+	size_t			 len;
+	enum format_field	 field;
+	ssize_t			 begoff;
+	ssize_t			 endoff;
+	int			 raw;
+	size_t			 nmods;
+	uint8_t			 mods[MAXTOKENLEN / 2];
+};
+
+struct expand_format {
+	char			*text;
+	size_t			 nops;
+	struct expand_op	*ops;
+};
+
 static void lka_expand(struct lka_session *, struct rule *,
     struct expandnode *);
+static void lka_session_forward(struct lka_session *, struct rule *,
+    struct expandnode *, int, struct lka_expansion *);
+static struct lka_expansion *lka_expansion_get(struct lka_session *,
+    struct rule *, const char *, const char *);
+static void lka_expansion_start(struct lka_session *);
+static void lka_expansion_put(struct lka_session *, struct rule *,
+    const char *, const char *, int, int);
+static size_t lka_expansion_replay(struct lka_session *,
+    struct lka_expansion *);
+static void lka_expansion_free(struct lka_expansion *);
 static void lka_submit(struct lka_session *, struct rule *,
     struct expandnode *);
 static void lka_resume(struct lka_session *);
+static int lka_format_token(struct expand_op *, const char *);
+static size_t lka_expand_token(char *, size_t, const struct expand_op *,
+    const struct envelope *, const struct userinfo *);
+static struct expand_op *lka_format_op(struct expand_format *, enum format_op);
+static size_t lka_format_run(const struct expand_format *, char *, size_t,
+    const struct envelope *, const struct userinfo *);
 static size_t lka_expand_format(char *, size_t, const struct envelope *,
     const struct userinfo *);
 static void mailaddr_to_username(const struct mailaddr *, char *, size_t);
@@ -87,11 +166,29 @@ struct modifiers {
 };
 static const char	*unsafe = MAILADDR_ESCAPE;
 
+static struct {
+	const char		*name;
+	enum format_field	 field;
+} format_fields[] = {
+	{ "sender",		FIELD_SENDER },
+	{ "dest",		FIELD_DEST },
+	{ "rcpt",		FIELD_RCPT },
+	{ "sender.user",	FIELD_SENDER_USER },
+	{ "sender.domain",	FIELD_SENDER_DOMAIN },
+	{ "user.username",	FIELD_USER_USERNAME },
+	{ "user.directory",	FIELD_USER_DIRECTORY },
+	{ "dest.user",		FIELD_DEST_USER },
+	{ "dest.domain",	FIELD_DEST_DOMAIN },
+	{ "rcpt.user",		FIELD_RCPT_USER },
+	{ "rcpt.domain",	FIELD_RCPT_DOMAIN },
+};
+
 
 static int		init;
 static struct tree	sessions;
-
-#define	MAXTOKENLEN	128
+static struct dict	expansions;
+static TAILQ_HEAD(, lka_expansion) expansions_lru;
+static size_t		nexpansions;
 
 void
 lka_session(uint64_t id, struct envelope *envelope)
@@ -102,6 +199,8 @@ lka_session(uint64_t id, struct envelope *envelope)
 	if (init == 0) {
 		init = 1;
 		tree_init(&sessions);
+		dict_init(&expansions);
+		TAILQ_INIT(&expansions_lru);
 	}
 
 	lks = xcalloc(1, sizeof(*lks), "lka_session");
@@ -128,7 +227,6 @@ lka_session_forward_reply(struct forward_req *fwreq, int fd)
 	struct lka_session     *lks;
 	struct rule	       *rule;
 	struct expandnode      *xn;
-	int			ret;
 
 	lks = tree_xget(&sessions, fwreq->id);
 	xn = lks->node;
@@ -144,55 +242,7 @@ lka_session_forward_reply(struct forward_req *fwreq, int fd)
 		lks->error = LKA_PERMFAIL;
 		break;
 	case 1:
-		if (fd == -1) {
-			if (lks->expand.rule->r_forwardonly) {
-				log_trace(TRACE_EXPAND, "expand: no .forward "
-				    "for user %s on forward-only rule", fwreq->user);
-				lks->error = LKA_TEMPFAIL;
-			}
-			else if (lks->expand.rule->r_action == A_NONE) {
-				log_trace(TRACE_EXPAND, "expand: no .forward "
-				    "for user %s and no default action on rule", fwreq->user);
-				lks->error = LKA_PERMFAIL;
-			}
-			else {
-				log_trace(TRACE_EXPAND, "expand: no .forward for "
-				    "user %s, just deliver", fwreq->user);
-				lka_submit(lks, rule, xn);
-			}
-		}
-		else {
-			/* expand for the current user and rule */
-			lks->expand.rule = rule;
-			lks->expand.parent = xn;
-			lks->expand.alias = 0;
-			xn->mapping = rule->r_mapping;
-			xn->userbase = rule->r_userbase;
-			/* forwards_get() will close the descriptor no matter what */
-			ret = forwards_get(fd, &lks->expand);
-			if (ret == -1) {
-				log_trace(TRACE_EXPAND, "expand: temporary "
-				    "forward error for user %s", fwreq->user);
-				lks->error = LKA_TEMPFAIL;
-			}
-			else if (ret == 0) {
-				if (lks->expand.rule->r_forwardonly) {
-					log_trace(TRACE_EXPAND, "expand: empty .forward "
-					    "for user %s on forward-only rule", fwreq->user);
-					lks->error = LKA_TEMPFAIL;
-				}
-				else if (lks->expand.rule->r_action == A_NONE) {
-					log_trace(TRACE_EXPAND, "expand: empty .forward "
-					    "for user %s and no default action on rule", fwreq->user);
-					lks->error = LKA_PERMFAIL;
-				}
-				else {
-					log_trace(TRACE_EXPAND, "expand: empty .forward "
-					    "for user %s, just deliver", fwreq->user);
-					lka_submit(lks, rule, xn);
-				}
-			}
-		}
+		lka_session_forward(lks, rule, xn, fd, NULL);
 		break;
 	default:
 		/* temporary failure while looking up ~/.forward */
@@ -202,11 +252,79 @@ lka_session_forward_reply(struct forward_req *fwreq, int fd)
 	lka_resume(lks);
 }
 
+static void
+lka_session_forward(struct lka_session *lks, struct rule *rule,
+    struct expandnode *xn, int fd, struct lka_expansion *xc)
+{
+	const char	*user = xn->u.user;
+	int		 ret;
+
+	if (xc == NULL && fd == -1)
+		lka_expansion_put(lks, rule, "forward", user, 0, 1);
+
+	if (xc ? xc->nofile : fd == -1) {
+		if (lks->expand.rule->r_forwardonly) {
+			log_trace(TRACE_EXPAND, "expand: no .forward "
+			    "for user %s on forward-only rule", user);
+			lks->error = LKA_TEMPFAIL;
+		}
+		else if (lks->expand.rule->r_action == A_NONE) {
+			log_trace(TRACE_EXPAND, "expand: no .forward "
+			    "for user %s and no default action on rule", user);
+			lks->error = LKA_PERMFAIL;
+		}
+		else {
+			log_trace(TRACE_EXPAND, "expand: no .forward for "
+			    "user %s, just deliver", user);
+			lka_submit(lks, rule, xn);
+		}
+		return;
+	}
+
+	/* expand for the current user and rule */
+	lks->expand.rule = rule;
+	lks->expand.parent = xn;
+	lks->expand.alias = 0;
+	xn->mapping = rule->r_mapping;
+	xn->userbase = rule->r_userbase;
+	if (xc)
+		ret = lka_expansion_replay(lks, xc) ? 1 : 0;
+	else {
+		lka_expansion_start(lks);
+		/* forwards_get() will close the descriptor no matter what */
+		ret = forwards_get(fd, &lks->expand);
+		lka_expansion_put(lks, rule, "forward", user, ret, 0);
+	}
+	if (ret == -1) {
+		log_trace(TRACE_EXPAND, "expand: temporary "
+		    "forward error for user %s", user);
+		lks->error = LKA_TEMPFAIL;
+	}
+	else if (ret == 0) {
+		if (lks->expand.rule->r_forwardonly) {
+			log_trace(TRACE_EXPAND, "expand: empty .forward "
+			    "for user %s on forward-only rule", user);
+			lks->error = LKA_TEMPFAIL;
+		}
+		else if (lks->expand.rule->r_action == A_NONE) {
+			log_trace(TRACE_EXPAND, "expand: empty .forward "
+			    "for user %s and no default action on rule", user);
+			lks->error = LKA_PERMFAIL;
+		}
+		else {
+			log_trace(TRACE_EXPAND, "expand: empty .forward "
+			    "for user %s, just deliver", user);
+			lka_submit(lks, rule, xn);
+		}
+	}
+}
+
 static void
 lka_resume(struct lka_session *lks)
 {
 	struct envelope		*ep;
 	struct expandnode	*xn;
+	struct mproc		*p;
 
 	if (lks->error)
 		goto error;
@@ -229,20 +347,21 @@ lka_resume(struct lka_session *lks)
 	}
     error:
 	if (lks->error) {
-		m_create(p_smtp, IMSG_LKA_EXPAND_RCPT, 0, 0, -1);
-		m_add_id(p_smtp, lks->id);
-		m_add_int(p_smtp, lks->error);
+		p = smtp_peer(lks->id);
+		m_create(p, IMSG_LKA_EXPAND_RCPT, 0, 0, -1);
+		m_add_id(p, lks->id);
+		m_add_int(p, lks->error);
 
 		if (lks->errormsg)
-			m_add_string(p_smtp, lks->errormsg);
+			m_add_string(p, lks->errormsg);
 		else {
 			if (lks->error == LKA_PERMFAIL)
-				m_add_string(p_smtp, "550 Invalid recipient");
+				m_add_string(p, "550 Invalid recipient");
 			else if (lks->error == LKA_TEMPFAIL)
-				m_add_string(p_smtp, "451 Temporary failure");
+				m_add_string(p, "451 Temporary failure");
 		}
 
-		m_close(p_smtp);
+		m_close(p);
 		while ((ep = TAILQ_FIRST(&lks->deliverylist)) != NULL) {
 			TAILQ_REMOVE(&lks->deliverylist, ep, entry);
 			free(ep);
@@ -276,6 +395,8 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 	struct envelope		ep;
 	struct expandnode	node;
 	struct mailaddr		maddr;
+	struct lka_expansion	*xc;
+	char			key[SMTPD_MAXLINESIZE];
 	int			r;
 	union lookup		lk;
 
@@ -328,7 +449,17 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 			mailaddr_to_username(&xn->u.mailaddr, maddr.user,
 			    sizeof maddr.user);
 
-			r = aliases_virtual_get(&lks->expand, &maddr);
+			(void)snprintf(key, sizeof key, "%s@%s", maddr.user,
+			    maddr.domain);
+			if ((xc = lka_expansion_get(lks, rule, "virtual", key))) {
+				lka_expansion_replay(lks, xc);
+				r = xc->ret;
+			}
+			else {
+				lka_expansion_start(lks);
+				r = aliases_virtual_get(&lks->expand, &maddr);
+				lka_expansion_put(lks, rule, "virtual", key, r, 0);
+			}
 			if (r == -1) {
 				lks->error = LKA_TEMPFAIL;
 				log_trace(TRACE_EXPAND, "expand: lka_expand: "
@@ -372,7 +503,17 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 		xn->mapping = rule->r_mapping;
 		xn->userbase = rule->r_userbase;
 		if (rule->r_mapping) {
-			r = aliases_get(&lks->expand, xn->u.user);
+			if ((xc = lka_expansion_get(lks, rule, "alias",
+			    xn->u.user))) {
+				lka_expansion_replay(lks, xc);
+				r = xc->ret;
+			}
+			else {
+				lka_expansion_start(lks);
+				r = aliases_get(&lks->expand, xn->u.user);
+				lka_expansion_put(lks, rule, "alias", xn->u.user,
+				    r, 0);
+			}
 			if (r == -1) {
 				log_trace(TRACE_EXPAND, "expand: lka_expand: "
 				    "error in alias lookup");
@@ -390,6 +531,12 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 			break;
 		}
 
+		/* the user was already known for this message */
+		if ((xc = lka_expansion_get(lks, rule, "forward", xn->u.user))) {
+			lka_session_forward(lks, rule, xn, -1, xc);
+			break;
+		}
+
 		r = table_lookup(rule->r_userbase, xn->u.user, K_USERINFO, &lk);
 		if (r == -1) {
 			log_trace(TRACE_EXPAND, "expand: lka_expand: "
@@ -459,6 +606,101 @@ lka_expand(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 	}
 }
 
+static struct lka_expansion *
+lka_expansion_get(struct lka_session *lks, struct rule *rule,
+    const char *kind, const char *value)
+{
+	struct lka_expansion	*xc;
+	char			 key[SMTPD_MAXLINESIZE];
+
+	if (! bsnprintf(key, sizeof key, "%08x:%p:%s:%s",
+	    evpid_to_msgid(lks->envelope.id), rule, kind, value))
+		return (NULL);
+	if ((xc = dict_get(&expansions, key)) == NULL)
+		return (NULL);
+	if (xc->expire < time(NULL)) {
+		lka_expansion_free(xc);
+		return (NULL);
+	}
+	log_trace(TRACE_EXPAND, "expand: reusing %s expansion for %s",
+	    kind, value);
+	return (xc);
+}
+
+static void
+lka_expansion_start(struct lka_session *lks)
+{
+	lks->expand.record = xcalloc(1, sizeof *lks->expand.record,
+	    "lka_expansion_start");
+}
+
+static void
+lka_expansion_put(struct lka_session *lks, struct rule *rule,
+    const char *kind, const char *value, int ret, int nofile)
+{
+	struct lka_expansion	*xc;
+	struct expandrecord	*rec;
+	char			 key[SMTPD_MAXLINESIZE];
+	time_t			 now;
+
+	rec = lks->expand.record;
+	lks->expand.record = NULL;
+
+	/* errors are not remembered */
+	if (ret == -1 || ! bsnprintf(key, sizeof key, "%08x:%p:%s:%s",
+	    evpid_to_msgid(lks->envelope.id), rule, kind, value)) {
+		if (rec)
+			free(rec->nodes);
+		free(rec);
+		return;
+	}
+
+	now = time(NULL);
+	while ((xc = TAILQ_FIRST(&expansions_lru)) &&
+	    (xc->expire < now || nexpansions >= EXPANSION_MAX))
+		lka_expansion_free(xc);
+	if ((xc = dict_get(&expansions, key)))
+		lka_expansion_free(xc);
+
+	xc = xcalloc(1, sizeof *xc, "lka_expansion_put");
+	xc->key = xstrdup(key, "lka_expansion_put");
+	xc->expire = now + EXPANSION_TTL;
+	xc->ret = ret;
+	xc->nofile = nofile;
+	xc->record = rec;
+	dict_set(&expansions, key, xc);
+	TAILQ_INSERT_TAIL(&expansions_lru, xc, entry);
+	nexpansions++;
+}
+
+/* insert the recorded nodes, return how many were new */
+static size_t
+lka_expansion_replay(struct lka_session *lks, struct lka_expansion *xc)
+{
+	struct expandnode	node;
+	size_t			i, save;
+
+	save = lks->expand.nb_nodes;
+	for (i = 0; xc->record && i < xc->record->count; i++) {
+		node = xc->record->nodes[i];
+		expand_insert(&lks->expand, &node);
+	}
+	return (lks->expand.nb_nodes - save);
+}
+
+static void
+lka_expansion_free(struct lka_expansion *xc)
+{
+	dict_xpop(&expansions, xc->key);
+	TAILQ_REMOVE(&expansions_lru, xc, entry);
+	nexpansions--;
+	if (xc->record)
+		free(xc->record->nodes);
+	free(xc->record);
+	free(xc->key);
+	free(xc);
+}
+
 static struct expandnode *
 lka_find_ancestor(struct expandnode *xn, enum expand_type type)
 {
@@ -483,6 +725,7 @@ lka_submit(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 
 	ep = xmemdup(&lks->envelope, sizeof *ep, "lka_submit");
 	ep->expire = rule->r_qexpire;
+	ep->priority = rule->r_priority;
 
 	switch (rule->r_action) {
 	case A_RELAY:
@@ -544,29 +787,34 @@ lka_submit(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 			strlcpy(ep->agent.mda.buffer, xn->u.buffer,
 			    sizeof ep->agent.mda.buffer);
 		}
-		else if (xn->type == EXPAND_USERNAME) {
+		else if (xn->type == EXPAND_USERNAME)
 			ep->agent.mda.method = rule->r_action;
-			strlcpy(ep->agent.mda.buffer, rule->r_value.buffer,
-			    sizeof ep->agent.mda.buffer);
-
-			memset(tag, 0, sizeof tag);
-			if (! mailaddr_tag(&ep->dest, tag, sizeof tag)) {
-				lks->error = LKA_PERMFAIL;
-				free(ep);
-				return;
-			}
-			if (rule->r_action == A_MAILDIR && tag[0]) {
-				strlcat(ep->agent.mda.buffer, "/.",
-				    sizeof(ep->agent.mda.buffer));
-				strlcat(ep->agent.mda.buffer, tag,
-				    sizeof(ep->agent.mda.buffer));
-			}
-		}
 		else
 			fatalx("lka_deliver: bad node type");
 
-		r = lka_expand_format(ep->agent.mda.buffer,
-		    sizeof(ep->agent.mda.buffer), ep, &lk.userinfo);
+		memset(tag, 0, sizeof tag);
+		if (xn->type == EXPAND_USERNAME &&
+		    ! mailaddr_tag(&ep->dest, tag, sizeof tag)) {
+			lks->error = LKA_PERMFAIL;
+			free(ep);
+			return;
+		}
+
+		/* the rule format was compiled at configuration time */
+		if (xn->type == EXPAND_USERNAME && rule->r_format)
+			r = lka_format_run(rule->r_format, ep->agent.mda.buffer,
+			    sizeof(ep->agent.mda.buffer), ep, &lk.userinfo);
+		else {
+			if (xn->type == EXPAND_USERNAME)
+				strlcpy(ep->agent.mda.buffer,
+				    rule->r_value.buffer,
+				    sizeof ep->agent.mda.buffer);
+			else
+				strlcpy(ep->agent.mda.buffer, xn->u.buffer,
+				    sizeof ep->agent.mda.buffer);
+			r = lka_expand_format(ep->agent.mda.buffer,
+			    sizeof(ep->agent.mda.buffer), ep, &lk.userinfo);
+		}
 		if (!r) {
 			lks->error = LKA_TEMPFAIL;
 			log_warnx("warn: format string error while"
@@ -574,6 +822,14 @@ lka_submit(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 			free(ep);
 			return;
 		}
+
+		/* the tag is sanitized, appending it after expansion is safe */
+		if (rule->r_action == A_MAILDIR && tag[0]) {
+			strlcat(ep->agent.mda.buffer, "/.",
+			    sizeof(ep->agent.mda.buffer));
+			strlcat(ep->agent.mda.buffer, tag,
+			    sizeof(ep->agent.mda.buffer));
+		}
 		break;
 	default:
 		fatalx("lka_submit: bad rule action");
@@ -583,22 +839,23 @@ lka_submit(struct lka_session *lks, struct rule *rule, struct expandnode *xn)
 }
 
 
-static size_t
-lka_expand_token(char *dest, size_t len, const char *token,
-    const struct envelope *ep, const struct userinfo *ui)
+/*
+ * Compile the %{token} between the braces: the field, the optional
+ * [begin:end] offsets and the modifiers.
+ */
+static int
+lka_format_token(struct expand_op *op, const char *token)
 {
 	char		rtoken[MAXTOKENLEN];
-	char		tmp[EXPAND_BUFFER];
-	const char     *string;
 	char	       *lbracket, *rbracket, *content, *sep, *mods;
-	ssize_t		i;
-	ssize_t		begoff, endoff;
+	size_t		i;
 	const char     *errstr = NULL;
-	int		replace = 1;
-	int		raw = 0;
 
-	begoff = 0;
-	endoff = EXPAND_BUFFER;
+	op->op = FORMAT_TOKEN;
+	op->begoff = 0;
+	op->endoff = EXPAND_BUFFER;
+	op->raw = 0;
+	op->nmods = 0;
 	mods = NULL;
 
 	if (strlcpy(rtoken, token, sizeof rtoken) >= sizeof rtoken)
@@ -615,68 +872,119 @@ lka_expand_token(char *dest, size_t len, const char *token,
 		 content  = lbracket + 1;
 
 		 if ((sep = strchr(content, ':')) == NULL)
-			 endoff = begoff = strtonum(content, -EXPAND_BUFFER,
-			     EXPAND_BUFFER, &errstr);
+			 op->endoff = op->begoff = strtonum(content,
+			     -EXPAND_BUFFER, EXPAND_BUFFER, &errstr);
 		 else {
 			 *sep = '\0';
 			 if (content != sep)
-				 begoff = strtonum(content, -EXPAND_BUFFER,
+				 op->begoff = strtonum(content, -EXPAND_BUFFER,
 				     EXPAND_BUFFER, &errstr);
 			 if (*(++sep)) {
 				 if (errstr == NULL)
-					 endoff = strtonum(sep, -EXPAND_BUFFER,
-					     EXPAND_BUFFER, &errstr);
+					 op->endoff = strtonum(sep,
+					     -EXPAND_BUFFER, EXPAND_BUFFER,
+					     &errstr);
 			 }
 		 }
 		 if (errstr)
 			 return 0;
 
 		 /* token:mod_1,mod_2,mod_n -> extract modifiers */
-		 mods = strchr(rbracket + 1, ':');
+		 if ((mods = strchr(rbracket + 1, ':')) != NULL)
+			 mods++;
 	} else {
 		if ((mods = strchr(rtoken, ':')) != NULL)
 			*mods++ = '\0';
 	}
 
+	for (i = 0; i < nitems(format_fields); ++i)
+		if (! strcasecmp(format_fields[i].name, rtoken))
+			break;
+	if (i == nitems(format_fields))
+		return 0;
+	op->field = format_fields[i].field;
+
+	if (mods != NULL) {
+		do {
+			if ((sep = strchr(mods, '|')) != NULL)
+				*sep++ = '\0';
+			for (i = 0; i < nitems(token_modifiers); ++i)
+				if (! strcasecmp(token_modifiers[i].name, mods))
+					break;
+			if (i == nitems(token_modifiers))
+				return 0; /* modifier not found */
+			if (token_modifiers[i].f == NULL)
+				op->raw = 1;
+			else if (op->nmods == nitems(op->mods))
+				return 0;
+			else
+				op->mods[op->nmods++] = i;
+		} while ((mods = sep) != NULL);
+	}
+
+	return 1;
+}
+
+static size_t
+lka_expand_token(char *dest, size_t len, const struct expand_op *op,
+    const struct envelope *ep, const struct userinfo *ui)
+{
+	char		tmp[EXPAND_BUFFER];
+	const char     *string;
+	char	       *p;
+	ssize_t		i;
+	ssize_t		begoff, endoff;
+	size_t		n;
+	int		replace = 1;
+
 	/* token -> expanded token */
-	if (! strcasecmp("sender", rtoken)) {
+	switch (op->field) {
+	case FIELD_SENDER:
 		if (snprintf(tmp, sizeof tmp, "%s@%s",
 			ep->sender.user, ep->sender.domain) <= 0)
 			return 0;
 		string = tmp;
-	}
-	else if (! strcasecmp("dest", rtoken)) {
+		break;
+	case FIELD_DEST:
 		if (snprintf(tmp, sizeof tmp, "%s@%s",
 			ep->dest.user, ep->dest.domain) <= 0)
 			return 0;
 		string = tmp;
-	}
-	else if (! strcasecmp("rcpt", rtoken)) {
+		break;
+	case FIELD_RCPT:
 		if (snprintf(tmp, sizeof tmp, "%s@%s",
 			ep->rcpt.user, ep->rcpt.domain) <= 0)
 			return 0;
 		string = tmp;
-	}
-	else if (! strcasecmp("sender.user", rtoken))
+		break;
+	case FIELD_SENDER_USER:
 		string = ep->sender.user;
-	else if (! strcasecmp("sender.domain", rtoken))
+		break;
+	case FIELD_SENDER_DOMAIN:
 		string = ep->sender.domain;
-	else if (! strcasecmp("user.username", rtoken))
+		break;
+	case FIELD_USER_USERNAME:
 		string = ui->username;
-	else if (! strcasecmp("user.directory", rtoken)) {
+		break;
+	case FIELD_USER_DIRECTORY:
 		string = ui->directory;
 		replace = 0;
-	}
-	else if (! strcasecmp("dest.user", rtoken))
+		break;
+	case FIELD_DEST_USER:
 		string = ep->dest.user;
-	else if (! strcasecmp("dest.domain", rtoken))
+		break;
+	case FIELD_DEST_DOMAIN:
 		string = ep->dest.domain;
-	else if (! strcasecmp("rcpt.user", rtoken))
+		break;
+	case FIELD_RCPT_USER:
 		string = ep->rcpt.user;
-	else if (! strcasecmp("rcpt.domain", rtoken))
+		break;
+	case FIELD_RCPT_DOMAIN:
 		string = ep->rcpt.domain;
-	else
+		break;
+	default:
 		return 0;
+	}
 
 	if (string != tmp) {
 		if (strlcpy(tmp, string, sizeof tmp) >= sizeof tmp)
@@ -685,36 +993,23 @@ lka_expand_token(char *dest, size_t len, const char *token,
 	}
 
 	/*  apply modifiers */
-	if (mods != NULL) {
-		do {
-			if ((sep = strchr(mods, '|')) != NULL)
-				*sep++ = '\0';
-			for (i = 0; (size_t)i < nitems(token_modifiers); ++i) {
-				if (! strcasecmp(token_modifiers[i].name, mods)) {
-					if (token_modifiers[i].f == NULL) {
-						raw = 1;
-						break;
-					}
-					if (! token_modifiers[i].f(tmp, sizeof tmp))
-						return 0; /* modifier error */
-					break;
-				}
-			}
-			if ((size_t)i == nitems(token_modifiers))
-				return 0; /* modifier not found */
-		} while ((mods = sep) != NULL);
-	}
-	
-	if (! raw)
-		for (i = 0; (size_t)i < strlen(tmp); ++i)
-			if (strchr(unsafe, tmp[i]))
-				tmp[i] = ':';
+	for (n = 0; n < op->nmods; n++)
+		if (! token_modifiers[op->mods[n]].f(tmp, sizeof tmp))
+			return 0; /* modifier error */
+
+	if (! op->raw)
+		for (p = tmp; *p; ++p)
+			if (strchr(unsafe, *p))
+				*p = ':';
 
 	/* expanded string is empty */
 	i = strlen(string);
 	if (i == 0)
 		return 0;
 
+	begoff = op->begoff;
+	endoff = op->endoff;
+
 	/* begin offset beyond end of string */
 	if (begoff >= i)
 		return 0;
@@ -752,86 +1047,183 @@ lka_expand_token(char *dest, size_t len, const char *token,
 	return endoff - begoff;
 }
 
-
-static size_t
-lka_expand_format(char *buf, size_t len, const struct envelope *ep,
-    const struct userinfo *ui)
+static struct expand_op *
+lka_format_op(struct expand_format *f, enum format_op type)
 {
-	char		tmpbuf[EXPAND_BUFFER], *ptmp, *pbuf, *ebuf;
-	char		exptok[EXPAND_BUFFER];
-	size_t		exptoklen;
-	char		token[MAXTOKENLEN];
-	size_t		ret, tmpret;
+	struct expand_op	*ops;
 
-	if (len < sizeof tmpbuf)
-		fatalx("lka_expand_format: tmp buffer < rule buffer");
+	ops = reallocarray(f->ops, f->nops + 1, sizeof *f->ops);
+	if (ops == NULL)
+		fatal("lka_format_op: reallocarray");
+	f->ops = ops;
+	memset(&f->ops[f->nops], 0, sizeof *f->ops);
+	f->ops[f->nops].op = type;
+
+	return (&f->ops[f->nops++]);
+}
 
-	memset(tmpbuf, 0, sizeof tmpbuf);
-	pbuf = buf;
-	ptmp = tmpbuf;
-	ret = tmpret = 0;
+/*
+ * A format is turned once into the list of what to copy, so that
+ * expanding it for each recipient does not parse it again: runs of
+ * literal text, the user directory for a leading ~/, and the tokens.
+ */
+struct expand_format *
+lka_format_compile(const char *buf)
+{
+	struct expand_format	*f;
+	struct expand_op	*op;
+	const char		*p, *e;
+	char			 token[MAXTOKENLEN], *t;
+
+	f = xcalloc(1, sizeof *f, "lka_format_compile");
+	f->text = xmalloc(strlen(buf) + 1, "lka_format_compile");
+	t = f->text;
+	p = buf;
 
 	/* special case: ~/ only allowed expanded at the beginning */
-	if (strncmp(pbuf, "~/", 2) == 0) {
-		tmpret = snprintf(ptmp, sizeof tmpbuf, "%s/", ui->directory);
-		if (tmpret >= sizeof tmpbuf) {
-			log_warnx("warn: user directory for %s too large",
-			    ui->directory);
-			return 0;
-		}
-		ret  += tmpret;
-		ptmp += tmpret;
-		pbuf += 2;
+	if (strncmp(p, "~/", 2) == 0) {
+		(void)lka_format_op(f, FORMAT_HOMEDIR);
+		p += 2;
 	}
 
-
-	/* expansion loop */
-	for (; *pbuf && ret < sizeof tmpbuf; ret += tmpret) {
-		if (*pbuf == '%' && *(pbuf + 1) == '%') {
-			*ptmp++ = *pbuf++;
-			pbuf  += 1;
-			tmpret = 1;
+	while (*p) {
+		if (*p == '%' && *(p + 1) == '{') {
+			/* %{...} otherwise fail */
+			if ((e = strchr(p + 1, '}')) == NULL)
+				goto fail;
+
+			/* extract token from %{token} */
+			if ((size_t)(e - p) - 1 >= sizeof token)
+				goto fail;
+			memcpy(token, p + 2, e - p - 2);
+			token[e - p - 2] = '\0';
+
+			op = lka_format_op(f, FORMAT_TOKEN);
+			if (! lka_format_token(op, token))
+				goto fail;
+			p = e + 1;
 			continue;
 		}
 
-		if (*pbuf != '%' || *(pbuf + 1) != '{') {
-			*ptmp++ = *pbuf++;
-			tmpret = 1;
-			continue;
+		if (f->nops == 0 || f->ops[f->nops - 1].op != FORMAT_LITERAL) {
+			op = lka_format_op(f, FORMAT_LITERAL);
+			op->text = t;
 		}
+		else
+			op = &f->ops[f->nops - 1];
 
-		/* %{...} otherwise fail */
-		if (*(pbuf+1) != '{' || (ebuf = strchr(pbuf+1, '}')) == NULL)
-			return 0;
+		*t++ = *p++;
+		/* %% -> % */
+		if (*(p - 1) == '%' && *p == '%')
+			p++;
+		op->len++;
+	}
 
-		/* extract token from %{token} */
-		if ((size_t)(ebuf - pbuf) - 1 >= sizeof token)
-			return 0;
+	return (f);
 
-		memcpy(token, pbuf+2, ebuf-pbuf-1);
-		if (strchr(token, '}') == NULL)
-			return 0;
-		*strchr(token, '}') = '\0';
+fail:
+	lka_format_free(f);
+	return (NULL);
+}
 
-		exptoklen = lka_expand_token(exptok, sizeof exptok, token, ep,
-		    ui);
-		if (exptoklen == 0)
-			return 0;
+void
+lka_format_free(struct expand_format *f)
+{
+	if (f == NULL)
+		return;
+	free(f->ops);
+	free(f->text);
+	free(f);
+}
+
+static size_t
+lka_format_run(const struct expand_format *f, char *buf, size_t len,
+    const struct envelope *ep, const struct userinfo *ui)
+{
+	char		 tmpbuf[EXPAND_BUFFER];
+	struct expand_op *op;
+	size_t		 i, n, ret;
+
+	ret = 0;
+	for (i = 0; i < f->nops; i++) {
+		op = &f->ops[i];
+		switch (op->op) {
+		case FORMAT_LITERAL:
+			n = op->len;
+			if (ret + n >= sizeof tmpbuf)
+				return 0;
+			memcpy(tmpbuf + ret, op->text, n);
+			break;
+
+		case FORMAT_HOMEDIR:
+			n = snprintf(tmpbuf + ret, sizeof tmpbuf - ret, "%s/",
+			    ui->directory);
+			if (n >= sizeof tmpbuf - ret) {
+				log_warnx("warn: user directory for %s too large",
+				    ui->directory);
+				return 0;
+			}
+			break;
+
+		case FORMAT_TOKEN:
+			n = lka_expand_token(tmpbuf + ret, sizeof tmpbuf - ret,
+			    op, ep, ui);
+			if (n == 0)
+				return 0;
+			break;
 
-		memcpy(ptmp, exptok, exptoklen);
-		pbuf   = ebuf + 1;
-		ptmp  += exptoklen;
-		tmpret = exptoklen;
+		default:
+			return 0;
+		}
+		ret += n;
 	}
-	if (ret >= sizeof tmpbuf)
+	tmpbuf[ret] = '\0';
+
+	if (ret >= len)
 		return 0;
+	memcpy(buf, tmpbuf, ret + 1);
 
-	if ((ret = strlcpy(buf, tmpbuf, len)) >= len)
+	return ret;
+}
+
+static size_t
+lka_expand_format(char *buf, size_t len, const struct envelope *ep,
+    const struct userinfo *ui)
+{
+	struct expand_format	*f;
+	size_t			 ret;
+
+	if (len < EXPAND_BUFFER)
+		fatalx("lka_expand_format: tmp buffer < rule buffer");
+
+	if ((f = lka_format_compile(buf)) == NULL)
 		return 0;
+	ret = lka_format_run(f, buf, len, ep, ui);
+	lka_format_free(f);
 
 	return ret;
 }
 
+/*
+ * Compile the formats of the delivery rules, they are expanded for
+ * every local recipient.  A format which does not compile is left to
+ * fail at delivery time, as it did before.
+ */
+void
+lka_format_compile_rules(void)
+{
+	struct rule	*r;
+
+	TAILQ_FOREACH(r, env->sc_rules, r_entry) {
+		if (r->r_decision != R_ACCEPT || r->r_action == A_RELAY ||
+		    r->r_action == A_RELAYVIA)
+			continue;
+		if ((r->r_format = lka_format_compile(r->r_value.buffer)) == NULL)
+			log_warnx("warn: invalid delivery format \"%s\"",
+			    r->r_value.buffer);
+	}
+}
+
 static void
 mailaddr_to_username(const struct mailaddr *maddr, char *dst, size_t len)
 {
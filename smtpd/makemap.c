@@ -51,12 +51,31 @@ static int parse_setentry(char *, size_t, size_t);
 static int make_plain(DBT *, char *);
 static int make_aliases(DBT *, char *);
 static char *conf_aliases(char *);
+static int db_get(DBT *);
+static int db_put(DBT *, DBT *);
+static int cdb_put(DBT *, DBT *);
+static int cdb_finish(void);
+static void cdb_put32(uint8_t *, uint32_t);
 
 DB	*db;
 char	*source;
 char	*oflag;
 int	 dbputs;
 
+/* -d cdb: records are appended to cdbfp, hash tables written at the end */
+struct cdbslot {
+	uint32_t	hash;
+	uint32_t	pos;
+};
+
+int		 cdb;
+FILE		*cdbfp;
+struct dict	 cdbkeys;
+struct cdbslot	*cdbslots;
+size_t		 cdbcount;
+size_t		 cdballoc;
+uint32_t	 cdbpos;
+
 struct smtpd	smtpd;
 struct smtpd	*env = &smtpd;
 
@@ -91,6 +110,7 @@ main(int argc, char *argv[])
 	DBTYPE		 dbtype = DB_HASH;
 	char		*p;
 	mode_t		 omode;
+	int		 fd;
 
 	log_init(1);
 
@@ -110,6 +130,8 @@ main(int argc, char *argv[])
 				dbtype = DB_BTREE;
 			else if (strcmp(optarg, "dbm") == 0)
 				dbtype = DB_RECNO;
+			else if (strcmp(optarg, "cdb") == 0)
+				cdb = 1;
 			else
 				errx(1, "unsupported DB type '%s'", optarg);
 			break;
@@ -169,7 +191,8 @@ main(int argc, char *argv[])
 		source = argv[0];
 	}
 
-	if (oflag == NULL && asprintf(&oflag, "%s.db", source) == -1)
+	if (oflag == NULL &&
+	    asprintf(&oflag, "%s.%s", source, cdb ? "cdb" : "db") == -1)
 		err(1, "asprintf");
 
 	if (strcmp(source, "-") != 0)
@@ -179,19 +202,35 @@ main(int argc, char *argv[])
 	if (! bsnprintf(dbname, sizeof(dbname), "%s.XXXXXXXXXXX", oflag))
 		errx(1, "path too long");
 	omode = umask(7077);
-	if (mkstemp(dbname) == -1)
+	if ((fd = mkstemp(dbname)) == -1)
 		err(1, "mkstemp");
 	umask(omode);
 
-	db = dbopen(dbname, O_EXLOCK|O_RDWR|O_SYNC, 0644, dbtype, NULL);
-	if (db == NULL) {
-		warn("dbopen: %s", dbname);
-		goto bad;
+	if (cdb) {
+		if ((cdbfp = fdopen(fd, "w")) == NULL) {
+			warn("fdopen: %s", dbname);
+			goto bad;
+		}
+		dict_init(&cdbkeys);
+		cdbpos = 2048;
+		if (fseek(cdbfp, cdbpos, SEEK_SET) == -1) {
+			warn("fseek: %s", dbname);
+			goto bad;
+		}
+	}
+	else {
+		close(fd);
+		db = dbopen(dbname, O_EXLOCK|O_RDWR|O_SYNC, 0644, dbtype, NULL);
+		if (db == NULL) {
+			warn("dbopen: %s", dbname);
+			goto bad;
+		}
+		fd = db->fd(db);
 	}
 
 	if (strcmp(source, "-") != 0)
-		if (fchmod(db->fd(db), sb.st_mode) == -1 ||
-		    fchown(db->fd(db), sb.st_uid, sb.st_gid) == -1) {
+		if (fchmod(fd, sb.st_mode) == -1 ||
+		    fchown(fd, sb.st_uid, sb.st_gid) == -1) {
 			warn("couldn't carry ownership and perms to %s",
 			    dbname);
 			goto bad;
@@ -200,7 +239,13 @@ main(int argc, char *argv[])
 	if (! parse_map(source))
 		goto bad;
 
-	if (db->close(db) == -1) {
+	if (cdb) {
+		if (! cdb_finish()) {
+			warn("%s", dbname);
+			goto bad;
+		}
+	}
+	else if (db->close(db) == -1) {
 		warn("dbclose: %s", dbname);
 		goto bad;
 	}
@@ -302,7 +347,7 @@ parse_mapentry(char *line, size_t len, size_t lineno)
 	key.size = strlen(keyp) + 1;
 
 	xlowercase(key.data, key.data, strlen(key.data) + 1);
-	if (db->get(db, &key, &val, 0) == 0) {
+	if (db_get(&key)) {
 		warnx("%s:%zd: duplicate entry for %s", source, lineno, keyp);
 		return 0;
 	}
@@ -316,7 +361,7 @@ parse_mapentry(char *line, size_t len, size_t lineno)
 			goto bad;
 	}
 
-	if (db->put(db, &key, &val, 0) == -1) {
+	if (! db_put(&key, &val)) {
 		warn("dbput");
 		return 0;
 	}
@@ -352,12 +397,12 @@ parse_setentry(char *line, size_t len, size_t lineno)
 	key.data = keyp;
 	key.size = strlen(keyp) + 1;
 	xlowercase(key.data, key.data, strlen(key.data) + 1);
-	if (db->get(db, &key, &val, 0) == 0) {
+	if (db_get(&key)) {
 		warnx("%s:%zd: duplicate entry for %s", source, lineno, keyp);
 		return 0;
 	}
 
-	if (db->put(db, &key, &val, 0) == -1) {
+	if (! db_put(&key, &val)) {
 		warn("dbput");
 		return 0;
 	}
@@ -367,6 +412,140 @@ parse_setentry(char *line, size_t len, size_t lineno)
 	return 1;
 }
 
+static int
+db_get(DBT *key)
+{
+	DBT	val;
+
+	if (cdb)
+		return dict_check(&cdbkeys, key->data);
+	return (db->get(db, key, &val, 0) == 0);
+}
+
+static int
+db_put(DBT *key, DBT *val)
+{
+	if (cdb)
+		return cdb_put(key, val);
+	return (db->put(db, key, val, 0) == 0);
+}
+
+static void
+cdb_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static int
+cdb_put(DBT *key, DBT *val)
+{
+	uint8_t	 hdr[8];
+	void	*tmp;
+
+	if (key->size > UINT32_MAX - cdbpos - 8 ||
+	    val->size > UINT32_MAX - cdbpos - 8 - key->size) {
+		errno = EFBIG;
+		return 0;
+	}
+
+	if (cdbcount == cdballoc) {
+		cdballoc = cdballoc ? cdballoc * 2 : 1024;
+		tmp = reallocarray(cdbslots, cdballoc, sizeof *cdbslots);
+		if (tmp == NULL)
+			err(1, "reallocarray");
+		cdbslots = tmp;
+	}
+	cdbslots[cdbcount].hash = cdb_hash(key->data, key->size);
+	cdbslots[cdbcount].pos = cdbpos;
+	cdbcount++;
+
+	cdb_put32(hdr, key->size);
+	cdb_put32(hdr + 4, val->size);
+	if (fwrite(hdr, sizeof hdr, 1, cdbfp) != 1 ||
+	    fwrite(key->data, key->size, 1, cdbfp) != 1 ||
+	    fwrite(val->data, val->size, 1, cdbfp) != 1)
+		return 0;
+	cdbpos += sizeof hdr + key->size + val->size;
+
+	dict_set(&cdbkeys, key->data, NULL);
+	return 1;
+}
+
+/*
+ * Write one hash table per low byte of the hashes, twice as many slots
+ * as entries, then the header pointing to them.
+ */
+static int
+cdb_finish(void)
+{
+	struct cdbslot	*table, *sorted;
+	uint8_t		 header[2048], slot[8];
+	size_t		 count[256], start[256], tlen, i, j, n;
+	uint32_t	 h;
+
+	if (cdbcount * 2 * sizeof slot > UINT32_MAX - cdbpos) {
+		errno = EFBIG;
+		return 0;
+	}
+
+	/* group the slots by table */
+	memset(count, 0, sizeof count);
+	for (i = 0; i < cdbcount; i++)
+		count[cdbslots[i].hash & 0xff]++;
+	for (h = 0, n = 0; h < 256; h++) {
+		start[h] = n;
+		n += count[h];
+	}
+	sorted = xcalloc(cdbcount ? cdbcount : 1, sizeof *sorted, "cdb_finish");
+	for (i = 0; i < cdbcount; i++)
+		sorted[start[cdbslots[i].hash & 0xff]++] = cdbslots[i];
+
+	table = xcalloc(cdbcount ? cdbcount * 2 : 1, sizeof *table,
+	    "cdb_finish");
+	for (h = 0; h < 256; h++) {
+		tlen = count[h] * 2;
+		cdb_put32(header + h * 8, cdbpos);
+		cdb_put32(header + h * 8 + 4, tlen);
+		if (tlen == 0)
+			continue;
+
+		/* start[h] is now the end of the group */
+		memset(table, 0, tlen * sizeof *table);
+		for (i = start[h] - count[h]; i < start[h]; i++) {
+			j = (sorted[i].hash >> 8) % tlen;
+			while (table[j].pos)
+				if (++j == tlen)
+					j = 0;
+			table[j] = sorted[i];
+		}
+		for (j = 0; j < tlen; j++) {
+			cdb_put32(slot, table[j].hash);
+			cdb_put32(slot + 4, table[j].pos);
+			if (fwrite(slot, sizeof slot, 1, cdbfp) != 1)
+				goto fail;
+		}
+		cdbpos += tlen * sizeof slot;
+	}
+	free(sorted);
+	free(table);
+
+	if (fseek(cdbfp, 0, SEEK_SET) == -1 ||
+	    fwrite(header, sizeof header, 1, cdbfp) != 1 ||
+	    fflush(cdbfp) == EOF ||
+	    fsync(fileno(cdbfp)) == -1 ||
+	    fclose(cdbfp) == EOF)
+		return 0;
+	return 1;
+
+fail:
+	free(sorted);
+	free(table);
+	return 0;
+}
+
 int
 make_plain(DBT *val, char *text)
 {
@@ -42,8 +42,6 @@
 #include "smtpd.h"
 #include "log.h"
 
-#define MDA_HIWAT		65536
-
 struct mda_envelope {
 	TAILQ_ENTRY(mda_envelope)	 entry;
 	uint64_t			 id;
@@ -54,13 +52,21 @@ struct mda_envelope {
 	enum action_type		 method;
 	char				*user;
 	char				*buffer;
+	int				 looped;
+	struct evptrace			 trace;
 };
 
+TAILQ_HEAD(mda_envelopeq, mda_envelope);
+
 #define USER_WAITINFO	0x01
 #define USER_RUNNABLE	0x02
 #define USER_ONHOLD	0x04
 #define USER_HOLDQ	0x08
 
+#define	MDA_OK		0
+#define	MDA_TEMPFAIL	1
+#define	MDA_PERMFAIL	2
+
 struct mda_user {
 	uint64_t			id;
 	TAILQ_ENTRY(mda_user)		entry;
@@ -68,7 +74,7 @@ struct mda_user {
 	char				name[SMTPD_MAXLOGNAME];
 	char				usertable[SMTPD_MAXPATHLEN];
 	size_t				evpcount;
-	TAILQ_HEAD(, mda_envelope)	envelopes;
+	struct mda_envelopeq		envelopes;
 	int				flags;
 	size_t				running;
 	struct userinfo			userinfo;
@@ -78,6 +84,7 @@ struct mda_session {
 	uint64_t		 id;
 	struct mda_user		*user;
 	struct mda_envelope	*evp;
+	struct mda_envelopeq	 batch;	/* same message, same delivery */
 	struct io		 io;
 	struct iobuf		 iobuf;
 	FILE			*datafp;
@@ -87,9 +94,11 @@ static void mda_imsg(struct mproc *, struct imsg *);
 static void mda_io(struct io *, int);
 static void mda_shutdown(void);
 static void mda_sig_handler(int, short, void *);
-static int mda_check_loop(FILE *, struct mda_envelope *);
+static int mda_check_loop(struct mda_session *);
+static int mda_check_batch(struct mda_session *);
 static int mda_getlastline(int, char *, size_t);
 static void mda_done(struct mda_session *);
+static void mda_result(struct mda_session *, int, const char *, const char *);
 static void mda_fail(struct mda_user *, int, const char *, enum enhanced_status_code);
 static void mda_drain(void);
 static void mda_log(const struct mda_envelope *, const char *, const char *);
@@ -111,7 +120,9 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 	struct mda_session	*s;
 	struct mda_user		*u;
 	struct mda_envelope	*e;
+	struct ctl_limit	 limit;
 	struct envelope		 evp;
+	struct evptrace		 trace;
 	struct userinfo		*userinfo;
 	struct deliver		 deliver;
 	struct msg		 m;
@@ -160,6 +171,13 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		case IMSG_MDA_DELIVER:
 			m_msg(&m, imsg);
 			m_get_envelope(&m, &evp);
+			memset(&trace, 0, sizeof(trace));
+			if (!m_is_eom(&m)) {
+				m_get_data(&m, &data, &sz);
+				if (sz != sizeof(trace))
+					fatalx("mda: bad trace size");
+				memmove(&trace, data, sz);
+			}
 			m_end(&m);
 
 			u = mda_user(&evp);
@@ -183,6 +201,7 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 			}
 
 			e = mda_envelope(&evp);
+			e->trace = trace;
 			TAILQ_INSERT_TAIL(&u->envelopes, e, entry);
 			u->evpcount += 1;
 			stat_increment("mda.pending", 1);
@@ -206,9 +225,8 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 
 			if (imsg->fd == -1) {
 				log_debug("debug: mda: cannot get message fd");
-				queue_tempfail(e->id, "Cannot get message fd",
-				    ESC_OTHER_MAIL_SYSTEM_STATUS);
-				mda_log(e, "TempFail", "Cannot get message fd");
+				mda_result(s, MDA_TEMPFAIL, "Cannot get message fd",
+				    NULL);
 				mda_done(s);
 				return;
 			}
@@ -220,41 +238,63 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 			if ((s->datafp = fdopen(imsg->fd, "r")) == NULL) {
 				log_warn("warn: mda: fdopen");
 				close(imsg->fd);
-				queue_tempfail(e->id, "fdopen failed",
-				    ESC_OTHER_MAIL_SYSTEM_STATUS);
-				mda_log(e, "TempFail", "fdopen failed");
-				mda_done(s);
-				return;
-			}
-
-			/* check delivery loop */
-			if (mda_check_loop(s->datafp, e)) {
-				log_debug("debug: mda: loop detected");
-				queue_loop(e->id);
-				mda_log(e, "PermFail", "Loop detected");
+				mda_result(s, MDA_TEMPFAIL, "fdopen failed", NULL);
 				mda_done(s);
 				return;
 			}
 
-			/* start queueing delivery headers */
+			/*
+			 * Start queueing delivery headers, a Delivered-To for
+			 * each address the copy stands for.
+			 */
+			n = 0;
 			if (e->sender[0])
 				/* XXX: remove exising Return-Path, if any */
 				n = iobuf_fqueue(&s->iobuf,
-				    "Return-Path: %s\nDelivered-To: %s\n",
-				    e->sender, e->rcpt ? e->rcpt : e->dest);
-			else
-				n = iobuf_fqueue(&s->iobuf,
-				    "Delivered-To: %s\n",
-				    e->rcpt ? e->rcpt : e->dest);
+				    "Return-Path: %s\n", e->sender);
+			if (n != -1)
+				n = mda_check_batch(s);
 			if (n == -1) {
 				log_warn("warn: mda: "
 				    "fail to write delivery info");
-				queue_tempfail(e->id, "Out of memory",
-				    ESC_OTHER_MAIL_SYSTEM_STATUS);
-				mda_log(e, "TempFail", "Out of memory");
+				mda_result(s, MDA_TEMPFAIL, "Out of memory", NULL);
+				mda_done(s);
+				return;
+			}
+
+			/* check delivery loop, queueing the message headers */
+			if (mda_check_loop(s) == -1) {
+				log_warn("warn: mda: "
+				    "fail to queue message headers");
+				mda_result(s, MDA_TEMPFAIL, "Out of memory", NULL);
+				mda_done(s);
+				return;
+			}
+			if (s->evp->looped) {
+				/* no envelope of the batch left */
 				mda_done(s);
 				return;
 			}
+			e = s->evp;
+
+			/*
+			 * The LMTP server adds the trace headers itself, the
+			 * session hands the message over from the start.
+			 */
+			if (e->method == A_LMTP) {
+				if (fseek(s->datafp, 0, SEEK_SET) == -1) {
+					log_warn("warn: mda: fseek");
+					mda_result(s, MDA_TEMPFAIL, "fseek failed",
+					    NULL);
+					mda_done(s);
+					return;
+				}
+				lmtp_deliver(s->id, e->buffer, e->sender,
+				    &s->user->userinfo, evpid_to_msgid(e->id),
+				    s->datafp);
+				s->datafp = NULL;
+				return;
+			}
 
 			/* request parent to fork a helper process */
 			userinfo = &s->user->userinfo;
@@ -302,17 +342,6 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 				    sizeof deliver.to);
 				break;
 
-			case A_LMTP:
-				deliver.mode = A_LMTP;
-				deliver.userinfo = *userinfo;
-				strlcpy(deliver.user, userinfo->username,
-				    sizeof(deliver.user));
-				strlcpy(deliver.to, e->buffer,
-				    sizeof(deliver.to));
-				strlcpy(deliver.from, e->sender,
-				    sizeof(deliver.from));
-				break;
-
 			default:
 				errx(1, "mda: unknown delivery method: %d",
 				    e->method);
@@ -338,12 +367,10 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 			m_end(&m);
 
 			s = tree_xget(&sessions, reqid);
-			e = s->evp;
 			if (imsg->fd == -1) {
 				log_warn("warn: mda: fail to retrieve mda fd");
-				queue_tempfail(e->id, "Cannot get mda fd",
-				    ESC_OTHER_MAIL_SYSTEM_STATUS);
-				mda_log(e, "TempFail", "Cannot get mda fd");
+				mda_result(s, MDA_TEMPFAIL, "Cannot get mda fd",
+				    NULL);
 				mda_done(s);
 				return;
 			}
@@ -357,6 +384,14 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 			io_set_write(&s->io);
 			return;
 
+		case IMSG_PARENT_LMTP_CONNECT:
+			m_msg(&m, imsg);
+			m_get_id(&m, &reqid);
+			m_get_string(&m, &parent_error);
+			m_end(&m);
+			lmtp_connected(reqid, imsg->fd, parent_error);
+			return;
+
 		case IMSG_MDA_DONE:
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
@@ -364,7 +399,6 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 			m_end(&m);
 
 			s = tree_xget(&sessions, reqid);
-			e = s->evp;
 			/*
 			 * Grab last line of mda stdout/stderr if available.
 			 */
@@ -385,15 +419,11 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 
 			/* update queue entry */
 			if (error) {
-				queue_tempfail(e->id, error,
-				    ESC_OTHER_MAIL_SYSTEM_STATUS);
 				snprintf(buf, sizeof buf, "Error (%s)", error);
-				mda_log(e, "TempFail", buf);
-			}
-			else {
-				queue_ok(e->id);
-				mda_log(e, "Ok", "Delivered");
+				mda_result(s, MDA_TEMPFAIL, error, buf);
 			}
+			else
+				mda_result(s, MDA_OK, NULL, NULL);
 			mda_done(s);
 			return;
 
@@ -413,6 +443,22 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 		}
 	}
 
+	if (p->proc == PROC_CONTROL) {
+		switch (imsg->hdr.type) {
+		case IMSG_CTL_SET_LIMIT:
+			memmove(&limit, imsg->data, sizeof limit);
+			n = limit_set(limit.name, limit.value);
+			if (n) {
+				log_info("info: mda: limit %s set to %lld",
+				    limit.name, (long long)limit.value);
+				mda_drain();
+			}
+			m_compose(p, n ? IMSG_CTL_OK : IMSG_CTL_FAIL,
+			    imsg->hdr.peerid, 0, -1, NULL, 0);
+			return;
+		}
+	}
+
 	errx(1, "mda_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
 }
 
@@ -502,17 +548,15 @@ static void
 mda_io(struct io *io, int evt)
 {
 	struct mda_session	*s = io->arg;
-	char			*ln;
-	size_t			 len;
+	off_t			 off;
+	int			 fd;
 
 	log_trace(TRACE_IO, "mda: %p: %s %s", s, io_strevent(evt),
 	    io_strio(io));
 
 	switch (evt) {
 	case IO_LOWAT:
-
 		/* done */
-	   done:
 		if (s->datafp == NULL) {
 			log_debug("debug: mda: all data sent for session"
 			    " %016"PRIx64 " evpid %016"PRIx64,
@@ -521,26 +565,14 @@ mda_io(struct io *io, int evt)
 			return;
 		}
 
-		while (iobuf_queued(&s->iobuf) < MDA_HIWAT) {
-			if ((ln = fgetln(s->datafp, &len)) == NULL)
-				break;
-			if (iobuf_queue(&s->iobuf, ln, len) == -1) {
-				m_create(p_parent, IMSG_PARENT_KILL_MDA,
-				    0, 0, -1);
-				m_add_id(p_parent, s->id);
-				m_add_string(p_parent, "Out of memory");
-				m_close(p_parent);
-				io_pause(io, IO_PAUSE_OUT);
-				return;
-			}
-#if 0
-			log_debug("debug: mda: %zu bytes queued "
-			    "for session %016"PRIx64 " evpid %016"PRIx64,
-			    iobuf_queued(&s->iobuf), s->id, s->evp->id);
-#endif
-		}
-
-		if (ferror(s->datafp)) {
+		/*
+		 * The headers are out, the io sends the rest of the file
+		 * straight from the descriptor.
+		 */
+		fd = -1;
+		if (ferror(s->datafp) ||
+		    (off = ftello(s->datafp)) == -1 ||
+		    (fd = dup(fileno(s->datafp))) == -1) {
 			log_debug("debug: mda: ferror on session %016"PRIx64,
 			    s->id);
 			m_create(p_parent, IMSG_PARENT_KILL_MDA, 0, 0, -1);
@@ -551,15 +583,12 @@ mda_io(struct io *io, int evt)
 			return;
 		}
 
-		if (feof(s->datafp)) {
-			log_debug("debug: mda: end-of-file for session"
-			    " %016"PRIx64 " evpid %016"PRIx64,
-			    s->id, s->evp->id);
-			fclose(s->datafp);
-			s->datafp = NULL;
- 			if (iobuf_queued(&s->iobuf) == 0)
-				goto done;
-		}
+		log_debug("debug: mda: sending body from offset %lld for "
+		    "session %016"PRIx64 " evpid %016"PRIx64,
+		    (long long)off, s->id, s->evp->id);
+		fclose(s->datafp);
+		s->datafp = NULL;
+		io_set_source(io, fd, off);
 		return;
 
 	case IO_TIMEOUT:
@@ -587,45 +616,91 @@ mda_io(struct io *io, int evt)
 	}
 }
 
+/*
+ * Queue a Delivered-To header for each distinct address of the envelopes
+ * sharing the copy.
+ */
 static int
-mda_check_loop(FILE *fp, struct mda_envelope *e)
+mda_check_batch(struct mda_session *s)
 {
-	char		*buf, *lbuf;
-	size_t		 len;
-	int		 ret = 0;
-
-	lbuf = NULL;
-	while ((buf = fgetln(fp, &len))) {
-		if (buf[len - 1] == '\n')
-			buf[len - 1] = '\0';
-		else {
-			/* EOF without EOL, copy and add the NUL */
-			lbuf = xmalloc(len + 1, "mda_check_loop");
-			memcpy(lbuf, buf, len);
-			lbuf[len] = '\0';
-			buf = lbuf;
-		}
+	struct mda_envelope	*e, *o;
 
-		if (strchr(buf, ':') == NULL && !isspace((unsigned char)*buf))
-			break;
+#define	ADDR(e)	((e)->rcpt ? (e)->rcpt : (e)->dest)
+	if (iobuf_fqueue(&s->iobuf, "Delivered-To: %s\n", ADDR(s->evp)) == -1)
+		return (-1);
 
-		if (strncasecmp("Delivered-To: ", buf, 14) == 0) {
-			if (strcasecmp(buf + 14, e->dest) == 0) {
-				ret = 1;
+	TAILQ_FOREACH(e, &s->batch, entry) {
+		if (strcmp(ADDR(e), ADDR(s->evp)) == 0)
+			continue;
+		TAILQ_FOREACH(o, &s->batch, entry)
+			if (o == e || strcmp(ADDR(o), ADDR(e)) == 0)
 				break;
-			}
-		}
-		if (lbuf) {
-			free(lbuf);
-			lbuf = NULL;
-		}
+		if (o != e)
+			continue;
+		if (iobuf_fqueue(&s->iobuf, "Delivered-To: %s\n", ADDR(e)) == -1)
+			return (-1);
 	}
-	if (lbuf)
-		free(lbuf);
+#undef ADDR
+
+	return (0);
+}
+
+/*
+ * Look for our own Delivered-To header.  The header lines are queued for
+ * delivery as they are read, the body then follows from the same point
+ * in mda_io(), so the file is read only once.  The envelopes found to
+ * loop are done with, the first one left leads the session.
+ */
+static int
+mda_check_loop(struct mda_session *s)
+{
+	struct mda_envelope	*e, *next;
+	char			*ln;
+	size_t			 len, n;
+
+	while ((ln = fgetln(s->datafp, &len))) {
+		if (iobuf_queue(&s->iobuf, ln, len) == -1)
+			return (-1);
 
-	fseek(fp, SEEK_SET, 0);
+		n = len;
+		if (ln[n - 1] == '\n')
+			n--;
 
-	return (ret);
+		if (memchr(ln, ':', n) == NULL &&
+		    !(n && isspace((unsigned char)*ln)))
+			break;
+
+		if (n <= 14 || strncasecmp("Delivered-To: ", ln, 14))
+			continue;
+		for (e = s->evp; e; e = (e == s->evp) ?
+		    TAILQ_FIRST(&s->batch) : TAILQ_NEXT(e, entry))
+			if (n == 14 + strlen(e->dest) &&
+			    strncasecmp(ln + 14, e->dest, n - 14) == 0)
+				e->looped = 1;
+	}
+
+	for (e = TAILQ_FIRST(&s->batch); e; e = next) {
+		next = TAILQ_NEXT(e, entry);
+		if (! e->looped)
+			continue;
+		TAILQ_REMOVE(&s->batch, e, entry);
+		log_debug("debug: mda: loop detected");
+		queue_loop(e->id);
+		mda_log(e, "PermFail", "Loop detected");
+		mda_envelope_free(e);
+	}
+	if (s->evp->looped) {
+		log_debug("debug: mda: loop detected");
+		queue_loop(s->evp->id);
+		mda_log(s->evp, "PermFail", "Loop detected");
+		if ((e = TAILQ_FIRST(&s->batch))) {
+			TAILQ_REMOVE(&s->batch, e, entry);
+			mda_envelope_free(s->evp);
+			s->evp = e;
+		}
+	}
+
+	return (0);
 }
 
 static int
@@ -693,6 +768,7 @@ static void
 mda_drain(void)
 {
 	struct mda_user		*u;
+	size_t			 n;
 
 	while ((u = (TAILQ_FIRST(&runnable)))) {
 
@@ -727,9 +803,12 @@ mda_drain(void)
 			return;
 		}
 
+		n = u->evpcount;
 		mda_session(u);
 
-		if (u->evpcount == env->sc_mda_task_lowat) {
+		/* a batch may take the count past the low watermark */
+		if (n > env->sc_mda_task_lowat &&
+		    u->evpcount <= env->sc_mda_task_lowat) {
 			if (u->flags & USER_ONHOLD) {
 				log_debug("debug: mda: down to lowat for user \"%s\": releasing",
 				    mda_user_to_text(u));
@@ -751,11 +830,17 @@ mda_drain(void)
 static void
 mda_done(struct mda_session *s)
 {
+	struct mda_envelope	*e;
+
 	log_debug("debug: mda: session %016" PRIx64 " done", s->id);
 
 	tree_xpop(&sessions, s->id);
 
 	mda_envelope_free(s->evp);
+	while ((e = TAILQ_FIRST(&s->batch))) {
+		TAILQ_REMOVE(&s->batch, e, entry);
+		mda_envelope_free(e);
+	}
 
 	s->user->running--;
 	if (!(s->user->flags & USER_RUNNABLE)) {
@@ -777,10 +862,62 @@ mda_done(struct mda_session *s)
 	mda_drain();
 }
 
+/* the reply of the LMTP server for the envelope of session id */
+void
+mda_lmtp_done(uint64_t id, const char *reply)
+{
+	struct mda_session	*s;
+	char			 buf[SMTPD_MAXLINESIZE];
+
+	s = tree_xget(&sessions, id);
+
+	snprintf(buf, sizeof buf, "Error (%s)", reply);
+	if (reply[0] == '2')
+		mda_result(s, MDA_OK, NULL, NULL);
+	else if (reply[0] == '5')
+		mda_result(s, MDA_PERMFAIL, reply, buf);
+	else
+		mda_result(s, MDA_TEMPFAIL, reply, buf);
+	mda_done(s);
+}
+
+/* report the outcome for all the envelopes of the session */
+static void
+mda_result(struct mda_session *s, int status, const char *reason,
+    const char *text)
+{
+	struct mda_envelope	*e;
+
+	if (text == NULL)
+		text = reason;
+
+	for (e = s->evp; e; e = (e == s->evp) ? TAILQ_FIRST(&s->batch) :
+	    TAILQ_NEXT(e, entry)) {
+		switch (status) {
+		case MDA_OK:
+			queue_ok(e->id);
+			if (e->trace.ts[EVPTRACE_ACCEPT])
+				e->trace.ts[EVPTRACE_DONE] = evptrace_now();
+			mda_log(e, "Ok", "Delivered");
+			break;
+		case MDA_PERMFAIL:
+			queue_permfail(e->id, reason,
+			    ESC_OTHER_MAIL_SYSTEM_STATUS);
+			mda_log(e, "PermFail", text);
+			break;
+		default:
+			queue_tempfail(e->id, reason,
+			    ESC_OTHER_MAIL_SYSTEM_STATUS);
+			mda_log(e, "TempFail", text);
+		}
+	}
+}
+
 static void
 mda_log(const struct mda_envelope *evp, const char *prefix, const char *status)
 {
 	char rcpt[SMTPD_MAXLINESIZE];
+	char latency[256];
 	const char *method;
 
 	rcpt[0] = '\0';
@@ -800,8 +937,10 @@ mda_log(const struct mda_envelope *evp, const char *prefix, const char *status)
 	else
 		method = "???";
 
+	evptrace_log(&evp->trace, evp->id, latency, sizeof latency);
+
 	log_info("delivery: %s for %016" PRIx64 ": from=<%s>, to=<%s>, "
-	    "%suser=%s, method=%s, delay=%s, stat=%s",
+	    "%suser=%s, method=%s, delay=%s, stat=%s%s",
 	    prefix,
 	    evp->id,
 	    evp->sender ? evp->sender : "",
@@ -810,12 +949,14 @@ mda_log(const struct mda_envelope *evp, const char *prefix, const char *status)
 	    evp->user,
 	    method,
 	    duration_to_text(time(NULL) - evp->creation),
-	    status);
+	    status,
+	    latency);
 }
 
 static struct mda_user *
 mda_user(const struct envelope *evp)
 {
+	struct mproc	*p;
 	struct mda_user	*u;
 	void		*i;
 
@@ -835,11 +976,12 @@ mda_user(const struct envelope *evp)
 
 	tree_xset(&users, u->id, u);
 
-	m_create(p_lka, IMSG_LKA_USERINFO, 0, 0, -1);
-	m_add_id(p_lka, u->id);
-	m_add_string(p_lka, evp->agent.mda.usertable);
-	m_add_string(p_lka, evp->agent.mda.username);
-	m_close(p_lka);
+	p = lka_peer(u->id);
+	m_create(p, IMSG_LKA_USERINFO, 0, 0, -1);
+	m_add_id(p, u->id);
+	m_add_string(p, evp->agent.mda.usertable);
+	m_add_string(p, evp->agent.mda.username);
+	m_close(p);
 	u->flags |= USER_WAITINFO;
 
 	stat_increment("mda.user", 1);
@@ -919,12 +1061,15 @@ mda_envelope_free(struct mda_envelope *e)
 static struct mda_session *
 mda_session(struct mda_user * u)
 {
-	struct mda_session *s;
+	struct mda_session	*s;
+	struct mda_envelope	*e, *next;
+	size_t			 n = 1;
 
 	s = xcalloc(1, sizeof *s, "mda_session");
 	s->id = generate_uid();
 	s->user = u;
 	s->io.sock = -1;
+	s->io.src = -1;
 	if (iobuf_init(&s->iobuf, 0, 0) == -1)
 		fatal("mda_session");
 
@@ -935,12 +1080,30 @@ mda_session(struct mda_user * u)
 	u->evpcount--;
 	u->running++;
 
-	stat_decrement("mda.pending", 1);
+	/*
+	 * The other envelopes of the message with the same delivery share
+	 * the session, it makes a single copy for them.
+	 */
+	TAILQ_INIT(&s->batch);
+	for (e = TAILQ_FIRST(&u->envelopes); e; e = next) {
+		next = TAILQ_NEXT(e, entry);
+		if (evpid_to_msgid(e->id) != evpid_to_msgid(s->evp->id) ||
+		    e->method != s->evp->method ||
+		    strcmp(e->buffer, s->evp->buffer) ||
+		    strcmp(e->sender, s->evp->sender))
+			continue;
+		TAILQ_REMOVE(&u->envelopes, e, entry);
+		TAILQ_INSERT_TAIL(&s->batch, e, entry);
+		u->evpcount--;
+		n++;
+	}
+
+	stat_decrement("mda.pending", n);
 	stat_increment("mda.running", 1);
 
 	log_debug("debug: mda: new session %016" PRIx64
-	    " for user \"%s\" evpid %016" PRIx64, s->id,
-	    mda_user_to_text(u), s->evp->id);
+	    " for user \"%s\" evpid %016" PRIx64 " (%zu envelope%s)", s->id,
+	    mda_user_to_text(u), s->evp->id, n, n > 1 ? "s" : "");
 
 	m_create(p_queue, IMSG_QUEUE_MESSAGE_FD, 0, 0, -1);
 	m_add_id(p_queue, s->id);
@@ -55,6 +55,7 @@ static void mfa_sig_handler(int, short, void *);
 static void mfa_tx_io(struct io *, int);
 static int mfa_tx(uint64_t, int);
 static void mfa_tx_done(struct mfa_tx *);
+static void mfa_tx_response(uint64_t, int);
 
 struct tree tx_tree;
 
@@ -64,6 +65,7 @@ mfa_imsg(struct mproc *p, struct imsg *imsg)
 	struct sockaddr_storage	 local, remote;
 	struct mailaddr		 maddr;
 	struct msg		 m;
+	struct mproc		*peer;
 	const char		*line, *hostname;
 	uint64_t		 reqid;
 	uint32_t		 datalen; /* XXX make it off_t? */
@@ -160,9 +162,28 @@ mfa_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_int(&m, &success);
 			m_end(&m);
 
+			/* no filter reads the data, smtp writes the file */
+			if (! mfa_filter_data(reqid)) {
+				peer = smtp_peer(reqid);
+				m_create(peer, IMSG_QUEUE_MESSAGE_FILE, 0, 0,
+				    imsg->fd);
+				m_add_id(peer, reqid);
+				m_add_int(peer, success);
+				m_add_int(peer, 1);
+				m_close(peer);
+				return;
+			}
+
 			fdout = mfa_tx(reqid, imsg->fd);
 			mfa_build_fd_chain(reqid, fdout);
 			return;
+
+		case IMSG_QUEUE_MESSAGE_FILE_RO:
+			m_msg(&m, imsg);
+			m_get_id(&m, &reqid);
+			m_end(&m);
+			mfa_set_message_fd(reqid, imsg->fd);
+			return;
 		}
 	}
 
@@ -286,7 +307,7 @@ mfa(void)
 	config_peer(PROC_CONTROL);
 	config_done();
 
-	mproc_disable(p_smtp);
+	smtp_enable(0);
 
 	if (event_dispatch() < 0)
 		fatal("event_dispatch");
@@ -299,7 +320,7 @@ void
 mfa_ready(void)
 {
 	log_debug("debug: mfa ready");
-	mproc_enable(p_smtp);
+	smtp_enable(1);
 }
 
 static int
@@ -388,27 +409,35 @@ mfa_tx_done(struct mfa_tx *tx)
 		tx->error = 1;
 	}
 
-	if (tx->error) {
+	mfa_tx_response(tx->reqid, tx->error);
+	free(tx);
+}
+
+static void
+mfa_tx_response(uint64_t reqid, int error)
+{
+	struct mproc	*p;
+
+	p = smtp_peer(reqid);
+	if (error) {
 		log_debug("debug: mfa: tx error");
 
-		m_create(p_smtp, IMSG_MFA_SMTP_RESPONSE, 0, 0, -1);
-		m_add_id(p_smtp, tx->reqid);
-		m_add_int(p_smtp, MFA_FAIL);
-		m_add_u32(p_smtp, 0);
-		m_add_string(p_smtp, "Internal server error");
-		m_close(p_smtp);
+		m_create(p, IMSG_MFA_SMTP_RESPONSE, 0, 0, -1);
+		m_add_id(p, reqid);
+		m_add_int(p, MFA_FAIL);
+		m_add_u32(p, 0);
+		m_add_string(p, "Internal server error");
+		m_close(p);
 	}
 	else {
 		/* XXX we could send the commit message here directly */
-		m_create(p_smtp, IMSG_MFA_SMTP_RESPONSE, 0, 0, -1);
-		m_add_id(p_smtp, tx->reqid);
-		m_add_int(p_smtp, MFA_OK);
-		m_add_u32(p_smtp, 300);
-		m_add_string(p_smtp, "This is not to be sent to the client");
-		m_close(p_smtp);
+		m_create(p, IMSG_MFA_SMTP_RESPONSE, 0, 0, -1);
+		m_add_id(p, reqid);
+		m_add_int(p, MFA_OK);
+		m_add_u32(p, 300);
+		m_add_string(p, "This is not to be sent to the client");
+		m_close(p);
 	}
-
-	free(tx);
 }
 
 void
@@ -416,7 +445,11 @@ mfa_report_eom(uint64_t reqid, size_t size)
 {
 	struct mfa_tx	*tx;
 
-	tx = tree_xget(&tx_tree, reqid);
+	/* the data went to the queue file without going through here */
+	if ((tx = tree_get(&tx_tree, reqid)) == NULL) {
+		mfa_tx_response(reqid, 0);
+		return;
+	}
 
 	tx->datalen = size;
 	tx->eom = 1;
@@ -63,7 +63,8 @@ struct mfa_filterproc {
 
 struct mfa_filter {
 	TAILQ_ENTRY(mfa_filter)		 entry;
-	struct mfa_filterproc		*proc;
+	struct mfa_filterproc	       **procs;	/* the workers */
+	int				 nprocs;
 };
 TAILQ_HEAD(mfa_filters, mfa_filter);
 
@@ -73,6 +74,7 @@ struct mfa_session {
 	TAILQ_HEAD(mfa_queries, mfa_query)	 queries;
 	struct mfa_filters			*filters;
 	struct mfa_filter			*fcurr;
+	int					 msgfd;	/* read-only */
 };
 
 struct mfa_query {
@@ -111,6 +113,8 @@ static struct mfa_query *mfa_query(struct mfa_session *, int, int);
 static void mfa_drain_query(struct mfa_query *);
 static void mfa_run_query(struct mfa_filter *, struct mfa_query *);
 static void mfa_set_fdout(struct mfa_session *, int);
+static struct mfa_filterproc *mfa_filter_proc(struct mfa_filter *,
+    struct mfa_session *);
 
 static TAILQ_HEAD(, mfa_filterproc)	procs;
 struct dict				chains;
@@ -149,7 +153,8 @@ mfa_extend_chain(struct mfa_filters *chain, const char *name)
 		log_debug("mfa:     adding filter \"%s\"", name);
 		n = xcalloc(1, sizeof(*n), "mfa_extend_chain");
 		fchain = dict_get(&chains, name);
-		n->proc = TAILQ_FIRST(fchain)->proc;
+		n->procs = TAILQ_FIRST(fchain)->procs;
+		n->nprocs = TAILQ_FIRST(fchain)->nprocs;
 		TAILQ_INSERT_TAIL(chain, n, entry);
 	}
 }
@@ -183,21 +188,29 @@ mfa_filter_prepare(void)
 
 		log_debug("mfa: building simple chain \"%s\"", filter->name);
 
-		proc = xcalloc(1, sizeof(*proc), "mfa_filter_init");
-		p = &proc->mproc;
-		p->handler = mfa_filter_imsg;
-		p->proc = PROC_FILTER;
-		p->name = xstrdup(filter->name, "mfa_filter_init");
-		p->data = proc;
-		if (mproc_fork(p, filter->path, filter->name) < 0)
-			fatalx("mfa_filter_init");
-
-		log_debug("mfa: registering proc \"%s\"", filter->name);
-
 		f = xcalloc(1, sizeof(*f), "mfa_filter_init");
-		f->proc = proc;
+		f->nprocs = filter->procs ? filter->procs : 1;
+		f->procs = xcalloc(f->nprocs, sizeof(*f->procs),
+		    "mfa_filter_init");
+
+		/* sessions are spread over the workers of the filter */
+		for (i = 0; i < f->nprocs; i++) {
+			proc = xcalloc(1, sizeof(*proc), "mfa_filter_init");
+			p = &proc->mproc;
+			p->handler = mfa_filter_imsg;
+			p->proc = PROC_FILTER;
+			p->name = xstrdup(filter->name, "mfa_filter_init");
+			p->data = proc;
+			if (mproc_fork(p, filter->path, filter->name) < 0)
+				fatalx("mfa_filter_init");
+
+			log_debug("mfa: registering proc \"%s\" (%d/%d)",
+			    filter->name, i + 1, f->nprocs);
+
+			f->procs[i] = proc;
+			TAILQ_INSERT_TAIL(&procs, proc, entry);
+		}
 
-		TAILQ_INSERT_TAIL(&procs, proc, entry);
 		fchain = xcalloc(1, sizeof(*fchain), "mfa_filter_prepare");
 		TAILQ_INIT(fchain);
 		TAILQ_INSERT_TAIL(fchain, f, entry);
@@ -284,12 +297,18 @@ mfa_filter_event(uint64_t id, int event)
 		s = xcalloc(1, sizeof(*s), "mfa_filter_event");
 		s->id = id;
 		s->filters = dict_xget(&chains, "default");
+		s->msgfd = -1;
 		TAILQ_INIT(&s->queries);
 		tree_xset(&sessions, s->id, s);
 	}
-	else if (event == EVENT_DISCONNECT)
+	else if (event == EVENT_DISCONNECT) {
 		/* On disconnect, the session is virtualy dead */
 		s = tree_xpop(&sessions, id);
+		if (s->msgfd != -1) {
+			close(s->msgfd);
+			s->msgfd = -1;
+		}
+	}
 	else
 		s = tree_xget(&sessions, id);
 	q = mfa_query(s, QT_EVENT, event);
@@ -378,9 +397,9 @@ mfa_set_fdout(struct mfa_session *s, int fdout)
 	struct mproc	*p;
 
 	while(s->fcurr) {
-		if (s->fcurr->proc->hooks & HOOK_DATALINE) {
+		if (s->fcurr->procs[0]->hooks & HOOK_DATALINE) {
 			log_trace(TRACE_MFA, "mfa: sending fd %d to %s", fdout, mfa_filter_to_text(s->fcurr));
-			p = &s->fcurr->proc->mproc;
+			p = &mfa_filter_proc(s->fcurr, s)->mproc;
 			m_create(p, IMSG_FILTER_PIPE_SETUP, 0, 0, fdout);
 			m_add_id(p, s->id);
 			m_close(p);
@@ -391,13 +410,51 @@ mfa_set_fdout(struct mfa_session *s, int fdout)
 
 	log_trace(TRACE_MFA, "mfa: chain input is %d", fdout);
 
-	m_create(p_smtp, IMSG_QUEUE_MESSAGE_FILE, 0, 0, fdout);
-	m_add_id(p_smtp, s->id);
-	m_add_int(p_smtp, 1);
-	m_close(p_smtp);
+	p = smtp_peer(s->id);
+	m_create(p, IMSG_QUEUE_MESSAGE_FILE, 0, 0, fdout);
+	m_add_id(p, s->id);
+	m_add_int(p, 1);
+	m_add_int(p, 0);
+	m_close(p);
 	return;
 }
 
+/* whether a filter of the session chain wants to see the message data */
+int
+mfa_filter_data(uint64_t id)
+{
+	struct mfa_session	*s;
+	struct mfa_filter	*f;
+
+	s = tree_xget(&sessions, id);
+	TAILQ_FOREACH(f, s->filters, entry)
+		if (f->procs[0]->hooks & HOOK_DATALINE)
+			return (1);
+	return (0);
+}
+
+/* keep the message file for the filters that scan it at eom */
+void
+mfa_set_message_fd(uint64_t id, int fd)
+{
+	struct mfa_session	*s;
+	struct mfa_filter	*f;
+
+	s = tree_xget(&sessions, id);
+	if (s->msgfd != -1)
+		close(s->msgfd);
+	s->msgfd = -1;
+
+	TAILQ_FOREACH(f, s->filters, entry)
+		if (f->procs[0]->hooks & HOOK_MESSAGE)
+			break;
+	if (f == NULL || mfa_filter_data(id)) {
+		close(fd);
+		return;
+	}
+	s->msgfd = fd;
+}
+
 void
 mfa_build_fd_chain(uint64_t id, int fdout)
 {
@@ -438,6 +495,7 @@ static void
 mfa_drain_query(struct mfa_query *q)
 {
 	struct mfa_query	*prev;
+	struct mproc		*p;
 
 	log_trace(TRACE_MFA, "filter: draining query %s", mfa_query_to_text(q));
 
@@ -492,16 +550,21 @@ mfa_drain_query(struct mfa_query *q)
 
 		/* ...and send the SMTP response */
 		if (q->hook == QUERY_EOM) {
+			if (q->session->msgfd != -1) {
+				close(q->session->msgfd);
+				q->session->msgfd = -1;
+			}
 			mfa_report_eom(q->session->id, q->u.datalen);
 		}
 		else {
-			m_create(p_smtp, IMSG_MFA_SMTP_RESPONSE, 0, 0, -1);
-			m_add_id(p_smtp, q->session->id);
-			m_add_int(p_smtp, q->smtp.status);
-			m_add_u32(p_smtp, q->smtp.code);
+			p = smtp_peer(q->session->id);
+			m_create(p, IMSG_MFA_SMTP_RESPONSE, 0, 0, -1);
+			m_add_id(p, q->session->id);
+			m_add_int(p, q->smtp.status);
+			m_add_u32(p, q->smtp.code);
 			if (q->smtp.response)
-				m_add_string(p_smtp, q->smtp.response);
-			m_close(p_smtp);
+				m_add_string(p, q->smtp.response);
+			m_close(p);
 		}
 		free(q->smtp.response);
 	}
@@ -511,41 +574,62 @@ mfa_drain_query(struct mfa_query *q)
 	free(q);
 }
 
+/* the worker of the filter that holds the state of the session */
+static struct mfa_filterproc *
+mfa_filter_proc(struct mfa_filter *f, struct mfa_session *s)
+{
+	return (f->procs[s->id % f->nprocs]);
+}
+
 static void
 mfa_run_query(struct mfa_filter *f, struct mfa_query *q)
 {
+	struct mproc	*p;
+	int		 fd = -1;
+
+	p = &mfa_filter_proc(f, q->session)->mproc;
+
 	if (q->type == QT_QUERY) {
 
 		log_trace(TRACE_MFA, "filter: running filter %s for query %s",
 		    mfa_filter_to_text(f), mfa_query_to_text(q));
 
-		m_create(&f->proc->mproc, IMSG_FILTER_QUERY, 0, 0, -1);
-		m_add_id(&f->proc->mproc, q->session->id);
-		m_add_id(&f->proc->mproc, q->qid);
-		m_add_int(&f->proc->mproc, q->hook);
+		/*
+		 * The file is complete at eom only if no filter rewrites
+		 * the data on its way to it.
+		 */
+		if (q->hook == QUERY_EOM && f->procs[0]->hooks & HOOK_MESSAGE &&
+		    q->session->msgfd != -1 && !mfa_filter_data(q->session->id))
+			if ((fd = dup(q->session->msgfd)) == -1)
+				log_warn("warn: mfa: dup");
+
+		m_create(p, IMSG_FILTER_QUERY, 0, 0, fd);
+		m_add_id(p, q->session->id);
+		m_add_id(p, q->qid);
+		m_add_int(p, q->hook);
 
 		switch (q->hook) {
 		case QUERY_CONNECT:
-			m_add_sockaddr(&f->proc->mproc,
+			m_add_sockaddr(p,
 			    (struct sockaddr *)&q->u.connect.local);
-			m_add_sockaddr(&f->proc->mproc,
+			m_add_sockaddr(p,
 			    (struct sockaddr *)&q->u.connect.remote);
-			m_add_string(&f->proc->mproc, q->u.connect.hostname);
+			m_add_string(p, q->u.connect.hostname);
 			break;
 		case QUERY_HELO:
-			m_add_string(&f->proc->mproc, q->u.line);
+			m_add_string(p, q->u.line);
 			break;
 		case QUERY_MAIL:
 		case QUERY_RCPT:
-			m_add_mailaddr(&f->proc->mproc, &q->u.maddr);
+			m_add_mailaddr(p, &q->u.maddr);
 			break;
 		case QUERY_EOM:
-			m_add_u32(&f->proc->mproc, q->u.datalen);
+			m_add_u32(p, q->u.datalen);
 			break;
 		default:
 			break;
 		}
-		m_close(&f->proc->mproc);
+		m_close(p);
 
 		tree_xset(&queries, q->qid, q);
 		q->state = QUERY_RUNNING;
@@ -554,10 +638,10 @@ mfa_run_query(struct mfa_filter *f, struct mfa_query *q)
 		log_trace(TRACE_MFA, "filter: running filter %s for query %s",
 		    mfa_filter_to_text(f), mfa_query_to_text(q));
 
-		m_create(&f->proc->mproc, IMSG_FILTER_EVENT, 0, 0, -1);
-		m_add_id(&f->proc->mproc, q->session->id);
-		m_add_int(&f->proc->mproc, q->hook);
-		m_close(&f->proc->mproc);
+		m_create(p, IMSG_FILTER_EVENT, 0, 0, -1);
+		m_add_id(p, q->session->id);
+		m_add_int(p, q->hook);
+		m_close(p);
  	}
 }
 
@@ -709,7 +793,7 @@ mfa_filter_to_text(struct mfa_filter *f)
 {
 	static char buf[1024];
 
-	snprintf(buf, sizeof buf, "filter:%s", mfa_filterproc_to_text(f->proc));
+	snprintf(buf, sizeof buf, "filter:%s", mfa_filterproc_to_text(f->procs[0]));
 
 	return (buf);
 }
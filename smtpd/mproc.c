@@ -17,6 +17,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/tree.h>
 #include <sys/queue.h>
@@ -40,9 +41,60 @@
 
 static void mproc_event_add(struct mproc *);
 static void mproc_dispatch(int, short, void *);
+static void mproc_dispatch_batch(struct mproc *, struct imsg *);
+static void m_batch_timeout(int, short, void *);
+static void m_batch_flush(struct mproc *);
 
 static ssize_t msgbuf_write2(struct msgbuf *);
 
+static void m_enqueue(struct mproc *, uint32_t, uint32_t, pid_t, int,
+    const struct iovec *, int);
+static int ring_put(struct mproc_ring *, const struct imsg_hdr *,
+    const struct iovec *, int);
+static void ring_notify(struct mproc *, volatile uint32_t *);
+static void mproc_ring_flush(struct mproc *);
+static void mproc_ring_drain(struct mproc *);
+static void mproc_ring_timeout(int, short, void *);
+static void mproc_flush_timeout(int, short, void *);
+
+/*
+ * Writes are deferred to the end of the event loop iteration, so that
+ * a single sendmsg() carries all the imsgs queued meanwhile, unless
+ * enough is queued already.
+ */
+#define	M_FLUSH_MSGS	64
+#define	M_FLUSH_BYTES	16384
+
+/* the channel whose imsg is being handled, for m_get_envelope() */
+static struct mproc		*m_inproc = NULL;
+
+static TAILQ_HEAD(, mproc)	m_flushq = TAILQ_HEAD_INITIALIZER(m_flushq);
+static struct event		m_flush_ev;
+static int			m_flush_armed = 0;
+
+/*
+ * Optional shared memory transport.  Messages to a peer are framed as
+ * imsgs in a single producer, single consumer ring that both processes
+ * map before forking.  The socketpair is then only used for wakeups
+ * and for the file descriptors attached to ring messages, which the
+ * consumer picks up in order.
+ */
+struct mproc_ring {
+	volatile uint64_t	 head;		/* written by the producer */
+	char			 pad0[56];
+	volatile uint64_t	 tail;		/* written by the consumer */
+	char			 pad1[56];
+	volatile uint32_t	 sleeping;	/* consumer wants a wakeup */
+	volatile uint32_t	 full;		/* producer wants a wakeup */
+	size_t			 size;
+	char			 data[];
+};
+
+#define	RING_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+#define	RING_F_PAD	0x1000		/* wrap to the start of the ring */
+#define	RING_F_FD	0x2000		/* fd comes on the socket */
+#define	RING_DRAIN_MAX	1024		/* messages per event */
+
 int
 mproc_fork(struct mproc *p, const char *path, const char *arg)
 {
@@ -88,19 +140,85 @@ mproc_init(struct mproc *p, int fd)
 void
 mproc_clear(struct mproc *p)
 {
+	if (p->f_queued) {
+		TAILQ_REMOVE(&m_flushq, p, f_entry);
+		p->f_queued = 0;
+	}
+	if (p->b_count)
+		evtimer_del(&p->b_ev);
+	free(p->b_evpids);
+	p->b_evpids = NULL;
+	p->b_count = 0;
 	event_del(&p->ev);
 	close(p->imsgbuf.fd);
 	imsg_clear(&p->imsgbuf);
+
+	if (p->r_in) {
+		evtimer_del(&p->r_ev);
+		mproc_ring_free(p->r_in);
+		mproc_ring_free(p->r_out);
+		p->r_in = p->r_out = NULL;
+	}
+	free(p->r_pend);
+	p->r_pend = NULL;
+	p->r_pendlen = p->r_pendalloc = 0;
+	while (p->r_nfds)
+		close(p->r_fds[--p->r_nfds]);
+	free(p->r_fds);
+	p->r_fds = NULL;
+	p->r_fdalloc = 0;
+
+	free(p->e_out);
+	free(p->e_in);
+	p->e_out = p->e_in = NULL;
+}
+
+struct mproc_ring *
+mproc_ring_new(size_t size)
+{
+	struct mproc_ring	*r;
+
+	r = mmap(NULL, sizeof(*r) + size, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (r == MAP_FAILED)
+		fatal("mproc_ring_new: mmap");
+	r->size = size;
+	r->sleeping = 1;
+
+	return (r);
+}
+
+void
+mproc_ring_free(struct mproc_ring *r)
+{
+	if (r)
+		munmap(r, sizeof(*r) + r->size);
+}
+
+void
+mproc_set_ring(struct mproc *p, struct mproc_ring *out, struct mproc_ring *in)
+{
+	p->r_out = out;
+	p->r_in = in;
+	evtimer_set(&p->r_ev, mproc_ring_timeout, p);
 }
 
 void
 mproc_enable(struct mproc *p)
 {
+	struct timeval	tv;
+
 	if (p->enable == 0) {
 		log_trace(TRACE_MPROC, "mproc: %s -> %s: enabled",
 		    proc_name(smtpd_process),
 		    proc_name(p->proc));
 		p->enable = 1;
+		/* no wakeup comes for what was left on the ring */
+		if (p->r_in) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			evtimer_add(&p->r_ev, &tv);
+		}
 	}
 	mproc_event_add(p);
 }
@@ -120,15 +238,31 @@ mproc_disable(struct mproc *p)
 static void
 mproc_event_add(struct mproc *p)
 {
-	short	events;
+	struct timeval	tv;
+	short		events;
 
 	if (p->enable)
 		events = EV_READ;
 	else
 		events = 0;
 
-	if (p->imsgbuf.w.queued)
-		events |= EV_WRITE;
+	if (p->imsgbuf.w.queued) {
+		if (p->f_flush || p->imsgbuf.w.queued >= M_FLUSH_MSGS ||
+		    p->bytes_queued >= M_FLUSH_BYTES)
+			events |= EV_WRITE;
+		else if (!p->f_queued) {
+			TAILQ_INSERT_TAIL(&m_flushq, p, f_entry);
+			p->f_queued = 1;
+			if (!m_flush_armed) {
+				tv.tv_sec = 0;
+				tv.tv_usec = 0;
+				evtimer_set(&m_flush_ev, mproc_flush_timeout,
+				    NULL);
+				evtimer_add(&m_flush_ev, &tv);
+				m_flush_armed = 1;
+			}
+		}
+	}
 
 	if (p->events)
 		event_del(&p->ev);
@@ -140,12 +274,27 @@ mproc_event_add(struct mproc *p)
 	}
 }
 
+static void
+mproc_flush_timeout(int fd, short event, void *arg)
+{
+	struct mproc	*p;
+
+	m_flush_armed = 0;
+	while ((p = TAILQ_FIRST(&m_flushq)) != NULL) {
+		TAILQ_REMOVE(&m_flushq, p, f_entry);
+		p->f_queued = 0;
+		p->f_flush = 1;
+		mproc_event_add(p);
+	}
+}
+
 static void
 mproc_dispatch(int fd, short event, void *arg)
 {
 	struct mproc	*p = arg;
 	struct imsg	 imsg;
 	ssize_t		 n;
+	uint32_t	 queued;
 
 	p->events = 0;
 
@@ -169,6 +318,7 @@ mproc_dispatch(int fd, short event, void *arg)
 	}
 
 	if (event & EV_WRITE) {
+		queued = p->imsgbuf.w.queued;
 		n = msgbuf_write2(&p->imsgbuf.w);
 		if (n == 0 || (n == -1 && errno != EAGAIN)) {
 			/* this pipe is dead, so remove the event handler */
@@ -181,7 +331,12 @@ mproc_dispatch(int fd, short event, void *arg)
 		} else if (n != -1) {
 			p->bytes_out += n;
 			p->bytes_queued -= n;
+			p->w_calls += 1;
+			p->w_msgs += queued - p->imsgbuf.w.queued;
 		}
+		/* keep writing until all is out, then defer again */
+		if (p->imsgbuf.w.queued == 0)
+			p->f_flush = 0;
 	}
 
 	for (;;) {
@@ -193,12 +348,39 @@ mproc_dispatch(int fd, short event, void *arg)
 		if (n == 0)
 			break;
 
+		if (imsg.hdr.type == IMSG_RING_WAKEUP) {
+			imsg_free(&imsg);
+			continue;
+		}
+		if (imsg.hdr.type == IMSG_RING_FD) {
+			if (p->r_nfds == p->r_fdalloc) {
+				p->r_fdalloc = p->r_fdalloc ? p->r_fdalloc * 2 : 8;
+				p->r_fds = realloc(p->r_fds,
+				    p->r_fdalloc * sizeof *p->r_fds);
+				if (p->r_fds == NULL)
+					fatal("mproc_dispatch: realloc");
+			}
+			p->r_fds[p->r_nfds++] = imsg.fd;
+			imsg_free(&imsg);
+			continue;
+		}
+
 		p->msg_in += 1;
-		p->handler(p, &imsg);
+		m_inproc = p;
+		if (imsg.hdr.type == IMSG_BATCH)
+			mproc_dispatch_batch(p, &imsg);
+		else
+			p->handler(p, &imsg);
+		m_inproc = NULL;
 
 		imsg_free(&imsg);
 	}
 
+	if (p->r_in)
+		mproc_ring_drain(p);
+	if (p->r_pendlen)
+		mproc_ring_flush(p);
+
 #if 0
 	if (smtpd_process == PROC_QUEUE)
 		queue_flow_control();
@@ -275,45 +457,300 @@ again:
 	return (n);
 }
 
+/*
+ * Queue a message for the peer, on the ring if there is one, in which
+ * case only the fd, if any, goes through the socket.  Messages that do
+ * not fit wait in r_pend until the consumer makes room.
+ */
+static void
+m_enqueue(struct mproc *p, uint32_t type, uint32_t peerid, pid_t pid, int fd,
+    const struct iovec *iov, int n)
+{
+	struct imsg_hdr	 hdr;
+	size_t		 len, alloc;
+	char		*tmp;
+	int		 i;
+
+	len = IMSG_HEADER_SIZE;
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+
+	if (p->r_out == NULL) {
+		if (imsg_composev(&p->imsgbuf, type, peerid, pid, fd, iov,
+		    n) == -1)
+			fatal("imsg_composev");
+		p->bytes_queued += len;
+		goto done;
+	}
+
+	if (len > MAX_IMSGSIZE)
+		fatalx("m_enqueue: message too large");
+
+	hdr.type = type;
+	hdr.len = len;
+	hdr.flags = 0;
+	hdr.peerid = peerid;
+	hdr.pid = pid ? pid : p->imsgbuf.pid;
+	if (fd != -1) {
+		hdr.flags |= RING_F_FD;
+		if (imsg_compose(&p->imsgbuf, IMSG_RING_FD, 0, 0, fd,
+		    NULL, 0) == -1)
+			fatal("imsg_compose");
+		p->bytes_queued += IMSG_HEADER_SIZE;
+	}
+
+	if (p->r_pendlen)
+		mproc_ring_flush(p);
+	if (p->r_pendlen == 0 && ring_put(p->r_out, &hdr, iov, n) == 0) {
+		p->bytes_out += len;
+		ring_notify(p, &p->r_out->sleeping);
+		goto done;
+	}
+
+	alloc = p->r_pendalloc ? p->r_pendalloc : 4096;
+	while (p->r_pendlen + len > alloc)
+		alloc *= 2;
+	if (alloc != p->r_pendalloc) {
+		tmp = realloc(p->r_pend, alloc);
+		if (tmp == NULL)
+			fatal("m_enqueue: realloc");
+		p->r_pend = tmp;
+		p->r_pendalloc = alloc;
+	}
+	memmove(p->r_pend + p->r_pendlen, &hdr, sizeof hdr);
+	p->r_pendlen += sizeof hdr;
+	for (i = 0; i < n; i++) {
+		memmove(p->r_pend + p->r_pendlen, iov[i].iov_base,
+		    iov[i].iov_len);
+		p->r_pendlen += iov[i].iov_len;
+	}
+	p->bytes_queued += len;
+	mproc_ring_flush(p);
+
+done:
+	p->msg_out += 1;
+	if (p->bytes_queued > p->bytes_queued_max)
+		p->bytes_queued_max = p->bytes_queued;
+
+	mproc_event_add(p);
+}
+
+/*
+ * Records are 8-byte aligned and never wrap: when the end of the ring is
+ * too short, a pad header sends the consumer back to the start, or it
+ * skips there by itself if not even a header fits.
+ */
+static int
+ring_put(struct mproc_ring *r, const struct imsg_hdr *hdr,
+    const struct iovec *iov, int n)
+{
+	struct imsg_hdr	 pad;
+	uint64_t	 head;
+	size_t		 off, end, len, need;
+	char		*dst;
+	int		 i;
+
+	head = r->head;
+	off = head & (r->size - 1);
+	end = r->size - off;
+	len = RING_ALIGN(hdr->len);
+	need = (end < len) ? end + len : len;
+
+	if (r->size - (head - r->tail) < need)
+		return (-1);
+	__sync_synchronize();
+
+	if (end < len) {
+		if (end >= IMSG_HEADER_SIZE) {
+			memset(&pad, 0, sizeof pad);
+			pad.flags = RING_F_PAD;
+			memmove(r->data + off, &pad, sizeof pad);
+		}
+		head += end;
+		off = 0;
+	}
+
+	dst = r->data + off;
+	memmove(dst, hdr, sizeof *hdr);
+	dst += sizeof *hdr;
+	for (i = 0; i < n; i++) {
+		memmove(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+
+	__sync_synchronize();
+	r->head = head + len;
+
+	return (0);
+}
+
+/* Tell the peer through the socket, if it is waiting for it. */
+static void
+ring_notify(struct mproc *p, volatile uint32_t *flag)
+{
+	__sync_synchronize();
+	if (*flag && __sync_bool_compare_and_swap(flag, 1, 0)) {
+		if (imsg_compose(&p->imsgbuf, IMSG_RING_WAKEUP, 0, 0, -1,
+		    NULL, 0) == -1)
+			fatal("imsg_compose");
+		/* written to the socket, so counted as any message there */
+		p->bytes_queued += IMSG_HEADER_SIZE;
+	}
+}
+
+static void
+mproc_ring_flush(struct mproc *p)
+{
+	struct imsg_hdr	hdr;
+	struct iovec	iov;
+	size_t		pos;
+	int		retry;
+
+	pos = 0;
+	for (retry = 0; pos < p->r_pendlen; ) {
+		memmove(&hdr, p->r_pend + pos, sizeof hdr);
+		iov.iov_base = p->r_pend + pos + sizeof hdr;
+		iov.iov_len = hdr.len - sizeof hdr;
+		if (ring_put(p->r_out, &hdr, &iov, 1) == -1) {
+			if (retry++)
+				break;
+			/* ask for a wakeup, then check again for a race */
+			p->r_out->full = 1;
+			__sync_synchronize();
+			continue;
+		}
+		pos += hdr.len;
+		p->bytes_out += hdr.len;
+		p->bytes_queued -= hdr.len;
+	}
+
+	if (pos) {
+		p->r_pendlen -= pos;
+		memmove(p->r_pend, p->r_pend + pos, p->r_pendlen);
+		ring_notify(p, &p->r_out->sleeping);
+		mproc_event_add(p);
+	}
+}
+
+static void
+mproc_ring_drain(struct mproc *p)
+{
+	struct mproc_ring	*r = p->r_in;
+	struct imsg		 imsg;
+	struct timeval		 tv;
+	uint64_t		 tail;
+	size_t			 off, end, count;
+
+	if (!p->enable)
+		return;
+
+	for (count = 0;; count++) {
+		tail = r->tail;
+		if (tail == r->head) {
+			/* go to sleep, unless something came in meanwhile */
+			r->sleeping = 1;
+			__sync_synchronize();
+			if (tail == r->head)
+				break;
+			r->sleeping = 0;
+		}
+		if (count == RING_DRAIN_MAX) {
+			/* let the other events run */
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			evtimer_add(&p->r_ev, &tv);
+			break;
+		}
+		__sync_synchronize();
+
+		off = tail & (r->size - 1);
+		end = r->size - off;
+		if (end < IMSG_HEADER_SIZE) {
+			r->tail = tail + end;
+			continue;
+		}
+		memmove(&imsg.hdr, r->data + off, sizeof imsg.hdr);
+		if (imsg.hdr.flags & RING_F_PAD) {
+			r->tail = tail + end;
+			continue;
+		}
+
+		imsg.fd = -1;
+		if (imsg.hdr.flags & RING_F_FD) {
+			/* wait for the socket to bring it */
+			if (p->r_nfds == 0)
+				break;
+			imsg.fd = p->r_fds[0];
+			p->r_nfds -= 1;
+			memmove(p->r_fds, p->r_fds + 1,
+			    p->r_nfds * sizeof *p->r_fds);
+		}
+		imsg.hdr.flags = 0;
+		imsg.data = r->data + off + IMSG_HEADER_SIZE;
+
+		p->msg_in += 1;
+		p->bytes_in += imsg.hdr.len;
+		m_inproc = p;
+		if (imsg.hdr.type == IMSG_BATCH)
+			mproc_dispatch_batch(p, &imsg);
+		else
+			p->handler(p, &imsg);
+		m_inproc = NULL;
+
+		__sync_synchronize();
+		r->tail = tail + RING_ALIGN(imsg.hdr.len);
+	}
+
+	if (r->full) {
+		ring_notify(p, &r->full);
+		mproc_event_add(p);
+	}
+}
+
+static void
+mproc_ring_timeout(int fd, short event, void *arg)
+{
+	struct mproc	*p = arg;
+
+	mproc_ring_drain(p);
+	if (p->r_pendlen)
+		mproc_ring_flush(p);
+}
+
 void
 m_forward(struct mproc *p, struct imsg *imsg)
 {
-	imsg_compose(&p->imsgbuf, imsg->hdr.type, imsg->hdr.peerid,
-	    imsg->hdr.pid, imsg->fd, imsg->data,
-	    imsg->hdr.len - sizeof(imsg->hdr));
+	struct iovec	iov;
+
+	m_batch_flush(p);
+	iov.iov_base = imsg->data;
+	iov.iov_len = imsg->hdr.len - sizeof(imsg->hdr);
+	m_enqueue(p, imsg->hdr.type, imsg->hdr.peerid, imsg->hdr.pid,
+	    imsg->fd, &iov, 1);
 
 	log_trace(TRACE_MPROC, "mproc: %s -> %s : %zu %s (forward)",
 		    proc_name(smtpd_process),
 		    proc_name(p->proc),
 		    imsg->hdr.len - sizeof(imsg->hdr),
 		    imsg_to_str(imsg->hdr.type));
-
-	p->msg_out += 1;
-	p->bytes_queued += imsg->hdr.len;
-	if (p->bytes_queued > p->bytes_queued_max)
-		p->bytes_queued_max = p->bytes_queued;
-
-	mproc_event_add(p);
 }
 
 void
 m_compose(struct mproc *p, uint32_t type, uint32_t peerid, pid_t pid, int fd,
     void *data, size_t len)
 {
-	imsg_compose(&p->imsgbuf, type, peerid, pid, fd, data, len);
+	struct iovec	iov;
+
+	m_batch_flush(p);
+	iov.iov_base = data;
+	iov.iov_len = len;
+	m_enqueue(p, type, peerid, pid, fd, &iov, 1);
 
 	log_trace(TRACE_MPROC, "mproc: %s -> %s : %zu %s",
 		    proc_name(smtpd_process),
 		    proc_name(p->proc),
 		    len,
 		    imsg_to_str(type));
-
-	p->msg_out += 1;
-	p->bytes_queued += len + IMSG_HEADER_SIZE;
-	if (p->bytes_queued > p->bytes_queued_max)
-		p->bytes_queued_max = p->bytes_queued;
-
-	mproc_event_add(p);
 }
 
 void
@@ -323,29 +760,24 @@ m_composev(struct mproc *p, uint32_t type, uint32_t peerid, pid_t pid,
 	size_t	len;
 	int	i;
 
-	imsg_composev(&p->imsgbuf, type, peerid, pid, fd, iov, n);
+	m_batch_flush(p);
+	m_enqueue(p, type, peerid, pid, fd, iov, n);
 
 	len = 0;
 	for (i = 0; i < n; i++)
 		len += iov[i].iov_len;
 
-	p->msg_out += 1;
-	p->bytes_queued += IMSG_HEADER_SIZE + len;
-	if (p->bytes_queued > p->bytes_queued_max)
-		p->bytes_queued_max = p->bytes_queued;
-
 	log_trace(TRACE_MPROC, "mproc: %s -> %s : %zu %s",
 		    proc_name(smtpd_process),
 		    proc_name(p->proc),
 		    len,
 		    imsg_to_str(type));
-
-	mproc_event_add(p);
 }
 
 void
 m_create(struct mproc *p, uint32_t type, uint32_t peerid, pid_t pid, int fd)
 {
+	m_batch_flush(p);
 	if (p->m_buf == NULL) {
 		p->m_alloc = 128;
 		log_trace(TRACE_MPROC, "mproc: %s -> %s: allocating %zu", 
@@ -399,22 +831,17 @@ m_add(struct mproc *p, const void *data, size_t len)
 void
 m_close(struct mproc *p)
 {
-	if (imsg_compose(&p->imsgbuf, p->m_type, p->m_peerid, p->m_pid, p->m_fd,
-	    p->m_buf, p->m_pos) == -1)
-		fatal("imsg_compose");
+	struct iovec	iov;
+
+	iov.iov_base = p->m_buf;
+	iov.iov_len = p->m_pos;
+	m_enqueue(p, p->m_type, p->m_peerid, p->m_pid, p->m_fd, &iov, 1);
 
 	log_trace(TRACE_MPROC, "mproc: %s -> %s : %zu %s",
 		    proc_name(smtpd_process),
 		    proc_name(p->proc),
 		    p->m_pos,
 		    imsg_to_str(p->m_type));
-
-	p->msg_out += 1;
-	p->bytes_queued += p->m_pos + IMSG_HEADER_SIZE;
-	if (p->bytes_queued > p->bytes_queued_max)
-		p->bytes_queued_max = p->bytes_queued;
-
-	mproc_event_add(p);
 }
 
 static struct imsg * current;
@@ -505,6 +932,7 @@ m_add_typed_sized(struct mproc *p, uint8_t type, const void *data, size_t len)
 enum {
 	M_INT,
 	M_UINT32,
+	M_SIZET,
 	M_TIME,
 	M_STRING,
 	M_DATA,
@@ -514,6 +942,7 @@ enum {
 	M_SOCKADDR,
 	M_MAILADDR,
 	M_ENVELOPE,
+	M_ENVELOPE_DELTA,
 };
 
 void
@@ -528,6 +957,12 @@ m_add_u32(struct mproc *m, uint32_t u32)
 	m_add_typed(m, M_UINT32, &u32, sizeof u32);
 };
 
+void
+m_add_size(struct mproc *m, size_t sz)
+{
+	m_add_typed(m, M_SIZET, &sz, sizeof sz);
+};
+
 void
 m_add_time(struct mproc *m, time_t v)
 {
@@ -577,18 +1012,43 @@ m_add_mailaddr(struct mproc *m, const struct mailaddr *maddr)
 }
 
 #ifndef BUILD_FILTER
+/*
+ * Envelopes travel in the binary format.  When the previous envelope
+ * sent to that peer was for the same message, only the difference with
+ * it is sent, along with its evpid so the receiver can check it has the
+ * same template.  This relies on every envelope being read with
+ * m_get_envelope() by the peer, in order.
+ */
 void
 m_add_envelope(struct mproc *m, const struct envelope *evp)
 {
-#if 0
-	m_add_typed(m, M_ENVELOPE, evp, sizeof(*evp));
-#else
 	char	buf[sizeof(*evp)];
+	char	delta[sizeof(*evp)];
+	int	len, dlen;
+
+	if ((len = envelope_dump_binary(evp, buf, sizeof(buf))) == 0)
+		fatalx("m_add_envelope: cannot encode envelope");
+
+	dlen = -1;
+	if (m->e_out && evpid_to_msgid(m->e_outid) == evpid_to_msgid(evp->id))
+		dlen = envelope_delta_binary(m->e_out, m->e_outlen, buf, len,
+		    delta + sizeof(m->e_outid),
+		    sizeof(delta) - sizeof(m->e_outid));
 
-	envelope_dump_buffer(evp, buf, sizeof(buf));
 	m_add_evpid(m, evp->id);
-	m_add_typed_sized(m, M_ENVELOPE, buf, strlen(buf) + 1);
-#endif
+	if (dlen != -1 && dlen + sizeof(m->e_outid) < (size_t)len) {
+		memmove(delta, &m->e_outid, sizeof(m->e_outid));
+		m_add_typed_sized(m, M_ENVELOPE_DELTA, delta,
+		    dlen + sizeof(m->e_outid));
+	}
+	else
+		m_add_typed_sized(m, M_ENVELOPE, buf, len);
+
+	if (m->e_out == NULL)
+		m->e_out = xmalloc(sizeof(*evp), "m_add_envelope");
+	memmove(m->e_out, buf, len);
+	m->e_outlen = len;
+	m->e_outid = evp->id;
 }
 #endif
 
@@ -604,6 +1064,12 @@ m_get_u32(struct msg *m, uint32_t *u32)
 	m_get_typed(m, M_UINT32, u32, sizeof(*u32));
 }
 
+void
+m_get_size(struct msg *m, size_t *sz)
+{
+	m_get_typed(m, M_SIZET, sz, sizeof(*sz));
+}
+
 void
 m_get_time(struct msg *m, time_t *t)
 {
@@ -672,19 +1138,144 @@ m_get_mailaddr(struct msg *m, struct mailaddr *maddr)
 void
 m_get_envelope(struct msg *m, struct envelope *evp)
 {
-#if 0
-	m_get_typed(m, M_ENVELOPE, evp, sizeof(*evp));
-#else
-	uint64_t	 evpid;
+	struct mproc	*p = m_inproc;
+	char		 buf[sizeof(*evp)];
+	uint64_t	 evpid, tid;
 	size_t		 s;
 	const void	*d;
+	int		 len;
 
 	m_get_evpid(m, &evpid);
-	m_get_typed_sized(m, M_ENVELOPE, &d, &s);
+	if (m->pos < m->end && *m->pos == M_ENVELOPE_DELTA) {
+		m_get_typed_sized(m, M_ENVELOPE_DELTA, &d, &s);
+		if (s < sizeof(tid))
+			m_error("envelope delta too short");
+		memmove(&tid, d, sizeof(tid));
+		if (p == NULL || p->e_in == NULL || p->e_inid != tid)
+			m_error("envelope template mismatch");
+		len = envelope_patch_binary(p->e_in, p->e_inlen,
+		    (const char *)d + sizeof(tid), s - sizeof(tid),
+		    buf, sizeof(buf));
+		if (len == 0)
+			m_error("bad envelope delta");
+		d = buf;
+		s = len;
+	}
+	else
+		m_get_typed_sized(m, M_ENVELOPE, &d, &s);
 
-	if (!envelope_load_buffer(evp, d, s - 1))
+	if (!envelope_load_buffer(evp, d, s))
 		fatalx("failed to retrieve envelope");
 	evp->id = evpid;
-#endif
+
+	if (p) {
+		if (p->e_in == NULL)
+			p->e_in = xmalloc(sizeof(*evp), "m_get_envelope");
+		memmove(p->e_in, d, s);
+		p->e_inlen = s;
+		p->e_inid = evpid;
+	}
 }
 #endif
+
+/*
+ * Messages that carry nothing but an evpid are coalesced per peer into a
+ * single IMSG_BATCH, which is sent when the next event loop iteration
+ * runs, or earlier if anything else is written to that peer so that the
+ * ordering of the stream is kept.  The receiving side replays them one
+ * by one to the handler as if they had been sent individually.
+ */
+#define	M_BATCH_MAX	((MAX_IMSGSIZE - IMSG_HEADER_SIZE - sizeof(uint32_t)) \
+			    / sizeof(uint64_t))
+
+void
+m_batch_evpid(struct mproc *p, uint32_t type, uint64_t evpid)
+{
+	struct timeval	tv;
+
+	if (p->b_count && (p->b_type != type || p->b_count == M_BATCH_MAX))
+		m_batch_flush(p);
+
+	if (p->b_evpids == NULL) {
+		p->b_evpids = calloc(M_BATCH_MAX, sizeof *p->b_evpids);
+		if (p->b_evpids == NULL)
+			fatal("m_batch_evpid: calloc");
+	}
+
+	if (p->b_count == 0) {
+		p->b_type = type;
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_set(&p->b_ev, m_batch_timeout, p);
+		evtimer_add(&p->b_ev, &tv);
+	}
+	p->b_evpids[p->b_count++] = evpid;
+}
+
+static void
+m_batch_timeout(int fd, short event, void *arg)
+{
+	m_batch_flush(arg);
+}
+
+static void
+m_batch_flush(struct mproc *p)
+{
+	struct iovec	iov[2];
+	size_t		len;
+
+	if (p->b_count == 0)
+		return;
+
+	evtimer_del(&p->b_ev);
+
+	iov[0].iov_base = &p->b_type;
+	iov[0].iov_len = sizeof p->b_type;
+	iov[1].iov_base = p->b_evpids;
+	iov[1].iov_len = p->b_count * sizeof *p->b_evpids;
+	len = iov[0].iov_len + iov[1].iov_len;
+
+	m_enqueue(p, IMSG_BATCH, 0, 0, -1, iov, 2);
+
+	log_trace(TRACE_MPROC, "mproc: %s -> %s : %zu %s (%zu %s)",
+		    proc_name(smtpd_process),
+		    proc_name(p->proc),
+		    len,
+		    imsg_to_str(IMSG_BATCH),
+		    p->b_count,
+		    imsg_to_str(p->b_type));
+
+	p->b_count = 0;
+}
+
+static void
+mproc_dispatch_batch(struct mproc *p, struct imsg *imsg)
+{
+	struct imsg	 one;
+	uint8_t		 buf[1 + sizeof(uint64_t)];
+	uint32_t	 type;
+	const uint8_t	*data;
+	size_t		 len;
+
+	data = imsg->data;
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (len < sizeof type || (len - sizeof type) % sizeof(uint64_t))
+		fatalx("mproc_dispatch_batch: bad batch size");
+
+	memmove(&type, data, sizeof type);
+	data += sizeof type;
+	len -= sizeof type;
+
+	/* each entry is framed the way m_add_evpid() would */
+	memset(&one, 0, sizeof one);
+	one.hdr.type = type;
+	one.hdr.len = IMSG_HEADER_SIZE + sizeof buf;
+	one.fd = -1;
+	one.data = buf;
+	buf[0] = M_EVPID;
+
+	for (; len; data += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+		memmove(buf + 1, data, sizeof(uint64_t));
+		p->handler(p, &one);
+	}
+}
@@ -49,10 +49,17 @@
 #define DELAY_CHECK_SOURCE_FAST 0
 #define DELAY_CHECK_LIMIT	5
 
+#define WINDOW_INIT		2
+
 #define	DELAY_QUADRATIC		1
 #define DELAY_ROUTE_BASE	200
 #define DELAY_ROUTE_MAX		(3600 * 4)
 
+/* source scores, in connections of a source of weight 1, see below */
+#define	SOURCE_SCORE_CONN	1000
+#define	SOURCE_SCORE_DISABLED	(10 * SOURCE_SCORE_CONN)
+#define	SOURCE_SCORE_AVOID	((uint64_t)1 << 40)
+
 #define RELAY_ONHOLD		0x01
 #define RELAY_HOLDQ		0x02
 
@@ -65,16 +72,29 @@ static void mta_query_secret(struct mta_relay *);
 static void mta_query_preference(struct mta_relay *);
 static void mta_query_source(struct mta_relay *);
 static void mta_on_mx(void *, void *, void *);
+static void mta_mx_error(struct mta_relay *, struct mta_domain *);
 static void mta_on_secret(struct mta_relay *, const char *);
 static void mta_on_preference(struct mta_relay *, int, int);
 static void mta_on_source(struct mta_relay *, struct mta_source *);
+static struct mta_source *mta_source_select(struct mta_relay *,
+    struct source *, int);
+static uint64_t mta_source_score(struct mta_relay *, struct mta_source *, int);
+static void mta_query_state(struct mta_relay *);
+static void mta_on_state(struct mta_relay *, int, struct mtastate *);
+static void mta_state_publish(uint64_t, const char *, size_t);
 static void mta_on_timeout(struct runq *, void *);
 static void mta_connect(struct mta_connector *);
 static void mta_route_enable(struct mta_route *);
 static void mta_route_disable(struct mta_route *, int, int);
 static void mta_drain(struct mta_relay *);
+static void mta_limits_update(void);
 static void mta_delivery_flush_event(int, short, void *);
 static void mta_flush(struct mta_relay *, int, const char *);
+static struct mta_shaper *mta_shaper(struct mta_relay *, struct envelope *);
+static void mta_shaper_refill(struct mta_relay *, struct mta_shaper *, time_t);
+static int mta_shaper_take(struct mta_relay *, struct mta_shaper *, time_t);
+static void mta_shaper_run(struct mta_relay *);
+static size_t mta_shaper_release(struct mta_relay *);
 static struct mta_route *mta_find_route(struct mta_connector *, time_t, int*,
     time_t*);
 static void mta_log(const struct mta_envelope *, const char *, const char *,
@@ -85,6 +105,10 @@ static struct mta_relay *mta_relay(struct envelope *);
 static void mta_relay_ref(struct mta_relay *);
 static void mta_relay_unref(struct mta_relay *);
 static void mta_relay_show(struct mta_relay *, struct mproc *, uint32_t, time_t);
+static void mta_stats_add(struct mta_stats *, enum mta_phase, int64_t);
+static size_t mta_stats_quantile(const struct mta_stats *, int, size_t);
+static const char *mta_stats_to_text(const struct mta_stats *, time_t);
+static void mta_stats_timeout(int, short, void *);
 static int mta_relay_cmp(const struct mta_relay *, const struct mta_relay *);
 SPLAY_PROTOTYPE(mta_relay_tree, mta_relay, entry, mta_relay_cmp);
 
@@ -97,10 +121,12 @@ SPLAY_PROTOTYPE(mta_host_tree, mta_host, entry, mta_host_cmp);
 
 SPLAY_HEAD(mta_domain_tree, mta_domain);
 static struct mta_domain *mta_domain(char *, int);
-#if 0
 static void mta_domain_ref(struct mta_domain *);
-#endif
 static void mta_domain_unref(struct mta_domain *);
+static void mta_domain_free(struct mta_domain *);
+static void mta_domain_query(struct mta_domain *);
+static void mta_domain_set_mxs(struct mta_domain *, int, int);
+static void mta_domain_clear(struct mta_domain *, int);
 static int mta_domain_cmp(const struct mta_domain *, const struct mta_domain *);
 SPLAY_PROTOTYPE(mta_domain_tree, mta_domain, entry, mta_domain_cmp);
 
@@ -119,6 +145,7 @@ static const char *mta_connector_to_text(struct mta_connector *);
 
 SPLAY_HEAD(mta_route_tree, mta_route);
 static struct mta_route *mta_route(struct mta_source *, struct mta_host *);
+static struct mta_route *mta_route_find(struct mta_source *, struct mta_host *);
 static void mta_route_ref(struct mta_route *);
 static void mta_route_unref(struct mta_route *);
 static const char *mta_route_to_text(struct mta_route *);
@@ -149,30 +176,85 @@ static struct tree wait_mx;
 static struct tree wait_preference;
 static struct tree wait_secret;
 static struct tree wait_source;
+static struct tree wait_state;
 static struct tree flush_evp;
 static struct event ev_flush_evp;
+static struct event ev_stats;
 
 static struct runq *runq_relay;
 static struct runq *runq_connector;
 static struct runq *runq_route;
 static struct runq *runq_hoststat;
+static struct runq *runq_domain;
+static struct runq *runq_shaper;
 
 static time_t	max_seen_conndelay_route;
 static time_t	max_seen_discdelay_route;
 
+#define	MTA_REPORT_MAX		(MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+#define	MTA_REPORT_ENTRY(e)	(32 + strlen((e)->status))
+
+#define	MX_TTL_MIN		60
+#define	MX_TTL_MAX		3600
+#define	MX_TTL_DEFAULT		300	/* when the resolver gives no TTL */
+#define	MX_TTL_NEGATIVE		300
+
+#define	MTA_STATS_INTERVAL	10
+
+/*
+ * With mta-shared-state, what a node learns about a destination domain
+ * is published in a table all nodes look up: the adaptive window it was
+ * throttled down to and whether the domain is down.  Others keep to it
+ * for MTA_STATE_HOLD seconds unless the state is refreshed, and look it
+ * up again every MTA_STATE_TTL seconds.
+ */
+#define	MTA_STATE_TTL		30
+#define	MTA_STATE_HOLD		300
+
+static const char *mta_phase_names[MTA_PHASE_COUNT] = {
+	"connect", "tls", "helo", "auth", "mail", "data"
+};
+
+/*
+ * With limits shape-rate and shape-burst, the tasks of a relay go through
+ * a token bucket per envelope tag, or per sender domain for untagged
+ * envelopes.  As for the smtp rate limits, a task costs 60 tokens and a
+ * bucket gets back shape-rate tokens per second.  A task over budget waits
+ * on its bucket, outside of relay->tasks, so it takes no connection slot.
+ */
+struct mta_shaper {
+	char			 key[SMTPD_MAXHOSTNAMELEN];
+	int64_t			 tokens;
+	time_t			 last;
+	size_t			 ntask;
+	TAILQ_HEAD(, mta_task)	 tasks;
+};
+
+#define	SHAPER_MAX(l)	\
+	((int64_t)((l)->shape_burst > 0 ? (l)->shape_burst : (l)->shape_rate) * 60)
+
 #define	HOSTSTAT_EXPIRE_DELAY	(4 * 3600)
+#define	HOSTSTAT_DOWN		4	/* consecutive tempfails */
 struct hoststat {
 	char			 name[SMTPD_MAXHOSTNAMELEN];
 	time_t			 tm;
 	char			 error[SMTPD_MAXLINESIZE];
 	struct tree		 deferred;
+
+	uint32_t		 failures;	/* consecutive tempfails */
+	uint32_t		 ntempfail;
+	uint32_t		 nok;
+	time_t			 lastsuccess;
 };
 static struct dict hoststat;
 
-void mta_hoststat_update(const char *, const char *);
+void mta_hoststat_update(const char *, int, const char *);
 void mta_hoststat_cache(const char *, uint64_t);
 void mta_hoststat_uncache(const char *, uint64_t);
 void mta_hoststat_reschedule(const char *);
+int mta_hoststat_down(const char *);
+static void mta_hoststat_notify(struct hoststat *);
+static void mta_hoststat_up(struct hoststat *);
 static void mta_hoststat_remove_entry(struct hoststat *);
 
 
@@ -181,6 +263,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct mta_relay	*relay;
 	struct mta_task		*task;
+	struct mta_shaper	*shaper;
 	struct mta_domain	*domain;
 	struct mta_host		*host;
 	struct mta_route	*route;
@@ -189,31 +272,50 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 	struct mta_source	*source;
 	struct hoststat		*hs;
 	struct mta_envelope	*e;
+	struct ctl_limit	 limit;
 	struct sockaddr_storage	 ss;
+	struct source		 srcs[SOURCE_MAX];
 	struct envelope		 evp;
+	struct evptrace		 trace;
 	struct msg		 m;
+	const void		*data;
+	size_t			 len;
 	const char		*secret;
 	const char		*hostname;
 	const char		*dom;
 	uint64_t		 reqid;
 	time_t			 t;
 	char			 buf[SMTPD_MAXLINESIZE];
-	int			 dnserror, preference, v, status;
+	int			 dnserror, preference, ttl, v, status, i;
+	struct mtastate		 st;
+	uint32_t		 u32;
 	void			*iter;
 	uint64_t		 u64;
 
+	if (p->proc == PROC_CA) {
+		ca_reply(imsg);
+		return;
+	}
+
 	if (p->proc == PROC_QUEUE) {
 		switch (imsg->hdr.type) {
 
 		case IMSG_MTA_TRANSFER:
 			m_msg(&m, imsg);
 			m_get_envelope(&m, &evp);
+			memset(&trace, 0, sizeof(trace));
+			if (!m_is_eom(&m)) {
+				m_get_data(&m, &data, &len);
+				if (len != sizeof(trace))
+					fatalx("mta: bad trace size");
+				memmove(&trace, data, len);
+			}
 			m_end(&m);
 
 			relay = mta_relay(&evp);
 			/* ignore if we don't know the limits yet */
-			if (relay->limits && 
-			    relay->ntask >= (size_t)relay->limits->task_hiwat) {
+			if (relay->limits && relay->ntask + relay->ndeferred >=
+			    (size_t)relay->limits->task_hiwat) {
 				if (!(relay->state & RELAY_ONHOLD)) {
 					log_info("smtp-out: hiwat reached on %s: holding envelopes",
 					    mta_relay_to_text(relay));
@@ -235,16 +337,36 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 				return;
 			}
 
+			shaper = mta_shaper(relay, &evp);
+
 			TAILQ_FOREACH(task, &relay->tasks, entry)
 				if (task->msgid == evpid_to_msgid(evp.id))
 					break;
+			if (task == NULL && shaper)
+				TAILQ_FOREACH(task, &shaper->tasks, entry)
+					if (task->msgid == evpid_to_msgid(evp.id))
+						break;
 
 			if (task == NULL) {
 				task = xmalloc(sizeof *task, "mta_task");
 				TAILQ_INIT(&task->envelopes);
 				task->relay = relay;
-				relay->ntask += 1;
-				TAILQ_INSERT_TAIL(&relay->tasks, task, entry);
+				if (shaper &&
+				    !mta_shaper_take(relay, shaper, time(NULL))) {
+					log_debug("debug: mta: deferring "
+					    "msg:%08" PRIx32 " on shaper %s",
+					    evpid_to_msgid(evp.id), shaper->key);
+					shaper->ntask += 1;
+					relay->ndeferred += 1;
+					TAILQ_INSERT_TAIL(&shaper->tasks, task,
+					    entry);
+					stat_increment("mta.task.deferred", 1);
+				}
+				else {
+					relay->ntask += 1;
+					TAILQ_INSERT_TAIL(&relay->tasks, task,
+					    entry);
+				}
 				task->msgid = evpid_to_msgid(evp.id);
 				if (evp.sender.user[0] || evp.sender.domain[0])
 					snprintf(buf, sizeof buf, "%s@%s",
@@ -258,6 +380,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			e = xcalloc(1, sizeof *e, "mta_envelope");
 			e->id = evp.id;
 			e->creation = evp.creation;
+			e->trace = trace;
 			snprintf(buf, sizeof buf, "%s@%s",
 			    evp.dest.user, evp.dest.domain);
 			e->dest = xstrdup(buf, "mta_envelope:dest");
@@ -309,19 +432,44 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
 			m_get_int(&m, &status);
-			if (status == LKA_OK)
-				m_get_sockaddr(&m, (struct sockaddr*)&ss);
+			v = 0;
+			if (status == LKA_OK) {
+				m_get_int(&m, &v);
+				if (v < 0 || v > SOURCE_MAX)
+					fatalx("mta: bad source count");
+				for (i = 0; i < v; i++) {
+					m_get_sockaddr(&m,
+					    (struct sockaddr *)&srcs[i].addr);
+					m_get_int(&m, &srcs[i].weight);
+				}
+			}
 			m_end(&m);
 
 			relay = tree_xpop(&wait_source, reqid);
-			mta_on_source(relay, (status == LKA_OK) ?
-			    mta_source((struct sockaddr *)&ss) : NULL);
+			mta_on_source(relay, v ?
+			    mta_source_select(relay, srcs, v) : NULL);
 			return;
 
 		case IMSG_LKA_HELO:
 			mta_session_imsg(p, imsg);
 			return;
 
+		case IMSG_LKA_MTASTATE:
+			m_msg(&m, imsg);
+			m_get_id(&m, &reqid);
+			m_get_int(&m, &status);
+			if (status == LKA_OK) {
+				m_get_time(&m, &st.until);
+				m_get_u32(&m, &u32);
+				st.window = u32;
+				m_get_u32(&m, &st.failures);
+			}
+			m_end(&m);
+
+			relay = tree_xpop(&wait_state, reqid);
+			mta_on_state(relay, status, &st);
+			return;
+
 		case IMSG_DNS_HOST:
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
@@ -332,36 +480,24 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			mx = xcalloc(1, sizeof *mx, "mta: mx");
 			mx->host = mta_host((struct sockaddr*)&ss);
 			mx->preference = preference;
-			TAILQ_FOREACH(imx, &domain->mxs, entry) {
+			TAILQ_FOREACH(imx, &domain->mxpending, entry) {
 				if (imx->preference > mx->preference) {
 					TAILQ_INSERT_BEFORE(imx, mx, entry);
 					return;
 				}
 			}
-			TAILQ_INSERT_TAIL(&domain->mxs, mx, entry);
+			TAILQ_INSERT_TAIL(&domain->mxpending, mx, entry);
 			return;
 
 		case IMSG_DNS_HOST_END:
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
 			m_get_int(&m, &dnserror);
+			m_get_int(&m, &ttl);
 			m_end(&m);
 			domain = tree_xpop(&wait_mx, reqid);
-			domain->mxstatus = dnserror;
-			if (domain->mxstatus == DNS_OK) {
-				log_debug("debug: MXs for domain %s:",
-				    domain->name);
-				TAILQ_FOREACH(mx, &domain->mxs, entry)
-					log_debug("	%s preference %d",
-					    sa_to_text(mx->host->sa),
-					    mx->preference);
-			}
-			else {
-				log_debug("debug: Failed MX query for %s:",
-				    domain->name);
-			}
-			domain->lastmxquery = time(NULL);
-			waitq_run(&domain->mxs, domain);
+			mta_domain_set_mxs(domain, dnserror, ttl);
+			mta_domain_unref(domain); /* from mta_domain_query() */
 			return;
 
 		case IMSG_DNS_MX_PREFERENCE:
@@ -473,7 +609,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			SPLAY_FOREACH(route, mta_route_tree, &routes) {
 				v = runq_pending(runq_route, NULL, route, &t);
 				snprintf(buf, sizeof(buf),
-				    "%llu. %s %c%c%c%c nconn=%zu nerror=%d penalty=%d timeout=%s",
+				    "%llu. %s %c%c%c%c nconn=%zu nerror=%d penalty=%d timeout=%s %s",
 				    (unsigned long long)route->id,
 				    mta_route_to_text(route),
 				    route->flags & ROUTE_NEW ? 'N' : '-',
@@ -483,7 +619,8 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 				    route->nconn,
 				    route->nerror,
 				    route->penalty,
-				    v ? duration_to_text(t - time(NULL)) : "-");
+				    v ? duration_to_text(t - time(NULL)) : "-",
+				    mta_stats_to_text(&route->stats, time(NULL)));
 				m_compose(p, IMSG_CTL_MTA_SHOW_ROUTES,
 				    imsg->hdr.peerid, 0, -1,
 				    buf, strlen(buf) + 1);
@@ -541,6 +678,18 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			m_compose(p, IMSG_CTL_OK, imsg->hdr.peerid, 0, -1, NULL, 0);
 			return;
 
+		case IMSG_CTL_SET_LIMIT:
+			memmove(&limit, imsg->data, sizeof limit);
+			v = limit_set(limit.name, limit.value);
+			if (v) {
+				log_info("info: mta: limit %s set to %lld",
+				    limit.name, (long long)limit.value);
+				mta_limits_update();
+			}
+			m_compose(p, v ? IMSG_CTL_OK : IMSG_CTL_FAIL,
+			    imsg->hdr.peerid, 0, -1, NULL, 0);
+			return;
+
 		case IMSG_CTL_MTA_SHOW_BLOCK:
 			SPLAY_FOREACH(block, mta_block_tree, &blocks) {
 				snprintf(buf, sizeof(buf), "%s -> %s",
@@ -579,7 +728,7 @@ mta_shutdown(void)
 }
 
 pid_t
-mta(void)
+mta(int shard)
 {
 	pid_t		 pid;
 	struct passwd	*pw;
@@ -591,6 +740,7 @@ mta(void)
 		fatal("mta: cannot fork");
 	case 0:
 		post_fork(PROC_MTA);
+		mta_shard = shard;
 		break;
 	default:
 		return (pid);
@@ -624,6 +774,7 @@ mta(void)
 	tree_init(&wait_mx);
 	tree_init(&wait_preference);
 	tree_init(&wait_source);
+	tree_init(&wait_state);
 	tree_init(&flush_evp);
 	dict_init(&hoststat);
 
@@ -631,11 +782,15 @@ mta(void)
 	event_init();
 
 	evtimer_set(&ev_flush_evp, mta_delivery_flush_event, NULL);
+	evtimer_set(&ev_stats, mta_stats_timeout, NULL);
+	mta_stats_timeout(-1, 0, NULL);
 
 	runq_init(&runq_relay, mta_on_timeout);
 	runq_init(&runq_connector, mta_on_timeout);
 	runq_init(&runq_route, mta_on_timeout);
 	runq_init(&runq_hoststat, mta_on_timeout);
+	runq_init(&runq_domain, mta_on_timeout);
+	runq_init(&runq_shaper, mta_on_timeout);
 
 	signal_set(&ev_sigint, SIGINT, mta_sig_handler, NULL);
 	signal_set(&ev_sigterm, SIGTERM, mta_sig_handler, NULL);
@@ -648,8 +803,11 @@ mta(void)
 	config_peer(PROC_QUEUE);
 	config_peer(PROC_LKA);
 	config_peer(PROC_CONTROL);
+	config_peer(PROC_CA);
 	config_done();
 
+	ca_init();
+
 	if (event_dispatch() < 0)
 		fatal("event_dispatch");
 	mta_shutdown();
@@ -657,6 +815,55 @@ mta(void)
 	return (0);
 }
 
+/*
+ * Pick the transfer process for an envelope.  The key is the name used
+ * for the relay domain, so all relays of a destination, and the limits
+ * that apply to it, live in the same process.
+ */
+struct mproc *
+mta_peer(const struct envelope *e)
+{
+	const char	*name;
+	uint32_t	 h;
+
+	if (env->sc_mta_procs <= 1)
+		return (p_mta);
+
+	if (e->agent.mta.relay.hostname[0] &&
+	    !(e->agent.mta.relay.flags & RELAY_BACKUP))
+		name = e->agent.mta.relay.hostname;
+	else
+		name = e->dest.domain;
+
+	/* FNV-1a, case-insensitive like mta_domain_cmp() */
+	for (h = 2166136261U; *name; name++)
+		h = (h ^ (uint8_t)tolower((unsigned char)*name)) * 16777619;
+
+	return (p_mtas[h % env->sc_mta_procs]);
+}
+
+void
+mta_forward(struct imsg *imsg)
+{
+	size_t	i;
+
+	for (i = 0; i < env->sc_mta_procs; i++)
+		m_forward(p_mtas[i], imsg);
+}
+
+void
+mta_enable(int on)
+{
+	size_t	i;
+
+	for (i = 0; i < env->sc_mta_procs; i++) {
+		if (on)
+			mproc_enable(p_mtas[i]);
+		else
+			mproc_disable(p_mtas[i]);
+	}
+}
+
 /*
  * Local error on the given source.
  */
@@ -707,6 +914,182 @@ mta_route_ok(struct mta_relay *relay, struct mta_route *route)
 	mta_connect(c);
 }
 
+/*
+ * Adaptive concurrency: the relay window grows by one connection after
+ * a window's worth of successful transactions, and is halved when the
+ * destination throttles us or a connection fails.
+ */
+void
+mta_relay_ack(struct mta_relay *relay)
+{
+	if (relay->limits == NULL || !relay->limits->adaptive)
+		return;
+
+	if (++relay->windowacks < relay->window)
+		return;
+	relay->windowacks = 0;
+	if (relay->window < relay->limits->maxconn_per_relay) {
+		relay->window += 1;
+		log_debug("debug: mta: window for %s raised to %zu",
+		    mta_relay_to_text(relay), relay->window);
+		/* let the other nodes recover along */
+		if (relay->stateuntil > time(NULL)) {
+			relay->statewindow = relay->window;
+			mta_state_publish(relay->id, relay->domain->name,
+			    relay->window);
+		}
+	}
+}
+
+/*
+ * Per-relay and per-route session statistics: how long each phase of
+ * a session took, and how many messages and bytes went through.
+ */
+void
+mta_stats_phase(struct mta_relay *relay, struct mta_route *route,
+    enum mta_phase phase, int64_t ms)
+{
+	mta_stats_add(&relay->stats, phase, ms);
+	if (route)
+		mta_stats_add(&route->stats, phase, ms);
+}
+
+void
+mta_stats_sent(struct mta_relay *relay, struct mta_route *route,
+    size_t bytes)
+{
+	relay->stats.nmsg += 1;
+	relay->stats.nbytes += bytes;
+	relay->stats.dirty = 1;
+	if (route) {
+		route->stats.nmsg += 1;
+		route->stats.nbytes += bytes;
+	}
+}
+
+static void
+mta_stats_add(struct mta_stats *st, enum mta_phase phase, int64_t ms)
+{
+	size_t	b;
+
+	if (phase < 0 || phase >= MTA_PHASE_COUNT)
+		return;
+
+	for (b = 0; b < MTA_STATS_BUCKETS - 1; b++)
+		if (ms < (1LL << b))
+			break;
+	st->hist[phase][b] += 1;
+	if (st->since == 0)
+		st->since = time(NULL);
+	st->dirty = 1;
+}
+
+/* upper bound in ms of the given quantile (per mille), 0 if no sample */
+static size_t
+mta_stats_quantile(const struct mta_stats *st, int phase, size_t permil)
+{
+	size_t	b, n, total, target;
+
+	for (total = 0, b = 0; b < MTA_STATS_BUCKETS; b++)
+		total += st->hist[phase][b];
+	if (total == 0)
+		return (0);
+
+	target = (total * permil + 999) / 1000;
+	for (n = 0, b = 0; b < MTA_STATS_BUCKETS - 1; b++) {
+		n += st->hist[phase][b];
+		if (n >= target)
+			break;
+	}
+	return ((size_t)1 << b);
+}
+
+static const char *
+mta_stats_to_text(const struct mta_stats *st, time_t t)
+{
+	static char	 buf[1024];
+	char		 tmp[64];
+	time_t		 elapsed;
+	int		 i;
+
+	strlcpy(buf, "latency", sizeof buf);
+	for (i = 0; i < MTA_PHASE_COUNT; i++) {
+		if (mta_stats_quantile(st, i, 500) == 0)
+			continue;
+		snprintf(tmp, sizeof tmp, " %s=%zu/%zums", mta_phase_names[i],
+		    mta_stats_quantile(st, i, 500),
+		    mta_stats_quantile(st, i, 990));
+		strlcat(buf, tmp, sizeof buf);
+	}
+	if (strcmp(buf, "latency") == 0)
+		strlcat(buf, " -", sizeof buf);
+
+	elapsed = st->since ? t - st->since : 0;
+	if (elapsed <= 0)
+		elapsed = 1;
+	snprintf(tmp, sizeof tmp, " msgs=%zu (%.2f/s) bytes=%zu (%.0f/s)",
+	    st->nmsg, (double)st->nmsg / elapsed,
+	    st->nbytes, (double)st->nbytes / elapsed);
+	strlcat(buf, tmp, sizeof buf);
+
+	return (buf);
+}
+
+/* push the relays that saw traffic since last time to the stat backend */
+static void
+mta_stats_timeout(int fd, short event, void *p)
+{
+	struct mta_relay	*r;
+	struct timeval		 tv;
+	char			 key[STAT_KEY_SIZE];
+	int			 i;
+
+	SPLAY_FOREACH(r, mta_relay_tree, &relays) {
+		if (!r->stats.dirty)
+			continue;
+		r->stats.dirty = 0;
+		for (i = 0; i < MTA_PHASE_COUNT; i++) {
+			if (mta_stats_quantile(&r->stats, i, 500) == 0)
+				continue;
+			snprintf(key, sizeof key, "mta.relay.%s.%s.p50ms",
+			    r->domain->name, mta_phase_names[i]);
+			stat_set(key, stat_counter(
+			    mta_stats_quantile(&r->stats, i, 500)));
+			snprintf(key, sizeof key, "mta.relay.%s.%s.p99ms",
+			    r->domain->name, mta_phase_names[i]);
+			stat_set(key, stat_counter(
+			    mta_stats_quantile(&r->stats, i, 990)));
+		}
+		snprintf(key, sizeof key, "mta.relay.%s.messages",
+		    r->domain->name);
+		stat_set(key, stat_counter(r->stats.nmsg));
+		snprintf(key, sizeof key, "mta.relay.%s.bytes",
+		    r->domain->name);
+		stat_set(key, stat_counter(r->stats.nbytes));
+	}
+
+	tv.tv_sec = MTA_STATS_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_stats, &tv);
+}
+
+void
+mta_relay_backoff(struct mta_relay *relay, const char *reason)
+{
+	if (relay->limits == NULL || !relay->limits->adaptive)
+		return;
+
+	relay->windowacks = 0;
+	if (relay->window > 1) {
+		relay->window /= 2;
+		log_info("smtp-out: Window for %s lowered to %zu: %s",
+		    mta_relay_to_text(relay), relay->window, reason);
+	}
+	mta_state_publish(relay->id, relay->domain->name, relay->window);
+	relay->stateuntil = time(NULL) + MTA_STATE_HOLD;
+	relay->statewindow = relay->window;
+}
+
 void
 mta_route_down(struct mta_relay *relay, struct mta_route *route)
 {
@@ -752,7 +1135,8 @@ mta_route_next_task(struct mta_relay *relay, struct mta_route *route)
 		task->relay = NULL;
 
 		/* When the number of tasks is down to lowat, query some evp */
-		if (relay->ntask == (size_t)relay->limits->task_lowat) {
+		if (relay->ntask + relay->ndeferred ==
+		    (size_t)relay->limits->task_lowat) {
 			if (relay->state & RELAY_ONHOLD) {
 				log_info("smtp-out: back to lowat on %s: releasing",
 				    mta_relay_to_text(relay));
@@ -765,7 +1149,8 @@ mta_route_next_task(struct mta_relay *relay, struct mta_route *route)
 				m_close(p_queue);
 			}
 		}
-		else if (relay->ntask == 0 && relay->state & RELAY_HOLDQ) {
+		else if (relay->ntask + relay->ndeferred == 0 &&
+		    relay->state & RELAY_HOLDQ) {
 			m_create(p_queue, IMSG_DELIVERY_RELEASE, 0, 0, -1);
 			m_add_id(p_queue, relay->id);
 			m_add_int(p_queue, 0);
@@ -776,42 +1161,128 @@ mta_route_next_task(struct mta_relay *relay, struct mta_route *route)
 	return (task);
 }
 
+/*
+ * A ready session out of tasks may carry on with another relay which
+ * would open the very same connection: relays to the MXs of different
+ * domains hosted by the same provider differ only by their domain.  The
+ * session moves to a relay with tasks waiting if it uses the same
+ * parameters and the route's host is one of its MXs.  Backup, verified
+ * TLS and authenticated relays are kept to their own sessions.
+ */
+struct mta_relay *
+mta_route_share(struct mta_relay *relay, struct mta_route *route)
+{
+	struct mta_relay	*r;
+	struct mta_connector	*c;
+	struct mta_mx		*mx;
+	int			 flags;
+
+	flags = RELAY_MX | RELAY_BACKUP | RELAY_AUTH | RELAY_TLS_VERIFY;
+	if ((relay->flags & flags) != RELAY_MX)
+		return (NULL);
+
+	SPLAY_FOREACH(r, mta_relay_tree, &relays) {
+		if (r == relay || r->ntask == 0 || r->domain == relay->domain)
+			continue;
+		if (r->flags != relay->flags || r->port != relay->port)
+			continue;
+		if (strcmp(r->sourcetable ? r->sourcetable : "",
+		    relay->sourcetable ? relay->sourcetable : "") ||
+		    strcmp(r->helotable ? r->helotable : "",
+		    relay->helotable ? relay->helotable : "") ||
+		    strcmp(r->heloname ? r->heloname : "",
+		    relay->heloname ? relay->heloname : "") ||
+		    strcmp(r->pki_name ? r->pki_name : "",
+		    relay->pki_name ? relay->pki_name : ""))
+			continue;
+		if (r->nconn >= r->limits->maxconn_per_relay ||
+		    r->domain->nconn >= r->limits->maxconn_per_domain)
+			continue;
+		if (mta_is_blocked(route->src, r->domain->name))
+			continue;
+		TAILQ_FOREACH(mx, &r->domain->mxs, entry)
+			if (mx->host == route->dst)
+				break;
+		if (mx == NULL)
+			continue;
+		break;
+	}
+	if (r == NULL)
+		return (NULL);
+
+	log_debug("debug: mta: sharing %s with %s",
+	    mta_route_to_text(route), mta_relay_to_text(r));
+
+	c = mta_connector(r, route->src);
+	c->nconn += 1;
+	r->nconn += 1;
+	r->nconn_ready += 1;
+	r->domain->nconn += 1;
+	mta_relay_ref(r);
+
+	c = mta_connector(relay, route->src);
+	c->nconn -= 1;
+	relay->nconn -= 1;
+	relay->nconn_ready -= 1;
+	relay->domain->nconn -= 1;
+	mta_relay_unref(relay); /* from mta_connect() */
+
+	stat_increment("mta.session.shared", 1);
+
+	return (r);
+}
+
 static void
 mta_delivery_flush_event(int fd, short event, void *arg)
 {
 	struct mta_envelope	*e;
-	struct timeval		 tv;
+	size_t			 len, n;
 
-	if (tree_poproot(&flush_evp, NULL, (void**)(&e))) {
+	/*
+	 * Report all pending envelopes at once, as many per message as fit
+	 * in an imsg.  An entry is at most the typed evpid and delivery
+	 * type, plus the extensions or the status string and code.
+	 */
+	len = n = 0;
+	while (tree_poproot(&flush_evp, NULL, (void**)(&e))) {
 
-		if (e->delivery == IMSG_DELIVERY_OK) {
-			m_create(p_queue, IMSG_DELIVERY_OK, 0, 0, -1);
-			m_add_evpid(p_queue, e->id);
-			m_add_int(p_queue, e->ext);
-			m_close(p_queue);
-		} else if (e->delivery == IMSG_DELIVERY_TEMPFAIL)
-			queue_tempfail(e->id, e->status, ESC_OTHER_STATUS);
-		else if (e->delivery == IMSG_DELIVERY_PERMFAIL)
-			queue_permfail(e->id, e->status, ESC_OTHER_STATUS);
-		else if (e->delivery == IMSG_DELIVERY_LOOP)
-			queue_loop(e->id);
-		else {
+		if (e->delivery != IMSG_DELIVERY_OK &&
+		    e->delivery != IMSG_DELIVERY_TEMPFAIL &&
+		    e->delivery != IMSG_DELIVERY_PERMFAIL &&
+		    e->delivery != IMSG_DELIVERY_LOOP) {
 			log_warnx("warn: bad delivery type %i for %016" PRIx64,
 			    e->delivery, e->id);
 			fatalx("aborting");
 		}
 
+		if (n && len + MTA_REPORT_ENTRY(e) > MTA_REPORT_MAX) {
+			m_close(p_queue);
+			len = n = 0;
+		}
+		if (n == 0)
+			m_create(p_queue, IMSG_MTA_DELIVERY_REPORT, 0, 0, -1);
+
+		m_add_evpid(p_queue, e->id);
+		m_add_int(p_queue, e->delivery);
+		if (e->delivery == IMSG_DELIVERY_OK)
+			m_add_int(p_queue, e->ext);
+		else if (e->delivery != IMSG_DELIVERY_LOOP) {
+			m_add_string(p_queue, e->status);
+			m_add_int(p_queue, ESC_OTHER_STATUS);
+		}
+		len += MTA_REPORT_ENTRY(e);
+		n++;
+
 		log_debug("debug: mta: flush for %016"PRIx64" (-> %s)", e->id, e->dest);
 
 		free(e->dest);
 		free(e->rcpt);
 		free(e->dsn_orcpt);
+		free(e->status);
 		free(e);
-
-		tv.tv_sec = 0;
-		tv.tv_usec = 0;
-		evtimer_add(&ev_flush_evp, &tv);
 	}
+	if (n)
+		m_close(p_queue);
 }
 
 void
@@ -833,8 +1304,10 @@ mta_delivery_log(struct mta_envelope *e, const char *source, const char *relay,
 	}
 
 	e->delivery = delivery;
-	if (status)
-		strlcpy(e->status, status, sizeof(e->status));
+	if (status || e->status == NULL) {
+		free(e->status);
+		e->status = xstrdup(status ? status : "", "mta_delivery_log");
+	}
 }
 
 void
@@ -853,22 +1326,14 @@ mta_delivery_notify(struct mta_envelope *e)
 static void
 mta_query_mx(struct mta_relay *relay)
 {
-	uint64_t	id;
-
 	if (relay->status & RELAY_WAIT_MX)
 		return;
 
 	log_debug("debug: mta: querying MX for %s...",
 	    mta_relay_to_text(relay));
 
-	if (waitq_wait(&relay->domain->mxs, mta_on_mx, relay)) {
-		id = generate_uid();
-		tree_xset(&wait_mx, id, relay->domain);
-		if (relay->domain->flags)
-			dns_query_host(id, relay->domain->name);
-		else
-			dns_query_mx(id, relay->domain->name);
-	}
+	if (waitq_wait(&relay->domain->mxs, mta_on_mx, relay))
+		mta_domain_query(relay->domain);
 	relay->status |= RELAY_WAIT_MX;
 	mta_relay_ref(relay);
 }
@@ -892,6 +1357,8 @@ mta_query_limits(struct mta_relay *relay)
 static void
 mta_query_secret(struct mta_relay *relay)
 {
+	struct mproc	*p;
+
 	if (relay->status & RELAY_WAIT_SECRET)
 		return;
 
@@ -901,11 +1368,12 @@ mta_query_secret(struct mta_relay *relay)
 	tree_xset(&wait_secret, relay->id, relay);
 	relay->status |= RELAY_WAIT_SECRET;
 
-	m_create(p_lka, IMSG_LKA_SECRET, 0, 0, -1);
-	m_add_id(p_lka, relay->id);
-	m_add_string(p_lka, relay->authtable);
-	m_add_string(p_lka, relay->authlabel);
-	m_close(p_lka);
+	p = lka_peer(relay->id);
+	m_create(p, IMSG_LKA_SECRET, 0, 0, -1);
+	m_add_id(p, relay->id);
+	m_add_string(p, relay->authtable);
+	m_add_string(p, relay->authlabel);
+	m_close(p);
 
 	mta_relay_ref(relay);
 }
@@ -929,6 +1397,8 @@ mta_query_preference(struct mta_relay *relay)
 static void
 mta_query_source(struct mta_relay *relay)
 {
+	struct mproc	*p;
+
 	log_debug("debug: mta: querying source for %s...",
 	    mta_relay_to_text(relay));
 
@@ -944,10 +1414,11 @@ mta_query_source(struct mta_relay *relay)
 		return;
 	}
 
-	m_create(p_lka, IMSG_LKA_SOURCE, 0, 0, -1);
-	m_add_id(p_lka, relay->id);
-	m_add_string(p_lka, relay->sourcetable);
-	m_close(p_lka);
+	p = lka_peer(relay->id);
+	m_create(p, IMSG_LKA_SOURCE, 0, 0, -1);
+	m_add_id(p, relay->id);
+	m_add_string(p, relay->sourcetable);
+	m_close(p);
 
 	tree_xset(&wait_source, relay->id, relay);
 	relay->status |= RELAY_WAIT_SOURCE;
@@ -963,6 +1434,16 @@ mta_on_mx(void *tag, void *arg, void *data)
 	log_debug("debug: mta: ... got mx (%p, %s, %s)",
 	    tag, domain->name, mta_relay_to_text(relay));
 
+	mta_mx_error(relay, domain);
+
+	relay->status &= ~RELAY_WAIT_MX;
+	mta_drain(relay);
+	mta_relay_unref(relay); /* from mta_drain() */
+}
+
+static void
+mta_mx_error(struct mta_relay *relay, struct mta_domain *domain)
+{
 	switch (domain->mxstatus) {
 	case DNS_OK:
 		break;
@@ -990,10 +1471,6 @@ mta_on_mx(void *tag, void *arg, void *data)
 	if (domain->mxstatus)
 		log_info("smtp-out: Failed to resolve MX for %s: %s",
 		    mta_relay_to_text(relay), relay->failstr);
-
-	relay->status &= ~RELAY_WAIT_MX;
-	mta_drain(relay);
-	mta_relay_unref(relay); /* from mta_drain() */
 }
 
 static void
@@ -1100,13 +1577,179 @@ mta_on_source(struct mta_relay *relay, struct mta_source *source)
 	mta_relay_unref(relay); /* from mta_query_source() */
 }
 
+/*
+ * Pick the source of a relay among the addresses of its table: the one
+ * with the lowest score, the first one on a tie.  lka rotates the list,
+ * so that equal sources are picked in turn.
+ */
+static struct mta_source *
+mta_source_select(struct mta_relay *relay, struct source *cand, int n)
+{
+	struct mta_source	*s, *best = NULL;
+	uint64_t		 score, bestscore = 0;
+	int			 i;
+
+	for (i = 0; i < n; i++) {
+		s = mta_source((struct sockaddr *)&cand[i].addr);
+		score = mta_source_score(relay, s, cand[i].weight);
+		log_trace(TRACE_MTA, "mta: source %s for %s: weight %d, "
+		    "score %llu", mta_source_to_text(s),
+		    mta_relay_to_text(relay), cand[i].weight,
+		    (unsigned long long)score);
+		if (best && score >= bestscore) {
+			mta_source_unref(s);
+			continue;
+		}
+		if (best)
+			mta_source_unref(best);
+		best = s;
+		bestscore = score;
+	}
+
+	return (best);
+}
+
+/*
+ * The connections a source has open to all relays, for its weight, plus
+ * the penalties of its routes to the MXs of this relay.  Sources blocked
+ * for the domain, failing with this relay or with all routes disabled
+ * are only picked when there is nothing else.
+ */
+static uint64_t
+mta_source_score(struct mta_relay *relay, struct mta_source *s, int weight)
+{
+	struct mta_connector	*c;
+	struct mta_route	*route, key;
+	struct mta_mx		*mx;
+	uint64_t		 score;
+	int			 nmx, ndisabled;
+
+	if (weight < 1)
+		weight = 1;
+	score = (uint64_t)(s->nconn + 1) * SOURCE_SCORE_CONN / weight;
+
+	nmx = ndisabled = 0;
+	key.src = s;
+	TAILQ_FOREACH(mx, &relay->domain->mxs, entry) {
+		nmx++;
+		key.dst = mx->host;
+		route = SPLAY_FIND(mta_route_tree, &routes, &key);
+		if (route == NULL)
+			continue;
+		if (route->flags & ROUTE_DISABLED) {
+			ndisabled++;
+			score += SOURCE_SCORE_DISABLED;
+		}
+		score += (uint64_t)route->penalty * SOURCE_SCORE_CONN;
+	}
+	if (nmx && ndisabled == nmx)
+		score += SOURCE_SCORE_AVOID;
+
+	if (mta_is_blocked(s, relay->domain->name))
+		score += SOURCE_SCORE_AVOID;
+
+	c = tree_get(&relay->connectors, (uintptr_t)s);
+	if (c && c->flags & CONNECTOR_ERROR)
+		score += SOURCE_SCORE_AVOID;
+
+	return (score);
+}
+
+static void
+mta_query_state(struct mta_relay *relay)
+{
+	struct mproc	*p;
+
+	if (env->sc_mta_state == NULL || time(NULL) < relay->statecheck ||
+	    tree_check(&wait_state, relay->id))
+		return;
+
+	log_debug("debug: mta: querying shared state for %s...",
+	    mta_relay_to_text(relay));
+
+	tree_xset(&wait_state, relay->id, relay);
+
+	p = lka_peer(relay->id);
+	m_create(p, IMSG_LKA_MTASTATE, 0, 0, -1);
+	m_add_id(p, relay->id);
+	m_add_string(p, env->sc_mta_state);
+	m_add_string(p, relay->domain->name);
+	m_close(p);
+
+	mta_relay_ref(relay);
+}
+
+static void
+mta_on_state(struct mta_relay *relay, int status, struct mtastate *st)
+{
+	time_t	now;
+
+	now = time(NULL);
+	relay->statecheck = now + MTA_STATE_TTL;
+
+	if (status == LKA_OK && st->until > now) {
+		log_debug("debug: mta: shared state for %s: window=%zu "
+		    "failures=%" PRIu32 " for %llus", mta_relay_to_text(relay),
+		    st->window, st->failures,
+		    (unsigned long long)st->until - now);
+		relay->stateuntil = st->until;
+		relay->statewindow = st->window;
+		relay->statedown = st->failures >= HOSTSTAT_DOWN;
+		if (relay->limits && relay->limits->adaptive && st->window &&
+		    (relay->window == 0 || relay->window > st->window))
+			relay->window = st->window;
+	}
+	/* keep what we knew if the table is unreachable */
+	else if (status != LKA_TEMPFAIL) {
+		relay->stateuntil = 0;
+		relay->statewindow = 0;
+		relay->statedown = 0;
+	}
+
+	mta_relay_unref(relay); /* from mta_query_state() */
+}
+
+/*
+ * Tell the other nodes about a destination: the window we keep to, if
+ * any, and how many deliveries to it have failed in a row.
+ */
+static void
+mta_state_publish(uint64_t id, const char *domain, size_t window)
+{
+	struct mtastate	 st;
+	struct hoststat	*hs;
+	struct mproc	*p;
+	char		 buf[SMTPD_MAXHOSTNAMELEN];
+
+	if (env->sc_mta_state == NULL)
+		return;
+
+	st.until = time(NULL) + MTA_STATE_HOLD;
+	st.window = window;
+	st.failures = 0;
+	if (lowercase(buf, domain, sizeof buf) &&
+	    (hs = dict_get(&hoststat, buf)))
+		st.failures = hs->failures;
+
+	log_debug("debug: mta: publishing shared state for %s: %s",
+	    domain, mtastate_to_text(&st));
+
+	p = lka_peer(id);
+	m_create(p, IMSG_LKA_MTASTATE_UPDATE, 0, 0, -1);
+	m_add_string(p, env->sc_mta_state);
+	m_add_string(p, domain);
+	m_add_string(p, mtastate_to_text(&st));
+	m_close(p);
+	stat_increment("mta.state.published", 1);
+}
+
 static void
 mta_connect(struct mta_connector *c)
 {
 	struct mta_route	*route;
 	struct mta_limits	*l = c->relay->limits;
 	int			 limits;
-	time_t			 nextconn, now;
+	time_t			 nextconn, now, t;
 
 	/* toggle the block flag */
 	if (mta_is_blocked(c->source, c->relay->domain->name))
@@ -1188,6 +1831,33 @@ mta_connect(struct mta_connector *c)
 		log_debug("debug: mta: hit relay limit");
 		limits |= CONNECTOR_LIMIT_RELAY;
 	}
+	if (c->relay->stateuntil > now) {
+		if (c->relay->statedown) {
+			log_debug("debug: mta: %s down as told by the shared "
+			    "state", mta_relay_to_text(c->relay));
+			/* but look again before long */
+			t = c->relay->stateuntil;
+			if (t > now + MTA_STATE_TTL)
+				t = now + MTA_STATE_TTL;
+			if (nextconn < t)
+				nextconn = t;
+		}
+		if (c->relay->statewindow &&
+		    c->relay->nconn >= c->relay->statewindow) {
+			log_debug("debug: mta: hit shared relay window");
+			limits |= CONNECTOR_LIMIT_RELAY;
+		}
+	}
+	if (l->adaptive) {
+		if (c->relay->window == 0)
+			c->relay->window = WINDOW_INIT;
+		if (c->relay->window > l->maxconn_per_relay)
+			c->relay->window = l->maxconn_per_relay;
+		if (c->relay->nconn >= c->relay->window) {
+			log_debug("debug: mta: hit relay window");
+			limits |= CONNECTOR_LIMIT_RELAY;
+		}
+	}
 
 	/* We can connect now, find a route */
 	if (!limits && nextconn <= now)
@@ -1251,6 +1921,7 @@ mta_on_timeout(struct runq *runq, void *arg)
 	struct mta_relay	*relay = arg;
 	struct mta_route	*route = arg;
 	struct hoststat		*hs = arg;
+	struct mta_domain	*domain = arg;
 
 	if (runq == runq_relay) {
 		log_debug("debug: mta: ... timeout for %s",
@@ -1276,6 +1947,16 @@ mta_on_timeout(struct runq *runq, void *arg)
 		mta_hoststat_remove_entry(hs);
 		free(hs);
 	}
+	else if (runq == runq_domain) {
+		log_debug("debug: mta: ... cached MXs expired for %s",
+		    domain->name);
+		mta_domain_free(domain);
+	}
+	else if (runq == runq_shaper) {
+		log_debug("debug: mta: ... shaper timeout for %s",
+		    mta_relay_to_text(relay));
+		mta_shaper_run(relay);
+	}
 }
 
 static void
@@ -1343,6 +2024,11 @@ mta_drain(struct mta_relay *r)
 		return;
 	}
 
+	/* A cached negative MX answer fails the relay right away. */
+	if (r->fail == 0 && r->domain->lastmxquery &&
+	    r->domain->mxstatus != DNS_OK && time(NULL) < r->domain->mxexpire)
+		mta_mx_error(r, r->domain);
+
 	/*
 	 * If we know that this relay is failing flush the tasks.
 	 */
@@ -1359,14 +2045,26 @@ mta_drain(struct mta_relay *r)
 	if (r->backupname && r->backuppref == -1)
 		mta_query_preference(r);
 
-	/* Query the domain MXs if needed. */
+	/*
+	 * Query the domain MXs if needed.  An expired positive answer is
+	 * refreshed in the background while the relay keeps using it.
+	 */
 	if (r->domain->lastmxquery == 0)
 		mta_query_mx(r);
+	else if (time(NULL) >= r->domain->mxexpire) {
+		if (r->domain->mxstatus != DNS_OK)
+			mta_query_mx(r);
+		else if (!r->domain->mxquery)
+			mta_domain_query(r->domain);
+	}
 
 	/* Query the limits if needed. */
 	if (r->limits == NULL)
 		mta_query_limits(r);
 
+	/* Refresh the shared state in the background. */
+	mta_query_state(r);
+
 	/* Wait until we are ready to proceed. */
 	if (r->status & RELAY_WAITMASK) {
 		buf[0] = '\0';
@@ -1400,11 +2098,39 @@ mta_drain(struct mta_relay *r)
 	}
 }
 
+/*
+ * The limits changed: wake up the relays that have work but are not
+ * waiting for anything, they may be allowed to open more connections.
+ */
+static void
+mta_limits_update(void)
+{
+	struct mta_relay	*r;
+
+	SPLAY_FOREACH(r, mta_relay_tree, &relays) {
+		if (r->limits == NULL)
+			continue;
+		if (max_seen_conndelay_route < r->limits->conndelay_route)
+			max_seen_conndelay_route = r->limits->conndelay_route;
+		if (max_seen_discdelay_route < r->limits->discdelay_route)
+			max_seen_discdelay_route = r->limits->discdelay_route;
+		/* shaping turned off, nothing waits on a bucket anymore */
+		if (r->limits->shape_rate <= 0)
+			mta_shaper_release(r);
+		if (r->ntask == 0 || r->status & RELAY_WAITMASK)
+			continue;
+		runq_schedule(runq_relay, time(NULL), NULL, r);
+		r->status |= RELAY_WAIT_CONNECTOR;
+		mta_relay_ref(r);
+	}
+}
+
 static void
 mta_flush(struct mta_relay *relay, int fail, const char *error)
 {
 	struct mta_envelope	*e;
 	struct mta_task		*task;
+	struct mta_shaper	*shaper;
 	const char     		*domain;
 	void			*iter;
 	struct mta_connector	*c;
@@ -1416,6 +2142,19 @@ mta_flush(struct mta_relay *relay, int fail, const char *error)
 	if (fail != IMSG_DELIVERY_TEMPFAIL && fail != IMSG_DELIVERY_PERMFAIL)
 		errx(1, "unexpected delivery status %d", fail);
 
+	/* the deferred tasks share the fate of the others */
+	iter = NULL;
+	while (dict_iter(&relay->shapers, &iter, NULL, (void **)&shaper)) {
+		while ((task = TAILQ_FIRST(&shaper->tasks))) {
+			TAILQ_REMOVE(&shaper->tasks, task, entry);
+			TAILQ_INSERT_TAIL(&relay->tasks, task, entry);
+			relay->ntask += 1;
+		}
+		shaper->ntask = 0;
+	}
+	stat_decrement("mta.task.deferred", relay->ndeferred);
+	relay->ndeferred = 0;
+
 	n = 0;
 	while ((task = TAILQ_FIRST(&relay->tasks))) {
 		TAILQ_REMOVE(&relay->tasks, task, entry);
@@ -1462,6 +2201,172 @@ mta_flush(struct mta_relay *relay, int fail, const char *error)
 	}
 }
 
+/*
+ * The bucket of the envelope on its relay, NULL when not shaping.
+ */
+static struct mta_shaper *
+mta_shaper(struct mta_relay *relay, struct envelope *evp)
+{
+	struct mta_shaper	*s;
+	const char		*key;
+
+	/* ignore if we don't know the limits yet */
+	if (relay->limits == NULL || relay->limits->shape_rate <= 0)
+		return (NULL);
+
+	if (evp->tag[0])
+		key = evp->tag;
+	else if (evp->sender.domain[0])
+		key = evp->sender.domain;
+	else
+		key = "<>";
+
+	if ((s = dict_get(&relay->shapers, key)))
+		return (s);
+
+	s = xcalloc(1, sizeof *s, "mta_shaper");
+	(void)strlcpy(s->key, key, sizeof s->key);
+	s->tokens = SHAPER_MAX(relay->limits);
+	s->last = time(NULL);
+	TAILQ_INIT(&s->tasks);
+	dict_xset(&relay->shapers, s->key, s);
+	stat_increment("mta.shaper", 1);
+
+	/* the runq expires the bucket once refilled */
+	if (!runq_pending(runq_shaper, NULL, relay, NULL)) {
+		runq_schedule(runq_shaper, time(NULL) + 1, NULL, relay);
+		mta_relay_ref(relay);
+	}
+
+	return (s);
+}
+
+static void
+mta_shaper_refill(struct mta_relay *relay, struct mta_shaper *s, time_t now)
+{
+	s->tokens += (int64_t)(now - s->last) * relay->limits->shape_rate;
+	if (s->tokens > SHAPER_MAX(relay->limits))
+		s->tokens = SHAPER_MAX(relay->limits);
+	s->last = now;
+}
+
+/*
+ * Charge the bucket for one task if it can afford it.
+ */
+static int
+mta_shaper_take(struct mta_relay *relay, struct mta_shaper *s, time_t now)
+{
+	mta_shaper_refill(relay, s, now);
+	if (s->tokens < 60)
+		return (0);
+	s->tokens -= 60;
+
+	return (1);
+}
+
+/*
+ * Move the deferred tasks the buckets can now afford to the relay, forget
+ * the idle buckets which have refilled, and come back when the next task
+ * is due.
+ */
+static void
+mta_shaper_run(struct mta_relay *relay)
+{
+	struct mta_shaper	*s;
+	struct mta_task		*task;
+	struct dict		 keep;
+	int64_t			 max, need;
+	time_t			 now, delay, next;
+	size_t			 n;
+
+	if (relay->limits->shape_rate <= 0) {
+		if (mta_shaper_release(relay))
+			mta_drain(relay);
+		mta_relay_unref(relay); /* from the last schedule */
+		return;
+	}
+
+	now = time(NULL);
+	max = SHAPER_MAX(relay->limits);
+	next = 0;
+	n = 0;
+
+	dict_init(&keep);
+	while (dict_poproot(&relay->shapers, (void **)&s)) {
+		while ((task = TAILQ_FIRST(&s->tasks)) &&
+		    mta_shaper_take(relay, s, now)) {
+			TAILQ_REMOVE(&s->tasks, task, entry);
+			s->ntask -= 1;
+			relay->ndeferred -= 1;
+			TAILQ_INSERT_TAIL(&relay->tasks, task, entry);
+			relay->ntask += 1;
+			n++;
+		}
+		mta_shaper_refill(relay, s, now);
+		if (task == NULL && s->tokens >= max) {
+			free(s);
+			stat_decrement("mta.shaper", 1);
+			continue;
+		}
+
+		need = (task ? 60 : max) - s->tokens;
+		delay = (need + relay->limits->shape_rate - 1) /
+		    relay->limits->shape_rate;
+		if (delay < 1)
+			delay = 1;
+		if (next == 0 || delay < next)
+			next = delay;
+		dict_xset(&keep, s->key, s);
+	}
+	relay->shapers = keep;
+
+	if (n) {
+		log_debug("debug: mta: released %zu deferred task(s) on %s",
+		    n, mta_relay_to_text(relay));
+		stat_decrement("mta.task.deferred", n);
+	}
+
+	if (next) {
+		runq_schedule(runq_shaper, now + next, NULL, relay);
+		mta_relay_ref(relay);
+	}
+	if (n)
+		mta_drain(relay);
+	mta_relay_unref(relay); /* from the last schedule */
+}
+
+/*
+ * Move all the deferred tasks back to the relay and drop the buckets,
+ * once the relay is no longer shaped.
+ */
+static size_t
+mta_shaper_release(struct mta_relay *relay)
+{
+	struct mta_shaper	*s;
+	struct mta_task		*task;
+	size_t			 n;
+
+	n = 0;
+	while (dict_poproot(&relay->shapers, (void **)&s)) {
+		while ((task = TAILQ_FIRST(&s->tasks))) {
+			TAILQ_REMOVE(&s->tasks, task, entry);
+			TAILQ_INSERT_TAIL(&relay->tasks, task, entry);
+			relay->ntask += 1;
+			n++;
+		}
+		free(s);
+		stat_decrement("mta.shaper", 1);
+	}
+	relay->ndeferred -= n;
+	if (n) {
+		log_debug("debug: mta: released %zu deferred task(s) on %s",
+		    n, mta_relay_to_text(relay));
+		stat_decrement("mta.task.deferred", n);
+	}
+
+	return (n);
+}
+
 /*
  * Find a route to use for this connector
  */
@@ -1469,11 +2374,14 @@ static struct mta_route *
 mta_find_route(struct mta_connector *c, time_t now, int *limits,
     time_t *nextconn)
 {
-	struct mta_route	*route, *best;
+	struct mta_route	*route;
+	struct mta_host		*best;
 	struct mta_limits	*l = c->relay->limits;
 	struct mta_mx		*mx;
 	int			 level, limit_host, limit_route;
 	int			 family_mismatch, seen, suspended_route;
+	size_t			 nconn, rank, bestrank;
+	int			 busy4, busy6;
 	time_t			 tm;
 
 	log_debug("debug: mta-routing: searching new route for %s...",
@@ -1486,8 +2394,23 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 	family_mismatch = 0;
 	level = -1;
 	best = NULL;
+	bestrank = 0;
 	seen = 0;
 
+	/*
+	 * RFC 8305: while connections to one address family are still
+	 * pending, the next attempt goes to the other family first.
+	 */
+	busy4 = busy6 = 0;
+	TAILQ_FOREACH(mx, &c->relay->domain->mxs, entry) {
+		if (mx->host->nconnecting == 0)
+			continue;
+		if (mx->host->sa->sa_family == AF_INET6)
+			busy6 = 1;
+		else
+			busy4 = 1;
+	}
+
 	TAILQ_FOREACH(mx, &c->relay->domain->mxs, entry) {
 		/*
 		 * New preference level
@@ -1554,69 +2477,78 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 			continue;
 		}
 
-		route = mta_route(c->source, mx->host);
+		/*
+		 * Only peek at the route here: taking a reference would
+		 * pull it off the keepalive runq and put it back for every
+		 * candidate examined.  A route not yet known is unused.
+		 */
+		route = mta_route_find(c->source, mx->host);
+		nconn = route ? route->nconn : 0;
 
-		if (route->flags & ROUTE_DISABLED) {
+		if (route && route->flags & ROUTE_DISABLED) {
 			log_debug("debug: mta-routing: skipping route %s: suspend",
 			    mta_route_to_text(route));
 			suspended_route |= route->flags & ROUTE_DISABLED;
-			mta_route_unref(route); /* from here */
 			continue;
 		}
 
-		if (route->nconn && (route->flags & ROUTE_NEW)) {
+		if (route && route->nconn && (route->flags & ROUTE_NEW)) {
 			log_debug("debug: mta-routing: skipping route %s: not validated yet",
 			    mta_route_to_text(route));
 			limit_route = 1;
-			mta_route_unref(route); /* from here */
 			continue;
 		}
 
-		if (route->nconn >= l->maxconn_per_route) {
-			log_debug("debug: mta-routing: skipping route %s: too many connections",
-			    mta_route_to_text(route));
+		if (nconn >= l->maxconn_per_route) {
+			log_debug("debug: mta-routing: skipping host %s: too many connections on route",
+			    mta_host_to_text(mx->host));
 			limit_route = 1;
-			mta_route_unref(route); /* from here */
 			continue;
 		}
 
-		if (route->lastconn + l->conndelay_route > now) {
+		if (route && route->lastconn + l->conndelay_route > now) {
 			log_debug("debug: mta-routing: skipping route %s: cannot use before %llus (delay after connect)",
 			    mta_route_to_text(route),
 			    (unsigned long long) route->lastconn + l->conndelay_route - now);
 			if (tm == 0 || route->lastconn + l->conndelay_route < tm)
 				tm = route->lastconn + l->conndelay_route;
-			mta_route_unref(route); /* from here */
 			continue;
 		}
 
-		if (route->lastdisc + l->discdelay_route > now) {
+		if (route && route->lastdisc + l->discdelay_route > now) {
 			log_debug("debug: mta-routing: skipping route %s: cannot use before %llus (delay after disconnect)",
 			    mta_route_to_text(route),
 			    (unsigned long long) route->lastdisc + l->discdelay_route - now);
 			if (tm == 0 || route->lastdisc + l->discdelay_route < tm)
 				tm = route->lastdisc + l->discdelay_route;
-			mta_route_unref(route); /* from here */
 			continue;
 		}
 
-		/* Use the route with the lowest number of connections. */
-		if (best && route->nconn >= best->nconn) {
-			log_debug("debug: mta-routing: skipping route %s: current one is better",
-			    mta_route_to_text(route));
-			mta_route_unref(route); /* from here */
+		/*
+		 * Use the route with the lowest number of connections,
+		 * on the address family not waiting for a connect.
+		 */
+		rank = nconn * 2;
+		if (mx->host->sa->sa_family == AF_INET6 ? busy6 : busy4)
+			rank += 1;
+		if (best && rank >= bestrank) {
+			log_debug("debug: mta-routing: skipping host %s: current one is better",
+			    mta_host_to_text(mx->host));
 			continue;
 		}
 
-		if (best)
-			mta_route_unref(best); /* from here */
-		best = route;
-		log_debug("debug: mta-routing: selecting candidate route %s",
-		    mta_route_to_text(route));
+		best = mx->host;
+		bestrank = rank;
+		log_debug("debug: mta-routing: selecting candidate host %s",
+		    mta_host_to_text(mx->host));
+
+		/* nothing can beat an unused route */
+		if (bestrank == 0)
+			break;
 	}
 
 	if (best)
-		return (best);
+		return (mta_route(c->source, best));
 
 	/* Order is important */
 	if (seen == 0) {
@@ -1657,9 +2589,13 @@ static void
 mta_log(const struct mta_envelope *evp, const char *prefix, const char *source,
     const char *relay, const char *status)
 {
+	char	latency[256];
+
+	evptrace_log(&evp->trace, evp->id, latency, sizeof latency);
+
 	log_info("relay: %s for %016" PRIx64 ": session=%016"PRIx64", "
 	    "from=<%s>, to=<%s>, rcpt=<%s>, source=%s, "
-	    "relay=%s, delay=%s, stat=%s",
+	    "relay=%s, delay=%s, stat=%s%s",
 	    prefix,
 	    evp->id,
 	    evp->session,
@@ -1669,7 +2605,8 @@ mta_log(const struct mta_envelope *evp, const char *prefix, const char *source,
 	    source ? source : "-",
 	    relay,
 	    duration_to_text(time(NULL) - evp->creation),
-	    status);
+	    status,
+	    latency);
 }
 
 static struct mta_relay *
@@ -1715,6 +2652,7 @@ mta_relay(struct envelope *e)
 	if ((r = SPLAY_FIND(mta_relay_tree, &relays, &key)) == NULL) {
 		r = xcalloc(1, sizeof *r, "mta_relay");
 		TAILQ_INIT(&r->tasks);
+		dict_init(&r->shapers);
 		r->id = generate_uid();
 		r->flags = key.flags;
 		r->domain = key.domain;
@@ -1866,7 +2804,7 @@ mta_relay_show(struct mta_relay *r, struct mproc *p, uint32_t id, time_t t)
 {
 	struct mta_connector	*c;
 	void			*iter;
-	char			 buf[1024], flags[1024], dur[64];
+	char			 buf[1024], flags[1024], dur[64], win[32];
 	time_t			 to;
 
 	flags[0] = '\0';
@@ -1892,17 +2830,27 @@ mta_relay_show(struct mta_relay *r, struct mproc *p, uint32_t id, time_t t)
 	else
 		strlcpy(dur, "-", sizeof(dur));
 
-	snprintf(buf, sizeof(buf), "%s refcount=%d ntask=%zu nconn=%zu lastconn=%s timeout=%s wait=%s%s",
+	if (r->limits && r->limits->adaptive && r->window)
+		snprintf(win, sizeof(win), "%zu", r->window);
+	else
+		strlcpy(win, "-", sizeof(win));
+
+	snprintf(buf, sizeof(buf), "%s refcount=%d ntask=%zu deferred=%zu nconn=%zu window=%s lastconn=%s timeout=%s wait=%s%s",
 	    mta_relay_to_text(r),
 	    r->refcount,
 	    r->ntask,
+	    r->ndeferred,
 	    r->nconn,
+	    win,
 	    r->lastconn ? duration_to_text(t - r->lastconn) : "-",
 	    dur,
 	    flags,
 	    (r->state & RELAY_ONHOLD) ? "ONHOLD" : "");
 	m_compose(p, IMSG_CTL_MTA_SHOW_RELAYS, id, 0, -1, buf, strlen(buf) + 1);
 
+	snprintf(buf, sizeof(buf), "  %s", mta_stats_to_text(&r->stats, t));
+	m_compose(p, IMSG_CTL_MTA_SHOW_RELAYS, id, 0, -1, buf, strlen(buf) + 1);
+
 	iter = NULL;
 	while (tree_iter(&r->connectors, &iter, NULL, (void **)&c)) {
 
@@ -2096,42 +3044,148 @@ mta_domain(char *name, int flags)
 		d->name = xstrdup(name, "mta_domain");
 		d->flags = flags;
 		TAILQ_INIT(&d->mxs);
+		TAILQ_INIT(&d->mxpending);
 		SPLAY_INSERT(mta_domain_tree, &domains, d);
 		stat_increment("mta.domain", 1);
 	}
+	else if (d->refcount == 0) {
+		/* revive a cached domain before its MXs expire */
+		runq_cancel(runq_domain, NULL, d);
+		stat_increment("mta.domain.cache.hit", 1);
+	}
 
 	d->refcount++;
 	return (d);
 }
 
-#if 0
 static void
 mta_domain_ref(struct mta_domain *d)
 {
 	d->refcount++;
 }
-#endif
 
 static void
 mta_domain_unref(struct mta_domain *d)
 {
-	struct mta_mx	*mx;
-
 	if (--d->refcount)
 		return;
 
-	while ((mx = TAILQ_FIRST(&d->mxs))) {
-		TAILQ_REMOVE(&d->mxs, mx, entry);
-		mta_host_unref(mx->host); /* from IMSG_DNS_HOST */
-		free(mx);
+	/* Keep the answer for the next relay until its TTL runs out. */
+	if (d->lastmxquery && d->mxexpire > time(NULL)) {
+		runq_schedule(runq_domain, d->mxexpire, NULL, d);
+		return;
 	}
 
+	mta_domain_free(d);
+}
+
+static void
+mta_domain_free(struct mta_domain *d)
+{
+	mta_domain_clear(d, 0);
+	mta_domain_clear(d, 1);
+
 	SPLAY_REMOVE(mta_domain_tree, &domains, d);
 	free(d->name);
 	free(d);
 	stat_decrement("mta.domain", 1);
 }
 
+static void
+mta_domain_query(struct mta_domain *d)
+{
+	uint64_t	id;
+
+	id = generate_uid();
+	tree_xset(&wait_mx, id, d);
+	d->mxquery = 1;
+	mta_domain_ref(d);
+	if (d->flags)
+		dns_query_host(id, d->name);
+	else
+		dns_query_mx(id, d->name);
+}
+
+static void
+mta_domain_set_mxs(struct mta_domain *d, int dnserror, int ttl)
+{
+	struct mta_mx	*mx;
+	time_t		 now;
+	int		 refresh;
+
+	now = time(NULL);
+	refresh = (d->lastmxquery && d->mxstatus == DNS_OK);
+	d->mxquery = 0;
+
+	if (refresh && dnserror == DNS_RETRY) {
+		log_info("smtp-out: Failed to refresh MX for %s, "
+		    "keeping cached entries", d->name);
+		mta_domain_clear(d, 1);
+		d->mxexpire = now + MX_TTL_NEGATIVE;
+		return;
+	}
+
+	mta_domain_clear(d, 0);
+	while ((mx = TAILQ_FIRST(&d->mxpending))) {
+		TAILQ_REMOVE(&d->mxpending, mx, entry);
+		TAILQ_INSERT_TAIL(&d->mxs, mx, entry);
+	}
+	d->mxstatus = dnserror;
+	d->lastmxquery = now;
+
+	switch (dnserror) {
+	case DNS_OK:
+		if (ttl == -1)
+			ttl = MX_TTL_DEFAULT;
+		else if (ttl < MX_TTL_MIN)
+			ttl = MX_TTL_MIN;
+		else if (ttl > MX_TTL_MAX)
+			ttl = MX_TTL_MAX;
+		break;
+	case DNS_RETRY:
+		ttl = 0;
+		break;
+	default:
+		ttl = MX_TTL_NEGATIVE;
+		break;
+	}
+	d->mxexpire = now + ttl;
+
+	if (d->mxstatus == DNS_OK) {
+		log_debug("debug: MXs for domain %s (ttl %d):", d->name, ttl);
+		TAILQ_FOREACH(mx, &d->mxs, entry)
+			log_debug("	%s preference %d",
+			    sa_to_text(mx->host->sa), mx->preference);
+	}
+	else
+		log_debug("debug: Failed MX query for %s:", d->name);
+
+	/* Relays only wait on the initial query, not on refreshes. */
+	if (!refresh)
+		waitq_run(&d->mxs, d);
+}
+
+static void
+mta_domain_clear(struct mta_domain *d, int pending)
+{
+	struct mta_mx	*mx;
+
+	if (pending) {
+		while ((mx = TAILQ_FIRST(&d->mxpending))) {
+			TAILQ_REMOVE(&d->mxpending, mx, entry);
+			mta_host_unref(mx->host); /* from IMSG_DNS_HOST */
+			free(mx);
+		}
+	}
+	else {
+		while ((mx = TAILQ_FIRST(&d->mxs))) {
+			TAILQ_REMOVE(&d->mxs, mx, entry);
+			mta_host_unref(mx->host); /* from IMSG_DNS_HOST */
+			free(mx);
+		}
+	}
+}
+
 static int
 mta_domain_cmp(const struct mta_domain *a, const struct mta_domain *b)
 {
@@ -2296,6 +3350,16 @@ mta_route(struct mta_source *src, struct mta_host *dst)
 	return (r);
 }
 
+static struct mta_route *
+mta_route_find(struct mta_source *src, struct mta_host *dst)
+{
+	struct mta_route	key;
+
+	key.src = src;
+	key.dst = dst;
+	return (SPLAY_FIND(mta_route_tree, &routes, &key));
+}
+
 static void
 mta_route_ref(struct mta_route *r)
 {
@@ -2464,7 +3528,7 @@ SPLAY_GENERATE(mta_block_tree, mta_block, entry, mta_block_cmp);
 
 /* hoststat errors are not critical, we do best effort */
 void
-mta_hoststat_update(const char *host, const char *error)
+mta_hoststat_update(const char *host, int delivery, const char *error)
 {
 	struct hoststat	*hs = NULL;
 	char		 buf[SMTPD_MAXHOSTNAMELEN];
@@ -2488,6 +3552,82 @@ mta_hoststat_update(const char *host, const char *error)
 
 	runq_cancel(runq_hoststat, NULL, hs);
 	runq_schedule(runq_hoststat, tm+HOSTSTAT_EXPIRE_DELAY, NULL, hs);
+
+	/*
+	 * Tell the scheduler when a host goes down, at each doubling of
+	 * its failure count, and when it comes back.
+	 */
+	if (delivery == IMSG_DELIVERY_TEMPFAIL) {
+		hs->ntempfail++;
+		hs->failures++;
+		if ((hs->failures & (hs->failures - 1)) == 0 &&
+		    hs->failures >= HOSTSTAT_DOWN)
+			mta_hoststat_notify(hs);
+	}
+	else {
+		/* the host answered, it is not down */
+		if (delivery == IMSG_DELIVERY_OK) {
+			hs->nok++;
+			hs->lastsuccess = tm;
+		}
+		mta_hoststat_up(hs);
+	}
+}
+
+static void
+mta_hoststat_up(struct hoststat *hs)
+{
+	int	down;
+
+	down = hs->failures >= HOSTSTAT_DOWN;
+	hs->failures = 0;
+	if (down)
+		mta_hoststat_notify(hs);
+}
+
+static void
+mta_hoststat_notify(struct hoststat *hs)
+{
+	struct mta_relay	*r;
+	uint32_t		 rate;
+	size_t			 window;
+
+	rate = hs->ntempfail * 1000ULL / (hs->ntempfail + hs->nok);
+
+	m_create(p_queue, IMSG_MTA_HOSTSTAT, 0, 0, -1);
+	m_add_string(p_queue, hs->name);
+	m_add_u32(p_queue, hs->failures);
+	m_add_u32(p_queue, rate);
+	m_add_time(p_queue, hs->lastsuccess);
+	m_close(p_queue);
+
+	if (env->sc_mta_state == NULL)
+		return;
+
+	/* do not lift the window the domain was throttled to */
+	window = 0;
+	SPLAY_FOREACH(r, mta_relay_tree, &relays)
+		if (r->stateuntil > time(NULL) && r->statewindow &&
+		    !strcmp(r->domain->name, hs->name) &&
+		    (window == 0 || r->statewindow < window))
+			window = r->statewindow;
+	mta_state_publish(0, hs->name, window);
+}
+
+int
+mta_hoststat_down(const char *host)
+{
+	struct hoststat	*hs = NULL;
+	char		 buf[SMTPD_MAXHOSTNAMELEN];
+
+	if (! lowercase(buf, host, sizeof buf))
+		return (0);
+
+	hs = dict_get(&hoststat, buf);
+	if (hs == NULL)
+		return (0);
+
+	return (hs->failures >= HOSTSTAT_DOWN);
 }
 
 void
@@ -2539,6 +3679,7 @@ mta_hoststat_reschedule(const char *host)
 	if (hs == NULL)
 		return;
 
+	mta_hoststat_up(hs);
 	while (tree_poproot(&hs->deferred, &evpid, NULL)) {
 		m_compose(p_queue, IMSG_MTA_SCHEDULE, 0, 0, -1,
 		    &evpid, sizeof evpid);
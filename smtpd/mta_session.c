@@ -49,6 +49,12 @@
 #define MAX_TRYBEFOREDISABLE	10
 
 #define MTA_HIWAT		65535
+#define MTA_CONNECT_TIMEOUT	30000
+#define MTA_TIMEOUT		300000
+#define MTA_DATA_CHUNK		16384
+#define MTA_HEAD_MAX		(256 * 1024)	/* headers kept by the loop check */
+#define MTA_BDAT_WINDOW		16
+#define MTA_TLS_CACHE_MAX	1024
 
 enum mta_state {
 	MTA_INIT,
@@ -90,12 +96,18 @@ enum mta_state {
 #define MTA_LMTP		0x0800
 #define MTA_WAIT		0x1000
 #define MTA_HANGON		0x2000
+#define MTA_MIDLINE		0x4000
+#define MTA_PIPELINE		0x8000
+#define MTA_TLS_RESUME		0x10000
+#define MTA_CONNECTING		0x20000
+#define MTA_BACKOFF		0x40000
 
 #define MTA_EXT_STARTTLS	0x01
 #define MTA_EXT_PIPELINING	0x02
 #define MTA_EXT_AUTH		0x04
 #define MTA_EXT_AUTH_PLAIN     	0x08
 #define MTA_EXT_AUTH_LOGIN     	0x10
+#define MTA_EXT_CHUNKING	0x20
 
 struct mta_session {
 	uint64_t		 id;
@@ -118,16 +130,33 @@ struct mta_session {
 	size_t			 msgtried;
 	size_t			 msgcount;
 	size_t			 rcptcount;
+	size_t			 rcptpending;
+	size_t			 bdatpending;
 	int			 hangon;
 
 	enum mta_state		 state;
 	struct mta_task		*task;
 	struct mta_envelope	*currevp;
 	FILE			*datafp;
+	char			*head;		/* headers read by the loop check */
+	size_t			 headlen;
+	size_t			 headoff;
+	size_t			 databytes;
+
+	enum mta_phase		 phase;
+	struct timespec		 phasestart;
+	uint64_t		 connected;	/* for envelope traces */
 
 	size_t			 failures;
 };
 
+/* TLS sessions kept for resumption, keyed by host address and identity */
+struct mta_tls_session {
+	TAILQ_ENTRY(mta_tls_session)	 entry;
+	char				*key;
+	SSL_SESSION			*session;
+};
+
 static void mta_session_init(void);
 static void mta_start(int fd, short ev, void *arg);
 static void mta_io(struct io *, int);
@@ -135,24 +164,37 @@ static void mta_free(struct mta_session *);
 static void mta_on_ptr(void *, void *, void *);
 static void mta_on_timeout(struct runq *, void *);
 static void mta_connect(struct mta_session *);
+static void mta_connect_done(struct mta_session *);
+static void mta_backoff(struct mta_session *, const char *);
 static void mta_enter_state(struct mta_session *, int);
 static void mta_flush_task(struct mta_session *, int, const char *, size_t, int);
 static void mta_error(struct mta_session *, const char *, ...);
 static void mta_send(struct mta_session *, char *, ...);
 static ssize_t mta_queue_data(struct mta_session *);
+static void mta_queue_chunk(struct mta_session *, const char *, size_t);
+static void mta_send_rcpt(struct mta_session *, struct mta_envelope *);
+static void mta_wait_replies(struct mta_session *);
 static void mta_response(struct mta_session *, char *);
 static const char * mta_strstate(int);
-static int mta_check_loop(FILE *);
+static int mta_check_loop(struct mta_session *);
+static void mta_data_close(struct mta_session *);
+static void mta_phase(struct mta_session *, enum mta_phase);
+static enum mta_phase mta_state_phase(int);
 static void mta_start_tls(struct mta_session *);
+static void mta_tls_key(struct mta_session *, char *, size_t);
+static void mta_tls_resume(struct mta_session *, void *);
+static void mta_tls_save(struct mta_session *);
+static void mta_tls_drop(const char *);
 static int mta_verify_certificate(struct mta_session *);
 static struct mta_session *mta_tree_pop(struct tree *, uint64_t);
 static const char * dsn_strret(enum dsn_ret);
 static const char * dsn_strnotify(uint8_t);
 
-void mta_hoststat_update(const char *, const char *);
+void mta_hoststat_update(const char *, int, const char *);
 void mta_hoststat_reschedule(const char *);
 void mta_hoststat_cache(const char *, uint64_t);
 void mta_hoststat_uncache(const char *, uint64_t);
+int mta_hoststat_down(const char *);
 
 static struct tree wait_helo;
 static struct tree wait_ptr;
@@ -160,6 +202,9 @@ static struct tree wait_fd;
 static struct tree wait_ssl_init;
 static struct tree wait_ssl_verify;
 
+static struct dict tls_sessions;
+static TAILQ_HEAD(, mta_tls_session) tls_lru;
+
 static struct runq *hangon;
 
 static void
@@ -173,6 +218,8 @@ mta_session_init(void)
 		tree_init(&wait_fd);
 		tree_init(&wait_ssl_init);
 		tree_init(&wait_ssl_verify);
+		dict_init(&tls_sessions);
+		TAILQ_INIT(&tls_lru);
 		runq_init(&hangon, mta_on_timeout);
 		init = 1;
 	}
@@ -191,6 +238,8 @@ mta_session(struct mta_relay *relay, struct mta_route *route)
 	s->relay = relay;
 	s->route = route;
 	s->io.sock = -1;
+	s->io.src = -1;
+	s->phase = MTA_PHASE_NONE;
 
 	if (relay->flags & RELAY_SSL && relay->flags & RELAY_AUTH)
 		s->flags |= MTA_USE_AUTH;
@@ -277,10 +326,9 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 		if (s->datafp == NULL)
 			fatal("mta: fdopen");
 
-		if (mta_check_loop(s->datafp)) {
+		if (mta_check_loop(s)) {
 			log_debug("debug: mta: loop detected");
-			fclose(s->datafp);
-			s->datafp = NULL;
+			mta_data_close(s);
 			mta_flush_task(s, IMSG_DELIVERY_LOOP,
 			    "Loop detected", 0, 0);
 			mta_enter_state(s, MTA_READY);
@@ -324,9 +372,10 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 				return;
 			}
 			else {
-				ssl = ssl_mta_init(NULL, 0, NULL, 0);
+				ssl = ssl_mta_init(NULL, NULL, 0);
 				if (ssl == NULL)
 					fatal("mta: ssl_mta_init");
+				mta_tls_resume(s, ssl);
 				io_start_tls(&s->io, ssl);
 				return;
 			}
@@ -335,19 +384,25 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 		resp_ca_cert = xmemdup(imsg->data, sizeof *resp_ca_cert, "mta:ca_cert");
 		resp_ca_cert->cert = xstrdup((char *)imsg->data +
 		    sizeof *resp_ca_cert, "mta:ca_cert");
-		resp_ca_cert->key = xstrdup((char *)imsg->data +
-		    sizeof *resp_ca_cert + resp_ca_cert->cert_len,
-		    "mta:ca_key");
-		ssl = ssl_mta_init(resp_ca_cert->cert, resp_ca_cert->cert_len,
-		    resp_ca_cert->key, resp_ca_cert->key_len);
-		if (ssl == NULL)
-			fatal("mta: ssl_mta_init");
+		ssl = ssl_mta_init(s->relay->pki_name ? s->relay->pki_name :
+		    s->helo, resp_ca_cert->cert, resp_ca_cert->cert_len);
+		if (ssl == NULL && s->relay->pki_name == NULL)
+			/* e.g. a non-RSA key, go on without a certificate */
+			ssl = ssl_mta_init(NULL, NULL, 0);
+		if (ssl == NULL) {
+			log_info("smtp-out: Disconnecting session %016"PRIx64
+			    ": cannot set up TLS", s->id);
+			memset(resp_ca_cert->cert, 0, resp_ca_cert->cert_len);
+			free(resp_ca_cert->cert);
+			free(resp_ca_cert);
+			mta_free(s);
+			return;
+		}
+		mta_tls_resume(s, ssl);
 		io_start_tls(&s->io, ssl);
 
 		memset(resp_ca_cert->cert, 0, resp_ca_cert->cert_len);
-		memset(resp_ca_cert->key, 0, resp_ca_cert->key_len);
 		free(resp_ca_cert->cert);
-		free(resp_ca_cert->key);
 		free(resp_ca_cert);
 		return;
 
@@ -360,6 +415,7 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 		if (resp_ca_vrfy->status == CA_OK)
 			s->flags |= MTA_VERIFIED;
 		else if (s->relay->flags & F_TLS_VERIFY) {
+			mta_tls_save(s);
 			errno = 0;
 			mta_error(s, "SSL certificate check failed");
 			mta_free(s);
@@ -423,6 +479,9 @@ mta_free(struct mta_session *s)
 
 	log_debug("debug: mta: %p: session done", s);
 
+	mta_connect_done(s);
+	mta_phase(s, MTA_PHASE_NONE);
+
 	if (s->ready)
 		s->relay->nconn_ready -= 1;
 
@@ -436,8 +495,7 @@ mta_free(struct mta_session *s)
 
 	if (s->task)
 		fatalx("current task should have been deleted already");
-	if (s->datafp)
-		fclose(s->datafp);
+	mta_data_close(s);
 	if (s->helo)
 		free(s->helo);
 
@@ -481,6 +539,7 @@ mta_start(int fd, short ev, void *arg)
 static void
 mta_connect(struct mta_session *s)
 {
+	struct mproc		*p;
 	struct sockaddr_storage	 ss;
 	struct sockaddr		*sa;
 	int			 portno;
@@ -488,11 +547,12 @@ mta_connect(struct mta_session *s)
 
 	if (s->helo == NULL) {
 		if (s->relay->helotable && s->route->src->sa) {
-			m_create(p_lka, IMSG_LKA_HELO, 0, 0, -1);
-			m_add_id(p_lka, s->id);
-			m_add_string(p_lka, s->relay->helotable);
-			m_add_sockaddr(p_lka, s->route->src->sa);
-			m_close(p_lka);
+			p = lka_peer(s->id);
+			m_create(p, IMSG_LKA_HELO, 0, 0, -1);
+			m_add_id(p, s->id);
+			m_add_string(p, s->relay->helotable);
+			m_add_sockaddr(p, s->route->src->sa);
+			m_close(p);
 			tree_xset(&wait_helo, s->id, s);
 			s->flags |= MTA_WAIT;
 			return;
@@ -503,6 +563,7 @@ mta_connect(struct mta_session *s)
 			s->helo = xstrdup(env->sc_hostname, "mta_connect");
 	}
 
+	mta_connect_done(s);
 	io_clear(&s->io);
 	iobuf_clear(&s->iobuf);
 
@@ -560,7 +621,8 @@ mta_connect(struct mta_session *s)
 	mta_enter_state(s, MTA_INIT);
 	iobuf_xinit(&s->iobuf, 0, 0, "mta_connect");
 	io_init(&s->io, -1, s, mta_io, &s->iobuf);
-	io_set_timeout(&s->io, 300000);
+	/* a black-holed address must not hold the session for long */
+	io_set_timeout(&s->io, MTA_CONNECT_TIMEOUT);
 	if (io_connect(&s->io, sa, s->route->src->sa) == -1) {
 		/*
 		 * This error is most likely a "no route",
@@ -572,12 +634,35 @@ mta_connect(struct mta_session *s)
 		else
 			mta_error(s, "Connection failed: %s", s->io.error);
 		mta_free(s);
+		return;
 	}
+	s->flags |= MTA_CONNECTING;
+	s->route->dst->nconnecting += 1;
+}
+
+/* let the relay window shrink, once per session */
+static void
+mta_backoff(struct mta_session *s, const char *reason)
+{
+	if (s->flags & MTA_BACKOFF)
+		return;
+	s->flags |= MTA_BACKOFF;
+	mta_relay_backoff(s->relay, reason);
+}
+
+static void
+mta_connect_done(struct mta_session *s)
+{
+	if (!(s->flags & MTA_CONNECTING))
+		return;
+	s->flags &= ~MTA_CONNECTING;
+	s->route->dst->nconnecting -= 1;
 }
 
 static void
 mta_enter_state(struct mta_session *s, int newstate)
 {
+	struct mta_relay	 *relay;
 	struct mta_envelope	 *e;
 	size_t			 envid_sz;
 	int			 oldstate;
@@ -594,6 +679,7 @@ mta_enter_state(struct mta_session *s, int newstate)
 	    mta_strstate(newstate));
 
 	s->state = newstate;
+	mta_phase(s, mta_state_phase(newstate));
 
 	/* don't try this at home! */
 #define mta_enter_state(_s, _st) do { newstate = _st; goto again; } while (0)
@@ -731,6 +817,11 @@ mta_enter_state(struct mta_session *s, int newstate)
 		}
 
 		s->task = mta_route_next_task(s->relay, s->route);
+		if (s->task == NULL &&
+		    (relay = mta_route_share(s->relay, s->route))) {
+			s->relay = relay;
+			s->task = mta_route_next_task(s->relay, s->route);
+		}
 		if (s->task == NULL) {
 			log_debug("debug: mta: %p: no task for relay %s",
 			    s, mta_relay_to_text(s->relay));
@@ -780,28 +871,59 @@ mta_enter_state(struct mta_session *s, int newstate)
 			    envid_sz ? e->dsn_envid : "");
 		} else
 			mta_send(s, "MAIL FROM:<%s>", s->task->sender);
+
+		/*
+		 * RFC 2920: send the whole transaction up to DATA as one
+		 * group, the replies are matched in order in mta_response().
+		 */
+		if (s->ext & MTA_EXT_PIPELINING) {
+			s->flags |= MTA_PIPELINE;
+			s->rcptpending = 0;
+			TAILQ_FOREACH(e, &s->task->envelopes, entry) {
+				mta_send_rcpt(s, e);
+				s->rcptpending++;
+			}
+			if (!(s->ext & MTA_EXT_CHUNKING)) {
+				s->headoff = 0;
+				s->databytes = 0;
+				s->flags &= ~MTA_MIDLINE;
+				mta_send(s, "DATA");
+			}
+		}
 		break;
 
 	case MTA_RCPT:
+		if (s->flags & MTA_PIPELINE)
+			break;
+
 		if (s->currevp == NULL)
 			s->currevp = TAILQ_FIRST(&s->task->envelopes);
 
-		e = s->currevp;
-		if (s->ext & MTA_EXT_DSN) {
-			mta_send(s, "RCPT TO:<%s> %s%s %s%s",
-			    e->dest,
-			    e->dsn_notify ? "NOTIFY=" : "",
-			    e->dsn_notify ? dsn_strnotify(e->dsn_notify) : "",
-			    e->dsn_orcpt ? "ORCPT=" : "",
-			    e->dsn_orcpt ? e->dsn_orcpt : "");
-		} else
-			mta_send(s, "RCPT TO:<%s>", e->dest);
-
-		s->rcptcount++;
+		mta_send_rcpt(s, s->currevp);
 		break;
 
 	case MTA_DATA:
-		fseek(s->datafp, 0, SEEK_SET);
+		/* RFC 3030: no DATA, the body goes out in BDAT chunks */
+		if (s->ext & MTA_EXT_CHUNKING) {
+			s->flags &= ~MTA_PIPELINE;
+			if (s->task == NULL) {
+				mta_enter_state(s, MTA_RSET);
+				break;
+			}
+			s->headoff = 0;
+			s->databytes = 0;
+			s->flags &= ~MTA_MIDLINE;
+			s->bdatpending = 0;
+			mta_enter_state(s, MTA_BODY);
+			break;
+		}
+
+		if (s->flags & MTA_PIPELINE)
+			break;
+
+		s->headoff = 0;
+		s->databytes = 0;
+		s->flags &= ~MTA_MIDLINE;
 		mta_send(s, "DATA");
 		break;
 
@@ -812,6 +934,11 @@ mta_enter_state(struct mta_session *s, int newstate)
 			break;
 		}
 
+		/* wait for replies to the chunks in flight */
+		if ((s->ext & MTA_EXT_CHUNKING) &&
+		    s->bdatpending >= MTA_BDAT_WINDOW)
+			break;
+
 		if ((q = mta_queue_data(s)) == -1) {
 			s->flags |= MTA_FREE;
 			break;
@@ -825,6 +952,16 @@ mta_enter_state(struct mta_session *s, int newstate)
 		break;
 
 	case MTA_EOM:
+		if ((s->ext & MTA_EXT_CHUNKING) && s->task) {
+			/* the final CRLF, if missing, travels with LAST */
+			if (s->flags & MTA_MIDLINE) {
+				mta_send(s, "BDAT 2 LAST");
+				iobuf_xfqueue(&s->iobuf, "mta_enter_state", "\r\n");
+			}
+			else
+				mta_send(s, "BDAT 0 LAST");
+			break;
+		}
 		mta_send(s, ".");
 		break;
 
@@ -834,10 +971,7 @@ mta_enter_state(struct mta_session *s, int newstate)
 		break;
 
 	case MTA_RSET:
-		if (s->datafp) {
-			fclose(s->datafp);
-			s->datafp = NULL;
-		}
+		mta_data_close(s);
 		mta_send(s, "RSET");
 		break;
 
@@ -968,6 +1102,12 @@ mta_response(struct mta_session *s, char *line)
 			else
 				delivery = IMSG_DELIVERY_TEMPFAIL;
 			mta_flush_task(s, delivery, line, 0, 0);
+			/* drain the replies to the rest of the group */
+			if (s->flags & MTA_PIPELINE) {
+				s->currevp = NULL;
+				mta_enter_state(s, MTA_RCPT);
+				return;
+			}
 			mta_enter_state(s, MTA_RSET);
 			return;
 		}
@@ -975,6 +1115,15 @@ mta_response(struct mta_session *s, char *line)
 		break;
 
 	case MTA_RCPT:
+		if (s->flags & MTA_PIPELINE)
+			s->rcptpending--;
+
+		if (s->task == NULL) {
+			if (s->rcptpending == 0)
+				mta_enter_state(s, MTA_DATA);
+			break;
+		}
+
 		e = s->currevp;
 
 		/* remove envelope from hosttat cache if there */
@@ -1023,7 +1172,7 @@ mta_response(struct mta_session *s, char *line)
 				    buf, delivery, line);
 
 			if (domain)
-				mta_hoststat_update(domain + 1, e->status);
+				mta_hoststat_update(domain, delivery, e->status);
 			mta_delivery_notify(e);
 
 			if (s->relay->limits->max_failures_per_session &&
@@ -1040,7 +1189,10 @@ mta_response(struct mta_session *s, char *line)
 			if (TAILQ_EMPTY(&s->task->envelopes)) {
 				mta_flush_task(s, IMSG_DELIVERY_OK,
 				    "No envelope", 0, 0);
-				mta_enter_state(s, MTA_RSET);
+				if (s->flags & MTA_PIPELINE)
+					mta_enter_state(s, MTA_DATA);
+				else
+					mta_enter_state(s, MTA_RSET);
 				break;
 			}
 		}
@@ -1052,6 +1204,15 @@ mta_response(struct mta_session *s, char *line)
 		break;
 
 	case MTA_DATA:
+		s->flags &= ~MTA_PIPELINE;
+		if (s->task == NULL) {
+			/* pipelined DATA accepted with no recipient left */
+			if (line[0] == '2' || line[0] == '3')
+				mta_enter_state(s, MTA_EOM);
+			else
+				mta_enter_state(s, MTA_RSET);
+			break;
+		}
 		if (line[0] == '2' || line[0] == '3') {
 			mta_enter_state(s, MTA_BODY);
 			break;
@@ -1064,12 +1225,47 @@ mta_response(struct mta_session *s, char *line)
 		mta_enter_state(s, MTA_RSET);
 		break;
 
+	case MTA_BODY:
+		s->bdatpending--;
+		if (line[0] != '2' && s->task) {
+			if (line[0] == '5')
+				delivery = IMSG_DELIVERY_PERMFAIL;
+			else
+				delivery = IMSG_DELIVERY_TEMPFAIL;
+			mta_flush_task(s, delivery, line, 0, 0);
+		}
+		/* after a failed chunk, drain the ones in flight */
+		if (s->task == NULL) {
+			if (s->bdatpending == 0)
+				mta_enter_state(s, MTA_RSET);
+			break;
+		}
+		mta_enter_state(s, MTA_BODY);
+		break;
+
 	case MTA_LMTP_EOM:
 	case MTA_EOM:
+		if (s->bdatpending) {
+			s->bdatpending--;
+			if (line[0] != '2' && s->task) {
+				if (line[0] == '5')
+					delivery = IMSG_DELIVERY_PERMFAIL;
+				else
+					delivery = IMSG_DELIVERY_TEMPFAIL;
+				mta_flush_task(s, delivery, line, 0, 0);
+			}
+			break;
+		}
+		if (s->task == NULL) {
+			mta_enter_state(s, MTA_RSET);
+			break;
+		}
 		if (line[0] == '2') {
 			delivery = IMSG_DELIVERY_OK;
 			s->msgtried = 0;
 			s->msgcount++;
+			mta_relay_ack(s->relay);
+			mta_stats_sent(s->relay, s->route, s->databytes);
 		}
 		else if (line[0] == '5')
 			delivery = IMSG_DELIVERY_PERMFAIL;
@@ -1120,6 +1316,7 @@ mta_io(struct io *io, int evt)
 {
 	struct mta_session	*s = io->arg;
 	char			*line, *msg, *p;
+	char			 buf[SMTPD_MAXLINESIZE];
 	size_t			 len;
 	const char		*error;
 	int			 cont;
@@ -1132,9 +1329,13 @@ mta_io(struct io *io, int evt)
 
 	case IO_CONNECTED:
 		log_info("smtp-out: Connected on session %016"PRIx64, s->id);
+		s->connected = evptrace_now();
+		mta_connect_done(s);
+		io_set_timeout(io, MTA_TIMEOUT);
 
 		if (s->use_smtps) {
 			io_set_write(io);
+			mta_phase(s, MTA_PHASE_TLS);
 			mta_start_tls(s);
 		}
 		else {
@@ -1154,6 +1355,7 @@ mta_io(struct io *io, int evt)
 		}
 
 	case IO_TLSVERIFIED:
+		mta_tls_save(s);
 		x = SSL_get_peer_certificate(s->io.ssl);
 		if (x) {
 			log_info("smtp-out: Server certificate verification %s "
@@ -1181,6 +1383,7 @@ mta_io(struct io *io, int evt)
 				return;
 			}
 			iobuf_normalize(&s->iobuf);
+			mta_wait_replies(s);
 			break;
 		}
 
@@ -1209,11 +1412,17 @@ mta_io(struct io *io, int evt)
 				s->ext |= MTA_EXT_PIPELINING;
 			else if (strcmp(msg, "DSN") == 0)
 				s->ext |= MTA_EXT_DSN;
+			else if (strcmp(msg, "CHUNKING") == 0)
+				s->ext |= MTA_EXT_CHUNKING;
 		}
 
 		if (cont)
 			goto nextline;
 
+		/* throttling answers */
+		if (!strncmp(line, "421", 3) || !strncmp(line, "450", 3))
+			mta_backoff(s, line);
+
 		if (s->state == MTA_QUIT) {
 			log_info("smtp-out: Closing session %016"PRIx64
 			    ": %zu message%s sent.", s->id, s->msgcount,
@@ -1221,13 +1430,20 @@ mta_io(struct io *io, int evt)
 			mta_free(s);
 			return;
 		}
-		io_set_write(io);
+		if ((io->flags & IO_RW) != IO_WRITE)
+			io_set_write(io);
 		mta_response(s, line);
 		if (s->flags & MTA_FREE) {
 			mta_free(s);
 			return;
 		}
 
+		/* more replies to a pipelined group may already be there */
+		if (((s->flags & MTA_PIPELINE) || s->bdatpending) &&
+		    iobuf_len(&s->iobuf))
+			goto nextline;
+		mta_wait_replies(s);
+
 		iobuf_normalize(&s->iobuf);
 
 		if (iobuf_len(&s->iobuf)) {
@@ -1256,6 +1472,8 @@ mta_io(struct io *io, int evt)
 	case IO_TIMEOUT:
 		log_debug("debug: mta: %p: connection timeout", s);
 		mta_error(s, "Connection timeout");
+		if (s->flags & MTA_CONNECTING)
+			mta_backoff(s, "connection timeout");
 		if (!s->ready)
 			mta_connect(s);
 		else
@@ -1265,6 +1483,13 @@ mta_io(struct io *io, int evt)
 	case IO_ERROR:
 		log_debug("debug: mta: %p: IO error: %s", s, io->error);
 		mta_error(s, "IO Error: %s", io->error);
+		if (s->flags & MTA_TLS_RESUME) {
+			mta_tls_key(s, buf, sizeof buf);
+			mta_tls_drop(buf);
+			s->flags &= ~MTA_TLS_RESUME;
+		}
+		if (s->flags & MTA_CONNECTING)
+			mta_backoff(s, "connection failed");
 		if (!s->ready)
 			mta_connect(s);
 		else
@@ -1305,24 +1530,51 @@ mta_send(struct mta_session *s, char *fmt, ...)
 	free(p);
 }
 
+static void
+mta_send_rcpt(struct mta_session *s, struct mta_envelope *e)
+{
+	if (s->ext & MTA_EXT_DSN) {
+		mta_send(s, "RCPT TO:<%s> %s%s %s%s",
+		    e->dest,
+		    e->dsn_notify ? "NOTIFY=" : "",
+		    e->dsn_notify ? dsn_strnotify(e->dsn_notify) : "",
+		    e->dsn_orcpt ? "ORCPT=" : "",
+		    e->dsn_orcpt ? e->dsn_orcpt : "");
+	} else
+		mta_send(s, "RCPT TO:<%s>", e->dest);
+
+	s->rcptcount++;
+}
+
 /*
  * Queue some data into the input buffer
  */
 static ssize_t
 mta_queue_data(struct mta_session *s)
 {
-	char	*ln;
-	size_t	 len, q;
+	static char	 buf[MTA_DATA_CHUNK];
+	size_t		 len, q;
 
 	q = iobuf_queued(&s->iobuf);
 
 	while (iobuf_queued(&s->iobuf) < MTA_HIWAT) {
-		if ((ln = fgetln(s->datafp, &len)) == NULL)
+		if ((s->ext & MTA_EXT_CHUNKING) &&
+		    s->bdatpending >= MTA_BDAT_WINDOW)
+			break;
+		/* the headers were already read by mta_check_loop() */
+		if (s->headoff < s->headlen) {
+			len = s->headlen - s->headoff;
+			if (len > MTA_DATA_CHUNK)
+				len = MTA_DATA_CHUNK;
+			mta_queue_chunk(s, s->head + s->headoff, len);
+			s->headoff += len;
+			s->databytes += len;
+			continue;
+		}
+		if ((len = fread(buf, 1, sizeof buf, s->datafp)) == 0)
 			break;
-		if (ln[len - 1] == '\n')
-			ln[len - 1] = '\0';
-		iobuf_xfqueue(&s->iobuf, "mta_queue_data", "%s%s\r\n",
-		    *ln == '.' ? "." : "", ln);
+		mta_queue_chunk(s, buf, len);
+		s->databytes += len;
 	}
 
 	if (ferror(s->datafp)) {
@@ -1332,13 +1584,83 @@ mta_queue_data(struct mta_session *s)
 	}
 
 	if (feof(s->datafp)) {
-		fclose(s->datafp);
-		s->datafp = NULL;
+		/* the final dot must be on a line of its own */
+		if ((s->flags & MTA_MIDLINE) && !(s->ext & MTA_EXT_CHUNKING))
+			iobuf_xfqueue(&s->iobuf, "mta_queue_data", "\r\n");
+		mta_data_close(s);
 	}
 
 	return (iobuf_queued(&s->iobuf) - q);
 }
 
+/*
+ * Turn LF into CRLF and stuff leading dots, straight into the output
+ * queue.  Lines are found with memchr(3) and copied as whole spans.
+ * With CHUNKING there is no stuffing and each block is a BDAT chunk.
+ */
+static void
+mta_queue_chunk(struct mta_session *s, const char *data, size_t len)
+{
+	const char	*p, *nl, *end = data + len;
+	char		*out;
+	size_t		 extra = 0;
+	int		 sol, stuff;
+
+	stuff = !(s->ext & MTA_EXT_CHUNKING);
+	sol = !(s->flags & MTA_MIDLINE);
+
+	if (stuff && sol && *data == '.')
+		extra++;
+	for (p = data; (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		extra++;
+		if (stuff && nl + 1 < end && nl[1] == '.')
+			extra++;
+	}
+
+	if (!stuff) {
+		iobuf_xfqueue(&s->iobuf, "mta_queue_chunk", "BDAT %zu\r\n",
+		    len + extra);
+		s->bdatpending++;
+	}
+
+	if ((out = iobuf_reserve(&s->iobuf, len + extra)) == NULL) {
+		log_warnx("mta_queue_chunk: iobuf_reserve(%p, %zu)",
+		    &s->iobuf, len + extra);
+		fatalx("exiting");
+	}
+
+	if (stuff && sol && *data == '.')
+		*out++ = '.';
+	for (p = data; (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		memcpy(out, p, nl - p);
+		out += nl - p;
+		*out++ = '\r';
+		*out++ = '\n';
+		if (stuff && nl + 1 < end && nl[1] == '.')
+			*out++ = '.';
+	}
+	memcpy(out, p, end - p);
+
+	if (end[-1] == '\n')
+		s->flags &= ~MTA_MIDLINE;
+	else
+		s->flags |= MTA_MIDLINE;
+}
+
+/*
+ * While replies to pipelined commands are due and nothing is left to
+ * send, go back to reading.
+ */
+static void
+mta_wait_replies(struct mta_session *s)
+{
+	if (!(s->flags & MTA_PIPELINE) && s->bdatpending == 0)
+		return;
+	if (iobuf_queued(&s->iobuf) || (s->io.flags & IO_RW) != IO_WRITE)
+		return;
+	io_set_read(&s->io);
+}
+
 static void
 mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t count,
 	int cache)
@@ -1365,6 +1687,10 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 		/* we're about to log, associate session to envelope */
 		e->session = s->id;
 		e->ext = s->ext;
+		if (delivery == IMSG_DELIVERY_OK && e->trace.ts[EVPTRACE_ACCEPT]) {
+			e->trace.ts[EVPTRACE_CONNECT] = s->connected;
+			e->trace.ts[EVPTRACE_DONE] = evptrace_now();
+		}
 
 		/* XXX */
 		/*
@@ -1383,8 +1709,10 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 
 		domain = strchr(e->dest, '@');
 		if (domain) {
-			mta_hoststat_update(domain + 1, error);
-			if (cache)
+			mta_hoststat_update(domain + 1, delivery, error);
+			/* retried as soon as the host is seen up again */
+			if (cache || (delivery == IMSG_DELIVERY_TEMPFAIL &&
+			    mta_hoststat_down(domain + 1)))
 				mta_hoststat_cache(domain + 1, e->id);
 		}
 
@@ -1395,10 +1723,7 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 	free(s->task);
 	s->task = NULL;
 
-	if (s->datafp) {
-		fclose(s->datafp);
-		s->datafp = NULL;
-	}
+	mta_data_close(s);
 
 	stat_decrement("mta.envelope", n);
 	stat_decrement("mta.task.running", 1);
@@ -1443,46 +1768,127 @@ mta_error(struct mta_session *s, const char *fmt, ...)
 	free(error);
 }
 
+/*
+ * Count the Received headers.  The headers are read in blocks and kept in
+ * s->head, mta_queue_data() sends them from there before reading the rest
+ * of the file, so the message is read only once.  The scan gives up past
+ * MTA_HEAD_MAX bytes of headers.
+ */
 static int
-mta_check_loop(FILE *fp)
+mta_check_loop(struct mta_session *s)
 {
-	char	*buf, *lbuf;
-	size_t	 len;
-	uint32_t rcvcount = 0;
-	int	 ret = 0;
-
-	lbuf = NULL;
-	while ((buf = fgetln(fp, &len))) {
-		if (buf[len - 1] == '\n')
-			buf[len - 1] = '\0';
-		else {
-			/* EOF without EOL, copy and add the NUL */
-			lbuf = xmalloc(len + 1, "mta_check_loop");
-			memcpy(lbuf, buf, len);
-			lbuf[len] = '\0';
-			buf = lbuf;
+	char		*line, *eol, *tmp;
+	size_t		 off, n, alloc;
+	uint32_t	 rcvcount = 0;
+	int		 last = 0;
+
+	alloc = 0;
+	off = 0;
+	for (;;) {
+		if (off == s->headlen || (eol = memchr(s->head + off, '\n',
+		    s->headlen - off)) == NULL) {
+			if (last || s->headlen >= MTA_HEAD_MAX)
+				return (0);
+			if (s->headlen + MTA_DATA_CHUNK > alloc) {
+				alloc += MTA_DATA_CHUNK;
+				if ((tmp = realloc(s->head, alloc)) == NULL)
+					fatal("mta_check_loop: realloc");
+				s->head = tmp;
+			}
+			n = fread(s->head + s->headlen, 1,
+			    alloc - s->headlen, s->datafp);
+			s->headlen += n;
+			/* EOF without EOL, check the partial line */
+			if (n == 0) {
+				if (off == s->headlen)
+					return (0);
+				last = 1;
+				eol = s->head + s->headlen;
+			}
+			else
+				continue;
 		}
 
-		if (strchr(buf, ':') == NULL && !isspace((unsigned char)*buf))
-			break;
+		line = s->head + off;
+		n = eol - line;
+		off += n + (last ? 0 : 1);
+
+		if (memchr(line, ':', n) == NULL &&
+		    !(n && isspace((unsigned char)*line)))
+			return (0);
 
-		if (strncasecmp("Received: ", buf, 10) == 0) {
+		if (n >= 10 && strncasecmp("Received: ", line, 10) == 0) {
 			rcvcount++;
-			if (rcvcount == MAX_HOPS_COUNT) {
-				ret = 1;
-				break;
-			}
-		}
-		if (lbuf) {
-			free(lbuf);
-			lbuf  = NULL;
+			if (rcvcount == MAX_HOPS_COUNT)
+				return (1);
 		}
 	}
-	if (lbuf)
-		free(lbuf);
+}
+
+/*
+ * Close the phase being timed and start the next one.
+ */
+static void
+mta_phase(struct mta_session *s, enum mta_phase phase)
+{
+	struct timespec	 now, dt;
+
+	if (phase == s->phase)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (s->phase != MTA_PHASE_NONE) {
+		timespecsub(&now, &s->phasestart, &dt);
+		mta_stats_phase(s->relay, s->route, s->phase,
+		    (int64_t)dt.tv_sec * 1000 + dt.tv_nsec / 1000000);
+	}
+	s->phase = phase;
+	s->phasestart = now;
+}
 
-	fseek(fp, SEEK_SET, 0);
-	return ret;
+static enum mta_phase
+mta_state_phase(int state)
+{
+	switch (state) {
+	case MTA_INIT:
+		return (MTA_PHASE_CONNECT);
+	case MTA_BANNER:
+	case MTA_EHLO:
+	case MTA_HELO:
+	case MTA_LHLO:
+		return (MTA_PHASE_HELO);
+	case MTA_STARTTLS:
+		return (MTA_PHASE_TLS);
+	case MTA_AUTH:
+	case MTA_AUTH_PLAIN:
+	case MTA_AUTH_LOGIN:
+	case MTA_AUTH_LOGIN_USER:
+	case MTA_AUTH_LOGIN_PASS:
+		return (MTA_PHASE_AUTH);
+	case MTA_MAIL:
+	case MTA_RCPT:
+		return (MTA_PHASE_MAIL);
+	case MTA_DATA:
+	case MTA_BODY:
+	case MTA_EOM:
+	case MTA_LMTP_EOM:
+		return (MTA_PHASE_DATA);
+	default:
+		return (MTA_PHASE_NONE);
+	}
+}
+
+static void
+mta_data_close(struct mta_session *s)
+{
+	if (s->datafp) {
+		fclose(s->datafp);
+		s->datafp = NULL;
+	}
+	free(s->head);
+	s->head = NULL;
+	s->headlen = 0;
+	s->headoff = 0;
 }
 
 static void
@@ -1498,13 +1904,113 @@ mta_start_tls(struct mta_session *s)
 
 	req_ca_cert.reqid = s->id;
 	strlcpy(req_ca_cert.name, certname, sizeof req_ca_cert.name);
-	m_compose(p_lka, IMSG_LKA_SSL_INIT, 0, 0, -1,
+	m_compose(lka_peer(s->id), IMSG_LKA_SSL_INIT, 0, 0, -1,
 	    &req_ca_cert, sizeof(req_ca_cert));
 	tree_xset(&wait_ssl_init, s->id, s);
 	s->flags |= MTA_WAIT;
 	return;
 }
 
+static void
+mta_tls_key(struct mta_session *s, char *buf, size_t len)
+{
+	const char	*certname;
+
+	if (s->relay->pki_name)
+		certname = s->relay->pki_name;
+	else
+		certname = s->helo;
+
+	(void)snprintf(buf, len, "%s|%s", sa_to_text(s->route->dst->sa),
+	    certname);
+}
+
+static void
+mta_tls_resume(struct mta_session *s, void *ssl)
+{
+	struct mta_tls_session	*ts;
+	char			 key[SMTPD_MAXLINESIZE];
+
+	mta_tls_key(s, key, sizeof key);
+	if ((ts = dict_get(&tls_sessions, key)) == NULL) {
+		stat_increment("mta.tls.session.miss", 1);
+		return;
+	}
+
+	if (SSL_SESSION_get_time(ts->session) +
+	    SSL_SESSION_get_timeout(ts->session) <= time(NULL)) {
+		mta_tls_drop(key);
+		stat_increment("mta.tls.session.miss", 1);
+		return;
+	}
+
+	if (!SSL_set_session(ssl, ts->session)) {
+		mta_tls_drop(key);
+		stat_increment("mta.tls.session.miss", 1);
+		return;
+	}
+	s->flags |= MTA_TLS_RESUME;
+}
+
+static void
+mta_tls_save(struct mta_session *s)
+{
+	struct mta_tls_session	*ts;
+	SSL_SESSION		*session;
+	char			 key[SMTPD_MAXLINESIZE];
+
+	mta_tls_key(s, key, sizeof key);
+
+	/* only a session whose peer passed verification is offered again */
+	if ((s->flags & MTA_VERIFIED) == 0) {
+		s->flags &= ~MTA_TLS_RESUME;
+		mta_tls_drop(key);
+		return;
+	}
+
+	if (s->flags & MTA_TLS_RESUME) {
+		s->flags &= ~MTA_TLS_RESUME;
+		if (SSL_session_reused(s->io.ssl)) {
+			stat_increment("mta.tls.session.hit", 1);
+			return;
+		}
+		stat_increment("mta.tls.session.miss", 1);
+	}
+
+	if ((session = SSL_get1_session(s->io.ssl)) == NULL)
+		return;
+
+	if ((ts = dict_get(&tls_sessions, key)) != NULL) {
+		SSL_SESSION_free(ts->session);
+		TAILQ_REMOVE(&tls_lru, ts, entry);
+	}
+	else {
+		if (dict_count(&tls_sessions) >= MTA_TLS_CACHE_MAX)
+			mta_tls_drop(TAILQ_FIRST(&tls_lru)->key);
+		ts = xcalloc(1, sizeof *ts, "mta_tls_save");
+		ts->key = xstrdup(key, "mta_tls_save");
+		dict_xset(&tls_sessions, ts->key, ts);
+		stat_increment("mta.tls.session", 1);
+	}
+	ts->session = session;
+	TAILQ_INSERT_TAIL(&tls_lru, ts, entry);
+}
+
+static void
+mta_tls_drop(const char *key)
+{
+	struct mta_tls_session	*ts;
+
+	if ((ts = dict_pop(&tls_sessions, key)) == NULL)
+		return;
+
+	TAILQ_REMOVE(&tls_lru, ts, entry);
+	SSL_SESSION_free(ts->session);
+	free(ts->key);
+	free(ts);
+	stat_decrement("mta.tls.session", 1);
+}
+
 static int
 mta_verify_certificate(struct mta_session *s)
 {
@@ -1549,7 +2055,7 @@ mta_verify_certificate(struct mta_session *s)
 	iov[0].iov_len = sizeof(req_ca_vrfy);
 	iov[1].iov_base = req_ca_vrfy.cert;
 	iov[1].iov_len = req_ca_vrfy.cert_len;
-	m_composev(p_lka, IMSG_LKA_SSL_VERIFY_CERT, 0, 0, -1,
+	m_composev(lka_peer(s->id), IMSG_LKA_SSL_VERIFY_CERT, 0, 0, -1,
 	    iov, nitems(iov));
 	free(req_ca_vrfy.cert);
 	X509_free(x);
@@ -1565,8 +2071,8 @@ mta_verify_certificate(struct mta_session *s)
 			iov[0].iov_len  = sizeof(req_ca_vrfy);
 			iov[1].iov_base = req_ca_vrfy.cert;
 			iov[1].iov_len  = req_ca_vrfy.cert_len;
-			m_composev(p_lka, IMSG_LKA_SSL_VERIFY_CHAIN, 0, 0, -1,
-			    iov, nitems(iov));
+			m_composev(lka_peer(s->id), IMSG_LKA_SSL_VERIFY_CHAIN, 0, 0,
+			    -1, iov, nitems(iov));
 			free(req_ca_vrfy.cert);
 		}
 	}
@@ -1574,7 +2080,7 @@ mta_verify_certificate(struct mta_session *s)
 	/* Tell lookup process that it can start verifying, we're done */
 	memset(&req_ca_vrfy, 0, sizeof req_ca_vrfy);
 	req_ca_vrfy.reqid = s->id;
-	m_compose(p_lka, IMSG_LKA_SSL_VERIFY, 0, 0, -1,
+	m_compose(lka_peer(s->id), IMSG_LKA_SSL_VERIFY, 0, 0, -1,
 	    &req_ca_vrfy, sizeof req_ca_vrfy);
 
 	return 1;
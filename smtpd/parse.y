@@ -47,6 +47,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <util.h>
 
@@ -97,6 +98,12 @@ struct rule		*rule = NULL;
 struct listener		 l;
 struct mta_limits	*limits;
 static struct pki	*pki;
+static struct offload	*offload;
+static time_t		 cache_ttl, cache_negttl;
+static size_t		 cache_max;
+
+/* static file tables no rule referenced yet, loaded on first reference */
+static struct dict	 deferred_tables;
 
 static struct listen_opts {
 	char	       *ifx;
@@ -109,6 +116,8 @@ static struct listen_opts {
 	char	       *tag;
 	char	       *hostname;
 	struct table   *hostnametable;
+	uint32_t	ratelimit;
+	uint32_t	rateburst;
 	uint16_t	flags;	
 } listen_opts;
 
@@ -124,9 +133,10 @@ void		 set_localaddrs(void);
 int		 delaytonum(char *);
 int		 is_if_in_group(const char *, const char *);
 
-static struct filter	*create_filter(const char *, const char *);
+static struct filter	*create_filter(const char *, const char *, int);
 static struct filter	*create_filter_chain(const char *);
 static int		 extend_filter_chain(struct filter *, const char *);
+static int		 load_table(struct table *);
 
 typedef struct {
 	union {
@@ -141,16 +151,18 @@ typedef struct {
 
 %}
 
-%token	AS QUEUE COMPRESSION ENCRYPTION MAXMESSAGESIZE MAXMTADEFERRED LISTEN ON ANY PORT EXPIRE
+%token	AS QUEUE COMPRESSION ENCRYPTION MAXMESSAGESIZE MAXMTADEFERRED MTAPROCESSES SMTPPROCESSES LKAPROCESSES IPCRINGSIZE LISTEN ON ANY PORT EXPIRE
 %token	TABLE SECURE SMTPS CERTIFICATE DOMAIN BOUNCEWARN LIMIT INET4 INET6
 %token  RELAY BACKUP VIA DELIVER TO LMTP MAILDIR MBOX HOSTNAME HOSTNAMES
 %token	ACCEPT REJECT INCLUDE ERROR MDA FROM FOR SOURCE MTA PKI SCHEDULER
 %token	ARROW AUTH TLS LOCAL VIRTUAL TAG TAGGED ALIAS FILTER FILTERCHAIN KEY CA DHPARAMS
 %token	AUTH_OPTIONAL TLS_REQUIRE USERBASE SENDER MASK_SOURCE VERIFY FORWARDONLY RECIPIENT
+%token	GROUPCOMMIT DEDUP ENVFORMAT PRIORITY RATELIMIT BURST SESSIONRESUME CACHE NEGATIVE
+%token	FILTERPROCESSES SHAREDSTATE OFFLOAD
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
 %type	<v.table>	table
-%type	<v.number>	size negation
+%type	<v.number>	size negation filterprocs
 %type	<v.table>	tables tablenew tableref alias virtual userbase
 %type	<v.string>	tagged
 %%
@@ -309,6 +321,15 @@ opt_limit_scheduler : STRING NUMBER {
 			if (!strcmp($1, "max-inflight")) {
 				conf->sc_scheduler_max_inflight = $2;
 			}
+			else if (!strcmp($1, "max-inflight-high")) {
+				conf->sc_scheduler_max_inflight_prio[PRIO_HIGH] = $2;
+			}
+			else if (!strcmp($1, "max-inflight-normal")) {
+				conf->sc_scheduler_max_inflight_prio[PRIO_NORMAL] = $2;
+			}
+			else if (!strcmp($1, "max-inflight-bulk")) {
+				conf->sc_scheduler_max_inflight_prio[PRIO_BULK] = $2;
+			}
 			else if (!strcmp($1, "max-evp-batch-size")) {
 				conf->sc_scheduler_max_evp_batch_size = $2;
 			}
@@ -331,6 +352,65 @@ limits_scheduler: opt_limit_scheduler limits_scheduler
 		| /* empty */
 		;
 
+opt_limit_queue	: STRING size {
+			if (!strcmp($1, "envelope-cache-size"))
+				conf->sc_queue_evpcache_size = $2;
+			else if (!strcmp($1, "ram-size"))
+				conf->sc_queue_ram_size = $2;
+			else if (!strcmp($1, "group-commit-max")) {
+				if ($2 <= 0) {
+					yyerror("invalid group-commit-max: %"
+					    PRId64, $2);
+					free($1);
+					YYERROR;
+				}
+				conf->sc_queue_group_commit_max = $2;
+			}
+			else if (!strcmp($1, "group-commit-delay")) {
+				if ($2 < 0) {
+					yyerror("invalid group-commit-delay: %"
+					    PRId64, $2);
+					free($1);
+					YYERROR;
+				}
+				conf->sc_queue_group_commit_delay = $2;
+			}
+			else {
+				yyerror("invalid queue limit keyword: %s", $1);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+limits_queue	: opt_limit_queue limits_queue
+		| /* empty */
+		;
+
+opt_limit_pki	: STRING NUMBER {
+			if (!strcmp($1, "cache-size")) {
+				if ($2 <= 0) {
+					yyerror("invalid pki cache-size: %"
+					    PRId64, $2);
+					free($1);
+					YYERROR;
+				}
+				conf->sc_pki_cache_size = $2;
+			}
+			else {
+				yyerror("invalid pki limit keyword: %s", $1);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+limits_pki	: opt_limit_pki limits_pki
+		| /* empty */
+		;
+
 opt_pki		: CERTIFICATE STRING {
 			pki->pki_cert_file = $2;
 		}
@@ -406,6 +486,26 @@ opt_listen     	: INET4			{ listen_opts.family = AF_INET; }
 			listen_opts.hostnametable = t;
 		}
 		| MASK_SOURCE	{ listen_opts.flags |= F_MASK_SOURCE; }
+		| SESSIONRESUME	{ listen_opts.flags |= F_TLS_RESUME; }
+		| RATELIMIT NUMBER		{
+			if ($2 <= 0 || $2 > UINT32_MAX) {
+				yyerror("invalid rate-limit: %" PRId64, $2);
+				YYERROR;
+			}
+			listen_opts.ratelimit = listen_opts.rateburst = $2;
+		}
+		| RATELIMIT NUMBER BURST NUMBER	{
+			if ($2 <= 0 || $2 > UINT32_MAX) {
+				yyerror("invalid rate-limit: %" PRId64, $2);
+				YYERROR;
+			}
+			if ($4 <= 0 || $4 > UINT32_MAX) {
+				yyerror("invalid burst: %" PRId64, $4);
+				YYERROR;
+			}
+			listen_opts.ratelimit = $2;
+			listen_opts.rateburst = $4;
+		}
 		;
 
 listen		: opt_listen listen
@@ -528,12 +628,79 @@ relay_via	: opt_relay_common relay_via
 		| /* empty */
 		;
 
+offload_domain	: FOR DOMAIN STRING {
+			offload->o_domain = $3;
+		}
+		| /* empty */
+		;
+
+opt_offload	: STRING STRING {
+			if (strcmp($1, "age")) {
+				yyerror("invalid offload threshold: %s", $1);
+				free($1);
+				free($2);
+				YYERROR;
+			}
+			if ((offload->o_age = delaytonum($2)) <= 0) {
+				yyerror("invalid offload age: %s", $2);
+				free($1);
+				free($2);
+				YYERROR;
+			}
+			free($1);
+			free($2);
+		}
+		| STRING NUMBER {
+			if ($2 <= 0) {
+				yyerror("invalid offload %s: %" PRId64, $1, $2);
+				free($1);
+				YYERROR;
+			}
+			if (!strcmp($1, "age"))
+				offload->o_age = $2;
+			else if (!strcmp($1, "backlog"))
+				offload->o_backlog = $2;
+			else {
+				yyerror("invalid offload threshold: %s", $1);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+offload_opts	: opt_offload offload_opts
+		| /* empty */
+		;
+
 main		: BOUNCEWARN {
 			memset(conf->sc_bounce_warn, 0, sizeof conf->sc_bounce_warn);
 		} bouncedelays
 		| QUEUE COMPRESSION {
 			conf->sc_queue_flags |= QUEUE_COMPRESSION;
 		}
+		| QUEUE COMPRESSION STRING {
+			conf->sc_queue_flags |= QUEUE_COMPRESSION;
+			conf->sc_queue_compress_algo = $3;
+		}
+		| QUEUE GROUPCOMMIT {
+			conf->sc_queue_flags |= QUEUE_GROUPCOMMIT;
+		}
+		| QUEUE DEDUP {
+			conf->sc_queue_flags |= QUEUE_DEDUP;
+		}
+		| QUEUE ENVFORMAT STRING {
+			if (!strcmp($3, "binary"))
+				conf->sc_queue_flags |= QUEUE_BINARY;
+			else if (!strcmp($3, "ascii"))
+				conf->sc_queue_flags &= ~QUEUE_BINARY;
+			else {
+				yyerror("invalid envelope format: %s", $3);
+				free($3);
+				YYERROR;
+			}
+			free($3);
+		}
 		| QUEUE ENCRYPTION {
 			char	*password;
 
@@ -586,9 +753,78 @@ main		: BOUNCEWARN {
 		| MAXMESSAGESIZE size {
 			conf->sc_maxsize = $2;
 		}
+		| IPCRINGSIZE size {
+			size_t	sz;
+
+			if ($2 < 4 * MAX_IMSGSIZE || $2 > 64 * 1024 * 1024) {
+				yyerror("ipc-ring-size must be between %d and "
+				    "64M", 4 * MAX_IMSGSIZE);
+				YYERROR;
+			}
+			for (sz = 1; sz < (size_t)$2; sz <<= 1)
+				;
+			conf->sc_ipc_ring = sz;
+		}
 		| MAXMTADEFERRED NUMBER  {
 			conf->sc_mta_max_deferred = $2;
 		}
+		| MTA SHAREDSTATE tableref {
+			struct table	*t = $3;
+
+			if (! table_check_use(t, T_DYNAMIC, K_MTASTATE) ||
+			    t->t_backend->store == NULL) {
+				yyerror("invalid use of table \"%s\" as "
+				    "mta shared state", t->t_name);
+				YYERROR;
+			}
+			conf->sc_mta_state = xstrdup(t->t_name,
+			    "parse:mta_state");
+		}
+		| OFFLOAD {
+			offload = xcalloc(1, sizeof *offload, "parse:offload");
+		} offload_domain VIA STRING {
+			if (! text_to_relayhost(&offload->o_relay, $5)) {
+				yyerror("error: invalid url: %s", $5);
+				free($5);
+				YYERROR;
+			}
+			free($5);
+			if (offload->o_relay.flags & (F_AUTH|F_BACKUP)) {
+				yyerror("error: invalid offload url");
+				YYERROR;
+			}
+		} offload_opts {
+			if (offload->o_age == 0 && offload->o_backlog == 0) {
+				yyerror("offload needs an age or a backlog");
+				YYERROR;
+			}
+			TAILQ_INSERT_TAIL(conf->sc_offloads, offload, o_entry);
+			offload = NULL;
+		}
+		| MTAPROCESSES NUMBER {
+			if ($2 < 1 || $2 > MTA_PROCS_MAX) {
+				yyerror("mta-processes must be between 1 and %d",
+				    MTA_PROCS_MAX);
+				YYERROR;
+			}
+			conf->sc_mta_procs = $2;
+		}
+		| SMTPPROCESSES NUMBER {
+			if ($2 < 1 || $2 > SMTP_PROCS_MAX) {
+				yyerror("smtp-processes must be between 1 and %d",
+				    SMTP_PROCS_MAX);
+				YYERROR;
+			}
+			conf->sc_smtp_procs = $2;
+		}
+		| LKAPROCESSES NUMBER {
+			if ($2 < 1 || $2 > LKA_PROCS_MAX) {
+				yyerror("lka-processes must be between 1 and %d",
+				    LKA_PROCS_MAX);
+				YYERROR;
+			}
+			conf->sc_lka_procs = $2;
+		}
 		| LIMIT MDA limits_mda
 		| LIMIT MTA FOR DOMAIN STRING {
 			struct mta_limits	*d;
@@ -606,6 +842,8 @@ main		: BOUNCEWARN {
 			limits = dict_get(conf->sc_limits_dict, "default");
 		} limits_mta
 		| LIMIT SCHEDULER limits_scheduler
+		| LIMIT QUEUE limits_queue
+		| LIMIT PKI limits_pki
 		| LISTEN {
 			memset(&l, 0, sizeof l);
 			memset(&listen_opts, 0, sizeof listen_opts);
@@ -614,8 +852,8 @@ main		: BOUNCEWARN {
 			listen_opts.ifx = $4;
 			create_listener(conf->sc_listeners, &listen_opts);
 		}
-		| FILTER STRING STRING {
-			if (!create_filter($2, $3)) {
+		| FILTER STRING STRING filterprocs {
+			if (!create_filter($2, $3, $4)) {
 				free($2);
 				free($3);
 				YYERROR;
@@ -669,7 +907,11 @@ table		: TABLE STRING STRING	{
 				YYERROR;
 			}
 			table = table_create(backend, $2, NULL, config);
-			if (!table_config(table)) {
+			if ((!strcmp(backend, "static") ||
+			    !strcmp(backend, "file")) && config &&
+			    !(conf->sc_opts & SMTPD_OPT_NOACTION))
+				dict_xset(&deferred_tables, table->t_name, table);
+			else if (!load_table(table)) {
 				yyerror("invalid backend configuration for table %s",
 				    table->t_name);
 				free($2);
@@ -678,6 +920,8 @@ table		: TABLE STRING STRING	{
 			}
 			free($2);
 			free($3);
+		} tablecache {
+			$$ = table;
 		}
 		| TABLE STRING {
 			table = table_create("static", $2, NULL, NULL);
@@ -687,18 +931,57 @@ table		: TABLE STRING STRING	{
 		}
 		;
 
+tablecache	: /* EMPTY */
+		| CACHE STRING {
+			if ((cache_ttl = delaytonum($2)) <= 0) {
+				yyerror("invalid cache delay for table %s: %s",
+				    table->t_name, $2);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+			cache_negttl = cache_ttl;
+			cache_max = 10000;
+		} tablecacheopts {
+			table_set_cache(table, cache_ttl, cache_negttl,
+			    cache_max);
+		}
+		;
+
+tablecacheopts	: /* EMPTY */
+		| tablecacheopts tablecacheopt
+		;
+
+tablecacheopt	: NEGATIVE STRING {
+			if ((cache_negttl = delaytonum($2)) < 0) {
+				yyerror("invalid negative cache delay for "
+				    "table %s: %s", table->t_name, $2);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+		}
+		| LIMIT NUMBER {
+			if ($2 <= 0) {
+				yyerror("invalid cache limit for table %s",
+				    table->t_name);
+				YYERROR;
+			}
+			cache_max = $2;
+		}
+		;
+
 assign		: '=' | ARROW;
 
 keyval		: STRING assign STRING		{
 			table->t_type = T_HASH;
-			table_add(table, $1, $3);
+			table_add_nocopy(table, $1, $3);
 			free($1);
-			free($3);
 		}
 		;
 
 keyval_list	: keyval
-		| keyval comma keyval_list
+		| keyval_list comma keyval
 		;
 
 stringel	: STRING			{
@@ -709,7 +992,18 @@ stringel	: STRING			{
 		;
 
 string_list	: stringel
-		| stringel comma string_list
+		| string_list comma stringel
+		;
+
+filterprocs	: /* empty */			{ $$ = 1; }
+		| FILTERPROCESSES NUMBER	{
+			if ($2 < 1 || $2 > FILTER_PROCS_MAX) {
+				yyerror("filter-processes must be between 1 "
+				    "and %d", FILTER_PROCS_MAX);
+				YYERROR;
+			}
+			$$ = $2;
+		}
 		;
 
 filter_list	:
@@ -749,6 +1043,13 @@ tableref       	: '<' STRING '>'       		{
 				free($2);
 				YYERROR;
 			}
+			if (dict_pop(&deferred_tables, t->t_name) &&
+			    !load_table(t)) {
+				yyerror("invalid backend configuration for table %s",
+				    t->t_name);
+				free($2);
+				YYERROR;
+			}
 			free($2);
 			$$ = t;
 		}
@@ -1012,6 +1313,25 @@ expire		: EXPIRE STRING {
 		}
 		;
 
+priority	: PRIORITY STRING {
+			if (rule->r_priority != PRIO_NORMAL) {
+				yyerror("priority specified multiple times");
+				free($2);
+				YYERROR;
+			}
+			if (!strcmp($2, "high"))
+				rule->r_priority = PRIO_HIGH;
+			else if (!strcmp($2, "bulk"))
+				rule->r_priority = PRIO_BULK;
+			else if (strcmp($2, "normal")) {
+				yyerror("invalid priority: %s", $2);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+		}
+		;
+
 opt_decision	: sender
 		| recipient
 		| from
@@ -1036,6 +1356,7 @@ action		: deliver_action
 
 opt_accept	: expire
 		| forwardonly
+		| priority
 		;
 
 accept_params	: opt_accept accept_params
@@ -1129,27 +1450,35 @@ lookup(char *s)
 		{ "auth-optional",     	AUTH_OPTIONAL },
 		{ "backup",		BACKUP },
 		{ "bounce-warn",	BOUNCEWARN },
+		{ "burst",		BURST },
 		{ "ca",			CA },
+		{ "cache",		CACHE },
 		{ "certificate",	CERTIFICATE },
 		{ "compression",	COMPRESSION },
+		{ "deduplication",	DEDUP },
 		{ "deliver",		DELIVER },
 		{ "dhparams",		DHPARAMS },
 		{ "domain",		DOMAIN },
 		{ "encryption",		ENCRYPTION },
+		{ "envelope-format",	ENVFORMAT },
 		{ "expire",		EXPIRE },
 		{ "filter",		FILTER },
+		{ "filter-processes",	FILTERPROCESSES },
 		{ "filterchain",	FILTERCHAIN },
 		{ "for",		FOR },
 		{ "forward-only",      	FORWARDONLY },
 		{ "from",		FROM },
+		{ "group-commit",	GROUPCOMMIT },
 		{ "hostname",		HOSTNAME },
 		{ "hostnames",		HOSTNAMES },
 		{ "include",		INCLUDE },
 		{ "inet4",		INET4 },
 		{ "inet6",		INET6 },
+		{ "ipc-ring-size",	IPCRINGSIZE },
 		{ "key",		KEY },
 		{ "limit",		LIMIT },
 		{ "listen",		LISTEN },
+		{ "lka-processes",	LKAPROCESSES },
 		{ "lmtp",		LMTP },
 		{ "local",		LOCAL },
 		{ "maildir",		MAILDIR },
@@ -1159,16 +1488,24 @@ lookup(char *s)
 		{ "mbox",		MBOX },
 		{ "mda",		MDA },
 		{ "mta",		MTA },
+		{ "mta-processes",	MTAPROCESSES },
+		{ "negative",		NEGATIVE },
+		{ "offload",		OFFLOAD },
 		{ "on",			ON },
 		{ "pki",		PKI },
 		{ "port",		PORT },
+		{ "priority",		PRIORITY },
 		{ "queue",		QUEUE },
+		{ "rate-limit",		RATELIMIT },
 		{ "recipient",		RECIPIENT },
 		{ "reject",		REJECT },
 		{ "relay",		RELAY },
 		{ "scheduler",		SCHEDULER },
 		{ "secure",		SECURE },
 		{ "sender",    		SENDER },
+		{ "session-resume",	SESSIONRESUME },
+		{ "shared-state",	SHAREDSTATE },
+		{ "smtp-processes",	SMTPPROCESSES },
 		{ "smtps",		SMTPS },
 		{ "source",		SOURCE },
 		{ "table",		TABLE },
@@ -1526,6 +1863,7 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 	conf->sc_tables_dict = calloc(1, sizeof(*conf->sc_tables_dict));
 	conf->sc_rules = calloc(1, sizeof(*conf->sc_rules));
 	conf->sc_listeners = calloc(1, sizeof(*conf->sc_listeners));
+	conf->sc_offloads = calloc(1, sizeof(*conf->sc_offloads));
 	conf->sc_pki_dict = calloc(1, sizeof(*conf->sc_pki_dict));
 	conf->sc_ssl_dict = calloc(1, sizeof(*conf->sc_ssl_dict));
 	conf->sc_limits_dict = calloc(1, sizeof(*conf->sc_limits_dict));
@@ -1536,12 +1874,14 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 	if (conf->sc_tables_dict == NULL	||
 	    conf->sc_rules == NULL		||
 	    conf->sc_listeners == NULL		||
+	    conf->sc_offloads == NULL		||
 	    conf->sc_pki_dict == NULL		||
 	    conf->sc_limits_dict == NULL) {
 		log_warn("warn: cannot allocate memory");
 		free(conf->sc_tables_dict);
 		free(conf->sc_rules);
 		free(conf->sc_listeners);
+		free(conf->sc_offloads);
 		free(conf->sc_pki_dict);
 		free(conf->sc_ssl_dict);
 		free(conf->sc_limits_dict);
@@ -1554,6 +1894,7 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 	rule = NULL;
 
 	dict_init(&conf->sc_filters);
+	dict_init(&deferred_tables);
 
 	dict_init(conf->sc_pki_dict);
 	dict_init(conf->sc_ssl_dict);
@@ -1566,16 +1907,28 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 
 	TAILQ_INIT(conf->sc_listeners);
 	TAILQ_INIT(conf->sc_rules);
+	TAILQ_INIT(conf->sc_offloads);
 
 	conf->sc_qexpire = SMTPD_QUEUE_EXPIRY;
 	conf->sc_opts = opts;
 
 	conf->sc_mta_max_deferred = 100;
+	conf->sc_mta_procs = 1;
+	conf->sc_smtp_procs = 1;
+	conf->sc_lka_procs = 1;
 	conf->sc_scheduler_max_inflight = 5000;
+	conf->sc_scheduler_max_inflight_prio[PRIO_BULK] = 2500;
 	conf->sc_scheduler_max_schedule = 10;
 	conf->sc_scheduler_max_evp_batch_size = 256;
 	conf->sc_scheduler_max_msg_batch_size = 1024;
 
+	conf->sc_queue_evpcache_size = 32 * 1024 * 1024;
+	conf->sc_queue_ram_size = 64 * 1024 * 1024;
+	conf->sc_queue_group_commit_max = 256;
+	conf->sc_queue_group_commit_delay = 5;
+
+	conf->sc_pki_cache_size = 1024;
+
 	conf->sc_mda_max_session = 50;
 	conf->sc_mda_max_user_session = 7;
 	conf->sc_mda_task_hiwat = 50;
@@ -1620,6 +1973,10 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 	popfile();
 	endservent();
 
+	/* never referenced, "smtpctl update table" may still load them */
+	while (dict_poproot(&deferred_tables, NULL))
+		conf->sc_load.tables_deferred++;
+
 	/* Free macros and check which have not been used. */
 	for (sym = TAILQ_FIRST(&symhead); sym != NULL; sym = next) {
 		next = TAILQ_NEXT(sym, entry);
@@ -1798,6 +2155,9 @@ config_listener(struct listener *h,  struct listen_opts *lo)
 
 	if (lo->ssl & F_TLS_VERIFY)
 		h->flags |= F_TLS_VERIFY;
+
+	h->ratelimit = lo->ratelimit;
+	h->rateburst = lo->rateburst;
 }
 
 struct listener *
@@ -2099,7 +2459,7 @@ end:
 }
 
 struct filter *
-create_filter(const char *name, const char *path)
+create_filter(const char *name, const char *path, int procs)
 {
 	struct filter	*f;
 
@@ -2111,6 +2471,7 @@ create_filter(const char *name, const char *path)
 	f = xcalloc(1, sizeof(*f), "create_filter");
 	strlcpy(f->name, name, sizeof(f->name));
 	strlcpy(f->path, path, sizeof(f->path));
+	f->procs = procs;
 
 	dict_xset(&conf->sc_filters, name, f);
 
@@ -2163,3 +2524,18 @@ extend_filter_chain(struct filter *f, const char *name)
 	yyerror("filter chain \"%s\" is full", f->name);
 	return (0);
 }
+
+static int
+load_table(struct table *t)
+{
+	struct timespec	t0, t1, dt;
+	int		r;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	r = table_config(t);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	timespecsub(&t1, &t0, &dt);
+	conf->sc_load.tables += dt.tv_sec * 1000000LL + dt.tv_nsec / 1000;
+	conf->sc_load.tables_loaded++;
+	return (r);
+}
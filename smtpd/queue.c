@@ -23,9 +23,12 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mount.h>
 
 #include <err.h>
+#include <errno.h>
 #include <event.h>
+#include <fts.h>
 #include <imsg.h>
 #include <inttypes.h>
 #include <libgen.h>
@@ -40,35 +43,172 @@
 #include "smtpd.h"
 #include "log.h"
 
+struct queue_commit;
+
 static void queue_imsg(struct mproc *, struct imsg *);
 static void queue_timeout(int, short, void *);
 static void queue_bounce(struct envelope *, struct delivery_bounce *);
+static void queue_query(struct imsg *);
 static void queue_shutdown(void);
 static void queue_sig_handler(int, short, void *);
 static void queue_log(const struct envelope *, const char *, const char *);
+static int queue_offload_match(const struct offload *,
+    const struct envelope *, time_t);
+static void queue_offload(struct envelope *);
+static void queue_commit_add(struct mproc *, uint64_t, uint32_t,
+    const struct evptrace *);
+static void queue_commit_flush(void);
+static void queue_commit_done(struct queue_commit *);
+static void queue_commit_release(void);
+static void queue_commit_timeout(int, short, void *);
+static void queue_syncers_start(void);
+static void queue_syncer_run(int);
+static void queue_syncer_imsg(struct mproc *, struct imsg *);
+static void queue_snapshot_timeout(int, short, void *);
+static void queue_profile_timeout(int, short, void *);
+static void queue_purge_timeout(int, short, void *);
+static void queue_decoded_timeout(int, short, void *);
+static void queue_flow_timeout(int, short, void *);
+static int queue_flow_credit(size_t, size_t, size_t);
+static int queue_flow_disk(void);
+static void queue_delivery_ok(struct mproc *, uint64_t, int);
+static void queue_delivery_tempfail(uint64_t, const char *, int);
+static void queue_delivery_permfail(uint64_t, const char *, int);
+static void queue_delivery_loop(uint64_t);
+static void queue_trace_commit(uint32_t, const struct evptrace *);
+static int queue_trace_get(uint64_t, struct evptrace *);
+
+struct queue_commit {
+	TAILQ_ENTRY(queue_commit)	 entry;
+	TAILQ_ENTRY(queue_commit)	 sentry;
+	struct queue_batch		*batch;
+	struct mproc			*p;
+	uint64_t			 reqid;
+	uint32_t			 msgid;
+	int				 ret;
+	struct evptrace			 trace;
+};
+
+/*
+ * When the backend supports it, messages are made durable and committed
+ * by QUEUE_SYNCERS processes forked once privileges are dropped, so that
+ * the file operations and fsyncs of a commit never hold the event loop.
+ * Requests and replies go over non-blocking imsg buffers.  Each syncer
+ * answers its requests in order.  Batches, of one message unless in
+ * group commit mode, are released in order too, once all their messages
+ * came back, and only then are the messages answered.
+ */
+#define	QUEUE_SYNCERS		4
+#define	QUEUE_SYNC_BATCH	256	/* messages a syncer takes at once */
+
+struct queue_batch {
+	TAILQ_ENTRY(queue_batch)	 entry;
+	TAILQ_HEAD(, queue_commit)	 commits;
+	size_t				 pending;
+};
+
+struct queue_sync {
+	uint32_t	msgid;
+	int		ret;
+};
+
+struct queue_syncer {
+	struct mproc			 mproc;
+	TAILQ_HEAD(, queue_commit)	 pending;
+};
+
+static struct queue_syncer		syncers[QUEUE_SYNCERS];
+static int				nsyncers;
+static int				syncer;
+static TAILQ_HEAD(, queue_batch)	batches;
+
+/* traces of the last committed messages, for their deliveries */
+struct queue_trace {
+	TAILQ_ENTRY(queue_trace)	 entry;
+	uint32_t			 msgid;
+	struct evptrace			 trace;
+};
+
+#define	QUEUE_TRACE_MAX		4096
+
+static TAILQ_HEAD(, queue_commit)	commits;
+static size_t				ncommits;
+static TAILQ_HEAD(, queue_trace)	traces;
+static struct tree			tracetree;
+static struct event			ev_commit;
+static struct event			ev_snapshot;
+static struct event			ev_profile;
+static struct event			ev_purge;
+static struct event			ev_decoded;
+static struct event			ev_flow;
+static FTS				*purge_fts;
+static size_t				 purge_backlog;
+static size_t				 offload_backlog;
 
 static size_t	flow_agent_hiwat = 10 * 1024 * 1024;
 static size_t	flow_agent_lowat =   1 * 1024 * 1024;
 static size_t	flow_scheduler_hiwat = 10 * 1024 * 1024;
 static size_t	flow_scheduler_lowat = 1 * 1024 * 1024;
 
-#define LIMIT_AGENT	0x01
-#define LIMIT_SCHEDULER	0x02
+/*
+ * Flow control works with credits, from QUEUE_CREDIT_MAX when there is
+ * no pressure down to 0, in steps of QUEUE_CREDIT_STEP.  The backlog
+ * between the lowat and hiwat marks, and the free space of the queue
+ * filesystem between QUEUE_DISK_LOWAT and QUEUE_DISK_HIWAT percents,
+ * are mapped linearly on that range.  The scheduler scales the number
+ * of envelopes it keeps in flight by the delivery credit, the smtp
+ * processes defer that share of new transactions by the inbound one.
+ * Credits are recomputed every QUEUE_FLOW_INTERVAL microseconds, and
+ * sent with the stats when they change.
+ */
+#define	QUEUE_CREDIT_STEP	10
+#define	QUEUE_DISK_LOWAT	5
+#define	QUEUE_DISK_HIWAT	20
+#define	QUEUE_FLOW_INTERVAL	250000
+
+static int	credit_delivery = -1;
+static int	credit_inbound = -1;
+static int	credit_disk = -1;
+
+/* envelopes fed to the scheduler per run of the loading task */
+#define	QUEUE_LOAD_BATCH	256
 
-static int limit = 0;
+/* seconds between two scheduler snapshots */
+#define	QUEUE_SNAPSHOT_INTERVAL	300
+
+/* seconds between two pushes of the latency histograms */
+#define	QUEUE_PROFILE_INTERVAL	10
+
+/*
+ * The purge directory is emptied a few entries at a time so that a large
+ * backlog does not compete with the live queue: at most QUEUE_PURGE_STEP
+ * unlinks every QUEUE_PURGE_DELAY microseconds, then a new look every
+ * QUEUE_PURGE_INTERVAL seconds once it is empty.
+ */
+#define	QUEUE_PURGE_STEP	100
+#define	QUEUE_PURGE_DELAY	100000
+#define	QUEUE_PURGE_INTERVAL	10
+
+/* how often the decoded cleartexts nobody uses any more are removed */
+#define	QUEUE_DECODED_INTERVAL	10
 
 static void
 queue_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct delivery_bounce	 bounce;
 	struct bounce_req_msg	*req_bounce;
+	struct ctl_limit	 limit;
 	struct envelope		 evp;
+	struct evptrace		 trace;
 	struct msg		 m;
+	struct mproc		*p_agent;
 	const char		*reason;
+	const void		*data;
 	uint64_t		 reqid, evpid, holdq;
 	uint32_t		 msgid;
 	time_t			 nexttry;
-	int			 fd, mta_ext, ret, v, flags, code;
+	size_t			 len;
+	int			 fd, fdro, mta_ext, ret, v, flags, code;
 
 	memset(&bounce, 0, sizeof(struct delivery_bounce));
 	if (p->proc == PROC_SMTP) {
@@ -109,9 +249,29 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
 			m_get_msgid(&m, &msgid);
+			memset(&trace, 0, sizeof(trace));
+			if (!m_is_eom(&m)) {
+				m_get_data(&m, &data, &len);
+				if (len != sizeof(trace))
+					fatalx("queue: bad trace size");
+				memmove(&trace, data, len);
+			}
 			m_end(&m);
 
-			ret = queue_message_commit(msgid);
+			if (nsyncers ||
+			    env->sc_queue_flags & QUEUE_GROUPCOMMIT) {
+				queue_commit_add(p, reqid, msgid, &trace);
+				return;
+			}
+
+			ret = queue_message_sync(msgid) &&
+			    queue_message_flush() &&
+			    queue_message_commit(msgid);
+			if (ret && ! queue_message_flush())
+				log_warnx("warn: queue: flush after commit "
+				    "failed");
+			if (ret && trace.ts[EVPTRACE_ACCEPT])
+				queue_trace_commit(msgid, &trace);
 
 			m_create(p,  IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
 			m_add_id(p, reqid);
@@ -130,14 +290,24 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
 			m_get_msgid(&m, &msgid);
+			m_get_int(&m, &v);
 			m_end(&m);
 
 			fd = queue_message_fd_rw(msgid);
 
-			m_create(p_mfa, IMSG_QUEUE_MESSAGE_FILE, 0, 0, fd);
-			m_add_id(p_mfa, reqid);
-			m_add_int(p_mfa, (fd == -1) ? 0 : 1);
-			m_close(p_mfa);
+			/* without filters, smtp writes the file itself */
+			p_agent = v ? p : p_mfa;
+			if (p_agent == p_mfa && fd != -1 &&
+			    (fdro = queue_message_fd_ro(msgid)) != -1) {
+				m_create(p_mfa, IMSG_QUEUE_MESSAGE_FILE_RO,
+				    0, 0, fdro);
+				m_add_id(p_mfa, reqid);
+				m_close(p_mfa);
+			}
+			m_create(p_agent, IMSG_QUEUE_MESSAGE_FILE, 0, 0, fd);
+			m_add_id(p_agent, reqid);
+			m_add_int(p_agent, (fd == -1) ? 0 : 1);
+			m_close(p_agent);
 			return;
 
 		case IMSG_SMTP_ENQUEUE_FD:
@@ -160,15 +330,16 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 				log_warnx("warn: imsg_queue_submit_envelope: msgid=0, "
 				    "evpid=%016"PRIx64, evp.id);
 			ret = queue_envelope_create(&evp);
-			m_create(p_smtp, IMSG_QUEUE_SUBMIT_ENVELOPE, 0, 0, -1);
-			m_add_id(p_smtp, reqid);
+			p_agent = smtp_peer(reqid);
+			m_create(p_agent, IMSG_QUEUE_SUBMIT_ENVELOPE, 0, 0, -1);
+			m_add_id(p_agent, reqid);
 			if (ret == 0)
-				m_add_int(p_smtp, 0);
+				m_add_int(p_agent, 0);
 			else {
-				m_add_int(p_smtp, 1);
-				m_add_evpid(p_smtp, evp.id);
+				m_add_int(p_agent, 1);
+				m_add_evpid(p_agent, evp.id);
 			}
-			m_close(p_smtp);
+			m_close(p_agent);
 			if (ret) {
 				m_create(p_scheduler,
 				    IMSG_QUEUE_SUBMIT_ENVELOPE, 0, 0, -1);
@@ -182,10 +353,11 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
 			m_end(&m);
-			m_create(p_smtp, IMSG_QUEUE_COMMIT_ENVELOPES, 0, 0, -1);
-			m_add_id(p_smtp, reqid);
-			m_add_int(p_smtp, 1);
-			m_close(p_smtp);
+			p_agent = smtp_peer(reqid);
+			m_create(p_agent, IMSG_QUEUE_COMMIT_ENVELOPES, 0, 0, -1);
+			m_add_id(p_agent, reqid);
+			m_add_int(p_agent, 1);
+			m_close(p_agent);
 			return;
 		}
 	}
@@ -222,6 +394,17 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			queue_envelope_delete(evpid);
 			return;
 
+		case IMSG_QUEUE_BACKLOG:
+			m_msg(&m, imsg);
+			m_get_size(&m, &offload_backlog);
+			m_end(&m);
+			return;
+
+		case IMSG_QUEUE_SNAPSHOT:
+			queue_snapshot_receive(imsg->data,
+			    imsg->hdr.len - sizeof imsg->hdr);
+			return;
+
 		case IMSG_QUEUE_BOUNCE:
 			req_bounce = imsg->data;
 			evpid = req_bounce->evpid;
@@ -255,6 +438,8 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			evp.lasttry = time(NULL);
 			m_create(p_mda, IMSG_MDA_DELIVER, 0, 0, -1);
 			m_add_envelope(p_mda, &evp);
+			if (queue_trace_get(evpid, &trace))
+				m_add_data(p_mda, &trace, sizeof(trace));
 			m_close(p_mda);
 			return;
 
@@ -278,9 +463,14 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 				return;
 			}
 			evp.lasttry = time(NULL);
-			m_create(p_mta, IMSG_MTA_TRANSFER, 0, 0, -1);
-			m_add_envelope(p_mta, &evp);
-			m_close(p_mta);
+			if (!TAILQ_EMPTY(env->sc_offloads))
+				queue_offload(&evp);
+			p_agent = mta_peer(&evp);
+			m_create(p_agent, IMSG_MTA_TRANSFER, 0, 0, -1);
+			m_add_envelope(p_agent, &evp);
+			if (queue_trace_get(evpid, &trace))
+				m_add_data(p_agent, &trace, sizeof(trace));
+			m_close(p_agent);
 			return;
 
 		case IMSG_CTL_LIST_ENVELOPES:
@@ -317,6 +507,10 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_compose(p_control, IMSG_CTL_LIST_ENVELOPES,
 			    imsg->hdr.peerid, 0, -1, &evp, sizeof evp);
 			return;
+
+		case IMSG_CTL_QUERY_ENVELOPES:
+			queue_query(imsg);
+			return;
 		}
 	}
 
@@ -339,26 +533,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			if (p->proc == PROC_MTA)
 				m_get_int(&m, &mta_ext);
 			m_end(&m);
-			if (queue_envelope_load(evpid, &evp) == 0) {
-				log_warn("queue: dsn: failed to load envelope");
-				return;
-			}
-			if (evp.dsn_notify & DSN_SUCCESS) {
-				bounce.type = B_DSN;
-				bounce.dsn_ret = evp.dsn_ret;
-
-				if (p->proc == PROC_MDA)
-					queue_bounce(&evp, &bounce);
-				else if (p->proc == PROC_MTA &&
-				    (mta_ext & MTA_EXT_DSN) == 0) {
-					bounce.mta_without_dsn = 1;
-					queue_bounce(&evp, &bounce);
-				}
-			}
-			queue_envelope_delete(evpid);
-			m_create(p_scheduler, IMSG_DELIVERY_OK, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_close(p_scheduler);
+			queue_delivery_ok(p, evpid, mta_ext);
 			return;
 
 		case IMSG_DELIVERY_TEMPFAIL:
@@ -367,23 +542,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_string(&m, &reason);
 			m_get_int(&m, &code);
 			m_end(&m);
-			if (queue_envelope_load(evpid, &evp) == 0) {
-				log_warnx("queue: tempfail: failed to load envelope");
-				m_create(p_scheduler, IMSG_QUEUE_REMOVE, 0, 0, -1);
-				m_add_evpid(p_scheduler, evpid);
-				m_add_u32(p_scheduler, 1); /* in-flight */
-				m_close(p_scheduler);
-				return;
-			}
-			envelope_set_errormsg(&evp, "%s", reason);
-			envelope_set_esc_class(&evp, ESC_STATUS_TEMPFAIL);
-			envelope_set_esc_code(&evp, code);
-			evp.retry++;
-			if (!queue_envelope_update(&evp))
-				log_warnx("warn: could not update envelope %016"PRIx64, evpid);
-			m_create(p_scheduler, IMSG_DELIVERY_TEMPFAIL, 0, 0, -1);
-			m_add_envelope(p_scheduler, &evp);
-			m_close(p_scheduler);
+			queue_delivery_tempfail(evpid, reason, code);
 			return;
 
 		case IMSG_DELIVERY_PERMFAIL:
@@ -392,50 +551,51 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_string(&m, &reason);
 			m_get_int(&m, &code);
 			m_end(&m);
-			if (queue_envelope_load(evpid, &evp) == 0) {
-				log_warnx("queue: permfail: failed to load envelope");
-				m_create(p_scheduler, IMSG_QUEUE_REMOVE, 0, 0, -1);
-				m_add_evpid(p_scheduler, evpid);
-				m_add_u32(p_scheduler, 1); /* in-flight */
-				m_close(p_scheduler);
-				return;
-			}
-			bounce.type = B_ERROR;
-			envelope_set_errormsg(&evp, "%s", reason);
-			envelope_set_esc_class(&evp, ESC_STATUS_PERMFAIL);
-			envelope_set_esc_code(&evp, code);
-			queue_bounce(&evp, &bounce);
-			queue_envelope_delete(evpid);
-			m_create(p_scheduler, IMSG_DELIVERY_PERMFAIL, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_close(p_scheduler);
+			queue_delivery_permfail(evpid, reason, code);
 			return;
 
 		case IMSG_DELIVERY_LOOP:
 			m_msg(&m, imsg);
 			m_get_evpid(&m, &evpid);
 			m_end(&m);
-			if (queue_envelope_load(evpid, &evp) == 0) {
-				log_warnx("queue: loop: failed to load envelope");
-				m_create(p_scheduler, IMSG_QUEUE_REMOVE, 0, 0, -1);
-				m_add_evpid(p_scheduler, evpid);
-				m_add_u32(p_scheduler, 1); /* in-flight */
-				m_close(p_scheduler);
-				return;
+			queue_delivery_loop(evpid);
+			return;
+
+		case IMSG_MTA_DELIVERY_REPORT:
+			m_msg(&m, imsg);
+			while (!m_is_eom(&m)) {
+				m_get_evpid(&m, &evpid);
+				m_get_int(&m, &v);
+				switch (v) {
+				case IMSG_DELIVERY_OK:
+					m_get_int(&m, &mta_ext);
+					queue_delivery_ok(p, evpid, mta_ext);
+					break;
+				case IMSG_DELIVERY_TEMPFAIL:
+					m_get_string(&m, &reason);
+					m_get_int(&m, &code);
+					queue_delivery_tempfail(evpid, reason, code);
+					break;
+				case IMSG_DELIVERY_PERMFAIL:
+					m_get_string(&m, &reason);
+					m_get_int(&m, &code);
+					queue_delivery_permfail(evpid, reason, code);
+					break;
+				case IMSG_DELIVERY_LOOP:
+					queue_delivery_loop(evpid);
+					break;
+				default:
+					log_warnx("warn: queue: bad delivery "
+					    "report type %d", v);
+					fatalx("aborting");
+				}
 			}
-			envelope_set_errormsg(&evp, "%s", "Loop detected");
-			envelope_set_esc_class(&evp, ESC_STATUS_TEMPFAIL);
-			envelope_set_esc_code(&evp, ESC_ROUTING_LOOP_DETECTED);
-			bounce.type = B_ERROR;
-			queue_bounce(&evp, &bounce);
-			queue_envelope_delete(evp.id);
-			m_create(p_scheduler, IMSG_DELIVERY_LOOP, 0, 0, -1);
-			m_add_evpid(p_scheduler, evp.id);
-			m_close(p_scheduler);
+			m_end(&m);
 			return;
 
 		case IMSG_DELIVERY_HOLD:
 		case IMSG_MTA_SCHEDULE:
+		case IMSG_MTA_HOSTSTAT:
 			m_forward(p_scheduler, imsg);
 			return;
 		case IMSG_DELIVERY_RELEASE:
@@ -465,6 +625,18 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		case IMSG_QUEUE_REMOVE:
 			m_forward(p_scheduler, imsg);
 			return;
+
+		case IMSG_CTL_SET_LIMIT:
+			memmove(&limit, imsg->data, sizeof limit);
+			ret = limit_set(limit.name, limit.value);
+			if (ret) {
+				log_info("info: queue: limit %s set to %lld",
+				    limit.name, (long long)limit.value);
+				queue_envelope_cache_resize();
+			}
+			m_compose(p, ret ? IMSG_CTL_OK : IMSG_CTL_FAIL,
+			    imsg->hdr.peerid, 0, -1, NULL, 0);
+			return;
 		}
 	}
 
@@ -490,6 +662,48 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 	errx(1, "queue_imsg: unexpected %s imsg", imsg_to_str(imsg->hdr.type));
 }
 
+/*
+ * A page of "show queue filter" from the scheduler.  Its index only keeps
+ * hashes of the recipient domain and sender, so a row is only passed on
+ * to control if the envelope really matches.
+ */
+static void
+queue_query(struct imsg *imsg)
+{
+	struct scheduler_query	 q;
+	struct evpsummary	 row;
+	struct envelope		 evp;
+	char			 sender[sizeof q.sender];
+	const char		*data;
+	size_t			 len;
+
+	data = imsg->data;
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (len < sizeof q || (len - sizeof q) % sizeof row)
+		fatalx("queue: bad query page");
+	memmove(&q, data, sizeof q);
+	data += sizeof q;
+	len -= sizeof q;
+
+	m_create(p_control, IMSG_CTL_QUERY_ENVELOPES, imsg->hdr.peerid, 0, -1);
+	m_add(p_control, &q.from, sizeof q.from);
+	for (; len; data += sizeof row, len -= sizeof row) {
+		memmove(&row, data, sizeof row);
+		if (q.domain[0] || q.sender[0]) {
+			if (queue_envelope_load(row.evpid, &evp) == 0)
+				continue;
+			if (q.domain[0] && strcasecmp(evp.dest.domain, q.domain))
+				continue;
+			(void)snprintf(sender, sizeof sender, "%s@%s",
+			    evp.sender.user, evp.sender.domain);
+			if (q.sender[0] && strcasecmp(sender, q.sender))
+				continue;
+		}
+		m_add(p_control, &row, sizeof row);
+	}
+	m_close(p_control);
+}
+
 static void
 queue_bounce(struct envelope *e, struct delivery_bounce *d)
 {
@@ -533,6 +747,317 @@ queue_bounce(struct envelope *e, struct delivery_bounce *d)
 	}
 }
 
+static void
+queue_commit_add(struct mproc *p, uint64_t reqid, uint32_t msgid,
+    const struct evptrace *trace)
+{
+	struct queue_commit	*c;
+	struct timeval		 tv;
+
+	c = xcalloc(1, sizeof *c, "queue_commit_add");
+	c->p = p;
+	c->reqid = reqid;
+	c->msgid = msgid;
+	c->trace = *trace;
+	TAILQ_INSERT_TAIL(&commits, c, entry);
+	ncommits++;
+
+	if (!(env->sc_queue_flags & QUEUE_GROUPCOMMIT) ||
+	    ncommits >= env->sc_queue_group_commit_max) {
+		queue_commit_flush();
+		return;
+	}
+
+	if (evtimer_pending(&ev_commit, NULL))
+		return;
+
+	tv.tv_sec = env->sc_queue_group_commit_delay / 1000;
+	tv.tv_usec = (env->sc_queue_group_commit_delay % 1000) * 1000;
+	evtimer_add(&ev_commit, &tv);
+}
+
+/*
+ * Commit every message gathered during the current window, then release
+ * the replies.  The backend has deferred syncing the envelopes of those
+ * messages, so the whole batch reaches the disk in one pass and no session
+ * is answered before its message is durable.  With syncers, the batch is
+ * handed over to them and the commits happen as they answer.
+ */
+static void
+queue_commit_flush(void)
+{
+	struct queue_batch	*b;
+	struct queue_commit	*c;
+	struct queue_syncer	*s;
+	struct queue_sync	 req;
+	size_t			 n;
+
+	evtimer_del(&ev_commit);
+
+	n = ncommits;
+	if (nsyncers == 0) {
+		/* sync the whole batch once, then commit it */
+		TAILQ_FOREACH(c, &commits, entry)
+			c->ret = queue_message_sync(c->msgid);
+		if (! queue_message_flush())
+			TAILQ_FOREACH(c, &commits, entry)
+				c->ret = 0;
+		TAILQ_FOREACH(c, &commits, entry)
+			c->ret = c->ret && queue_message_commit(c->msgid);
+		if (! queue_message_flush())
+			log_warnx("warn: queue: flush after commit failed");
+		while ((c = TAILQ_FIRST(&commits))) {
+			TAILQ_REMOVE(&commits, c, entry);
+			ncommits--;
+			queue_commit_done(c);
+		}
+	}
+	else {
+		b = xcalloc(1, sizeof *b, "queue_commit_flush");
+		TAILQ_INIT(&b->commits);
+		while ((c = TAILQ_FIRST(&commits))) {
+			TAILQ_REMOVE(&commits, c, entry);
+			ncommits--;
+			TAILQ_INSERT_TAIL(&b->commits, c, entry);
+			c->batch = b;
+			b->pending++;
+
+			s = &syncers[syncer];
+			syncer = (syncer + 1) % nsyncers;
+			memset(&req, 0, sizeof req);
+			req.msgid = c->msgid;
+			m_compose(&s->mproc, IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1,
+			    &req, sizeof req);
+			TAILQ_INSERT_TAIL(&s->pending, c, sentry);
+		}
+		TAILQ_INSERT_TAIL(&batches, b, entry);
+	}
+
+	if (!(env->sc_queue_flags & QUEUE_GROUPCOMMIT))
+		return;
+	log_trace(TRACE_QUEUE, "queue: group commit of %zu message(s)", n);
+	stat_increment("queue.group_commit", 1);
+}
+
+/* answer for a message of a batch that was synced and committed */
+static void
+queue_commit_done(struct queue_commit *c)
+{
+	int	ret;
+
+	ret = c->ret;
+	if (ret && c->trace.ts[EVPTRACE_ACCEPT])
+		queue_trace_commit(c->msgid, &c->trace);
+
+	m_create(c->p, IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
+	m_add_id(c->p, c->reqid);
+	m_add_int(c->p, (ret == 0) ? 0 : 1);
+	m_close(c->p);
+
+	if (ret) {
+		m_create(p_scheduler, IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
+		m_add_msgid(p_scheduler, c->msgid);
+		m_close(p_scheduler);
+	}
+	free(c);
+}
+
+/* commit the batches the syncers are done with, oldest first */
+static void
+queue_commit_release(void)
+{
+	struct queue_batch	*b;
+	struct queue_commit	*c;
+
+	while ((b = TAILQ_FIRST(&batches)) && b->pending == 0) {
+		TAILQ_REMOVE(&batches, b, entry);
+		while ((c = TAILQ_FIRST(&b->commits))) {
+			TAILQ_REMOVE(&b->commits, c, entry);
+			queue_commit_done(c);
+		}
+		free(b);
+	}
+}
+
+static void
+queue_commit_timeout(int fd, short event, void *p)
+{
+	queue_commit_flush();
+}
+
+static void
+queue_syncers_start(void)
+{
+	struct queue_syncer	*s;
+	int			 sp[2], i;
+	pid_t			 pid;
+
+	if (! queue_message_can_sync())
+		return;
+
+	for (i = 0; i < QUEUE_SYNCERS; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1) {
+			log_warn("warn: queue: socketpair");
+			break;
+		}
+		if ((pid = fork()) == -1) {
+			log_warn("warn: queue: fork");
+			close(sp[0]);
+			close(sp[1]);
+			break;
+		}
+		if (pid == 0) {
+			close(sp[0]);
+			while (i--)
+				close(syncers[i].mproc.imsgbuf.fd);
+			queue_syncer_run(sp[1]);
+			_exit(0);
+		}
+		close(sp[1]);
+		session_socket_blockmode(sp[0], BM_NONBLOCK);
+		s = &syncers[nsyncers++];
+		s->mproc.pid = pid;
+		s->mproc.proc = PROC_QUEUE;
+		s->mproc.name = "queue-syncer";
+		s->mproc.handler = queue_syncer_imsg;
+		s->mproc.data = s;
+		mproc_init(&s->mproc, sp[0]);
+		TAILQ_INIT(&s->pending);
+	}
+
+	if (nsyncers)
+		log_debug("debug: queue: syncing messages with %d processes",
+		    nsyncers);
+}
+
+/*
+ * The syncer loop, it exits when the queue process goes away.  It may
+ * block on its socket, the queue process never does.
+ */
+static void
+queue_syncer_run(int fd)
+{
+	struct imsgbuf		 ibuf;
+	struct imsg		 imsg;
+	struct queue_sync	 reqs[QUEUE_SYNC_BATCH];
+	ssize_t			 n;
+	size_t			 i, nreqs;
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	imsg_init(&ibuf, fd);
+	for (;;) {
+		if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN &&
+		    errno != EINTR)
+			break;
+		if (n == 0)
+			break;
+
+		/*
+		 * Take all that came in as one group: sync all the messages,
+		 * flush, commit them, flush again and send the replies.
+		 */
+		for (;;) {
+			for (nreqs = 0; nreqs < QUEUE_SYNC_BATCH; nreqs++) {
+				if ((n = imsg_get(&ibuf, &imsg)) <= 0)
+					break;
+				if (imsg.hdr.type != IMSG_QUEUE_COMMIT_MESSAGE ||
+				    imsg.hdr.len - IMSG_HEADER_SIZE !=
+				    sizeof reqs[0])
+					_exit(1);
+				memmove(&reqs[nreqs], imsg.data, sizeof reqs[0]);
+				imsg_free(&imsg);
+			}
+			if (n == -1)
+				_exit(1);
+			if (nreqs == 0)
+				break;
+
+			for (i = 0; i < nreqs; i++)
+				reqs[i].ret = queue_message_sync(reqs[i].msgid);
+			if (! queue_message_flush())
+				for (i = 0; i < nreqs; i++)
+					reqs[i].ret = 0;
+			for (i = 0; i < nreqs; i++)
+				reqs[i].ret = reqs[i].ret &&
+				    queue_message_commit(reqs[i].msgid);
+			if (! queue_message_flush())
+				log_warnx("warn: queue: flush after commit "
+				    "failed");
+
+			for (i = 0; i < nreqs; i++)
+				if (imsg_compose(&ibuf, IMSG_QUEUE_COMMIT_MESSAGE,
+				    0, 0, -1, &reqs[i], sizeof reqs[i]) == -1)
+					_exit(1);
+			if (imsg_flush(&ibuf) == -1)
+				_exit(1);
+		}
+	}
+}
+
+static void
+queue_syncer_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct queue_syncer	*s = p->data;
+	struct queue_commit	*c;
+	struct queue_sync	 rep;
+
+	if (imsg == NULL)
+		fatalx("queue: syncer exited");
+
+	if (imsg->hdr.type != IMSG_QUEUE_COMMIT_MESSAGE ||
+	    imsg->hdr.len - IMSG_HEADER_SIZE != sizeof rep)
+		fatalx("queue: bad reply from syncer");
+	memmove(&rep, imsg->data, sizeof rep);
+
+	c = TAILQ_FIRST(&s->pending);
+	if (c == NULL || c->msgid != rep.msgid)
+		fatalx("queue: unexpected reply from syncer");
+	TAILQ_REMOVE(&s->pending, c, sentry);
+	c->ret = rep.ret;
+	c->batch->pending--;
+
+	queue_commit_release();
+}
+
+/* keep the trace of a committed message, forgetting the oldest one */
+static void
+queue_trace_commit(uint32_t msgid, const struct evptrace *trace)
+{
+	struct queue_trace	*t;
+
+	if (tree_count(&tracetree) >= QUEUE_TRACE_MAX) {
+		t = TAILQ_FIRST(&traces);
+		TAILQ_REMOVE(&traces, t, entry);
+		tree_xpop(&tracetree, t->msgid);
+		free(t);
+	}
+
+	if ((t = tree_get(&tracetree, msgid)) == NULL) {
+		t = xcalloc(1, sizeof *t, "queue_trace_commit");
+		t->msgid = msgid;
+		tree_xset(&tracetree, msgid, t);
+		TAILQ_INSERT_TAIL(&traces, t, entry);
+	}
+	t->trace = *trace;
+	t->trace.ts[EVPTRACE_COMMIT] = evptrace_now();
+}
+
+/* the trace to send along with an envelope being delivered, if any */
+static int
+queue_trace_get(uint64_t evpid, struct evptrace *trace)
+{
+	struct queue_trace	*t;
+
+	if ((t = tree_get(&tracetree, evpid_to_msgid(evpid))) == NULL)
+		return (0);
+	if (t->trace.ts[EVPTRACE_SCHEDULE] == 0)
+		t->trace.ts[EVPTRACE_SCHEDULE] = evptrace_now();
+	*trace = t->trace;
+	return (1);
+}
+
 static void
 queue_sig_handler(int sig, short event, void *p)
 {
@@ -560,6 +1085,7 @@ queue(void)
 	struct passwd	*pw;
 	struct timeval	 tv;
 	struct event	 ev_qload;
+	int		 i;
 	struct event	 ev_sigint;
 	struct event	 ev_sigterm;
 
@@ -579,8 +1105,8 @@ queue(void)
 		if ((pw = getpwnam(SMTPD_USER)) == NULL)
 			fatalx("unknown user " SMTPD_USER);
 
-	env->sc_queue_flags |= QUEUE_EVPCACHE;
-	env->sc_queue_evpcache_size = 1024;
+	if (env->sc_queue_evpcache_size)
+		env->sc_queue_flags |= QUEUE_EVPCACHE;
 
 	if (chroot(PATH_SPOOL) == -1)
 		fatal("queue: chroot");
@@ -603,6 +1129,10 @@ queue(void)
 	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
 		fatal("queue: cannot drop privileges");
 
+	/* before event_init(), the syncers have no use for the event loop */
+	TAILQ_INIT(&batches);
+	queue_syncers_start();
+
 	imsg_callback = queue_imsg;
 	event_init();
 
@@ -623,6 +1153,40 @@ queue(void)
 	config_peer(PROC_SCHEDULER);
 	config_done();
 
+	TAILQ_INIT(&commits);
+	TAILQ_INIT(&traces);
+	tree_init(&tracetree);
+	evtimer_set(&ev_commit, queue_commit_timeout, NULL);
+	for (i = 0; i < nsyncers; i++)
+		mproc_enable(&syncers[i].mproc);
+	if (env->sc_queue_flags & QUEUE_GROUPCOMMIT)
+		log_info("queue: group commit enabled");
+
+	queue_snapshot_load();
+	evtimer_set(&ev_snapshot, queue_snapshot_timeout, NULL);
+
+	evtimer_set(&ev_profile, queue_profile_timeout, NULL);
+	tv.tv_sec = QUEUE_PROFILE_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_profile, &tv);
+
+	evtimer_set(&ev_purge, queue_purge_timeout, NULL);
+	tv.tv_sec = QUEUE_PURGE_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_purge, &tv);
+
+	evtimer_set(&ev_flow, queue_flow_timeout, NULL);
+	tv.tv_sec = 0;
+	tv.tv_usec = QUEUE_FLOW_INTERVAL;
+	evtimer_add(&ev_flow, &tv);
+
+	if (env->sc_queue_flags & (QUEUE_COMPRESSION | QUEUE_ENCRYPTION)) {
+		evtimer_set(&ev_decoded, queue_decoded_timeout, NULL);
+		tv.tv_sec = QUEUE_DECODED_INTERVAL;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_decoded, &tv);
+	}
+
 	/* setup queue loading task */
 	evtimer_set(&ev_qload, queue_timeout, &ev_qload);
 	tv.tv_sec = 0;
@@ -639,34 +1203,58 @@ queue(void)
 static void
 queue_timeout(int fd, short event, void *p)
 {
-	static uint32_t	 msgid = 0;
-	struct envelope	 evp;
-	struct event	*ev = p;
-	struct timeval	 tv;
-	int		 r;
+	static uint32_t		 msgid = 0;
+	static int		 walked = 0;
+	struct envelope		 evp;
+	struct scheduler_info	 si;
+	struct event		*ev = p;
+	struct timeval		 tv;
+	uint64_t		 evpid;
+	int			 r, n;
+
+	for (n = 0; n < QUEUE_LOAD_BATCH; n++) {
+		if (! walked) {
+			r = queue_envelope_walk(&evp);
+			if (r == -1) {
+				walked = 1;
+				continue;
+			}
+			if (r == 0)
+				continue;
+			evpid = evp.id;
+		}
+		else if (queue_snapshot_next(&si))
+			evpid = si.evpid;
+		else {
+			if (msgid) {
+				m_create(p_scheduler,
+				    IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
+				m_add_msgid(p_scheduler, msgid);
+				m_close(p_scheduler);
+			}
+			log_debug("debug: queue: done loading queue into "
+			    "scheduler");
+			queue_snapshot_timeout(-1, 0, NULL);
+			return;
+		}
 
-	r = queue_envelope_walk(&evp);
-	if (r == -1) {
-		if (msgid) {
+		if (msgid && evpid_to_msgid(evpid) != msgid) {
 			m_create(p_scheduler, IMSG_QUEUE_COMMIT_MESSAGE,
 			    0, 0, -1);
 			m_add_msgid(p_scheduler, msgid);
 			m_close(p_scheduler);
 		}
-		log_debug("debug: queue: done loading queue into scheduler");
-		return;
-	}
-
-	if (r) {
-		if (msgid && evpid_to_msgid(evp.id) != msgid) {
-			m_create(p_scheduler, IMSG_QUEUE_COMMIT_MESSAGE,
+		msgid = evpid_to_msgid(evpid);
+		if (! walked) {
+			m_create(p_scheduler, IMSG_QUEUE_SUBMIT_ENVELOPE,
 			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
+			m_add_envelope(p_scheduler, &evp);
+		}
+		else {
+			m_create(p_scheduler, IMSG_QUEUE_SUBMIT_SNAPSHOT,
+			    0, 0, -1);
+			m_add_data(p_scheduler, &si, sizeof si);
 		}
-		msgid = evpid_to_msgid(evp.id);
-		m_create(p_scheduler, IMSG_QUEUE_SUBMIT_ENVELOPE, 0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
 		m_close(p_scheduler);
 	}
 
@@ -675,6 +1263,233 @@ queue_timeout(int fd, short event, void *p)
 	evtimer_add(ev, &tv);
 }
 
+static void
+queue_snapshot_timeout(int fd, short event, void *p)
+{
+	struct timeval	tv;
+
+	if (! queue_snapshot_supported())
+		return;
+
+	/* first call is made once the queue is loaded */
+	if (fd != -1 && queue_snapshot_request())
+		m_compose(p_scheduler, IMSG_QUEUE_SNAPSHOT, 0, 0, -1, NULL, 0);
+
+	tv.tv_sec = QUEUE_SNAPSHOT_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_snapshot, &tv);
+}
+
+static void
+queue_profile_timeout(int fd, short event, void *p)
+{
+	struct timeval	tv;
+	char		key[STAT_KEY_SIZE];
+	size_t		iter = 0, count;
+
+	while (queue_profile_next(&iter, key, sizeof key, &count))
+		stat_set(key, stat_counter(count));
+
+	tv.tv_sec = QUEUE_PROFILE_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_profile, &tv);
+}
+
+static void
+queue_decoded_timeout(int fd, short event, void *p)
+{
+	struct timeval	tv;
+
+	queue_message_expire_decoded();
+
+	tv.tv_sec = QUEUE_DECODED_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_decoded, &tv);
+}
+
+/*
+ * Walk the purge directory across runs, the backlog being the number of
+ * its entries not yet entirely removed.
+ */
+static void
+queue_purge_timeout(int fd, short event, void *p)
+{
+	char		*path_argv[2];
+	struct timeval	 tv;
+	FTSENT		*e, *c;
+	size_t		 n = 0;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = QUEUE_PURGE_DELAY;
+
+	if (purge_fts == NULL) {
+		path_argv[0] = PATH_PURGE;
+		path_argv[1] = NULL;
+		purge_fts = fts_open(path_argv, FTS_PHYSICAL | FTS_NOCHDIR,
+		    NULL);
+		if (purge_fts == NULL) {
+			log_warn("warn: queue: fts_open: %s", PATH_PURGE);
+			goto idle;
+		}
+	}
+
+	while (n < QUEUE_PURGE_STEP) {
+		if ((e = fts_read(purge_fts)) == NULL) {
+			purge_backlog = 0;
+			goto idle;
+		}
+
+		switch (e->fts_info) {
+		case FTS_D:
+			if (e->fts_level == FTS_ROOTLEVEL) {
+				purge_backlog = 0;
+				c = fts_children(purge_fts, 0);
+				for (; c; c = c->fts_link)
+					purge_backlog++;
+				if (purge_backlog == 0)
+					goto idle;
+			}
+			continue;
+		case FTS_DP:
+		case FTS_DNR:
+			if (e->fts_level == FTS_ROOTLEVEL)
+				continue;
+			if (rmdir(e->fts_path) == -1)
+				log_warn("warn: queue: rmdir: %s", e->fts_path);
+			break;
+		case FTS_F:
+		case FTS_SL:
+		case FTS_SLNONE:
+		case FTS_DEFAULT:
+			if (unlink(e->fts_path) == -1)
+				log_warn("warn: queue: unlink: %s", e->fts_path);
+			break;
+		default:
+			log_warnx("warn: queue: purge: %s: %s", e->fts_path,
+			    strerror(e->fts_errno));
+			continue;
+		}
+		n++;
+		if (e->fts_level == FTS_ROOTLEVEL + 1 && purge_backlog)
+			purge_backlog--;
+	}
+	stat_increment("queue.purge.removed", n);
+	stat_set("queue.purge.backlog", stat_counter(purge_backlog));
+	evtimer_add(&ev_purge, &tv);
+	return;
+
+idle:
+	if (n)
+		stat_increment("queue.purge.removed", n);
+	if (purge_fts) {
+		fts_close(purge_fts);
+		purge_fts = NULL;
+	}
+	stat_set("queue.purge.backlog", stat_counter(purge_backlog));
+	tv.tv_sec = QUEUE_PURGE_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_purge, &tv);
+}
+
+static void
+queue_delivery_ok(struct mproc *p, uint64_t evpid, int mta_ext)
+{
+	struct delivery_bounce	 bounce;
+	struct envelope		 evp;
+
+	if (queue_envelope_load(evpid, &evp) == 0) {
+		log_warn("queue: dsn: failed to load envelope");
+		return;
+	}
+	if (evp.dsn_notify & DSN_SUCCESS) {
+		memset(&bounce, 0, sizeof bounce);
+		bounce.type = B_DSN;
+		bounce.dsn_ret = evp.dsn_ret;
+
+		if (p->proc == PROC_MDA)
+			queue_bounce(&evp, &bounce);
+		else if (p->proc == PROC_MTA &&
+		    (mta_ext & MTA_EXT_DSN) == 0) {
+			bounce.mta_without_dsn = 1;
+			queue_bounce(&evp, &bounce);
+		}
+	}
+	queue_envelope_delete(evpid);
+	m_batch_evpid(p_scheduler, IMSG_DELIVERY_OK, evpid);
+}
+
+static void
+queue_delivery_tempfail(uint64_t evpid, const char *reason, int code)
+{
+	struct envelope		 evp;
+
+	if (queue_envelope_load(evpid, &evp) == 0) {
+		log_warnx("queue: tempfail: failed to load envelope");
+		m_create(p_scheduler, IMSG_QUEUE_REMOVE, 0, 0, -1);
+		m_add_evpid(p_scheduler, evpid);
+		m_add_u32(p_scheduler, 1); /* in-flight */
+		m_close(p_scheduler);
+		return;
+	}
+	envelope_set_errormsg(&evp, "%s", reason);
+	envelope_set_esc_class(&evp, ESC_STATUS_TEMPFAIL);
+	envelope_set_esc_code(&evp, code);
+	evp.retry++;
+	if (!queue_envelope_update(&evp))
+		log_warnx("warn: could not update envelope %016"PRIx64, evpid);
+	m_create(p_scheduler, IMSG_DELIVERY_TEMPFAIL, 0, 0, -1);
+	m_add_envelope(p_scheduler, &evp);
+	m_close(p_scheduler);
+}
+
+static void
+queue_delivery_permfail(uint64_t evpid, const char *reason, int code)
+{
+	struct delivery_bounce	 bounce;
+	struct envelope		 evp;
+
+	if (queue_envelope_load(evpid, &evp) == 0) {
+		log_warnx("queue: permfail: failed to load envelope");
+		m_create(p_scheduler, IMSG_QUEUE_REMOVE, 0, 0, -1);
+		m_add_evpid(p_scheduler, evpid);
+		m_add_u32(p_scheduler, 1); /* in-flight */
+		m_close(p_scheduler);
+		return;
+	}
+	memset(&bounce, 0, sizeof bounce);
+	bounce.type = B_ERROR;
+	envelope_set_errormsg(&evp, "%s", reason);
+	envelope_set_esc_class(&evp, ESC_STATUS_PERMFAIL);
+	envelope_set_esc_code(&evp, code);
+	queue_bounce(&evp, &bounce);
+	queue_envelope_delete(evpid);
+	m_batch_evpid(p_scheduler, IMSG_DELIVERY_PERMFAIL, evpid);
+}
+
+static void
+queue_delivery_loop(uint64_t evpid)
+{
+	struct delivery_bounce	 bounce;
+	struct envelope		 evp;
+
+	if (queue_envelope_load(evpid, &evp) == 0) {
+		log_warnx("queue: loop: failed to load envelope");
+		m_create(p_scheduler, IMSG_QUEUE_REMOVE, 0, 0, -1);
+		m_add_evpid(p_scheduler, evpid);
+		m_add_u32(p_scheduler, 1); /* in-flight */
+		m_close(p_scheduler);
+		return;
+	}
+	memset(&bounce, 0, sizeof bounce);
+	envelope_set_errormsg(&evp, "%s", "Loop detected");
+	envelope_set_esc_class(&evp, ESC_STATUS_TEMPFAIL);
+	envelope_set_esc_code(&evp, ESC_ROUTING_LOOP_DETECTED);
+	bounce.type = B_ERROR;
+	queue_bounce(&evp, &bounce);
+	queue_envelope_delete(evp.id);
+	m_batch_evpid(p_scheduler, IMSG_DELIVERY_LOOP, evp.id);
+}
+
 void
 queue_ok(uint64_t evpid)
 {
@@ -733,50 +1548,173 @@ queue_log(const struct envelope *e, const char *prefix, const char *status)
 	    status);
 }
 
+/*
+ * Hand an envelope over to a peer once it is too old or the local queue
+ * too large.  Only envelopes that already failed here are offloaded, so
+ * that a node never bounces back what a peer just gave it.  The relay is
+ * not saved: a tempfail reloads the envelope as it was, and once the peer
+ * accepted it the local copy is removed as for any delivery.  When several
+ * peers match, the msgid picks one so that a message stays together.
+ */
+static int
+queue_offload_match(const struct offload *o, const struct envelope *evp,
+    time_t age)
+{
+	if (o->o_domain && !hostname_match(evp->dest.domain, o->o_domain))
+		return (0);
+	if (o->o_age && age >= o->o_age)
+		return (1);
+	if (o->o_backlog && offload_backlog >= o->o_backlog)
+		return (1);
+	return (0);
+}
+
+static void
+queue_offload(struct envelope *evp)
+{
+	struct offload	*o;
+	time_t		 age;
+	size_t		 n;
+
+	if (evp->type != D_MTA || evp->retry == 0)
+		return;
+
+	age = time(NULL) - evp->creation;
+	n = 0;
+	TAILQ_FOREACH(o, env->sc_offloads, o_entry)
+		if (queue_offload_match(o, evp, age))
+			n++;
+	if (n == 0)
+		return;
+
+	n = evpid_to_msgid(evp->id) % n;
+	TAILQ_FOREACH(o, env->sc_offloads, o_entry)
+		if (queue_offload_match(o, evp, age) && n-- == 0)
+			break;
+
+	evp->agent.mta.relay = o->o_relay;
+	log_info("%016" PRIx64 ": offloading to %s after %s, backlog=%zu",
+	    evp->id, relayhost_to_text(&o->o_relay), duration_to_text(age),
+	    offload_backlog);
+	stat_increment("queue.offload", 1);
+}
+
 void
 queue_flow_control(void)
 {
-	size_t	bufsz;
-	int	oldlimit = limit;
-	int	set, unset;
-
-	bufsz = p_mda->bytes_queued + p_mta->bytes_queued;
-	if (bufsz <= flow_agent_lowat)
-		limit &= ~LIMIT_AGENT;
-	else if (bufsz > flow_agent_hiwat)
-		limit |= LIMIT_AGENT;
-
-	if (p_scheduler->bytes_queued <= flow_scheduler_lowat)
-		limit &= ~LIMIT_SCHEDULER;
-	else if (p_scheduler->bytes_queued > flow_scheduler_hiwat)
-		limit |= LIMIT_SCHEDULER;
-
-	set = limit & (limit ^ oldlimit);
-	unset = oldlimit & (limit ^ oldlimit);
-
-	if (set & LIMIT_SCHEDULER) {
-		log_warnx("warn: queue: Hiwat reached on scheduler buffer: "
-		    "suspending transfer, delivery and lookup input");
-		mproc_disable(p_mta);
-		mproc_disable(p_mda);
-		mproc_disable(p_lka);
-	}
-	else if (unset & LIMIT_SCHEDULER) {
-		log_warnx("warn: queue: Down to lowat on scheduler buffer: "
-		    "resuming transfer, delivery and lookup input");
-		mproc_enable(p_mta);
-		mproc_enable(p_mda);
-		mproc_enable(p_lka);
-	}
-
-	if (set & LIMIT_AGENT) {
-		log_warnx("warn: queue: Hiwat reached on transfer and delivery "
-		    "buffers: suspending scheduler input");
-		mproc_disable(p_scheduler);
-	}
-	else if (unset & LIMIT_AGENT) {
-		log_warnx("warn: queue: Down to lowat on transfer and delivery "
-		    "buffers: resuming scheduler input");
-		mproc_enable(p_scheduler);
+	struct stat_value	value;
+	size_t			bufsz, i;
+	int			agent, sched, disk, delivery, inbound;
+	int			changed = 0;
+
+	bufsz = p_mda->bytes_queued;
+	for (i = 0; i < env->sc_mta_procs; i++)
+		bufsz += p_mtas[i]->bytes_queued;
+	agent = queue_flow_credit(bufsz, flow_agent_lowat, flow_agent_hiwat);
+	sched = queue_flow_credit(p_scheduler->bytes_queued,
+	    flow_scheduler_lowat, flow_scheduler_hiwat);
+	disk = queue_flow_disk();
+
+	/* what gets to the scheduler must not outrun it either */
+	delivery = agent < sched ? agent : sched;
+	inbound = disk < sched ? disk : sched;
+
+	if (delivery != credit_delivery) {
+		if (delivery == 0)
+			log_warnx("warn: queue: transfer and delivery buffers "
+			    "full: suspending scheduling");
+		else if (credit_delivery == 0)
+			log_warnx("warn: queue: resuming scheduling");
+		credit_delivery = delivery;
+		changed = 1;
+		m_create(p_scheduler, IMSG_QUEUE_CREDIT, 0, 0, -1);
+		m_add_int(p_scheduler, credit_delivery);
+		m_close(p_scheduler);
 	}
+
+	if (inbound != credit_inbound) {
+		if (inbound == 0)
+			log_warnx("warn: queue: %s: deferring all new messages",
+			    disk == 0 ? "not enough disk space" :
+			    "scheduler buffer full");
+		else if (credit_inbound == 0)
+			log_warnx("warn: queue: accepting new messages again");
+		credit_inbound = inbound;
+		changed = 1;
+		for (i = 0; i < env->sc_smtp_procs; i++) {
+			m_create(p_smtps[i], IMSG_QUEUE_CREDIT, 0, 0, -1);
+			m_add_int(p_smtps[i], credit_inbound);
+			m_close(p_smtps[i]);
+		}
+	}
+
+	if (disk != credit_disk || changed) {
+		credit_disk = disk;
+		value.type = STAT_COUNTER;
+		value.u.counter = credit_delivery;
+		stat_set("queue.credit.delivery", &value);
+		value.u.counter = credit_inbound;
+		stat_set("queue.credit.inbound", &value);
+		value.u.counter = credit_disk;
+		stat_set("queue.credit.disk", &value);
+	}
+}
+
+static int
+queue_flow_credit(size_t v, size_t lowat, size_t hiwat)
+{
+	size_t	credit;
+
+	if (v <= lowat)
+		return (QUEUE_CREDIT_MAX);
+	if (v >= hiwat)
+		return (0);
+	credit = QUEUE_CREDIT_MAX - (v - lowat) * QUEUE_CREDIT_MAX /
+	    (hiwat - lowat);
+	return (credit - credit % QUEUE_CREDIT_STEP);
+}
+
+/* the credit left by the free blocks and inodes of the spool, our root */
+static int
+queue_flow_disk(void)
+{
+	struct statfs	buf;
+	int64_t		bavail, favail, btotal, ftotal;
+	uint64_t	bfree, ffree;
+	int		credit, fcredit;
+
+	if (statfs("/", &buf) == -1)
+		return (QUEUE_CREDIT_MAX);
+
+	/* some filesystems do not report these, see queue_fs.c */
+	if (buf.f_bfree == 0 || buf.f_ffree == 0 ||
+	    (int64_t)buf.f_bfree == -1 || (int64_t)buf.f_ffree == -1 ||
+	    buf.f_blocks == 0 || buf.f_files == 0)
+		return (QUEUE_CREDIT_MAX);
+
+	/* what is available to us goes negative once the reserve is used */
+	bavail = (int64_t)buf.f_bavail < 0 ? 0 : (int64_t)buf.f_bavail;
+	favail = (int64_t)buf.f_favail < 0 ? 0 : (int64_t)buf.f_favail;
+	btotal = (int64_t)(buf.f_blocks - buf.f_bfree) + bavail;
+	ftotal = (int64_t)(buf.f_files - buf.f_ffree) + favail;
+	bfree = btotal > 0 ? bavail * 100 / btotal : 0;
+	ffree = ftotal > 0 ? favail * 100 / ftotal : 0;
+
+	credit = QUEUE_CREDIT_MAX - queue_flow_credit(bfree, QUEUE_DISK_LOWAT,
+	    QUEUE_DISK_HIWAT);
+	fcredit = QUEUE_CREDIT_MAX - queue_flow_credit(ffree, QUEUE_DISK_LOWAT,
+	    QUEUE_DISK_HIWAT);
+	return (credit < fcredit ? credit : fcredit);
+}
+
+static void
+queue_flow_timeout(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+
+	queue_flow_control();
+
+	tv.tv_sec = 0;
+	tv.tv_usec = QUEUE_FLOW_INTERVAL;
+	evtimer_add(&ev_flow, &tv);
 }
@@ -33,6 +33,8 @@
 
 static int (*handler_message_create)(uint32_t *);
 static int (*handler_message_commit)(uint32_t, const char *);
+static int (*handler_message_sync)(uint32_t, const char *);
+static int (*handler_message_flush)(void);
 static int (*handler_message_delete)(uint32_t);
 static int (*handler_message_fd_r)(uint32_t);
 static int (*handler_message_corrupt)(uint32_t);
@@ -163,7 +165,20 @@ queue_msg_dispatch(void)
 					    ifile);
 					fwrite(buffer, 1, n, ofile);
 				}
-				r = handler_message_commit(msgid, path);
+				fflush(ofile);
+				/* the backend process syncs inline */
+				if ((handler_message_sync &&
+				    ! handler_message_sync(msgid, path)) ||
+				    (handler_message_flush &&
+				    ! handler_message_flush()))
+					r = 0;
+				else
+					r = handler_message_commit(msgid,
+					    path);
+				if (r == 1 && handler_message_flush &&
+				    ! handler_message_flush())
+					log_warnx("warn: queue-api: flush "
+					    "after commit failed");
 			}
 			if (ifile)
 				fclose(ifile);
@@ -261,6 +276,18 @@ queue_api_on_message_commit(int(*cb)(uint32_t, const char *))
 	handler_message_commit = cb;
 }
 
+void
+queue_api_on_message_sync(int(*cb)(uint32_t, const char *))
+{
+	handler_message_sync = cb;
+}
+
+void
+queue_api_on_message_flush(int(*cb)(void))
+{
+	handler_message_flush = cb;
+}
+
 void
 queue_api_on_message_delete(int(*cb)(uint32_t))
 {
@@ -21,6 +21,7 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <ctype.h>
 #include <err.h>
@@ -31,6 +32,7 @@
 #include <inttypes.h>
 #include <libgen.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,25 +42,127 @@
 #include "smtpd.h"
 #include "log.h"
 
+struct queue_decoded;
+
 static const char* envelope_validate(struct envelope *);
+static int queue_message_fd_pipeline(int, int);
+static int queue_decoded_get(uint32_t);
+static int queue_decoded_create(char *, size_t);
+static void queue_decoded_add(uint32_t, const char *, int);
+static void queue_decoded_drop(struct queue_decoded *);
+static void queue_decoded_expire(time_t);
 
 extern struct queue_backend	queue_backend_fs;
+extern struct queue_backend	queue_backend_journal;
 extern struct queue_backend	queue_backend_null;
 extern struct queue_backend	queue_backend_proc;
 extern struct queue_backend	queue_backend_ram;
 
+static void queue_envelope_cache_init(void);
+static int queue_envelope_cache_get(uint64_t, struct envelope *);
 static void queue_envelope_cache_add(struct envelope *);
 static void queue_envelope_cache_update(struct envelope *);
 static void queue_envelope_cache_del(uint64_t evpid);
 
-TAILQ_HEAD(evplst, envelope);
+/*
+ * The envelope cache is a hash table indexed by evpid, holding as many
+ * entries as fit in sc_queue_evpcache_size bytes.  Entries are evicted
+ * using the CLOCK algorithm: a hit only sets the reference bit, and the
+ * hand clears it while looking for a victim.
+ *
+ * An entry keeps the envelope in its binary encoding, a few hundred
+ * bytes instead of the several KB of struct envelope, and a hit decodes
+ * it.  The ring is sized for entries of EVPCACHE_ENTRY_AVG bytes.
+ */
+#define	EVPCACHE_ENTRY_AVG	512
+
+struct evpcache_entry {
+	struct evpcache_entry	*next;
+	uint64_t		 id;
+	size_t			 slot;
+	int			 ref;
+	size_t			 len;
+	char			 evp[];
+};
+
+static struct evpcache_entry	**evpcache_hash;
+static size_t			  evpcache_hashmask;
+static struct evpcache_entry	**evpcache_ring;
+static size_t			 *evpcache_free;
+static size_t			  evpcache_nfree;
+static size_t			  evpcache_slots;
+static size_t			  evpcache_hand;
+static size_t			  evpcache_used;
+
+/*
+ * With compression or encryption, a message is decoded once for all the
+ * deliveries running at the same time: the cleartext is kept in a file
+ * of the temporary directory and every consumer gets its own open of it,
+ * as a dup()ed fd would share the offset.  Unlinking an entry only drops
+ * it from the cache, the consumers still holding it keep reading.
+ * Entries expire QUEUE_DECODED_TTL seconds after their last use, checked
+ * on every access and from a timer of the queue process, and the least
+ * recently used go first beyond QUEUE_DECODED_MAX entries or
+ * QUEUE_DECODED_BUDGET bytes.
+ */
+#define	QUEUE_DECODED_MAX	64
+#define	QUEUE_DECODED_BUDGET	(256 * 1024 * 1024)
+#define	QUEUE_DECODED_TTL	30
+
+struct queue_decoded {
+	TAILQ_ENTRY(queue_decoded)	 entry;
+	uint32_t			 msgid;
+	time_t				 lastuse;
+	off_t				 size;
+	char				 path[SMTPD_MAXPATHLEN];
+};
+
+static struct tree			decoded;
+static TAILQ_HEAD(, queue_decoded)	decoded_lru =
+    TAILQ_HEAD_INITIALIZER(decoded_lru);
+static off_t				decoded_used;
 
-static struct tree		evpcache_tree;
-static struct evplst		evpcache_list;
 static struct queue_backend	*backend;
 
+/*
+ * The scheduler snapshot holds the scheduling state of every envelope as
+ * of its generation.  Envelopes not modified since then are restored from
+ * it at startup instead of being loaded from the queue.
+ *
+ * The generation is the modification time the filesystem gave the
+ * snapshot file when it was requested, so that it compares with the
+ * envelope files.  Files modified less than SNAPSHOT_MARGIN seconds
+ * before it are not trusted to be covered, to allow for filesystems with
+ * coarse timestamps and for small steps of the clock.
+ */
+#define	SNAPSHOT_FILE		PATH_SNAPSHOT "/scheduler"
+#define	SNAPSHOT_TMPFILE	PATH_SNAPSHOT "/scheduler.tmp"
+#define	SNAPSHOT_MAGIC		0x534e4150
+#define	SNAPSHOT_MARGIN		2
+#define	SNAPSHOT_VERSION	5
+
+struct snapshot_header {
+	uint32_t	magic;
+	uint32_t	version;
+	struct timespec	generation;
+};
+
+struct snapshot_entry {
+	struct scheduler_info	si;
+	int			seen;
+};
+
+static struct tree		snapshot;
+static struct timespec		snapshot_gen;
+static void		       *snapshot_iter;
+static FILE		       *snapshot_fp;
+
+static void queue_snapshot_clear(void);
+
 static int (*handler_message_create)(uint32_t *);
 static int (*handler_message_commit)(uint32_t, const char*);
+static int (*handler_message_sync)(uint32_t, const char*);
+static int (*handler_message_flush)(void);
 static int (*handler_message_delete)(uint32_t);
 static int (*handler_message_fd_r)(uint32_t);
 static int (*handler_message_corrupt)(uint32_t);
@@ -68,39 +172,108 @@ static int (*handler_envelope_update)(uint64_t, const char *, size_t);
 static int (*handler_envelope_load)(uint64_t, char *, size_t);
 static int (*handler_envelope_walk)(uint64_t *, char *, size_t);
 
-#ifdef QUEUE_PROFILING
+/*
+ * Latency histograms are always kept, one per backend handler: bucket n
+ * counts calls that took less than 2^n microseconds, the last bucket is
+ * open-ended.  Recording is local to the queue process, queue.c pushes
+ * the buckets that changed to the stat backend from a timer.
+ */
+#define	QPROF_BUCKETS	24
+
+enum qprof_op {
+	QOP_MESSAGE_CREATE,
+	QOP_MESSAGE_DELETE,
+	QOP_MESSAGE_COMMIT,
+	QOP_MESSAGE_CORRUPT,
+	QOP_MESSAGE_FD_R,
+	QOP_ENVELOPE_CREATE,
+	QOP_ENVELOPE_DELETE,
+	QOP_ENVELOPE_LOAD,
+	QOP_ENVELOPE_UPDATE,
+	QOP_ENVELOPE_WALK,
+	QOP_COUNT
+};
+
+static struct qprof {
+	const char	*name;
+	size_t		 hist[QPROF_BUCKETS];
+	size_t		 flushed[QPROF_BUCKETS];
+} qprof[QOP_COUNT] = {
+	{ "message_create" },
+	{ "message_delete" },
+	{ "message_commit" },
+	{ "message_corrupt" },
+	{ "message_fd_r" },
+	{ "envelope_create" },
+	{ "envelope_delete" },
+	{ "envelope_load" },
+	{ "envelope_update" },
+	{ "envelope_walk" },
+};
 
 static struct {
 	struct timespec	 t0;
-	const char	*name;
+	enum qprof_op	 op;
 } profile;
 
-static inline void profile_enter(const char *name)
+static inline void profile_enter(enum qprof_op op)
 {
-	if ((profiling & PROFILE_QUEUE) == 0)
-		return;
-
-	profile.name = name;
+	profile.op = op;
 	clock_gettime(CLOCK_MONOTONIC, &profile.t0);
 }
 
 static inline void profile_leave(void)
 {
 	struct timespec	 t1, dt;
-
-	if ((profiling & PROFILE_QUEUE) == 0)
-		return;
+	uint64_t	 us;
+	size_t		 b;
 
 	clock_gettime(CLOCK_MONOTONIC, &t1);
 	timespecsub(&t1, &profile.t0, &dt);
-	log_debug("profile-queue: %s %lld.%06ld", profile.name,
-	    (long long)dt.tv_sec * 1000000 + dt.tv_nsec / 1000000,
-	    dt.tv_nsec % 1000000);
-}
-#else
-#define profile_enter(x)	do {} while (0)
-#define profile_leave()		do {} while (0)
+
+	us = (uint64_t)dt.tv_sec * 1000000 + dt.tv_nsec / 1000;
+	for (b = 0; b < QPROF_BUCKETS - 1 && us >> b; b++)
+		;
+	qprof[profile.op].hist[b]++;
+
+#ifdef QUEUE_PROFILING
+	if (profiling & PROFILE_QUEUE)
+		log_debug("profile-queue: queue_%s %lld.%06ld",
+		    qprof[profile.op].name,
+		    (long long)dt.tv_sec * 1000000 + dt.tv_nsec / 1000000,
+		    dt.tv_nsec % 1000000);
 #endif
+}
+
+/*
+ * Iterate over the histogram buckets that changed since the last call,
+ * producing "queue.latency.<op>.<bound>us" keys with their counters.
+ */
+int
+queue_profile_next(size_t *iter, char *key, size_t len, size_t *count)
+{
+	struct qprof	*q;
+	size_t		 op, b;
+
+	for (; *iter < QOP_COUNT * QPROF_BUCKETS; (*iter)++) {
+		op = *iter / QPROF_BUCKETS;
+		b = *iter % QPROF_BUCKETS;
+		q = &qprof[op];
+		if (q->hist[b] == q->flushed[b])
+			continue;
+		q->flushed[b] = q->hist[b];
+		*count = q->hist[b];
+		if (b == QPROF_BUCKETS - 1)
+			(void)snprintf(key, len, "queue.latency.%s.inf",
+			    q->name);
+		else
+			(void)snprintf(key, len, "queue.latency.%s.%zuus",
+			    q->name, (size_t)1 << b);
+		(*iter)++;
+		return (1);
+	}
+	return (0);
+}
 
 static int
 queue_message_path(uint32_t msgid, char *buf, size_t len)
@@ -120,11 +293,10 @@ queue_init(const char *name, int server)
 	if (pwq == NULL)
 		errx(1, "unknown user %s", SMTPD_USER);
 
-	tree_init(&evpcache_tree);
-	TAILQ_INIT(&evpcache_list);
-
 	if (!strcmp(name, "fs"))
 		backend = &queue_backend_fs;
+	if (!strcmp(name, "journal"))
+		backend = &queue_backend_journal;
 	if (!strcmp(name, "null"))
 		backend = &queue_backend_null;
 	if (!strcmp(name, "proc"))
@@ -149,8 +321,12 @@ queue_init(const char *name, int server)
 
 		if (ckdir(PATH_SPOOL PATH_TEMPORARY, 0700, pwq->pw_uid, 0, 1) == 0)
 			errx(1, "error in purge directory setup");
+		if (ckdir(PATH_SPOOL PATH_SNAPSHOT, 0700, pwq->pw_uid, 0, 1) == 0)
+			errx(1, "error in snapshot directory setup");
 	}
 
+	tree_init(&decoded);
+
 	r = backend->init(pwq, server);
 
 	log_trace(TRACE_QUEUE, "queue-backend: queue_init(%d) -> %d", server, r);
@@ -163,7 +339,7 @@ queue_message_create(uint32_t *msgid)
 {
 	int	r;
 
-	profile_enter("queue_message_create");
+	profile_enter(QOP_MESSAGE_CREATE);
 	r = handler_message_create(msgid);
 	profile_leave();
 
@@ -177,10 +353,14 @@ queue_message_create(uint32_t *msgid)
 int
 queue_message_delete(uint32_t msgid)
 {
-	char	msgpath[MAXPATHLEN];
-	int	r;
+	struct queue_decoded	*d;
+	char			 msgpath[MAXPATHLEN];
+	int			 r;
+
+	if ((d = tree_get(&decoded, msgid)))
+		queue_decoded_drop(d);
 
-	profile_enter("queue_message_delete");
+	profile_enter(QOP_MESSAGE_DELETE);
 	r = handler_message_delete(msgid);
 	profile_leave();
 
@@ -194,8 +374,13 @@ queue_message_delete(uint32_t msgid)
 	return (r);
 }
 
+/*
+ * Encode the content of a message and let the backend make it durable
+ * before it gets committed.  Nothing here depends on the state of the
+ * queue process, so it may run in a sync worker.
+ */
 int
-queue_message_commit(uint32_t msgid)
+queue_message_sync(uint32_t msgid)
 {
 	int	r;
 	char	msgpath[MAXPATHLEN];
@@ -203,8 +388,6 @@ queue_message_commit(uint32_t msgid)
 	FILE	*ifp = NULL;
 	FILE	*ofp = NULL;
 
-	profile_enter("queue_message_commit");
-
 	queue_message_path(msgid, msgpath, sizeof(msgpath));
 
 	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
@@ -251,14 +434,12 @@ queue_message_commit(uint32_t msgid)
 		}
 	}
 
-	r = handler_message_commit(msgid, msgpath);
-	profile_leave();
-
-	/* in case it's not done by the backend */
-	unlink(msgpath);
+	r = 1;
+	if (handler_message_sync)
+		r = handler_message_sync(msgid, msgpath);
 
 	log_trace(TRACE_QUEUE,
-	    "queue-backend: queue_message_commit(%08"PRIx32") -> %d",
+	    "queue-backend: queue_message_sync(%08"PRIx32") -> %d",
 	    msgid, r);
 
 	return (r);
@@ -271,12 +452,66 @@ err:
 	return 0;
 }
 
+/*
+ * Make durable what the queue_message_sync() and queue_message_commit()
+ * calls since the last flush left to sync, for a whole commit group at
+ * once.  It must come between the syncs and the commits of the group,
+ * and after the commits.
+ */
 int
-queue_message_corrupt(uint32_t msgid)
+queue_message_flush(void)
 {
 	int	r;
 
-	profile_enter("queue_message_corrupt");
+	if (handler_message_flush == NULL)
+		return (1);
+
+	r = handler_message_flush();
+
+	log_trace(TRACE_QUEUE, "queue-backend: queue_message_flush() -> %d", r);
+
+	return (r);
+}
+
+/* whether messages are made durable by queue_message_sync() */
+int
+queue_message_can_sync(void)
+{
+	return (handler_message_sync != NULL);
+}
+
+int
+queue_message_commit(uint32_t msgid)
+{
+	int	r;
+	char	msgpath[MAXPATHLEN];
+
+	profile_enter(QOP_MESSAGE_COMMIT);
+
+	queue_message_path(msgid, msgpath, sizeof(msgpath));
+	r = handler_message_commit(msgid, msgpath);
+	profile_leave();
+
+	/* in case it's not done by the backend */
+	unlink(msgpath);
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_message_commit(%08"PRIx32") -> %d",
+	    msgid, r);
+
+	return (r);
+}
+
+int
+queue_message_corrupt(uint32_t msgid)
+{
+	struct queue_decoded	*d;
+	int			 r;
+
+	if ((d = tree_get(&decoded, msgid)))
+		queue_decoded_drop(d);
+
+	profile_enter(QOP_MESSAGE_CORRUPT);
 	r = handler_message_corrupt(msgid);
 	profile_leave();
 
@@ -289,11 +524,19 @@ queue_message_corrupt(uint32_t msgid)
 int
 queue_message_fd_r(uint32_t msgid)
 {
+	char	path[SMTPD_MAXPATHLEN];
 	int	fdin = -1, fdout = -1, fd = -1;
 	FILE	*ifp = NULL;
 	FILE	*ofp = NULL;
 
-	profile_enter("queue_message_fd_r");
+	if ((env->sc_queue_flags & (QUEUE_ENCRYPTION | QUEUE_COMPRESSION)) &&
+	    (fd = queue_decoded_get(msgid)) != -1) {
+		log_trace(TRACE_QUEUE, "queue-backend: queue_message_fd_r"
+		    "(%08"PRIx32") -> %d (decoded)", msgid, fd);
+		return (fd);
+	}
+
+	profile_enter(QOP_MESSAGE_FD_R);
 	fdin = handler_message_fd_r(msgid);
 	profile_leave();
 
@@ -303,47 +546,315 @@ queue_message_fd_r(uint32_t msgid)
 	if (fdin == -1)
 		return (-1);
 
-	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
-		if ((fdout = mktmpfile()) == -1)
-			goto err;
-		if ((fd = dup(fdout)) == -1)
-			goto err;
-		if ((ifp = fdopen(fdin, "r")) == NULL)
-			goto err;
-		fdin = fd;
-		fd = -1;
-		if ((ofp = fdopen(fdout, "w+")) == NULL)
-			goto err;
+	if ((env->sc_queue_flags & (QUEUE_ENCRYPTION | QUEUE_COMPRESSION)) == 0)
+		return (fdin);
 
+	if ((fdout = queue_decoded_create(path, sizeof path)) == -1)
+		goto err;
+	if ((fd = dup(fdout)) == -1)
+		goto err;
+
+	if ((env->sc_queue_flags & QUEUE_ENCRYPTION) &&
+	    (env->sc_queue_flags & QUEUE_COMPRESSION)) {
+		close(fdout);
+		if (! queue_message_fd_pipeline(fdin, fd)) {
+			unlink(path);
+			return (-1);
+		}
+		queue_decoded_add(msgid, path, fd);
+		return (fd);
+	}
+
+	if ((ifp = fdopen(fdin, "r")) == NULL)
+		goto err;
+	fdin = -1;
+	if ((ofp = fdopen(fdout, "w+")) == NULL)
+		goto err;
+	fdout = -1;
+
+	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
 		if (! crypto_decrypt_file(ifp, ofp))
 			goto err;
+	}
+	else if (! uncompress_file(ifp, ofp))
+		goto err;
+
+	fclose(ifp);
+	ifp = NULL;
+	if (fclose(ofp) != 0) {
+		ofp = NULL;
+		goto err;
+	}
+	ofp = NULL;
 
+	lseek(fd, 0, SEEK_SET);
+	queue_decoded_add(msgid, path, fd);
+	return (fd);
+
+err:
+	if (fd != -1)
+		close(fd);
+	if (fdin != -1)
+		close(fdin);
+	if (fdout != -1)
+		close(fdout);
+	if (ifp)
 		fclose(ifp);
+	if (ofp)
 		fclose(ofp);
-		lseek(fdin, SEEK_SET, 0);
+	if (path[0])
+		unlink(path);
+	return -1;
+}
+
+/*
+ * Decrypt and uncompress in a single pass: a child decrypts the message
+ * into a pipe while we uncompress from it, so that only the cleartext
+ * hits the output file instead of an intermediate copy.  Both fds are
+ * consumed, the output is rewound on success.
+ */
+static int
+queue_message_fd_pipeline(int fdin, int fd)
+{
+	int	pipefd[2], fdout = -1, status;
+	FILE	*ifp = NULL;
+	FILE	*ofp = NULL;
+	pid_t	 pid;
+	int	 ret;
+
+	if (pipe(pipefd) == -1) {
+		log_warn("warn: queue-backend: pipe");
+		close(fdin);
+		close(fd);
+		return (0);
 	}
 
-	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
-		if ((fdout = mktmpfile()) == -1)
-			goto err;
-		if ((fd = dup(fdout)) == -1)
-			goto err;
-		if ((ifp = fdopen(fdin, "r")) == NULL)
-			goto err;
-		fdin = fd;
-		fd = -1;
-		if ((ofp = fdopen(fdout, "w+")) == NULL)
-			goto err;
+	if ((pid = fork()) == -1) {
+		log_warn("warn: queue-backend: fork");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		close(fdin);
+		close(fd);
+		return (0);
+	}
 
-		if (! uncompress_file(ifp, ofp))
+	if (pid == 0) {
+		close(pipefd[0]);
+		if ((ifp = fdopen(fdin, "r")) == NULL ||
+		    (ofp = fdopen(pipefd[1], "w")) == NULL)
+			_exit(1);
+		ret = crypto_decrypt_file(ifp, ofp);
+		if (fclose(ofp) != 0)
+			ret = 0;
+		_exit(ret ? 0 : 1);
+	}
+
+	close(pipefd[1]);
+	close(fdin);
+
+	if ((fdout = dup(fd)) == -1)
+		goto err;
+	if ((ifp = fdopen(pipefd[0], "r")) == NULL)
+		goto err;
+	pipefd[0] = -1;
+	if ((ofp = fdopen(fdout, "w+")) == NULL)
+		goto err;
+	fdout = -1;
+
+	ret = uncompress_file(ifp, ofp);
+	fclose(ifp);
+	ifp = NULL;
+	if (fclose(ofp) != 0)
+		ret = 0;
+	ofp = NULL;
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			log_warn("warn: queue-backend: waitpid");
 			goto err;
+		}
+	}
+	pid = -1;
+	if (! ret || ! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		goto err;
+
+	lseek(fd, 0, SEEK_SET);
+	return (1);
+
+err:
+	if (pipefd[0] != -1)
+		close(pipefd[0]);
+	if (ifp)
+		fclose(ifp);
+	if (ofp)
+		fclose(ofp);
+	if (fdout != -1)
+		close(fdout);
+	close(fd);
+	if (pid != -1) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	return (0);
+}
+
+/* a fresh open of the cached cleartext, or -1 */
+static int
+queue_decoded_get(uint32_t msgid)
+{
+	struct queue_decoded	*d;
+	time_t			 now;
+	int			 fd;
+
+	now = time(NULL);
+	queue_decoded_expire(now);
+
+	if ((d = tree_get(&decoded, msgid)) == NULL)
+		return (-1);
+	if ((fd = open(d->path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-backend: open: %s", d->path);
+		queue_decoded_drop(d);
+		return (-1);
+	}
+	d->lastuse = now;
+	TAILQ_REMOVE(&decoded_lru, d, entry);
+	TAILQ_INSERT_TAIL(&decoded_lru, d, entry);
+	stat_increment("queue.decoded.hit", 1);
+
+	return (fd);
+}
+
+/* like mktmpfile(), but the file stays linked so it can be reopened */
+static int
+queue_decoded_create(char *path, size_t len)
+{
+	mode_t	omode;
+	int	fd;
+
+	path[0] = '\0';
+	if (! bsnprintf(path, len, "%s/decoded.XXXXXXXXXX", PATH_TEMPORARY))
+		return (-1);
+
+	omode = umask(7077);
+	if ((fd = mkstemp(path)) == -1) {
+		log_warn("warn: queue-backend: mkstemp: %s", path);
+		path[0] = '\0';
+	}
+	umask(omode);
+
+	return (fd);
+}
+
+static void
+queue_decoded_add(uint32_t msgid, const char *path, int fd)
+{
+	struct queue_decoded	*d;
+	struct stat		 sb;
+	time_t			 now;
+
+	if (fstat(fd, &sb) == -1 || sb.st_size > QUEUE_DECODED_BUDGET) {
+		unlink(path);
+		return;
+	}
+
+	if ((d = tree_get(&decoded, msgid)))
+		queue_decoded_drop(d);
+
+	/* make room, least recently used first */
+	queue_decoded_expire(now = time(NULL));
+	while ((d = TAILQ_FIRST(&decoded_lru)) &&
+	    (tree_count(&decoded) >= QUEUE_DECODED_MAX ||
+	    decoded_used + sb.st_size > QUEUE_DECODED_BUDGET))
+		queue_decoded_drop(d);
+
+	d = xcalloc(1, sizeof *d, "queue_decoded_add");
+	d->msgid = msgid;
+	d->lastuse = now;
+	d->size = sb.st_size;
+	(void)strlcpy(d->path, path, sizeof d->path);
+	tree_xset(&decoded, msgid, d);
+	TAILQ_INSERT_TAIL(&decoded_lru, d, entry);
+	decoded_used += d->size;
+}
 
+static void
+queue_decoded_drop(struct queue_decoded *d)
+{
+	unlink(d->path);
+	tree_xpop(&decoded, d->msgid);
+	TAILQ_REMOVE(&decoded_lru, d, entry);
+	decoded_used -= d->size;
+	free(d);
+}
+
+/* drop the entries nobody asked for in a while */
+static void
+queue_decoded_expire(time_t now)
+{
+	struct queue_decoded	*d;
+
+	while ((d = TAILQ_FIRST(&decoded_lru)) &&
+	    d->lastuse + QUEUE_DECODED_TTL <= now)
+		queue_decoded_drop(d);
+}
+
+/* so that the cleartexts do not stay on disk while the queue is idle */
+void
+queue_message_expire_decoded(void)
+{
+	queue_decoded_expire(time(NULL));
+}
+
+/*
+ * Return an fd on a message holding at least its headers, which avoids
+ * decrypting all of it when nothing else is needed.  Any other setup
+ * falls back to the whole message.
+ */
+int
+queue_message_fd_r_head(uint32_t msgid)
+{
+	int	fdin = -1, fdout = -1, fd = -1;
+	FILE	*ifp = NULL;
+	FILE	*ofp = NULL;
+
+	if ((env->sc_queue_flags & QUEUE_ENCRYPTION) == 0 ||
+	    (env->sc_queue_flags & QUEUE_COMPRESSION))
+		return (queue_message_fd_r(msgid));
+
+	profile_enter(QOP_MESSAGE_FD_R);
+	fdin = handler_message_fd_r(msgid);
+	profile_leave();
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_message_fd_r_head(%08"PRIx32") -> %d",
+	    msgid, fdin);
+
+	if (fdin == -1)
+		return (-1);
+
+	if ((fdout = mktmpfile()) == -1)
+		goto err;
+	if ((fd = dup(fdout)) == -1)
+		goto err;
+	if ((ifp = fdopen(fdin, "r")) == NULL)
+		goto err;
+	fdin = -1;
+	if ((ofp = fdopen(fdout, "w+")) == NULL)
+		goto err;
+	fdout = -1;
+
+	/* messages written before chunked encryption are read in full */
+	if (! crypto_decrypt_file_headers(ifp, ofp)) {
 		fclose(ifp);
 		fclose(ofp);
-		lseek(fdin, SEEK_SET, 0);
+		close(fd);
+		return (queue_message_fd_r(msgid));
 	}
 
-	return (fdin);
+	fclose(ifp);
+	fclose(ofp);
+	lseek(fd, 0, SEEK_SET);
+	return (fd);
 
 err:
 	if (fd != -1)
@@ -356,7 +867,7 @@ err:
 		fclose(ifp);
 	if (ofp)
 		fclose(ofp);
-	return -1;
+	return (-1);
 }
 
 int
@@ -369,6 +880,17 @@ queue_message_fd_rw(uint32_t msgid)
 	return open(buf, O_RDWR | O_CREAT | O_EXCL, 0600);
 }
 
+/* a second, read-only, view of the incoming message for the filters */
+int
+queue_message_fd_ro(uint32_t msgid)
+{
+	char buf[SMTPD_MAXPATHLEN];
+
+	queue_message_path(msgid, buf, sizeof(buf));
+
+	return open(buf, O_RDONLY);
+}
+
 static int
 queue_envelope_dump_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 {
@@ -380,7 +902,10 @@ queue_envelope_dump_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	char	encbuf[sizeof(struct envelope)];
 
 	evp = evpbuf;
-	evplen = envelope_dump_buffer(ep, evpbuf, evpbufsize);
+	if (env->sc_queue_flags & QUEUE_BINARY)
+		evplen = envelope_dump_binary(ep, evpbuf, evpbufsize);
+	else
+		evplen = envelope_dump_buffer(ep, evpbuf, evpbufsize);
 	if (evplen == 0)
 		return (0);
 
@@ -437,47 +962,170 @@ queue_envelope_load_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	return (envelope_load_buffer(ep, evp, evplen));
 }
 
+#define	EVPCACHE_HASH(id)	(((id) ^ ((id) >> 32)) & evpcache_hashmask)
+
+static void
+queue_envelope_cache_init(void)
+{
+	size_t	i, hashsize;
+
+	evpcache_slots = env->sc_queue_evpcache_size /
+	    (sizeof(struct evpcache_entry) + EVPCACHE_ENTRY_AVG);
+	if (evpcache_slots == 0)
+		evpcache_slots = 1;
+	for (hashsize = 1; hashsize < evpcache_slots; hashsize <<= 1)
+		;
+	evpcache_hashmask = hashsize - 1;
+
+	evpcache_hash = xcalloc(hashsize, sizeof *evpcache_hash,
+	    "queue_envelope_cache_init");
+	evpcache_ring = xcalloc(evpcache_slots, sizeof *evpcache_ring,
+	    "queue_envelope_cache_init");
+	evpcache_free = xcalloc(evpcache_slots, sizeof *evpcache_free,
+	    "queue_envelope_cache_init");
+	for (i = 0; i < evpcache_slots; i++)
+		evpcache_free[i] = evpcache_slots - i - 1;
+	evpcache_nfree = evpcache_slots;
+
+	log_debug("debug: queue: envelope cache of %zu entries", evpcache_slots);
+}
+
+/*
+ * Drop the cache after sc_queue_evpcache_size changed, it is sized again
+ * on the next add.  A size of zero turns it off.
+ */
+void
+queue_envelope_cache_resize(void)
+{
+	size_t	i;
+
+	if (evpcache_hash) {
+		for (i = 0; i < evpcache_slots; i++)
+			if (evpcache_ring[i])
+				queue_envelope_cache_del(evpcache_ring[i]->id);
+		free(evpcache_hash);
+		free(evpcache_ring);
+		free(evpcache_free);
+		evpcache_hash = NULL;
+		evpcache_ring = NULL;
+		evpcache_free = NULL;
+		evpcache_hand = 0;
+	}
+
+	if (env->sc_queue_evpcache_size)
+		env->sc_queue_flags |= QUEUE_EVPCACHE;
+	else
+		env->sc_queue_flags &= ~QUEUE_EVPCACHE;
+}
+
+static int
+queue_envelope_cache_get(uint64_t evpid, struct envelope *ep)
+{
+	struct evpcache_entry	*c;
+
+	if (evpcache_hash == NULL)
+		return (0);
+
+	for (c = evpcache_hash[EVPCACHE_HASH(evpid)]; c; c = c->next)
+		if (c->id == evpid)
+			break;
+	if (c == NULL)
+		return (0);
+
+	if (! envelope_load_buffer(ep, c->evp, c->len)) {
+		queue_envelope_cache_del(evpid);
+		return (0);
+	}
+	ep->id = evpid;
+	c->ref = 1;
+	return (1);
+}
+
 static void
 queue_envelope_cache_add(struct envelope *e)
 {
-	struct envelope *cached;
+	struct evpcache_entry	*c, **h;
+	char			 evpbuf[sizeof(struct envelope)];
+	size_t			 evplen, size, slot;
+
+	if ((evplen = envelope_dump_binary(e, evpbuf, sizeof evpbuf)) == 0)
+		return;
+	size = sizeof(*c) + evplen;
+	if (size > env->sc_queue_evpcache_size)
+		return;
 
-	while (tree_count(&evpcache_tree) >= env->sc_queue_evpcache_size)
-		queue_envelope_cache_del(TAILQ_LAST(&evpcache_list, evplst)->id);
+	if (evpcache_hash == NULL)
+		queue_envelope_cache_init();
+
+	/* make room in the ring and in the memory budget */
+	while (evpcache_nfree == 0 ||
+	    evpcache_used + size > env->sc_queue_evpcache_size) {
+		c = evpcache_ring[evpcache_hand];
+		evpcache_hand = (evpcache_hand + 1) % evpcache_slots;
+		if (c == NULL)
+			continue;
+		if (c->ref) {
+			c->ref = 0;
+			continue;
+		}
+		queue_envelope_cache_del(c->id);
+		stat_increment("queue.evpcache.evicted", 1);
+	}
 
-	cached = xcalloc(1, sizeof *cached, "queue_envelope_cache_add");
-	*cached = *e;
-	TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
-	tree_xset(&evpcache_tree, e->id, cached);
+	slot = evpcache_free[--evpcache_nfree];
+	c = xmalloc(size, "queue_envelope_cache_add");
+	c->id = e->id;
+	c->slot = slot;
+	c->ref = 0;
+	c->len = evplen;
+	memmove(c->evp, evpbuf, evplen);
+	evpcache_ring[slot] = c;
+	evpcache_used += size;
+
+	h = &evpcache_hash[EVPCACHE_HASH(e->id)];
+	c->next = *h;
+	*h = c;
 	stat_increment("queue.evpcache.size", 1);
 }
 
 static void
 queue_envelope_cache_update(struct envelope *e)
 {
-	struct envelope *cached;
+	struct evpcache_entry	*c = NULL;
 
-	if ((cached = tree_get(&evpcache_tree, e->id)) == NULL) {
-		queue_envelope_cache_add(e);
+	if (evpcache_hash)
+		for (c = evpcache_hash[EVPCACHE_HASH(e->id)]; c; c = c->next)
+			if (c->id == e->id)
+				break;
+
+	if (c == NULL)
 		stat_increment("queue.evpcache.update.missed", 1);
-	} else {
-		TAILQ_REMOVE(&evpcache_list, cached, entry);
-		*cached = *e;
-		TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
+	else {
+		queue_envelope_cache_del(e->id);
 		stat_increment("queue.evpcache.update.hit", 1);
 	}
+	queue_envelope_cache_add(e);
 }
 
 static void
 queue_envelope_cache_del(uint64_t evpid)
 {
-	struct envelope *cached;
+	struct evpcache_entry	*c, **h;
+
+	if (evpcache_hash == NULL)
+		return;
 
-	if ((cached = tree_pop(&evpcache_tree, evpid)) == NULL)
+	for (h = &evpcache_hash[EVPCACHE_HASH(evpid)]; (c = *h); h = &c->next)
+		if (c->id == evpid)
+			break;
+	if (c == NULL)
 		return;
 
-	TAILQ_REMOVE(&evpcache_list, cached, entry);
-	free(cached);
+	*h = c->next;
+	evpcache_ring[c->slot] = NULL;
+	evpcache_free[evpcache_nfree++] = c->slot;
+	evpcache_used -= sizeof(*c) + c->len;
+	free(c);
 	stat_decrement("queue.evpcache.size", 1);
 }
 
@@ -498,7 +1146,7 @@ queue_envelope_create(struct envelope *ep)
 	evpid = ep->id;
 	msgid = evpid_to_msgid(evpid);
 
-	profile_enter("queue_envelope_create");
+	profile_enter(QOP_ENVELOPE_CREATE);
 	r = handler_envelope_create(msgid, evpbuf, evplen, &ep->id);
 	profile_leave();
 
@@ -525,7 +1173,7 @@ queue_envelope_delete(uint64_t evpid)
 	if (env->sc_queue_flags & QUEUE_EVPCACHE)
 		queue_envelope_cache_del(evpid);
 
-	profile_enter("queue_envelope_delete");
+	profile_enter(QOP_ENVELOPE_DELETE);
 	r = handler_envelope_delete(evpid);
 	profile_leave();
 
@@ -542,17 +1190,15 @@ queue_envelope_load(uint64_t evpid, struct envelope *ep)
 	const char	*e;
 	char		 evpbuf[sizeof(struct envelope)];
 	size_t		 evplen;
-	struct envelope	*cached;
 
 	if ((env->sc_queue_flags & QUEUE_EVPCACHE) &&
-	    (cached = tree_get(&evpcache_tree, evpid))) {
-		*ep = *cached;
+	    queue_envelope_cache_get(evpid, ep)) {
 		stat_increment("queue.evpcache.load.hit", 1);
 		return (1);
 	}
 
 	ep->id = evpid;
-	profile_enter("queue_envelope_load");
+	profile_enter(QOP_ENVELOPE_LOAD);
 	evplen = handler_envelope_load(ep->id, evpbuf, sizeof evpbuf);
 	profile_leave();
 
@@ -580,6 +1226,189 @@ queue_envelope_load(uint64_t evpid, struct envelope *ep)
 	return (0);
 }
 
+int
+queue_snapshot_supported(void)
+{
+	return (backend == &queue_backend_fs);
+}
+
+void
+queue_snapshot_load(void)
+{
+	struct snapshot_header	 hdr;
+	struct snapshot_entry	*e;
+	struct scheduler_info	 si;
+	FILE			*fp;
+	size_t			 n;
+
+	tree_init(&snapshot);
+
+	if (! queue_snapshot_supported())
+		return;
+
+	if ((fp = fopen(SNAPSHOT_FILE, "r")) == NULL) {
+		if (errno != ENOENT)
+			log_warn("warn: queue-backend: fopen: %s",
+			    SNAPSHOT_FILE);
+		return;
+	}
+
+	if (fread(&hdr, sizeof hdr, 1, fp) != 1 ||
+	    hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+		log_warnx("warn: queue-backend: ignoring invalid snapshot");
+		fclose(fp);
+		return;
+	}
+
+	for (n = 0; fread(&si, sizeof si, 1, fp) == 1; n++) {
+		e = xcalloc(1, sizeof *e, "queue_snapshot_load");
+		e->si = si;
+		tree_set(&snapshot, si.evpid, e);
+	}
+	if (ferror(fp)) {
+		log_warn("warn: queue-backend: fread: %s", SNAPSHOT_FILE);
+		queue_snapshot_clear();
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+
+	snapshot_gen = hdr.generation;
+	log_info("info: queue: loaded scheduler snapshot with %zu envelopes",
+	    n);
+}
+
+int
+queue_snapshot_covers(uint64_t evpid, const struct timespec *mtime)
+{
+	struct timespec	limit;
+
+	if (tree_get(&snapshot, evpid) == NULL)
+		return (0);
+
+	limit = snapshot_gen;
+	limit.tv_sec -= SNAPSHOT_MARGIN;
+	return (timespeccmp(mtime, &limit, <));
+}
+
+void
+queue_snapshot_mark(uint64_t evpid)
+{
+	struct snapshot_entry	*e;
+
+	if ((e = tree_get(&snapshot, evpid)))
+		e->seen = 1;
+}
+
+/*
+ * Return the next envelope of the snapshot that was found in the queue,
+ * in evpid order.
+ */
+int
+queue_snapshot_next(struct scheduler_info *si)
+{
+	struct snapshot_entry	*e;
+
+	while (tree_iter(&snapshot, &snapshot_iter, NULL, (void **)&e)) {
+		if (! e->seen)
+			continue;
+		*si = e->si;
+		return (1);
+	}
+
+	queue_snapshot_clear();
+	return (0);
+}
+
+static void
+queue_snapshot_clear(void)
+{
+	struct snapshot_entry	*e;
+
+	while (tree_poproot(&snapshot, NULL, (void **)&e))
+		free(e);
+	snapshot_iter = NULL;
+}
+
+int
+queue_snapshot_request(void)
+{
+	struct snapshot_header	hdr;
+	struct stat		sb;
+
+	if (snapshot_fp)
+		return (0);
+
+	/* a new file, so the filesystem stamps it now */
+	(void)unlink(SNAPSHOT_TMPFILE);
+	if ((snapshot_fp = fopen(SNAPSHOT_TMPFILE, "w")) == NULL) {
+		log_warn("warn: queue-backend: fopen: %s", SNAPSHOT_TMPFILE);
+		return (0);
+	}
+	if (fstat(fileno(snapshot_fp), &sb) == -1) {
+		log_warn("warn: queue-backend: fstat: %s", SNAPSHOT_TMPFILE);
+		fclose(snapshot_fp);
+		snapshot_fp = NULL;
+		unlink(SNAPSHOT_TMPFILE);
+		return (0);
+	}
+
+	/*
+	 * Envelopes written before this point have already been reported to
+	 * the scheduler, so the snapshot it returns covers them.
+	 */
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.generation = sb.st_mtim;
+	if (fwrite(&hdr, sizeof hdr, 1, snapshot_fp) != 1) {
+		log_warn("warn: queue-backend: fwrite: %s", SNAPSHOT_TMPFILE);
+		fclose(snapshot_fp);
+		snapshot_fp = NULL;
+		unlink(SNAPSHOT_TMPFILE);
+		return (0);
+	}
+
+	return (1);
+}
+
+void
+queue_snapshot_receive(const void *data, size_t len)
+{
+	if (snapshot_fp == NULL)
+		return;
+
+	if (len) {
+		if (len % sizeof(struct scheduler_info) ||
+		    fwrite(data, len, 1, snapshot_fp) != 1)
+			goto fail;
+		return;
+	}
+
+	/* end of snapshot */
+	if (fflush(snapshot_fp) != 0 || fsync(fileno(snapshot_fp)) == -1)
+		goto fail;
+	if (fclose(snapshot_fp) != 0) {
+		snapshot_fp = NULL;
+		goto fail;
+	}
+	snapshot_fp = NULL;
+	if (rename(SNAPSHOT_TMPFILE, SNAPSHOT_FILE) == -1) {
+		log_warn("warn: queue-backend: rename: %s", SNAPSHOT_FILE);
+		unlink(SNAPSHOT_TMPFILE);
+		return;
+	}
+	log_debug("debug: queue: scheduler snapshot written");
+	return;
+
+fail:
+	log_warn("warn: queue-backend: cannot write snapshot");
+	if (snapshot_fp)
+		fclose(snapshot_fp);
+	snapshot_fp = NULL;
+	unlink(SNAPSHOT_TMPFILE);
+}
+
 int
 queue_envelope_update(struct envelope *ep)
 {
@@ -591,7 +1420,7 @@ queue_envelope_update(struct envelope *ep)
 	if (evplen == 0)
 		return (0);
 
-	profile_enter("queue_envelope_update");
+	profile_enter(QOP_ENVELOPE_UPDATE);
 	r = handler_envelope_update(ep->id, evpbuf, evplen);
 	profile_leave();
 
@@ -613,7 +1442,7 @@ queue_envelope_walk(struct envelope *ep)
 	char		 evpbuf[sizeof(struct envelope)];
 	int		 r;
 
-	profile_enter("queue_envelope_walk");
+	profile_enter(QOP_ENVELOPE_WALK);
 	r = handler_envelope_walk(&evpid, evpbuf, sizeof evpbuf);
 	profile_leave();
 
@@ -700,6 +1529,18 @@ queue_api_on_message_commit(int(*cb)(uint32_t, const char *))
 	handler_message_commit = cb;
 }
 
+void
+queue_api_on_message_sync(int(*cb)(uint32_t, const char *))
+{
+	handler_message_sync = cb;
+}
+
+void
+queue_api_on_message_flush(int(*cb)(void))
+{
+	handler_message_flush = cb;
+}
+
 void
 queue_api_on_message_delete(int(*cb)(uint32_t))
 {
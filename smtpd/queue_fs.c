@@ -23,8 +23,10 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <sys/mount.h>
+#include <sys/wait.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <event.h>
@@ -33,13 +35,17 @@
 #include <imsg.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <poll.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <openssl/sha.h>
+
 #include "smtpd.h"
 #include "log.h"
 
@@ -48,14 +54,38 @@
 #define PATH_INCOMING		"/incoming"
 #define PATH_EVPTMP		PATH_INCOMING "/envelope.tmp"
 #define PATH_MESSAGE		"/message"
+#define PATH_BODIES		"/bodies"
 
 /* percentage of remaining space / inodes required to accept new messages */
 #define	MINSPACE		5
 #define	MININODES		5
 
+/* number of processes reading the queue in parallel at startup */
+#define	WALKERS			4
+
 struct qwalk {
 	FTS	*fts;
 	int	 depth;
+	int	 slot;
+	int	 nslots;
+	int	 cached;
+};
+
+/*
+ * Walkers send each envelope as a record header followed by its content.
+ * A record with a zero evpid marks the end of a message, so that all the
+ * envelopes of a message reach the scheduler before the next one starts.
+ * Envelopes covered by the scheduler snapshot are sent without content.
+ */
+struct qrecord {
+	uint64_t	evpid;
+	size_t		len;
+	int		cached;
+};
+
+struct qwalker {
+	pid_t	pid;
+	int	fd;
 };
 
 static int	fsqueue_check_space(void);
@@ -65,13 +95,34 @@ static int	fsqueue_envelope_dump(char *, const char *, size_t, int, int);
 static void	fsqueue_message_path(uint32_t, char *, size_t);
 static void	fsqueue_message_corrupt_path(uint32_t, char *, size_t);
 static void	fsqueue_message_incoming_path(uint32_t, char *, size_t);
+static int	fsqueue_message_sync(uint32_t);
+static void	fsqueue_dirty(const char *);
+static int	queue_fs_message_flush(void);
+static int	fsqueue_body_path(const char *, char *, size_t);
+static void	fsqueue_body_link(const char *);
+static void	fsqueue_body_unlink(const char *);
+static void	fsqueue_body_collect(void);
 static void    *fsqueue_qwalk_new(void);
 static int	fsqueue_qwalk(void *, uint64_t *);
 static void	fsqueue_qwalk_close(void *);
+static void	fsqueue_walkers_start(void);
+static void	fsqueue_walker_run(int, int, int);
+static int	fsqueue_walkers_read(uint64_t *, char *, size_t);
+static int	fsqueue_walkers_poll(void);
+static void	fsqueue_walker_close(int);
+static int	fsqueue_io(int, void *, size_t, int);
+static void	fsqueue_evpcount_incr(uint32_t);
 
 struct tree evpcount;
 static struct timespec startup;
 
+/* files and directories to fsync once for the current commit group */
+static struct dict	dirty;
+
+static struct qwalker	walkers[WALKERS];
+static int		nwalkers;
+static int		walker = -1;
+
 #define REF	(int*)0xf00
 
 static int
@@ -115,6 +166,24 @@ again:
 	return (1);
 }
 
+/*
+ * Incoming envelopes were not synced at creation: move the message
+ * content in the incoming directory and sync it all now.  This usually
+ * runs in a syncer, the commit only has the directory to rename.
+ */
+static int
+queue_fs_message_sync(uint32_t msgid, const char *path)
+{
+	char msgpath[SMTPD_MAXPATHLEN];
+
+	fsqueue_message_incoming_path(msgid, msgpath, sizeof(msgpath));
+	strlcat(msgpath, PATH_MESSAGE, sizeof(msgpath));
+	if (rename(path, msgpath) == -1)
+		return (0);
+
+	return (fsqueue_message_sync(msgid));
+}
+
 static int
 queue_fs_message_commit(uint32_t msgid, const char *path)
 {
@@ -122,20 +191,30 @@ queue_fs_message_commit(uint32_t msgid, const char *path)
 	char queuedir[SMTPD_MAXPATHLEN];
 	char msgdir[SMTPD_MAXPATHLEN];
 	char msgpath[SMTPD_MAXPATHLEN];
+	struct stat sb;
 
 	/* before-first, move the message content in the incoming directory */
 	fsqueue_message_incoming_path(msgid, msgpath, sizeof(msgpath));
 	strlcat(msgpath, PATH_MESSAGE, sizeof(msgpath));
-	if (rename(path, msgpath) == -1)
-		return (0);
+	if (rename(path, msgpath) == -1) {
+		/* unless queue_fs_message_sync() already did */
+		if (errno != ENOENT || stat(msgpath, &sb) == -1)
+			return (0);
+	}
+
+	if (env->sc_queue_flags & QUEUE_DEDUP)
+		fsqueue_body_link(msgpath);
 
 	fsqueue_message_incoming_path(msgid, incomingdir, sizeof(incomingdir));
 	fsqueue_message_path(msgid, msgdir, sizeof(msgdir));
 	strlcpy(queuedir, msgdir, sizeof(queuedir));
 
 	/* first attempt to rename */
-	if (rename(incomingdir, msgdir) == 0)
+	if (rename(incomingdir, msgdir) == 0) {
+		*strrchr(queuedir, '/') = '\0';
+		fsqueue_dirty(queuedir);
 		return 1;
+	}
 	if (errno == ENOSPC)
 		return 0;
 	if (errno != ENOENT) {
@@ -161,10 +240,40 @@ queue_fs_message_commit(uint32_t msgid, const char *path)
 		log_warn("warn: queue-fs: rename");
 		return 0;
 	}
+	fsqueue_dirty(queuedir);
+	fsqueue_dirty(PATH_QUEUE);
 
 	return 1;
 }
 
+/*
+ * Sync what the messages synced or committed since the last flush left
+ * dirty, each file or directory once however many messages touched it.
+ */
+static int
+queue_fs_message_flush(void)
+{
+	char	*path;
+	int	 fd, r = 1;
+
+	while (dict_poproot(&dirty, (void **)&path)) {
+		if ((fd = open(path, O_RDONLY)) == -1) {
+			log_warn("warn: queue-fs: open: %s", path);
+			r = 0;
+		}
+		else {
+			if (fsync(fd) == -1) {
+				log_warn("warn: queue-fs: fsync: %s", path);
+				r = 0;
+			}
+			close(fd);
+		}
+		free(path);
+	}
+
+	return (r);
+}
+
 static int
 queue_fs_message_fd_r(uint32_t msgid)
 {
@@ -192,7 +301,14 @@ queue_fs_message_delete(uint32_t msgid)
 	if (stat(path, &sb) == -1)
 		fsqueue_message_path(msgid, path, sizeof(path));
 
-	if (rmtree(path, 0) == -1)
+	/* even with deduplication off, bodies may be left from before */
+	if (strlcat(path, PATH_MESSAGE, sizeof(path)) < sizeof(path)) {
+		fsqueue_body_unlink(path);
+		*strrchr(path, '/') = '\0';
+	}
+
+	/* one rename now, the files are removed by the purge task */
+	if (mvpurge(path, PATH_PURGE) == -1 && rmtree(path, 0) == -1)
 		log_warn("warn: queue-fs: rmtree");
 
 	tree_pop(&evpcount, msgid);
@@ -237,7 +353,7 @@ queue_fs_envelope_create(uint32_t msgid, const char *buf, size_t len,
     uint64_t *evpid)
 {
 	char		path[SMTPD_MAXPATHLEN];
-	int		queued = 0, i, r = 0, *n;
+	int		queued = 0, i, r = 0, *n, do_sync;
 	struct stat	sb;
 
 	if (msgid == 0) {
@@ -249,6 +365,13 @@ queue_fs_envelope_create(uint32_t msgid, const char *buf, size_t len,
 	if (stat(path, &sb) == -1)
 		queued = 1;
 
+	/*
+	 * Incoming envelopes are synced together with the message when it
+	 * gets committed: until then they are invisible and discarded at
+	 * startup anyway.
+	 */
+	do_sync = queued;
+
 	for (i = 0; i < 20; i ++) {
 		*evpid = queue_generate_evpid(msgid);
 		if (queued)
@@ -257,7 +380,7 @@ queue_fs_envelope_create(uint32_t msgid, const char *buf, size_t len,
 			fsqueue_envelope_incoming_path(*evpid, path,
 			    sizeof(path));
 
-		r = fsqueue_envelope_dump(path, buf, len, 0, 1);
+		r = fsqueue_envelope_dump(path, buf, len, 0, do_sync);
 		if (r >= 0)
 			goto done;
 	}
@@ -343,27 +466,39 @@ static int
 queue_fs_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 {
 	static int	 done = 0;
+	static int	 started = 0;
 	static void	*hdl = NULL;
-	int		 r, *n;
-	uint32_t	 msgid;
+	int		 r;
 
 	if (done)
 		return (-1);
 
-	if (hdl == NULL)
-		hdl = fsqueue_qwalk_new();
+	if (! started) {
+		started = 1;
+		fsqueue_walkers_start();
+		if (nwalkers == 0)
+			hdl = fsqueue_qwalk_new();
+	}
 
-	if (fsqueue_qwalk(hdl, evpid)) {
+	if (nwalkers) {
+		r = fsqueue_walkers_read(evpid, buf, len);
+		if (r == -1)
+			done = 1;
+		else if (r)
+			fsqueue_evpcount_incr(evpid_to_msgid(*evpid));
+		return (r);
+	}
+
+	while (fsqueue_qwalk(hdl, evpid)) {
+		if (((struct qwalk *)hdl)->cached) {
+			queue_snapshot_mark(*evpid);
+			fsqueue_evpcount_incr(evpid_to_msgid(*evpid));
+			continue;
+		}
 		memset(buf, 0, len);
 		r = queue_fs_envelope_load(*evpid, buf, len);
-		if (r) {
-			msgid = evpid_to_msgid(*evpid);
-			n = tree_pop(&evpcount, msgid);
-			if (n == NULL)
-				n = REF;
-			n += 1;
-			tree_xset(&evpcount, msgid, n);
-		}
+		if (r)
+			fsqueue_evpcount_incr(evpid_to_msgid(*evpid));
 		return (r);
 	}
 
@@ -372,6 +507,211 @@ queue_fs_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 	return (-1);
 }
 
+static void
+fsqueue_evpcount_incr(uint32_t msgid)
+{
+	int	*n;
+
+	n = tree_pop(&evpcount, msgid);
+	if (n == NULL)
+		n = REF;
+	n += 1;
+	tree_xset(&evpcount, msgid, n);
+}
+
+static void
+fsqueue_walkers_start(void)
+{
+	int	sp[2], i;
+	pid_t	pid;
+
+	for (i = 0; i < WALKERS; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1) {
+			log_warn("warn: queue-fs: socketpair");
+			break;
+		}
+		if ((pid = fork()) == -1) {
+			log_warn("warn: queue-fs: fork");
+			close(sp[0]);
+			close(sp[1]);
+			break;
+		}
+		if (pid == 0) {
+			close(sp[0]);
+			while (i--)
+				close(walkers[i].fd);
+			fsqueue_walker_run(sp[1], nwalkers, WALKERS);
+			_exit(0);
+		}
+		close(sp[1]);
+		walkers[nwalkers].pid = pid;
+		walkers[nwalkers].fd = sp[0];
+		nwalkers++;
+	}
+
+	/* buckets are assigned statically, so it is all or nothing */
+	if (nwalkers && nwalkers != WALKERS) {
+		while (nwalkers)
+			fsqueue_walker_close(--nwalkers);
+		walker = -1;
+	}
+
+	if (nwalkers)
+		log_debug("debug: queue-fs: walking queue with %d processes",
+		    nwalkers);
+}
+
+static void
+fsqueue_walker_run(int fd, int slot, int nslots)
+{
+	struct qwalk	*q;
+	struct qrecord	 rec, eom;
+	uint64_t	 evpid;
+	uint32_t	 msgid = 0;
+	char		 buf[sizeof(struct envelope)];
+	int		 r;
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	memset(&eom, 0, sizeof eom);
+
+	q = fsqueue_qwalk_new();
+	q->slot = slot;
+	q->nslots = nslots;
+	while (fsqueue_qwalk(q, &evpid)) {
+		if (msgid && evpid_to_msgid(evpid) != msgid)
+			if (! fsqueue_io(fd, &eom, sizeof eom, 1))
+				_exit(1);
+		msgid = evpid_to_msgid(evpid);
+
+		rec.evpid = evpid;
+		rec.cached = q->cached;
+		if (q->cached)
+			r = 0;
+		else
+			r = queue_fs_envelope_load(evpid, buf, sizeof buf);
+		rec.len = r;
+		if (! fsqueue_io(fd, &rec, sizeof rec, 1) ||
+		    ! fsqueue_io(fd, buf, rec.len, 1))
+			_exit(1);
+	}
+	if (msgid && ! fsqueue_io(fd, &eom, sizeof eom, 1))
+		_exit(1);
+	fsqueue_qwalk_close(q);
+	close(fd);
+}
+
+static int
+fsqueue_walkers_read(uint64_t *evpid, char *buf, size_t len)
+{
+	struct qrecord	rec;
+
+	for (;;) {
+		if (walker == -1 && (walker = fsqueue_walkers_poll()) == -1)
+			return (-1);
+
+		if (! fsqueue_io(walkers[walker].fd, &rec, sizeof rec, 0)) {
+			fsqueue_walker_close(walker);
+			walker = -1;
+			continue;
+		}
+		if (rec.evpid == 0) {
+			walker = -1;
+			continue;
+		}
+		if (rec.cached) {
+			queue_snapshot_mark(rec.evpid);
+			fsqueue_evpcount_incr(evpid_to_msgid(rec.evpid));
+			continue;
+		}
+		if (rec.len >= len)
+			fatalx("queue-fs: walker sent an oversized envelope");
+		if (! fsqueue_io(walkers[walker].fd, buf, rec.len, 0))
+			fatalx("queue-fs: truncated record from walker");
+		buf[rec.len] = '\0';
+		*evpid = rec.evpid;
+		return (rec.len);
+	}
+}
+
+static int
+fsqueue_walkers_poll(void)
+{
+	static int	next = 0;
+	struct pollfd	pfd[WALKERS];
+	int		i, n, w;
+
+	for (;;) {
+		n = 0;
+		for (i = 0; i < nwalkers; i++) {
+			pfd[i].fd = walkers[i].fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+			if (walkers[i].fd != -1)
+				n++;
+		}
+		if (n == 0)
+			return (-1);
+
+		if (poll(pfd, nwalkers, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("queue-fs: poll");
+		}
+
+		for (i = 0; i < nwalkers; i++) {
+			w = (next + i) % nwalkers;
+			if (walkers[w].fd != -1 && pfd[w].revents) {
+				next = w + 1;
+				return (w);
+			}
+		}
+	}
+}
+
+static void
+fsqueue_walker_close(int i)
+{
+	int	status;
+
+	close(walkers[i].fd);
+	walkers[i].fd = -1;
+	while (waitpid(walkers[i].pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return;
+	if (! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		log_warnx("warn: queue-fs: walker %d exited abnormally", i);
+}
+
+/*
+ * Read or write exactly len bytes. A short read is only acceptable before
+ * the first byte, which signals the end of the walker's stream.
+ */
+static int
+fsqueue_io(int fd, void *buf, size_t len, int out)
+{
+	char	*p = buf;
+	ssize_t	 n;
+
+	while (len) {
+		if (out)
+			n = write(fd, p, len);
+		else
+			n = read(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return (0);
+		}
+		if (n == 0)
+			return (0);
+		p += n;
+		len -= n;
+	}
+	return (1);
+}
+
 static int
 fsqueue_check_space(void)
 {
@@ -527,6 +867,162 @@ fsqueue_message_incoming_path(uint32_t msgid, char *buf, size_t len)
 		fatalx("fsqueue_message_incoming_path: path does not fit buffer");
 }
 
+/* the files of an incoming message and its directory, for the flush */
+static int
+fsqueue_message_sync(uint32_t msgid)
+{
+	char		 rootdir[SMTPD_MAXPATHLEN];
+	char		 path[SMTPD_MAXPATHLEN];
+	DIR		*dir;
+	struct dirent	*dp;
+	int		 r = 0;
+
+	fsqueue_message_incoming_path(msgid, rootdir, sizeof(rootdir));
+	if ((dir = opendir(rootdir)) == NULL) {
+		log_warn("warn: queue-fs: opendir");
+		return (0);
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		if (! bsnprintf(path, sizeof(path), "%s/%s", rootdir,
+		    dp->d_name))
+			goto end;
+		fsqueue_dirty(path);
+	}
+
+	/* make the directory entries durable too */
+	fsqueue_dirty(rootdir);
+	r = 1;
+
+end:
+	closedir(dir);
+	return (r);
+}
+
+static void
+fsqueue_dirty(const char *path)
+{
+	if (! dict_check(&dirty, path))
+		dict_set(&dirty, path, xstrdup(path, "fsqueue_dirty"));
+}
+
+/*
+ * With deduplication, identical message files are stored once under
+ * PATH_BODIES, named after their SHA-256, and the message directories
+ * hold hard links to them: the link count is the reference count.  The
+ * queued file is hashed as stored, so encrypted messages, which never
+ * share a ciphertext, are not deduplicated.  Failing to deduplicate is
+ * not an error, the message keeps its own copy.
+ */
+static int
+fsqueue_body_path(const char *msgpath, char *buf, size_t len)
+{
+	SHA256_CTX	ctx;
+	unsigned char	md[SHA256_DIGEST_LENGTH];
+	char		hex[SHA256_DIGEST_LENGTH * 2 + 1];
+	char		data[16384];
+	ssize_t		n;
+	int		fd, i;
+
+	if ((fd = open(msgpath, O_RDONLY)) == -1)
+		return (0);
+	SHA256_Init(&ctx);
+	while ((n = read(fd, data, sizeof data)) > 0)
+		SHA256_Update(&ctx, data, n);
+	close(fd);
+	if (n == -1)
+		return (0);
+	SHA256_Final(md, &ctx);
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		snprintf(hex + i * 2, 3, "%02x", md[i]);
+
+	return (bsnprintf(buf, len, "%s/%.2s/%s", PATH_BODIES, hex, hex));
+}
+
+/* replace the message file by a link to its body, creating it if needed */
+static void
+fsqueue_body_link(const char *msgpath)
+{
+	char	bodypath[SMTPD_MAXPATHLEN];
+	char	tmppath[SMTPD_MAXPATHLEN];
+
+	if (! fsqueue_body_path(msgpath, bodypath, sizeof(bodypath)))
+		return;
+
+	if (link(msgpath, bodypath) == 0)
+		return;
+	if (errno == ENOENT) {
+		*strrchr(bodypath, '/') = '\0';
+		if (mkdir(bodypath, 0700) == -1 && errno != EEXIST)
+			return;
+		bodypath[strlen(bodypath)] = '/';
+		if (link(msgpath, bodypath) == 0)
+			return;
+	}
+	if (errno != EEXIST) {
+		log_warn("warn: queue-fs: link");
+		return;
+	}
+
+	if (! bsnprintf(tmppath, sizeof(tmppath), "%s.dedup", msgpath))
+		return;
+	if (link(bodypath, tmppath) == -1) {
+		log_warn("warn: queue-fs: link");
+		return;
+	}
+	if (rename(tmppath, msgpath) == -1) {
+		log_warn("warn: queue-fs: rename");
+		unlink(tmppath);
+		return;
+	}
+	stat_increment("queue.fs.dedup", 1);
+}
+
+/* about to remove the last message linked to a body, remove the body */
+static void
+fsqueue_body_unlink(const char *msgpath)
+{
+	char		bodypath[SMTPD_MAXPATHLEN];
+	struct stat	sb, bsb;
+
+	if (stat(msgpath, &sb) == -1 || sb.st_nlink != 2)
+		return;
+	if (! fsqueue_body_path(msgpath, bodypath, sizeof(bodypath)))
+		return;
+	if (stat(bodypath, &bsb) == -1 ||
+	    bsb.st_dev != sb.st_dev || bsb.st_ino != sb.st_ino)
+		return;
+	if (unlink(bodypath) == -1)
+		log_warn("warn: queue-fs: unlink");
+}
+
+/* at startup, remove the bodies no message links to anymore */
+static void
+fsqueue_body_collect(void)
+{
+	char		 path[SMTPD_MAXPATHLEN];
+	char * const	 path_argv[] = { path, NULL };
+	FTS		*fts;
+	FTSENT		*e;
+
+	strlcpy(path, PATH_SPOOL PATH_BODIES, sizeof(path));
+	if ((fts = fts_open(path_argv, FTS_PHYSICAL | FTS_NOCHDIR,
+	    NULL)) == NULL) {
+		log_warn("warn: queue-fs: fts_open: %s", path);
+		return;
+	}
+	while ((e = fts_read(fts)) != NULL) {
+		if (e->fts_info != FTS_F || e->fts_statp->st_nlink != 1)
+			continue;
+		if (unlink(e->fts_accpath) == -1)
+			log_warn("warn: queue-fs: unlink: %s", e->fts_path);
+	}
+	fts_close(fts);
+}
+
 static void *
 fsqueue_qwalk_new(void)
 {
@@ -572,6 +1068,13 @@ fsqueue_qwalk(void *hdl, uint64_t *evpid)
 				fts_set(q->fts, e, FTS_SKIP);
 				break;
 			}
+			if (q->depth == 2 && q->nslots &&
+			    strtoul(e->fts_name, NULL, 16) % q->nslots !=
+			    (unsigned long)q->slot) {
+				/* bucket belongs to another walker */
+				fts_set(q->fts, e, FTS_SKIP);
+				break;
+			}
 			if (q->depth == 3 && e->fts_namelen != 8) {
 				log_debug("debug: fsqueue: bogus directory %s",
 				    e->fts_path);
@@ -599,6 +1102,8 @@ fsqueue_qwalk(void *hdl, uint64_t *evpid)
 				    e->fts_path);
 				break;
 			}
+			q->cached = queue_snapshot_covers(*evpid,
+			    &e->fts_statp->st_mtim);
 			return (1);
 		default:
 			break;
@@ -612,7 +1117,8 @@ static int
 queue_fs_init(struct passwd *pw, int server)
 {
 	unsigned int	 n;
-	char		*paths[] = { PATH_QUEUE, PATH_CORRUPT, PATH_INCOMING };
+	char		*paths[] = { PATH_QUEUE, PATH_CORRUPT, PATH_INCOMING,
+			     PATH_BODIES };
 	char		 path[SMTPD_MAXPATHLEN];
 	int		 ret;
 	struct timeval	 tv;
@@ -632,14 +1138,20 @@ queue_fs_init(struct passwd *pw, int server)
 			ret = 0;
 	}
 
+	if (server && ret)
+		fsqueue_body_collect();
+
 	if (gettimeofday(&tv, NULL) == -1)
 		err(1, "gettimeofday");
 	TIMEVAL_TO_TIMESPEC(&tv, &startup);
 
 	tree_init(&evpcount);
+	dict_init(&dirty);
 
 	queue_api_on_message_create(queue_fs_message_create);
 	queue_api_on_message_commit(queue_fs_message_commit);
+	queue_api_on_message_sync(queue_fs_message_sync);
+	queue_api_on_message_flush(queue_fs_message_flush);
 	queue_api_on_message_delete(queue_fs_message_delete);
 	queue_api_on_message_fd_r(queue_fs_message_fd_r);
 	queue_api_on_message_corrupt(queue_fs_message_corrupt);
@@ -0,0 +1,923 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2014 Gilles Chehade <gilles@poolp.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Journal queue backend.
+ *
+ * Message contents are kept as plain files, but envelopes are appended to
+ * a set of journal segments instead of living in a file of their own.
+ * Every change to an envelope (creation, update, removal) is a new record
+ * at the end of the active segment, and an in-memory index maps each live
+ * envelope to its most recent record.  The index is rebuilt by replaying
+ * the segments in order the first time the queue is accessed.
+ *
+ * Envelopes of a message being received are kept in memory and only hit
+ * the journal, with a single sync, when the message is committed.
+ *
+ * To reclaim space, the oldest segment is compacted incrementally once
+ * most of its records are dead: its live envelopes are copied to the
+ * active segment and the file is removed.  Working on the oldest segment
+ * only guarantees that removal records it holds cannot shadow an older
+ * creation record, so they can safely be dropped.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define PATH_JOURNAL		"/journal"
+#define PATH_JMESSAGES		PATH_JOURNAL "/messages"
+#define PATH_JCORRUPT		PATH_JOURNAL "/corrupt"
+
+#define	JOURNAL_MAGIC		0x4a524e4c
+#define	JOURNAL_SEGMENT_MAX	(64 * 1024 * 1024)
+#define	JOURNAL_COMPACT_STEP	128
+
+enum {
+	JR_ENVELOPE = 1,	/* envelope created or updated */
+	JR_ENVELOPE_DELETE,
+	JR_MESSAGE_DELETE,
+};
+
+struct jrecord {
+	uint32_t	magic;
+	uint32_t	type;
+	uint64_t	id;
+	uint32_t	len;
+	uint32_t	crc;
+};
+
+#define	JRECSIZE(len)	((off_t)sizeof(struct jrecord) + (len))
+
+struct jsegment {
+	uint32_t	id;
+	int		fd;
+	off_t		size;
+	off_t		live;
+};
+
+struct jentry {
+	struct jsegment	*seg;
+	off_t		 off;
+	uint32_t	 len;
+};
+
+struct jpending {
+	char		*buf;
+	size_t		 len;
+};
+
+struct jmessage {
+	int		 committed;
+	size_t		 count;		/* envelopes in the index */
+	struct tree	 pending;	/* envelopes waiting for commit */
+};
+
+static int	journal_load(void);
+static int	journal_record_read(FILE *, struct jrecord *, char *, size_t);
+static int	journal_replay(struct jsegment *, int);
+static struct jsegment *journal_segment_open(uint32_t, int);
+static int	journal_rotate(void);
+static int	journal_append(int, uint64_t, const char *, size_t,
+    struct jentry *);
+static int	journal_sync(void);
+static void	journal_index(uint64_t, struct jsegment *, off_t, size_t);
+static void	journal_forget(uint64_t);
+static void	journal_forget_message(uint32_t);
+static void	journal_compact(void);
+static struct jmessage *journal_message(uint32_t, int);
+static void	journal_message_free(uint32_t);
+static void	journal_segment_path(uint32_t, char *, size_t);
+static void	journal_message_path(uint32_t, char *, size_t);
+
+static struct tree	 segments;	/* segment id -> jsegment */
+static struct tree	 jindex;	/* evpid -> jentry */
+static struct tree	 messages;	/* msgid -> jmessage */
+static struct jsegment	*active;
+static int		 loaded;
+static off_t		 compact_off;
+static uint64_t		 walk_next;
+
+static int
+queue_journal_message_create(uint32_t *msgid)
+{
+	char		path[SMTPD_MAXPATHLEN];
+	struct stat	sb;
+
+	if (! journal_load())
+		return (0);
+
+again:
+	*msgid = queue_generate_msgid();
+	if (tree_check(&messages, *msgid))
+		goto again;
+
+	journal_message_path(*msgid, path, sizeof(path));
+	if (stat(path, &sb) != -1)
+		goto again;
+	if (errno != ENOENT) {
+		*msgid = 0;
+		return (0);
+	}
+
+	journal_message(*msgid, 1);
+
+	return (1);
+}
+
+static int
+queue_journal_message_commit(uint32_t msgid, const char *path)
+{
+	char			 msgpath[SMTPD_MAXPATHLEN];
+	char			 bucket[SMTPD_MAXPATHLEN];
+	struct jmessage		*msg;
+	struct jpending		*p;
+	struct jentry		 e;
+	uint64_t		 evpid;
+
+	if ((msg = journal_message(msgid, 0)) == NULL) {
+		log_warnx("warn: queue-journal: msgid not found");
+		return (0);
+	}
+
+	journal_message_path(msgid, msgpath, sizeof(msgpath));
+	if (rename(path, msgpath) == -1) {
+		if (errno != ENOENT) {
+			log_warn("warn: queue-journal: rename");
+			return (0);
+		}
+		strlcpy(bucket, msgpath, sizeof(bucket));
+		*strrchr(bucket, '/') = '\0';
+		if (mkdir(bucket, 0700) == -1 && errno != EEXIST) {
+			log_warn("warn: queue-journal: mkdir");
+			return (0);
+		}
+		if (rename(path, msgpath) == -1) {
+			log_warn("warn: queue-journal: rename");
+			return (0);
+		}
+	}
+
+	while (tree_root(&msg->pending, &evpid, (void **)&p)) {
+		if (! journal_append(JR_ENVELOPE, evpid, p->buf, p->len, &e))
+			return (0);
+		journal_index(evpid, e.seg, e.off, e.len);
+		tree_xpop(&msg->pending, evpid);
+		free(p->buf);
+		free(p);
+	}
+	msg->committed = 1;
+
+	return (journal_sync());
+}
+
+static int
+queue_journal_message_delete(uint32_t msgid)
+{
+	char		 path[SMTPD_MAXPATHLEN];
+	struct jmessage	*msg;
+
+	if (! journal_load())
+		return (0);
+
+	if ((msg = journal_message(msgid, 0)) == NULL)
+		return (0);
+
+	if (msg->committed) {
+		if (! journal_append(JR_MESSAGE_DELETE, msgid, NULL, 0, NULL))
+			return (0);
+		journal_forget_message(msgid);
+	}
+
+	journal_message_path(msgid, path, sizeof(path));
+	if (unlink(path) == -1 && errno != ENOENT)
+		log_warn("warn: queue-journal: unlink");
+
+	journal_message_free(msgid);
+
+	return (1);
+}
+
+static int
+queue_journal_message_fd_r(uint32_t msgid)
+{
+	char	path[SMTPD_MAXPATHLEN];
+	int	fd;
+
+	journal_message_path(msgid, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-journal: open");
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+queue_journal_message_corrupt(uint32_t msgid)
+{
+	char		path[SMTPD_MAXPATHLEN];
+	char		corrupt[SMTPD_MAXPATHLEN];
+
+	if (! journal_load())
+		return (0);
+
+	journal_message_path(msgid, path, sizeof(path));
+	if (! bsnprintf(corrupt, sizeof(corrupt), "%s/%08"PRIx32".%lld",
+	    PATH_JCORRUPT, msgid, (long long)time(NULL)))
+		return (0);
+	if (rename(path, corrupt) == -1 && errno != ENOENT) {
+		log_warn("warn: queue-journal: rename");
+		return (0);
+	}
+
+	if (! journal_append(JR_MESSAGE_DELETE, msgid, NULL, 0, NULL))
+		return (0);
+	journal_forget_message(msgid);
+	journal_message_free(msgid);
+
+	return (1);
+}
+
+static int
+queue_journal_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	struct jmessage	*msg;
+	struct jpending	*p;
+	struct jentry	 e;
+
+	if (! journal_load())
+		return (0);
+
+	if ((msg = journal_message(msgid, 0)) == NULL) {
+		log_warnx("warn: queue-journal: msgid=%08"PRIx32" not found",
+		    msgid);
+		return (0);
+	}
+
+	do {
+		*evpid = queue_generate_evpid(msgid);
+	} while (tree_check(&jindex, *evpid) ||
+	    tree_check(&msg->pending, *evpid));
+
+	if (msg->committed) {
+		if (! journal_append(JR_ENVELOPE, *evpid, buf, len, &e))
+			return (0);
+		if (! journal_sync())
+			return (0);
+		journal_index(*evpid, e.seg, e.off, e.len);
+		return (1);
+	}
+
+	p = xcalloc(1, sizeof *p, "queue_journal_envelope_create");
+	p->buf = xmemdup(buf, len, "queue_journal_envelope_create");
+	p->len = len;
+	tree_xset(&msg->pending, *evpid, p);
+
+	return (1);
+}
+
+static int
+queue_journal_envelope_delete(uint64_t evpid)
+{
+	struct jmessage	*msg;
+	struct jpending	*p;
+	uint32_t	 msgid;
+
+	if (! journal_load())
+		return (0);
+
+	msgid = evpid_to_msgid(evpid);
+	if ((msg = journal_message(msgid, 0)) == NULL)
+		return (1);
+
+	if ((p = tree_pop(&msg->pending, evpid))) {
+		free(p->buf);
+		free(p);
+		return (1);
+	}
+
+	if (! tree_check(&jindex, evpid))
+		return (1);
+
+	if (! journal_append(JR_ENVELOPE_DELETE, evpid, NULL, 0, NULL))
+		return (0);
+	journal_forget(evpid);
+	journal_compact();
+
+	return (1);
+}
+
+static int
+queue_journal_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	struct jentry	e;
+
+	if (! journal_load())
+		return (0);
+
+	if (! tree_check(&jindex, evpid)) {
+		log_warnx("warn: queue-journal: evpid=%016"PRIx64" not found",
+		    evpid);
+		return (0);
+	}
+
+	if (! journal_append(JR_ENVELOPE, evpid, buf, len, &e))
+		return (0);
+	if (! journal_sync())
+		return (0);
+	journal_index(evpid, e.seg, e.off, e.len);
+	journal_compact();
+
+	return (1);
+}
+
+static int
+queue_journal_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct jmessage	*msg;
+	struct jpending	*p;
+	struct jentry	*e;
+	ssize_t		 n;
+
+	if (! journal_load())
+		return (0);
+
+	if ((e = tree_get(&jindex, evpid)) == NULL) {
+		msg = journal_message(evpid_to_msgid(evpid), 0);
+		if (msg == NULL ||
+		    (p = tree_get(&msg->pending, evpid)) == NULL)
+			return (0);
+		if (p->len >= len) {
+			log_warnx("warn: queue-journal: too large");
+			return (0);
+		}
+		memmove(buf, p->buf, p->len);
+		buf[p->len] = '\0';
+		return (p->len);
+	}
+
+	if (e->len >= len) {
+		log_warnx("warn: queue-journal: too large");
+		return (0);
+	}
+
+	n = pread(e->seg->fd, buf, e->len, e->off + sizeof(struct jrecord));
+	if (n == -1) {
+		log_warn("warn: queue-journal: pread");
+		return (0);
+	}
+	if ((size_t)n != e->len) {
+		log_warnx("warn: queue-journal: short read");
+		return (0);
+	}
+	buf[n] = '\0';
+
+	return (n);
+}
+
+static int
+queue_journal_envelope_walk(uint64_t *evpid, char *buf, size_t len)
+{
+	void	*iter = NULL;
+
+	if (! journal_load())
+		return (-1);
+
+	/*
+	 * The index may change between two calls, so always restart
+	 * from the next expected key rather than keeping an iterator.
+	 */
+	if (walk_next == UINT64_MAX ||
+	    ! tree_iterfrom(&jindex, &iter, walk_next, evpid, NULL))
+		return (-1);
+	walk_next = *evpid + 1;
+
+	return (queue_journal_envelope_load(*evpid, buf, len));
+}
+
+static int
+journal_load(void)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	struct jsegment	*seg;
+	void		*iter;
+	uint32_t	 id, last;
+	char		*ep;
+
+	if (loaded)
+		return (1);
+
+	if ((dir = opendir(PATH_JOURNAL)) == NULL) {
+		log_warn("warn: queue-journal: opendir");
+		return (0);
+	}
+	last = 0;
+	while ((dp = readdir(dir)) != NULL) {
+		if (strlen(dp->d_name) != 8 || !isxdigit((int)dp->d_name[0]))
+			continue;
+		errno = 0;
+		id = strtoul(dp->d_name, &ep, 16);
+		if (*ep != '\0' || errno || id == 0)
+			continue;
+		if ((seg = journal_segment_open(id, 0)) == NULL) {
+			closedir(dir);
+			return (0);
+		}
+		tree_xset(&segments, id, seg);
+		if (id > last)
+			last = id;
+	}
+	closedir(dir);
+
+	active = NULL;
+	iter = NULL;
+	while (tree_iter(&segments, &iter, NULL, (void **)&seg)) {
+		if (! journal_replay(seg, seg->id == last))
+			return (0);
+		active = seg;
+	}
+
+	if (active == NULL || active->size >= JOURNAL_SEGMENT_MAX)
+		if (! journal_rotate())
+			return (0);
+
+	log_debug("debug: queue-journal: %zu envelopes in %zu segments",
+	    tree_count(&jindex), tree_count(&segments));
+
+	loaded = 1;
+	return (1);
+}
+
+/*
+ * Read the record at the current position: 1 if valid, 0 at the end of
+ * the segment, -1 if it is damaged.
+ */
+static int
+journal_record_read(FILE *fp, struct jrecord *rec, char *buf, size_t len)
+{
+	size_t	n;
+
+	if ((n = fread(rec, 1, sizeof *rec, fp)) == 0)
+		return (0);
+	if (n != sizeof *rec ||
+	    rec->magic != JOURNAL_MAGIC ||
+	    rec->len > len ||
+	    fread(buf, 1, rec->len, fp) != rec->len ||
+	    crc32(0, (Bytef *)buf, rec->len) != rec->crc)
+		return (-1);
+
+	return (1);
+}
+
+/*
+ * A damaged record in the active segment can only be a torn write at its
+ * tail, which is cut off.  Sealed segments were synced before the next
+ * one was created, so damage there is reported and the rest of the file
+ * is scanned for the following valid record: dropping it all would lose
+ * the removals it holds and bring the envelopes back.
+ */
+static int
+journal_replay(struct jsegment *seg, int last)
+{
+	char		 buf[sizeof(struct envelope)];
+	struct jrecord	 rec;
+	off_t		 off;
+	FILE		*fp;
+	int		 fd, r, damaged;
+
+	if ((fd = dup(seg->fd)) == -1) {
+		log_warn("warn: queue-journal: dup");
+		return (0);
+	}
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		log_warn("warn: queue-journal: fdopen");
+		close(fd);
+		return (0);
+	}
+	rewind(fp);
+
+	off = 0;
+	damaged = 0;
+	for (;;) {
+		if ((r = journal_record_read(fp, &rec, buf, sizeof buf)) == 0)
+			break;
+		if (r == -1 && last) {
+			/* torn write at the tail, discard it */
+			log_warnx("warn: queue-journal: segment %08"PRIx32
+			    " truncated at offset %lld", seg->id,
+			    (long long)off);
+			if (ftruncate(seg->fd, off) == -1) {
+				log_warn("warn: queue-journal: ftruncate");
+				fclose(fp);
+				return (0);
+			}
+			break;
+		}
+		if (r == -1) {
+			if (! damaged)
+				log_warnx("warn: queue-journal: sealed segment "
+				    "%08"PRIx32" damaged at offset %lld, "
+				    "scanning for the next record", seg->id,
+				    (long long)off);
+			damaged = 1;
+			off += 1;
+			if (fseeko(fp, off, SEEK_SET) == -1) {
+				log_warn("warn: queue-journal: fseeko");
+				fclose(fp);
+				return (0);
+			}
+			continue;
+		}
+		if (damaged) {
+			log_warnx("warn: queue-journal: segment %08"PRIx32
+			    " resumes at offset %lld", seg->id,
+			    (long long)off);
+			damaged = 0;
+		}
+
+		switch (rec.type) {
+		case JR_ENVELOPE:
+			journal_index(rec.id, seg, off, rec.len);
+			break;
+		case JR_ENVELOPE_DELETE:
+			journal_forget(rec.id);
+			break;
+		case JR_MESSAGE_DELETE:
+			journal_forget_message(rec.id);
+			journal_message_free(rec.id);
+			break;
+		default:
+			log_warnx("warn: queue-journal: bad record type %"PRIu32,
+			    rec.type);
+			break;
+		}
+		off += JRECSIZE(rec.len);
+		seg->size = off;
+	}
+	fclose(fp);
+
+	seg->size = off;
+	return (1);
+}
+
+static struct jsegment *
+journal_segment_open(uint32_t id, int create)
+{
+	char		 path[SMTPD_MAXPATHLEN];
+	struct jsegment	*seg;
+	int		 fd, flags;
+
+	journal_segment_path(id, path, sizeof(path));
+
+	flags = O_RDWR | O_APPEND;
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+	if ((fd = open(path, flags, 0600)) == -1) {
+		log_warn("warn: queue-journal: open: %s", path);
+		return (NULL);
+	}
+
+	seg = xcalloc(1, sizeof *seg, "journal_segment_open");
+	seg->id = id;
+	seg->fd = fd;
+
+	return (seg);
+}
+
+static int
+journal_rotate(void)
+{
+	struct jsegment	*seg;
+	uint32_t	 id;
+
+	id = active ? active->id + 1 : 1;
+	if (active && fsync(active->fd) == -1) {
+		log_warn("warn: queue-journal: fsync");
+		return (0);
+	}
+	if ((seg = journal_segment_open(id, 1)) == NULL)
+		return (0);
+	tree_xset(&segments, id, seg);
+	active = seg;
+
+	log_debug("debug: queue-journal: new segment %08"PRIx32, id);
+
+	return (1);
+}
+
+static int
+journal_append(int type, uint64_t id, const char *buf, size_t len,
+    struct jentry *e)
+{
+	struct jrecord	rec;
+	struct iovec	iov[2];
+	ssize_t		n;
+
+	if (active->size + JRECSIZE(len) > JOURNAL_SEGMENT_MAX)
+		if (! journal_rotate())
+			return (0);
+
+	memset(&rec, 0, sizeof rec);
+	rec.magic = JOURNAL_MAGIC;
+	rec.type = type;
+	rec.id = id;
+	rec.len = len;
+	rec.crc = crc32(0, (const Bytef *)buf, len);
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof rec;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
+	n = writev(active->fd, iov, buf ? 2 : 1);
+	if (n == -1 || (size_t)n != JRECSIZE(len)) {
+		if (n == -1)
+			log_warn("warn: queue-journal: writev");
+		else
+			log_warnx("warn: queue-journal: short write");
+		/* drop any partial record so that the next one is aligned */
+		if (ftruncate(active->fd, active->size) == -1)
+			fatal("queue-journal: ftruncate");
+		return (0);
+	}
+
+	if (e) {
+		e->seg = active;
+		e->off = active->size;
+		e->len = len;
+	}
+	active->size += n;
+
+	return (1);
+}
+
+static int
+journal_sync(void)
+{
+	if (fsync(active->fd) == -1) {
+		log_warn("warn: queue-journal: fsync");
+		return (0);
+	}
+	return (1);
+}
+
+static void
+journal_index(uint64_t evpid, struct jsegment *seg, off_t off, size_t len)
+{
+	struct jmessage	*msg;
+	struct jentry	*e;
+
+	if ((e = tree_get(&jindex, evpid))) {
+		e->seg->live -= JRECSIZE(e->len);
+	}
+	else {
+		e = xcalloc(1, sizeof *e, "journal_index");
+		tree_xset(&jindex, evpid, e);
+		msg = journal_message(evpid_to_msgid(evpid), 1);
+		msg->committed = 1;
+		msg->count++;
+		stat_increment("queue.journal.envelopes", 1);
+	}
+	e->seg = seg;
+	e->off = off;
+	e->len = len;
+	seg->live += JRECSIZE(len);
+}
+
+static void
+journal_forget(uint64_t evpid)
+{
+	char		 path[SMTPD_MAXPATHLEN];
+	struct jmessage	*msg;
+	struct jentry	*e;
+	uint32_t	 msgid;
+
+	if ((e = tree_pop(&jindex, evpid)) == NULL)
+		return;
+	e->seg->live -= JRECSIZE(e->len);
+	free(e);
+	stat_decrement("queue.journal.envelopes", 1);
+
+	msgid = evpid_to_msgid(evpid);
+	if ((msg = journal_message(msgid, 0)) == NULL)
+		return;
+	if (--msg->count == 0 && tree_empty(&msg->pending)) {
+		journal_message_path(msgid, path, sizeof(path));
+		if (unlink(path) == -1 && errno != ENOENT)
+			log_warn("warn: queue-journal: unlink");
+		journal_message_free(msgid);
+	}
+}
+
+static void
+journal_forget_message(uint32_t msgid)
+{
+	void		*iter;
+	uint64_t	 evpid;
+
+	for (;;) {
+		iter = NULL;
+		if (! tree_iterfrom(&jindex, &iter, (uint64_t)msgid << 32,
+		    &evpid, NULL))
+			break;
+		if (evpid_to_msgid(evpid) != msgid)
+			break;
+		journal_forget(evpid);
+	}
+}
+
+/*
+ * Move forward in the oldest segment, copying the live envelopes it
+ * still holds to the active segment, and drop it when done.
+ */
+static void
+journal_compact(void)
+{
+	char		 buf[sizeof(struct envelope)];
+	struct jsegment	*oldest;
+	struct jrecord	 rec;
+	struct jentry	*e, n;
+	char		 path[SMTPD_MAXPATHLEN];
+	void		*iter = NULL;
+	uint32_t	 id;
+	int		 i;
+
+	if (! tree_iter(&segments, &iter, NULL, (void **)&oldest))
+		return;
+	if (oldest == active)
+		return;
+
+	/* only start once most of the segment is dead */
+	if (compact_off == 0 && oldest->live * 2 > oldest->size)
+		return;
+
+	for (i = 0; i < JOURNAL_COMPACT_STEP && compact_off < oldest->size;
+	     i++) {
+		if (pread(oldest->fd, &rec, sizeof rec, compact_off) !=
+		    (ssize_t)sizeof rec || rec.len > sizeof buf) {
+			log_warnx("warn: queue-journal: compaction failed");
+			return;
+		}
+		if (rec.type == JR_ENVELOPE &&
+		    (e = tree_get(&jindex, rec.id)) &&
+		    e->seg == oldest && e->off == compact_off) {
+			if (pread(oldest->fd, buf, rec.len,
+			    compact_off + sizeof rec) != (ssize_t)rec.len) {
+				log_warnx("warn: queue-journal: compaction failed");
+				return;
+			}
+			if (! journal_append(JR_ENVELOPE, rec.id, buf, rec.len,
+			    &n))
+				return;
+			journal_index(rec.id, n.seg, n.off, n.len);
+		}
+		compact_off += JRECSIZE(rec.len);
+	}
+
+	if (compact_off < oldest->size)
+		return;
+
+	/* copies must be on disk before the originals go away */
+	if (! journal_sync())
+		return;
+
+	id = oldest->id;
+	journal_segment_path(id, path, sizeof(path));
+	if (unlink(path) == -1) {
+		log_warn("warn: queue-journal: unlink");
+		return;
+	}
+	close(oldest->fd);
+	tree_xpop(&segments, id);
+	free(oldest);
+	compact_off = 0;
+
+	log_debug("debug: queue-journal: segment %08"PRIx32" compacted", id);
+	stat_increment("queue.journal.compaction", 1);
+}
+
+static struct jmessage *
+journal_message(uint32_t msgid, int create)
+{
+	struct jmessage	*msg;
+
+	if ((msg = tree_get(&messages, msgid)) || !create)
+		return (msg);
+
+	msg = xcalloc(1, sizeof *msg, "journal_message");
+	tree_init(&msg->pending);
+	tree_xset(&messages, msgid, msg);
+
+	return (msg);
+}
+
+static void
+journal_message_free(uint32_t msgid)
+{
+	struct jmessage	*msg;
+	struct jpending	*p;
+
+	if ((msg = tree_pop(&messages, msgid)) == NULL)
+		return;
+	while (tree_poproot(&msg->pending, NULL, (void **)&p)) {
+		free(p->buf);
+		free(p);
+	}
+	free(msg);
+}
+
+static void
+journal_segment_path(uint32_t id, char *buf, size_t len)
+{
+	if (! bsnprintf(buf, len, "%s/%08"PRIx32, PATH_JOURNAL, id))
+		fatalx("journal_segment_path: path does not fit buffer");
+}
+
+static void
+journal_message_path(uint32_t msgid, char *buf, size_t len)
+{
+	if (! bsnprintf(buf, len, "%s/%02x/%08"PRIx32,
+		PATH_JMESSAGES,
+		(msgid & 0xff000000) >> 24,
+		msgid))
+		fatalx("journal_message_path: path does not fit buffer");
+}
+
+static int
+queue_journal_init(struct passwd *pw, int server)
+{
+	unsigned int	 n;
+	char		*paths[] = { PATH_JOURNAL, PATH_JMESSAGES, PATH_JCORRUPT };
+	char		 path[SMTPD_MAXPATHLEN];
+	int		 ret;
+
+	ret = 1;
+	for (n = 0; n < nitems(paths); n++) {
+		strlcpy(path, PATH_SPOOL, sizeof(path));
+		if (strlcat(path, paths[n], sizeof(path)) >= sizeof(path))
+			errx(1, "path too long %s%s", PATH_SPOOL, paths[n]);
+		if (ckdir(path, 0700, pw->pw_uid, 0, server) == 0)
+			ret = 0;
+	}
+
+	tree_init(&segments);
+	tree_init(&jindex);
+	tree_init(&messages);
+
+	queue_api_on_message_create(queue_journal_message_create);
+	queue_api_on_message_commit(queue_journal_message_commit);
+	queue_api_on_message_delete(queue_journal_message_delete);
+	queue_api_on_message_fd_r(queue_journal_message_fd_r);
+	queue_api_on_message_corrupt(queue_journal_message_corrupt);
+	queue_api_on_envelope_create(queue_journal_envelope_create);
+	queue_api_on_envelope_delete(queue_journal_envelope_delete);
+	queue_api_on_envelope_update(queue_journal_envelope_update);
+	queue_api_on_envelope_load(queue_journal_envelope_load);
+	queue_api_on_envelope_walk(queue_journal_envelope_walk);
+
+	return (ret);
+}
+
+struct queue_backend	queue_backend_journal = {
+	queue_journal_init,
+};
@@ -40,18 +40,54 @@
 #include "smtpd.h"
 #include "log.h"
 
+/*
+ * Message contents live in an arena of QR_BLOCK_SIZE blocks, carved
+ * from slabs of QR_SLAB_BLOCKS and recycled through a free list, which
+ * holds at most sc_queue_ram_size bytes.  When a new message does not
+ * fit, the least recently used ones are spilled to files of PATH_RAMSPILL
+ * and read from there until they are deleted.  A message larger than the
+ * whole arena goes straight to disk.  Envelopes stay in memory.
+ */
+#define	PATH_RAMSPILL		"/ramspill"
+
+#define	QR_BLOCK_SIZE		(16 * 1024)
+#define	QR_SLAB_BLOCKS		64
+
+struct qr_block {
+	struct qr_block	*next;
+	char		 data[QR_BLOCK_SIZE];
+};
+
 struct qr_envelope {
 	char		*buf;
 	size_t		 len;
 };
 
 struct qr_message {
-	char		*buf;
-	size_t		 len;
-	struct tree	 envelopes;
+	TAILQ_ENTRY(qr_message)	 entry;
+	uint32_t		 msgid;
+	struct qr_block		*blocks;
+	size_t			 nblocks;
+	size_t			 len;
+	int			 resident;
+	int			 spilled;
+	struct tree		 envelopes;
 };
 
-static struct tree messages;
+static struct qr_block	*qr_block_alloc(void);
+static void		 qr_block_free(struct qr_block *);
+static int		 qr_reserve(size_t);
+static int		 qr_spill(struct qr_message *);
+static void		 qr_spill_path(uint32_t, char *, size_t);
+static void		 qr_message_free(struct qr_message *);
+
+static struct tree			messages;
+static TAILQ_HEAD(, qr_message)		resident =
+    TAILQ_HEAD_INITIALIZER(resident);
+static struct qr_block			*freeblocks;
+static size_t				 nfreeblocks;
+static size_t				 nblocks;
+static size_t				 maxblocks;
 
 static struct qr_message *
 get_message(uint32_t msgid)
@@ -65,6 +101,134 @@ get_message(uint32_t msgid)
 	return (msg);
 }
 
+static struct qr_block *
+qr_block_alloc(void)
+{
+	struct qr_block	*slab, *b;
+	size_t		 i;
+
+	if (freeblocks == NULL) {
+		if (nblocks + QR_SLAB_BLOCKS > maxblocks)
+			return (NULL);
+		slab = reallocarray(NULL, QR_SLAB_BLOCKS, sizeof(*slab));
+		if (slab == NULL) {
+			log_warn("warn: queue-ram: reallocarray");
+			return (NULL);
+		}
+		for (i = 0; i < QR_SLAB_BLOCKS; i++)
+			qr_block_free(&slab[i]);
+		nblocks += QR_SLAB_BLOCKS;
+		stat_increment("queue.ram.arena.size",
+		    QR_SLAB_BLOCKS * sizeof(*slab));
+	}
+
+	b = freeblocks;
+	freeblocks = b->next;
+	nfreeblocks--;
+	b->next = NULL;
+	return (b);
+}
+
+static void
+qr_block_free(struct qr_block *b)
+{
+	b->next = freeblocks;
+	freeblocks = b;
+	nfreeblocks++;
+}
+
+/* make sure n blocks can be allocated, spilling the coldest messages */
+static int
+qr_reserve(size_t n)
+{
+	struct qr_message	*msg;
+	size_t			 avail;
+
+	for (;;) {
+		avail = nfreeblocks;
+		avail += (maxblocks - nblocks) / QR_SLAB_BLOCKS * QR_SLAB_BLOCKS;
+		if (avail >= n)
+			return (1);
+		if ((msg = TAILQ_FIRST(&resident)) == NULL)
+			return (0);
+		if (! qr_spill(msg))
+			return (0);
+	}
+}
+
+static void
+qr_spill_path(uint32_t msgid, char *buf, size_t len)
+{
+	if (! bsnprintf(buf, len, "%s/%08"PRIx32, PATH_RAMSPILL, msgid))
+		fatalx("queue-ram: spill path does not fit buffer");
+}
+
+static int
+qr_spill(struct qr_message *msg)
+{
+	char		 path[SMTPD_MAXPATHLEN];
+	struct qr_block	*b;
+	size_t		 left, n;
+	FILE		*f;
+
+	qr_spill_path(msg->msgid, path, sizeof(path));
+	if ((f = fopen(path, "wb")) == NULL) {
+		log_warn("warn: queue-ram: fopen: %s", path);
+		return (0);
+	}
+	for (b = msg->blocks, left = msg->len; b && left; b = b->next) {
+		n = MIN(left, QR_BLOCK_SIZE);
+		if (fwrite(b->data, 1, n, f) != n)
+			break;
+		left -= n;
+	}
+	if (fclose(f) != 0 || left) {
+		log_warn("warn: queue-ram: spill");
+		unlink(path);
+		return (0);
+	}
+
+	while ((b = msg->blocks)) {
+		msg->blocks = b->next;
+		qr_block_free(b);
+	}
+	msg->nblocks = 0;
+	msg->spilled = 1;
+	msg->resident = 0;
+	TAILQ_REMOVE(&resident, msg, entry);
+	stat_decrement("queue.ram.message.size", msg->len);
+	stat_increment("queue.ram.spill", 1);
+	return (1);
+}
+
+static void
+qr_message_free(struct qr_message *msg)
+{
+	char			 path[SMTPD_MAXPATHLEN];
+	struct qr_block		*b;
+	struct qr_envelope	*evp;
+	uint64_t		 evpid;
+
+	while (tree_poproot(&msg->envelopes, &evpid, (void**)&evp)) {
+		stat_decrement("queue.ram.envelope.size", evp->len);
+		free(evp->buf);
+		free(evp);
+	}
+	if (msg->spilled) {
+		qr_spill_path(msg->msgid, path, sizeof(path));
+		unlink(path);
+	}
+	else if (msg->resident) {
+		while ((b = msg->blocks)) {
+			msg->blocks = b->next;
+			qr_block_free(b);
+		}
+		TAILQ_REMOVE(&resident, msg, entry);
+		stat_decrement("queue.ram.message.size", msg->len);
+	}
+	free(msg);
+}
+
 static int
 queue_ram_message_create(uint32_t *msgid)
 {
@@ -81,6 +245,7 @@ queue_ram_message_create(uint32_t *msgid)
 		*msgid = queue_generate_msgid();
 	} while (tree_check(&messages, *msgid));
 
+	msg->msgid = *msgid;
 	tree_xset(&messages, *msgid, msg);
 
 	return (1);
@@ -89,9 +254,11 @@ queue_ram_message_create(uint32_t *msgid)
 static int
 queue_ram_message_commit(uint32_t msgid, const char *path)
 {
+	char			 spillpath[SMTPD_MAXPATHLEN];
 	struct qr_message	*msg;
+	struct qr_block		*b, **tail;
 	struct stat		 sb;
-	size_t			 n;
+	size_t			 left, n;
 	FILE			*f;
 	int			 ret;
 
@@ -110,57 +277,84 @@ queue_ram_message_commit(uint32_t msgid, const char *path)
 		fclose(f);
 		return (0);
 	}
-
 	msg->len = sb.st_size;
-	msg->buf = malloc(msg->len);
-	if (msg->buf == NULL) {
-		log_warn("warn: queue-ram: malloc");
+	n = (msg->len + QR_BLOCK_SIZE - 1) / QR_BLOCK_SIZE;
+
+	/* too large for the arena, or nothing to spill: keep the file */
+	if (! qr_reserve(n)) {
 		fclose(f);
-		return (0);
+		qr_spill_path(msgid, spillpath, sizeof(spillpath));
+		if (rename(path, spillpath) == -1) {
+			log_warn("warn: queue-ram: rename");
+			msg->len = 0;
+			return (0);
+		}
+		msg->spilled = 1;
+		stat_increment("queue.ram.spill", 1);
+		return (1);
 	}
 
-	ret = 0;
-	n = fread(msg->buf, 1, msg->len, f);
-	if (ferror(f))
-		log_warn("warn: queue-ram: fread");
-	else if ((off_t)n != sb.st_size)
-		log_warnx("warn: queue-ram: bad read");
-	else {
-		ret = 1;
-		stat_increment("queue.ram.message.size", msg->len);
+	ret = 1;
+	tail = &msg->blocks;
+	for (left = msg->len; left; left -= n) {
+		if ((b = qr_block_alloc()) == NULL) {
+			log_warnx("warn: queue-ram: arena exhausted");
+			ret = 0;
+			break;
+		}
+		*tail = b;
+		tail = &b->next;
+		msg->nblocks++;
+
+		n = MIN(left, QR_BLOCK_SIZE);
+		if (fread(b->data, 1, n, f) != n) {
+			if (ferror(f))
+				log_warn("warn: queue-ram: fread");
+			else
+				log_warnx("warn: queue-ram: bad read");
+			ret = 0;
+			break;
+		}
 	}
 	fclose(f);
 
-	return (ret);
+	if (ret == 0) {
+		while ((b = msg->blocks)) {
+			msg->blocks = b->next;
+			qr_block_free(b);
+		}
+		msg->nblocks = 0;
+		msg->len = 0;
+		return (0);
+	}
+
+	TAILQ_INSERT_TAIL(&resident, msg, entry);
+	msg->resident = 1;
+	stat_increment("queue.ram.message.size", msg->len);
+
+	return (1);
 }
 
 static int
 queue_ram_message_delete(uint32_t msgid)
 {
 	struct qr_message	*msg;
-	struct qr_envelope	*evp;
-	uint64_t		 evpid;
 
 	if ((msg = tree_pop(&messages, msgid)) == NULL) {
 		log_warnx("warn: queue-ram: not found");
 		return (0);
 	}
-	while (tree_poproot(&messages, &evpid, (void**)&evp)) {
-		stat_decrement("queue.ram.envelope.size", evp->len);
-		free(evp->buf);
-		free(evp);
-	}
-	stat_decrement("queue.ram.message.size", msg->len);
-	free(msg->buf);
-	free(msg);
-	return (0);
+	qr_message_free(msg);
+	return (1);
 }
 
 static int
 queue_ram_message_fd_r(uint32_t msgid)
 {
+	char			 path[SMTPD_MAXPATHLEN];
 	struct qr_message	*msg;
-	size_t			 n;
+	struct qr_block		*b;
+	size_t			 left, n;
 	FILE			*f;
 	int			 fd, fd2;
 
@@ -169,6 +363,17 @@ queue_ram_message_fd_r(uint32_t msgid)
 		return (-1);
 	}
 
+	if (msg->spilled) {
+		qr_spill_path(msgid, path, sizeof(path));
+		if ((fd = open(path, O_RDONLY)) == -1)
+			log_warn("warn: queue-ram: open: %s", path);
+		return (fd);
+	}
+
+	/* still in use, keep it in memory */
+	TAILQ_REMOVE(&resident, msg, entry);
+	TAILQ_INSERT_TAIL(&resident, msg, entry);
+
 	fd = mktmpfile();
 	if (fd == -1) {
 		log_warn("warn: queue-ram: mktmpfile");
@@ -188,14 +393,17 @@ queue_ram_message_fd_r(uint32_t msgid)
 		close(fd2);
 		return (-1);
 	}
-	n = fwrite(msg->buf, 1, msg->len, f);
-	if (n != msg->len) {
+	for (b = msg->blocks, left = msg->len; b && left; b = b->next) {
+		n = MIN(left, QR_BLOCK_SIZE);
+		if (fwrite(b->data, 1, n, f) != n)
+			break;
+		left -= n;
+	}
+	if (fclose(f) != 0 || left) {
 		log_warn("warn: queue-ram: write");
 		close(fd);
-		fclose(f);
 		return (-1);
 	}
-	fclose(f);
 	lseek(fd, 0, SEEK_SET);
 	return (fd);
 }
@@ -255,9 +463,7 @@ queue_ram_envelope_delete(uint64_t evpid)
 	free(evp);
 	if (tree_empty(&msg->envelopes)) {
 		tree_xpop(&messages, evpid_to_msgid(evpid));
-		stat_decrement("queue.ram.message.size", msg->len);
-		free(msg->buf);
-		free(msg);
+		qr_message_free(msg);
 	}
 	return (1);
 }
@@ -283,10 +489,10 @@ queue_ram_envelope_update(uint64_t evpid, const char *buf, size_t len)
 	}
 	memmove(tmp, buf, len);
 	free(evp->buf);
-	evp->len = len;
-	evp->buf = tmp;
 	stat_decrement("queue.ram.envelope.size", evp->len);
 	stat_increment("queue.ram.envelope.size", len);
+	evp->len = len;
+	evp->buf = tmp;
 	return (1);
 }
 
@@ -320,7 +526,16 @@ queue_ram_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 static int
 queue_ram_init(struct passwd *pw, int server)
 {
+	/* nothing survives a restart */
+	if (server) {
+		mvpurge(PATH_SPOOL PATH_RAMSPILL, PATH_SPOOL PATH_PURGE);
+		if (ckdir(PATH_SPOOL PATH_RAMSPILL, 0700, pw->pw_uid, 0,
+		    1) == 0)
+			return (0);
+	}
+
 	tree_init(&messages);
+	maxblocks = env->sc_queue_ram_size / sizeof(struct qr_block);
 
 	queue_api_on_message_create(queue_ram_message_create);
 	queue_api_on_message_commit(queue_ram_message_commit);
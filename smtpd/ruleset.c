@@ -27,25 +27,105 @@
 #include <event.h>
 #include <imsg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "smtpd.h"
 #include "log.h"
 
 
+/*
+ * The ruleset is compiled once into buckets of rule indexes: rules
+ * requiring a tag, rules whose destination is a fixed list of domains,
+ * and the others.  A match only walks, in rule order, the rules from
+ * the envelope tag and domain buckets merged with the generic one.
+ * Table checks are numbered by (table, key) so that each is done once
+ * per match however many rules share it.
+ */
+
+enum ruleset_key {
+	RS_SOURCE,
+	RS_SENDER,
+	RS_RECIPIENT,
+	RS_DESTINATION,
+};
+
+struct ruleset_check {
+	struct table		*table;
+	enum ruleset_key	 key;
+	int			 ret;
+	uint64_t		 gen;
+};
+
+struct ruleset_rule {
+	struct rule		*rule;
+	int			 sources;
+	int			 senders;
+	int			 recipients;
+	int			 destination;
+};
+
+struct ruleset_bucket {
+	size_t			 count;
+	size_t			 size;
+	size_t			*rules;
+};
+
+extern struct table_backend table_backend_static;
+
 static int ruleset_check_source(struct table *,
     const struct sockaddr_storage *, int);
 static int ruleset_check_mailaddr(struct table *, const struct mailaddr *);
+static int ruleset_check(int, const struct envelope *);
+static int ruleset_check_id(struct table *, enum ruleset_key);
+static int ruleset_indexable(struct table *);
+static void ruleset_bucket_add(struct ruleset_bucket *, size_t);
+static struct ruleset_bucket *ruleset_bucket(struct dict *, const char *);
+
+static struct ruleset_rule	*rules;
+static size_t			 nrules;
+static struct ruleset_check	*checks;
+static size_t			 nchecks;
+static uint64_t			 generation;
+static struct ruleset_bucket	 generic;
+static struct dict		 bytag;
+static struct dict		 bydomain;
 
 struct rule *
 ruleset_match(const struct envelope *evp)
 {
 	const struct mailaddr		*maddr = &evp->dest;
-	const struct sockaddr_storage	*ss = &evp->ss;
+	struct ruleset_bucket		*b[3];
+	struct ruleset_bucket		 empty;
 	struct rule			*r;
+	char				 domain[SMTPD_MAXDOMAINPARTSIZE];
+	size_t				 pos[3], i, n;
 	int				 ret;
 
-	TAILQ_FOREACH(r, env->sc_rules, r_entry) {
+	memset(&empty, 0, sizeof empty);
+	b[0] = &generic;
+	if ((b[1] = dict_get(&bytag, evp->tag)) == NULL)
+		b[1] = &empty;
+	b[2] = NULL;
+	if (lowercase(domain, maddr->domain, sizeof domain))
+		b[2] = dict_get(&bydomain, domain);
+	if (b[2] == NULL)
+		b[2] = &empty;
+	memset(pos, 0, sizeof pos);
+	generation++;
+
+	for (;;) {
+		/* next rule in order from the three buckets */
+		n = nrules;
+		for (i = 0; i < 3; i++)
+			if (pos[i] < b[i]->count && b[i]->rules[pos[i]] < n)
+				n = b[i]->rules[pos[i]];
+		if (n == nrules)
+			break;
+		for (i = 0; i < 3; i++)
+			if (pos[i] < b[i]->count && b[i]->rules[pos[i]] == n)
+				pos[i]++;
+		r = rules[n].rule;
 
 		if (r->r_tag[0] != '\0') {
 			ret = strcmp(r->r_tag, evp->tag);
@@ -55,7 +135,7 @@ ruleset_match(const struct envelope *evp)
 				continue;
 		}
 
-		ret = ruleset_check_source(r->r_sources, ss, evp->flags);
+		ret = ruleset_check(rules[n].sources, evp);
 		if (ret == -1) {
 			errno = EAGAIN;
 			return (NULL);
@@ -64,7 +144,7 @@ ruleset_match(const struct envelope *evp)
 			continue;
 
 		if (r->r_senders) {
-			ret = ruleset_check_mailaddr(r->r_senders, &evp->sender);
+			ret = ruleset_check(rules[n].senders, evp);
 			if (ret == -1) {
 				errno = EAGAIN;
 				return (NULL);
@@ -74,7 +154,7 @@ ruleset_match(const struct envelope *evp)
 		}
 
 		if (r->r_recipients) {
-			ret = ruleset_check_mailaddr(r->r_recipients, &evp->dest);
+			ret = ruleset_check(rules[n].recipients, evp);
 			if (ret == -1) {
 				errno = EAGAIN;
 				return (NULL);
@@ -84,8 +164,7 @@ ruleset_match(const struct envelope *evp)
 		}
 
 		ret = r->r_destination == NULL ? 1 :
-		    table_lookup(r->r_destination, maddr->domain, K_DOMAIN,
-			NULL);
+		    ruleset_check(rules[n].destination, evp);
 		if (ret == -1) {
 			errno = EAGAIN;
 			return NULL;
@@ -112,6 +191,156 @@ matched:
 	return r;
 }
 
+static int
+ruleset_check(int id, const struct envelope *evp)
+{
+	struct ruleset_check	*c = &checks[id];
+
+	if (c->gen == generation)
+		return (c->ret);
+
+	switch (c->key) {
+	case RS_SOURCE:
+		c->ret = ruleset_check_source(c->table, &evp->ss, evp->flags);
+		break;
+	case RS_SENDER:
+		c->ret = ruleset_check_mailaddr(c->table, &evp->sender);
+		break;
+	case RS_RECIPIENT:
+		c->ret = ruleset_check_mailaddr(c->table, &evp->dest);
+		break;
+	case RS_DESTINATION:
+		c->ret = table_lookup(c->table, evp->dest.domain, K_DOMAIN,
+		    NULL);
+		break;
+	}
+	c->gen = generation;
+
+	return (c->ret);
+}
+
+void
+ruleset_compile(void)
+{
+	struct rule		*r;
+	struct ruleset_bucket	*b;
+	const char		*key;
+	char			 domain[SMTPD_MAXDOMAINPARTSIZE];
+	void			*iter;
+	size_t			 n;
+
+	dict_init(&bytag);
+	dict_init(&bydomain);
+
+	nrules = 0;
+	TAILQ_FOREACH(r, env->sc_rules, r_entry)
+		nrules++;
+	rules = xcalloc(nrules ? nrules : 1, sizeof *rules, "ruleset_compile");
+
+	n = 0;
+	TAILQ_FOREACH(r, env->sc_rules, r_entry) {
+		rules[n].rule = r;
+		rules[n].sources = ruleset_check_id(r->r_sources, RS_SOURCE);
+		rules[n].senders = ruleset_check_id(r->r_senders, RS_SENDER);
+		rules[n].recipients = ruleset_check_id(r->r_recipients,
+		    RS_RECIPIENT);
+		rules[n].destination = ruleset_check_id(r->r_destination,
+		    RS_DESTINATION);
+
+		if (r->r_tag[0] != '\0' && !r->r_nottag)
+			ruleset_bucket_add(ruleset_bucket(&bytag, r->r_tag), n);
+		else if (r->r_destination && !r->r_notdestination &&
+		    ruleset_indexable(r->r_destination)) {
+			iter = NULL;
+			while (dict_iter(&r->r_destination->t_dict, &iter, &key,
+			    NULL)) {
+				if (! lowercase(domain, key, sizeof domain))
+					continue;
+				b = ruleset_bucket(&bydomain, domain);
+				/* the same domain may be listed twice */
+				if (b->count == 0 || b->rules[b->count - 1] != n)
+					ruleset_bucket_add(b, n);
+			}
+		}
+		else
+			ruleset_bucket_add(&generic, n);
+		n++;
+	}
+
+	log_debug("debug: ruleset: %zu rules, %zu generic, %zu table checks",
+	    nrules, generic.count, nchecks);
+}
+
+/*
+ * An inline list of plain domains never changes and only matches these
+ * domains, ignoring case.
+ */
+static int
+ruleset_indexable(struct table *t)
+{
+	const char	*key;
+	void		*iter;
+
+	if (t->t_backend != &table_backend_static || t->t_config[0] != '\0')
+		return (0);
+
+	iter = NULL;
+	while (dict_iter(&t->t_dict, &iter, &key, NULL))
+		if (strchr(key, '*'))
+			return (0);
+	return (1);
+}
+
+static int
+ruleset_check_id(struct table *t, enum ruleset_key key)
+{
+	size_t	i;
+
+	if (t == NULL)
+		return (-1);
+
+	for (i = 0; i < nchecks; i++)
+		if (checks[i].table == t && checks[i].key == key)
+			return (i);
+
+	checks = reallocarray(checks, nchecks + 1, sizeof *checks);
+	if (checks == NULL)
+		fatal("ruleset_check_id: reallocarray");
+	checks[nchecks].table = t;
+	checks[nchecks].key = key;
+	checks[nchecks].ret = 0;
+	checks[nchecks].gen = 0;
+
+	return (nchecks++);
+}
+
+static struct ruleset_bucket *
+ruleset_bucket(struct dict *d, const char *key)
+{
+	struct ruleset_bucket	*b;
+
+	if ((b = dict_get(d, key)) == NULL) {
+		b = xcalloc(1, sizeof *b, "ruleset_bucket");
+		dict_set(d, key, b);
+	}
+	return (b);
+}
+
+static void
+ruleset_bucket_add(struct ruleset_bucket *b, size_t n)
+{
+	size_t	*tmp;
+
+	if (b->count == b->size) {
+		b->size = b->size ? b->size * 2 : 4;
+		tmp = reallocarray(b->rules, b->size, sizeof *b->rules);
+		if (tmp == NULL)
+			fatal("ruleset_bucket_add: reallocarray");
+		b->rules = tmp;
+	}
+	b->rules[b->count++] = n;
+}
+
 static int
 ruleset_check_source(struct table *table, const struct sockaddr_storage *ss,
     int evpflags)
@@ -28,20 +28,43 @@
 
 #include "smtpd.h"
 
+/*
+ * The jobs are kept in a binary heap ordered on their time, ties are
+ * broken by the order of scheduling so that jobs due at the same second
+ * still run first in, first out.  Each job knows its slot in the heap,
+ * and the jobs of an argument are chained in a tree indexed on it, so
+ * that cancelling or looking up a job does not walk the queue.
+ */
 struct job {
-	TAILQ_ENTRY(job)	 entry;
+	struct job		*next;	/* same arg */
+	size_t			 slot;
+	uint64_t		 seq;
 	time_t			 when;
 	void			(*cb)(struct runq *, void *);
 	void			*arg;
 };
 
 struct runq {
-	TAILQ_HEAD(, job)	 jobs;
+	struct job		**heap;
+	size_t			 count;
+	size_t			 size;
+	uint64_t		 seq;
+	struct tree		 args;
 	void			(*cb)(struct runq *, void *);
 	struct event		 ev;
 };
 
+#define	RUNQ_HEAP_MIN	64
+
+static void runq_reset(struct runq *);
 static void runq_timeout(int, short, void *);
+static int runq_before(struct job *, struct job *);
+static void runq_up(struct runq *, size_t);
+static void runq_down(struct runq *, size_t);
+static int runq_insert(struct runq *, struct job *);
+static void runq_remove(struct runq *, struct job *);
+static struct job *runq_find(struct runq *, void (*)(struct runq *, void *),
+    void *);
 
 static struct runq *active;
 
@@ -52,9 +75,9 @@ runq_reset(struct runq *runq)
 	struct job	*job;
 	time_t		 now;
 
-	job = TAILQ_FIRST(&runq->jobs);
-	if (job == NULL)
+	if (runq->count == 0)
 		return;
+	job = runq->heap[0];
 
 	now = time(NULL);
 	if (job->when <= now)
@@ -75,10 +98,11 @@ runq_timeout(int fd, short ev, void *arg)
 	active = runq;
 	now = time(NULL);
 
-	while((job = TAILQ_FIRST(&runq->jobs))) {
+	while (runq->count) {
+		job = runq->heap[0];
 		if (job->when > now)
 			break;
-		TAILQ_REMOVE(&runq->jobs, job, entry);
+		runq_remove(runq, job);
 		if (job->cb)
 			job->cb(runq, job->arg);
 		else
@@ -90,17 +114,134 @@ runq_timeout(int fd, short ev, void *arg)
 	runq_reset(runq);
 }
 
+static int
+runq_before(struct job *a, struct job *b)
+{
+	if (a->when != b->when)
+		return (a->when < b->when);
+	return (a->seq < b->seq);
+}
+
+static void
+runq_up(struct runq *runq, size_t slot)
+{
+	struct job	*job;
+	size_t		 parent;
+
+	job = runq->heap[slot];
+	while (slot) {
+		parent = (slot - 1) / 2;
+		if (! runq_before(job, runq->heap[parent]))
+			break;
+		runq->heap[slot] = runq->heap[parent];
+		runq->heap[slot]->slot = slot;
+		slot = parent;
+	}
+	runq->heap[slot] = job;
+	job->slot = slot;
+}
+
+static void
+runq_down(struct runq *runq, size_t slot)
+{
+	struct job	*job;
+	size_t		 child;
+
+	job = runq->heap[slot];
+	while ((child = 2 * slot + 1) < runq->count) {
+		if (child + 1 < runq->count &&
+		    runq_before(runq->heap[child + 1], runq->heap[child]))
+			child++;
+		if (! runq_before(runq->heap[child], job))
+			break;
+		runq->heap[slot] = runq->heap[child];
+		runq->heap[slot]->slot = slot;
+		slot = child;
+	}
+	runq->heap[slot] = job;
+	job->slot = slot;
+}
+
+static int
+runq_insert(struct runq *runq, struct job *job)
+{
+	struct job	**heap;
+	size_t		  size;
+
+	if (runq->count == runq->size) {
+		size = runq->size ? runq->size * 2 : RUNQ_HEAP_MIN;
+		heap = reallocarray(runq->heap, size, sizeof(*heap));
+		if (heap == NULL)
+			return (0);
+		runq->heap = heap;
+		runq->size = size;
+	}
+
+	job->seq = runq->seq++;
+	job->next = tree_get(&runq->args, (uintptr_t)job->arg);
+	tree_set(&runq->args, (uintptr_t)job->arg, job);
+
+	runq->heap[runq->count] = job;
+	job->slot = runq->count++;
+	runq_up(runq, job->slot);
+
+	return (1);
+}
+
+static void
+runq_remove(struct runq *runq, struct job *job)
+{
+	struct job	*last, **prev;
+	size_t		 slot;
+
+	slot = job->slot;
+	last = runq->heap[--runq->count];
+	if (last != job) {
+		runq->heap[slot] = last;
+		last->slot = slot;
+		runq_up(runq, slot);
+		runq_down(runq, last->slot);
+	}
+
+	prev = NULL;
+	last = tree_get(&runq->args, (uintptr_t)job->arg);
+	if (last == job) {
+		if (job->next)
+			tree_set(&runq->args, (uintptr_t)job->arg, job->next);
+		else
+			tree_pop(&runq->args, (uintptr_t)job->arg);
+		return;
+	}
+	for (prev = &last->next; *prev != job; prev = &(*prev)->next)
+		;
+	*prev = job->next;
+}
+
+/* the earliest job of the arg with that callback */
+static struct job *
+runq_find(struct runq *runq, void (*cb)(struct runq *, void *), void *arg)
+{
+	struct job	*job, *found;
+
+	found = NULL;
+	for (job = tree_get(&runq->args, (uintptr_t)arg); job; job = job->next)
+		if (job->cb == cb && (found == NULL || runq_before(job, found)))
+			found = job;
+
+	return (found);
+}
+
 int
 runq_init(struct runq **runqp, void (*cb)(struct runq *, void *))
 {
 	struct runq	*runq;
 
-	runq = malloc(sizeof(*runq));
+	runq = calloc(1, sizeof(*runq));
 	if (runq == NULL)
 		return (0);
 
 	runq->cb = cb;
-	TAILQ_INIT(&runq->jobs);
+	tree_init(&runq->args);
 	evtimer_set(&runq->ev, runq_timeout, runq);
 
 	*runqp = runq;
@@ -112,7 +253,7 @@ int
 runq_schedule(struct runq *runq, time_t when, void (*cb)(struct runq *, void *),
     void *arg)
 {
-	struct job	*job, *tmpjob;
+	struct job	*job;
 
 	job = malloc(sizeof(*job));
 	if (job == NULL)
@@ -122,16 +263,12 @@ runq_schedule(struct runq *runq, time_t when, void (*cb)(struct runq *, void *),
 	job->cb = cb;
 	job->when = when;
 
-	TAILQ_FOREACH(tmpjob, &runq->jobs, entry) {
-		if (tmpjob->when > job->when) {
-			TAILQ_INSERT_BEFORE(tmpjob, job, entry);
-			goto done;
-		}
+	if (! runq_insert(runq, job)) {
+		free(job);
+		return (0);
 	}
-	TAILQ_INSERT_TAIL(&runq->jobs, job, entry);
 
-    done:
-	if (runq != active && job == TAILQ_FIRST(&runq->jobs)) {
+	if (runq != active && job->slot == 0) {
 		evtimer_del(&runq->ev);
 		runq_reset(runq);
 	}
@@ -148,22 +285,21 @@ runq_delay(struct runq *runq, unsigned int delay,
 int
 runq_cancel(struct runq *runq, void (*cb)(struct runq *, void *), void *arg)
 {
-	struct job	*job, *first;
-
-	first = TAILQ_FIRST(&runq->jobs);
-	TAILQ_FOREACH(job, &runq->jobs, entry) {
-		if (job->cb == cb && job->arg == arg) {
-			TAILQ_REMOVE(&runq->jobs, job, entry);
-			free(job);
-			if (runq != active && job == first) {
-				evtimer_del(&runq->ev);
-				runq_reset(runq);
-			}
-			return (1);
-		}
+	struct job	*job;
+	int		 first;
+
+	if ((job = runq_find(runq, cb, arg)) == NULL)
+		return (0);
+
+	first = (job->slot == 0);
+	runq_remove(runq, job);
+	free(job);
+	if (runq != active && first) {
+		evtimer_del(&runq->ev);
+		runq_reset(runq);
 	}
 
-	return (0);
+	return (1);
 }
 
 int
@@ -172,15 +308,12 @@ runq_pending(struct runq *runq, void (*cb)(struct runq *, void *), void *arg,
 {
 	struct job	*job;
 
-	TAILQ_FOREACH(job, &runq->jobs, entry) {
-		if (job->cb == cb && job->arg == arg) {
-			if (when)
-				*when = job->when;
-			return (1);
-		}
-	}
+	if ((job = runq_find(runq, cb, arg)) == NULL)
+		return (0);
+	if (when)
+		*when = job->when;
 
-	return (0);
+	return (1);
 }
 
 int
@@ -189,9 +322,9 @@ runq_next(struct runq *runq, void (**cb)(struct runq *, void *), void **arg,
 {
 	struct job	*job;
 
-	job = TAILQ_FIRST(&runq->jobs);
-	if (job == NULL)
+	if (runq->count == 0)
 		return (0);
+	job = runq->heap[0];
 	if (cb)
 		*cb = job->cb;
 	if (arg)
@@ -24,6 +24,7 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <dirent.h>
@@ -48,6 +49,7 @@ static void scheduler_imsg(struct mproc *, struct imsg *);
 static void scheduler_shutdown(void);
 static void scheduler_sig_handler(int, short, void *);
 static void scheduler_reset_events(void);
+static int scheduler_alloc_batches(void);
 static void scheduler_timeout(int, short, void *);
 static void scheduler_process_remove(struct scheduler_batch *);
 static void scheduler_process_expire(struct scheduler_batch *);
@@ -55,10 +57,15 @@ static void scheduler_process_update(struct scheduler_batch *);
 static void scheduler_process_bounce(struct scheduler_batch *);
 static void scheduler_process_mda(struct scheduler_batch *);
 static void scheduler_process_mta(struct scheduler_batch *);
+static void scheduler_snapshot(void);
+static void scheduler_query(struct mproc *, struct imsg *);
 
 static struct scheduler_backend *backend = NULL;
 static struct event		 ev;
 static size_t			 ninflight;
+static int			 credit = QUEUE_CREDIT_MAX;
+static size_t			 backlog;	/* committed envelopes */
+static size_t			 backlog_sent;
 static uint64_t			*evpids;
 static uint32_t			*msgids;
 static struct evpstate		*state;
@@ -69,15 +76,20 @@ void
 scheduler_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct bounce_req_msg	 req;
+	struct ctl_limit	 limit;
 	struct envelope		 evp;
 	struct scheduler_info	 si;
 	struct msg		 m;
 	uint64_t		 evpid, id, holdq;
 	uint32_t		 msgid;
 	uint32_t       		 inflight;
-	size_t			 n, i;
+	uint32_t		 failures, rate;
+	const char		*host;
+	size_t			 n, i, nschedule, nmsg, nevp;
 	time_t			 timestamp;
 	int			 v, r, type;
+	const void		*data;
+	size_t			 sz;
 
 	switch (imsg->hdr.type) {
 
@@ -92,6 +104,32 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		backend->insert(&si);
 		return;
 
+	case IMSG_QUEUE_SUBMIT_SNAPSHOT:
+		m_msg(&m, imsg);
+		m_get_data(&m, &data, &sz);
+		m_end(&m);
+		if (sz != sizeof si)
+			fatalx("scheduler: bad snapshot entry");
+		memmove(&si, data, sizeof si);
+		log_trace(TRACE_SCHEDULER,
+		    "scheduler: restoring evp:%016" PRIx64, si.evpid);
+		stat_increment("scheduler.envelope.incoming", 1);
+		backend->insert(&si);
+		return;
+
+	case IMSG_QUEUE_SNAPSHOT:
+		scheduler_snapshot();
+		return;
+
+	case IMSG_QUEUE_CREDIT:
+		m_msg(&m, imsg);
+		m_get_int(&m, &credit);
+		m_end(&m);
+		log_trace(TRACE_SCHEDULER, "scheduler: delivery credit %d",
+		    credit);
+		scheduler_reset_events();
+		return;
+
 	case IMSG_QUEUE_COMMIT_MESSAGE:
 		m_msg(&m, imsg);
 		m_get_msgid(&m, &msgid);
@@ -101,6 +139,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		n = backend->commit(msgid);
 		stat_decrement("scheduler.envelope.incoming", n);
 		stat_increment("scheduler.envelope", n);
+		backlog += n;
 		scheduler_reset_events();
 		return;
 
@@ -124,6 +163,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		    "scheduler: queue requested removal of evp:%016" PRIx64,
 		    evpid);
 		stat_decrement("scheduler.envelope", 1);
+		backlog -= 1;
 		if (! inflight)
 			backend->remove(evpid);
 		else {
@@ -146,6 +186,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		stat_increment("scheduler.delivery.ok", 1);
 		stat_decrement("scheduler.envelope.inflight", 1);
 		stat_decrement("scheduler.envelope", 1);
+		backlog -= 1;
 		scheduler_reset_events();
 		return;
 
@@ -191,6 +232,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		stat_increment("scheduler.delivery.permfail", 1);
 		stat_decrement("scheduler.envelope.inflight", 1);
 		stat_decrement("scheduler.envelope", 1);
+		backlog -= 1;
 		scheduler_reset_events();
 		return;
 
@@ -205,6 +247,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		stat_increment("scheduler.delivery.loop", 1);
 		stat_decrement("scheduler.envelope.inflight", 1);
 		stat_decrement("scheduler.envelope", 1);
+		backlog -= 1;
 		scheduler_reset_events();
 		return;
 
@@ -264,6 +307,29 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		log_verbose(v);
 		return;
 
+	case IMSG_CTL_SET_LIMIT:
+		memmove(&limit, imsg->data, sizeof limit);
+		nschedule = env->sc_scheduler_max_schedule;
+		nmsg = env->sc_scheduler_max_msg_batch_size;
+		nevp = env->sc_scheduler_max_evp_batch_size;
+		r = limit_set(limit.name, limit.value);
+		/* keep the old sizes and arrays if the new ones do not fit */
+		if (r && scheduler_alloc_batches() == -1) {
+			log_warn("warn: scheduler: limit %s", limit.name);
+			env->sc_scheduler_max_schedule = nschedule;
+			env->sc_scheduler_max_msg_batch_size = nmsg;
+			env->sc_scheduler_max_evp_batch_size = nevp;
+			r = 0;
+		}
+		if (r) {
+			log_info("info: scheduler: limit %s set to %lld",
+			    limit.name, (long long)limit.value);
+			scheduler_reset_events();
+		}
+		m_compose(p, r ? IMSG_CTL_OK : IMSG_CTL_FAIL, imsg->hdr.peerid,
+		    0, -1, NULL, 0);
+		return;
+
 	case IMSG_CTL_LIST_MESSAGES:
 		msgid = *(uint32_t *)(imsg->data);
 		n = backend->messages(msgid, msgids, env->sc_scheduler_max_msg_batch_size);
@@ -286,6 +352,10 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		    imsg->hdr.peerid, 0, -1, NULL, 0);
 		return;
 
+	case IMSG_CTL_QUERY_ENVELOPES:
+		scheduler_query(p, imsg);
+		return;
+
 	case IMSG_CTL_SCHEDULE:
 		id = *(uint64_t *)(imsg->data);
 		if (id <= 0xffffffffL)
@@ -306,6 +376,16 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		scheduler_reset_events();
 		return;
 
+	case IMSG_MTA_HOSTSTAT:
+		m_msg(&m, imsg);
+		m_get_string(&m, &host);
+		m_get_u32(&m, &failures);
+		m_get_u32(&m, &rate);
+		m_get_time(&m, &timestamp);
+		m_end(&m);
+		scheduler_hoststat_update(host, failures, rate, timestamp);
+		return;
+
 	case IMSG_CTL_REMOVE:
 		id = *(uint64_t *)(imsg->data);
 		if (id <= 0xffffffffL)
@@ -426,9 +506,8 @@ scheduler(void)
 	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
 		fatal("scheduler: cannot drop privileges");
 
-	evpids = xcalloc(env->sc_scheduler_max_schedule, sizeof *evpids, "scheduler: init evpids");
-	msgids = xcalloc(env->sc_scheduler_max_msg_batch_size, sizeof *msgids, "scheduler: list msg");
-	state = xcalloc(env->sc_scheduler_max_evp_batch_size, sizeof *state, "scheduler: list evp");
+	if (scheduler_alloc_batches() == -1)
+		fatal("scheduler: calloc");
 
 	imsg_callback = scheduler_imsg;
 	event_init();
@@ -453,11 +532,42 @@ scheduler(void)
 	return (0);
 }
 
+/*
+ * The batch sizes can change at runtime, see limit.c.  The current arrays
+ * are only replaced once the new ones are allocated.
+ */
+static int
+scheduler_alloc_batches(void)
+{
+	uint64_t	*nevpids;
+	uint32_t	*nmsgids;
+	struct evpstate	*nstate;
+
+	nevpids = calloc(env->sc_scheduler_max_schedule, sizeof *nevpids);
+	nmsgids = calloc(env->sc_scheduler_max_msg_batch_size, sizeof *nmsgids);
+	nstate = calloc(env->sc_scheduler_max_evp_batch_size, sizeof *nstate);
+	if (nevpids == NULL || nmsgids == NULL || nstate == NULL) {
+		free(nevpids);
+		free(nmsgids);
+		free(nstate);
+		return (-1);
+	}
+
+	free(evpids);
+	free(msgids);
+	free(state);
+	evpids = nevpids;
+	msgids = nmsgids;
+	state = nstate;
+	return (0);
+}
+
 static void
 scheduler_timeout(int fd, short event, void *p)
 {
 	struct timeval		tv;
 	struct scheduler_batch	batch;
+	size_t			maxinflight;
 	int			typemask, left;
 
 	log_trace(TRACE_SCHEDULER, "scheduler: getting next batch");
@@ -465,11 +575,15 @@ scheduler_timeout(int fd, short event, void *p)
 	tv.tv_sec = 0;
 	tv.tv_usec = 0;
 
+	/* the queue lowers the credit as its agent buffers fill up */
+	maxinflight = env->sc_scheduler_max_inflight * credit /
+	    QUEUE_CREDIT_MAX;
+
 	typemask = SCHED_REMOVE | SCHED_EXPIRE | SCHED_UPDATE | SCHED_BOUNCE;
-	if (ninflight < env->sc_scheduler_max_inflight &&
+	if (ninflight < maxinflight &&
 	    !(env->sc_flags & SMTPD_MDA_PAUSED))
 		typemask |= SCHED_MDA;
-	if (ninflight < env->sc_scheduler_max_inflight &&
+	if (ninflight < maxinflight &&
 	    !(env->sc_flags & SMTPD_MTA_PAUSED))
 		typemask |= SCHED_MTA;
 
@@ -563,13 +677,12 @@ scheduler_process_remove(struct scheduler_batch *batch)
 	for (i = 0; i < batch->evpcount; i++) {
 		log_debug("debug: scheduler: evp:%016" PRIx64 " removed",
 		    batch->evpids[i]);
-		m_create(p_queue, IMSG_QUEUE_REMOVE, 0, 0, -1);
-		m_add_evpid(p_queue, batch->evpids[i]);
-		m_close(p_queue);
+		m_batch_evpid(p_queue, IMSG_QUEUE_REMOVE, batch->evpids[i]);
 	}
 
 	stat_decrement("scheduler.envelope", batch->evpcount);
 	stat_increment("scheduler.envelope.removed", batch->evpcount);
+	backlog -= batch->evpcount;
 }
 
 static void
@@ -580,13 +693,12 @@ scheduler_process_expire(struct scheduler_batch *batch)
 	for (i = 0; i < batch->evpcount; i++) {
 		log_debug("debug: scheduler: evp:%016" PRIx64 " expired",
 		    batch->evpids[i]);
-		m_create(p_queue, IMSG_QUEUE_EXPIRE, 0, 0, -1);
-		m_add_evpid(p_queue, batch->evpids[i]);
-		m_close(p_queue);
+		m_batch_evpid(p_queue, IMSG_QUEUE_EXPIRE, batch->evpids[i]);
 	}
 
 	stat_decrement("scheduler.envelope", batch->evpcount);
 	stat_increment("scheduler.envelope.expired", batch->evpcount);
+	backlog -= batch->evpcount;
 }
 
 static void
@@ -610,9 +722,7 @@ scheduler_process_bounce(struct scheduler_batch *batch)
 	for (i = 0; i < batch->evpcount; i++) {
 		log_debug("debug: scheduler: evp:%016" PRIx64
 		    " scheduled (bounce)", batch->evpids[i]);
-		m_create(p_queue, IMSG_BOUNCE_INJECT, 0, 0, -1);
-		m_add_evpid(p_queue, batch->evpids[i]);
-		m_close(p_queue);
+		m_batch_evpid(p_queue, IMSG_BOUNCE_INJECT, batch->evpids[i]);
 	}
 
 	ninflight += batch->evpcount;
@@ -627,9 +737,7 @@ scheduler_process_mda(struct scheduler_batch *batch)
 	for (i = 0; i < batch->evpcount; i++) {
 		log_debug("debug: scheduler: evp:%016" PRIx64
 		    " scheduled (mda)", batch->evpids[i]);
-		m_create(p_queue, IMSG_MDA_DELIVER, 0, 0, -1);
-		m_add_evpid(p_queue, batch->evpids[i]);
-		m_close(p_queue);
+		m_batch_evpid(p_queue, IMSG_MDA_DELIVER, batch->evpids[i]);
 	}
 
 	ninflight += batch->evpcount;
@@ -641,14 +749,85 @@ scheduler_process_mta(struct scheduler_batch *batch)
 {
 	size_t	i;
 
+	/* the queue decides on offloading from the size of the backlog */
+	if (!TAILQ_EMPTY(env->sc_offloads) && backlog != backlog_sent) {
+		m_create(p_queue, IMSG_QUEUE_BACKLOG, 0, 0, -1);
+		m_add_size(p_queue, backlog);
+		m_close(p_queue);
+		backlog_sent = backlog;
+	}
+
 	for (i = 0; i < batch->evpcount; i++) {
 		log_debug("debug: scheduler: evp:%016" PRIx64
 		    " scheduled (mta)", batch->evpids[i]);
-		m_create(p_queue, IMSG_MTA_TRANSFER, 0, 0, -1);
-		m_add_evpid(p_queue, batch->evpids[i]);
-		m_close(p_queue);
+		m_batch_evpid(p_queue, IMSG_MTA_TRANSFER, batch->evpids[i]);
 	}
 
 	ninflight += batch->evpcount;
 	stat_increment("scheduler.envelope.inflight", batch->evpcount);
 }
+
+/*
+ * Answer one page of a filtered queue listing from the backend index.
+ * The walk is bounded, smtpctl asks for the next page once it has
+ * received this one.  The page goes through the queue, which checks the
+ * domain and sender of the rows since the index only keeps their hashes.
+ */
+static void
+scheduler_query(struct mproc *p, struct imsg *imsg)
+{
+	struct evpsummary	 rows[(MAX_IMSGSIZE - IMSG_HEADER_SIZE -
+				    sizeof(struct scheduler_query)) /
+				    sizeof(struct evpsummary)];
+	struct scheduler_query	 q;
+	struct iovec		 iov[2];
+	size_t			 n;
+
+	if (imsg->hdr.len - sizeof imsg->hdr != sizeof q)
+		fatalx("scheduler: bad query");
+	memmove(&q, imsg->data, sizeof q);
+	q.domain[sizeof(q.domain) - 1] = '\0';
+	q.sender[sizeof(q.sender) - 1] = '\0';
+
+	if (backend->query == NULL) {
+		m_compose(p, IMSG_CTL_FAIL, imsg->hdr.peerid, 0, -1, NULL, 0);
+		return;
+	}
+
+	q.rcptkey = scheduler_key(q.domain);
+	q.senderkey = scheduler_key(q.sender);
+	q.scan = SCHEDULER_QUERY_SCAN;
+	n = backend->query(&q, rows, nitems(rows));
+
+	iov[0].iov_base = &q;
+	iov[0].iov_len = sizeof q;
+	iov[1].iov_base = rows;
+	iov[1].iov_len = n * sizeof rows[0];
+	m_composev(p_queue, IMSG_CTL_QUERY_ENVELOPES, imsg->hdr.peerid, 0, -1,
+	    iov, 2);
+}
+
+/*
+ * Send the scheduling state of all envelopes to the queue, which saves it
+ * to speed up the next startup.  An empty message ends the snapshot.
+ */
+static void
+scheduler_snapshot(void)
+{
+	struct scheduler_info	si[(MAX_IMSGSIZE - IMSG_HEADER_SIZE) /
+				    sizeof(struct scheduler_info)];
+	uint64_t		from = 0;
+	size_t			n, total = 0;
+
+	if (backend->snapshot) {
+		while ((n = backend->snapshot(from, si, nitems(si)))) {
+			m_compose(p_queue, IMSG_QUEUE_SNAPSHOT, 0, 0, -1,
+			    si, n * sizeof(si[0]));
+			from = si[n - 1].evpid + 1;
+			total += n;
+		}
+	}
+	m_compose(p_queue, IMSG_QUEUE_SNAPSHOT, 0, 0, -1, NULL, 0);
+
+	log_debug("debug: scheduler: snapshot of %zu envelopes sent", total);
+}
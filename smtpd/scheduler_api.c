@@ -21,6 +21,7 @@
 #include <sys/uio.h>
 
 #include <imsg.h>
+#include <inttypes.h>
 #include <pwd.h>
 #include <string.h>
 #include <unistd.h>
@@ -185,6 +186,46 @@ scheduler_msg_dispatch(void)
 		imsg_compose(&ibuf, PROC_SCHEDULER_OK, 0, 0, -1, &r, sizeof(r));
 		break;
 
+	case PROC_SCHEDULER_INSERT_BATCH:
+		log_debug("scheduler-api:  PROC_SCHEDULER_INSERT_BATCH");
+		while (rlen) {
+			scheduler_msg_get(&info, sizeof(info));
+			if (handler_insert(&info) != 1)
+				log_warnx("warn: scheduler-api: insert failed "
+				    "for %016"PRIx64, info.evpid);
+		}
+		scheduler_msg_end();
+		break;
+
+	case PROC_SCHEDULER_COMMIT_BATCH:
+		log_debug("scheduler-api:  PROC_SCHEDULER_COMMIT_BATCH");
+		while (rlen) {
+			scheduler_msg_get(&msgid, sizeof(msgid));
+			handler_commit(msgid);
+		}
+		scheduler_msg_end();
+		break;
+
+	case PROC_SCHEDULER_UPDATE_BATCH:
+		log_debug("scheduler-api:  PROC_SCHEDULER_UPDATE_BATCH");
+		while (rlen) {
+			scheduler_msg_get(&info, sizeof(info));
+			if (handler_update(&info) == -1)
+				log_warnx("warn: scheduler-api: update failed "
+				    "for %016"PRIx64, info.evpid);
+		}
+		scheduler_msg_end();
+		break;
+
+	case PROC_SCHEDULER_DELETE_BATCH:
+		log_debug("scheduler-api:  PROC_SCHEDULER_DELETE_BATCH");
+		while (rlen) {
+			scheduler_msg_get(&evpid, sizeof(evpid));
+			handler_delete(evpid);
+		}
+		scheduler_msg_end();
+		break;
+
 	case PROC_SCHEDULER_HOLD:
 		log_debug("scheduler-api: PROC_SCHEDULER_HOLD");
 		scheduler_msg_get(&evpid, sizeof(evpid));
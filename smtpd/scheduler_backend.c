@@ -26,6 +26,7 @@
 #include <event.h>
 #include <fcntl.h>
 #include <imsg.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +34,30 @@
 #include "smtpd.h"
 #include "log.h"
 
+static time_t scheduler_hoststat_adjust(struct scheduler_info *, time_t);
+
+/*
+ * Health of the MTA destinations as last reported by the MTA.  Retries
+ * for a host that keeps failing are spaced further apart, so that they
+ * do not eat connection slots while it is down; envelopes deferred
+ * while it was down are pulled back in by the MTA when it recovers.
+ */
+#define	HOSTSTAT_EXPIRE		(4 * 3600)	/* as in the MTA */
+#define	HOSTSTAT_DOWN		4U		/* consecutive tempfails */
+#define	HOSTSTAT_STRETCH_MAX	4
+#define	HOSTSTAT_TEMPFAIL_RATE	500		/* permille */
+
+struct hoststat {
+	time_t		tm;
+	time_t		lastsuccess;
+	uint32_t	failures;
+	uint32_t	rate;
+};
+
+static struct tree	hoststats;
+static int		hoststats_init;
+static time_t		hoststats_purge;
+
 extern struct scheduler_backend scheduler_backend_null;
 extern struct scheduler_backend scheduler_backend_proc;
 extern struct scheduler_backend scheduler_backend_ramqueue;
@@ -53,6 +78,8 @@ scheduler_backend_lookup(const char *name)
 void
 scheduler_info(struct scheduler_info *sched, struct envelope *evp)
 {
+	char	buf[SMTPD_MAXLOCALPARTSIZE + SMTPD_MAXDOMAINPARTSIZE + 1];
+
 	sched->evpid = evp->id;
 	sched->type = evp->type;
 	sched->creation = evp->creation;
@@ -61,6 +88,31 @@ scheduler_info(struct scheduler_info *sched, struct envelope *evp)
 	sched->lasttry = evp->lasttry;
 	sched->lastbounce = evp->lastbounce;
 	sched->nexttry	= 0;
+	sched->priority = evp->priority;
+
+	if (evp->type == D_MTA && evp->agent.mta.relay.hostname[0])
+		sched->destkey = scheduler_key(evp->agent.mta.relay.hostname);
+	else
+		sched->destkey = scheduler_key(evp->dest.domain);
+	sched->rcptkey = scheduler_key(evp->dest.domain);
+
+	(void)snprintf(buf, sizeof buf, "%s@%s", evp->sender.user,
+	    evp->sender.domain);
+	sched->senderkey = scheduler_key(buf);
+}
+
+/* FNV-1a over the lowercased name */
+uint32_t
+scheduler_key(const char *name)
+{
+	uint32_t	h = 2166136261U;
+
+	for (; *name; name++) {
+		h ^= (unsigned char)tolower((unsigned char)*name);
+		h *= 16777619U;
+	}
+
+	return (h);
 }
 
 time_t
@@ -77,5 +129,79 @@ scheduler_compute_schedule(struct scheduler_info *sched)
 	retry = sched->retry;
 	delay = ((delay * retry) * retry) / 2;
 
+	if (sched->type == D_MTA && retry)
+		return (scheduler_hoststat_adjust(sched,
+		    sched->creation + delay));
+
 	return (sched->creation + delay);
 }
+
+void
+scheduler_hoststat_update(const char *host, uint32_t failures, uint32_t rate,
+    time_t lastsuccess)
+{
+	struct hoststat	*hs;
+	uint64_t	 key;
+	void		*iter;
+	time_t		 now;
+
+	if (!hoststats_init) {
+		tree_init(&hoststats);
+		hoststats_init = 1;
+	}
+
+	now = time(NULL);
+	if (hoststats_purge + 3600 < now) {
+		iter = NULL;
+		while (tree_iter(&hoststats, &iter, &key, (void **)&hs))
+			if (hs->tm + HOSTSTAT_EXPIRE < now) {
+				tree_xpop(&hoststats, key);
+				free(hs);
+				iter = NULL;
+			}
+		hoststats_purge = now;
+	}
+
+	key = scheduler_key(host);
+	if ((hs = tree_get(&hoststats, key)) == NULL) {
+		hs = xcalloc(1, sizeof *hs, "scheduler_hoststat_update");
+		tree_xset(&hoststats, key, hs);
+	}
+	hs->tm = now;
+	hs->failures = failures;
+	hs->rate = rate;
+	hs->lastsuccess = lastsuccess;
+
+	log_debug("debug: scheduler: host %s: %" PRIu32 " consecutive "
+	    "failures, %" PRIu32 "%% tempfail", host, failures, rate / 10);
+}
+
+static time_t
+scheduler_hoststat_adjust(struct scheduler_info *sched, time_t nexttry)
+{
+	struct hoststat	*hs;
+	time_t		 now;
+	uint32_t	 stretch;
+
+	if (!hoststats_init)
+		return (nexttry);
+	if ((hs = tree_get(&hoststats, sched->destkey)) == NULL)
+		return (nexttry);
+
+	now = time(NULL);
+	if (hs->tm + HOSTSTAT_EXPIRE < now || nexttry <= now)
+		return (nexttry);
+
+	/* one more step each time the failure count doubles */
+	stretch = 1;
+	if (hs->failures >= HOSTSTAT_DOWN) {
+		while (stretch < HOSTSTAT_STRETCH_MAX &&
+		    hs->failures >= (HOSTSTAT_DOWN << (stretch - 1)))
+			stretch++;
+	}
+	else if (hs->rate >= HOSTSTAT_TEMPFAIL_RATE &&
+	    hs->lastsuccess + 3600 < now)
+		stretch = 2;
+
+	return (now + (nexttry - now) * stretch);
+}
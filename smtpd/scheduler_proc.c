@@ -42,13 +42,60 @@ static struct imsg	 imsg;
 static size_t		 rlen;
 static char		*rdata;
 
+/*
+ * Inserts, commits, updates and deletes are not answered.  They are
+ * packed into batch messages which go out ahead of the next call that
+ * waits for a reply, so they never cost a round trip of their own.
+ */
+static struct ibuf	*pending;
+static uint32_t		 pending_type;
+static size_t		 pending_len;
+static struct tree	 incoming;	/* msgid -> uncommitted count */
+
+static void scheduler_proc_queue(uint32_t, const void *, size_t);
+static void scheduler_proc_flush(void);
+
 static const char *execpath = "/usr/libexec/smtpd/backend-scheduler";
 
+static void
+scheduler_proc_queue(uint32_t type, const void *data, size_t len)
+{
+	if (pending && (pending_type != type ||
+	    pending_len + len > MAX_IMSGSIZE - IMSG_HEADER_SIZE))
+		scheduler_proc_flush();
+
+	if (pending == NULL) {
+		pending = imsg_create(&ibuf, type, 0, 0, len);
+		if (pending == NULL) {
+			log_warn("warn: scheduler-proc: imsg_create");
+			fatalx("scheduler-proc: exiting");
+		}
+		pending_type = type;
+		pending_len = 0;
+	}
+
+	if (imsg_add(pending, data, len) == -1) {
+		log_warn("warn: scheduler-proc: imsg_add");
+		fatalx("scheduler-proc: exiting");
+	}
+	pending_len += len;
+}
+
+static void
+scheduler_proc_flush(void)
+{
+	if (pending == NULL)
+		return;
+	imsg_close(&ibuf, pending);
+	pending = NULL;
+}
+
 static void
 scheduler_proc_call(void)
 {
 	ssize_t	n;
 
+	scheduler_proc_flush();
 	if (imsg_flush(&ibuf) == -1) {
 		log_warn("warn: scheduler-proc: imsg_flush");
 		fatalx("scheduler-proc: exiting");
@@ -142,6 +189,7 @@ scheduler_proc_init(void)
 	/* parent process */
 	close(sp[0]);
 	imsg_init(&ibuf, sp[1]);
+	tree_init(&incoming);
 
 	version = PROC_SCHEDULER_API_VERSION;
 	imsg_compose(&ibuf, PROC_SCHEDULER_INIT, 0, 0, -1,
@@ -164,32 +212,37 @@ err:
 static int
 scheduler_proc_insert(struct scheduler_info *si)
 {
-	int	r;
+	uint32_t	 msgid;
+	size_t		*count;
 
-	log_debug("debug: scheduler-proc: PROC_SCHEDULER_INSERT");
+	log_debug("debug: scheduler-proc: PROC_SCHEDULER_INSERT_BATCH");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_INSERT, 0, 0, -1, si, sizeof(*si));
+	msgid = evpid_to_msgid(si->evpid);
+	if ((count = tree_get(&incoming, msgid)) == NULL) {
+		count = xcalloc(1, sizeof *count, "scheduler_proc_insert");
+		tree_xset(&incoming, msgid, count);
+	}
+	*count += 1;
 
-	scheduler_proc_call();
-	scheduler_proc_read(&r, sizeof(r));
-	scheduler_proc_end();
+	scheduler_proc_queue(PROC_SCHEDULER_INSERT_BATCH, si, sizeof(*si));
 
-	return (r);
+	return (1);
 }
 
 static size_t
 scheduler_proc_commit(uint32_t msgid)
 {
-	size_t	s;
+	size_t	*count, s = 0;
 
-	log_debug("debug: scheduler-proc: PROC_SCHEDULER_COMMIT");
+	log_debug("debug: scheduler-proc: PROC_SCHEDULER_COMMIT_BATCH");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_COMMIT, 0, 0, -1,
-	    &msgid, sizeof(msgid));
+	if ((count = tree_pop(&incoming, msgid)) != NULL) {
+		s = *count;
+		free(count);
+	}
 
-	scheduler_proc_call();
-	scheduler_proc_read(&s, sizeof(s));
-	scheduler_proc_end();
+	scheduler_proc_queue(PROC_SCHEDULER_COMMIT_BATCH, &msgid,
+	    sizeof(msgid));
 
 	return (s);
 }
@@ -201,6 +254,8 @@ scheduler_proc_rollback(uint32_t msgid)
 
 	log_debug("debug: scheduler-proc: PROC_SCHEDULER_ROLLBACK");
 
+	free(tree_pop(&incoming, msgid));
+
 	imsg_compose(&ibuf, PROC_SCHEDULER_ROLLBACK, 0, 0, -1,
 	    &msgid, sizeof(msgid));
 
@@ -214,36 +269,25 @@ scheduler_proc_rollback(uint32_t msgid)
 static int
 scheduler_proc_update(struct scheduler_info *si)
 {
-	int	r;
-
-	log_debug("debug: scheduler-proc: PROC_SCHEDULER_UPDATE");
+	log_debug("debug: scheduler-proc: PROC_SCHEDULER_UPDATE_BATCH");
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_UPDATE, 0, 0, -1, si, sizeof(*si));
+	/* the caller only needs an estimate for bounce warnings */
+	si->nexttry = scheduler_compute_schedule(si);
 
-	scheduler_proc_call();
-	scheduler_proc_read(&r, sizeof(r));
-	if (r == 1)
-		scheduler_proc_read(si, sizeof(*si));
-	scheduler_proc_end();
+	scheduler_proc_queue(PROC_SCHEDULER_UPDATE_BATCH, si, sizeof(*si));
 
-	return (r);
+	return (1);
 }
 
 static int
 scheduler_proc_delete(uint64_t evpid)
 {
-	int	r;
+	log_debug("debug: scheduler-proc: PROC_SCHEDULER_DELETE_BATCH");
 
-	log_debug("debug: scheduler-proc: PROC_SCHEDULER_DELETE");
+	scheduler_proc_queue(PROC_SCHEDULER_DELETE_BATCH, &evpid,
+	    sizeof(evpid));
 
-	imsg_compose(&ibuf, PROC_SCHEDULER_DELETE, 0, 0, -1,
-	    &evpid, sizeof(evpid));
-
-	scheduler_proc_call();
-	scheduler_proc_read(&r, sizeof(r));
-	scheduler_proc_end();
-
-	return (r);
+	return (1);
 }
 
 static int
@@ -38,18 +38,50 @@
 
 TAILQ_HEAD(evplist, rq_envelope);
 
+/*
+ * Envelopes of a message are kept in an array of evpid and pointer
+ * pairs, which is a fraction of the size of a tree node per envelope.
+ * New envelopes are appended and the array is only sorted by evpid
+ * when a lookup needs it.  Deleted envelopes leave a NULL slot behind
+ * that is reclaimed once half of the array is dead, so that building
+ * or draining a large message does not shift the array every time.
+ */
+struct rq_msgevp {
+	uint64_t		 evpid;
+	struct rq_envelope	*evp;
+};
+
 struct rq_message {
 	uint32_t		 msgid;
-	struct tree		 envelopes;
+	uint32_t		 senderkey;
+	uint32_t		 count;		/* slots in use */
+	uint32_t		 alloc;
+	uint32_t		 live;		/* non-NULL slots */
+	uint32_t		 unsorted;
+	struct rq_msgevp	*envelopes;
 };
 
+/*
+ * Times are stored as seconds relative to rq_epoch, use rq_time() and
+ * rq_reltime() to convert.
+ */
 struct rq_envelope {
 	TAILQ_ENTRY(rq_envelope) entry;
-	SPLAY_ENTRY(rq_envelope) t_entry;
 
 	uint64_t		 evpid;
 	uint64_t		 holdq;
-	enum delivery_type	 type;
+	struct rq_message	*message;
+
+	int32_t			 ctime;
+	int32_t			 sched;
+	int32_t			 expire;
+	int32_t			 t_state;	/* entered current state */
+
+	uint32_t		 t_heapidx;
+	uint32_t		 destkey;
+	uint32_t		 rcptkey;	/* recipient domain */
+	uint8_t			 type;		/* enum delivery_type */
+	uint8_t			 priority;	/* enum delivery_priority */
 
 #define	RQ_EVPSTATE_PENDING	 0
 #define	RQ_EVPSTATE_SCHEDULED	 1
@@ -62,40 +94,75 @@ struct rq_envelope {
 #define	RQ_ENVELOPE_SUSPEND	 0x04
 #define	RQ_ENVELOPE_UPDATE	 0x08
 	uint8_t			 flags;
+};
 
-	time_t			 ctime;
-	time_t			 sched;
-	time_t			 expire;
-
-	struct rq_message	*message;
+/*
+ * Envelopes and messages are carved out of slabs and recycled through a
+ * free list, slabs are never given back.
+ */
+#define	RQ_SLAB_ITEMS	1024
 
-	time_t			 t_inflight;
-	time_t			 t_scheduled;
+struct rq_slab {
+	size_t			 size;
+	void			*free;
 };
 
 struct rq_holdq {
 	struct evplist		 q;
 };
 
+/*
+ * Scheduled MTA envelopes are queued per destination, and destinations
+ * are served in turn so that a batch carries runs of envelopes for the
+ * same relay.  Emptied destinations are reaped when they reach the head.
+ */
+struct rq_dest {
+	TAILQ_ENTRY(rq_dest)	 entry;
+	uint64_t		 key;		/* priority and destkey */
+	struct evplist		 q;
+};
+TAILQ_HEAD(destlist, rq_dest);
+
+/*
+ * Pending envelopes of the main queue live in a 4-ary min-heap ordered
+ * by their next event, the key is cached next to the pointer so that
+ * sifting does not touch the envelopes themselves.
+ */
+#define	RQ_HEAP_ARITY	4
+
+/*
+ * Committed envelopes wait in the main queue q_pending and are moved to
+ * the heap a few at a time, so a large message does not hold up the
+ * event loop.
+ */
+#define	RQ_MERGE_STEP	1024
+
+struct rq_heapent {
+	time_t			 ref;
+	struct rq_envelope	*evp;
+};
+
 struct rq_queue {
 	size_t			 evpcount;
 	struct tree		 messages;
-	SPLAY_HEAD(prioqtree, rq_envelope)	q_priotree;
 
-	struct evplist		 q_pending;
+	struct rq_heapent	*q_heap;
+	size_t			 q_heapsize;
+	size_t			 q_heapalloc;
+
+	struct evplist		 q_pending;	/* not in q_heap yet */
 	struct evplist		 q_inflight;
 
-	struct evplist		 q_mta;
-	struct evplist		 q_mda;
-	struct evplist		 q_bounce;
+	/* scheduled deliveries, per priority class */
+	struct destlist		 q_mta[PRIO_COUNT];
+	struct tree		 q_mtadest;
+	struct evplist		 q_mda[PRIO_COUNT];
+	struct evplist		 q_bounce[PRIO_COUNT];
 	struct evplist		 q_update;
 	struct evplist		 q_expired;
 	struct evplist		 q_removed;
 };
 
-static int rq_envelope_cmp(struct rq_envelope *, struct rq_envelope *);
-
-SPLAY_PROTOTYPE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
 static int scheduler_ram_init(void);
 static int scheduler_ram_insert(struct scheduler_info *);
 static size_t scheduler_ram_commit(uint32_t);
@@ -111,19 +178,49 @@ static int scheduler_ram_schedule(uint64_t);
 static int scheduler_ram_remove(uint64_t);
 static int scheduler_ram_suspend(uint64_t);
 static int scheduler_ram_resume(uint64_t);
-
-static void sorted_insert(struct rq_queue *, struct rq_envelope *);
+static size_t scheduler_ram_snapshot(uint64_t, struct scheduler_info *, size_t);
+static size_t scheduler_ram_query(struct scheduler_query *, struct evpsummary *,
+    size_t);
+
+static void *rq_slab_get(struct rq_slab *);
+static void rq_slab_put(struct rq_slab *, void *);
+static time_t rq_time(int32_t);
+static int32_t rq_reltime(time_t);
+
+static int rq_msgevp_cmp(const void *, const void *);
+static void rq_message_compact(struct rq_message *);
+static size_t rq_message_lookup(struct rq_message *, uint64_t);
+static struct rq_envelope *rq_message_get(struct rq_message *, uint64_t);
+static struct rq_envelope *rq_message_xget(struct rq_message *, uint64_t);
+static void rq_message_add(struct rq_message *, struct rq_envelope *);
+static void rq_message_del(struct rq_message *, struct rq_envelope *);
+
+static struct evplist *rq_mta_list(struct rq_queue *, int, uint32_t);
+static struct rq_dest *rq_mta_first(struct rq_queue *, int);
+static int rq_prio_ready(struct rq_queue *, int, int);
+static int rq_prio_pick(struct rq_queue *, int);
+
+static void rq_heap_insert(struct rq_queue *, struct rq_envelope *);
+static void rq_heap_remove(struct rq_queue *, struct rq_envelope *);
+static int rq_heap_has(struct rq_queue *, struct rq_envelope *);
+static struct rq_envelope *rq_heap_first(struct rq_queue *);
+static void rq_heap_up(struct rq_queue *, size_t);
+static void rq_heap_down(struct rq_queue *, size_t);
+static int rq_heap_lt(const struct rq_heapent *, const struct rq_heapent *);
 
 static void rq_queue_init(struct rq_queue *);
 static void rq_queue_merge(struct rq_queue *, struct rq_queue *);
+static void rq_queue_merge_step(struct rq_queue *, size_t);
 static void rq_queue_dump(struct rq_queue *, const char *);
 static void rq_queue_schedule(struct rq_queue *rq);
 static struct evplist *rq_envelope_list(struct rq_queue *, struct rq_envelope *);
+static void rq_envelope_unpend(struct rq_queue *, struct rq_envelope *);
 static void rq_envelope_schedule(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_remove(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_suspend(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_resume(struct rq_queue *, struct rq_envelope *);
 static void rq_envelope_delete(struct rq_queue *, struct rq_envelope *);
+static uint16_t rq_envelope_state(struct rq_envelope *, time_t *);
 static const char *rq_envelope_to_text(struct rq_envelope *);
 
 struct scheduler_backend scheduler_backend_ramqueue = {
@@ -146,17 +243,42 @@ struct scheduler_backend scheduler_backend_ramqueue = {
 	scheduler_ram_remove,
 	scheduler_ram_suspend,
 	scheduler_ram_resume,
+
+	scheduler_ram_snapshot,
+	scheduler_ram_query,
 };
 
 static struct rq_queue	ramqueue;
 static struct tree	updates;
 static struct tree	holdqs[3]; /* delivery type */
 
+static struct rq_slab	envelope_slab = { sizeof(struct rq_envelope), NULL };
+static struct rq_slab	message_slab = { sizeof(struct rq_message), NULL };
+
 static time_t		currtime;
+static time_t		rq_epoch;
+
+/*
+ * Priority classes share the deliveries by weighted round-robin: a class
+ * is served while it has credits left, one credit per envelope, and all
+ * credits are refilled once no class with work has any.  A class that
+ * reached its inflight cap is skipped.
+ */
+static const int	rq_prio_weight[PRIO_COUNT] = {
+	[PRIO_NORMAL]	= 4,
+	[PRIO_HIGH]	= 16,
+	[PRIO_BULK]	= 1,
+};
+static const int	rq_prio_order[PRIO_COUNT] = {
+	PRIO_HIGH, PRIO_NORMAL, PRIO_BULK
+};
+static int		rq_prio_credits[PRIO_COUNT];
+static size_t		rq_prio_inflight[PRIO_COUNT];
 
 static int
 scheduler_ram_init(void)
 {
+	rq_epoch = time(NULL);
 	rq_queue_init(&ramqueue);
 	tree_init(&updates);
 	tree_init(&holdqs[D_MDA]);
@@ -188,22 +310,30 @@ scheduler_ram_insert(struct scheduler_info *si)
 
 	/* find/prepare the msgtree message in ramqueue update */
 	if ((message = tree_get(&update->messages, msgid)) == NULL) {
-		message = xcalloc(1, sizeof *message, "scheduler_insert");
+		message = rq_slab_get(&message_slab);
 		message->msgid = msgid;
-		tree_init(&message->envelopes);
+		message->senderkey = si->senderkey;
 		tree_xset(&update->messages, msgid, message);
 		stat_increment("scheduler.ramqueue.message", 1);
 	}
 
 	/* create envelope in ramqueue message */
-	envelope = xcalloc(1, sizeof *envelope, "scheduler_insert");
+	envelope = rq_slab_get(&envelope_slab);
 	envelope->evpid = si->evpid;
 	envelope->type = si->type;
+	envelope->destkey = si->destkey;
+	envelope->rcptkey = si->rcptkey;
+	envelope->priority = (si->priority < PRIO_COUNT) ?
+	    si->priority : PRIO_NORMAL;
 	envelope->message = message;
-	envelope->ctime = si->creation;
-	envelope->expire = si->creation + si->expire;
-	envelope->sched = scheduler_compute_schedule(si);
-	tree_xset(&message->envelopes, envelope->evpid, envelope);
+	envelope->ctime = rq_reltime(si->creation);
+	envelope->expire = rq_reltime(si->creation + si->expire);
+	/* restored from a snapshot */
+	if (si->nexttry)
+		envelope->sched = rq_reltime(si->nexttry);
+	else
+		envelope->sched = rq_reltime(scheduler_compute_schedule(si));
+	rq_message_add(message, envelope);
 
 	update->evpcount++;
 	stat_increment("scheduler.ramqueue.envelope", 1);
@@ -211,7 +341,7 @@ scheduler_ram_insert(struct scheduler_info *si)
 	envelope->state = RQ_EVPSTATE_PENDING;
 	TAILQ_INSERT_TAIL(&update->q_pending, envelope, entry);
 
-	si->nexttry = envelope->sched;
+	si->nexttry = rq_time(envelope->sched);
 
 	return (1);
 }
@@ -231,6 +361,7 @@ scheduler_ram_commit(uint32_t msgid)
 		rq_queue_dump(update, "update to commit");
 
 	rq_queue_merge(&ramqueue, update);
+	rq_queue_merge_step(&ramqueue, RQ_MERGE_STEP);
 
 	if (verbose & TRACE_SCHEDULER)
 		rq_queue_dump(&ramqueue, "resulting queue");
@@ -273,18 +404,20 @@ scheduler_ram_update(struct scheduler_info *si)
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
+	time_t			 sched;
 
 	currtime = time(NULL);
 
 	msgid = evpid_to_msgid(si->evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, si->evpid);
+	evp = rq_message_xget(msg, si->evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		errx(1, "evp:%016" PRIx64 " not in-flight", si->evpid);
 
 	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	rq_prio_inflight[evp->priority]--;
 
 	/*
 	 * If the envelope was removed while inflight,  schedule it for
@@ -293,18 +426,19 @@ scheduler_ram_update(struct scheduler_info *si)
 	if (evp->flags & RQ_ENVELOPE_REMOVED) {
 		TAILQ_INSERT_TAIL(&ramqueue.q_removed, evp, entry);
 		evp->state = RQ_EVPSTATE_SCHEDULED;
-		evp->t_scheduled = currtime;
+		evp->t_state = rq_reltime(currtime);
 		return (1);
 	}
 
-	while ((evp->sched = scheduler_compute_schedule(si)) <= currtime)
+	while ((sched = scheduler_compute_schedule(si)) <= currtime)
 		si->retry += 1;
+	evp->sched = rq_reltime(sched);
 
 	evp->state = RQ_EVPSTATE_PENDING;
 	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
-		sorted_insert(&ramqueue, evp);
+		rq_heap_insert(&ramqueue, evp);
 
-	si->nexttry = evp->sched;
+	si->nexttry = sched;
 
 	return (1);
 }
@@ -320,13 +454,14 @@ scheduler_ram_delete(uint64_t evpid)
 
 	msgid = evpid_to_msgid(evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, evpid);
+	evp = rq_message_xget(msg, evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		errx(1, "evp:%016" PRIx64 " not in-flight", evpid);
 
 	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	rq_prio_inflight[evp->priority]--;
 
 	rq_envelope_delete(&ramqueue, evp);
 
@@ -345,13 +480,14 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 
 	msgid = evpid_to_msgid(evpid);
 	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, evpid);
+	evp = rq_message_xget(msg, evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		errx(1, "evp:%016" PRIx64 " not in-flight", evpid);
 
 	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	rq_prio_inflight[evp->priority]--;
 
 	/* If the envelope is suspended, just mark it as pending */
 	if (evp->flags & RQ_ENVELOPE_SUSPEND) {
@@ -415,7 +551,7 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 		evp->state = RQ_EVPSTATE_PENDING;
 		if (update)
 			evp->flags |= RQ_ENVELOPE_UPDATE;
-		sorted_insert(&ramqueue, evp);
+		rq_heap_insert(&ramqueue, evp);
 	}
 
 	if (TAILQ_EMPTY(&hq->q)) {
@@ -430,13 +566,17 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 static int
 scheduler_ram_batch(int typemask, struct scheduler_batch *ret)
 {
-	struct evplist		*q;
+	struct evplist		*q = NULL;
 	struct rq_envelope	*evp;
-	size_t			 n;
-	int			 retry;
+	struct rq_dest		*dest, *served;
+	size_t			 n, cap;
+	int			 retry, prio = PRIO_NORMAL;
+	time_t			 sched;
 
 	currtime = time(NULL);
 
+	rq_queue_merge_step(&ramqueue, RQ_MERGE_STEP);
+
 	rq_queue_schedule(&ramqueue);
 	if (verbose & TRACE_SCHEDULER)
 		rq_queue_dump(&ramqueue, "scheduler_ram_batch()");
@@ -453,25 +593,34 @@ scheduler_ram_batch(int typemask, struct scheduler_batch *ret)
 		q = &ramqueue.q_update;
 		ret->type = SCHED_UPDATE;
 	}
-	else if (typemask & SCHED_BOUNCE && TAILQ_FIRST(&ramqueue.q_bounce)) {
-		q = &ramqueue.q_bounce;
+	else if (typemask & SCHED_BOUNCE &&
+	    (prio = rq_prio_pick(&ramqueue, SCHED_BOUNCE)) != -1) {
+		q = &ramqueue.q_bounce[prio];
 		ret->type = SCHED_BOUNCE;
 	}
-	else if (typemask & SCHED_MDA && TAILQ_FIRST(&ramqueue.q_mda)) {
-		q = &ramqueue.q_mda;
+	else if (typemask & SCHED_MDA &&
+	    (prio = rq_prio_pick(&ramqueue, SCHED_MDA)) != -1) {
+		q = &ramqueue.q_mda[prio];
 		ret->type = SCHED_MDA;
 	}
-	else if (typemask & SCHED_MTA && TAILQ_FIRST(&ramqueue.q_mta)) {
-		q = &ramqueue.q_mta;
+	else if (typemask & SCHED_MTA &&
+	    (prio = rq_prio_pick(&ramqueue, SCHED_MTA)) != -1) {
 		ret->type = SCHED_MTA;
 	}
-	else if ((evp = TAILQ_FIRST(&ramqueue.q_pending))) {
+	else if (TAILQ_FIRST(&ramqueue.q_pending)) {
+		/* come back as soon as possible to finish the merge */
+		ret->type = SCHED_DELAY;
+		ret->evpcount = 0;
+		ret->delay = 0;
+		goto done;
+	}
+	else if ((evp = rq_heap_first(&ramqueue))) {
 		ret->type = SCHED_DELAY;
 		ret->evpcount = 0;
 		if (evp->sched < evp->expire)
-			ret->delay = evp->sched - currtime;
+			ret->delay = rq_time(evp->sched) - currtime;
 		else
-			ret->delay = evp->expire - currtime;
+			ret->delay = rq_time(evp->expire) - currtime;
 		goto done;
 	}
 	else {
@@ -480,7 +629,24 @@ scheduler_ram_batch(int typemask, struct scheduler_batch *ret)
 		goto done;
 	}
 
-	for (n = 0; (evp = TAILQ_FIRST(q)) && n < ret->evpcount; n++) {
+	cap = 0;
+	if (ret->type & (SCHED_BOUNCE | SCHED_MDA | SCHED_MTA))
+		cap = env->sc_scheduler_max_inflight_prio[prio];
+
+	served = NULL;
+	for (n = 0; n < ret->evpcount; n++) {
+
+		if (cap && rq_prio_inflight[prio] >= cap)
+			break;
+		if (ret->type == SCHED_MTA) {
+			/* may reap the destination served so far */
+			served = dest = rq_mta_first(&ramqueue, prio);
+			if (dest == NULL)
+				break;
+			q = &dest->q;
+		}
+		if ((evp = TAILQ_FIRST(q)) == NULL)
+			break;
 
 		TAILQ_REMOVE(q, evp, entry);
 
@@ -498,22 +664,37 @@ scheduler_ram_batch(int typemask, struct scheduler_batch *ret)
 
 			/* XXX we can't really use scheduler_compute_schedule */
 			retry = 0;
-			while ((evp->sched = evp->ctime + 800 * retry * retry / 2) <= currtime)
+			while ((sched = rq_time(evp->ctime) +
+			    800 * retry * retry / 2) <= currtime)
 				retry += 1;
+			evp->sched = rq_reltime(sched);
 
 			evp->state = RQ_EVPSTATE_PENDING;
 			if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
-				sorted_insert(&ramqueue, evp);
+				rq_heap_insert(&ramqueue, evp);
 		}
 		else {
 			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
+			rq_prio_inflight[evp->priority]++;
 			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			evp->t_state = rq_reltime(currtime);
 		}
 	}
 
 	ret->evpcount = n;
 
+	if (ret->type & (SCHED_BOUNCE | SCHED_MDA | SCHED_MTA)) {
+		rq_prio_credits[prio] -= n;
+		if (rq_prio_credits[prio] < 0)
+			rq_prio_credits[prio] = 0;
+	}
+
+	/* let the next destination go first on the next batch */
+	if (served && !TAILQ_EMPTY(&served->q)) {
+		TAILQ_REMOVE(&ramqueue.q_mta[prio], served, entry);
+		TAILQ_INSERT_TAIL(&ramqueue.q_mta[prio], served, entry);
+	}
+
    done:
 
 	ret->mask = 0;
@@ -523,13 +704,15 @@ scheduler_ram_batch(int typemask, struct scheduler_batch *ret)
 		ret->mask |= SCHED_EXPIRE;
 	if (TAILQ_FIRST(&ramqueue.q_update))
 		ret->mask |= SCHED_UPDATE;
-	if (TAILQ_FIRST(&ramqueue.q_bounce))
-		ret->mask |= SCHED_BOUNCE;
-	if (TAILQ_FIRST(&ramqueue.q_mda))
-		ret->mask |= SCHED_MDA;
-	if (TAILQ_FIRST(&ramqueue.q_mta))
-		ret->mask |= SCHED_MTA;
-	if (TAILQ_FIRST(&ramqueue.q_pending))
+	for (prio = 0; prio < PRIO_COUNT; prio++) {
+		if (rq_prio_ready(&ramqueue, SCHED_BOUNCE, prio))
+			ret->mask |= SCHED_BOUNCE;
+		if (rq_prio_ready(&ramqueue, SCHED_MDA, prio))
+			ret->mask |= SCHED_MDA;
+		if (rq_prio_ready(&ramqueue, SCHED_MTA, prio))
+			ret->mask |= SCHED_MTA;
+	}
+	if (rq_heap_first(&ramqueue) || TAILQ_FIRST(&ramqueue.q_pending))
 		ret->mask |= SCHED_DELAY;
 
 	return ((ret->type == SCHED_NONE) ? 0 : 1);
@@ -556,50 +739,127 @@ scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	void			*i;
-	size_t			 n;
+	size_t			 n, i;
 
 	if ((msg = tree_get(&ramqueue.messages, evpid_to_msgid(from))) == NULL)
 		return (0);
 
-	for (n = 0, i = NULL; n < size; ) {
+	for (n = 0, i = rq_message_lookup(msg, from); n < size; ) {
 
-		if (tree_iterfrom(&msg->envelopes, &i, from, NULL,
-		    (void**)&evp) == 0)
+		if (i == msg->count)
 			break;
+		if ((evp = msg->envelopes[i++].evp) == NULL)
+			continue;
 
 		if (evp->flags & (RQ_ENVELOPE_REMOVED | RQ_ENVELOPE_EXPIRED))
 			continue;
 
 		dst[n].evpid = evp->evpid;
-		dst[n].flags = 0;
 		dst[n].retry = 0;
-		dst[n].time = 0;
+		dst[n].flags = rq_envelope_state(evp, &dst[n].time);
+		n++;
+	}
 
-		if (evp->state == RQ_EVPSTATE_PENDING) {
-			dst[n].time = evp->sched;
-			dst[n].flags = EF_PENDING;
-		}
-		else if (evp->state == RQ_EVPSTATE_SCHEDULED) {
-			dst[n].time = evp->t_scheduled;
-			dst[n].flags = EF_PENDING;
-		}
-		else if (evp->state == RQ_EVPSTATE_INFLIGHT) {
-			dst[n].time = evp->t_inflight;
-			dst[n].flags = EF_INFLIGHT;
+	return (n);
+}
+
+static size_t
+scheduler_ram_snapshot(uint64_t from, struct scheduler_info *dst, size_t size)
+{
+	struct rq_message	*msg;
+	struct rq_envelope	*evp;
+	void			*i;
+	size_t			 n, j;
+
+	n = 0;
+	i = NULL;
+	while (n < size && tree_iterfrom(&ramqueue.messages, &i,
+	    evpid_to_msgid(from), NULL, (void**)&msg)) {
+		j = rq_message_lookup(msg, from);
+		while (n < size && j < msg->count) {
+			if ((evp = msg->envelopes[j++].evp) == NULL)
+				continue;
+			if (evp->flags & (RQ_ENVELOPE_REMOVED |
+			    RQ_ENVELOPE_EXPIRED))
+				continue;
+			memset(&dst[n], 0, sizeof dst[n]);
+			dst[n].evpid = evp->evpid;
+			dst[n].type = evp->type;
+			dst[n].creation = rq_time(evp->ctime);
+			dst[n].expire = evp->expire - evp->ctime;
+			dst[n].nexttry = rq_time(evp->sched);
+			dst[n].destkey = evp->destkey;
+			dst[n].senderkey = msg->senderkey;
+			dst[n].rcptkey = evp->rcptkey;
+			dst[n].priority = evp->priority;
+			n++;
 		}
-		else if (evp->state == RQ_EVPSTATE_HELD) {
-			/* same as scheduled */
-			dst[n].time = evp->t_scheduled;
-			dst[n].flags = EF_PENDING;
-			dst[n].flags |= EF_HOLD;
+	}
+
+	return (n);
+}
+
+static size_t
+scheduler_ram_query(struct scheduler_query *q, struct evpsummary *dst,
+    size_t size)
+{
+	struct rq_message	*msg;
+	struct rq_envelope	*evp;
+	void			*i;
+	size_t			 n, j, scan;
+	uint16_t		 flags;
+	time_t			 t, age;
+
+	currtime = time(NULL);
+
+	n = 0;
+	scan = 0;
+	i = NULL;
+	while (tree_iterfrom(&ramqueue.messages, &i, evpid_to_msgid(q->from),
+	    NULL, (void**)&msg)) {
+		if (q->sender[0] && msg->senderkey != q->senderkey) {
+			scan++;
+			j = msg->count;
 		}
-		if (evp->flags & RQ_ENVELOPE_SUSPEND)
-			dst[n].flags |= EF_SUSPEND;
+		else
+			j = rq_message_lookup(msg, q->from);
+		for (; j < msg->count; j++, scan++) {
+			if (n == size || scan >= q->scan) {
+				q->from = msg->envelopes[j].evpid;
+				return (n);
+			}
+			if ((evp = msg->envelopes[j].evp) == NULL)
+				continue;
+			if (evp->flags & (RQ_ENVELOPE_REMOVED |
+			    RQ_ENVELOPE_EXPIRED))
+				continue;
+			if (q->domain[0] && evp->rcptkey != q->rcptkey)
+				continue;
+			age = currtime - rq_time(evp->ctime);
+			if (q->minage && age < q->minage)
+				continue;
+			if (q->maxage && age > q->maxage)
+				continue;
+			flags = rq_envelope_state(evp, &t);
+			if ((flags & q->flags) != q->flags)
+				continue;
 
-		n++;
+			dst[n].evpid = evp->evpid;
+			dst[n].flags = flags;
+			dst[n].type = evp->type;
+			dst[n].priority = evp->priority;
+			dst[n].creation = rq_time(evp->ctime);
+			dst[n].time = t;
+			n++;
+		}
+		if (msg->msgid == 0xffffffff)
+			break;
+		q->from = msgid_to_evpid(msg->msgid + 1);
+		if (scan >= q->scan)
+			return (n);
 	}
 
+	q->from = 0;
 	return (n);
 }
 
@@ -609,7 +869,7 @@ scheduler_ram_schedule(uint64_t evpid)
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
-	void			*i;
+	size_t			 i;
 	int			 r;
 
 	currtime = time(NULL);
@@ -618,7 +878,7 @@ scheduler_ram_schedule(uint64_t evpid)
 		msgid = evpid_to_msgid(evpid);
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_message_get(msg, evpid)) == NULL)
 			return (0);
 		if (evp->state == RQ_EVPSTATE_INFLIGHT)
 			return (0);
@@ -629,9 +889,10 @@ scheduler_ram_schedule(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp))) {
+		for (i = 0; i < msg->count; i++) {
+			if ((evp = msg->envelopes[i].evp) == NULL)
+				continue;
 			if (evp->state == RQ_EVPSTATE_INFLIGHT)
 				continue;
 			rq_envelope_schedule(&ramqueue, evp);
@@ -647,7 +908,7 @@ scheduler_ram_remove(uint64_t evpid)
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
-	void			*i;
+	size_t			 i;
 	int			 r;
 
 	currtime = time(NULL);
@@ -656,7 +917,7 @@ scheduler_ram_remove(uint64_t evpid)
 		msgid = evpid_to_msgid(evpid);
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_message_get(msg, evpid)) == NULL)
 			return (0);
 		if (rq_envelope_remove(&ramqueue, evp))
 			return (1);
@@ -666,10 +927,10 @@ scheduler_ram_remove(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_remove(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if ((evp = msg->envelopes[i].evp) &&
+			    rq_envelope_remove(&ramqueue, evp))
 				r++;
 		return (r);
 	}
@@ -681,7 +942,7 @@ scheduler_ram_suspend(uint64_t evpid)
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
-	void			*i;
+	size_t			 i;
 	int			 r;
 
 	currtime = time(NULL);
@@ -690,7 +951,7 @@ scheduler_ram_suspend(uint64_t evpid)
 		msgid = evpid_to_msgid(evpid);
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_message_get(msg, evpid)) == NULL)
 			return (0);
 		if (rq_envelope_suspend(&ramqueue, evp))
 			return (1);
@@ -700,10 +961,10 @@ scheduler_ram_suspend(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_suspend(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if ((evp = msg->envelopes[i].evp) &&
+			    rq_envelope_suspend(&ramqueue, evp))
 				r++;
 		return (r);
 	}
@@ -715,7 +976,7 @@ scheduler_ram_resume(uint64_t evpid)
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
-	void			*i;
+	size_t			 i;
 	int			 r;
 
 	currtime = time(NULL);
@@ -724,7 +985,7 @@ scheduler_ram_resume(uint64_t evpid)
 		msgid = evpid_to_msgid(evpid);
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_message_get(msg, evpid)) == NULL)
 			return (0);
 		if (rq_envelope_resume(&ramqueue, evp))
 			return (1);
@@ -734,42 +995,389 @@ scheduler_ram_resume(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_resume(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if ((evp = msg->envelopes[i].evp) &&
+			    rq_envelope_resume(&ramqueue, evp))
 				r++;
 		return (r);
 	}
 }
 
+static void *
+rq_slab_get(struct rq_slab *slab)
+{
+	char	*chunk;
+	void	*item;
+	size_t	 i;
+
+	if (slab->free == NULL) {
+		chunk = xcalloc(RQ_SLAB_ITEMS, slab->size, "rq_slab_get");
+		for (i = 0; i < RQ_SLAB_ITEMS; i++)
+			rq_slab_put(slab, chunk + i * slab->size);
+	}
+
+	item = slab->free;
+	slab->free = *(void **)item;
+	memset(item, 0, slab->size);
+
+	return (item);
+}
+
+static void
+rq_slab_put(struct rq_slab *slab, void *item)
+{
+	*(void **)item = slab->free;
+	slab->free = item;
+}
+
+static time_t
+rq_time(int32_t t)
+{
+	return (rq_epoch + t);
+}
+
+static int32_t
+rq_reltime(time_t t)
+{
+	if (t - rq_epoch > INT32_MAX)
+		return (INT32_MAX);
+	if (t - rq_epoch < INT32_MIN)
+		return (INT32_MIN);
+	return (t - rq_epoch);
+}
+
+static int
+rq_msgevp_cmp(const void *a, const void *b)
+{
+	const struct rq_msgevp	*ea = a, *eb = b;
+
+	if (ea->evpid < eb->evpid)
+		return (-1);
+	if (ea->evpid > eb->evpid)
+		return (1);
+	return (0);
+}
+
+static void
+rq_message_compact(struct rq_message *msg)
+{
+	size_t	i, j;
+
+	if (msg->live == msg->count)
+		return;
+	for (i = 0, j = 0; i < msg->count; i++)
+		if (msg->envelopes[i].evp)
+			msg->envelopes[j++] = msg->envelopes[i];
+	msg->count = j;
+}
+
+/*
+ * Sort the array if envelopes were appended out of order, then return
+ * the index of the first slot whose evpid is not less than evpid.  Dead
+ * slots keep their evpid so the search does not need to skip them.
+ */
+static size_t
+rq_message_lookup(struct rq_message *msg, uint64_t evpid)
+{
+	size_t	lo, hi, mid;
+
+	if (msg->unsorted) {
+		rq_message_compact(msg);
+		qsort(msg->envelopes, msg->count, sizeof(*msg->envelopes),
+		    rq_msgevp_cmp);
+		msg->unsorted = 0;
+	}
+
+	lo = 0;
+	hi = msg->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (msg->envelopes[mid].evpid < evpid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static struct rq_envelope *
+rq_message_get(struct rq_message *msg, uint64_t evpid)
+{
+	size_t	i;
+
+	i = rq_message_lookup(msg, evpid);
+	if (i == msg->count || msg->envelopes[i].evpid != evpid)
+		return (NULL);
+
+	return (msg->envelopes[i].evp);
+}
+
+static struct rq_envelope *
+rq_message_xget(struct rq_message *msg, uint64_t evpid)
+{
+	struct rq_envelope	*evp;
+
+	if ((evp = rq_message_get(msg, evpid)) == NULL)
+		errx(1, "rq_message_xget(%08" PRIx32 ", %016" PRIx64 ")",
+		    msg->msgid, evpid);
+
+	return (evp);
+}
+
+static void
+rq_message_add(struct rq_message *msg, struct rq_envelope *evp)
+{
+	struct rq_msgevp	*envelopes;
+	size_t			 alloc;
+
+	if (msg->count == msg->alloc) {
+		alloc = msg->alloc ? msg->alloc * 2 : 1;
+		if (alloc > UINT32_MAX)
+			fatalx("scheduler: too many envelopes");
+		envelopes = realloc(msg->envelopes, alloc * sizeof(*envelopes));
+		if (envelopes == NULL)
+			fatal("scheduler: realloc");
+		msg->envelopes = envelopes;
+		msg->alloc = alloc;
+	}
+
+	if (msg->count && msg->envelopes[msg->count - 1].evpid >= evp->evpid)
+		msg->unsorted = 1;
+
+	msg->envelopes[msg->count].evpid = evp->evpid;
+	msg->envelopes[msg->count].evp = evp;
+	msg->count++;
+	msg->live++;
+}
+
 static void
-sorted_insert(struct rq_queue *rq, struct rq_envelope *evp)
+rq_message_del(struct rq_message *msg, struct rq_envelope *evp)
+{
+	size_t	i;
+
+	i = rq_message_lookup(msg, evp->evpid);
+	if (i == msg->count || msg->envelopes[i].evp != evp)
+		errx(1, "rq_message_del(%016" PRIx64 "): not found",
+		    evp->evpid);
+
+	msg->envelopes[i].evp = NULL;
+	msg->live--;
+
+	if (msg->live <= msg->count / 2)
+		rq_message_compact(msg);
+}
+
+static struct evplist *
+rq_mta_list(struct rq_queue *rq, int prio, uint32_t destkey)
 {
-	struct rq_envelope	*evp2;
+	struct rq_dest	*dest;
+	uint64_t	 key;
+
+	key = ((uint64_t)prio << 32) | destkey;
+	if ((dest = tree_get(&rq->q_mtadest, key)) == NULL) {
+		dest = xcalloc(1, sizeof(*dest), "rq_mta_list");
+		dest->key = key;
+		TAILQ_INIT(&dest->q);
+		tree_xset(&rq->q_mtadest, key, dest);
+		TAILQ_INSERT_TAIL(&rq->q_mta[prio], dest, entry);
+	}
+
+	return (&dest->q);
+}
+
+static struct rq_dest *
+rq_mta_first(struct rq_queue *rq, int prio)
+{
+	struct rq_dest	*dest;
+
+	while ((dest = TAILQ_FIRST(&rq->q_mta[prio])) &&
+	    TAILQ_EMPTY(&dest->q)) {
+		TAILQ_REMOVE(&rq->q_mta[prio], dest, entry);
+		tree_xpop(&rq->q_mtadest, dest->key);
+		free(dest);
+	}
 
-	SPLAY_INSERT(prioqtree, &rq->q_priotree, evp);
-	evp2 = SPLAY_NEXT(prioqtree, &rq->q_priotree, evp);
-	if (evp2)
-		TAILQ_INSERT_BEFORE(evp2, evp, entry);
+	return (dest);
+}
+
+static int
+rq_prio_ready(struct rq_queue *rq, int type, int prio)
+{
+	size_t	cap;
+
+	cap = env->sc_scheduler_max_inflight_prio[prio];
+	if (cap && rq_prio_inflight[prio] >= cap)
+		return (0);
+
+	switch (type) {
+	case SCHED_BOUNCE:
+		return (TAILQ_FIRST(&rq->q_bounce[prio]) != NULL);
+	case SCHED_MDA:
+		return (TAILQ_FIRST(&rq->q_mda[prio]) != NULL);
+	case SCHED_MTA:
+		return (rq_mta_first(rq, prio) != NULL);
+	}
+
+	return (0);
+}
+
+static int
+rq_prio_pick(struct rq_queue *rq, int type)
+{
+	int	i, prio, ready;
+
+	for (;;) {
+		ready = 0;
+		for (i = 0; i < PRIO_COUNT; i++) {
+			prio = rq_prio_order[i];
+			if (!rq_prio_ready(rq, type, prio))
+				continue;
+			if (rq_prio_credits[prio] > 0)
+				return (prio);
+			ready = 1;
+		}
+		if (!ready)
+			return (-1);
+		for (prio = 0; prio < PRIO_COUNT; prio++)
+			rq_prio_credits[prio] = rq_prio_weight[prio];
+	}
+}
+
+static void
+rq_heap_insert(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_heapent	*heap;
+	size_t			 alloc;
+
+	if (rq->q_heapsize == rq->q_heapalloc) {
+		alloc = rq->q_heapalloc ? rq->q_heapalloc * 2 : 1024;
+		if (alloc > UINT32_MAX || SIZE_MAX / sizeof(*heap) < alloc)
+			fatalx("scheduler: heap overflow");
+		heap = realloc(rq->q_heap, alloc * sizeof(*heap));
+		if (heap == NULL)
+			fatal("scheduler: realloc");
+		rq->q_heap = heap;
+		rq->q_heapalloc = alloc;
+	}
+
+	evp->t_heapidx = rq->q_heapsize++;
+	rq->q_heap[evp->t_heapidx].ref =
+	    rq_time((evp->sched < evp->expire) ? evp->sched : evp->expire);
+	rq->q_heap[evp->t_heapidx].evp = evp;
+	rq_heap_up(rq, evp->t_heapidx);
+}
+
+static void
+rq_heap_remove(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	size_t	idx = evp->t_heapidx;
+
+	if (idx >= rq->q_heapsize || rq->q_heap[idx].evp != evp)
+		errx(1, "evp:%016" PRIx64 " not in heap", evp->evpid);
+
+	rq->q_heapsize--;
+	if (idx == rq->q_heapsize)
+		return;
+
+	rq->q_heap[idx] = rq->q_heap[rq->q_heapsize];
+	rq->q_heap[idx].evp->t_heapidx = idx;
+	if (idx && rq_heap_lt(&rq->q_heap[idx],
+	    &rq->q_heap[(idx - 1) / RQ_HEAP_ARITY]))
+		rq_heap_up(rq, idx);
 	else
-		TAILQ_INSERT_TAIL(&rq->q_pending, evp, entry);
+		rq_heap_down(rq, idx);
+}
+
+static int
+rq_heap_has(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	return (evp->t_heapidx < rq->q_heapsize &&
+	    rq->q_heap[evp->t_heapidx].evp == evp);
+}
+
+static struct rq_envelope *
+rq_heap_first(struct rq_queue *rq)
+{
+	if (rq->q_heapsize == 0)
+		return (NULL);
+	return (rq->q_heap[0].evp);
+}
+
+static void
+rq_heap_up(struct rq_queue *rq, size_t idx)
+{
+	struct rq_heapent	e;
+	size_t			parent;
+
+	e = rq->q_heap[idx];
+	while (idx) {
+		parent = (idx - 1) / RQ_HEAP_ARITY;
+		if (!rq_heap_lt(&e, &rq->q_heap[parent]))
+			break;
+		rq->q_heap[idx] = rq->q_heap[parent];
+		rq->q_heap[idx].evp->t_heapidx = idx;
+		idx = parent;
+	}
+	rq->q_heap[idx] = e;
+	e.evp->t_heapidx = idx;
+}
+
+static void
+rq_heap_down(struct rq_queue *rq, size_t idx)
+{
+	struct rq_heapent	e;
+	size_t			child, last, best;
+
+	e = rq->q_heap[idx];
+	for (;;) {
+		child = idx * RQ_HEAP_ARITY + 1;
+		if (child >= rq->q_heapsize)
+			break;
+		last = child + RQ_HEAP_ARITY;
+		if (last > rq->q_heapsize)
+			last = rq->q_heapsize;
+		for (best = child++; child < last; child++)
+			if (rq_heap_lt(&rq->q_heap[child], &rq->q_heap[best]))
+				best = child;
+		if (!rq_heap_lt(&rq->q_heap[best], &e))
+			break;
+		rq->q_heap[idx] = rq->q_heap[best];
+		rq->q_heap[idx].evp->t_heapidx = idx;
+		idx = best;
+	}
+	rq->q_heap[idx] = e;
+	e.evp->t_heapidx = idx;
+}
+
+static int
+rq_heap_lt(const struct rq_heapent *h1, const struct rq_heapent *h2)
+{
+	if (h1->ref != h2->ref)
+		return (h1->ref < h2->ref);
+
+	return (h1->evp->evpid < h2->evp->evpid);
 }
 
 static void
 rq_queue_init(struct rq_queue *rq)
 {
+	int	i;
+
 	memset(rq, 0, sizeof *rq);
 	tree_init(&rq->messages);
 	TAILQ_INIT(&rq->q_pending);
 	TAILQ_INIT(&rq->q_inflight);
-	TAILQ_INIT(&rq->q_mta);
-	TAILQ_INIT(&rq->q_mda);
-	TAILQ_INIT(&rq->q_bounce);
+	tree_init(&rq->q_mtadest);
+	for (i = 0; i < PRIO_COUNT; i++) {
+		TAILQ_INIT(&rq->q_mta[i]);
+		TAILQ_INIT(&rq->q_mda[i]);
+		TAILQ_INIT(&rq->q_bounce[i]);
+	}
 	TAILQ_INIT(&rq->q_update);
 	TAILQ_INIT(&rq->q_expired);
 	TAILQ_INIT(&rq->q_removed);
-	SPLAY_INIT(&rq->q_priotree);
 }
 
 static void
@@ -778,7 +1386,7 @@ rq_queue_merge(struct rq_queue *rq, struct rq_queue *update)
 	struct rq_message	*message, *tomessage;
 	struct rq_envelope	*envelope;
 	uint64_t		 id;
-	void			*i;
+	size_t			 i;
 
 	while (tree_poproot(&update->messages, &id, (void*)&message)) {
 		if ((tomessage = tree_get(&rq->messages, id)) == NULL) {
@@ -787,44 +1395,57 @@ rq_queue_merge(struct rq_queue *rq, struct rq_queue *update)
 			continue;
 		}
 		/* need to re-link all envelopes before merging them */
-		i = NULL;
-		while ((tree_iter(&message->envelopes, &i, &id,
-		    (void*)&envelope)))
+		for (i = 0; i < message->count; i++) {
+			if ((envelope = message->envelopes[i].evp) == NULL)
+				continue;
 			envelope->message = tomessage;
-		tree_merge(&tomessage->envelopes, &message->envelopes);
-		free(message);
+			rq_message_add(tomessage, envelope);
+		}
+		free(message->envelopes);
+		rq_slab_put(&message_slab, message);
 		stat_decrement("scheduler.ramqueue.message", 1);
 	}
 
-	/* Sorted insert in the pending queue */
+	/* the heap is fed in steps, see rq_queue_merge_step() */
 	while ((envelope = TAILQ_FIRST(&update->q_pending))) {
 		TAILQ_REMOVE(&update->q_pending, envelope, entry);
-		sorted_insert(rq, envelope);
+		TAILQ_INSERT_TAIL(&rq->q_pending, envelope, entry);
 	}
 
 	rq->evpcount += update->evpcount;
 }
 
+static void
+rq_queue_merge_step(struct rq_queue *rq, size_t count)
+{
+	struct rq_envelope	*evp;
+
+	while (count-- && (evp = TAILQ_FIRST(&rq->q_pending))) {
+		TAILQ_REMOVE(&rq->q_pending, evp, entry);
+		rq_heap_insert(rq, evp);
+	}
+}
+
 static void
 rq_queue_schedule(struct rq_queue *rq)
 {
 	struct rq_envelope	*evp;
 
-	while ((evp = TAILQ_FIRST(&rq->q_pending))) {
-		if (evp->sched > currtime && evp->expire > currtime)
+	while ((evp = rq_heap_first(rq))) {
+		if (rq_time(evp->sched) > currtime &&
+		    rq_time(evp->expire) > currtime)
 			break;
 
 		if (evp->state != RQ_EVPSTATE_PENDING)
 			errx(1, "evp:%016" PRIx64 " flags=0x%x", evp->evpid,
 			    evp->flags);
 
-		if (evp->expire <= currtime) {
-			TAILQ_REMOVE(&rq->q_pending, evp, entry);
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+		if (rq_time(evp->expire) <= currtime) {
+			rq_heap_remove(rq, evp);
 			TAILQ_INSERT_TAIL(&rq->q_expired, evp, entry);
 			evp->state = RQ_EVPSTATE_SCHEDULED;
 			evp->flags |= RQ_ENVELOPE_EXPIRED;
-			evp->t_scheduled = currtime;
+			evp->t_state = rq_reltime(currtime);
 			continue;
 		}
 		rq_envelope_schedule(rq, evp);
@@ -846,11 +1467,11 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 		if (evp->flags & RQ_ENVELOPE_UPDATE)
 			return &rq->q_update;
 		if (evp->type == D_MTA)
-			return &rq->q_mta;
+			return rq_mta_list(rq, evp->priority, evp->destkey);
 		if (evp->type == D_MDA)
-			return &rq->q_mda;
+			return &rq->q_mda[evp->priority];
 		if (evp->type == D_BOUNCE)
-			return &rq->q_bounce;
+			return &rq->q_bounce[evp->priority];
 		errx(1, "%016" PRIx64 " bad evp type %d", evp->evpid, evp->type);
 
 	case RQ_EVPSTATE_INFLIGHT:
@@ -864,21 +1485,34 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 	return (NULL);
 }
 
+/* take a pending envelope off the heap, or off the merge list */
+static void
+rq_envelope_unpend(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	if (rq_heap_has(rq, evp))
+		rq_heap_remove(rq, evp);
+	else
+		TAILQ_REMOVE(&rq->q_pending, evp, entry);
+}
+
 static void
 rq_envelope_schedule(struct rq_queue *rq, struct rq_envelope *evp)
 {
 	struct rq_holdq	*hq;
 	struct evplist	*q = NULL;
 
+	if (evp->state == RQ_EVPSTATE_SCHEDULED)
+		return;
+
 	switch (evp->type) {
 	case D_MTA:
-		q = &rq->q_mta;
+		q = rq_mta_list(rq, evp->priority, evp->destkey);
 		break;
 	case D_MDA:
-		q = &rq->q_mda;
+		q = &rq->q_mda[evp->priority];
 		break;
 	case D_BOUNCE:
-		q = &rq->q_bounce;
+		q = &rq->q_bounce[evp->priority];
 		break;
 	}
 
@@ -895,14 +1529,14 @@ rq_envelope_schedule(struct rq_queue *rq, struct rq_envelope *evp)
 		evp->holdq = 0;
 		stat_decrement("scheduler.ramqueue.hold", 1);
 	}
-	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
-		TAILQ_REMOVE(&rq->q_pending, evp, entry);
-		SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
-	}
+	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
+		rq_envelope_unpend(rq, evp);
 
-	TAILQ_INSERT_TAIL(q, evp, entry);
+	/* a suspended envelope is queued again when resumed */
+	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
+		TAILQ_INSERT_TAIL(q, evp, entry);
 	evp->state = RQ_EVPSTATE_SCHEDULED;
-	evp->t_scheduled = currtime;
+	evp->t_state = rq_reltime(currtime);
 }
 
 static int
@@ -933,15 +1567,17 @@ rq_envelope_remove(struct rq_queue *rq, struct rq_envelope *evp)
 	}
 	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
 		evl = rq_envelope_list(rq, evp);
-		TAILQ_REMOVE(evl, evp, entry);
 		if (evl == &rq->q_pending)
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			rq_envelope_unpend(rq, evp);
+		else
+			TAILQ_REMOVE(evl, evp, entry);
 	}
 
 	TAILQ_INSERT_TAIL(&rq->q_removed, evp, entry);
 	evp->state = RQ_EVPSTATE_SCHEDULED;
 	evp->flags |= RQ_ENVELOPE_REMOVED;
-	evp->t_scheduled = currtime;
+	evp->flags &= ~RQ_ENVELOPE_SUSPEND;
+	evp->t_state = rq_reltime(currtime);
 
 	return (1);
 }
@@ -968,9 +1604,10 @@ rq_envelope_suspend(struct rq_queue *rq, struct rq_envelope *evp)
 	}
 	else if (evp->state != RQ_EVPSTATE_INFLIGHT) {
 		evl = rq_envelope_list(rq, evp);
-		TAILQ_REMOVE(evl, evp, entry);
 		if (evl == &rq->q_pending)
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			rq_envelope_unpend(rq, evp);
+		else
+			TAILQ_REMOVE(evl, evp, entry);
 	}
 
 	evp->flags |= RQ_ENVELOPE_SUSPEND;
@@ -989,7 +1626,7 @@ rq_envelope_resume(struct rq_queue *rq, struct rq_envelope *evp)
 	if (evp->state != RQ_EVPSTATE_INFLIGHT) {
 		evl = rq_envelope_list(rq, evp);
 		if (evl == &rq->q_pending)
-			sorted_insert(rq, evp);
+			rq_heap_insert(rq, evp);
 		else
 			TAILQ_INSERT_TAIL(evl, evp, entry);
 	}
@@ -999,17 +1636,49 @@ rq_envelope_resume(struct rq_queue *rq, struct rq_envelope *evp)
 	return (1);
 }
 
+/* EF_* flags and reference time as reported to smtpctl */
+static uint16_t
+rq_envelope_state(struct rq_envelope *evp, time_t *t)
+{
+	uint16_t	flags = 0;
+
+	*t = 0;
+	if (evp->state == RQ_EVPSTATE_PENDING) {
+		*t = rq_time(evp->sched);
+		flags = EF_PENDING;
+	}
+	else if (evp->state == RQ_EVPSTATE_SCHEDULED) {
+		*t = rq_time(evp->t_state);
+		flags = EF_PENDING;
+	}
+	else if (evp->state == RQ_EVPSTATE_INFLIGHT) {
+		*t = rq_time(evp->t_state);
+		flags = EF_INFLIGHT;
+	}
+	else if (evp->state == RQ_EVPSTATE_HELD) {
+		/* same as scheduled */
+		*t = rq_time(evp->t_state);
+		flags = EF_PENDING;
+		flags |= EF_HOLD;
+	}
+	if (evp->flags & RQ_ENVELOPE_SUSPEND)
+		flags |= EF_SUSPEND;
+
+	return (flags);
+}
+
 static void
 rq_envelope_delete(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	tree_xpop(&evp->message->envelopes, evp->evpid);
-	if (tree_empty(&evp->message->envelopes)) {
+	rq_message_del(evp->message, evp);
+	if (evp->message->live == 0) {
 		tree_xpop(&rq->messages, evp->message->msgid);
-		free(evp->message);
+		free(evp->message->envelopes);
+		rq_slab_put(&message_slab, evp->message);
 		stat_decrement("scheduler.ramqueue.message", 1);
 	}
 
-	free(evp);
+	rq_slab_put(&envelope_slab, evp);
 	rq->evpcount--;
 	stat_decrement("scheduler.ramqueue.envelope", 1);
 }
@@ -1030,32 +1699,32 @@ rq_envelope_to_text(struct rq_envelope *e)
 		strlcat(buf, "mta", sizeof buf);
 
 	snprintf(t, sizeof t, ",expire=%s",
-	    duration_to_text(e->expire - currtime));
+	    duration_to_text(rq_time(e->expire) - currtime));
 	strlcat(buf, t, sizeof buf);
 
 
 	switch (e->state) {
 	case RQ_EVPSTATE_PENDING:
 		snprintf(t, sizeof t, ",pending=%s",
-		    duration_to_text(e->sched - currtime));
+		    duration_to_text(rq_time(e->sched) - currtime));
 		strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_SCHEDULED:
 		snprintf(t, sizeof t, ",scheduled=%s",
-		    duration_to_text(currtime - e->t_scheduled));
+		    duration_to_text(currtime - rq_time(e->t_state)));
 		strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_INFLIGHT:
 		snprintf(t, sizeof t, ",inflight=%s",
-		    duration_to_text(currtime - e->t_inflight));
+		    duration_to_text(currtime - rq_time(e->t_state)));
 		strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_HELD:
 		snprintf(t, sizeof t, ",held=%s",
-		    duration_to_text(currtime - e->t_inflight));
+		    duration_to_text(currtime - rq_time(e->t_state)));
 		strlcat(buf, t, sizeof buf);
 		break;
 	default:
@@ -1078,38 +1747,19 @@ static void
 rq_queue_dump(struct rq_queue *rq, const char * name)
 {
 	struct rq_message	*message;
-	struct rq_envelope	*envelope;
-	void			*i, *j;
+	void			*i;
 	uint64_t		 id;
+	size_t			 j;
 
 	log_debug("debug: /--- ramqueue: %s", name);
 
 	i = NULL;
 	while ((tree_iter(&rq->messages, &i, &id, (void*)&message))) {
 		log_debug("debug: | msg:%08" PRIx32, message->msgid);
-		j = NULL;
-		while ((tree_iter(&message->envelopes, &j, &id,
-		    (void*)&envelope)))
-			log_debug("debug: |   %s",
-			    rq_envelope_to_text(envelope));
+		for (j = 0; j < message->count; j++)
+			if (message->envelopes[j].evp)
+				log_debug("debug: |   %s", rq_envelope_to_text(
+				    message->envelopes[j].evp));
 	}
 	log_debug("debug: \\---");
 }
-
-static int
-rq_envelope_cmp(struct rq_envelope *e1, struct rq_envelope *e2)
-{
-	time_t	ref1, ref2;
-
-	ref1 = (e1->sched < e1->expire) ? e1->sched : e1->expire;
-	ref2 = (e2->sched < e2->expire) ? e2->sched : e2->expire;
-	if (ref1 != ref2)
-		return (ref1 < ref2) ? -1 : 1;
-
-	if (e1->evpid != e2->evpid)
-		return (e1->evpid < e2->evpid) ? -1 : 1;
-
-	return 0;
-}
-
-SPLAY_GENERATE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
@@ -23,6 +23,9 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
 #include <err.h>
 #include <errno.h>
 #include <event.h>
@@ -51,16 +54,47 @@ static void smtp_accept(int, short, void *);
 static int smtp_enqueue(uid_t *);
 static int smtp_can_accept(void);
 static void smtp_setup_listeners(void);
+static int smtp_ratelimit(struct listener *, const struct sockaddr_storage *);
+static int64_t smtp_ratelimit_max(const struct listener *);
+static void smtp_ratelimit_expire(int, short, void *);
 
 #define	SMTP_FD_RESERVE	5
 static size_t	sessions;
 
+#define	SMTP_RATE_NETBLOCK4	24	/* prefix lengths sharing a bucket */
+#define	SMTP_RATE_NETBLOCK6	64
+#define	SMTP_RATE_EXPIRE	60
+
+/*
+ * Token bucket per listener and source netblock.  A listener limited to
+ * n connections per minute gets back n tokens per second, up to 60 times
+ * its burst.  Each smtp process keeps its own buckets, so a connection
+ * costs 60 tokens times the number of smtp processes: together they admit
+ * no more than the limit.  A bucket always holds at least one connection.
+ */
+#define	SMTP_RATE_COST		((int64_t)60 * env->sc_smtp_procs)
+
+struct smtp_ratelimit {
+	char		 key[128];
+	struct listener	*l;
+	int64_t		 tokens;
+	time_t		 last;
+};
+
+static struct dict	ratelimits;
+static struct event	ev_ratelimit;
+
 static void
 smtp_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct msg	 m;
 	int		 v;
 
+	if (p->proc == PROC_CA) {
+		ca_reply(imsg);
+		return;
+	}
+
 	if (p->proc == PROC_LKA) {
 		switch (imsg->hdr.type) {
 		case IMSG_DNS_PTR:
@@ -89,6 +123,8 @@ smtp_imsg(struct mproc *p, struct imsg *imsg)
 		case IMSG_QUEUE_SUBMIT_ENVELOPE:
 		case IMSG_QUEUE_COMMIT_ENVELOPES:
 		case IMSG_QUEUE_COMMIT_MESSAGE:
+		case IMSG_QUEUE_MESSAGE_FILE:
+		case IMSG_QUEUE_CREDIT:
 			smtp_session_imsg(p, imsg);
 			return;
 
@@ -171,7 +207,7 @@ smtp_shutdown(void)
 }
 
 pid_t
-smtp(void)
+smtp(int shard)
 {
 	pid_t		 pid;
 	struct passwd	*pw;
@@ -183,6 +219,7 @@ smtp(void)
 		fatal("smtp: cannot fork");
 	case 0:
 		post_fork(PROC_SMTP);
+		smtp_shard = shard;
 		break;
 	default:
 		return (pid);
@@ -223,8 +260,11 @@ smtp(void)
 	config_peer(PROC_LKA);
 	config_peer(PROC_MFA);
 	config_peer(PROC_QUEUE);
+	config_peer(PROC_CA);
 	config_done();
 
+	ca_init();
+
 	if (event_dispatch() < 0)
 		fatal("event_dispatch");
 	smtp_shutdown();
@@ -232,6 +272,57 @@ smtp(void)
 	return (0);
 }
 
+/*
+ * Session ids carry the process they belong to, so that the replies
+ * relayed by the lka, mfa and queue find their way back.
+ */
+uint64_t
+smtp_uid(void)
+{
+	uint64_t	id;
+
+	if (env->sc_smtp_procs <= 1)
+		return (generate_uid());
+
+	do {
+		id = generate_uid();
+		id = id - id % env->sc_smtp_procs + smtp_shard;
+	} while (id == 0 || id % env->sc_smtp_procs != (uint64_t)smtp_shard);
+
+	return (id);
+}
+
+struct mproc *
+smtp_peer(uint64_t reqid)
+{
+	if (env->sc_smtp_procs <= 1)
+		return (p_smtp);
+
+	return (p_smtps[reqid % env->sc_smtp_procs]);
+}
+
+void
+smtp_forward(struct imsg *imsg)
+{
+	size_t	i;
+
+	for (i = 0; i < env->sc_smtp_procs; i++)
+		m_forward(p_smtps[i], imsg);
+}
+
+void
+smtp_enable(int on)
+{
+	size_t	i;
+
+	for (i = 0; i < env->sc_smtp_procs; i++) {
+		if (on)
+			mproc_enable(p_smtps[i]);
+		else
+			mproc_disable(p_smtps[i]);
+	}
+}
+
 static void
 smtp_setup_listeners(void)
 {
@@ -250,6 +341,10 @@ smtp_setup_listeners(void)
 		if (setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, &opt,
 			sizeof(opt)) < 0)
 			fatal("smtpd: setsockopt");
+		/* each smtp process binds its own socket */
+		if (env->sc_smtp_procs > 1 && setsockopt(l->fd, SOL_SOCKET,
+			SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+			fatal("smtpd: setsockopt");
 		if (bind(l->fd, (struct sockaddr *)&l->ss, l->ss.ss_len) == -1)
 			fatal("smtpd: bind");
 	}
@@ -261,7 +356,6 @@ smtp_setup_events(void)
 	struct listener *l;
 	struct pki	*pki;
 	SSL_CTX		*ssl_ctx;
-	void		*iter;
 	const char	*k;
 
 	TAILQ_FOREACH(l, env->sc_listeners, entry) {
@@ -278,12 +372,28 @@ smtp_setup_events(void)
 			event_add(&l->ev, NULL);
 	}
 
-	iter = NULL;
-	while (dict_iter(env->sc_pki_dict, &iter, &k, (void **)&pki)) {
-		if (! ssl_setup((SSL_CTX **)&ssl_ctx, pki))
-			fatal("smtp_setup_events: ssl_setup failure");
-		dict_xset(env->sc_ssl_dict, k, ssl_ctx);
+	/*
+	 * Only the contexts of the listeners are built now, the others are
+	 * built on first use and kept in an LRU cache, see smtp_session.c.
+	 */
+	TAILQ_FOREACH(l, env->sc_listeners, entry) {
+		if (!(l->flags & F_SSL))
+			continue;
+		k = l->pki_name[0] ? l->pki_name : l->hostname;
+		if ((ssl_ctx = dict_get(env->sc_ssl_dict, k)) == NULL) {
+			if ((pki = dict_get(env->sc_pki_dict, k)) == NULL)
+				continue;
+			if (! ssl_setup((SSL_CTX **)&ssl_ctx, pki)) {
+				log_warnx("warn: smtp: no TLS for pki %s", k);
+				continue;
+			}
+			dict_xset(env->sc_ssl_dict, k, ssl_ctx);
+		}
+		if (l->flags & F_TLS_RESUME)
+			ssl_set_session_resume(ssl_ctx, env->sc_ticket_seed,
+			    sizeof env->sc_ticket_seed);
 	}
+	memset(env->sc_ticket_seed, 0, sizeof env->sc_ticket_seed);
 
 	purge_config(PURGE_PKI);
 
@@ -391,6 +501,11 @@ smtp_accept(int fd, short event, void *p)
 		fatal("smtp_accept");
 	}
 
+	if (listener->ratelimit && !smtp_ratelimit(listener, &ss)) {
+		close(sock);
+		return;
+	}
+
 	if (smtp_session(listener, sock, &ss, NULL) == -1) {
 		log_warn("warn: Failed to create SMTP session");
 		close(sock);
@@ -415,6 +530,113 @@ pause:
 	return;
 }
 
+static int
+smtp_ratelimit(struct listener *l, const struct sockaddr_storage *ss)
+{
+	struct smtp_ratelimit	*r;
+	struct timeval		 tv;
+	struct in_addr		 in;
+	struct in6_addr		 in6;
+	char			 buf[INET6_ADDRSTRLEN], key[128];
+	int64_t			 max;
+	time_t			 now;
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		in = ((const struct sockaddr_in *)ss)->sin_addr;
+		in.s_addr &= htonl(0xffffffffU << (32 - SMTP_RATE_NETBLOCK4));
+		inet_ntop(AF_INET, &in, buf, sizeof buf);
+		(void)snprintf(key, sizeof key, "%p %s/%d", l, buf,
+		    SMTP_RATE_NETBLOCK4);
+		break;
+	case AF_INET6:
+		in6 = ((const struct sockaddr_in6 *)ss)->sin6_addr;
+		memset(in6.s6_addr + SMTP_RATE_NETBLOCK6 / 8, 0,
+		    16 - SMTP_RATE_NETBLOCK6 / 8);
+		inet_ntop(AF_INET6, &in6, buf, sizeof buf);
+		(void)snprintf(key, sizeof key, "%p %s/%d", l, buf,
+		    SMTP_RATE_NETBLOCK6);
+		break;
+	default:
+		return (1);
+	}
+
+	now = time(NULL);
+	max = smtp_ratelimit_max(l);
+
+	if ((r = dict_get(&ratelimits, key)) == NULL) {
+		if (dict_root(&ratelimits, NULL, NULL) == 0) {
+			tv.tv_sec = SMTP_RATE_EXPIRE;
+			tv.tv_usec = 0;
+			evtimer_set(&ev_ratelimit, smtp_ratelimit_expire, NULL);
+			evtimer_add(&ev_ratelimit, &tv);
+		}
+		r = xcalloc(1, sizeof *r, "smtp_ratelimit");
+		(void)strlcpy(r->key, key, sizeof r->key);
+		r->l = l;
+		r->tokens = max;
+		r->last = now;
+		dict_xset(&ratelimits, r->key, r);
+		stat_increment("smtp.ratelimit.netblock", 1);
+	}
+
+	r->tokens += (int64_t)(now - r->last) * l->ratelimit;
+	if (r->tokens > max)
+		r->tokens = max;
+	r->last = now;
+
+	if (r->tokens < SMTP_RATE_COST) {
+		log_debug("debug: smtp: rate limit reached for %s", key);
+		stat_increment("smtp.ratelimit.refused", 1);
+		return (0);
+	}
+	r->tokens -= SMTP_RATE_COST;
+
+	return (1);
+}
+
+static int64_t
+smtp_ratelimit_max(const struct listener *l)
+{
+	int64_t	max;
+
+	max = (int64_t)l->rateburst * 60;
+	if (max < SMTP_RATE_COST)
+		max = SMTP_RATE_COST;
+	return (max);
+}
+
+/*
+ * Forget the buckets that have refilled since they were last used.
+ */
+static void
+smtp_ratelimit_expire(int fd, short event, void *p)
+{
+	struct smtp_ratelimit	*r;
+	struct dict		 keep;
+	struct timeval		 tv;
+	time_t			 now;
+
+	now = time(NULL);
+	dict_init(&keep);
+	while (dict_poproot(&ratelimits, (void **)&r)) {
+		if (r->tokens + (int64_t)(now - r->last) * r->l->ratelimit <
+		    smtp_ratelimit_max(r->l)) {
+			dict_xset(&keep, r->key, r);
+			continue;
+		}
+		free(r);
+		stat_decrement("smtp.ratelimit.netblock", 1);
+	}
+	ratelimits = keep;
+
+	if (dict_root(&ratelimits, NULL, NULL)) {
+		tv.tv_sec = SMTP_RATE_EXPIRE;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_ratelimit, &tv);
+	}
+}
+
 static int
 smtp_can_accept(void)
 {
@@ -0,0 +1,192 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Parsing of the client commands, done in place on the input line and
+ * kept apart from the session so that it can be exercised on its own.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <imsg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "smtpd.h"
+
+/* indexed on enum smtp_command, with the character ending the verb */
+static struct {
+	const char	*verb;
+	size_t		 len;
+	char		 sep;
+} commands[] = {
+	{ "HELO",	4,	' ' },
+	{ "EHLO",	4,	' ' },
+	{ "STARTTLS",	8,	' ' },
+	{ "AUTH",	4,	' ' },
+	{ "MAIL FROM",	9,	':' },
+	{ "RCPT TO",	7,	':' },
+	{ "DATA",	4,	' ' },
+	{ "BDAT",	4,	' ' },
+	{ "RSET",	4,	' ' },
+	{ "QUIT",	4,	' ' },
+	{ "HELP",	4,	' ' },
+	{ "WIZ",	3,	' ' },
+	{ "NOOP",	4,	' ' },
+};
+
+/*
+ * Find the command of a line and where its arguments start, past the
+ * blanks.  The verb is ended in place, the arguments are NULL if there
+ * is nothing after it.  Only one entry of the table can match the
+ * first letter, and the second one sets HELO/HELP and RCPT/RSET apart.
+ */
+int
+smtp_command_parse(char *line, char **args)
+{
+	char	*p;
+	int	 cmd;
+
+	*args = NULL;
+
+	switch (toupper((unsigned char)line[0])) {
+	case 'A':
+		cmd = CMD_AUTH;
+		break;
+	case 'B':
+		cmd = CMD_BDAT;
+		break;
+	case 'D':
+		cmd = CMD_DATA;
+		break;
+	case 'E':
+		cmd = CMD_EHLO;
+		break;
+	case 'H':
+		if (line[1] == '\0' || line[2] == '\0')
+			return (-1);
+		cmd = (toupper((unsigned char)line[3]) == 'P') ?
+		    CMD_HELP : CMD_HELO;
+		break;
+	case 'M':
+		cmd = CMD_MAIL_FROM;
+		break;
+	case 'N':
+		cmd = CMD_NOOP;
+		break;
+	case 'Q':
+		cmd = CMD_QUIT;
+		break;
+	case 'R':
+		cmd = (toupper((unsigned char)line[1]) == 'C') ?
+		    CMD_RCPT_TO : CMD_RSET;
+		break;
+	case 'S':
+		cmd = CMD_STARTTLS;
+		break;
+	case 'W':
+		cmd = CMD_WIZ;
+		break;
+	default:
+		return (-1);
+	}
+
+	if (strncasecmp(line, commands[cmd].verb, commands[cmd].len))
+		return (-1);
+
+	p = line + commands[cmd].len;
+	if (*p != '\0') {
+		if (*p != commands[cmd].sep)
+			return (-1);
+		*p++ = '\0';
+		while (isspace((unsigned char)*p))
+			p++;
+		*args = p;
+	}
+	/* "MAIL FROM" and "RCPT TO" never come without the colon */
+	else if (commands[cmd].sep != ' ')
+		return (-1);
+
+	return (cmd);
+}
+
+/*
+ * Extract the <path> of a MAIL FROM or RCPT TO into maddr, dropping an
+ * obsolete source route, and point args to what follows it.
+ */
+int
+smtp_mailaddr(struct mailaddr *maddr, char *line, int mailfrom, char **args,
+    const char *domain)
+{
+	char	*e, *user, *at, *p;
+	size_t	 len;
+
+	if (line == NULL)
+		return (0);
+
+	if (*line != '<')
+		return (0);
+
+	e = strchr(line, '>');
+	if (e == NULL)
+		return (0);
+	*e++ = '\0';
+	while (*e == ' ')
+		e++;
+	*args = e;
+
+	memset(maddr, 0, sizeof *maddr);
+
+	user = line + 1;
+	if ((at = strrchr(user, '@')) != NULL) {
+		*at++ = '\0';
+		if (strlcpy(maddr->domain, at, sizeof maddr->domain)
+		    >= sizeof maddr->domain)
+			return (0);
+	}
+	if ((p = strchr(user, ':')) != NULL)
+		user = p + 1;
+	if ((len = strlen(user)) >= sizeof maddr->user)
+		return (0);
+	memcpy(maddr->user, user, len + 1);
+
+	if (!valid_localpart(maddr->user) ||
+	    !valid_domainpart(maddr->domain)) {
+		/* We accept empty sender for MAIL FROM */
+		if (mailfrom &&
+		    maddr->user[0] == '\0' &&
+		    maddr->domain[0] == '\0')
+			return (1);
+
+		/* We accept empty domain for RCPT TO if user is postmaster */
+		if (!mailfrom &&
+		    strcasecmp(maddr->user, "postmaster") == 0 &&
+		    maddr->domain[0] == '\0') {
+			(void)strlcpy(maddr->domain, domain,
+			    sizeof(maddr->domain));
+			return (1);
+		}
+
+		return (0);
+	}
+
+	return (1);
+}
@@ -32,6 +32,7 @@
 #include <event.h>
 #include <imsg.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <openssl/ssl.h>
 #include <resolv.h>
 #include <stdio.h>
@@ -49,6 +50,9 @@
 #define SMTP_KICK_CMD		5
 #define SMTP_KICK_RCPTFAIL	50
 
+#define SMTP_SESSION_POOL	32
+#define SMTP_IOBUF_MIN		256
+
 enum smtp_phase {
 	PHASE_INIT = 0,
 	PHASE_SETUP,
@@ -65,6 +69,7 @@ enum smtp_state {
 	STATE_AUTH_PASSWORD,
 	STATE_AUTH_FINALIZE,
 	STATE_BODY,
+	STATE_BDAT,
 	STATE_QUIT,
 };
 
@@ -78,30 +83,20 @@ enum session_flags {
 	SF_VERIFIED		= 0x0040,
 	SF_MFACONNSENT		= 0x0080,
 	SF_BADINPUT		= 0x0100,
+	SF_PTRWAIT		= 0x0200,	/* hostname not resolved yet */
+	SF_PTRHOLD		= 0x0400,	/* MAIL held until it is */
 };
 
 enum message_flags {
 	MF_QUEUE_ENVELOPE_FAIL	= 0x0001,
+	MF_BDAT			= 0x0002,	/* body sent in chunks */
+	MF_BDAT_LAST		= 0x0004,
+	MF_BDAT_CR		= 0x0008,	/* chunk ended with CR */
 	MF_ERROR_SIZE		= 0x1000,
 	MF_ERROR_IO		= 0x2000,
 };
 #define MF_ERROR	(MF_ERROR_SIZE | MF_ERROR_IO)
 
-enum smtp_command {
-	CMD_HELO = 0,
-	CMD_EHLO,
-	CMD_STARTTLS,
-	CMD_AUTH,
-	CMD_MAIL_FROM,
-	CMD_RCPT_TO,
-	CMD_DATA,
-	CMD_RSET,
-	CMD_QUIT,
-	CMD_HELP,
-	CMD_WIZ,
-	CMD_NOOP,
-};
-
 struct smtp_rcpt {
 	TAILQ_ENTRY(smtp_rcpt)	 entry;
  	struct mailaddr		 maddr;
@@ -144,9 +139,13 @@ struct smtp_session {
 	size_t			 datalen;
 	struct iobuf		 dataiobuf;
 	struct io		 dataio;
+	FILE			*datafp;	/* queue file, without filters */
 	int			 dataeom;
+	size_t			 bdatleft;
+	struct evptrace		 trace;
 
 	struct event		 pause;
+	struct event		 pipeline;	/* next command in group */
 };
 
 #define ADVERTISE_TLS(s) \
@@ -156,9 +155,11 @@ struct smtp_session {
 	((s)->listener->flags & F_AUTH && (s)->flags & SF_SECURE && \
 	 !((s)->flags & SF_AUTHENTICATED))
 
-static int smtp_mailaddr(struct mailaddr *, char *, int, char **, const char *);
 static void smtp_session_init(void);
+static struct smtp_session *smtp_session_alloc(void);
+static void smtp_session_release(struct smtp_session *);
 static int smtp_lookup_servername(struct smtp_session *);
+static int smtp_wait_ptr(struct smtp_session *);
 static void smtp_connected(struct smtp_session *);
 static void smtp_send_banner(struct smtp_session *);
 static void smtp_mfa_response(struct smtp_session *, int, uint32_t,
@@ -174,8 +175,17 @@ static int smtp_parse_rcpt_args(struct smtp_session *, char *);
 static void smtp_rfc4954_auth_plain(struct smtp_session *, char *);
 static void smtp_rfc4954_auth_login(struct smtp_session *, char *);
 static void smtp_message_line(struct smtp_session *, const char *);
+static int smtp_message_direct(struct smtp_session *);
+static void smtp_message_write(struct smtp_session *, const char *, size_t);
+static void smtp_message_chunk(struct smtp_session *, char *, size_t);
+static void smtp_bdat_chunk(struct smtp_session *);
+static void smtp_message_commit(struct smtp_session *);
 static void smtp_message_reset(struct smtp_session *, int);
+static int smtp_data_close(struct smtp_session *);
 static void smtp_wait_mfa(struct smtp_session *s, int);
+static int smtp_pipelined(struct smtp_session *, const char *);
+static void smtp_next(struct smtp_session *);
+static void smtp_next_command(int, short, void *);
 static void smtp_free(struct smtp_session *, const char *);
 static const char *smtp_strstate(int);
 static int smtp_verify_certificate(struct smtp_session *);
@@ -183,22 +193,8 @@ static uint8_t dsn_notify_str_to_uint8(const char *);
 static void smtp_auth_failure_pause(struct smtp_session *);
 static void smtp_auth_failure_resume(int, short, void *);
 static int smtp_sni_callback(SSL *, int *, void *);
-
-static struct { int code; const char *cmd; } commands[] = {
-	{ CMD_HELO,		"HELO" },
-	{ CMD_EHLO,		"EHLO" },
-	{ CMD_STARTTLS,		"STARTTLS" },
-	{ CMD_AUTH,		"AUTH" },
-	{ CMD_MAIL_FROM,	"MAIL FROM" },
-	{ CMD_RCPT_TO,		"RCPT TO" },
-	{ CMD_DATA,		"DATA" },
-	{ CMD_RSET,		"RSET" },
-	{ CMD_QUIT,		"QUIT" },
-	{ CMD_HELP,		"HELP" },
-	{ CMD_WIZ,		"WIZ" },
-	{ CMD_NOOP,		"NOOP" },
-	{ -1, NULL },
-};
+static SSL_CTX *smtp_ssl_ctx_get(const char *);
+static SSL_CTX *smtp_ssl_ctx_new(struct pki *);
 
 static struct tree wait_lka_ptr;
 static struct tree wait_lka_helo;
@@ -211,6 +207,28 @@ static struct tree wait_queue_commit;
 static struct tree wait_ssl_init;
 static struct tree wait_ssl_verify;
 
+/* share of new transactions accepted, lowered by the queue under load */
+static int queue_credit = QUEUE_CREDIT_MAX;
+
+/*
+ * The TLS contexts of the listeners are built at startup, in
+ * env->sc_ssl_dict.  The others are built on first use from what lka
+ * or the ca sends, and at most env->sc_pki_cache_size are kept.
+ */
+struct ssl_cache_entry {
+	TAILQ_ENTRY(ssl_cache_entry)	 entry;
+	char				 name[SMTPD_MAXPATHLEN];
+	SSL_CTX				*ctx;
+};
+
+static struct dict ssl_cache;
+static TAILQ_HEAD(, ssl_cache_entry) ssl_cache_lru;
+static size_t ssl_cache_count;
+
+/* freed sessions kept for reuse, most are short-lived */
+static struct smtp_session *session_pool[SMTP_SESSION_POOL];
+static size_t session_npool;
+
 static void
 smtp_session_init(void)
 {
@@ -227,6 +245,8 @@ smtp_session_init(void)
 		tree_init(&wait_queue_commit);
 		tree_init(&wait_ssl_init);
 		tree_init(&wait_ssl_verify);
+		dict_init(&ssl_cache);
+		TAILQ_INIT(&ssl_cache_lru);
 		init = 1;
 	}
 }
@@ -241,15 +261,15 @@ smtp_session(struct listener *listener, int sock,
 
 	smtp_session_init();
 
-	if ((s = calloc(1, sizeof(*s))) == NULL)
+	if ((s = smtp_session_alloc()) == NULL)
 		return (-1);
-	if (iobuf_init(&s->iobuf, SMTPD_MAXLINESIZE, SMTPD_MAXLINESIZE) == -1) {
-		free(s);
+	if (iobuf_init(&s->iobuf, SMTP_IOBUF_MIN, SMTPD_MAXLINESIZE) == -1) {
+		smtp_session_release(s);
 		return (-1);
 	}
 	TAILQ_INIT(&s->rcpts);
 
-	s->id = generate_uid();
+	s->id = smtp_uid();
 	s->listener = listener;
 	memmove(&s->ss, ss, sizeof(*ss));
 	io_init(&s->io, sock, s, smtp_io, &s->iobuf);
@@ -257,6 +277,7 @@ smtp_session(struct listener *listener, int sock,
 	io_set_write(&s->io);
 
 	io_init(&s->dataio, -1, NULL, NULL, NULL);
+	evtimer_set(&s->pipeline, smtp_next_command, s);
 
 	s->state = STATE_NEW;
 	s->phase = PHASE_INIT;
@@ -273,8 +294,12 @@ smtp_session(struct listener *listener, int sock,
 		if (smtp_lookup_servername(s))
 			smtp_connected(s);
 	} else {
+		/* resolve the client and our name for it at once */
+		s->flags |= SF_PTRWAIT;
 		dns_query_ptr(s->id, (struct sockaddr *)&s->ss);
 		tree_xset(&wait_lka_ptr, s->id, s);
+		if (smtp_lookup_servername(s) && !smtp_wait_ptr(s))
+			smtp_connected(s);
 	}
 
 	return (0);
@@ -289,15 +314,23 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 	struct smtp_rcpt		*rcpt;
 	void				*ssl;
 	char				 user[SMTPD_MAXLOGNAME];
+	char				 name[SMTPD_MAXHOSTNAMELEN];
+	struct pki			 pki;
 	struct msg			 m;
 	const char			*line, *helo;
 	uint64_t			 reqid, evpid;
 	uint32_t			 code, msgid;
-	int				 status, success, dnserror;
+	int				 status, success, file, dnserror;
 	X509				*x;
 	void				*ssl_ctx;
 
 	switch (imsg->hdr.type) {
+	case IMSG_QUEUE_CREDIT:
+		m_msg(&m, imsg);
+		m_get_int(&m, &queue_credit);
+		m_end(&m);
+		return;
+
 	case IMSG_DNS_PTR:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
@@ -307,10 +340,24 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		else
 			m_get_string(&m, &line);
 		m_end(&m);
-		s = tree_xpop(&wait_lka_ptr, reqid);
+		/* the session may be over already */
+		if ((s = tree_pop(&wait_lka_ptr, reqid)) == NULL)
+			return;
 		strlcpy(s->hostname, line, sizeof s->hostname);
-		if (smtp_lookup_servername(s))
-			smtp_connected(s);
+		s->flags &= ~SF_PTRWAIT;
+		if (s->state == STATE_NEW) {
+			if (tree_get(&wait_lka_helo, s->id) == NULL)
+				smtp_connected(s);
+			return;
+		}
+		log_info("smtp-in: New session %016"PRIx64" from host %s [%s]",
+		    s->id, s->hostname, ss_to_text(&s->ss));
+		if (s->flags & SF_PTRHOLD) {
+			/* the io was paused while reading, parse what is left */
+			s->flags &= ~SF_PTRHOLD;
+			io_resume(&s->io, IO_PAUSE_IN);
+			smtp_io(&s->io, IO_DATAIN);
+		}
 		return;
 
 	case IMSG_LKA_EXPAND_RCPT:
@@ -335,7 +382,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		case LKA_TEMPFAIL:
 			smtp_reply(s, "%s", line);
 		}
-		io_reload(&s->io);
+		smtp_next(s);
 		return;
 
 	case IMSG_LKA_HELO:
@@ -348,7 +395,8 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			strlcpy(s->smtpname, helo, sizeof(s->smtpname));
 		}
 		m_end(&m);
-		smtp_connected(s);
+		if (!smtp_wait_ptr(s))
+			smtp_connected(s);
 		return;
 
 	case IMSG_MFA_SMTP_RESPONSE:
@@ -375,6 +423,9 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			s->evp.id = msgid_to_evpid(msgid);
 			s->rcptcount = 0;
 			s->phase = PHASE_TRANSACTION;
+			memset(&s->trace, 0, sizeof(s->trace));
+			if (profiling & PROFILE_ENVELOPE)
+				s->trace.ts[EVPTRACE_ACCEPT] = evptrace_now();
 			smtp_reply(s, "250 %s: Ok",
 			    esc_code(ESC_STATUS_OK, ESC_OTHER_STATUS));
 		} else {
@@ -383,30 +434,43 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			smtp_enter_state(s, STATE_QUIT);
 		}
 		m_end(&m);
-		io_reload(&s->io);
+		smtp_next(s);
 		return;
 
 	case IMSG_QUEUE_MESSAGE_FILE:
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
 		m_get_int(&m, &success);
+		/* mfa hands over the queue file when no filter reads data */
+		file = 1;
+		if (p->proc == PROC_MFA)
+			m_get_int(&m, &file);
 		m_end(&m);
 		s = tree_xpop(&wait_queue_fd, reqid);
+		if (success && imsg->fd != -1 && file &&
+		    (s->datafp = fdopen(imsg->fd, "w")) == NULL) {
+			log_warn("warn: smtp: fdopen");
+			success = 0;
+		}
 		if (!success || imsg->fd == -1) {
 			if (imsg->fd != -1)
 				close(imsg->fd);
 			smtp_reply(s, "421 %s: Temporary Error",
 			    esc_code(ESC_STATUS_TEMPFAIL, ESC_OTHER_MAIL_SYSTEM_STATUS));
 			smtp_enter_state(s, STATE_QUIT);
-			io_reload(&s->io);
+			smtp_next(s);
 			return;
 		}
 
 		iobuf_init(&s->dataiobuf, 0, 0);
-		io_init(&s->dataio, imsg->fd, s, smtp_data_io, &s->dataiobuf);
 		s->dataeom = 0;
 
-		stat_increment("smtp.datapipe", 1);
+		/* either the queue file itself or the pipe into the filters */
+		if (s->datafp == NULL) {
+			io_init(&s->dataio, imsg->fd, s, smtp_data_io,
+			    &s->dataiobuf);
+			stat_increment("smtp.datapipe", 1);
+		}
 
 		iobuf_fqueue(&s->dataiobuf, "Received: ");
 		if (! (s->listener->flags & F_MASK_SOURCE)) {
@@ -449,13 +513,25 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		 */
 		s->datalen = iobuf_queued(&s->dataiobuf);
 
-		io_set_write(&s->dataio);
+		if (s->datafp) {
+			if (iobuf_flush(&s->dataiobuf, fileno(s->datafp)) < 0)
+				s->msgflags |= MF_ERROR_IO;
+			iobuf_clear(&s->dataiobuf);
+		}
+		else
+			io_set_write(&s->dataio);
+
+		if (s->msgflags & MF_BDAT) {
+			smtp_enter_state(s, STATE_BDAT);
+			smtp_bdat_chunk(s);
+			return;
+		}
 
 		smtp_enter_state(s, STATE_BODY);
 		smtp_reply(s, "354 Enter mail, end with \".\""
 		    " on a line by itself");
 
-		io_reload(&s->io);
+		smtp_next(s);
 		return;
 
 	case IMSG_QUEUE_SUBMIT_ENVELOPE:
@@ -503,7 +579,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			    esc_code(ESC_STATUS_OK, ESC_DESTINATION_ADDRESS_VALID),
 			    esc_description(ESC_DESTINATION_ADDRESS_VALID));
 		}
-		io_reload(&s->io);
+		smtp_next(s);
 		return;
 
 	case IMSG_QUEUE_COMMIT_MESSAGE:
@@ -519,7 +595,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			smtp_reply(s, "421 %s: Temporary failure",
 			    esc_code(ESC_STATUS_TEMPFAIL, ESC_OTHER_MAIL_SYSTEM_STATUS));
 			smtp_enter_state(s, STATE_QUIT);
-			io_reload(&s->io);
+			smtp_next(s);
 			return;
 		}
 
@@ -553,7 +629,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		s->phase = PHASE_SETUP;
 		smtp_message_reset(s, 0);
 		smtp_enter_state(s, STATE_HELO);
-		io_reload(&s->io);
+		smtp_next(s);
 		return;
 
 	case IMSG_LKA_AUTHENTICATE:
@@ -588,7 +664,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			fatalx("bad lka response");
 
 		smtp_enter_state(s, STATE_HELO);
-		io_reload(&s->io);
+		smtp_next(s);
 		return;
 
 	case IMSG_LKA_SSL_INIT:
@@ -602,33 +678,40 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 		}
 
-		resp_ca_cert = xmemdup(imsg->data, sizeof *resp_ca_cert, "smtp:ca_cert");
-		if (resp_ca_cert == NULL)
-			fatal(NULL);
-		resp_ca_cert->cert = xstrdup((char *)imsg->data +
-		    sizeof *resp_ca_cert, "smtp:ca_cert");
-
-		resp_ca_cert->key = xstrdup((char *)imsg->data +
-		    sizeof *resp_ca_cert + resp_ca_cert->cert_len,
-		    "smtp:ca_key");
-
 		if (s->listener->pki_name[0])
 			ssl_ctx = dict_get(env->sc_ssl_dict, s->listener->pki_name);
-		else
-			ssl_ctx = dict_get(env->sc_ssl_dict, s->smtpname);
+		else if ((ssl_ctx = dict_get(env->sc_ssl_dict,
+		    s->smtpname)) == NULL) {
+			xlowercase(name, s->smtpname, sizeof name);
+			if ((ssl_ctx = smtp_ssl_ctx_get(name)) == NULL) {
+				/* first use, build it from what lka sent */
+				memset(&pki, 0, sizeof pki);
+				strlcpy(pki.pki_name, name, sizeof pki.pki_name);
+				pki.pki_cert = (char *)imsg->data +
+				    sizeof *resp_ca_cert;
+				pki.pki_cert_len = resp_ca_cert->cert_len;
+				if (resp_ca_cert->dhparams_len) {
+					pki.pki_dhparams = pki.pki_cert +
+					    pki.pki_cert_len;
+					pki.pki_dhparams_len =
+					    resp_ca_cert->dhparams_len;
+				}
+				ssl_ctx = smtp_ssl_ctx_new(&pki);
+			}
+		}
+		if (ssl_ctx == NULL) {
+			log_info("smtp-in: Disconnecting session %016" PRIx64
+			    ": no TLS context", s->id);
+			smtp_free(s, "no TLS context");
+			return;
+		}
 
-		ssl = ssl_smtp_init(ssl_ctx,
-		    resp_ca_cert->cert, resp_ca_cert->cert_len,
-		    resp_ca_cert->key, resp_ca_cert->key_len,
-		    smtp_sni_callback, s);
+		/* the context holds the certificate, the ca process the key */
+		ssl = ssl_smtp_init(ssl_ctx, smtp_sni_callback, s);
+		if (ssl && s->listener->flags & F_TLS_RESUME)
+			SSL_clear_options(ssl, SSL_OP_NO_TICKET);
 		io_set_read(&s->io);
 		io_start_tls(&s->io, ssl);
-
-		memset(resp_ca_cert->cert, 0, resp_ca_cert->cert_len);
-		memset(resp_ca_cert->key, 0, resp_ca_cert->key_len);
-		free(resp_ca_cert->cert);
-		free(resp_ca_cert->key);
-		free(resp_ca_cert);
 		return;
 
 	case IMSG_LKA_SSL_VERIFY:
@@ -658,13 +741,14 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
     const char *line)
 {
 	struct ca_cert_req_msg		 req_ca_cert;
+	struct mproc			*p;
 
 	if (status == MFA_CLOSE) {
 		code = code ? code : 421;
 		line = line ? line : "Temporary failure";
 		smtp_reply(s, "%d %s", code, line);
 		smtp_enter_state(s, STATE_QUIT);
-		io_reload(&s->io);
+		smtp_next(s);
 		return;
 	}
 
@@ -682,7 +766,7 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 			req_ca_cert.reqid = s->id;
 			strlcpy(req_ca_cert.name, s->smtpname,
 			    sizeof req_ca_cert.name);
-			m_compose(p_lka, IMSG_LKA_SSL_INIT, 0, 0, -1,
+			m_compose(lka_peer(s->id), IMSG_LKA_SSL_INIT, 0, 0, -1,
 			    &req_ca_cert, sizeof(req_ca_cert));
 			tree_xset(&wait_ssl_init, s->id, s);
 			return;
@@ -695,7 +779,7 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 			code = code ? code : 530;
 			line = line ? line : "Hello rejected";
 			smtp_reply(s, "%d %s", code, line);
-			io_reload(&s->io);
+			smtp_next(s);
 			return;
 		}
 
@@ -711,6 +795,8 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 			smtp_reply(s, "250-ENHANCEDSTATUSCODES");
 			smtp_reply(s, "250-SIZE %zu", env->sc_maxsize);
 			smtp_reply(s, "250-DSN");
+			smtp_reply(s, "250-CHUNKING");
+			smtp_reply(s, "250-PIPELINING");
 			if (ADVERTISE_TLS(s))
 				smtp_reply(s, "250-STARTTLS");
 			if (ADVERTISE_AUTH(s))
@@ -719,7 +805,7 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 		}
 		s->kickcount = 0;
 		s->phase = PHASE_SETUP;
-		io_reload(&s->io);
+		smtp_next(s);
 		return;
 
 	case IMSG_MFA_REQ_MAIL:
@@ -727,7 +813,7 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 			code = code ? code : 530;
 			line = line ? line : "Sender rejected";
 			smtp_reply(s, "%d %s", code, line);
-			io_reload(&s->io);
+			smtp_next(s);
 			return;
 		}
 
@@ -749,14 +835,15 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 				    ": too many failed RCPT", s->id);
 				smtp_enter_state(s, STATE_QUIT);
 			}
-			io_reload(&s->io);
+			smtp_next(s);
 			return;
 		}
 
-		m_create(p_lka, IMSG_LKA_EXPAND_RCPT, 0, 0, -1);
-		m_add_id(p_lka, s->id);
-		m_add_envelope(p_lka, &s->evp);
-		m_close(p_lka);
+		p = lka_peer(s->id);
+		m_create(p, IMSG_LKA_EXPAND_RCPT, 0, 0, -1);
+		m_add_id(p, s->id);
+		m_add_envelope(p, &s->evp);
+		m_close(p);
 		tree_xset(&wait_lka_rcpt, s->id, s);
 		return;
 
@@ -765,12 +852,17 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 			code = code ? code : 530;
 			line = line ? line : "Message rejected";
 			smtp_reply(s, "%d %s", code, line);
-			io_reload(&s->io);
+			/* the chunk that follows cannot be told from commands */
+			if (s->msgflags & MF_BDAT)
+				smtp_enter_state(s, STATE_QUIT);
+			smtp_next(s);
 			return;
 		}
 		m_create(p_queue, IMSG_QUEUE_MESSAGE_FILE, 0, 0, -1);
 		m_add_id(p_queue, s->id);
 		m_add_msgid(p_queue, evpid_to_msgid(s->evp.id));
+		/* without filters, the body does not need to go through mfa */
+		m_add_int(p_queue, dict_root(&env->sc_filters, NULL, NULL) == 0);
 		m_close(p_queue);
 		tree_xset(&wait_queue_fd, s->id, s);
 		return;
@@ -782,16 +874,11 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 			line = line ? line : "Message rejected";
 			smtp_reply(s, "%d %s", code, line);
 			/* XXX enough? call rollback? */
-			io_reload(&s->io);
+			smtp_next(s);
 			return;
 		}
 
-		s->phase = PHASE_SETUP;
-		m_create(p_queue, IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
-		m_add_id(p_queue, s->id);
-		m_add_msgid(p_queue, evpid_to_msgid(s->evp.id));
-		m_close(p_queue);
-		tree_xset(&wait_queue_commit, s->id, s);
+		smtp_message_commit(s);
 		return;
 
 	default:
@@ -804,6 +891,7 @@ smtp_io(struct io *io, int evt)
 {
 	struct ca_cert_req_msg	req_ca_cert;
 	struct smtp_session    *s = io->arg;
+	struct timeval		tv;
 	char		       *line;
 	size_t			len, i;
 	X509		       *x;
@@ -821,6 +909,10 @@ smtp_io(struct io *io, int evt)
 		s->kickcount = 0;
 		s->phase = PHASE_INIT;
 
+		if (s->listener->flags & F_TLS_RESUME)
+			stat_increment(SSL_session_reused(s->io.ssl) ?
+			    "smtp.tls.session.hit" : "smtp.tls.session.miss", 1);
+
 		if (smtp_verify_certificate(s)) {
 			io_pause(&s->io, IO_PAUSE_IN);
 			break;
@@ -857,6 +949,26 @@ smtp_io(struct io *io, int evt)
 		break;
 
 	case IO_DATAIN:
+		if (s->state == STATE_BDAT) {
+			smtp_bdat_chunk(s);
+			return;
+		}
+
+		if (s->state == STATE_BODY && s->datafp &&
+		    smtp_message_direct(s) == 0) {
+			iobuf_normalize(&s->iobuf);
+			return;
+		}
+
+		/* the envelope needs the client hostname */
+		if (s->flags & SF_PTRWAIT && s->state != STATE_BODY &&
+		    iobuf_len(&s->iobuf) >= 4 &&
+		    strncasecmp(iobuf_data(&s->iobuf), "MAIL", 4) == 0) {
+			s->flags |= SF_PTRHOLD;
+			io_pause(io, IO_PAUSE_IN);
+			return;
+		}
+
 	    nextline:
 		line = iobuf_getline(&s->iobuf, &len);
 		if ((line == NULL && iobuf_len(&s->iobuf) >= SMTPD_MAXLINESIZE) ||
@@ -866,6 +978,7 @@ smtp_io(struct io *io, int evt)
 			    esc_code(ESC_STATUS_PERMFAIL, ESC_OTHER_STATUS));
 			smtp_enter_state(s, STATE_QUIT);
 			io_set_write(io);
+			io_resume(io, IO_PAUSE_OUT);
 			return;
 		}
 
@@ -892,22 +1005,31 @@ smtp_io(struct io *io, int evt)
 			goto nextline;
 		}
 
-		/* Pipelining not supported */
-		if (iobuf_len(&s->iobuf)) {
+		/* Only a command group may be pipelined, and a chunk follows BDAT */
+		if (iobuf_len(&s->iobuf) && strncasecmp(line, "BDAT ", 5) &&
+		    !smtp_pipelined(s, line)) {
 			s->flags |= SF_BADINPUT;
 			smtp_reply(s, "500 %s %s: Pipelining not supported",
 			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 			    esc_description(ESC_INVALID_COMMAND));
 			smtp_enter_state(s, STATE_QUIT);
 			io_set_write(io);
+			io_resume(io, IO_PAUSE_OUT);
 			return;
 		}
 
+		/* Hold the replies until the last command of the group */
+		io_set_write(io);
+		if (memchr(iobuf_data(&s->iobuf), '\n', iobuf_len(&s->iobuf)) &&
+		    smtp_pipelined(s, line))
+			io_pause(io, IO_PAUSE_OUT);
+		else if (io->flags & IO_PAUSE_OUT)
+			io_resume(io, IO_PAUSE_OUT);
+
 		/* End of body */
 		if (s->state == STATE_BODY) {
 			log_debug("debug: smtp: %p: eom", s);
 			iobuf_normalize(&s->iobuf);
-			io_set_write(io);
 			s->dataeom = 1;
 			if (iobuf_queued(&s->dataiobuf) == 0)
 				smtp_data_io_done(s);
@@ -916,11 +1038,16 @@ smtp_io(struct io *io, int evt)
 
 		/* Must be a command */
 		strlcpy(s->cmd, line, sizeof s->cmd);
-		io_set_write(io);
 		smtp_command(s, line);
 		iobuf_normalize(&s->iobuf);
-		if (s->flags & SF_KICK)
+		if (s->flags & SF_KICK) {
 			smtp_free(s, "kick");
+			break;
+		}
+		/* Group commands only wait for the mfa, if at all */
+		if (io->flags & IO_PAUSE_OUT &&
+		    tree_get(&wait_mfa_response, s->id) == NULL)
+			smtp_next(s);
 		break;
 
 	case IO_LOWAT:
@@ -935,12 +1062,25 @@ smtp_io(struct io *io, int evt)
 			req_ca_cert.reqid = s->id;
 			strlcpy(req_ca_cert.name, s->smtpname,
 			    sizeof req_ca_cert.name);
-			m_compose(p_lka, IMSG_LKA_SSL_INIT, 0, 0, -1,
+			m_compose(lka_peer(s->id), IMSG_LKA_SSL_INIT, 0, 0, -1,
 			    &req_ca_cert, sizeof(req_ca_cert));
 			tree_xset(&wait_ssl_init, s->id, s);
 			break;
 		}
 
+		/*
+		 * A client may send the next chunk or command along with a
+		 * BDAT chunk.  It is already buffered and no read event will
+		 * come for it, so go and parse it.
+		 */
+		if (iobuf_len(&s->iobuf)) {
+			if (!evtimer_pending(&s->pipeline, NULL)) {
+				timerclear(&tv);
+				evtimer_add(&s->pipeline, &tv);
+			}
+			break;
+		}
+
 		io_set_read(io);
 		break;
 
@@ -1007,12 +1147,18 @@ smtp_data_io(struct io *io, int evt)
 static void
 smtp_data_io_done(struct smtp_session *s)
 {
+	int	direct = 0;
+
 	log_debug("debug: smtp: %p: data io done (%zu bytes)", s, s->datalen);
 
-	if (s->dataio.sock != -1)
-		stat_decrement("smtp.datapipe", 1);
-	io_clear(&s->dataio);
-	iobuf_clear(&s->dataiobuf);
+	if (s->trace.ts[EVPTRACE_ACCEPT])
+		s->trace.ts[EVPTRACE_EOM] = evptrace_now();
+
+	if (s->datafp)
+		/* filters may still want to know about the end of message */
+		direct = (dict_root(&env->sc_filters, NULL, NULL) == 0);
+	if (smtp_data_close(s) == -1)
+		s->msgflags |= MF_ERROR_IO;
 
 	if (s->msgflags & MF_ERROR) {
 
@@ -1034,8 +1180,10 @@ smtp_data_io_done(struct smtp_session *s)
 			    esc_description(ESC_OTHER_MAIL_SYSTEM_STATUS));
 		smtp_message_reset(s, 0);
 		smtp_enter_state(s, STATE_HELO);
-		io_reload(&s->io);
+		smtp_next(s);
 	}
+	else if (direct)
+		smtp_message_commit(s);
 	else {
 		m_create(p_mfa, IMSG_MFA_REQ_EOM, 0, 0, -1);
 		m_add_id(p_mfa, s->id);
@@ -1048,8 +1196,10 @@ smtp_data_io_done(struct smtp_session *s)
 static void
 smtp_command(struct smtp_session *s, char *line)
 {
+	struct mproc		       *p;
 	char			       *args, *eom, *method;
-	int				cmd, i;
+	const char		       *errstr;
+	int				cmd;
 
 	log_trace(TRACE_SMTP, "smtp: %p: <<< %s", s, line);
 
@@ -1073,28 +1223,7 @@ smtp_command(struct smtp_session *s, char *line)
 		return;
 	}
 
-	/*
-	 * Unlike other commands, "mail from" and "rcpt to" contain a
-	 * space in the command name.
-	 */
-	if (strncasecmp("mail from:", line, 10) == 0 ||
-	    strncasecmp("rcpt to:", line, 8) == 0)
-		args = strchr(line, ':');
-	else
-		args = strchr(line, ' ');
-
-	if (args) {
-		*args++ = '\0';
-		while (isspace((unsigned char)*args))
-			args++;
-	}
-
-	cmd = -1;
-	for (i = 0; commands[i].code != -1; i++)
-		if (!strcasecmp(line, commands[i].cmd)) {
-			cmd = commands[i].code;
-			break;
-		}
+	cmd = smtp_command_parse(line, &args);
 
 	switch (cmd) {
 	/*
@@ -1256,6 +1385,15 @@ smtp_command(struct smtp_session *s, char *line)
 			break;
 		}
 
+		if (queue_credit < QUEUE_CREDIT_MAX &&
+		    (int)arc4random_uniform(QUEUE_CREDIT_MAX) >= queue_credit) {
+			stat_increment("smtp.session.deferred", 1);
+			smtp_reply(s, "451 %s %s: Queue busy, try again later",
+			    esc_code(ESC_STATUS_TEMPFAIL, ESC_MAIL_SYSTEM_FULL),
+			    esc_description(ESC_MAIL_SYSTEM_FULL));
+			break;
+		}
+
 		smtp_message_reset(s, 1);
 
 		if (smtp_mailaddr(&s->evp.sender, args, 1, &args,
@@ -1316,6 +1454,14 @@ smtp_command(struct smtp_session *s, char *line)
 			break;
 		}
 
+		/* between BDAT chunks, the message is still being written */
+		if (s->msgflags & MF_BDAT) {
+			smtp_data_close(s);
+			m_create(p_mfa, IMSG_MFA_EVENT_ROLLBACK, 0, 0, -1);
+			m_add_id(p_mfa, s->id);
+			m_close(p_mfa);
+		}
+
 		m_create(p_mfa, IMSG_MFA_EVENT_RSET, 0, 0, -1);
 		m_add_id(p_mfa, s->id);
 		m_close(p_mfa);
@@ -1345,12 +1491,63 @@ smtp_command(struct smtp_session *s, char *line)
 			    esc_description(ESC_INVALID_COMMAND_ARGUMENTS));
 			break;
 		}
+		if (s->msgflags & MF_BDAT) {
+			smtp_reply(s, "503 %s %s: DATA after BDAT",
+			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+			    esc_description(ESC_INVALID_COMMAND));
+			break;
+		}
 
 		m_create(p_mfa, IMSG_MFA_REQ_DATA, 0, 0, -1);
 		m_add_id(p_mfa, s->id);
 		m_close(p_mfa);
 		smtp_wait_mfa(s, IMSG_MFA_REQ_DATA);
 		break;
+
+	case CMD_BDAT:
+		/*
+		 * RFC 3030: the chunk follows the command, so on error the
+		 * stream is out of sync and the session must end.
+		 */
+		if (s->phase != PHASE_TRANSACTION || s->rcptcount == 0) {
+			smtp_reply(s, "503 %s %s: Command not allowed at this point.",
+			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+			    esc_description(ESC_INVALID_COMMAND));
+			smtp_enter_state(s, STATE_QUIT);
+			break;
+		}
+		eom = NULL;
+		if (args && (eom = strchr(args, ' ')) != NULL) {
+			*eom++ = '\0';
+			while (isspace((unsigned char)*eom))
+				eom++;
+		}
+		if (args)
+			s->bdatleft = strtonum(args, 0, UINT32_MAX, &errstr);
+		if (args == NULL || errstr ||
+		    (eom && *eom && strcasecmp(eom, "LAST"))) {
+			smtp_reply(s, "501 %s %s: Invalid chunk size",
+			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND_ARGUMENTS),
+			    esc_description(ESC_INVALID_COMMAND_ARGUMENTS));
+			smtp_enter_state(s, STATE_QUIT);
+			break;
+		}
+		if (eom && *eom)
+			s->msgflags |= MF_BDAT_LAST;
+
+		if (s->msgflags & MF_BDAT) {
+			smtp_enter_state(s, STATE_BDAT);
+			smtp_bdat_chunk(s);
+			break;
+		}
+
+		/* first chunk, get the message file as for DATA */
+		s->msgflags |= MF_BDAT;
+		m_create(p_mfa, IMSG_MFA_REQ_DATA, 0, 0, -1);
+		m_add_id(p_mfa, s->id);
+		m_close(p_mfa);
+		smtp_wait_mfa(s, IMSG_MFA_REQ_DATA);
+		break;
 	/*
 	 * ANY
 	 */
@@ -1428,12 +1625,13 @@ smtp_rfc4954_auth_plain(struct smtp_session *s, char *arg)
 			goto abort;
 		pass++; /* skip NUL */
 
-		m_create(p_lka,  IMSG_LKA_AUTHENTICATE, 0, 0, -1);
-		m_add_id(p_lka, s->id);
-		m_add_string(p_lka, s->listener->authtable);
-		m_add_string(p_lka, user);
-		m_add_string(p_lka, pass);
-		m_close(p_lka);
+		p = lka_peer(s->id);
+		m_create(p,  IMSG_LKA_AUTHENTICATE, 0, 0, -1);
+		m_add_id(p, s->id);
+		m_add_string(p, s->listener->authtable);
+		m_add_string(p, user);
+		m_add_string(p, pass);
+		m_close(p);
 		tree_xset(&wait_parent_auth, s->id, s);
 		return;
 
@@ -1475,12 +1673,13 @@ smtp_rfc4954_auth_login(struct smtp_session *s, char *arg)
 				  sizeof(buf)-1) == -1)
 			goto abort;
 
-		m_create(p_lka,  IMSG_LKA_AUTHENTICATE, 0, 0, -1);
-		m_add_id(p_lka, s->id);
-		m_add_string(p_lka, s->listener->authtable);
-		m_add_string(p_lka, s->username);
-		m_add_string(p_lka, buf);
-		m_close(p_lka);
+		p = lka_peer(s->id);
+		m_create(p,  IMSG_LKA_AUTHENTICATE, 0, 0, -1);
+		m_add_id(p, s->id);
+		m_add_string(p, s->listener->authtable);
+		m_add_string(p, s->username);
+		m_add_string(p, buf);
+		m_close(p);
 		tree_xset(&wait_parent_auth, s->id, s);
 		return;
 
@@ -1595,6 +1794,7 @@ smtp_parse_mail_args(struct smtp_session *s, char *args)
 static int
 smtp_lookup_servername(struct smtp_session *s)
 {
+	struct mproc		*p;
 	struct sockaddr		*sa;
 	socklen_t		 sa_len;
 	struct sockaddr_storage	 ss;
@@ -1606,11 +1806,12 @@ smtp_lookup_servername(struct smtp_session *s)
 			log_warn("warn: getsockname()");
 		}
 		else {
-			m_create(p_lka, IMSG_LKA_HELO, 0, 0, -1);
-			m_add_id(p_lka, s->id);
-			m_add_string(p_lka, s->listener->hostnametable);
-			m_add_sockaddr(p_lka, sa);
-			m_close(p_lka);
+			p = lka_peer(s->id);
+			m_create(p, IMSG_LKA_HELO, 0, 0, -1);
+			m_add_id(p, s->id);
+			m_add_string(p, s->listener->hostnametable);
+			m_add_sockaddr(p, sa);
+			m_close(p);
 			tree_xset(&wait_lka_helo, s->id, s);
 			return 0;
 		}
@@ -1618,6 +1819,17 @@ smtp_lookup_servername(struct smtp_session *s)
 	return 1;
 }
 
+/*
+ * Only filters see the client hostname before the greeting, without
+ * them the PTR lookup goes on while the session starts.
+ */
+static int
+smtp_wait_ptr(struct smtp_session *s)
+{
+	return (s->flags & SF_PTRWAIT &&
+	    dict_root(&env->sc_filters, NULL, NULL));
+}
+
 static void
 smtp_connected(struct smtp_session *s)
 {
@@ -1626,8 +1838,10 @@ smtp_connected(struct smtp_session *s)
 
 	smtp_enter_state(s, STATE_CONNECTED);
 
-	log_info("smtp-in: New session %016"PRIx64" from host %s [%s]",
-	    s->id, s->hostname, ss_to_text(&s->ss));
+	/* otherwise logged when the PTR lookup completes */
+	if (!(s->flags & SF_PTRWAIT))
+		log_info("smtp-in: New session %016"PRIx64" from host %s [%s]",
+		    s->id, s->hostname, ss_to_text(&s->ss));
 
 	sl = sizeof(ss);
 	if (getsockname(s->io.sock, (struct sockaddr*)&ss, &sl) == -1) {
@@ -1649,7 +1863,7 @@ static void
 smtp_send_banner(struct smtp_session *s)
 {
 	smtp_reply(s, SMTPD_BANNER, s->smtpname, SMTPD_NAME);
-	io_reload(&s->io);
+	smtp_next(s);
 }
 
 void
@@ -1693,6 +1907,190 @@ smtp_message_line(struct smtp_session *s, const char *line)
 	io_reload(&s->dataio);
 }
 
+/*
+ * Without filters the body is written straight into the queue file.
+ * Complete lines are taken from the input buffer in one pass, unstuffed
+ * and copied, with no formatting and no round trip through the mfa.
+ * Stop before the final dot or an overlong line, which the caller
+ * handles as usual, and return 0 when more input is needed.
+ */
+static int
+smtp_message_direct(struct smtp_session *s)
+{
+	char	*data, *nl;
+	size_t	 len, i;
+
+	for (;;) {
+		data = iobuf_data(&s->iobuf);
+		nl = memchr(data, '\n', iobuf_len(&s->iobuf));
+		if (nl == NULL)
+			return (iobuf_len(&s->iobuf) >= SMTPD_MAXLINESIZE);
+
+		len = nl - data;
+		if (len && data[len - 1] == '\r')
+			len--;
+		if (len >= SMTPD_MAXLINESIZE || (len == 1 && data[0] == '.'))
+			return (1);
+		iobuf_drop(&s->iobuf, nl - data + 1);
+
+		if (s->msgflags & MF_ERROR)
+			continue;
+
+		if (len && data[0] == '.') {
+			data += 1;
+			len -= 1;
+		}
+		/* like smtp_message_line(), stop at the first NUL */
+		len = strnlen(data, len);
+
+		if (!(s->flags & SF_8BITMIME))
+			for (i = 0; i < len; ++i)
+				data[i] &= 0x7f;
+
+		smtp_message_write(s, data, len);
+		smtp_message_write(s, "\n", 1);
+	}
+}
+
+/*
+ * Append raw message data, to the queue file or to the mfa pipe.
+ */
+static void
+smtp_message_write(struct smtp_session *s, const char *data, size_t len)
+{
+	if (s->msgflags & MF_ERROR)
+		return;
+
+	if (s->datalen + len > env->sc_maxsize) {
+		s->msgflags |= MF_ERROR_SIZE;
+		return;
+	}
+	s->datalen += len;
+
+	if (s->datafp) {
+		if (fwrite(data, 1, len, s->datafp) != len)
+			s->msgflags |= MF_ERROR_IO;
+		return;
+	}
+
+	iobuf_queue(&s->dataiobuf, data, len);
+	if (iobuf_len(&s->dataiobuf) >= DATAIO_HIWAT &&
+	    !(s->io.flags & IO_PAUSE_IN)) {
+		log_debug("debug: smtp: %p: mfa congestion: pausing session", s);
+		io_pause(&s->io, IO_PAUSE_IN);
+	}
+	io_reload(&s->dataio);
+}
+
+/*
+ * Chunks are taken as is.  The queue stores lines ending with LF, so
+ * CRLF becomes LF, and a CR at the end of a chunk waits for the next.
+ */
+static void
+smtp_message_chunk(struct smtp_session *s, char *data, size_t len)
+{
+	char	*end = data + len, *cr;
+	size_t	 i;
+
+	if (!(s->flags & SF_8BITMIME))
+		for (i = 0; i < len; ++i)
+			data[i] &= 0x7f;
+
+	if (len && (s->msgflags & MF_BDAT_CR)) {
+		s->msgflags &= ~MF_BDAT_CR;
+		if (*data != '\n')
+			smtp_message_write(s, "\r", 1);
+	}
+
+	while (data < end) {
+		if ((cr = memchr(data, '\r', end - data)) == NULL) {
+			smtp_message_write(s, data, end - data);
+			break;
+		}
+		smtp_message_write(s, data, cr - data);
+		data = cr + 1;
+		if (data == end)
+			s->msgflags |= MF_BDAT_CR;
+		else if (*data != '\n')
+			smtp_message_write(s, "\r", 1);
+	}
+}
+
+/*
+ * Move what is available of the current chunk from the input buffer
+ * to the message, and reply once it is complete.
+ */
+static void
+smtp_bdat_chunk(struct smtp_session *s)
+{
+	size_t	n;
+
+	n = MIN(iobuf_len(&s->iobuf), s->bdatleft);
+	smtp_message_chunk(s, iobuf_data(&s->iobuf), n);
+	iobuf_drop(&s->iobuf, n);
+	s->bdatleft -= n;
+
+	if (s->bdatleft) {
+		iobuf_normalize(&s->iobuf);
+		if ((s->io.flags & IO_RW) != IO_READ)
+			io_set_read(&s->io);
+		return;
+	}
+
+	if ((s->io.flags & IO_RW) != IO_WRITE)
+		io_set_write(&s->io);
+	s->kickcount = 0;
+
+	if (s->msgflags & MF_BDAT_LAST) {
+		log_debug("debug: smtp: %p: eom", s);
+		if (s->msgflags & MF_BDAT_CR)
+			smtp_message_write(s, "\r", 1);
+		s->dataeom = 1;
+		if (iobuf_queued(&s->dataiobuf) == 0)
+			smtp_data_io_done(s);
+		return;
+	}
+
+	smtp_enter_state(s, STATE_HELO);
+	smtp_reply(s, "250 %s: Chunk accepted",
+	    esc_code(ESC_STATUS_OK, ESC_OTHER_STATUS));
+	smtp_next(s);
+}
+
+static void
+smtp_message_commit(struct smtp_session *s)
+{
+	s->phase = PHASE_SETUP;
+	m_create(p_queue, IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
+	m_add_id(p_queue, s->id);
+	m_add_msgid(p_queue, evpid_to_msgid(s->evp.id));
+	if (s->trace.ts[EVPTRACE_ACCEPT])
+		m_add_data(p_queue, &s->trace, sizeof(s->trace));
+	m_close(p_queue);
+	tree_xset(&wait_queue_commit, s->id, s);
+}
+
+/* close the way to the message file, -1 if it could not be written */
+static int
+smtp_data_close(struct smtp_session *s)
+{
+	int	r = 0;
+
+	if (s->dataio.sock != -1)
+		stat_decrement("smtp.datapipe", 1);
+	io_clear(&s->dataio);
+	iobuf_clear(&s->dataiobuf);
+
+	if (s->datafp) {
+		if (fclose(s->datafp) != 0)
+			r = -1;
+		s->datafp = NULL;
+	}
+	s->dataeom = 0;
+
+	return (r);
+}
+
 static void
 smtp_message_reset(struct smtp_session *s, int prepare)
 {
@@ -1769,6 +2167,57 @@ smtp_wait_mfa(struct smtp_session *s, int type)
 	tree_xset(&wait_mfa_response, s->id, s);	
 }
 
+/*
+ * RFC 2920: RSET, MAIL and RCPT may be followed by other commands, and
+ * so may the end of the message.
+ */
+static int
+smtp_pipelined(struct smtp_session *s, const char *line)
+{
+	if (!(s->flags & SF_EHLO))
+		return (0);
+	if (s->state == STATE_BODY)
+		return (1);
+
+	return (strcasecmp(line, "RSET") == 0 ||
+	    strncasecmp(line, "MAIL ", 5) == 0 ||
+	    strncasecmp(line, "RCPT ", 5) == 0);
+}
+
+/*
+ * The reply to a command is queued.  Within a pipelined group, keep it
+ * and handle the next command from the input buffer; all replies are
+ * written at once when the group is done.
+ */
+static void
+smtp_next(struct smtp_session *s)
+{
+	struct timeval	tv = { 0, 0 };
+
+	if (!(s->io.flags & IO_PAUSE_OUT)) {
+		io_reload(&s->io);
+		return;
+	}
+
+	if (s->state == STATE_HELO &&
+	    memchr(iobuf_data(&s->iobuf), '\n', iobuf_len(&s->iobuf))) {
+		if (!evtimer_pending(&s->pipeline, NULL))
+			evtimer_add(&s->pipeline, &tv);
+		return;
+	}
+
+	io_resume(&s->io, IO_PAUSE_OUT);
+}
+
+static void
+smtp_next_command(int fd, short event, void *p)
+{
+	struct smtp_session *s = p;
+
+	io_set_read(&s->io);
+	smtp_io(&s->io, IO_DATAIN);
+}
+
 static void
 smtp_free(struct smtp_session *s, const char * reason)
 {
@@ -1777,11 +2226,11 @@ smtp_free(struct smtp_session *s, const char * reason)
 	log_debug("debug: smtp: %p: deleting session: %s", s, reason);
 
 	tree_pop(&wait_mfa_response, s->id);
+	if (s->flags & SF_PTRWAIT)
+		tree_pop(&wait_lka_ptr, s->id);
+	evtimer_del(&s->pipeline);
 
-	if (s->dataio.sock != -1)
-		stat_decrement("smtp.datapipe", 1);
-	io_clear(&s->dataio);
-	iobuf_clear(&s->dataiobuf);
+	smtp_data_close(s);
 
 	if (s->evp.id) {
 		m_create(p_queue, IMSG_QUEUE_REMOVE_MESSAGE, 0, 0, -1);
@@ -1805,61 +2254,33 @@ smtp_free(struct smtp_session *s, const char * reason)
 
 	io_clear(&s->io);
 	iobuf_clear(&s->iobuf);
-	free(s);
+	smtp_session_release(s);
 
 	smtp_collect();
 }
 
-static int
-smtp_mailaddr(struct mailaddr *maddr, char *line, int mailfrom, char **args,
-    const char *domain)
+static struct smtp_session *
+smtp_session_alloc(void)
 {
-	char   *p, *e;
-
-	if (line == NULL)
-		return (0);
-
-	if (*line != '<')
-		return (0);
+	struct smtp_session	*s;
 
-	e = strchr(line, '>');
-	if (e == NULL)
-		return (0);
-	*e++ = '\0';
-	while (*e == ' ')
-		e++;
-	*args = e;
+	if (session_npool == 0)
+		return (calloc(1, sizeof(*s)));
 
-	if (!text_to_mailaddr(maddr, line + 1))
-		return (0);
+	s = session_pool[--session_npool];
+	memset(s, 0, sizeof(*s));
 
-	p = strchr(maddr->user, ':');
-	if (p != NULL) {
-		p++;
-		memmove(maddr->user, p, strlen(p) + 1);
-	}
-
-	if (!valid_localpart(maddr->user) ||
-	    !valid_domainpart(maddr->domain)) {
-		/* We accept empty sender for MAIL FROM */
-		if (mailfrom &&
-		    maddr->user[0] == '\0' &&
-		    maddr->domain[0] == '\0')
-			return (1);
+	return (s);
+}
 
-		/* We accept empty domain for RCPT TO if user is postmaster */
-		if (!mailfrom &&
-		    strcasecmp(maddr->user, "postmaster") == 0 &&
-		    maddr->domain[0] == '\0') {
-			(void)strlcpy(maddr->domain, domain,
-			    sizeof(maddr->domain));
-			return (1);
-		}
-			
-		return (0);
+static void
+smtp_session_release(struct smtp_session *s)
+{
+	if (session_npool == SMTP_SESSION_POOL) {
+		free(s);
+		return;
 	}
-
-	return (1);
+	session_pool[session_npool++] = s;
 }
 
 static int
@@ -1906,7 +2327,7 @@ smtp_verify_certificate(struct smtp_session *s)
 	iov[0].iov_len = sizeof(req_ca_vrfy);
 	iov[1].iov_base = req_ca_vrfy.cert;
 	iov[1].iov_len = req_ca_vrfy.cert_len;
-	m_composev(p_lka, IMSG_LKA_SSL_VERIFY_CERT, 0, 0, -1,
+	m_composev(lka_peer(s->id), IMSG_LKA_SSL_VERIFY_CERT, 0, 0, -1,
 	    iov, nitems(iov));
 	free(req_ca_vrfy.cert);
 	X509_free(x);
@@ -1922,8 +2343,8 @@ smtp_verify_certificate(struct smtp_session *s)
 			iov[0].iov_len  = sizeof(req_ca_vrfy);
 			iov[1].iov_base = req_ca_vrfy.cert;
 			iov[1].iov_len  = req_ca_vrfy.cert_len;
-			m_composev(p_lka, IMSG_LKA_SSL_VERIFY_CHAIN, 0, 0, -1,
-			    iov, nitems(iov));
+			m_composev(lka_peer(s->id), IMSG_LKA_SSL_VERIFY_CHAIN, 0, 0,
+			    -1, iov, nitems(iov));
 			free(req_ca_vrfy.cert);
 		}
 	}
@@ -1931,7 +2352,7 @@ smtp_verify_certificate(struct smtp_session *s)
 	/* Tell lookup process that it can start verifying, we're done */
 	memset(&req_ca_vrfy, 0, sizeof req_ca_vrfy);
 	req_ca_vrfy.reqid = s->id;
-	m_compose(p_lka, IMSG_LKA_SSL_VERIFY, 0, 0, -1,
+	m_compose(lka_peer(s->id), IMSG_LKA_SSL_VERIFY, 0, 0, -1,
 	    &req_ca_vrfy, sizeof req_ca_vrfy);
 
 	return 1;
@@ -1944,7 +2365,7 @@ smtp_auth_failure_resume(int fd, short event, void *p)
 
 	smtp_reply(s, "535 Authentication failed");
 	smtp_enter_state(s, STATE_HELO);
-	io_reload(&s->io);
+	smtp_next(s);
 }
 
 static void
@@ -1965,6 +2386,8 @@ smtp_sni_callback(SSL *ssl, int *ad, void *arg)
 {
 	const char		*sn;
 	struct smtp_session	*s = arg;
+	struct pki		 pki;
+	char			 name[SMTPD_MAXHOSTNAMELEN];
 	void			*ssl_ctx;
 
 	sn = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
@@ -1974,15 +2397,68 @@ smtp_sni_callback(SSL *ssl, int *ad, void *arg)
 		log_warnx("warn: client SNI exceeds max hostname length");
 		return SSL_TLSEXT_ERR_NOACK;
 	}
-	ssl_ctx = dict_get(env->sc_ssl_dict, sn);
-	if (ssl_ctx == NULL) {
-		log_warnx("warn: SNI name not found in PKI");
-		return SSL_TLSEXT_ERR_NOACK;
+	xlowercase(name, sn, sizeof name);
+	if ((ssl_ctx = dict_get(env->sc_ssl_dict, name)) == NULL &&
+	    (ssl_ctx = smtp_ssl_ctx_get(name)) == NULL) {
+		/* the handshake cannot wait, ask the ca synchronously */
+		if (! ca_fetch_pki(name, &pki)) {
+			log_warnx("warn: SNI name not found in PKI");
+			return SSL_TLSEXT_ERR_NOACK;
+		}
+		ssl_ctx = smtp_ssl_ctx_new(&pki);
+		free(pki.pki_cert);
+		free(pki.pki_dhparams);
+		if (ssl_ctx == NULL)
+			return SSL_TLSEXT_ERR_NOACK;
 	}
 	SSL_set_SSL_CTX(ssl, ssl_ctx);
 	return SSL_TLSEXT_ERR_OK;
 }
 
+static SSL_CTX *
+smtp_ssl_ctx_get(const char *name)
+{
+	struct ssl_cache_entry	*e;
+
+	if ((e = dict_get(&ssl_cache, name)) == NULL)
+		return (NULL);
+	TAILQ_REMOVE(&ssl_cache_lru, e, entry);
+	TAILQ_INSERT_TAIL(&ssl_cache_lru, e, entry);
+	stat_increment("smtp.ssl.cache.hit", 1);
+	return (e->ctx);
+}
+
+static SSL_CTX *
+smtp_ssl_ctx_new(struct pki *pki)
+{
+	struct ssl_cache_entry	*e;
+	SSL_CTX			*ctx;
+
+	if (! ssl_setup(&ctx, pki))
+		return (NULL);
+	stat_increment("smtp.ssl.cache.miss", 1);
+
+	/* sessions hold a reference on their context, it can go anytime */
+	if (ssl_cache_count >= env->sc_pki_cache_size) {
+		e = TAILQ_FIRST(&ssl_cache_lru);
+		TAILQ_REMOVE(&ssl_cache_lru, e, entry);
+		dict_xpop(&ssl_cache, e->name);
+		SSL_CTX_free(e->ctx);
+		free(e);
+		ssl_cache_count--;
+		stat_increment("smtp.ssl.cache.evicted", 1);
+	}
+
+	e = xcalloc(1, sizeof *e, "smtp_ssl_ctx_new");
+	(void)strlcpy(e->name, pki->pki_name, sizeof e->name);
+	e->ctx = ctx;
+	dict_xset(&ssl_cache, e->name, e);
+	TAILQ_INSERT_TAIL(&ssl_cache_lru, e, entry);
+	ssl_cache_count++;
+
+	return (ctx);
+}
+
 
 #define CASE(x) case x : return #x
 
@@ -2001,6 +2477,7 @@ smtp_strstate(int state)
 	CASE(STATE_AUTH_PASSWORD);
 	CASE(STATE_AUTH_FINALIZE);
 	CASE(STATE_BODY);
+	CASE(STATE_BDAT);
 	CASE(STATE_QUIT);
 	default:
 		snprintf(buf, sizeof(buf), "STATE_??? (%d)", state);
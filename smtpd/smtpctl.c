@@ -34,6 +34,7 @@
 #include <fts.h>
 #include <imsg.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,6 +55,9 @@ int srv_connect(void);
 
 void usage(void);
 static void show_queue_envelope(struct envelope *, int);
+static void show_queue_summary(struct evpsummary *);
+static void parse_query(struct scheduler_query *, const char *);
+static time_t parse_age(const char *);
 static void getflag(uint *, int, char *, char *, size_t);
 static void display(const char *);
 static int str_to_trace(const char *);
@@ -73,6 +77,7 @@ char		*rdata;
 size_t		 rlen;
 time_t		 now;
 
+struct queue_backend queue_backend_journal;
 struct queue_backend queue_backend_null;
 struct queue_backend queue_backend_proc;
 struct queue_backend queue_backend_ram;
@@ -408,16 +413,38 @@ static int
 do_monitor(int argc, struct parameter *argv)
 {
 	struct stat_digest	last, digest;
-	size_t			count;
+	const char		*errstr;
+	size_t			count, delta;
+	uint32_t		mask;
+	int			i, interval;
+
+	interval = 1;
+	if (argc) {
+		interval = strtonum(argv[0].u.u_str, 1, 3600, &errstr);
+		if (errstr)
+			errx(1, "interval is %s: %s", errstr, argv[0].u.u_str);
+	}
 
 	memset(&last, 0, sizeof(last));
 	count = 0;
 
+	/* subscribe, smtpd then pushes what changed at every interval */
+	srv_send(IMSG_CTL_MONITOR, &interval, sizeof(interval));
+	srv_recv(IMSG_DIGEST);
+	srv_read(&digest, sizeof(digest));
+	srv_end();
+
 	while (1) {
-		srv_send(IMSG_DIGEST, NULL, 0);
-		srv_recv(IMSG_DIGEST);
-		srv_read(&digest, sizeof(digest));
-		srv_end();
+		if (count) {
+			srv_recv(IMSG_CTL_MONITOR);
+			srv_read(&mask, sizeof(mask));
+			for (i = 0; i < STAT_DIGEST_COUNTERS; i++)
+				if (mask & (1 << i)) {
+					srv_read(&delta, sizeof(delta));
+					*STAT_DIGEST_COUNTER(&digest, i) += delta;
+				}
+			srv_end();
+		}
 
 		if (count % 25 == 0) {
 			if (count != 0)
@@ -454,7 +481,6 @@ do_monitor(int argc, struct parameter *argv)
 
 		last = digest;
 		count++;
-		sleep(1);
 	}
 
 	return (0);
@@ -571,6 +597,24 @@ do_schedule(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_set_limit(int argc, struct parameter *argv)
+{
+	struct ctl_limit	 limit;
+	const char		*errstr;
+
+	memset(&limit, 0, sizeof limit);
+	if (strlcpy(limit.name, argv[0].u.u_str, sizeof limit.name)
+	    >= sizeof limit.name)
+		errx(1, "invalid limit name: %s", argv[0].u.u_str);
+	limit.value = strtonum(argv[1].u.u_str, 0, LLONG_MAX, &errstr);
+	if (errstr)
+		errx(1, "limit value is %s: %s", errstr, argv[1].u.u_str);
+
+	srv_send(IMSG_CTL_SET_LIMIT, &limit, sizeof limit);
+	return srv_check_result(1);
+}
+
 static int
 do_show_envelope(int argc, struct parameter *argv)
 {
@@ -678,6 +722,35 @@ do_show_queue(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_show_queue_filter(int argc, struct parameter *argv)
+{
+	struct scheduler_query	q;
+	struct evpsummary	row;
+
+	now = time(NULL);
+
+	memset(&q, 0, sizeof q);
+	parse_query(&q, argv[0].u.u_str);
+
+	do {
+		srv_send(IMSG_CTL_QUERY_ENVELOPES, &q, sizeof q);
+		srv_recv(-1);
+		if (imsg.hdr.type == IMSG_CTL_FAIL)
+			errx(1, "filtering not supported by the scheduler");
+		if (imsg.hdr.type != IMSG_CTL_QUERY_ENVELOPES)
+			errx(1, "bad message type");
+		srv_read(&q.from, sizeof q.from);
+		while (rlen) {
+			srv_read(&row, sizeof row);
+			show_queue_summary(&row);
+		}
+		srv_end();
+	} while (q.from);
+
+	return (0);
+}
+
 static int
 do_show_hosts(int argc, struct parameter *argv)
 {
@@ -686,6 +759,22 @@ do_show_hosts(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_show_imsg_profile(int argc, struct parameter *argv)
+{
+	srv_show_cmd(IMSG_CTL_SHOW_IMSG_PROFILE, NULL, 0);
+
+	return (0);
+}
+
+static int
+do_show_metrics(int argc, struct parameter *argv)
+{
+	srv_show_cmd(IMSG_CTL_SHOW_METRICS, NULL, 0);
+
+	return (0);
+}
+
 static int
 do_show_relays(int argc, struct parameter *argv)
 {
@@ -747,6 +836,23 @@ do_show_stats(int argc, struct parameter *argv)
 				    kv.val.u.ts.tv_nsec / 1000000,
 				    kv.val.u.ts.tv_nsec % 1000000);
 				break;
+			case STAT_HISTOGRAM:
+				printf("%s.count=%zu\n", kv.key,
+				    kv.val.u.hist.count);
+				printf("%s.mean=%llu\n", kv.key,
+				    (unsigned long long)kv.val.u.hist.mean);
+				printf("%s.p50=%llu\n", kv.key,
+				    (unsigned long long)kv.val.u.hist.p50);
+				printf("%s.p90=%llu\n", kv.key,
+				    (unsigned long long)kv.val.u.hist.p90);
+				printf("%s.p99=%llu\n", kv.key,
+				    (unsigned long long)kv.val.u.hist.p99);
+				printf("%s.max=%llu\n", kv.key,
+				    (unsigned long long)kv.val.u.hist.max);
+				break;
+			case STAT_RATE:
+				printf("%s=%.3f\n", kv.key, kv.val.u.rate);
+				break;
 			}
 		}
 	}
@@ -899,6 +1005,7 @@ main(int argc, char **argv)
 	cmd_install("log brief",		do_log_brief);
 	cmd_install("log verbose",		do_log_verbose);
 	cmd_install("monitor",			do_monitor);
+	cmd_install("monitor <str>",		do_monitor);
 	cmd_install("pause envelope <evpid>",	do_pause_envelope);
 	cmd_install("pause envelope <msgid>",	do_pause_envelope);
 	cmd_install("pause mda",		do_pause_mda);
@@ -916,13 +1023,17 @@ main(int argc, char **argv)
 	cmd_install("schedule <msgid>",		do_schedule);
 	cmd_install("schedule <evpid>",		do_schedule);
 	cmd_install("schedule all",		do_schedule);
+	cmd_install("set limit <str> <str>",	do_set_limit);
 	cmd_install("show envelope <evpid>",	do_show_envelope);
 	cmd_install("show hoststats",		do_show_hoststats);
 	cmd_install("show message <msgid>",	do_show_message);
 	cmd_install("show message <evpid>",	do_show_message);
 	cmd_install("show queue",		do_show_queue);
 	cmd_install("show queue <msgid>",	do_show_queue);
+	cmd_install("show queue filter <str>",	do_show_queue_filter);
 	cmd_install("show hosts",		do_show_hosts);
+	cmd_install("show imsg-profile",	do_show_imsg_profile);
+	cmd_install("show metrics",		do_show_metrics);
 	cmd_install("show relays",		do_show_relays);
 	cmd_install("show routes",		do_show_routes);
 	cmd_install("show stats",		do_show_stats);
@@ -1013,6 +1124,128 @@ show_queue_envelope(struct envelope *e, int online)
 	    e->errorline);
 }
 
+static void
+show_queue_summary(struct evpsummary *e)
+{
+	const char	*agent = "?", *prio = "normal";
+	char		 status[128], runstate[128];
+	uint		 flags = e->flags;
+
+	status[0] = '\0';
+	getflag(&flags, EF_SUSPEND, "suspend", status, sizeof(status));
+	getflag(&flags, EF_HOLD, "hold", status, sizeof(status));
+	if (status[0])
+		status[strlen(status) - 1] = '\0';
+
+	if (flags & EF_PENDING)
+		snprintf(runstate, sizeof runstate, "pending|%zi",
+		    (ssize_t)(e->time - now));
+	else if (flags & EF_INFLIGHT)
+		snprintf(runstate, sizeof runstate, "inflight|%zi",
+		    (ssize_t)(now - e->time));
+	else
+		snprintf(runstate, sizeof runstate, "invalid|");
+
+	if (e->type == D_MDA)
+		agent = "mda";
+	else if (e->type == D_MTA)
+		agent = "mta";
+	else if (e->type == D_BOUNCE)
+		agent = "bounce";
+
+	if (e->priority == PRIO_HIGH)
+		prio = "high";
+	else if (e->priority == PRIO_BULK)
+		prio = "bulk";
+
+	printf("%016" PRIx64 "|%s|%s|%s|%zu|%s\n", e->evpid, agent, prio,
+	    status, (size_t)e->creation, runstate);
+}
+
+/*
+ * A filter is a comma-separated list of domain=, sender=, state=,
+ * older= and newer= terms, all of which must match.
+ */
+static void
+parse_query(struct scheduler_query *q, const char *filter)
+{
+	char	*buf, *term, *val, *next;
+
+	if ((buf = strdup(filter)) == NULL)
+		err(1, "strdup");
+
+	for (term = buf; term; term = next) {
+		if ((next = strchr(term, ',')) != NULL)
+			*next++ = '\0';
+		if ((val = strchr(term, '=')) == NULL)
+			errx(1, "invalid filter term: %s", term);
+		*val++ = '\0';
+
+		if (!strcmp(term, "domain")) {
+			if (strlcpy(q->domain, val, sizeof q->domain)
+			    >= sizeof q->domain)
+				errx(1, "domain too long: %s", val);
+		}
+		else if (!strcmp(term, "sender")) {
+			if (strlcpy(q->sender, val, sizeof q->sender)
+			    >= sizeof q->sender)
+				errx(1, "sender too long: %s", val);
+		}
+		else if (!strcmp(term, "state")) {
+			if (!strcmp(val, "pending"))
+				q->flags |= EF_PENDING;
+			else if (!strcmp(val, "inflight"))
+				q->flags |= EF_INFLIGHT;
+			else if (!strcmp(val, "hold"))
+				q->flags |= EF_HOLD;
+			else if (!strcmp(val, "suspend"))
+				q->flags |= EF_SUSPEND;
+			else
+				errx(1, "invalid state: %s", val);
+		}
+		else if (!strcmp(term, "older"))
+			q->minage = parse_age(val);
+		else if (!strcmp(term, "newer"))
+			q->maxage = parse_age(val);
+		else
+			errx(1, "invalid filter term: %s", term);
+	}
+
+	free(buf);
+}
+
+/* seconds, or a number followed by s, m, h or d */
+static time_t
+parse_age(const char *str)
+{
+	long long	 n;
+	char		*ep;
+
+	errno = 0;
+	n = strtoll(str, &ep, 10);
+	if (errno || n <= 0 || ep == str)
+		errx(1, "invalid age: %s", str);
+
+	switch (*ep) {
+	case 'd':
+		n *= 24;
+		/* FALLTHROUGH */
+	case 'h':
+		n *= 60;
+		/* FALLTHROUGH */
+	case 'm':
+		n *= 60;
+		/* FALLTHROUGH */
+	case 's':
+		ep++;
+		break;
+	}
+	if (*ep != '\0')
+		errx(1, "invalid age: %s", str);
+
+	return ((time_t)n);
+}
+
 static void
 getflag(uint *bitmap, int bit, char *bitstr, char *buf, size_t len)
 {
@@ -1164,6 +1397,10 @@ str_to_profile(const char *str)
 		return PROFILE_IMSG;
 	if (!strcmp(str, "queue"))
 		return PROFILE_QUEUE;
+	if (!strcmp(str, "io"))
+		return PROFILE_IO;
+	if (!strcmp(str, "envelope"))
+		return PROFILE_ENVELOPE;
 	errx(1, "invalid profile keyword: %s", str);
 	return (0);
 }
@@ -1209,7 +1446,8 @@ is_encrypted_buffer(const char *buffer)
 
 	magic = *buffer;
 #define	ENCRYPTION_MAGIC	0x1
-	return (magic == ENCRYPTION_MAGIC);
+#define	ENCRYPTION_MAGIC_CHUNKED	0x2
+	return (magic == ENCRYPTION_MAGIC || magic == ENCRYPTION_MAGIC_CHUNKED);
 }
 
 static int
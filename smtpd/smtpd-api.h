@@ -27,7 +27,7 @@
 #include <netinet/in.h>
 #include <netdb.h>
 
-#define	FILTER_API_VERSION	 50
+#define	FILTER_API_VERSION	 51
 
 struct mailaddr {
 	char	user[SMTPD_MAXLOCALPARTSIZE];
@@ -37,14 +37,23 @@ struct mailaddr {
 SPLAY_HEAD(_dict, dictentry);
 SPLAY_HEAD(_tree, treeentry);
 
+/*
+ * Ordered containers.  Once they grow past a few dozen entries, point
+ * lookups go through an open-addressing hash index and no longer splay
+ * the tree.
+ */
 struct tree {
-	struct _tree	tree;
-	size_t		count;
+	struct _tree		  tree;
+	size_t			  count;
+	struct treeentry	**slots;
+	size_t			  nslots;
 };
 
 struct dict {
-	struct _dict	dict;
-	size_t		count;
+	struct _dict		  dict;
+	size_t			  count;
+	struct dictentry	**slots;
+	size_t			  nslots;
 };
 
 enum filter_status {
@@ -96,6 +105,7 @@ enum filter_hook {
 	HOOK_COMMIT		= 1 << 8,
 	HOOK_ROLLBACK		= 1 << 9,
 	HOOK_DATALINE		= 1 << 10,
+	HOOK_MESSAGE		= 1 << 11,
 };
 
 struct filter_connect {
@@ -122,7 +132,7 @@ enum {
 	PROC_QUEUE_ENVELOPE_WALK,
 };
 
-#define PROC_SCHEDULER_API_VERSION	1
+#define PROC_SCHEDULER_API_VERSION	6
 
 struct scheduler_info;
 struct scheduler_batch;
@@ -145,6 +155,12 @@ enum {
 	PROC_SCHEDULER_REMOVE,
 	PROC_SCHEDULER_SUSPEND,
 	PROC_SCHEDULER_RESUME,
+
+	/* pipelined, several entries per message and no reply */
+	PROC_SCHEDULER_INSERT_BATCH,
+	PROC_SCHEDULER_COMMIT_BATCH,
+	PROC_SCHEDULER_UPDATE_BATCH,
+	PROC_SCHEDULER_DELETE_BATCH,
 };
 
 enum envelope_flags {
@@ -173,6 +189,13 @@ enum delivery_type {
 	D_BOUNCE,
 };
 
+enum delivery_priority {
+	PRIO_NORMAL,
+	PRIO_HIGH,
+	PRIO_BULK,
+};
+#define	PRIO_COUNT	3
+
 struct scheduler_info {
 	uint64_t		evpid;
 	enum delivery_type	type;
@@ -182,6 +205,10 @@ struct scheduler_info {
 	time_t			lasttry;
 	time_t			lastbounce;
 	time_t			nexttry;
+	uint32_t		destkey;	/* groups MTA envelopes */
+	uint32_t		senderkey;
+	uint32_t		rcptkey;	/* recipient domain */
+	uint8_t			priority;
 };
 
 #define SCHED_NONE		0x00
@@ -201,7 +228,7 @@ struct scheduler_batch {
 	uint64_t	*evpids;
 };
 
-#define PROC_TABLE_API_VERSION	1
+#define PROC_TABLE_API_VERSION	4
 
 struct table_open_params {
 	uint32_t	version;
@@ -218,8 +245,9 @@ enum table_service {
 	K_SOURCE	= 0x20, /* returns struct source	*/
 	K_MAILADDR	= 0x40, /* returns struct mailaddr	*/
 	K_ADDRNAME	= 0x80, /* returns struct addrname	*/
+	K_MTASTATE	= 0x100, /* returns struct mtastate	*/
 };
-#define K_ANY		  0xff
+#define K_ANY		  0x1ff
 
 enum {
 	PROC_TABLE_OK,
@@ -230,6 +258,9 @@ enum {
 	PROC_TABLE_CHECK,
 	PROC_TABLE_LOOKUP,
 	PROC_TABLE_FETCH,
+	PROC_TABLE_CHECK_BATCH,		/* service, count, keys */
+	PROC_TABLE_LOOKUP_BATCH,
+	PROC_TABLE_STORE,		/* service, key, value */
 };
 
 enum enhanced_status_code {
@@ -318,7 +349,8 @@ msgid_to_evpid(uint32_t msgid)
 }
 
 /* dict.c */
-#define dict_init(d) do { SPLAY_INIT(&((d)->dict)); (d)->count = 0; } while(0)
+#define dict_init(d) do { SPLAY_INIT(&((d)->dict)); (d)->count = 0;	\
+	(d)->slots = NULL; (d)->nslots = 0; } while(0)
 #define dict_empty(d) SPLAY_EMPTY(&((d)->dict))
 #define dict_count(d) ((d)->count)
 int dict_check(struct dict *, const char *);
@@ -347,11 +379,15 @@ void filter_api_no_chroot(void);
 
 void filter_api_loop(void);
 int filter_api_accept(uint64_t);
+int filter_api_pending(uint64_t);
+void filter_api_set_concurrency(int);
+void filter_api_set_timeout(int);
 int filter_api_accept_notify(uint64_t, uint64_t *);
 int filter_api_reject(uint64_t, enum filter_status);
 int filter_api_reject_code(uint64_t, enum filter_status, uint32_t,
     const char *);
 void filter_api_writeln(uint64_t, const char *);
+void filter_api_write(uint64_t, const char *, size_t);
 const char *filter_api_sockaddr_to_text(const struct sockaddr *);
 const char *filter_api_mailaddr_to_text(const struct mailaddr *);
 
@@ -361,11 +397,16 @@ void filter_api_on_mail(int(*)(uint64_t, struct mailaddr *));
 void filter_api_on_rcpt(int(*)(uint64_t, struct mailaddr *));
 void filter_api_on_data(int(*)(uint64_t));
 void filter_api_on_dataline(void(*)(uint64_t, const char *));
+void filter_api_on_datachunk(void(*)(uint64_t, const char *, size_t));
+void filter_api_data_passthrough(void);
 void filter_api_on_eom(int(*)(uint64_t));
+void filter_api_on_message(int(*)(uint64_t, int, size_t));
 
 /* queue */
 void queue_api_on_message_create(int(*)(uint32_t *));
 void queue_api_on_message_commit(int(*)(uint32_t, const char*));
+void queue_api_on_message_sync(int(*)(uint32_t, const char*));
+void queue_api_on_message_flush(int(*)(void));
 void queue_api_on_message_delete(int(*)(uint32_t));
 void queue_api_on_message_fd_r(int(*)(uint32_t));
 void queue_api_on_message_corrupt(int(*)(uint32_t));
@@ -399,11 +440,17 @@ void table_api_on_update(int(*)(void));
 void table_api_on_check(int(*)(int, const char *));
 void table_api_on_lookup(int(*)(int, const char *, char *, size_t));
 void table_api_on_fetch(int(*)(int, char *, size_t));
+void table_api_on_store(int(*)(int, const char *, const char *));
+void table_api_on_async_check(void(*)(uint32_t, int, const char *));
+void table_api_on_async_lookup(void(*)(uint32_t, int, const char *));
+void table_api_check_done(uint32_t, int);
+void table_api_lookup_done(uint32_t, int, const char *);
 int table_api_dispatch(void);
 const char *table_api_get_name(void);
 
 /* tree.c */
-#define tree_init(t) do { SPLAY_INIT(&((t)->tree)); (t)->count = 0; } while(0)
+#define tree_init(t) do { SPLAY_INIT(&((t)->tree)); (t)->count = 0;	\
+	(t)->slots = NULL; (t)->nslots = 0; } while(0)
 #define tree_empty(t) SPLAY_EMPTY(&((t)->tree))
 #define tree_count(t) ((t)->count)
 int tree_check(struct tree *, uint64_t);
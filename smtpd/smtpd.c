@@ -61,6 +61,19 @@ static void parent_send_config_mfa(void);
 static void parent_send_config_smtp(void);
 static void parent_sig_handler(int, short, void *);
 static void forkmda(struct mproc *, uint64_t, struct deliver *);
+static int mda_worker_run(struct mproc *, uint64_t, struct deliver *);
+static struct mda_worker *mda_worker_fork(struct deliver *);
+static void mda_worker_main(int, struct deliver *);
+static void mda_worker_imsg(struct mproc *, struct imsg *);
+static void mda_worker_free(struct mda_worker *);
+static void mda_worker_reap(int, short, void *);
+static void lmtp_connector_run(uint64_t, const char *,
+    const struct userinfo *);
+static int lmtp_connector_allowed(const char *);
+static int lmtp_dest_match(const char *, const char *);
+static void lmtp_connector_main(int, const char *, const struct userinfo *);
+static void lmtp_connector_read(int, short, void *);
+static void lmtp_connector_reply(uint64_t, int, const char *);
 static int parent_forward_open(char *, char *, uid_t, gid_t);
 static void parent_broadcast_verbose(uint32_t);
 static void parent_broadcast_profile(uint32_t);
@@ -69,17 +82,25 @@ static struct child *child_add(pid_t, int, const char *);
 
 static void	offline_scan(int, short, void *);
 static int	offline_add(char *);
+static void	offline_run(void);
 static void	offline_done(void);
-static int	offline_enqueue(char *);
+static int	offline_enqueue(uid_t, char **, size_t);
+static void	offline_batch(uid_t, char **, size_t);
+static int	offline_submit(const char *);
 
-static void	purge_task(int, short, void *);
 static void	log_imsg(int, int, struct imsg *);
+static void	imsg_profile_add(int, uint32_t, size_t, struct timespec *);
+static size_t	imsg_profile_hist(char *, size_t, const size_t *);
 static int	parent_auth_user(const char *, const char *);
 static void	load_pki_tree(void);
+static int64_t	usec_since(const struct timespec *);
+static void	report_config_load(int);
 
 enum child_type {
 	CHILD_DAEMON,
 	CHILD_MDA,
+	CHILD_MDA_WORKER,
+	CHILD_LMTP_CONNECT,
 	CHILD_ENQUEUE_OFFLINE,
 };
 
@@ -89,17 +110,62 @@ struct child {
 	const char		*title;
 	int			 mda_out;
 	uint64_t		 mda_id;
-	char			*path;
 	char			*cause;
+	struct mda_worker	*worker;
+};
+
+/*
+ * Backends that can deliver from an fd are run by workers, one user
+ * each, kept around to take the next message for that user instead of
+ * forking a process per delivery.  A worker does one delivery at a time.
+ */
+#define	MDA_WORKER_MAX		32
+#define	MDA_WORKER_IDLE		60
+
+struct mda_worker {
+	TAILQ_ENTRY(mda_worker)	 entry;
+	struct mproc		 p;
+	struct child		*child;
+	uid_t			 uid;
+	gid_t			 gid;
+	int			 busy;
+	int			 dead;		/* socket closed */
+	time_t			 lastused;
+};
+
+/*
+ * An LMTP connection asked by mda is made by a helper running as the
+ * user, which passes the socket back and exits.  The resolution and the
+ * connect do not hold the parent, and the destination must be one that
+ * a rule names.
+ */
+#define	LMTP_CONNECT_TIMEOUT	60
+
+struct lmtp_connector {
+	uint64_t		 id;
+	struct imsgbuf		 ibuf;
+	struct event		 ev;
 };
 
+static TAILQ_HEAD(, mda_worker)	mda_workers =
+    TAILQ_HEAD_INITIALIZER(mda_workers);
+static size_t			mda_nworkers = 0;
+static struct event		mda_worker_ev;
+
+/*
+ * Offline messages are reinjected in batches of messages from the same
+ * user, each batch by a child running as that user which submits them
+ * one after the other.  A few batches run at once.
+ */
 struct offline {
 	TAILQ_ENTRY(offline)	 entry;
+	uid_t			 uid;
 	char			*path;
 };
 
-#define OFFLINE_READMAX		20
-#define OFFLINE_QUEUEMAX	5
+#define OFFLINE_READMAX		256
+#define OFFLINE_QUEUEMAX	8
+#define OFFLINE_BATCH		64
 static size_t			offline_running = 0;
 TAILQ_HEAD(, offline)		offline_q;
 
@@ -107,26 +173,49 @@ static struct event		config_ev;
 static struct event		offline_ev;
 static struct timeval		offline_timeout;
 
-static pid_t			purge_pid;
-static struct timeval		purge_timeout;
-static struct event		purge_ev;
+/*
+ * With imsg profiling, handler latencies and message sizes are counted
+ * per peer and imsg type in power of two buckets: bucket b holds the
+ * values below 1 << b and at least half of it, the last one the rest.
+ */
+#define	IMSG_PROF_BUCKETS	24
+
+struct imsg_prof {
+	size_t		 count;
+	uint64_t	 usec;
+	uint64_t	 usec_max;
+	uint64_t	 bytes;
+	size_t		 bytes_max;
+	size_t		 lat[IMSG_PROF_BUCKETS];
+	size_t		 size[IMSG_PROF_BUCKETS];
+};
+
+static struct tree		imsg_prof;
+static int			imsg_prof_init = 0;
 
 extern char	**environ;
 void		(*imsg_callback)(struct mproc *, struct imsg *);
 
 enum smtp_proc_type	smtpd_process;
+int			mta_shard;
+int			smtp_shard;
+int			lka_shard;
 
 struct smtpd	*env = NULL;
 
+struct mproc	*p_ca = NULL;
 struct mproc	*p_control = NULL;
 struct mproc	*p_lka = NULL;
+struct mproc	*p_lkas[LKA_PROCS_MAX];
 struct mproc	*p_mda = NULL;
 struct mproc	*p_mfa = NULL;
 struct mproc	*p_mta = NULL;
+struct mproc	*p_mtas[MTA_PROCS_MAX];
 struct mproc	*p_parent = NULL;
 struct mproc	*p_queue = NULL;
 struct mproc	*p_scheduler = NULL;
 struct mproc	*p_smtp = NULL;
+struct mproc	*p_smtps[SMTP_PROCS_MAX];
 
 const char	*backend_queue = "fs";
 const char	*backend_scheduler = "ramqueue";
@@ -145,10 +234,12 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct forward_req	*fwreq;
 	struct deliver		 deliver;
+	struct userinfo		 userinfo;
 	struct child		*c;
 	struct msg		 m;
 	const void		*data;
 	const char		*username, *password, *cause;
+	char			 ebuf[SMTPD_MAXLINESIZE];
 	uint64_t		 reqid;
 	size_t			 sz;
 	void			*i;
@@ -213,7 +304,9 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 
 			i = NULL;
 			while ((n = tree_iter(&children, &i, NULL, (void**)&c)))
-				if (c->type == CHILD_MDA &&
+				if ((c->type == CHILD_MDA ||
+				    (c->type == CHILD_MDA_WORKER &&
+				    c->worker && c->worker->busy)) &&
 				    c->mda_id == reqid &&
 				    c->cause == NULL)
 					break;
@@ -228,6 +321,18 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 			    c->pid, c->cause);
 			kill(c->pid, SIGTERM);
 			return;
+
+		case IMSG_PARENT_LMTP_CONNECT:
+			m_msg(&m, imsg);
+			m_get_id(&m, &reqid);
+			m_get_string(&m, &cause);
+			m_get_data(&m, &data, &sz);
+			m_end(&m);
+			if (sz != sizeof userinfo)
+				fatalx("parent_imsg: bad userinfo");
+			memmove(&userinfo, data, sizeof userinfo);
+			lmtp_connector_run(reqid, cause, &userinfo);
+			return;
 		}
 	}
 
@@ -238,12 +343,12 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_int(&m, &v);
 			m_end(&m);
 			log_verbose(v);
-			m_forward(p_lka, imsg);
+			lka_forward(imsg);
 			m_forward(p_mda, imsg);
 			m_forward(p_mfa, imsg);
-			m_forward(p_mta, imsg);
+			mta_forward(imsg);
 			m_forward(p_queue, imsg);
-			m_forward(p_smtp, imsg);
+			smtp_forward(imsg);
 			return;
 
 		case IMSG_CTL_TRACE:
@@ -333,9 +438,13 @@ parent_send_config(int fd, short event, void *p)
 static void
 parent_send_config_smtp(void)
 {
+	size_t	i;
+
 	log_debug("debug: parent_send_config: configuring smtp");
-	m_compose(p_smtp, IMSG_CONF_START, 0, 0, -1, NULL, 0);
-	m_compose(p_smtp, IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	for (i = 0; i < env->sc_smtp_procs; i++) {
+		m_compose(p_smtps[i], IMSG_CONF_START, 0, 0, -1, NULL, 0);
+		m_compose(p_smtps[i], IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	}
 }
 
 void
@@ -356,9 +465,13 @@ parent_send_config_mfa()
 void
 parent_send_config_lka()
 {
+	size_t	i;
+
 	log_debug("debug: parent_send_config_ruleset: reloading");
-	m_compose(p_lka, IMSG_CONF_START, 0, 0, -1, NULL, 0);
-	m_compose(p_lka, IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	for (i = 0; i < env->sc_lka_procs; i++) {
+		m_compose(p_lkas[i], IMSG_CONF_START, 0, 0, -1, NULL, 0);
+		m_compose(p_lkas[i], IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	}
 }
 
 static void
@@ -380,6 +493,8 @@ parent_sig_handler(int sig, short event, void *p)
 			if (pid <= 0)
 				continue;
 
+			shmstat_release(pid);
+
 			fail = 0;
 			if (WIFSIGNALED(status)) {
 				fail = 1;
@@ -394,9 +509,6 @@ parent_sig_handler(int sig, short event, void *p)
 			} else
 				fatalx("smtpd: unexpected cause of SIGCHLD");
 
-			if (pid == purge_pid)
-				purge_pid = -1;
-
 			child = tree_pop(&children, pid);
 			if (child == NULL)
 				goto skip;
@@ -435,15 +547,50 @@ parent_sig_handler(int sig, short event, void *p)
 				/* free(cause); */
 				break;
 
+			case CHILD_MDA_WORKER:
+				/* closed by the parent once idle */
+				if (child->worker == NULL) {
+					free(child->cause);
+					break;
+				}
+				if (child->worker->busy) {
+					if (WIFSIGNALED(status) &&
+					    WTERMSIG(status) == SIGALRM) {
+						free(cause);
+						asprintf(&cause,
+						    "terminated; timeout");
+					}
+					else if (child->cause &&
+					    WIFSIGNALED(status) &&
+					    WTERMSIG(status) == SIGTERM) {
+						free(cause);
+						cause = child->cause;
+						child->cause = NULL;
+					}
+					log_debug("debug: smtpd: mda worker "
+					    "lost for session %016"PRIx64": %s",
+					    child->mda_id, cause);
+					m_create(p_mda, IMSG_MDA_DONE, 0, 0, -1);
+					m_add_id(p_mda, child->mda_id);
+					m_add_string(p_mda, cause);
+					m_close(p_mda);
+				}
+				free(child->cause);
+				mda_worker_free(child->worker);
+				break;
+
+			case CHILD_LMTP_CONNECT:
+				/* the socket, or the error, went to mda */
+				if (fail)
+					log_debug("debug: smtpd: lmtp connect "
+					    "helper %s", cause);
+				break;
+
 			case CHILD_ENQUEUE_OFFLINE:
 				if (fail)
 					log_warnx("warn: smtpd: "
-					    "couldn't enqueue offline "
-					    "message %s; smtpctl %s",
-					    child->path, cause);
-				else
-					unlink(child->path);
-				free(child->path);
+					    "couldn't enqueue all offline "
+					    "messages; batch %s", cause);
 				offline_done();
 				break;
 
@@ -475,6 +622,7 @@ main(int argc, char *argv[])
 	struct event	 ev_sigchld;
 	struct event	 ev_sighup;
 	struct timeval	 tv;
+	struct timespec	 t0;
 
 	env = &smtpd;
 
@@ -564,6 +712,10 @@ main(int argc, char *argv[])
 				profiling |= PROFILE_IMSG;
 			else if (!strcmp(optarg, "profile-queue"))
 				profiling |= PROFILE_QUEUE;
+			else if (!strcmp(optarg, "profile-io"))
+				profiling |= PROFILE_IO;
+			else if (!strcmp(optarg, "profile-envelope"))
+				profiling |= PROFILE_ENVELOPE;
 			else
 				log_warnx("warn: unknown trace flag \"%s\"",
 				    optarg);
@@ -592,8 +744,10 @@ main(int argc, char *argv[])
 
 	ssl_init();
 
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 	if (parse_config(&smtpd, conffile, opts))
 		exit(1);
+	env->sc_load.parse = usec_since(&t0);
 
 	if (strlcpy(env->sc_conffile, conffile, SMTPD_MAXPATHLEN)
 	    >= SMTPD_MAXPATHLEN)
@@ -601,6 +755,8 @@ main(int argc, char *argv[])
 
 	if (env->sc_opts & SMTPD_OPT_NOACTION) {
 		load_pki_tree();
+		if (env->sc_opts & SMTPD_OPT_VERBOSE)
+			report_config_load(0);
 		fprintf(stderr, "configuration OK\n");
 		exit(0);
 	}
@@ -620,14 +776,24 @@ main(int argc, char *argv[])
 	env->sc_stat = stat_backend_lookup(backend_stat);
 	if (env->sc_stat == NULL)
 		errx(1, "could not find stat backend \"%s\"", backend_stat);
-
-	if (env->sc_queue_flags & QUEUE_COMPRESSION)
-		env->sc_comp = compress_backend_lookup("gzip");
+	/* the counters are shared by the processes forked from here */
+	if (!strcmp(backend_stat, "shm"))
+		shmstat_map();
+
+	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
+		if (env->sc_queue_compress_algo == NULL)
+			env->sc_queue_compress_algo = "gzip";
+		env->sc_comp = compress_backend_lookup(env->sc_queue_compress_algo);
+		if (env->sc_comp == NULL)
+			errx(1, "unsupported compression algorithm \"%s\"",
+			    env->sc_queue_compress_algo);
+	}
 
 	log_init(foreground);
 	log_verbose(verbose);
 
 	load_pki_tree();
+	report_config_load(1);
 
 	log_info("info: %s %s starting", SMTPD_NAME, SMTPD_VERSION);
 
@@ -687,12 +853,6 @@ main(int argc, char *argv[])
 	offline_timeout.tv_usec = 0;
 	evtimer_add(&offline_ev, &offline_timeout);
 
-	purge_pid = -1;
-	evtimer_set(&purge_ev, purge_task, NULL);
-	purge_timeout.tv_sec = 10;
-	purge_timeout.tv_usec = 0;
-	evtimer_add(&purge_ev, &purge_timeout);
-
 	if (pidfile(NULL) < 0)
 		err(1, "pidfile");
 
@@ -708,7 +868,9 @@ load_pki_tree(void)
 	struct pki	*pki;
 	const char	*k;
 	void		*iter_dict;
+	struct timespec	 t0;
 
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 	log_debug("debug: init ssl-tree");
 	iter_dict = NULL;
 	while (dict_iter(env->sc_pki_dict, &iter_dict, &k, (void **)&pki)) {
@@ -730,23 +892,61 @@ load_pki_tree(void)
 			if (! ssl_load_dhparams(pki, pki->pki_dhparams_file))
 				fatalx("load_pki_tree: failed to load dhparams file");
 	}
+	env->sc_load.pki = usec_since(&t0);
+}
+
+static int64_t
+usec_since(const struct timespec *t0)
+{
+	struct timespec	t1, dt;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	timespecsub(&t1, t0, &dt);
+	return (dt.tv_sec * 1000000LL + dt.tv_nsec / 1000);
+}
+
+/* parsing includes the tables, which are also shown on their own */
+static void
+report_config_load(int tolog)
+{
+	struct config_load	*l = &env->sc_load;
+	char			 buf[256];
+
+	(void)snprintf(buf, sizeof buf, "configuration loaded in %lldms: "
+	    "parse %lldms, tables %lldms (%zu loaded, %zu deferred), "
+	    "pki %lldms", (long long)(l->parse + l->pki) / 1000,
+	    (long long)l->parse / 1000, (long long)l->tables / 1000,
+	    l->tables_loaded, l->tables_deferred, (long long)l->pki / 1000);
+	if (tolog)
+		log_info("info: %s", buf);
+	else
+		fprintf(stderr, "%s\n", buf);
 }
 
 static void
 fork_peers(void)
 {
+	size_t	i;
+
 	tree_init(&children);
 
 	init_pipes();
 
+	child_add(ca(), CHILD_DAEMON, proc_title(PROC_CA));
 	child_add(queue(), CHILD_DAEMON, proc_title(PROC_QUEUE));
 	child_add(control(), CHILD_DAEMON, proc_title(PROC_CONTROL));
-	child_add(lka(), CHILD_DAEMON, proc_title(PROC_LKA));
+	for (i = 0; i < env->sc_lka_procs; i++)
+		child_add(lka(i), CHILD_DAEMON, proc_title(PROC_LKA));
 	child_add(mda(), CHILD_DAEMON, proc_title(PROC_MDA));
 	child_add(mfa(), CHILD_DAEMON, proc_title(PROC_MFA));
-	child_add(mta(), CHILD_DAEMON, proc_title(PROC_MTA));
+	for (i = 0; i < env->sc_mta_procs; i++)
+		child_add(mta(i), CHILD_DAEMON, proc_title(PROC_MTA));
 	child_add(scheduler(), CHILD_DAEMON, proc_title(PROC_SCHEDULER));
-	child_add(smtp(), CHILD_DAEMON, proc_title(PROC_SMTP));
+	/* TLS ticket keys are derived from it, only smtp processes get it */
+	arc4random_buf(env->sc_ticket_seed, sizeof env->sc_ticket_seed);
+	for (i = 0; i < env->sc_smtp_procs; i++)
+		child_add(smtp(i), CHILD_DAEMON, proc_title(PROC_SMTP));
+	memset(env->sc_ticket_seed, 0, sizeof env->sc_ticket_seed);
 
 	post_fork(PROC_PARENT);
 }
@@ -754,9 +954,24 @@ fork_peers(void)
 void
 post_fork(int proc)
 {
+	struct pki	*pki;
+	void		*iter;
+
 	if (proc != PROC_QUEUE && env->sc_queue_key)
 		memset(env->sc_queue_key, 0, strlen(env->sc_queue_key));
 
+	/* only the ca process keeps the private keys */
+	iter = NULL;
+	while (proc != PROC_CA && env->sc_pki_dict &&
+	    dict_iter(env->sc_pki_dict, &iter, NULL, (void **)&pki)) {
+		if (pki->pki_key == NULL)
+			continue;
+		memset(pki->pki_key, 0, pki->pki_key_len);
+		free(pki->pki_key);
+		pki->pki_key = NULL;
+		pki->pki_key_len = 0;
+	}
+
 	if (proc != PROC_CONTROL) {
 		close(control_socket);
 		control_socket = -1;
@@ -780,55 +995,6 @@ child_add(pid_t pid, int type, const char *title)
 	return (child);
 }
 
-static void
-purge_task(int fd, short ev, void *arg)
-{
-	struct passwd	*pw;
-	DIR		*d;
-	int		 n;
-	uid_t		 uid;
-	gid_t		 gid;
-
-	if (purge_pid == -1) {
-
-		n = 0;
-		if ((d = opendir(PATH_SPOOL PATH_PURGE))) {
-			while (readdir(d) != NULL)
-				n++;
-			closedir(d);
-		} else
-			log_warn("warn: purge_task: opendir");
-
-		if (n > 2) {
-			switch (purge_pid = fork()) {
-			case -1:
-				log_warn("warn: purge_task: fork");
-				break;
-			case 0:
-				if ((pw = getpwnam(SMTPD_USER)) == NULL)
-					fatalx("unknown user " SMTPD_USER);
-				if (chroot(PATH_SPOOL PATH_PURGE) == -1)
-					fatal("smtpd: chroot");
-				if (chdir("/") == -1)
-					fatal("smtpd: chdir");
-				uid = pw->pw_uid;
-				gid = pw->pw_gid;
-				if (setgroups(1, &gid) ||
-				    setresgid(gid, gid, gid) ||
-				    setresuid(uid, uid, uid))
-					fatal("smtpd: cannot drop privileges");
-				rmtree("/", 1);
-				_exit(0);
-				break;
-			default:
-				break;
-			}
-		}
-	}
-
-	evtimer_add(&purge_ev, &purge_timeout);
-}
-
 static void
 forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 {
@@ -856,6 +1022,9 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 		return;
 	}
 
+	if (db->deliver && mda_worker_run(p, id, deliver))
+		return;
+
 	/* lower privs early to allow fork fail due to ulimit */
 	if (seteuid(deliver->userinfo.uid) < 0)
 		fatal("smtpd: forkmda: cannot lower privileges");
@@ -952,6 +1121,445 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 }
 #undef error
 
+/* hand the delivery to a worker of that user, if one can take it */
+static int
+mda_worker_run(struct mproc *p, uint64_t id, struct deliver *deliver)
+{
+	struct mda_worker	*w, *idle;
+	int			 pipefd[2];
+
+	idle = NULL;
+	TAILQ_FOREACH(w, &mda_workers, entry) {
+		if (w->busy || w->dead)
+			continue;
+		if (w->uid == deliver->userinfo.uid &&
+		    w->gid == deliver->userinfo.gid)
+			break;
+		if (idle == NULL)
+			idle = w;
+	}
+	if (w == NULL) {
+		/* the least recently used idle worker makes room */
+		if (mda_nworkers >= MDA_WORKER_MAX) {
+			if (idle == NULL)
+				return (0);
+			mda_worker_free(idle);
+		}
+		if ((w = mda_worker_fork(deliver)) == NULL)
+			return (0);
+	}
+
+	if (pipe(pipefd) < 0) {
+		log_warn("warn: smtpd: mda worker: pipe");
+		return (0);
+	}
+
+	log_debug("debug: smtpd: mda worker %d for session %016"PRIx64
+	    ": \"%s\" as %s", w->child->pid, id, deliver->to, deliver->user);
+
+	w->busy = 1;
+	w->child->mda_id = id;
+	TAILQ_REMOVE(&mda_workers, w, entry);
+	TAILQ_INSERT_TAIL(&mda_workers, w, entry);
+
+	m_compose(&w->p, IMSG_PARENT_FORK_MDA, 0, 0, pipefd[0], deliver,
+	    sizeof *deliver);
+	m_create(p, IMSG_PARENT_FORK_MDA, 0, 0, pipefd[1]);
+	m_add_id(p, id);
+	m_close(p);
+	return (1);
+}
+
+static struct mda_worker *
+mda_worker_fork(struct deliver *deliver)
+{
+	struct mda_worker	*w;
+	struct timeval		 tv;
+	pid_t			 pid;
+	int			 sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) < 0) {
+		log_warn("warn: smtpd: mda worker: socketpair");
+		return (NULL);
+	}
+
+	/* lower privs early to allow fork fail due to ulimit */
+	if (seteuid(deliver->userinfo.uid) < 0)
+		fatal("smtpd: mda_worker_fork: cannot lower privileges");
+	pid = fork();
+	if (pid == 0) {
+		close(sp[1]);
+		mda_worker_main(sp[0], deliver);
+	}
+	if (seteuid(0) < 0)
+		fatal("smtpd: mda_worker_fork: cannot restore privileges");
+	close(sp[0]);
+	if (pid < 0) {
+		log_warn("warn: smtpd: mda worker: fork");
+		close(sp[1]);
+		return (NULL);
+	}
+
+	w = xcalloc(1, sizeof *w, "mda_worker_fork");
+	w->uid = deliver->userinfo.uid;
+	w->gid = deliver->userinfo.gid;
+	w->child = child_add(pid, CHILD_MDA_WORKER, NULL);
+	w->child->worker = w;
+	w->p.proc = PROC_MDA;
+	w->p.name = xstrdup("mda-worker", "mda_worker_fork");
+	w->p.handler = mda_worker_imsg;
+	session_socket_blockmode(sp[1], BM_NONBLOCK);
+	mproc_init(&w->p, sp[1]);
+	mproc_enable(&w->p);
+	TAILQ_INSERT_TAIL(&mda_workers, w, entry);
+	mda_nworkers++;
+
+	if (! evtimer_pending(&mda_worker_ev, NULL)) {
+		evtimer_set(&mda_worker_ev, mda_worker_reap, NULL);
+		tv.tv_sec = MDA_WORKER_IDLE;
+		tv.tv_usec = 0;
+		evtimer_add(&mda_worker_ev, &tv);
+	}
+
+	log_debug("debug: smtpd: forked mda worker %d for %s", pid,
+	    deliver->user);
+	return (w);
+}
+
+#define error(m) { perror(m); _exit(1); }
+static void
+mda_worker_main(int fd, struct deliver *deliver)
+{
+	struct delivery_backend	*db;
+	struct deliver		 d;
+	struct imsgbuf		 ibuf;
+	struct imsg		 imsg;
+	char			 ebuf[SMTPD_MAXLINESIZE];
+	ssize_t			 n;
+
+	if (dup2(fd, STDIN_FILENO) < 0)
+		error("mda worker: dup2");
+	if (closefrom(STDERR_FILENO + 1) < 0)
+		error("closefrom");
+	if (seteuid(0) < 0)
+		error("mda worker: cannot restore privileges");
+	if (setgroups(1, &deliver->userinfo.gid) ||
+	    setresgid(deliver->userinfo.gid, deliver->userinfo.gid, deliver->userinfo.gid) ||
+	    setresuid(deliver->userinfo.uid, deliver->userinfo.uid, deliver->userinfo.uid))
+		error("mda worker: cannot drop privileges");
+	if (setsid() < 0)
+		error("setsid");
+	if (signal(SIGPIPE, SIG_DFL) == SIG_ERR ||
+	    signal(SIGINT, SIG_DFL) == SIG_ERR ||
+	    signal(SIGTERM, SIG_DFL) == SIG_ERR ||
+	    signal(SIGCHLD, SIG_DFL) == SIG_ERR ||
+	    signal(SIGHUP, SIG_DFL) == SIG_ERR)
+		error("signal");
+	setproctitle("delivery worker for %s", deliver->user);
+
+	imsg_init(&ibuf, STDIN_FILENO);
+	for (;;) {
+		if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN)
+			error("mda worker: imsg_read");
+		/* the parent is done with us */
+		if (n == 0)
+			_exit(0);
+
+		while ((n = imsg_get(&ibuf, &imsg)) > 0) {
+			if (imsg.hdr.type != IMSG_PARENT_FORK_MDA ||
+			    imsg.fd == -1 ||
+			    imsg.hdr.len - IMSG_HEADER_SIZE != sizeof d)
+				_exit(1);
+			memmove(&d, imsg.data, sizeof d);
+			imsg_free(&imsg);
+
+			/* avoid hangs by setting 5m timeout */
+			alarm(300);
+			ebuf[0] = '\0';
+			db = delivery_backend_lookup(d.mode);
+			if (db == NULL || db->deliver == NULL) {
+				close(imsg.fd);
+				strlcpy(ebuf, "mda worker: unknown mode",
+				    sizeof ebuf);
+			}
+			else if (chdir(d.userinfo.directory) < 0 &&
+			    chdir("/") < 0) {
+				close(imsg.fd);
+				snprintf(ebuf, sizeof ebuf, "chdir: %s",
+				    strerror(errno));
+			}
+			else
+				db->deliver(&d, imsg.fd, ebuf, sizeof ebuf);
+			alarm(0);
+
+			if (imsg_compose(&ibuf, IMSG_MDA_DONE, 0, 0, -1, ebuf,
+			    strlen(ebuf) + 1) == -1 || imsg_flush(&ibuf) == -1)
+				error("mda worker: imsg_compose");
+		}
+		if (n == -1)
+			error("mda worker: imsg_get");
+	}
+}
+#undef error
+
+static void
+mda_worker_imsg(struct mproc *p, struct imsg *imsg)
+{
+	struct mda_worker	*w;
+	const char		*cause;
+	size_t			 len;
+
+	TAILQ_FOREACH(w, &mda_workers, entry)
+		if (&w->p == p)
+			break;
+	if (w == NULL)
+		fatalx("smtpd: mda_worker_imsg: unknown worker");
+
+	/* gone, SIGCHLD tells the outcome */
+	if (imsg == NULL) {
+		mproc_clear(&w->p);
+		w->dead = 1;
+		return;
+	}
+
+	if (imsg->hdr.type != IMSG_MDA_DONE || !w->busy)
+		fatalx("smtpd: mda_worker_imsg: unexpected imsg");
+	cause = imsg->data;
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (len == 0 || cause[len - 1] != '\0')
+		fatalx("smtpd: mda_worker_imsg: bad message");
+
+	log_debug("debug: smtpd: mda worker %d done for session %016"PRIx64
+	    ": %s", w->child->pid, w->child->mda_id,
+	    cause[0] ? cause : "ok");
+
+	/* the empty string tells success, as a clean exit does */
+	m_create(p_mda, IMSG_MDA_DONE, 0, 0, -1);
+	m_add_id(p_mda, w->child->mda_id);
+	m_add_string(p_mda, cause[0] ? cause : "exited okay");
+	m_close(p_mda);
+
+	w->busy = 0;
+	w->lastused = time(NULL);
+}
+
+static void
+mda_worker_free(struct mda_worker *w)
+{
+	TAILQ_REMOVE(&mda_workers, w, entry);
+	mda_nworkers--;
+	if (! w->dead)
+		mproc_clear(&w->p);
+	if (w->child)
+		w->child->worker = NULL;
+	free(w->p.m_buf);
+	free(w->p.name);
+	free(w);
+}
+
+/* close the workers idle for too long, they exit on their own */
+static void
+mda_worker_reap(int fd, short event, void *arg)
+{
+	struct mda_worker	*w, *next;
+	struct timeval		 tv;
+	time_t			 now;
+
+	now = time(NULL);
+	for (w = TAILQ_FIRST(&mda_workers); w; w = next) {
+		next = TAILQ_NEXT(w, entry);
+		if (! w->busy && ! w->dead &&
+		    w->lastused + MDA_WORKER_IDLE <= now)
+			mda_worker_free(w);
+	}
+
+	if (mda_nworkers) {
+		tv.tv_sec = MDA_WORKER_IDLE;
+		tv.tv_usec = 0;
+		evtimer_add(&mda_worker_ev, &tv);
+	}
+}
+
+static void
+lmtp_connector_run(uint64_t id, const char *dest,
+    const struct userinfo *userinfo)
+{
+	struct lmtp_connector	*c;
+	pid_t			 pid;
+	int			 sp[2];
+
+	if (! lmtp_connector_allowed(dest)) {
+		log_warnx("warn: smtpd: lmtp destination not in any rule: %s",
+		    dest);
+		lmtp_connector_reply(id, -1, "destination not allowed");
+		return;
+	}
+	if (userinfo->uid == 0) {
+		lmtp_connector_reply(id, -1, "not allowed to connect as root");
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) < 0) {
+		log_warn("warn: smtpd: lmtp connect: socketpair");
+		lmtp_connector_reply(id, -1, "socketpair failed");
+		return;
+	}
+
+	/* lower privs early to allow fork fail due to ulimit */
+	if (seteuid(userinfo->uid) < 0)
+		fatal("smtpd: lmtp_connector_run: cannot lower privileges");
+	pid = fork();
+	if (pid == 0) {
+		close(sp[1]);
+		lmtp_connector_main(sp[0], dest, userinfo);
+	}
+	if (seteuid(0) < 0)
+		fatal("smtpd: lmtp_connector_run: cannot restore privileges");
+	close(sp[0]);
+	if (pid < 0) {
+		log_warn("warn: smtpd: lmtp connect: fork");
+		close(sp[1]);
+		lmtp_connector_reply(id, -1, "fork failed");
+		return;
+	}
+	child_add(pid, CHILD_LMTP_CONNECT, NULL);
+
+	c = xcalloc(1, sizeof *c, "lmtp_connector_run");
+	c->id = id;
+	session_socket_blockmode(sp[1], BM_NONBLOCK);
+	imsg_init(&c->ibuf, sp[1]);
+	event_set(&c->ev, sp[1], EV_READ, lmtp_connector_read, c);
+	event_add(&c->ev, NULL);
+}
+
+/* the destination of an lmtp rule, or an expansion of it */
+static int
+lmtp_connector_allowed(const char *dest)
+{
+	struct rule	*r;
+
+	TAILQ_FOREACH(r, env->sc_rules, r_entry)
+		if (r->r_action == A_LMTP &&
+		    lmtp_dest_match(r->r_value.buffer, dest))
+			return (1);
+	return (0);
+}
+
+/* a %{...} format of the rule stands for any text without a slash */
+static int
+lmtp_dest_match(const char *pattern, const char *dest)
+{
+	const char	*end;
+
+	while (*pattern) {
+		if (pattern[0] == '%' && pattern[1] == '{' &&
+		    (end = strchr(pattern, '}')) != NULL) {
+			pattern = end + 1;
+			for (;; dest++) {
+				if (lmtp_dest_match(pattern, dest))
+					return (1);
+				if (*dest == '\0' || *dest == '/')
+					return (0);
+			}
+		}
+		if (pattern[0] == '%' && pattern[1] == '%')
+			pattern++;
+		if (*pattern++ != *dest++)
+			return (0);
+	}
+	return (*dest == '\0');
+}
+
+#define error(m) { perror(m); _exit(1); }
+static void
+lmtp_connector_main(int fd, const char *dest, const struct userinfo *userinfo)
+{
+	struct imsgbuf	ibuf;
+	char		ebuf[SMTPD_MAXLINESIZE];
+	int		sock;
+
+	if (dup2(fd, STDIN_FILENO) < 0)
+		error("lmtp connect: dup2");
+	if (closefrom(STDERR_FILENO + 1) < 0)
+		error("closefrom");
+	if (seteuid(0) < 0)
+		error("lmtp connect: cannot restore privileges");
+	if (setgroups(1, &userinfo->gid) ||
+	    setresgid(userinfo->gid, userinfo->gid, userinfo->gid) ||
+	    setresuid(userinfo->uid, userinfo->uid, userinfo->uid))
+		error("lmtp connect: cannot drop privileges");
+	if (signal(SIGPIPE, SIG_DFL) == SIG_ERR ||
+	    signal(SIGINT, SIG_DFL) == SIG_ERR ||
+	    signal(SIGTERM, SIG_DFL) == SIG_ERR ||
+	    signal(SIGCHLD, SIG_DFL) == SIG_ERR ||
+	    signal(SIGHUP, SIG_DFL) == SIG_ERR)
+		error("signal");
+
+	/* the resolver may hang */
+	alarm(LMTP_CONNECT_TIMEOUT);
+
+	ebuf[0] = '\0';
+	sock = lmtp_connect(dest, ebuf, sizeof ebuf);
+
+	imsg_init(&ibuf, STDIN_FILENO);
+	if (imsg_compose(&ibuf, IMSG_PARENT_LMTP_CONNECT, 0, 0, sock, ebuf,
+	    strlen(ebuf) + 1) == -1 || imsg_flush(&ibuf) == -1)
+		error("lmtp connect: imsg_compose");
+	_exit(0);
+}
+#undef error
+
+static void
+lmtp_connector_read(int fd, short event, void *arg)
+{
+	struct lmtp_connector	*c = arg;
+	struct imsg		 imsg;
+	const char		*error;
+	size_t			 len;
+	ssize_t			 n;
+	int			 sock;
+
+	if ((n = imsg_read(&c->ibuf)) == -1 && errno == EAGAIN) {
+		event_add(&c->ev, NULL);
+		return;
+	}
+	if (n > 0 && (n = imsg_get(&c->ibuf, &imsg)) == 0) {
+		/* not all of it yet */
+		event_add(&c->ev, NULL);
+		return;
+	}
+
+	sock = -1;
+	error = "connection helper failed";
+	if (n > 0) {
+		len = imsg.hdr.len - IMSG_HEADER_SIZE;
+		sock = imsg.fd;
+		if (imsg.hdr.type == IMSG_PARENT_LMTP_CONNECT && len &&
+		    ((char *)imsg.data)[len - 1] == '\0')
+			error = imsg.data;
+		else if (sock != -1) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	lmtp_connector_reply(c->id, sock, error);
+	if (n > 0)
+		imsg_free(&imsg);
+
+	imsg_clear(&c->ibuf);
+	close(fd);
+	free(c);
+}
+
+static void
+lmtp_connector_reply(uint64_t id, int fd, const char *error)
+{
+	m_create(p_mda, IMSG_PARENT_LMTP_CONNECT, 0, 0, fd);
+	m_add_id(p_mda, id);
+	m_add_string(p_mda, error);
+	m_close(p_mda);
+}
+
 static void
 offline_scan(int fd, short ev, void *arg)
 {
@@ -976,6 +1584,7 @@ offline_scan(int fd, short ev, void *arg)
 		}
 
 		if ((n++) == OFFLINE_READMAX) {
+			offline_run();
 			evtimer_set(&offline_ev, offline_scan, dir);
 			offline_timeout.tv_sec = 0;
 			offline_timeout.tv_usec = 100000;
@@ -984,78 +1593,175 @@ offline_scan(int fd, short ev, void *arg)
 		}
 	}
 
+	offline_run();
 	log_debug("debug: smtpd: offline scanning done");
 	closedir(dir);
 }
 
 static int
-offline_enqueue(char *name)
+offline_add(char *name)
 {
-	char		 t[SMTPD_MAXPATHLEN], *path;
+	struct offline	*q;
 	struct stat	 sb;
-	pid_t		 pid;
-	struct child	*child;
-	struct passwd	*pw;
+	char		 path[SMTPD_MAXPATHLEN];
 
-	if (!bsnprintf(t, sizeof t, "%s/%s", PATH_SPOOL PATH_OFFLINE, name)) {
+	if (!bsnprintf(path, sizeof path, "%s/%s", PATH_SPOOL PATH_OFFLINE,
+	    name)) {
 		log_warnx("warn: smtpd: path name too long");
 		return (-1);
 	}
+	if (lstat(path, &sb) == -1) {
+		log_warn("warn: smtpd: lstat: %s", path);
+		return (-1);
+	}
 
-	if ((path = strdup(t)) == NULL) {
-		log_warn("warn: smtpd: strdup");
+	q = malloc(sizeof(*q) + strlen(path) + 1);
+	if (q == NULL)
 		return (-1);
+	q->uid = sb.st_uid;
+	q->path = (char *)q + sizeof(*q);
+	memmove(q->path, path, strlen(path) + 1);
+	TAILQ_INSERT_TAIL(&offline_q, q, entry);
+
+	return (0);
+}
+
+/* start batches with what is queued */
+static void
+offline_run(void)
+{
+	struct offline	*q, *next, *batch[OFFLINE_BATCH];
+	char		*paths[OFFLINE_BATCH];
+	uid_t		 uid;
+	size_t		 i, n;
+
+	while (offline_running < OFFLINE_QUEUEMAX) {
+		if ((q = TAILQ_FIRST(&offline_q)) == NULL)
+			break; /* all done */
+
+		uid = q->uid;
+		for (n = 0; q && n < OFFLINE_BATCH; q = next) {
+			next = TAILQ_NEXT(q, entry);
+			if (q->uid != uid)
+				continue;
+			TAILQ_REMOVE(&offline_q, q, entry);
+			batch[n] = q;
+			paths[n++] = q->path;
+		}
+		offline_enqueue(uid, paths, n);
+		for (i = 0; i < n; i++)
+			free(batch[i]);
 	}
+}
 
-	log_debug("debug: smtpd: enqueueing offline message %s", path);
+static void
+offline_done(void)
+{
+	offline_running--;
+	offline_run();
+}
+
+static int
+offline_enqueue(uid_t uid, char **paths, size_t n)
+{
+	pid_t		 pid;
+
+	log_debug("debug: smtpd: enqueueing %zu offline messages for uid %d",
+	    n, uid);
 
 	if ((pid = fork()) == -1) {
 		log_warn("warn: smtpd: fork");
-		free(path);
 		return (-1);
 	}
 
-	if (pid == 0) {
-		char	*envp[2], *p, *tmp;
-		FILE	*fp;
-		size_t	 len;
-		arglist	 args;
+	if (pid == 0)
+		offline_batch(uid, paths, n);
 
-		memset(&args, 0, sizeof(args));
+	offline_running++;
+	child_add(pid, CHILD_ENQUEUE_OFFLINE, NULL);
 
-		if (lstat(path, &sb) == -1) {
-			log_warn("warn: smtpd: lstat: %s", path);
-			_exit(1);
-		}
+	return (0);
+}
 
-		if (chflags(path, 0) == -1) {
-			log_warn("warn: smtpd: chflags: %s", path);
-			_exit(1);
-		}
+/*
+ * In the child: check the files, become their owner and submit them one
+ * at a time, removing each once it is in the queue.
+ */
+static void
+offline_batch(uid_t uid, char **paths, size_t n)
+{
+	struct passwd	*pw;
+	struct stat	 sb;
+	size_t		 i, ok;
+	int		 fail = 0;
 
-		pw = getpwuid(sb.st_uid);
-		if (pw == NULL) {
-			log_warnx("warn: smtpd: getpwuid for uid %d failed",
-			    sb.st_uid);
-			_exit(1);
+	signal(SIGCHLD, SIG_DFL);
+
+	for (i = 0, ok = 0; i < n; i++) {
+		if (lstat(paths[i], &sb) == -1) {
+			log_warn("warn: smtpd: lstat: %s", paths[i]);
+			fail = 1;
+			continue;
+		}
+		if (! S_ISREG(sb.st_mode) || sb.st_uid != uid) {
+			log_warnx("warn: smtpd: file %s (uid %d) not regular "
+			    "or not owned", paths[i], sb.st_uid);
+			fail = 1;
+			continue;
+		}
+		if (chflags(paths[i], 0) == -1) {
+			log_warn("warn: smtpd: chflags: %s", paths[i]);
+			fail = 1;
+			continue;
 		}
+		paths[ok++] = paths[i];
+	}
 
-		if (! S_ISREG(sb.st_mode)) {
-			log_warnx("warn: smtpd: file %s (uid %d) not regular",
-			    path, sb.st_uid);
-			_exit(1);
+	pw = getpwuid(uid);
+	if (pw == NULL) {
+		log_warnx("warn: smtpd: getpwuid for uid %d failed", uid);
+		_exit(1);
+	}
+
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid) ||
+	    closefrom(STDERR_FILENO + 1) == -1)
+		_exit(1);
+
+	if (chdir(pw->pw_dir) == -1 && chdir("/") == -1)
+		_exit(1);
+
+	for (i = 0; i < ok; i++) {
+		if (offline_submit(paths[i]) == -1) {
+			log_warnx("warn: smtpd: "
+			    "couldn't enqueue offline message %s", paths[i]);
+			fail = 1;
+			continue;
 		}
+		unlink(paths[i]);
+	}
 
-		if (setgroups(1, &pw->pw_gid) ||
-		    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
-		    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid) ||
-		    closefrom(STDERR_FILENO + 1) == -1)
-			_exit(1);
+	_exit(fail);
+}
 
-		if ((fp = fopen(path, "r")) == NULL)
-			_exit(1);
+static int
+offline_submit(const char *path)
+{
+	char	*envp[2], *p, *tmp;
+	FILE	*fp;
+	size_t	 len;
+	arglist	 args;
+	pid_t	 pid;
+	int	 status;
+
+	if ((pid = fork()) == -1)
+		return (-1);
+
+	if (pid == 0) {
+		memset(&args, 0, sizeof(args));
 
-		if (chdir(pw->pw_dir) == -1 && chdir("/") == -1)
+		if ((fp = fopen(path, "r")) == NULL)
 			_exit(1);
 
 		if (setsid() == -1 ||
@@ -1086,48 +1792,15 @@ offline_enqueue(char *name)
 		_exit(1);
 	}
 
-	offline_running++;
-	child = child_add(pid, CHILD_ENQUEUE_OFFLINE, NULL);
-	child->path = path;
-
-	return (0);
-}
-
-static int
-offline_add(char *path)
-{
-	struct offline	*q;
-
-	if (offline_running < OFFLINE_QUEUEMAX)
-		/* skip queue */
-		return offline_enqueue(path);
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return (-1);
 
-	q = malloc(sizeof(*q) + strlen(path) + 1);
-	if (q == NULL)
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
 		return (-1);
-	q->path = (char *)q + sizeof(*q);
-	memmove(q->path, path, strlen(path) + 1);
-	TAILQ_INSERT_TAIL(&offline_q, q, entry);
-
 	return (0);
 }
 
-static void
-offline_done(void)
-{
-	struct offline	*q;
-
-	offline_running--;
-
-	while (offline_running < OFFLINE_QUEUEMAX) {
-		if ((q = TAILQ_FIRST(&offline_q)) == NULL)
-			break; /* all done */
-		TAILQ_REMOVE(&offline_q, q, entry);
-		offline_enqueue(q->path);
-		free(q);
-	}
-}
-
 static int
 parent_forward_open(char *username, char *directory, uid_t uid, gid_t gid)
 {
@@ -1185,6 +1858,12 @@ imsg_dispatch(struct mproc *p, struct imsg *imsg)
 
 	log_imsg(smtpd_process, p->proc, imsg);
 
+	if (p->proc == PROC_CONTROL &&
+	    imsg->hdr.type == IMSG_CTL_SHOW_IMSG_PROFILE) {
+		imsg_profile_show(p, imsg->hdr.peerid);
+		return;
+	}
+
 	if (profiling & PROFILE_IMSG)
 		clock_gettime(CLOCK_MONOTONIC, &t0);
 
@@ -1194,13 +1873,8 @@ imsg_dispatch(struct mproc *p, struct imsg *imsg)
 		clock_gettime(CLOCK_MONOTONIC, &t1);
 		timespecsub(&t1, &t0, &dt);
 
-		log_debug("profile-imsg: %s %s %s %d %lld.%06ld",
-		    proc_name(smtpd_process),
-		    proc_name(p->proc),
-		    imsg_to_str(imsg->hdr.type),
-		    (int)imsg->hdr.len,
-		    (long long)dt.tv_sec * 1000000 + dt.tv_nsec / 1000000,
-		    dt.tv_nsec % 1000000);
+		imsg_profile_add(p->proc, imsg->hdr.type,
+		    imsg->hdr.len - IMSG_HEADER_SIZE, &dt);
 
 		if (profiling & PROFILE_TOSTAT) {
 			char	key[STAT_KEY_SIZE];
@@ -1219,6 +1893,99 @@ imsg_dispatch(struct mproc *p, struct imsg *imsg)
 	}
 }
 
+static void
+imsg_profile_add(int peer, uint32_t type, size_t len, struct timespec *dt)
+{
+	struct imsg_prof	*ip;
+	uint64_t		 id, us;
+	size_t			 b;
+
+	if (!imsg_prof_init) {
+		tree_init(&imsg_prof);
+		imsg_prof_init = 1;
+	}
+
+	id = ((uint64_t)peer << 32) | type;
+	if ((ip = tree_get(&imsg_prof, id)) == NULL) {
+		ip = xcalloc(1, sizeof *ip, "imsg_profile_add");
+		tree_xset(&imsg_prof, id, ip);
+	}
+
+	us = (uint64_t)dt->tv_sec * 1000000 + dt->tv_nsec / 1000;
+	for (b = 0; b < IMSG_PROF_BUCKETS - 1 && us >> b; b++)
+		;
+	ip->lat[b]++;
+	for (b = 0; b < IMSG_PROF_BUCKETS - 1 && len >> b; b++)
+		;
+	ip->size[b]++;
+
+	ip->count++;
+	ip->usec += us;
+	ip->bytes += len;
+	if (us > ip->usec_max)
+		ip->usec_max = us;
+	if (len > ip->bytes_max)
+		ip->bytes_max = len;
+}
+
+/* Print the non-empty buckets as <bound>:<count> pairs. */
+static size_t
+imsg_profile_hist(char *buf, size_t len, const size_t *hist)
+{
+	size_t	b, n;
+	int	r;
+
+	for (b = 0, n = 0; b < IMSG_PROF_BUCKETS && n < len; b++) {
+		if (hist[b] == 0)
+			continue;
+		if (b == IMSG_PROF_BUCKETS - 1)
+			r = snprintf(buf + n, len - n, "%sinf:%zu",
+			    n ? "," : "", hist[b]);
+		else
+			r = snprintf(buf + n, len - n, "%s%zu:%zu",
+			    n ? "," : "", (size_t)1 << b, hist[b]);
+		if (r == -1)
+			break;
+		n += r;
+	}
+	return (n);
+}
+
+/*
+ * Send one line per peer and imsg type to the control process, ended
+ * by an empty message.
+ */
+void
+imsg_profile_show(struct mproc *p, uint32_t peerid)
+{
+	struct imsg_prof	*ip;
+	void			*iter;
+	uint64_t		 id;
+	char			 buf[2048], lat[512], size[512];
+
+	iter = NULL;
+	while (imsg_prof_init && tree_iter(&imsg_prof, &iter, &id,
+	    (void **)&ip)) {
+		imsg_profile_hist(lat, sizeof lat, ip->lat);
+		imsg_profile_hist(size, sizeof size, ip->size);
+		snprintf(buf, sizeof buf,
+		    "%s <- %s %s count=%zu usec avg=%llu max=%llu "
+		    "bytes avg=%llu max=%zu lat=%s size=%s",
+		    proc_name(smtpd_process),
+		    proc_name(id >> 32),
+		    imsg_to_str(id & 0xffffffff),
+		    ip->count,
+		    (unsigned long long)(ip->usec / ip->count),
+		    (unsigned long long)ip->usec_max,
+		    (unsigned long long)(ip->bytes / ip->count),
+		    ip->bytes_max,
+		    lat, size);
+		m_compose(p, IMSG_CTL_SHOW_IMSG_PROFILE, peerid, 0, -1,
+		    buf, strlen(buf) + 1);
+	}
+	m_compose(p, IMSG_CTL_SHOW_IMSG_PROFILE, peerid, 0, -1, NULL, 0);
+}
+
 static void
 log_imsg(int to, int from, struct imsg *imsg)
 {
@@ -1263,6 +2030,8 @@ proc_title(enum smtp_proc_type proc)
 		return "control";
 	case PROC_SCHEDULER:
 		return "scheduler";
+	case PROC_CA:
+		return "ca";
 	default:
 		return "unknown";
 	}
@@ -1290,6 +2059,8 @@ proc_name(enum smtp_proc_type proc)
 		return "control";
 	case PROC_SCHEDULER:
 		return "scheduler";
+	case PROC_CA:
+		return "ca";
 
 	case PROC_FILTER:
 		return "filter-proc";
@@ -1324,12 +2095,15 @@ imsg_to_str(int type)
 	CASE(IMSG_CTL_RESUME_ROUTE);
 	CASE(IMSG_CTL_LIST_MESSAGES);
 	CASE(IMSG_CTL_LIST_ENVELOPES);
+	CASE(IMSG_CTL_QUERY_ENVELOPES);
 	CASE(IMSG_CTL_REMOVE);
 	CASE(IMSG_CTL_SCHEDULE);
 
 	CASE(IMSG_CTL_TRACE);
 	CASE(IMSG_CTL_UNTRACE);
 	CASE(IMSG_CTL_PROFILE);
+	CASE(IMSG_CTL_SHOW_IMSG_PROFILE);
+	CASE(IMSG_CTL_SHOW_METRICS);
 	CASE(IMSG_CTL_UNPROFILE);
 
 	CASE(IMSG_CTL_MTA_SHOW_HOSTS);
@@ -1339,6 +2113,7 @@ imsg_to_str(int type)
 	CASE(IMSG_CTL_MTA_BLOCK);
 	CASE(IMSG_CTL_MTA_UNBLOCK);
 	CASE(IMSG_CTL_MTA_SHOW_BLOCK);
+	CASE(IMSG_CTL_SET_LIMIT);
 
 	CASE(IMSG_CONF_START);
 	CASE(IMSG_CONF_SSL);
@@ -1360,6 +2135,8 @@ imsg_to_str(int type)
 	CASE(IMSG_LKA_SECRET);
 	CASE(IMSG_LKA_SOURCE);
 	CASE(IMSG_LKA_HELO);
+	CASE(IMSG_LKA_MTASTATE);
+	CASE(IMSG_LKA_MTASTATE_UPDATE);
 	CASE(IMSG_LKA_USERINFO);
 	CASE(IMSG_LKA_AUTHENTICATE);
 	CASE(IMSG_LKA_SSL_INIT);
@@ -1393,6 +2170,8 @@ imsg_to_str(int type)
 
 	CASE(IMSG_MTA_TRANSFER);
 	CASE(IMSG_MTA_SCHEDULE);
+	CASE(IMSG_MTA_HOSTSTAT);
+	CASE(IMSG_MTA_DELIVERY_REPORT);
 
 	CASE(IMSG_QUEUE_CREATE_MESSAGE);
 	CASE(IMSG_QUEUE_SUBMIT_ENVELOPE);
@@ -1401,13 +2180,17 @@ imsg_to_str(int type)
 	CASE(IMSG_QUEUE_COMMIT_MESSAGE);
 	CASE(IMSG_QUEUE_MESSAGE_FD);
 	CASE(IMSG_QUEUE_MESSAGE_FILE);
+	CASE(IMSG_QUEUE_MESSAGE_FILE_RO);
 	CASE(IMSG_QUEUE_REMOVE);
 	CASE(IMSG_QUEUE_EXPIRE);
 	CASE(IMSG_QUEUE_BOUNCE);
+	CASE(IMSG_QUEUE_CREDIT);
+	CASE(IMSG_QUEUE_BACKLOG);
 
 	CASE(IMSG_PARENT_FORWARD_OPEN);
 	CASE(IMSG_PARENT_FORK_MDA);
 	CASE(IMSG_PARENT_KILL_MDA);
+	CASE(IMSG_PARENT_LMTP_CONNECT);
 
 	CASE(IMSG_SMTP_ENQUEUE_FD);
 
@@ -1420,11 +2203,22 @@ imsg_to_str(int type)
 	CASE(IMSG_STAT_INCREMENT);
 	CASE(IMSG_STAT_DECREMENT);
 	CASE(IMSG_STAT_SET);
+	CASE(IMSG_STAT_HISTOGRAM);
+	CASE(IMSG_STAT_RATE);
+
+	CASE(IMSG_CA_PRIVENC);
+	CASE(IMSG_CA_PRIVDEC);
+	CASE(IMSG_CA_PKI);
 
 	CASE(IMSG_DIGEST);
+	CASE(IMSG_CTL_MONITOR);
 	CASE(IMSG_STATS);
 	CASE(IMSG_STATS_GET);
 
+	CASE(IMSG_BATCH);
+	CASE(IMSG_RING_WAKEUP);
+	CASE(IMSG_RING_FD);
+
 	default:
 		snprintf(buf, sizeof(buf), "IMSG_??? (%d)", type);
 
@@ -1451,9 +2245,13 @@ parent_auth_user(const char *username, const char *password)
 static void
 parent_broadcast_verbose(uint32_t v)
 {
-	m_create(p_lka, IMSG_CTL_VERBOSE, 0, 0, -1);
-	m_add_int(p_lka, v);
-	m_close(p_lka);
+	size_t	i;
+
+	for (i = 0; i < env->sc_lka_procs; i++) {
+		m_create(p_lkas[i], IMSG_CTL_VERBOSE, 0, 0, -1);
+		m_add_int(p_lkas[i], v);
+		m_close(p_lkas[i]);
+	}
 	
 	m_create(p_mda, IMSG_CTL_VERBOSE, 0, 0, -1);
 	m_add_int(p_mda, v);
@@ -1463,25 +2261,33 @@ parent_broadcast_verbose(uint32_t v)
 	m_add_int(p_mfa, v);
 	m_close(p_mfa);
 	
-	m_create(p_mta, IMSG_CTL_VERBOSE, 0, 0, -1);
-	m_add_int(p_mta, v);
-	m_close(p_mta);
+	for (i = 0; i < env->sc_mta_procs; i++) {
+		m_create(p_mtas[i], IMSG_CTL_VERBOSE, 0, 0, -1);
+		m_add_int(p_mtas[i], v);
+		m_close(p_mtas[i]);
+	}
 	
 	m_create(p_queue, IMSG_CTL_VERBOSE, 0, 0, -1);
 	m_add_int(p_queue, v);
 	m_close(p_queue);
 	
-	m_create(p_smtp, IMSG_CTL_VERBOSE, 0, 0, -1);
-	m_add_int(p_smtp, v);
-	m_close(p_smtp);
+	for (i = 0; i < env->sc_smtp_procs; i++) {
+		m_create(p_smtps[i], IMSG_CTL_VERBOSE, 0, 0, -1);
+		m_add_int(p_smtps[i], v);
+		m_close(p_smtps[i]);
+	}
 }
 
 static void
 parent_broadcast_profile(uint32_t v)
 {
-	m_create(p_lka, IMSG_CTL_PROFILE, 0, 0, -1);
-	m_add_int(p_lka, v);
-	m_close(p_lka);
+	size_t	i;
+
+	for (i = 0; i < env->sc_lka_procs; i++) {
+		m_create(p_lkas[i], IMSG_CTL_PROFILE, 0, 0, -1);
+		m_add_int(p_lkas[i], v);
+		m_close(p_lkas[i]);
+	}
 	
 	m_create(p_mda, IMSG_CTL_PROFILE, 0, 0, -1);
 	m_add_int(p_mda, v);
@@ -1491,15 +2297,19 @@ parent_broadcast_profile(uint32_t v)
 	m_add_int(p_mfa, v);
 	m_close(p_mfa);
 	
-	m_create(p_mta, IMSG_CTL_PROFILE, 0, 0, -1);
-	m_add_int(p_mta, v);
-	m_close(p_mta);
+	for (i = 0; i < env->sc_mta_procs; i++) {
+		m_create(p_mtas[i], IMSG_CTL_PROFILE, 0, 0, -1);
+		m_add_int(p_mtas[i], v);
+		m_close(p_mtas[i]);
+	}
 	
 	m_create(p_queue, IMSG_CTL_PROFILE, 0, 0, -1);
 	m_add_int(p_queue, v);
 	m_close(p_queue);
 	
-	m_create(p_smtp, IMSG_CTL_PROFILE, 0, 0, -1);
-	m_add_int(p_smtp, v);
-	m_close(p_smtp);
+	for (i = 0; i < env->sc_smtp_procs; i++) {
+		m_create(p_smtps[i], IMSG_CTL_PROFILE, 0, 0, -1);
+		m_add_int(p_smtps[i], v);
+		m_close(p_smtps[i]);
+	}
 }
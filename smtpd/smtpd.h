@@ -31,7 +31,10 @@
 #define MAILNAME_FILE		 "/etc/mail/mailname"
 #define CA_FILE			 "/etc/ssl/cert.pem"
 
-#define PROC_COUNT		 10
+#define PROC_COUNT		 11
+#define MTA_PROCS_MAX		 16
+#define SMTP_PROCS_MAX		 16
+#define LKA_PROCS_MAX		 16
 
 #define MAX_HOPS_COUNT		 100
 #define	DEFAULT_MAX_BODY_SIZE	(35*1024*1024)
@@ -55,6 +58,7 @@
 #define PATH_OFFLINE		"/offline"
 #define PATH_PURGE		"/purge"
 #define PATH_TEMPORARY		"/temporary"
+#define PATH_SNAPSHOT		"/snapshot"
 
 #define	PATH_FILTERS		"/usr/libexec/smtpd"
 #define	PATH_TABLES		"/usr/libexec/smtpd"
@@ -79,6 +83,7 @@
 #define	F_LMTP			0x80
 #define	F_MASK_SOURCE		0x100
 #define	F_TLS_VERIFY		0x200
+#define	F_TLS_RESUME		0x400
 
 /* must match F_* for mta */
 #define RELAY_STARTTLS		0x01
@@ -126,8 +131,12 @@ struct destination {
 	char	name[SMTPD_MAXHOSTNAMELEN];
 };
 
+/* the weight of a source address tells how many connections it takes */
+#define	SOURCE_MAX		256	/* addresses returned for a relay */
+#define	SOURCE_WEIGHT_MAX	1000
 struct source {
 	struct sockaddr_storage	addr;
+	int			weight;
 };
 
 struct addrname {
@@ -135,6 +144,13 @@ struct addrname {
 	char			name[SMTPD_MAXHOSTNAMELEN];
 };
 
+/* the health of a destination as shared by the mta of several nodes */
+struct mtastate {
+	time_t			until;		/* back off until then */
+	size_t			window;		/* adaptive connection limit */
+	uint32_t		failures;	/* consecutive tempfails */
+};
+
 union lookup {
 	struct expand		*expand;
 	struct credentials	 creds;
@@ -144,13 +160,14 @@ union lookup {
 	struct userinfo		 userinfo;
 	struct mailaddr		 mailaddr;
 	struct addrname		 addrname;
+	struct mtastate		 mtastate;
 };
 
 /*
  * Bump IMSG_VERSION whenever a change is made to enum imsg_type.
  * This will ensure that we can never use a wrong version of smtpctl with smtpd.
  */
-#define	IMSG_VERSION		8
+#define	IMSG_VERSION		9
 
 enum imsg_type {
 	IMSG_NONE,
@@ -169,9 +186,12 @@ enum imsg_type {
 	IMSG_CTL_RESUME_ROUTE,
 	IMSG_CTL_LIST_MESSAGES,
 	IMSG_CTL_LIST_ENVELOPES,
+	IMSG_CTL_QUERY_ENVELOPES,
 	IMSG_CTL_REMOVE,
 	IMSG_CTL_SCHEDULE,
 	IMSG_CTL_SHOW_STATUS,
+	IMSG_CTL_SHOW_IMSG_PROFILE,
+	IMSG_CTL_SHOW_METRICS,
 
 	IMSG_CTL_TRACE,
 	IMSG_CTL_UNTRACE,
@@ -185,6 +205,7 @@ enum imsg_type {
 	IMSG_CTL_MTA_BLOCK,
 	IMSG_CTL_MTA_UNBLOCK,
 	IMSG_CTL_MTA_SHOW_BLOCK,
+	IMSG_CTL_SET_LIMIT,
 
 	IMSG_CONF_START,
 	IMSG_CONF_SSL,
@@ -206,6 +227,8 @@ enum imsg_type {
 	IMSG_LKA_SECRET,
 	IMSG_LKA_SOURCE,
 	IMSG_LKA_HELO,
+	IMSG_LKA_MTASTATE,
+	IMSG_LKA_MTASTATE_UPDATE,
 	IMSG_LKA_USERINFO,
 	IMSG_LKA_AUTHENTICATE,
 	IMSG_LKA_SSL_INIT,
@@ -239,6 +262,8 @@ enum imsg_type {
 
 	IMSG_MTA_TRANSFER,
 	IMSG_MTA_SCHEDULE,
+	IMSG_MTA_HOSTSTAT,
+	IMSG_MTA_DELIVERY_REPORT,
 
 	IMSG_QUEUE_CREATE_MESSAGE,
 	IMSG_QUEUE_SUBMIT_ENVELOPE,
@@ -247,13 +272,19 @@ enum imsg_type {
 	IMSG_QUEUE_COMMIT_MESSAGE,
 	IMSG_QUEUE_MESSAGE_FD,
 	IMSG_QUEUE_MESSAGE_FILE,
+	IMSG_QUEUE_MESSAGE_FILE_RO,
 	IMSG_QUEUE_REMOVE,
 	IMSG_QUEUE_EXPIRE,
 	IMSG_QUEUE_BOUNCE,
+	IMSG_QUEUE_SNAPSHOT,
+	IMSG_QUEUE_SUBMIT_SNAPSHOT,
+	IMSG_QUEUE_CREDIT,
+	IMSG_QUEUE_BACKLOG,
 
 	IMSG_PARENT_FORWARD_OPEN,
 	IMSG_PARENT_FORK_MDA,
 	IMSG_PARENT_KILL_MDA,
+	IMSG_PARENT_LMTP_CONNECT,
 
 	IMSG_SMTP_ENQUEUE_FD,
 
@@ -266,10 +297,21 @@ enum imsg_type {
 	IMSG_STAT_INCREMENT,
 	IMSG_STAT_DECREMENT,
 	IMSG_STAT_SET,
+	IMSG_STAT_HISTOGRAM,
+	IMSG_STAT_RATE,
+
+	IMSG_CA_PRIVENC,
+	IMSG_CA_PRIVDEC,
+	IMSG_CA_PKI,
 
 	IMSG_DIGEST,
+	IMSG_CTL_MONITOR,
 	IMSG_STATS,
 	IMSG_STATS_GET,
+
+	IMSG_BATCH,
+	IMSG_RING_WAKEUP,
+	IMSG_RING_FD,
 };
 
 enum blockmodes {
@@ -287,6 +329,7 @@ enum smtp_proc_type {
 	PROC_MTA,
 	PROC_CONTROL,
 	PROC_SCHEDULER,
+	PROC_CA,
 
 	PROC_FILTER,
 	PROC_CLIENT,
@@ -305,12 +348,18 @@ struct table {
 	char				 t_config[SMTPD_MAXPATHLEN];
 
 	struct dict			 t_dict;
+	char				*t_arena;	/* bulk loaded entries */
+	size_t				 t_arenalen;
 
 	void				*t_handle;
 	struct table_backend		*t_backend;
 	void				*t_iter;
+	struct table_cache		*t_cache;
 };
 
+/* returned by an update that must be called again to complete */
+#define	TABLE_UPDATE_AGAIN	2
+
 struct table_backend {
 	const unsigned int	services;
 	int	(*config)(struct table *);
@@ -319,6 +368,9 @@ struct table_backend {
 	void	(*close)(void *);
 	int	(*lookup)(void *, const char *, enum table_service, union lookup *);
 	int	(*fetch)(void *, enum table_service, union lookup *);
+	int	(*lookup_batch)(void *, const char **, size_t, enum table_service,
+	    union lookup *, int *);
+	int	(*store)(void *, const char *, enum table_service, const char *);
 };
 
 
@@ -343,6 +395,8 @@ enum decision {
 	R_ACCEPT
 };
 
+struct expand_format;
+
 struct rule {
 	TAILQ_ENTRY(rule)		r_entry;
 	enum decision			r_decision;
@@ -367,12 +421,23 @@ struct rule {
 		char			buffer[EXPAND_BUFFER];
 		struct relayhost	relayhost;
 	}				r_value;
+	struct expand_format	       *r_format;
 
 	struct mailaddr		       *r_as;
 	struct table		       *r_mapping;
 	struct table		       *r_userbase;
 	time_t				r_qexpire;
 	uint8_t				r_forwardonly;
+	uint8_t				r_priority;
+};
+
+/* hand envelopes over to a peer once the local node falls behind */
+struct offload {
+	TAILQ_ENTRY(offload)		o_entry;
+	char			       *o_domain;	/* NULL for any */
+	struct relayhost		o_relay;
+	time_t				o_age;		/* 0 if unset */
+	size_t				o_backlog;	/* 0 if unset */
 };
 
 struct delivery_mda {
@@ -437,6 +502,13 @@ struct expandnode {
 	}			u;
 };
 
+/* copies of the nodes offered to expand_insert(), duplicates included */
+struct expandrecord {
+	size_t				 count;
+	size_t				 size;
+	struct expandnode		*nodes;
+};
+
 struct expand {
 	RB_HEAD(expandtree, expandnode)	 tree;
 	TAILQ_HEAD(xnodes, expandnode)	*queue;
@@ -444,6 +516,12 @@ struct expand {
 	size_t				 nb_nodes;
 	struct rule			*rule;
 	struct expandnode		*parent;
+	struct expandrecord		*record;
+
+	/* nodes are carved from chunks and released with the expansion */
+	struct expandchunk		*chunks;
+	struct expandnode		**slots;
+	size_t				 nslots;
 };
 
 #define DSN_SUCCESS 0x01
@@ -474,6 +552,7 @@ struct envelope {
 	struct mailaddr			dest;
 
 	enum delivery_type		type;
+	uint8_t				priority;	/* delivery_priority */
 	union {
 		struct delivery_mda	mda;
 		struct delivery_mta	mta;
@@ -496,6 +575,27 @@ struct envelope {
 	uint8_t				esc_code;
 };
 
+/*
+ * Timestamps of a message on its way through the daemon, in microseconds
+ * since the epoch, 0 when unknown.  They are taken while envelope
+ * profiling is on, and go along with the imsgs, not on disk.
+ */
+enum evptrace_stage {
+	EVPTRACE_ACCEPT,	/* MAIL FROM accepted */
+	EVPTRACE_EOM,		/* end of data received */
+	EVPTRACE_COMMIT,	/* message committed to the queue */
+	EVPTRACE_SCHEDULE,	/* first handed out by the scheduler */
+	EVPTRACE_CONNECT,	/* session to the relay established */
+	EVPTRACE_DONE,		/* accepted by the relay or delivered */
+	EVPTRACE_MAX
+};
+
+#define	EVPTRACE_SAMPLE	64	/* one message in so many is logged */
+
+struct evptrace {
+	uint64_t	ts[EVPTRACE_MAX];
+};
+
 struct listener {
 	uint16_t       		 flags;
 	int			 fd;
@@ -508,9 +608,20 @@ struct listener {
 	char			 authtable[SMTPD_MAXLINESIZE];
 	char			 hostname[SMTPD_MAXHOSTNAMELEN];
 	char			 hostnametable[SMTPD_MAXPATHLEN];
+	uint32_t		 ratelimit;	/* connections/minute/netblock */
+	uint32_t		 rateburst;
 	TAILQ_ENTRY(listener)	 entry;
 };
 
+/* time spent loading the configuration, in microseconds */
+struct config_load {
+	int64_t		parse;
+	int64_t		tables;
+	int64_t		pki;
+	size_t		tables_loaded;
+	size_t		tables_deferred;
+};
+
 struct smtpd {
 	char				sc_conffile[SMTPD_MAXPATHLEN];
 	size_t				sc_maxsize;
@@ -532,9 +643,19 @@ struct smtpd {
 #define QUEUE_COMPRESSION      		0x00000001
 #define QUEUE_ENCRYPTION      		0x00000002
 #define QUEUE_EVPCACHE			0x00000004
+#define QUEUE_GROUPCOMMIT		0x00000008
+#define QUEUE_BINARY			0x00000010
+#define QUEUE_DEDUP			0x00000020
+
+/* flow control credits sent by the queue, see queue.c */
+#define	QUEUE_CREDIT_MAX		100
 	uint32_t			sc_queue_flags;
 	char			       *sc_queue_key;
+	char			       *sc_queue_compress_algo;
 	size_t				sc_queue_evpcache_size;
+	size_t				sc_queue_ram_size;
+	size_t				sc_queue_group_commit_max;
+	size_t				sc_queue_group_commit_delay;
 
 	size_t				sc_mda_max_session;
 	size_t				sc_mda_max_user_session;
@@ -543,8 +664,15 @@ struct smtpd {
 	size_t				sc_mda_task_release;
 
 	size_t				sc_mta_max_deferred;
+	char			       *sc_mta_state;	/* shared state table */
+	size_t				sc_mta_procs;
+	size_t				sc_smtp_procs;
+	size_t				sc_lka_procs;
+	size_t				sc_ipc_ring;
+	uint8_t				sc_ticket_seed[32];
 
 	size_t				sc_scheduler_max_inflight;
+	size_t				sc_scheduler_max_inflight_prio[PRIO_COUNT];
 	size_t				sc_scheduler_max_evp_batch_size;
 	size_t				sc_scheduler_max_msg_batch_size;
 	size_t				sc_scheduler_max_schedule;
@@ -561,11 +689,14 @@ struct smtpd {
 	TAILQ_HEAD(listenerlist, listener)	*sc_listeners;
 
 	TAILQ_HEAD(rulelist, rule)		*sc_rules;
+	TAILQ_HEAD(offloadlist, offload)	*sc_offloads;
 	
 	struct dict			       *sc_pki_dict;
 	struct dict			       *sc_ssl_dict;
+	size_t					sc_pki_cache_size;
 
 	struct dict			       *sc_tables_dict;		/* keyed lookup	*/
+	struct config_load			sc_load;
 
 	struct dict			       *sc_limits_dict;
 
@@ -592,6 +723,8 @@ struct smtpd {
 #define PROFILE_TOSTAT	0x0001
 #define PROFILE_IMSG	0x0002
 #define PROFILE_QUEUE	0x0004
+#define PROFILE_IO	0x0008
+#define PROFILE_ENVELOPE	0x0010
 
 struct forward_req {
 	uint64_t			id;
@@ -613,11 +746,13 @@ struct deliver {
 };
 
 #define MAX_FILTER_PER_CHAIN	16
+#define FILTER_PROCS_MAX	16
 struct filter {
 	int			chain;
 	int			done;
 	char			name[MAX_FILTER_NAME];
 	char			path[SMTPD_MAXPATHLEN];
+	int			procs;
 	char			filters[MAX_FILTER_NAME][MAX_FILTER_PER_CHAIN];
 };
 
@@ -627,6 +762,7 @@ struct mta_host {
 	char			*ptrname;
 	int			 refcount;
 	size_t			 nconn;
+	size_t			 nconnecting;	/* connect in progress */
 	time_t			 lastconn;
 	time_t			 lastptrquery;
 
@@ -645,11 +781,14 @@ struct mta_domain {
 	char			*name;
 	int			 flags;
 	TAILQ_HEAD(, mta_mx)	 mxs;
+	TAILQ_HEAD(, mta_mx)	 mxpending;
 	int			 mxstatus;
+	int			 mxquery;
 	int			 refcount;
 	size_t			 nconn;
 	time_t			 lastconn;
 	time_t			 lastmxquery;
+	time_t			 mxexpire;
 };
 
 struct mta_source {
@@ -690,6 +829,29 @@ struct mta_connector {
 	time_t				 lastconn;
 };
 
+/* phases of an outgoing session, timed by the MTA */
+enum mta_phase {
+	MTA_PHASE_NONE = -1,
+	MTA_PHASE_CONNECT,
+	MTA_PHASE_TLS,
+	MTA_PHASE_HELO,
+	MTA_PHASE_AUTH,
+	MTA_PHASE_MAIL,
+	MTA_PHASE_DATA,
+	MTA_PHASE_COUNT
+};
+
+/* bucket n counts phases that took less than 2^n milliseconds */
+#define	MTA_STATS_BUCKETS	16
+
+struct mta_stats {
+	size_t			 hist[MTA_PHASE_COUNT][MTA_STATS_BUCKETS];
+	size_t			 nmsg;
+	size_t			 nbytes;
+	time_t			 since;
+	int			 dirty;
+};
+
 struct mta_route {
 	SPLAY_ENTRY(mta_route)	 entry;
 	uint64_t		 id;
@@ -709,6 +871,8 @@ struct mta_route {
 	time_t			 lastconn;
 	time_t			 lastdisc;
 	time_t			 lastpenalty;
+
+	struct mta_stats	 stats;
 };
 
 struct mta_limits {
@@ -736,9 +900,14 @@ struct mta_limits {
 
 	int	family;
 
+	int	adaptive;	/* AIMD window on top of maxconn_per_relay */
+
 	int	task_hiwat;
 	int	task_lowat;
 	int	task_release;
+
+	int	shape_rate;	/* messages per minute per sender */
+	int	shape_burst;
 };
 
 struct mta_relay {
@@ -762,6 +931,8 @@ struct mta_relay {
 	int			 state;
 	size_t			 ntask;
 	TAILQ_HEAD(, mta_task)	 tasks;
+	size_t			 ndeferred;	/* held by the shapers */
+	struct dict		 shapers;
 
 	struct tree		 connectors;
 	size_t			 sourceloop;
@@ -784,6 +955,16 @@ struct mta_relay {
 	size_t			 nconn;
 	size_t			 nconn_ready;
 	time_t			 lastconn;
+
+	size_t			 window;	/* adaptive connection limit */
+	size_t			 windowacks;
+
+	time_t			 statecheck;	/* next shared state lookup */
+	time_t			 stateuntil;	/* the shared state holds */
+	size_t			 statewindow;
+	int			 statedown;
+
+	struct mta_stats	 stats;
 };
 
 struct mta_envelope {
@@ -802,7 +983,8 @@ struct mta_envelope {
 	uint8_t				dsn_notify;
 	enum dsn_ret			dsn_ret;
 
-	char				 status[SMTPD_MAXLINESIZE];
+	char				*status;
+	struct evptrace			 trace;
 };
 
 struct mta_task {
@@ -841,6 +1023,37 @@ struct auth_backend {
 struct delivery_backend {
 	int	allow_root;
 	void	(*open)(struct deliver *);
+	/* deliver from fd, which it closes, within a long-lived worker */
+	int	(*deliver)(struct deliver *, int, char *, size_t);
+};
+
+/*
+ * Filtered walk of the scheduler index for smtpctl, a request resumes
+ * at "from" and is bounded by "scan" envelopes looked at.  The scheduler
+ * only compares hashes of the domain and sender, the queue confirms the
+ * rows it returns against the envelopes.
+ */
+#define	SCHEDULER_QUERY_SCAN	4096
+
+struct scheduler_query {
+	uint64_t	from;		/* updated, 0 once done */
+	size_t		scan;
+	uint16_t	flags;		/* EF_* the envelope must have */
+	time_t		minage;
+	time_t		maxage;
+	char		domain[SMTPD_MAXDOMAINPARTSIZE];
+	char		sender[SMTPD_MAXLOCALPARTSIZE + SMTPD_MAXDOMAINPARTSIZE];
+	uint32_t	rcptkey;	/* set by the scheduler */
+	uint32_t	senderkey;
+};
+
+struct evpsummary {
+	uint64_t	evpid;
+	uint16_t	flags;
+	uint8_t		type;
+	uint8_t		priority;
+	time_t		creation;
+	time_t		time;		/* as in struct evpstate */
 };
 
 struct scheduler_backend {
@@ -863,6 +1076,10 @@ struct scheduler_backend {
 	int	(*remove)(uint64_t);
 	int	(*suspend)(uint64_t);
 	int	(*resume)(uint64_t);
+
+	/* optional */
+	size_t	(*snapshot)(uint64_t, struct scheduler_info *, size_t);
+	size_t	(*query)(struct scheduler_query *, struct evpsummary *, size_t);
 };
 
 enum stat_type {
@@ -870,6 +1087,8 @@ enum stat_type {
 	STAT_TIMESTAMP,
 	STAT_TIMEVAL,
 	STAT_TIMESPEC,
+	STAT_HISTOGRAM,
+	STAT_RATE,
 };
 
 struct stat_value {
@@ -879,9 +1098,39 @@ struct stat_value {
 		time_t		timestamp;
 		struct timeval	tv;
 		struct timespec	ts;
+		struct {
+			size_t		count;
+			uint64_t	sum;
+			uint64_t	mean;
+			uint64_t	p50;
+			uint64_t	p90;
+			uint64_t	p99;
+			uint64_t	max;
+		} hist;
+		double		rate;	/* per second */
 	} u;
 };
 
+/*
+ * Log-linear buckets: exact below 4, then 4 buckets per power of two,
+ * so that a bucket is never wider than a quarter of its lower bound.
+ */
+#define	STAT_HISTOGRAM_BUCKETS	252
+struct stat_histogram {
+	size_t		count;
+	uint64_t	sum;
+	uint64_t	max;
+	uint32_t	buckets[STAT_HISTOGRAM_BUCKETS];
+};
+
+/* events per second, averaged over about a minute */
+#define	STAT_RATE_DECAY		0.98347145	/* exp(-1/60) */
+struct stat_rate {
+	double		rate;
+	size_t		pending;	/* events in the current second */
+	time_t		last;
+};
+
 #define	STAT_KEY_SIZE	1024
 struct stat_kv {
 	void	*iter;
@@ -896,6 +1145,8 @@ struct stat_backend {
 	void	(*decrement)(const char *, size_t);
 	void	(*set)(const char *, const struct stat_value *);
 	int	(*iter)(void **, char **, struct stat_value *);
+	void	(*histogram)(const char *, uint64_t);
+	void	(*rate)(const char *, size_t);
 };
 
 struct stat_digest {
@@ -918,6 +1169,23 @@ struct stat_digest {
 	size_t			 dlv_loop;
 };
 
+/*
+ * The counters of a digest, in order from clt_connect.  A monitor frame
+ * is a uint32_t mask of the counters that changed, followed by the delta
+ * of each of them as a size_t.
+ */
+#define	STAT_DIGEST_COUNTERS	11
+#define	STAT_DIGEST_COUNTER(d, i)	(&(d)->clt_connect + (i))
+
+/* "smtpctl set limit", see limit.c */
+#define	LIMIT_NAME_SIZE	64
+struct ctl_limit {
+	char	name[LIMIT_NAME_SIZE];
+	int64_t	value;
+};
+
+
+struct mproc_ring;
 
 struct mproc {
 	pid_t		 pid;
@@ -934,6 +1202,25 @@ struct mproc {
 	pid_t		 m_pid;
 	int		 m_fd;
 
+	uint32_t	 b_type;	/* see m_batch_evpid() */
+	size_t		 b_count;
+	uint64_t	*b_evpids;
+	struct event	 b_ev;
+
+	struct mproc_ring *r_out;	/* see mproc_set_ring() */
+	struct mproc_ring *r_in;
+	char		*r_pend;
+	size_t		 r_pendlen;
+	size_t		 r_pendalloc;
+	int		*r_fds;
+	size_t		 r_nfds;
+	size_t		 r_fdalloc;
+	struct event	 r_ev;
+
+	TAILQ_ENTRY(mproc) f_entry;	/* see mproc_event_add() */
+	int		 f_queued;
+	int		 f_flush;
+
 	int		 enable;
 	short		 events;
 	struct event	 ev;
@@ -945,6 +1232,15 @@ struct mproc {
 	off_t		 bytes_out;
 	size_t		 bytes_queued;
 	size_t		 bytes_queued_max;
+	size_t		 w_calls;	/* writes since the last stat */
+	size_t		 w_msgs;	/* imsgs carried by them */
+
+	char		*e_out;		/* see m_add_envelope() */
+	size_t		 e_outlen;
+	uint64_t	 e_outid;
+	char		*e_in;
+	size_t		 e_inlen;
+	uint64_t	 e_inid;
 };
 
 struct msg {
@@ -953,19 +1249,26 @@ struct msg {
 };
 
 extern enum smtp_proc_type	smtpd_process;
+extern int			mta_shard;
+extern int			smtp_shard;
+extern int			lka_shard;
 
 extern int verbose;
 extern int profiling;
 
+extern struct mproc *p_ca;
 extern struct mproc *p_control;
 extern struct mproc *p_parent;
 extern struct mproc *p_lka;
+extern struct mproc *p_lkas[LKA_PROCS_MAX];
 extern struct mproc *p_mda;
 extern struct mproc *p_mfa;
 extern struct mproc *p_mta;
+extern struct mproc *p_mtas[MTA_PROCS_MAX];
 extern struct mproc *p_queue;
 extern struct mproc *p_scheduler;
 extern struct mproc *p_smtp;
+extern struct mproc *p_smtps[SMTP_PROCS_MAX];
 
 extern struct smtpd	*env;
 extern void (*imsg_callback)(struct mproc *, struct imsg *);
@@ -1025,6 +1328,7 @@ struct ca_cert_resp_msg {
 	off_t			cert_len;
 	char		       *key;
 	off_t			key_len;
+	off_t			dhparams_len;
 };
 
 struct ca_vrfy_req_msg {
@@ -1061,6 +1365,11 @@ void bounce_fd(int);
 
 
 /* ca.c */
+pid_t	ca(void);
+void	ca_init(void);
+void	ca_reply(struct imsg *);
+int	ca_async_attach(void (*)(void *), void *);
+int	ca_async_detach(void *);
 int	ca_X509_verify(void *, void *, const char *, const char *, const char **);
 
 
@@ -1093,6 +1402,8 @@ int control_create_socket(void);
 int	crypto_setup(const char *, size_t);
 int	crypto_encrypt_file(FILE *, FILE *);
 int	crypto_decrypt_file(FILE *, FILE *);
+int	crypto_decrypt_file_range(FILE *, FILE *, off_t, size_t);
+int	crypto_decrypt_file_headers(FILE *, FILE *);
 size_t	crypto_encrypt_buffer(const char *, size_t, char *, size_t);
 size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
 
@@ -1101,6 +1412,13 @@ size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
 struct delivery_backend *delivery_backend_lookup(enum action_type);
 
 
+/* delivery_lmtp.c */
+int lmtp_connect(const char *, char *, size_t);
+void lmtp_deliver(uint64_t, const char *, const char *,
+    const struct userinfo *, uint32_t, FILE *);
+void lmtp_connected(uint64_t, int, const char *);
+
+
 /* dns.c */
 void dns_query_host(uint64_t, const char *);
 void dns_query_ptr(uint64_t, const struct sockaddr *);
@@ -1119,6 +1437,11 @@ void envelope_set_esc_class(struct envelope *, enum enhanced_status_class);
 void envelope_set_esc_code(struct envelope *, enum enhanced_status_code);
 int envelope_load_buffer(struct envelope *, const char *, size_t);
 int envelope_dump_buffer(const struct envelope *, char *, size_t);
+int envelope_dump_binary(const struct envelope *, char *, size_t);
+int envelope_delta_binary(const char *, size_t, const char *, size_t, char *,
+    size_t);
+int envelope_patch_binary(const char *, size_t, const char *, size_t, char *,
+    size_t);
 
 
 /* expand.c */
@@ -1148,14 +1471,22 @@ void imsgproc_reset_callback(struct imsgproc *, void (*)(struct imsg *, void *),
 /* limit.c */
 void limit_mta_set_defaults(struct mta_limits *);
 int limit_mta_set(struct mta_limits *, const char*, int64_t);
+int limit_process(const char *);
+int limit_set(const char *, int64_t);
 
 /* lka.c */
-pid_t lka(void);
+pid_t lka(int);
+struct mproc *lka_peer(uint64_t);
+void lka_forward(struct imsg *);
+void lka_enable(int);
 
 
 /* lka_session.c */
 void lka_session(uint64_t, struct envelope *);
 void lka_session_forward_reply(struct forward_req *, int);
+struct expand_format *lka_format_compile(const char *);
+void lka_format_free(struct expand_format *);
+void lka_format_compile_rules(void);
 
 
 /* log.c */
@@ -1164,6 +1495,7 @@ void vlog(int, const char *, va_list);
 
 /* mda.c */
 pid_t mda(void);
+void mda_lmtp_done(uint64_t, const char *);
 
 
 /* mfa.c */
@@ -1182,6 +1514,8 @@ void mfa_filter_eom(uint64_t, int, size_t);
 void mfa_filter(uint64_t, int);
 void mfa_filter_event(uint64_t, int);
 void mfa_build_fd_chain(uint64_t, int);
+int mfa_filter_data(uint64_t);
+void mfa_set_message_fd(uint64_t, int);
 
 /* mproc.c */
 int mproc_fork(struct mproc *, const char*, const char *);
@@ -1189,6 +1523,9 @@ void mproc_init(struct mproc *, int);
 void mproc_clear(struct mproc *);
 void mproc_enable(struct mproc *);
 void mproc_disable(struct mproc *);
+struct mproc_ring *mproc_ring_new(size_t);
+void mproc_ring_free(struct mproc_ring *);
+void mproc_set_ring(struct mproc *, struct mproc_ring *, struct mproc_ring *);
 void m_compose(struct mproc *, uint32_t, uint32_t, pid_t, int, void *, size_t);
 void m_composev(struct mproc *, uint32_t, uint32_t, pid_t, int,
     const struct iovec *, int);
@@ -1197,6 +1534,7 @@ void m_create(struct mproc *, uint32_t, uint32_t, pid_t, int);
 void m_add(struct mproc *, const void *, size_t);
 void m_add_int(struct mproc *, int);
 void m_add_u32(struct mproc *, uint32_t);
+void m_add_size(struct mproc *, size_t);
 void m_add_time(struct mproc *, time_t);
 void m_add_string(struct mproc *, const char *);
 void m_add_data(struct mproc *, const void *, size_t);
@@ -1207,12 +1545,14 @@ void m_add_sockaddr(struct mproc *, const struct sockaddr *);
 void m_add_mailaddr(struct mproc *, const struct mailaddr *);
 void m_add_envelope(struct mproc *, const struct envelope *);
 void m_close(struct mproc *);
+void m_batch_evpid(struct mproc *, uint32_t, uint64_t);
 
 void m_msg(struct msg *, struct imsg *);
 int  m_is_eom(struct msg *);
 void m_end(struct msg *);
 void m_get_int(struct msg *, int *);
 void m_get_u32(struct msg *, uint32_t *);
+void m_get_size(struct msg *, size_t *);
 void m_get_time(struct msg *, time_t *);
 void m_get_string(struct msg *, const char **);
 void m_get_data(struct msg *, const void **, size_t *);
@@ -1225,15 +1565,23 @@ void m_get_envelope(struct msg *, struct envelope *);
 
 
 /* mta.c */
-pid_t mta(void);
+pid_t mta(int);
+struct mproc *mta_peer(const struct envelope *);
+void mta_forward(struct imsg *);
+void mta_enable(int);
 void mta_route_ok(struct mta_relay *, struct mta_route *);
 void mta_route_error(struct mta_relay *, struct mta_route *);
 void mta_route_down(struct mta_relay *, struct mta_route *);
 void mta_route_collect(struct mta_relay *, struct mta_route *);
+void mta_relay_ack(struct mta_relay *);
+void mta_relay_backoff(struct mta_relay *, const char *);
+void mta_stats_phase(struct mta_relay *, struct mta_route *, enum mta_phase, int64_t);
+void mta_stats_sent(struct mta_relay *, struct mta_route *, size_t);
 void mta_source_error(struct mta_relay *, struct mta_route *, const char *);
 void mta_delivery_log(struct mta_envelope *, const char *, const char *, int, const char *);
 void mta_delivery_notify(struct mta_envelope *);
 struct mta_task *mta_route_next_task(struct mta_relay *, struct mta_route *);
+struct mta_relay *mta_route_share(struct mta_relay *, struct mta_route *);
 const char *mta_host_to_text(struct mta_host *);
 const char *mta_relay_to_text(struct mta_relay *);
 
@@ -1263,18 +1611,34 @@ int queue_init(const char *, int);
 int queue_message_create(uint32_t *);
 int queue_message_delete(uint32_t);
 int queue_message_commit(uint32_t);
+int queue_message_sync(uint32_t);
+int queue_message_can_sync(void);
+int queue_message_flush(void);
+void queue_message_expire_decoded(void);
 int queue_message_fd_r(uint32_t);
+int queue_message_fd_r_head(uint32_t);
 int queue_message_fd_rw(uint32_t);
+int queue_message_fd_ro(uint32_t);
 int queue_message_corrupt(uint32_t);
 int queue_envelope_create(struct envelope *);
 int queue_envelope_delete(uint64_t);
 int queue_envelope_load(uint64_t, struct envelope *);
 int queue_envelope_update(struct envelope *);
 int queue_envelope_walk(struct envelope *);
+void queue_envelope_cache_resize(void);
+int queue_snapshot_supported(void);
+void queue_snapshot_load(void);
+int queue_snapshot_covers(uint64_t, const struct timespec *);
+void queue_snapshot_mark(uint64_t);
+int queue_snapshot_next(struct scheduler_info *);
+int queue_snapshot_request(void);
+void queue_snapshot_receive(const void *, size_t);
+int queue_profile_next(size_t *, char *, size_t, size_t *);
 
 
 /* ruleset.c */
 struct rule *ruleset_match(const struct envelope *);
+void ruleset_compile(void);
 
 
 /* scheduler.c */
@@ -1285,13 +1649,39 @@ pid_t scheduler(void);
 struct scheduler_backend *scheduler_backend_lookup(const char *);
 void scheduler_info(struct scheduler_info *, struct envelope *);
 time_t scheduler_compute_schedule(struct scheduler_info *);
+uint32_t scheduler_key(const char *);
+void scheduler_hoststat_update(const char *, uint32_t, uint32_t, time_t);
 
 
 /* smtp.c */
-pid_t smtp(void);
+pid_t smtp(int);
+uint64_t smtp_uid(void);
+struct mproc *smtp_peer(uint64_t);
+void smtp_forward(struct imsg *);
+void smtp_enable(int);
 void smtp_collect(void);
 
 
+/* smtp_parse.c */
+enum smtp_command {
+	CMD_HELO = 0,
+	CMD_EHLO,
+	CMD_STARTTLS,
+	CMD_AUTH,
+	CMD_MAIL_FROM,
+	CMD_RCPT_TO,
+	CMD_DATA,
+	CMD_BDAT,
+	CMD_RSET,
+	CMD_QUIT,
+	CMD_HELP,
+	CMD_WIZ,
+	CMD_NOOP,
+};
+int smtp_command_parse(char *, char **);
+int smtp_mailaddr(struct mailaddr *, char *, int, char **, const char *);
+
+
 /* smtp_session.c */
 int smtp_session(struct listener *, int, const struct sockaddr_storage *,
     const char *);
@@ -1300,6 +1690,7 @@ void smtp_session_imsg(struct mproc *, struct imsg *);
 
 /* smtpd.c */
 void imsg_dispatch(struct mproc *, struct imsg *);
+void imsg_profile_show(struct mproc *, uint32_t);
 void post_fork(int);
 const char *proc_name(enum smtp_proc_type);
 const char *proc_title(enum smtp_proc_type);
@@ -1307,8 +1698,14 @@ const char *imsg_to_str(int);
 
 
 /* ssl_smtpd.c */
-void   *ssl_mta_init(char *, off_t, char *, off_t);
-void   *ssl_smtp_init(void *, char *, off_t, char *, off_t, void *, void *);
+void   *ssl_mta_init(const char *, char *, off_t);
+void   *ssl_smtp_init(void *, void *, void *);
+
+
+/* stat_shmstat.c */
+void	shmstat_map(void);
+void	shmstat_release(pid_t);
+int	shmstat_add(const char *, size_t);
 
 
 /* stat_backend.c */
@@ -1320,6 +1717,14 @@ struct stat_value *stat_counter(size_t);
 struct stat_value *stat_timestamp(time_t);
 struct stat_value *stat_timeval(struct timeval *);
 struct stat_value *stat_timespec(struct timespec *);
+void	stat_histogram(const char *, uint64_t);
+void	stat_rate(const char *, size_t);
+void	stat_histogram_add(struct stat_histogram *, uint64_t);
+void	stat_histogram_value(const struct stat_histogram *, struct stat_value *);
+void	stat_rate_add(struct stat_rate *, size_t, time_t);
+void	stat_rate_value(struct stat_rate *, time_t, struct stat_value *);
+uint64_t evptrace_now(void);
+void	evptrace_log(const struct evptrace *, uint64_t, char *, size_t);
 
 
 /* table.c */
@@ -1336,8 +1741,15 @@ int	table_check_service(struct table *, uint32_t);
 int	table_lookup(struct table *, const char *, enum table_service,
     union lookup *);
 int	table_fetch(struct table *, enum table_service, union lookup *);
+void	table_lookup_batch(struct table *, const char **, size_t,
+    enum table_service, union lookup *, int *);
+int	table_store(struct table *, const char *, enum table_service,
+    const char *);
+void	table_set_cache(struct table *, time_t, time_t, size_t);
 void table_destroy(struct table *);
 void table_add(struct table *, const char *, const char *);
+void table_add_nocopy(struct table *, const char *, char *);
+void table_free_value(struct table *, void *);
 void table_delete(struct table *, const char *);
 int table_domain_match(const char *, const char *);
 int table_netaddr_match(const char *, const char *);
@@ -1350,6 +1762,10 @@ int table_parse_lookup(enum table_service, const char *, const char *,
     union lookup *);
 
 
+/* table_cdb.c */
+uint32_t cdb_hash(const void *, size_t);
+
+
 /* to.c */
 int email_to_mailaddr(struct mailaddr *, char *);
 int text_to_netaddr(struct netaddr *, const char *);
@@ -1357,6 +1773,7 @@ int text_to_mailaddr(struct mailaddr *, const char *);
 int text_to_relayhost(struct relayhost *, const char *);
 int text_to_userinfo(struct userinfo *, const char *);
 int text_to_credentials(struct credentials *, const char *);
+int text_to_mtastate(struct mtastate *, const char *);
 int text_to_expandnode(struct expandnode *, const char *);
 uint64_t text_to_evpid(const char *);
 uint32_t text_to_msgid(const char *);
@@ -1365,6 +1782,7 @@ const char *ss_to_text(const struct sockaddr_storage *);
 const char *time_to_text(time_t);
 const char *duration_to_text(time_t);
 const char *relayhost_to_text(const struct relayhost *);
+const char *mtastate_to_text(const struct mtastate *);
 const char *rule_to_text(struct rule *);
 const char *sockaddr_to_text(struct sockaddr *);
 const char *mailaddr_to_text(const struct mailaddr *);
@@ -33,11 +33,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <openssl/ssl.h>
 #include <openssl/engine.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 #include "log.h"
 #include "ssl.h"
@@ -72,8 +75,8 @@ ssl_setup(SSL_CTX **ctxp, struct pki *pki)
 	if (!ssl_ctx_use_certificate_chain(ctx,
 		pki->pki_cert, pki->pki_cert_len))
 		goto err;
-	if (!ssl_ctx_use_private_key(ctx,
-		pki->pki_key, pki->pki_key_len))
+	if (!ca_use_private_key(ctx, pki->pki_name,
+		pki->pki_cert, pki->pki_cert_len))
 		goto err;
 
 	if (!SSL_CTX_check_private_key(ctx))
@@ -448,3 +451,89 @@ ssl_set_ecdh_curve(SSL_CTX *ctx, const char *curve)
 	SSL_CTX_set_options(ctx, SSL_OP_SINGLE_ECDH_USE);
 	EC_KEY_free(ecdh);
 }
+
+/*
+ * Session tickets are encrypted with keys derived from a seed shared by
+ * all smtp processes, one per SSL_SESSION_TIMEOUT epoch, so any process
+ * can resume a session without a key exchange between them.  Tickets
+ * from the previous epoch are accepted and renewed.
+ */
+static unsigned char	ticket_seed[32];
+
+static int
+ssl_ticket_keys(uint64_t epoch, unsigned char *aes, unsigned char *mac)
+{
+	unsigned char	buf[8], md[EVP_MAX_MD_SIZE];
+	unsigned int	len;
+	int		i;
+
+	for (i = 0; i < 8; i++)
+		buf[i] = epoch >> (56 - 8 * i);
+
+	if (HMAC(EVP_sha512(), ticket_seed, sizeof ticket_seed, buf,
+	    sizeof buf, md, &len) == NULL || len < 64)
+		return (0);
+
+	memcpy(aes, md, 32);
+	memcpy(mac, md + 32, 32);
+	memset(md, 0, sizeof md);
+
+	return (1);
+}
+
+static int
+ssl_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	unsigned char	aes[32], mac[32];
+	uint64_t	epoch, now;
+	int		i, ret;
+
+	now = time(NULL) / SSL_SESSION_TIMEOUT;
+
+	if (enc) {
+		epoch = now;
+		for (i = 0; i < 8; i++)
+			name[i] = epoch >> (56 - 8 * i);
+		memcpy(name + 8, SSL_TICKET_NAME, 8);
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return (-1);
+	}
+	else {
+		if (memcmp(name + 8, SSL_TICKET_NAME, 8))
+			return (0);
+		epoch = 0;
+		for (i = 0; i < 8; i++)
+			epoch = (epoch << 8) | name[i];
+		if (epoch != now && epoch + 1 != now)
+			return (0);
+	}
+
+	if (!ssl_ticket_keys(epoch, aes, mac))
+		return (-1);
+
+	if (enc)
+		ret = EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv);
+	else
+		ret = EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv);
+	if (ret == 1)
+		ret = HMAC_Init_ex(hctx, mac, sizeof mac, EVP_sha256(), NULL);
+	memset(aes, 0, sizeof aes);
+	memset(mac, 0, sizeof mac);
+	if (ret != 1)
+		return (-1);
+
+	return ((enc || epoch == now) ? 1 : 2);
+}
+
+void
+ssl_set_session_resume(SSL_CTX *ctx, const void *seed, size_t len)
+{
+	if (len > sizeof ticket_seed)
+		len = sizeof ticket_seed;
+	memcpy(ticket_seed, seed, len);
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, SSL_SESSION_CACHE_SIZE);
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, ssl_ticket_key_cb);
+}
@@ -18,6 +18,8 @@
 #define SSL_CIPHERS		"HIGH:!aNULL:!MD5"
 #define	SSL_ECDH_CURVE		"prime256v1"
 #define	SSL_SESSION_TIMEOUT	300
+#define	SSL_SESSION_CACHE_SIZE	1024
+#define	SSL_TICKET_NAME		"OpenSMTP"	/* 8 bytes, after the epoch */
 
 struct pki {
 	char			 pki_name[PATH_MAX];
@@ -48,6 +50,7 @@ DH	       *get_dh1024(void);
 DH	       *get_dh_from_memory(char *, size_t);
 void		ssl_set_ephemeral_key_exchange(SSL_CTX *, DH *);
 void		ssl_set_ecdh_curve(SSL_CTX *, const char *);
+void		ssl_set_session_resume(SSL_CTX *, const void *, size_t);
 extern int	ssl_ctx_load_verify_memory(SSL_CTX *, char *, off_t);
 char	       *ssl_load_file(const char *, off_t *, mode_t);
 char	       *ssl_load_key(const char *, off_t *, char *, mode_t, const char *);
@@ -61,6 +64,11 @@ int		ssl_load_cafile(struct pki *, const char *);
 int		ssl_load_dhparams(struct pki *, const char *);
 
 
+/* ca.c */
+int	 ca_use_private_key(SSL_CTX *, const char *, char *, off_t);
+int	 ca_fetch_pki(const char *, struct pki *);
+
+
 /* ssl_privsep.c */
 int	 ssl_ctx_use_private_key(SSL_CTX *, char *, off_t);
 int	 ssl_ctx_use_certificate_chain(SSL_CTX *, char *, off_t);
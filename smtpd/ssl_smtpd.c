@@ -44,17 +44,17 @@
 
 
 void *
-ssl_mta_init(char *cert, off_t cert_len, char *key, off_t key_len)
+ssl_mta_init(const char *pkiname, char *cert, off_t cert_len)
 {
 	SSL_CTX	*ctx = NULL;
 	SSL	*ssl = NULL;
 
 	ctx = ssl_ctx_create();
 
-	if (cert != NULL && key != NULL) {
+	if (pkiname != NULL && cert != NULL) {
 		if (!ssl_ctx_use_certificate_chain(ctx, cert, cert_len)) 
 			goto err;
-		else if (!ssl_ctx_use_private_key(ctx, key, key_len))
+		else if (!ca_use_private_key(ctx, pkiname, cert, cert_len))
 			goto err;
 		else if (!SSL_CTX_check_private_key(ctx))
 			goto err;
@@ -90,18 +90,12 @@ dummy_verify(int ok, X509_STORE_CTX *store)
 }
 
 void *
-ssl_smtp_init(void *ssl_ctx, char *cert, off_t cert_len, char *key, off_t key_len, void *sni, void *arg)
+ssl_smtp_init(void *ssl_ctx, void *sni, void *arg)
 {
 	SSL	*ssl = NULL;
 	int	(*cb)(SSL *,int *,void *) = sni;
 
 	log_debug("debug: session_start_ssl: switching to SSL");
-	if (!ssl_ctx_use_certificate_chain(ssl_ctx, cert, cert_len))
-		goto err;
-	else if (!ssl_ctx_use_private_key(ssl_ctx, key, key_len))
-		goto err;
-	else if (!SSL_CTX_check_private_key(ssl_ctx))
-		goto err;
 
 	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, dummy_verify);
 
@@ -19,17 +19,22 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <sys/time.h>
 #include <sys/tree.h>
 
 #include <event.h>
 #include <imsg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "log.h"
 #include "smtpd.h"
 
+static int stat_digest_key(const char *);
+
 struct stat_backend	stat_backend_ramstat;
+struct stat_backend	stat_backend_shmstat;
 struct stat_backend	stat_backend_sqlite;
 
 struct stat_backend *
@@ -38,6 +43,9 @@ stat_backend_lookup(const char *name)
 	if (!strcmp(name, "ram"))
 		return &stat_backend_ramstat;
 
+	if (!strcmp(name, "shm"))
+		return &stat_backend_shmstat;
+
 	if (!strcmp(name, "sqlite"))
 		return &stat_backend_sqlite;
 
@@ -49,6 +57,9 @@ stat_increment(const char *key, size_t count)
 {
 	struct stat_value	*value;
 
+	if (!stat_digest_key(key) && shmstat_add(key, count))
+		return;
+
 	value = stat_counter(count);
 
 	m_create(p_control, IMSG_STAT_INCREMENT, 0, 0, -1);
@@ -62,6 +73,9 @@ stat_decrement(const char *key, size_t count)
 {
 	struct stat_value	*value;
 
+	if (!stat_digest_key(key) && shmstat_add(key, -count))
+		return;
+
 	value = stat_counter(count);
 
 	m_create(p_control, IMSG_STAT_DECREMENT, 0, 0, -1);
@@ -79,8 +93,157 @@ stat_set(const char *key, const struct stat_value *value)
 	m_close(p_control);
 }
 
+/* record a sample, usually a duration in microseconds */
+void
+stat_histogram(const char *key, uint64_t value)
+{
+	m_create(p_control, IMSG_STAT_HISTOGRAM, 0, 0, -1);
+	m_add_string(p_control, key);
+	m_add_data(p_control, &value, sizeof(value));
+	m_close(p_control);
+}
+
+/* count events whose rate is wanted rather than their total */
+void
+stat_rate(const char *key, size_t count)
+{
+	m_create(p_control, IMSG_STAT_RATE, 0, 0, -1);
+	m_add_string(p_control, key);
+	m_add_data(p_control, &count, sizeof(count));
+	m_close(p_control);
+}
+
 /* helpers */
 
+/* the counters of the control digest, which must reach control */
+static int
+stat_digest_key(const char *key)
+{
+	static const char *keys[] = {
+		"smtp.session",
+		"scheduler.envelope",
+		"scheduler.envelope.expired",
+		"scheduler.envelope.removed",
+		"scheduler.delivery.ok",
+		"scheduler.delivery.permfail",
+		"scheduler.delivery.tempfail",
+		"scheduler.delivery.loop",
+		"queue.bounce",
+	};
+	size_t	i;
+
+	for (i = 0; i < nitems(keys); i++)
+		if (!strcmp(key, keys[i]))
+			return (1);
+	return (0);
+}
+
+static int
+stat_histogram_bucket(uint64_t v)
+{
+	int	k;
+
+	if (v < 4)
+		return (v);
+	for (k = 2; k < 63 && (v >> (k + 1)); k++)
+		;
+	return (4 * (k - 1) + ((v >> (k - 2)) & 3));
+}
+
+/* the highest value that falls in a bucket */
+static uint64_t
+stat_histogram_bound(int i)
+{
+	int	k;
+
+	if (i < 4)
+		return (i);
+	k = i / 4 + 1;
+	if (i == STAT_HISTOGRAM_BUCKETS - 1)
+		return (UINT64_MAX);
+	return (((uint64_t)(4 + i % 4 + 1) << (k - 2)) - 1);
+}
+
+void
+stat_histogram_add(struct stat_histogram *h, uint64_t v)
+{
+	h->count += 1;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->buckets[stat_histogram_bucket(v)] += 1;
+}
+
+void
+stat_histogram_value(const struct stat_histogram *h, struct stat_value *val)
+{
+	static const int	 q[] = { 50, 90, 99 };
+	uint64_t		*p[3], bound;
+	size_t			 n;
+	int			 i, j;
+
+	memset(val, 0, sizeof(*val));
+	val->type = STAT_HISTOGRAM;
+	val->u.hist.count = h->count;
+	val->u.hist.sum = h->sum;
+	val->u.hist.max = h->max;
+	if (h->count == 0)
+		return;
+	val->u.hist.mean = h->sum / h->count;
+
+	p[0] = &val->u.hist.p50;
+	p[1] = &val->u.hist.p90;
+	p[2] = &val->u.hist.p99;
+	n = 0;
+	j = 0;
+	for (i = 0; i < STAT_HISTOGRAM_BUCKETS && j < 3; i++) {
+		n += h->buckets[i];
+		bound = stat_histogram_bound(i);
+		if (bound > h->max)
+			bound = h->max;
+		for (; j < 3 && n * 100 >= h->count * q[j]; j++)
+			*p[j] = bound;
+	}
+}
+
+/* fold the seconds elapsed since the last update into the average */
+static void
+stat_rate_update(struct stat_rate *r, time_t now)
+{
+	time_t	t;
+
+	if (r->last == 0)
+		r->last = now;
+	if (now <= r->last)
+		return;
+
+	r->rate = r->rate * STAT_RATE_DECAY +
+	    r->pending * (1 - STAT_RATE_DECAY);
+	r->pending = 0;
+	for (t = r->last + 1; t < now && r->rate > 0.0001; t++)
+		r->rate *= STAT_RATE_DECAY;
+	if (r->rate <= 0.0001)
+		r->rate = 0;
+	r->last = now;
+}
+
+void
+stat_rate_add(struct stat_rate *r, size_t count, time_t now)
+{
+	stat_rate_update(r, now);
+	r->pending += count;
+}
+
+void
+stat_rate_value(struct stat_rate *r, time_t now, struct stat_value *val)
+{
+	stat_rate_update(r, now);
+
+	memset(val, 0, sizeof(*val));
+	val->type = STAT_RATE;
+	val->u.rate = r->rate;
+}
+
 struct stat_value *
 stat_counter(size_t counter)
 {
@@ -120,3 +283,61 @@ stat_timespec(struct timespec *ts)
 	value.u.ts = *ts;
 	return &value;
 }
+
+static const char *evptrace_stages[EVPTRACE_MAX] = {
+	"accept", "data", "commit", "schedule", "connect", "delivery"
+};
+
+uint64_t
+evptrace_now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+/*
+ * Account for a delivered envelope.  Each stage lasts from the latest
+ * earlier timestamp to its own, and goes in microseconds to the
+ * envelope.latency.<stage> histogram.  For a sample of the messages, the
+ * stages are also written to buf for the delivery log line.
+ */
+void
+evptrace_log(const struct evptrace *t, uint64_t evpid, char *buf, size_t len)
+{
+	char		key[STAT_KEY_SIZE], tmp[64];
+	uint64_t	prev, d;
+	int		i, sample;
+
+	buf[0] = '\0';
+	if (t->ts[EVPTRACE_ACCEPT] == 0 || t->ts[EVPTRACE_DONE] == 0)
+		return;
+
+	sample = evpid_to_msgid(evpid) % EVPTRACE_SAMPLE == 0;
+	if (sample)
+		strlcpy(buf, ", latency=", len);
+
+	prev = t->ts[EVPTRACE_ACCEPT];
+	for (i = EVPTRACE_ACCEPT + 1; i < EVPTRACE_MAX; i++) {
+		if (t->ts[i] == 0)
+			continue;
+		d = (t->ts[i] > prev) ? t->ts[i] - prev : 0;
+		prev += d;
+		(void)snprintf(key, sizeof key, "envelope.latency.%s",
+		    evptrace_stages[i]);
+		stat_histogram(key, d);
+		if (sample) {
+			(void)snprintf(tmp, sizeof tmp, "%s:%.3fms,",
+			    evptrace_stages[i], d / 1000.0);
+			strlcat(buf, tmp, len);
+		}
+	}
+
+	d = prev - t->ts[EVPTRACE_ACCEPT];
+	stat_histogram("envelope.latency.total", d);
+	if (sample) {
+		(void)snprintf(tmp, sizeof tmp, "total:%.3fms", d / 1000.0);
+		strlcat(buf, tmp, len);
+	}
+}
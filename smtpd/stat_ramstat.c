@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "smtpd.h"
 #include "log.h"
@@ -37,11 +38,16 @@ static void	ramstat_increment(const char *, size_t);
 static void	ramstat_decrement(const char *, size_t);
 static void	ramstat_set(const char *, const struct stat_value *);
 static int	ramstat_iter(void **, char **, struct stat_value *);
+static void	ramstat_histogram(const char *, uint64_t);
+static void	ramstat_rate(const char *, size_t);
+static struct ramstat_entry *ramstat_entry(const char *, const char *);
 
 struct ramstat_entry {
 	RB_ENTRY(ramstat_entry)	entry;
 	char			key[STAT_KEY_SIZE];
 	struct stat_value	value;
+	struct stat_histogram  *hist;
+	struct stat_rate	rate;
 };
 RB_HEAD(stats_tree, ramstat_entry)	stats;
 RB_PROTOTYPE(stats_tree, ramstat_entry, entry, ramstat_entry_cmp);
@@ -52,7 +58,9 @@ struct stat_backend	stat_backend_ramstat = {
 	ramstat_increment,
 	ramstat_decrement,
 	ramstat_set,
-	ramstat_iter
+	ramstat_iter,
+	ramstat_histogram,
+	ramstat_rate
 };
 
 static void
@@ -127,6 +135,46 @@ ramstat_set(const char *name, const struct stat_value *val)
 	np->value = *val;
 }
 
+static struct ramstat_entry *
+ramstat_entry(const char *name, const char *where)
+{
+	struct ramstat_entry	*np, lk;
+
+	strlcpy(lk.key, name, sizeof (lk.key));
+	np = RB_FIND(stats_tree, &stats, &lk);
+	if (np == NULL) {
+		np = xcalloc(1, sizeof *np, where);
+		strlcpy(np->key, name, sizeof (np->key));
+		RB_INSERT(stats_tree, &stats, np);
+	}
+	return (np);
+}
+
+static void
+ramstat_histogram(const char *name, uint64_t val)
+{
+	struct ramstat_entry	*np;
+
+	log_trace(TRACE_STAT, "ramstat: histogram: %s", name);
+	np = ramstat_entry(name, "ramstat_histogram");
+	if (np->hist == NULL) {
+		np->hist = xcalloc(1, sizeof *np->hist, "ramstat_histogram");
+		np->value.type = STAT_HISTOGRAM;
+	}
+	stat_histogram_add(np->hist, val);
+}
+
+static void
+ramstat_rate(const char *name, size_t val)
+{
+	struct ramstat_entry	*np;
+
+	log_trace(TRACE_STAT, "ramstat: rate: %s", name);
+	np = ramstat_entry(name, "ramstat_rate");
+	np->value.type = STAT_RATE;
+	stat_rate_add(&np->rate, val, time(NULL));
+}
+
 static int
 ramstat_iter(void **iter, char **name, struct stat_value *val)
 {
@@ -146,7 +194,12 @@ ramstat_iter(void **iter, char **name, struct stat_value *val)
 		return 0;
 
 	*name = np->key;
-	*val  = np->value;
+	if (np->value.type == STAT_HISTOGRAM && np->hist)
+		stat_histogram_value(np->hist, val);
+	else if (np->value.type == STAT_RATE)
+		stat_rate_value(&np->rate, time(NULL), val);
+	else
+		*val = np->value;
 	return 1;
 }
 
@@ -0,0 +1,294 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/*
+ * Counters in shared memory.  The parent maps the pages before forking,
+ * each process then claims one for itself, registers its keys there on
+ * first use and updates them in place, with no imsg.  Only the owner
+ * writes to a page, the control process sums the pages when the stats
+ * are read.  Values that are set, too long keys, counters that do not
+ * fit in the page and the counters of the control digest still go
+ * through the ram backend, as do all counters of a process that found
+ * no page left.  The pages must be mapped before forking so they cannot
+ * grow, instead the parent recycles the page of a process it reaps.
+ */
+
+#define	SHMSTAT_PAGES		64
+#define	SHMSTAT_SLOTS		256
+#define	SHMSTAT_KEY_SIZE	64
+
+struct shmstat_slot {
+	char			key[SHMSTAT_KEY_SIZE];
+	volatile size_t		counter;
+};
+
+struct shmstat_page {
+	volatile pid_t		owner;
+	volatile uint32_t	nslots;
+	struct shmstat_slot	slots[SHMSTAT_SLOTS];
+};
+
+static void	shmstat_init(void);
+static void	shmstat_close(void);
+static void	shmstat_increment(const char *, size_t);
+static void	shmstat_decrement(const char *, size_t);
+static void	shmstat_set(const char *, const struct stat_value *);
+static int	shmstat_iter(void **, char **, struct stat_value *);
+static void	shmstat_histogram(const char *, uint64_t);
+static void	shmstat_rate(const char *, size_t);
+
+static struct shmstat_page	*shmstat_page(void);
+static struct shmstat_slot	*shmstat_slot(const char *);
+static void			 shmstat_sum(void);
+
+extern struct stat_backend	stat_backend_ramstat;
+
+struct stat_backend	stat_backend_shmstat = {
+	shmstat_init,
+	shmstat_close,
+	shmstat_increment,
+	shmstat_decrement,
+	shmstat_set,
+	shmstat_iter,
+	shmstat_histogram,
+	shmstat_rate
+};
+
+static struct shmstat_page	*pages;		/* shared by all processes */
+static struct shmstat_page	*page;		/* the one of this process */
+static pid_t			 pagepid;
+static struct dict		 slots;		/* key -> our slot */
+static struct dict		 sums;		/* key -> total, in control */
+
+void
+shmstat_map(void)
+{
+	pages = mmap(NULL, SHMSTAT_PAGES * sizeof(*pages),
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (pages == MAP_FAILED)
+		fatal("shmstat_map: mmap");
+}
+
+/*
+ * In the parent, once process pid is gone: move its counters to the page
+ * of the parent and free its page for another process.
+ */
+void
+shmstat_release(pid_t pid)
+{
+	struct shmstat_page	*p;
+	struct shmstat_slot	*slot, *dst;
+	uint32_t		 i, j, n;
+
+	if (pages == NULL)
+		return;
+
+	for (i = 0; i < SHMSTAT_PAGES; i++) {
+		p = &pages[i];
+		if (p->owner != pid)
+			continue;
+		n = p->nslots;
+		for (j = 0; j < n; j++) {
+			slot = &p->slots[j];
+			if (slot->counter == 0)
+				continue;
+			if ((dst = shmstat_slot(slot->key)) == NULL) {
+				log_warnx("warn: shmstat: counter %s of "
+				    "process %d lost", slot->key, pid);
+				continue;
+			}
+			__sync_fetch_and_add(&dst->counter, slot->counter);
+		}
+		p->nslots = 0;
+		__sync_synchronize();
+		p->owner = 0;
+		break;
+	}
+}
+
+/* add to the counter in our page, 0 if it must go to control instead */
+int
+shmstat_add(const char *key, size_t delta)
+{
+	struct shmstat_slot	*slot;
+
+	if (pages == NULL || (slot = shmstat_slot(key)) == NULL)
+		return (0);
+
+	__sync_fetch_and_add(&slot->counter, delta);
+	return (1);
+}
+
+static struct shmstat_page *
+shmstat_page(void)
+{
+	pid_t	pid;
+	int	i;
+
+	/* what was inherited over fork belongs to the parent */
+	pid = getpid();
+	if (page && pagepid == pid)
+		return (page);
+
+	page = NULL;
+	pagepid = pid;
+	dict_init(&slots);
+	for (i = 0; i < SHMSTAT_PAGES; i++)
+		if (__sync_bool_compare_and_swap(&pages[i].owner, 0, pid)) {
+			page = &pages[i];
+			break;
+		}
+	if (page == NULL)
+		log_warnx("warn: shmstat: no page left for process %d, "
+		    "its counters go through control", pid);
+	return (page);
+}
+
+static struct shmstat_slot *
+shmstat_slot(const char *key)
+{
+	struct shmstat_page	*p;
+	struct shmstat_slot	*slot;
+	uint32_t		 n;
+
+	if ((p = shmstat_page()) == NULL)
+		return (NULL);
+	if ((slot = dict_get(&slots, key)))
+		return (slot);
+
+	n = p->nslots;
+	if (n == SHMSTAT_SLOTS || strlen(key) >= SHMSTAT_KEY_SIZE)
+		return (NULL);
+
+	/* fill the slot before it becomes visible to control */
+	slot = &p->slots[n];
+	strlcpy(slot->key, key, sizeof(slot->key));
+	slot->counter = 0;
+	__sync_synchronize();
+	p->nslots = n + 1;
+
+	dict_xset(&slots, key, slot);
+	return (slot);
+}
+
+/* total the counters of all pages, and make sure ram knows the keys */
+static void
+shmstat_sum(void)
+{
+	struct shmstat_slot	*slot;
+	size_t			*sum;
+	uint32_t		 i, j, n;
+
+	while (dict_poproot(&sums, (void **)&sum))
+		free(sum);
+
+	for (i = 0; i < SHMSTAT_PAGES; i++) {
+		if (pages[i].owner == 0)
+			continue;
+		n = pages[i].nslots;
+		__sync_synchronize();
+		for (j = 0; j < n; j++) {
+			slot = &pages[i].slots[j];
+			if ((sum = dict_get(&sums, slot->key)) == NULL) {
+				sum = xcalloc(1, sizeof(*sum), "shmstat_sum");
+				dict_xset(&sums, slot->key, sum);
+				stat_backend_ramstat.increment(slot->key, 0);
+			}
+			*sum += slot->counter;
+		}
+	}
+}
+
+static void
+shmstat_init(void)
+{
+	log_trace(TRACE_STAT, "shmstat: init");
+
+	if (pages == NULL)
+		fatalx("shmstat: pages not mapped");
+	dict_init(&sums);
+	stat_backend_ramstat.init();
+}
+
+static void
+shmstat_close(void)
+{
+	log_trace(TRACE_STAT, "shmstat: close");
+
+	stat_backend_ramstat.close();
+}
+
+static void
+shmstat_increment(const char *name, size_t val)
+{
+	stat_backend_ramstat.increment(name, val);
+}
+
+static void
+shmstat_decrement(const char *name, size_t val)
+{
+	stat_backend_ramstat.decrement(name, val);
+}
+
+static void
+shmstat_set(const char *name, const struct stat_value *val)
+{
+	stat_backend_ramstat.set(name, val);
+}
+
+static void
+shmstat_histogram(const char *name, uint64_t val)
+{
+	stat_backend_ramstat.histogram(name, val);
+}
+
+static void
+shmstat_rate(const char *name, size_t val)
+{
+	stat_backend_ramstat.rate(name, val);
+}
+
+static int
+shmstat_iter(void **iter, char **name, struct stat_value *val)
+{
+	size_t	*sum;
+
+	if (*iter == NULL)
+		shmstat_sum();
+
+	if (! stat_backend_ramstat.iter(iter, name, val))
+		return (0);
+
+	if (val->type == STAT_COUNTER && (sum = dict_get(&sums, *name)))
+		val->u.counter += *sum;
+	return (1);
+}
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "smtpd.h"
@@ -44,6 +45,7 @@ struct table_backend *table_backend_lookup(const char *);
 
 extern struct table_backend table_backend_static;
 extern struct table_backend table_backend_db;
+extern struct table_backend table_backend_cdb;
 extern struct table_backend table_backend_getpwnam;
 extern struct table_backend table_backend_proc;
 
@@ -52,6 +54,40 @@ static const char * table_backend_name(struct table_backend *);
 static const char * table_dump_lookup(enum table_service, union lookup *);
 static int parse_sockaddr(struct sockaddr *, int, const char *);
 
+/*
+ * Results of backend lookups can be cached per table, found keys for
+ * ttl seconds and missing ones for negttl, with at most max entries
+ * evicted in LRU order.  Errors are never cached.
+ */
+struct table_cache_entry {
+	TAILQ_ENTRY(table_cache_entry)	 entry;
+	char				*key;
+	time_t				 expire;
+	enum table_service		 kind;
+	int				 r;
+	int				 hasvalue;
+	union lookup			 lk;
+};
+
+struct table_cache {
+	struct dict			 entries;
+	TAILQ_HEAD(table_cache_lru, table_cache_entry) lru;
+	size_t				 count;
+	size_t				 max;
+	time_t				 ttl;
+	time_t				 negttl;
+};
+
+static int table_cache_get(struct table *, const char *, enum table_service,
+    union lookup *);
+static void table_cache_put(struct table *, const char *, enum table_service,
+    int, union lookup *);
+static void table_cache_remove(struct table_cache *,
+    struct table_cache_entry *);
+static void table_cache_flush(struct table *);
+static struct expand *table_cache_expand_dup(struct expand *);
+static void table_cache_stat(struct table *, const char *);
+
 static unsigned int last_table_id = 0;
 
 struct table_backend *
@@ -61,6 +97,8 @@ table_backend_lookup(const char *backend)
 		return &table_backend_static;
 	if (!strcmp(backend, "db"))
 		return &table_backend_db;
+	if (!strcmp(backend, "cdb"))
+		return &table_backend_cdb;
 	if (!strcmp(backend, "getpwnam"))
 		return &table_backend_getpwnam;
 	if (!strcmp(backend, "proc"))
@@ -75,6 +113,8 @@ table_backend_name(struct table_backend *backend)
 		return "static";
 	if (backend == &table_backend_db)
 		return "db";
+	if (backend == &table_backend_cdb)
+		return "cdb";
 	if (backend == &table_backend_getpwnam)
 		return "getpwnam";
 	if (backend == &table_backend_proc)
@@ -95,6 +135,7 @@ table_service_name(enum table_service s)
 	case K_SOURCE:		return "SOURCE";
 	case K_MAILADDR:	return "MAILADDR";
 	case K_ADDRNAME:	return "ADDRNAME";
+	case K_MTASTATE:	return "MTASTATE";
 	default:		return "???";
 	}
 }
@@ -130,8 +171,19 @@ table_lookup(struct table *table, const char *key, enum table_service kind,
 		return -1;
 	}
 
+	if (table->t_cache) {
+		if ((r = table_cache_get(table, lkey, kind, lk)) != -1) {
+			table_cache_stat(table, "hit");
+			return (r);
+		}
+		table_cache_stat(table, "miss");
+	}
+
 	r = table->t_backend->lookup(table->t_handle, lkey, kind, lk);
 
+	if (table->t_cache && r != -1)
+		table_cache_put(table, lkey, kind, r, lk);
+
 	if (r == 1)
 		log_trace(TRACE_LOOKUP, "lookup: %s \"%s\" as %s in table %s:%s -> %s%s%s",
 		    lk ? "lookup" : "check",
@@ -154,6 +206,118 @@ table_lookup(struct table *table, const char *key, enum table_service kind,
 	return (r);
 }
 
+/*
+ * Write a value for key, for the backends which can.  A cached answer
+ * for the key is dropped so the next lookup sees the new value.
+ */
+int
+table_store(struct table *table, const char *key, enum table_service kind,
+    const char *value)
+{
+	struct table_cache_entry	*e;
+	char				 lkey[1024], buf[1100];
+	int				 r;
+
+	if (table->t_backend->store == NULL)
+		return (-1);
+
+	if (! lowercase(lkey, key, sizeof lkey)) {
+		log_warnx("warn: store key too long: %s", key);
+		return (-1);
+	}
+
+	if (table->t_cache && bsnprintf(buf, sizeof buf, "%d:%s", kind, lkey) &&
+	    (e = dict_get(&table->t_cache->entries, buf)) != NULL)
+		table_cache_remove(table->t_cache, e);
+
+	r = table->t_backend->store(table->t_handle, lkey, kind, value);
+
+	log_trace(TRACE_LOOKUP, "lookup: store \"%s\" as %s in table %s:%s "
+	    "<- \"%s\" -> %d",
+	    lkey,
+	    table_service_name(kind),
+	    table_backend_name(table->t_backend),
+	    table->t_name,
+	    value,
+	    r);
+
+	return (r);
+}
+
+/*
+ * Look up n keys at once, lks may be NULL for a check.  Keys missing
+ * from the cache go to the backend in a single call when it supports
+ * it, one lookup per key otherwise.
+ */
+void
+table_lookup_batch(struct table *table, const char **keys, size_t n,
+    enum table_service kind, union lookup *lks, int *res)
+{
+	char		(*lkeys)[1024];
+	const char	**mkeys;
+	union lookup	*mlks = NULL;
+	size_t		*midx, i, m;
+	int		*mres;
+
+	if (table->t_backend->lookup_batch == NULL) {
+		for (i = 0; i < n; i++)
+			res[i] = table_lookup(table, keys[i], kind,
+			    lks ? &lks[i] : NULL);
+		return;
+	}
+
+	lkeys = xcalloc(n, sizeof *lkeys, "table_lookup_batch");
+	mkeys = xcalloc(n, sizeof *mkeys, "table_lookup_batch");
+	midx = xcalloc(n, sizeof *midx, "table_lookup_batch");
+	mres = xcalloc(n, sizeof *mres, "table_lookup_batch");
+	if (lks)
+		mlks = xcalloc(n, sizeof *mlks, "table_lookup_batch");
+
+	for (m = 0, i = 0; i < n; i++) {
+		if (! lowercase(lkeys[i], keys[i], sizeof lkeys[i])) {
+			log_warnx("warn: lookup key too long: %s", keys[i]);
+			res[i] = -1;
+			continue;
+		}
+		if (table->t_cache) {
+			res[i] = table_cache_get(table, lkeys[i], kind,
+			    lks ? &lks[i] : NULL);
+			if (res[i] != -1) {
+				table_cache_stat(table, "hit");
+				continue;
+			}
+			table_cache_stat(table, "miss");
+		}
+		midx[m] = i;
+		mkeys[m++] = lkeys[i];
+	}
+
+	if (m && table->t_backend->lookup_batch(table->t_handle, mkeys, m,
+	    kind, mlks, mres) == -1)
+		for (i = 0; i < m; i++)
+			mres[i] = -1;
+
+	for (i = 0; i < m; i++) {
+		res[midx[i]] = mres[i];
+		if (lks)
+			lks[midx[i]] = mlks[i];
+		if (table->t_cache && mres[i] != -1)
+			table_cache_put(table, mkeys[i], kind, mres[i],
+			    lks ? &lks[midx[i]] : NULL);
+		log_trace(TRACE_LOOKUP, "lookup: batch %s \"%s\" as %s in "
+		    "table %s:%s -> %d", lks ? "lookup" : "check", mkeys[i],
+		    table_service_name(kind),
+		    table_backend_name(table->t_backend), table->t_name,
+		    mres[i]);
+	}
+
+	free(mlks);
+	free(mres);
+	free(midx);
+	free(mkeys);
+	free(lkeys);
+}
+
 int
 table_fetch(struct table *table, enum table_service kind, union lookup *lk)
 {
@@ -264,12 +428,31 @@ table_destroy(struct table *t)
 	void	*p = NULL;
 
 	while (dict_poproot(&t->t_dict, (void **)&p))
-		free(p);
+		table_free_value(t, p);
+	free(t->t_arena);
+
+	if (t->t_cache) {
+		table_cache_flush(t);
+		free(t->t_cache);
+	}
 
 	dict_xpop(env->sc_tables_dict, t->t_name);
 	free(t);
 }
 
+void
+table_set_cache(struct table *t, time_t ttl, time_t negttl, size_t max)
+{
+	if (t->t_cache == NULL) {
+		t->t_cache = xcalloc(1, sizeof *t->t_cache, "table_set_cache");
+		dict_init(&t->t_cache->entries);
+		TAILQ_INIT(&t->t_cache->lru);
+	}
+	t->t_cache->ttl = ttl;
+	t->t_cache->negttl = negttl;
+	t->t_cache->max = max;
+}
+
 int
 table_config(struct table *t)
 {
@@ -280,6 +463,16 @@ table_config(struct table *t)
 
 void
 table_add(struct table *t, const char *key, const char *val)
+{
+	table_add_nocopy(t, key, val ? xstrdup(val, "table_add") : NULL);
+}
+
+/*
+ * Add val itself, it belongs to the table from now on: either allocated
+ * or pointing inside t_arena.
+ */
+void
+table_add_nocopy(struct table *t, const char *key, char *val)
 {
 	char	lkey[1024], *old;
 
@@ -288,17 +481,28 @@ table_add(struct table *t, const char *key, const char *val)
 
 	if (! lowercase(lkey, key, sizeof lkey)) {
 		log_warnx("warn: lookup key too long: %s", key);
+		table_free_value(t, val);
 		return;
 	}
 
-	old = dict_set(&t->t_dict, lkey, val ? xstrdup(val, "table_add") : NULL);
+	old = dict_set(&t->t_dict, lkey, val);
 	if (old) {
 		log_warnx("warn: duplicate key \"%s\" in static table \"%s\"",
 		    lkey, t->t_name);
-		free(old);
+		table_free_value(t, old);
 	}
 }
 
+/* values loaded in bulk live in the arena, freed with the table */
+void
+table_free_value(struct table *t, void *val)
+{
+	if (t->t_arena && (char *)val >= t->t_arena &&
+	    (char *)val < t->t_arena + t->t_arenalen)
+		return;
+	free(val);
+}
+
 const void *
 table_get(struct table *t, const char *key)
 {
@@ -312,7 +516,7 @@ table_delete(struct table *t, const char *key)
 {
 	if (t->t_type & T_DYNAMIC)
 		errx(1, "table_delete: cannot delete from table");
-	free(dict_pop(&t->t_dict, key));
+	table_free_value(t, dict_pop(&t->t_dict, key));
 }
 
 int
@@ -352,14 +556,135 @@ table_close(struct table *t)
 		t->t_backend->close(t->t_handle);
 }
 
+/*
+ * An update returning TABLE_UPDATE_AGAIN goes on when called again.
+ * The cache is flushed at each step: it must not keep what was looked
+ * up before the new version was swapped in.
+ */
 int
 table_update(struct table *t)
 {
+	if (t->t_cache)
+		table_cache_flush(t);
 	if (t->t_backend->update == NULL)
 		return (1);
 	return (t->t_backend->update(t));
 }
 
+static int
+table_cache_get(struct table *t, const char *key, enum table_service kind,
+    union lookup *lk)
+{
+	struct table_cache		*tc = t->t_cache;
+	struct table_cache_entry	*e;
+	char				 buf[1100];
+
+	if (! bsnprintf(buf, sizeof buf, "%d:%s", kind, key))
+		return (-1);
+	if ((e = dict_get(&tc->entries, buf)) == NULL)
+		return (-1);
+	if (e->expire <= time(NULL)) {
+		table_cache_remove(tc, e);
+		return (-1);
+	}
+	/* a check does not tell what a lookup would return */
+	if (lk && e->r == 1 && !e->hasvalue)
+		return (-1);
+
+	TAILQ_REMOVE(&tc->lru, e, entry);
+	TAILQ_INSERT_HEAD(&tc->lru, e, entry);
+
+	if (lk && e->r == 1) {
+		*lk = e->lk;
+		if (kind == K_ALIAS)
+			lk->expand = table_cache_expand_dup(e->lk.expand);
+	}
+	return (e->r);
+}
+
+static void
+table_cache_put(struct table *t, const char *key, enum table_service kind,
+    int r, union lookup *lk)
+{
+	struct table_cache		*tc = t->t_cache;
+	struct table_cache_entry	*e;
+	char				 buf[1100];
+	time_t				 ttl;
+
+	ttl = r ? tc->ttl : tc->negttl;
+	if (ttl == 0 || tc->max == 0)
+		return;
+	if (! bsnprintf(buf, sizeof buf, "%d:%s", kind, key))
+		return;
+
+	if ((e = dict_get(&tc->entries, buf)) != NULL)
+		table_cache_remove(tc, e);
+	else if (tc->count == tc->max)
+		table_cache_remove(tc, TAILQ_LAST(&tc->lru, table_cache_lru));
+
+	e = xcalloc(1, sizeof *e, "table_cache_put");
+	e->key = xstrdup(buf, "table_cache_put");
+	e->expire = time(NULL) + ttl;
+	e->kind = kind;
+	e->r = r;
+	if (lk && r == 1) {
+		e->hasvalue = 1;
+		e->lk = *lk;
+		if (kind == K_ALIAS)
+			e->lk.expand = table_cache_expand_dup(lk->expand);
+	}
+	dict_xset(&tc->entries, e->key, e);
+	TAILQ_INSERT_HEAD(&tc->lru, e, entry);
+	tc->count++;
+}
+
+static void
+table_cache_remove(struct table_cache *tc, struct table_cache_entry *e)
+{
+	dict_xpop(&tc->entries, e->key);
+	TAILQ_REMOVE(&tc->lru, e, entry);
+	tc->count--;
+	if (e->hasvalue && e->kind == K_ALIAS)
+		expand_free(e->lk.expand);
+	free(e->key);
+	free(e);
+}
+
+static void
+table_cache_flush(struct table *t)
+{
+	struct table_cache_entry	*e;
+
+	while ((e = TAILQ_FIRST(&t->t_cache->lru)) != NULL)
+		table_cache_remove(t->t_cache, e);
+}
+
+static struct expand *
+table_cache_expand_dup(struct expand *src)
+{
+	struct expand		*dst;
+	struct expandnode	*xn, node;
+
+	dst = xcalloc(1, sizeof *dst, "table_cache_expand_dup");
+	RB_INIT(&dst->tree);
+	dst->alias = src->alias;
+	dst->rule = src->rule;
+	RB_FOREACH(xn, expandtree, &src->tree) {
+		node = *xn;
+		expand_insert(dst, &node);
+	}
+	return (dst);
+}
+
+static void
+table_cache_stat(struct table *t, const char *what)
+{
+	char	key[STAT_KEY_SIZE];
+
+	if (bsnprintf(key, sizeof key, "table.%s.cache.%s", t->t_name, what))
+		stat_increment(key, 1);
+}
+
 int
 table_domain_match(const char *s1, const char *s2)
 {
@@ -534,8 +859,9 @@ int
 table_parse_lookup(enum table_service service, const char *key,
     const char *line, union lookup *lk)
 {
-	char	buffer[SMTPD_MAXLINESIZE], *p;
-	size_t	len;
+	char		 buffer[SMTPD_MAXLINESIZE], *p;
+	const char	*errstr;
+	size_t		 len;
 
 	len = strlen(line);
 
@@ -602,8 +928,20 @@ table_parse_lookup(enum table_service service, const char *key,
  		return (1);
 
 	case K_SOURCE:
+		/* the address, optionally followed by its weight */
+		if (strlcpy(buffer, line, sizeof(buffer)) >= sizeof(buffer))
+			return (-1);
+		lk->source.weight = 1;
+		if ((p = strpbrk(buffer, " \t")) != NULL) {
+			*p++ = '\0';
+			p += strspn(p, " \t");
+			lk->source.weight = strtonum(p, 1, SOURCE_WEIGHT_MAX,
+			    &errstr);
+			if (errstr)
+				return (-1);
+		}
 		if (parse_sockaddr((struct sockaddr *)&lk->source.addr,
-		    PF_UNSPEC, line) == -1)
+		    PF_UNSPEC, buffer) == -1)
 			return (-1);
 		return (1);
 
@@ -621,6 +959,11 @@ table_parse_lookup(enum table_service service, const char *key,
 			return (-1);
 		return (1);
 
+	case K_MTASTATE:
+		if (!text_to_mtastate(&lk->mtastate, line))
+			return (-1);
+		return (1);
+
 	default:
 		return (-1);
 	}
@@ -663,8 +1006,8 @@ table_dump_lookup(enum table_service s, union lookup *lk)
 		break;
 
 	case K_SOURCE:
-		snprintf(buf, sizeof(buf), "%s",
-		    ss_to_text(&lk->source.addr));
+		snprintf(buf, sizeof(buf), "%s weight %d",
+		    ss_to_text(&lk->source.addr), lk->source.weight);
 		break;
 
 	case K_MAILADDR:
@@ -678,6 +1021,11 @@ table_dump_lookup(enum table_service s, union lookup *lk)
 		    lk->addrname.name);
 		break;
 
+	case K_MTASTATE:
+		snprintf(buf, sizeof(buf), "%s",
+		    mtastate_to_text(&lk->mtastate));
+		break;
+
 	default:
 		break;
 	}
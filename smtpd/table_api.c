@@ -37,8 +37,13 @@ static int (*handler_update)(void);
 static int (*handler_check)(int, const char *);
 static int (*handler_lookup)(int, const char *, char *, size_t);
 static int (*handler_fetch)(int, char *, size_t);
+static int (*handler_store)(int, const char *, const char *);
+static void (*handler_async_check)(uint32_t, int, const char *);
+static void (*handler_async_lookup)(uint32_t, int, const char *);
 
 static int		 quit;
+static uint32_t		 reqid;
+static struct event	 ev_in;
 static struct imsgbuf	 ibuf;
 static struct imsg	 imsg;
 static size_t		 rlen;
@@ -46,6 +51,9 @@ static char		*rdata;
 static struct ibuf	*buf;
 static char		*name;
 
+static void table_api_io(int, short, void *);
+static int table_api_read(void);
+
 #if 0
 static char		*rootpath;
 static char		*user = SMTPD_USER;
@@ -83,7 +91,7 @@ static void
 table_msg_add(const void *data, size_t len)
 {
 	if (buf == NULL)
-		buf = imsg_create(&ibuf, PROC_TABLE_OK, 0, 0, 1024);
+		buf = imsg_create(&ibuf, PROC_TABLE_OK, reqid, 0, 1024);
 	if (buf == NULL) {
 		log_warnx("warn: table-api: imsg_create failed");
 		fatalx("table-api: exiting");
@@ -101,13 +109,52 @@ table_msg_close(void)
 	buf = NULL;
 }
 
+/*
+ * Answer a check or lookup for key, or hand it to the asynchronous
+ * handler which answers later.
+ */
+static void
+table_msg_key(int lookup, uint32_t id, int type, const char *key)
+{
+	char	res[4096];
+	int	r;
+
+	if (lookup && handler_async_lookup) {
+		handler_async_lookup(id, type, key);
+		return;
+	}
+	if (!lookup && handler_async_check) {
+		handler_async_check(id, type, key);
+		return;
+	}
+
+	reqid = id;
+	res[0] = '\0';
+	if (lookup && handler_lookup)
+		r = handler_lookup(type, key, res, sizeof(res));
+	else if (!lookup && handler_check)
+		r = handler_check(type, key);
+	else
+		r = -1;
+
+	table_msg_add(&r, sizeof(r));
+	if (lookup && r == 1)
+		table_msg_add(res, strlen(res) + 1);
+	table_msg_close();
+}
+
 static void
 table_msg_dispatch(void)
 {
 	struct table_open_params op;
 	char		 res[4096];
+	size_t		 len;
+	uint32_t	 id, i, n;
 	int		 type, r;
 
+	/* replies carry the id of the request */
+	reqid = imsg.hdr.peerid;
+
 	switch (imsg.hdr.type) {
 	case PROC_TABLE_OPEN:
 		table_msg_get(&op, sizeof op);
@@ -122,7 +169,7 @@ table_msg_dispatch(void)
 			fatalx("table-api: terminating");
 		}
 
-		imsg_compose(&ibuf, PROC_TABLE_OK, 0, 0, -1, NULL, 0);
+		imsg_compose(&ibuf, PROC_TABLE_OK, reqid, 0, -1, NULL, 0);
 		break;
 
 	case PROC_TABLE_UPDATE:
@@ -133,7 +180,7 @@ table_msg_dispatch(void)
 		else
 			r = 1;
 
-		imsg_compose(&ibuf, PROC_TABLE_OK, 0, 0, -1, &r, sizeof(r));
+		imsg_compose(&ibuf, PROC_TABLE_OK, reqid, 0, -1, &r, sizeof(r));
 		break;
 
 	case PROC_TABLE_CLOSE:
@@ -141,6 +188,7 @@ table_msg_dispatch(void)
 		break;
 
 	case PROC_TABLE_CHECK:
+	case PROC_TABLE_LOOKUP:
 		table_msg_get(&type, sizeof(type));
 		if (rlen == 0) {
 			log_warnx("warn: table-api: no key");
@@ -151,56 +199,62 @@ table_msg_dispatch(void)
 			fatalx("table-api: exiting");
 		}
 
-		if (handler_check)
-			r = handler_check(type, rdata);
-		else
-			r = -1;
+		table_msg_key(imsg.hdr.type == PROC_TABLE_LOOKUP, reqid, type,
+		    rdata);
 		table_msg_get(NULL, rlen);
 		table_msg_end();
-
-		table_msg_add(&r, sizeof(r));
-		table_msg_close();
 		break;
 
-	case PROC_TABLE_LOOKUP:
+	case PROC_TABLE_CHECK_BATCH:
+	case PROC_TABLE_LOOKUP_BATCH:
+		/* key i is answered on its own with id reqid + i */
 		table_msg_get(&type, sizeof(type));
-
-		if (rlen == 0) {
-			log_warnx("warn: table-api: no key");
-			fatalx("table-api: exiting");
-		}
-		if (rdata[rlen - 1] != '\0') {
-			log_warnx("warn: table-api: key not NUL-terminated");
-			fatalx("table-api: exiting");
+		table_msg_get(&n, sizeof(n));
+		id = reqid;
+		for (i = 0; i < n; i++) {
+			len = strnlen(rdata, rlen);
+			if (len == rlen) {
+				log_warnx("warn: table-api: bad key in batch");
+				fatalx("table-api: exiting");
+			}
+			table_msg_key(imsg.hdr.type == PROC_TABLE_LOOKUP_BATCH,
+			    id + i, type, rdata);
+			table_msg_get(NULL, len + 1);
 		}
+		table_msg_end();
+		break;
+
+	case PROC_TABLE_FETCH:
+		table_msg_get(&type, sizeof(type));
+		table_msg_end();
 
-		if (handler_lookup)
-			r = handler_lookup(type, rdata, res, sizeof(res));
+		if (handler_fetch)
+			r = handler_fetch(type, res, sizeof(res));
 		else
 			r = -1;
 
-		table_msg_get(NULL, rlen);
-		table_msg_end();
-
 		table_msg_add(&r, sizeof(r));
 		if (r == 1)
 			table_msg_add(res, strlen(res) + 1);
 		table_msg_close();
 		break;
 
-
-	case PROC_TABLE_FETCH:
+	case PROC_TABLE_STORE:
 		table_msg_get(&type, sizeof(type));
-		table_msg_end();
+		len = strnlen(rdata, rlen);
+		if (len + 1 >= rlen || rdata[rlen - 1] != '\0') {
+			log_warnx("warn: table-api: bad key or value");
+			fatalx("table-api: exiting");
+		}
 
-		if (handler_fetch)
-			r = handler_fetch(type, res, sizeof(res));
+		if (handler_store)
+			r = handler_store(type, rdata, rdata + len + 1);
 		else
 			r = -1;
+		table_msg_get(NULL, rlen);
+		table_msg_end();
 
 		table_msg_add(&r, sizeof(r));
-		if (r == 1)
-			table_msg_add(res, strlen(res) + 1);
 		table_msg_close();
 		break;
 
@@ -234,6 +288,51 @@ table_api_on_fetch(int(*cb)(int, char *, size_t))
 	handler_fetch = cb;
 }
 
+void
+table_api_on_store(int(*cb)(int, const char *, const char *))
+{
+	handler_store = cb;
+}
+
+/*
+ * Asynchronous handlers get the request id and must copy the key if
+ * they need it after returning.  They answer later, in any order, with
+ * table_api_check_done() or table_api_lookup_done().  The backend runs
+ * the event loop: it calls event_init() before registering its events,
+ * and table_api_dispatch() then runs event_dispatch().
+ */
+void
+table_api_on_async_check(void(*cb)(uint32_t, int, const char *))
+{
+	handler_async_check = cb;
+}
+
+void
+table_api_on_async_lookup(void(*cb)(uint32_t, int, const char *))
+{
+	handler_async_lookup = cb;
+}
+
+void
+table_api_check_done(uint32_t id, int r)
+{
+	reqid = id;
+	table_msg_add(&r, sizeof(r));
+	table_msg_close();
+	imsg_flush(&ibuf);
+}
+
+void
+table_api_lookup_done(uint32_t id, int r, const char *res)
+{
+	reqid = id;
+	table_msg_add(&r, sizeof(r));
+	if (r == 1)
+		table_msg_add(res, strlen(res) + 1);
+	table_msg_close();
+	imsg_flush(&ibuf);
+}
+
 const char *
 table_api_get_name(void)
 {
@@ -246,7 +345,6 @@ table_api_dispatch(void)
 #if 0
 	struct passwd	*pw;
 #endif
-	ssize_t		 n;
 
 #if 0
 	pw = getpwnam(user);
@@ -276,32 +374,56 @@ table_api_dispatch(void)
 
 	imsg_init(&ibuf, 0);
 
-	while (1) {
-		n = imsg_get(&ibuf, &imsg);
-		if (n == -1) {
-			log_warn("warn: table-api: imsg_get");
-			break;
-		}
+	if (handler_async_check || handler_async_lookup) {
+		event_set(&ev_in, 0, EV_READ|EV_PERSIST, table_api_io, NULL);
+		event_add(&ev_in, NULL);
+		event_dispatch();
+		return (1);
+	}
 
-		if (n) {
-			rdata = imsg.data;
-			rlen = imsg.hdr.len - IMSG_HEADER_SIZE;
-			table_msg_dispatch();
-			if (quit)
-				break;
-			imsg_flush(&ibuf);
-			continue;
-		}
+	while (table_api_read())
+		;
 
-		n = imsg_read(&ibuf);
-		if (n == -1) {
-			log_warn("warn: table-api: imsg_read");
-			break;
-		}
-		if (n == 0) {
-			log_warnx("warn: table-api: pipe closed");
-			break;
-		}
+	return (1);
+}
+
+static void
+table_api_io(int fd, short event, void *p)
+{
+	if (! table_api_read())
+		event_loopexit(NULL);
+}
+
+/*
+ * Read once and dispatch every complete request.  Returns 0 when the
+ * table must exit.
+ */
+static int
+table_api_read(void)
+{
+	ssize_t		 n;
+
+	n = imsg_read(&ibuf);
+	if (n == -1) {
+		log_warn("warn: table-api: imsg_read");
+		return (0);
+	}
+	if (n == 0) {
+		log_warnx("warn: table-api: pipe closed");
+		return (0);
+	}
+
+	while ((n = imsg_get(&ibuf, &imsg)) > 0) {
+		rdata = imsg.data;
+		rlen = imsg.hdr.len - IMSG_HEADER_SIZE;
+		table_msg_dispatch();
+		if (quit)
+			return (0);
+		imsg_flush(&ibuf);
+	}
+	if (n == -1) {
+		log_warn("warn: table-api: imsg_get");
+		return (0);
 	}
 
 	return (1);
@@ -0,0 +1,334 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+/*
+ * Constant database files as written by makemap -d cdb.  A 2048 bytes
+ * header holds 256 (position, slots) pairs, one open addressing hash
+ * table per low byte of the key hash, then come the records, each a
+ * (key length, data length) pair followed by the key and the data, and
+ * finally the hash tables of (hash, record position) slots.  Numbers
+ * are 32 bits little endian.  Keys and values keep their terminating
+ * NUL so that lookups use them in place in the read-only mapping.
+ */
+
+struct cdbhandle {
+	uint8_t		*map;
+	size_t		 size;
+	uint32_t	 eod;
+	uint32_t	 iter;
+	char		 pathname[SMTPD_MAXPATHLEN];
+	time_t		 mtime;
+	struct table	*table;
+};
+
+/* cdb backend */
+static int table_cdb_config(struct table *);
+static int table_cdb_update(struct table *);
+static void *table_cdb_open(struct table *);
+static int table_cdb_lookup(void *, const char *, enum table_service,
+    union lookup *);
+static int table_cdb_fetch(void *, enum table_service, union lookup *);
+static void table_cdb_close(void *);
+
+static const char *table_cdb_find(struct cdbhandle *, const char *);
+static const char *table_cdb_find_match(struct cdbhandle *, const char *,
+    int(*)(const char *, const char *));
+static int table_cdb_record(struct cdbhandle *, uint32_t *, const char **,
+    const char **);
+static uint32_t cdb_get(const uint8_t *);
+
+struct table_backend table_backend_cdb = {
+	K_ALIAS|K_CREDENTIALS|K_DOMAIN|K_NETADDR|K_USERINFO|K_SOURCE|K_ADDRNAME,
+	table_cdb_config,
+	table_cdb_open,
+	table_cdb_update,
+	table_cdb_close,
+	table_cdb_lookup,
+	table_cdb_fetch,
+};
+
+static struct keycmp {
+	enum table_service	service;
+	int		       (*func)(const char *, const char *);
+} keycmp[] = {
+	{ K_DOMAIN, table_domain_match },
+	{ K_NETADDR, table_netaddr_match }
+};
+
+uint32_t
+cdb_hash(const void *buf, size_t len)
+{
+	const uint8_t	*p = buf;
+	uint32_t	 h = 5381;
+
+	while (len--)
+		h = ((h << 5) + h) ^ *p++;
+	return (h);
+}
+
+static uint32_t
+cdb_get(const uint8_t *p)
+{
+	return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static int
+table_cdb_config(struct table *table)
+{
+	struct cdbhandle	*handle;
+
+	handle = table_cdb_open(table);
+	if (handle == NULL)
+		return 0;
+
+	table_cdb_close(handle);
+	return 1;
+}
+
+static int
+table_cdb_update(struct table *table)
+{
+	struct cdbhandle	*handle;
+
+	handle = table_cdb_open(table);
+	if (handle == NULL)
+		return 0;
+
+	table_cdb_close(table->t_handle);
+	table->t_handle = handle;
+	return 1;
+}
+
+static void *
+table_cdb_open(struct table *table)
+{
+	struct cdbhandle	*handle;
+	struct stat		 sb;
+	uint32_t		 pos, len;
+	int			 fd, i;
+
+	fd = -1;
+	handle = xcalloc(1, sizeof *handle, "table_cdb_open");
+	if (strlcpy(handle->pathname, table->t_config, sizeof handle->pathname)
+	    >= sizeof handle->pathname)
+		goto error;
+
+	if ((fd = open(handle->pathname, O_RDONLY)) == -1)
+		goto error;
+	if (fstat(fd, &sb) == -1)
+		goto error;
+	if (sb.st_size < 2048 || (uint64_t)sb.st_size > UINT32_MAX) {
+		log_warnx("warn: table-cdb: %s: bad size", handle->pathname);
+		goto error;
+	}
+
+	handle->mtime = sb.st_mtime;
+	handle->size = sb.st_size;
+	handle->map = mmap(NULL, handle->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (handle->map == MAP_FAILED) {
+		handle->map = NULL;
+		log_warn("warn: table-cdb: mmap: %s", handle->pathname);
+		goto error;
+	}
+	close(fd);
+	fd = -1;
+
+	/* the records end where the first hash table starts */
+	handle->eod = handle->size;
+	for (i = 0; i < 256; i++) {
+		pos = cdb_get(handle->map + i * 8);
+		len = cdb_get(handle->map + i * 8 + 4);
+		if (pos < 2048 || pos > handle->size ||
+		    len > (handle->size - pos) / 8) {
+			log_warnx("warn: table-cdb: %s: corrupted header",
+			    handle->pathname);
+			goto error;
+		}
+		if (pos < handle->eod)
+			handle->eod = pos;
+	}
+	handle->iter = 2048;
+	handle->table = table;
+
+	return handle;
+
+error:
+	if (fd != -1)
+		close(fd);
+	if (handle->map)
+		munmap(handle->map, handle->size);
+	free(handle);
+	return NULL;
+}
+
+static void
+table_cdb_close(void *hdl)
+{
+	struct cdbhandle	*handle = hdl;
+
+	munmap(handle->map, handle->size);
+	free(handle);
+}
+
+static int
+table_cdb_lookup(void *hdl, const char *key, enum table_service service,
+    union lookup *lk)
+{
+	struct cdbhandle	*handle = hdl;
+	struct table		*table;
+	const char		*line;
+	int		       (*match)(const char *, const char *) = NULL;
+	size_t			 i;
+	struct stat		 sb;
+
+	if (stat(handle->pathname, &sb) < 0)
+		return -1;
+
+	/* file was replaced, map the new one */
+	if (sb.st_mtime != handle->mtime) {
+		table = handle->table;
+		if (! table_cdb_update(table))
+			return -1;
+		handle = table->t_handle;
+	}
+
+	for (i = 0; i < nitems(keycmp); ++i)
+		if (keycmp[i].service == service)
+			match = keycmp[i].func;
+
+	if (match == NULL)
+		line = table_cdb_find(handle, key);
+	else
+		line = table_cdb_find_match(handle, key, match);
+	if (line == NULL)
+		return 0;
+
+	if (lk == NULL)
+		return 1;
+	return table_parse_lookup(service, key, line, lk);
+}
+
+static int
+table_cdb_fetch(void *hdl, enum table_service service, union lookup *lk)
+{
+	struct cdbhandle	*handle = hdl;
+	const char		*key, *data;
+
+	if (! table_cdb_record(handle, &handle->iter, &key, &data)) {
+		handle->iter = 2048;
+		if (! table_cdb_record(handle, &handle->iter, &key, &data))
+			return 0;
+	}
+
+	return table_parse_lookup(service, NULL, key, lk);
+}
+
+/*
+ * Read the record at *pos and advance past it.  Both key and data must
+ * be NUL terminated strings in the map.
+ */
+static int
+table_cdb_record(struct cdbhandle *handle, uint32_t *pos, const char **key,
+    const char **data)
+{
+	uint32_t	klen, dlen;
+
+	if (*pos > handle->eod || handle->eod - *pos < 8)
+		return 0;
+	klen = cdb_get(handle->map + *pos);
+	dlen = cdb_get(handle->map + *pos + 4);
+	if (klen == 0 || dlen == 0 ||
+	    klen > handle->eod - *pos - 8 ||
+	    dlen > handle->eod - *pos - 8 - klen) {
+		log_warnx("warn: table-cdb: %s: corrupted record",
+		    handle->pathname);
+		return 0;
+	}
+
+	*key = (const char *)handle->map + *pos + 8;
+	*data = *key + klen;
+	if ((*key)[klen - 1] != '\0' || (*data)[dlen - 1] != '\0')
+		return 0;
+
+	*pos += 8 + klen + dlen;
+	return 1;
+}
+
+static const char *
+table_cdb_find(struct cdbhandle *handle, const char *key)
+{
+	const char	*k, *data;
+	size_t		 klen;
+	uint32_t	 h, tpos, tlen, slot, hash, pos, n;
+
+	klen = strlen(key) + 1;
+	h = cdb_hash(key, klen);
+	tpos = cdb_get(handle->map + (h & 0xff) * 8);
+	tlen = cdb_get(handle->map + (h & 0xff) * 8 + 4);
+	if (tlen == 0)
+		return NULL;
+
+	slot = (h >> 8) % tlen;
+	for (n = 0; n < tlen; n++) {
+		hash = cdb_get(handle->map + tpos + slot * 8);
+		pos = cdb_get(handle->map + tpos + slot * 8 + 4);
+		if (pos == 0)
+			return NULL;
+		if (hash == h && pos >= 2048 &&
+		    table_cdb_record(handle, &pos, &k, &data) &&
+		    strcmp(k, key) == 0)
+			return data;
+		if (++slot == tlen)
+			slot = 0;
+	}
+	return NULL;
+}
+
+static const char *
+table_cdb_find_match(struct cdbhandle *handle, const char *key,
+    int(*func)(const char *, const char *))
+{
+	const char	*k, *data;
+	uint32_t	 pos;
+
+	for (pos = 2048; table_cdb_record(handle, &pos, &k, &data); )
+		if (func(key, k))
+			return data;
+	return NULL;
+}
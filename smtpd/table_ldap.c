@@ -17,8 +17,16 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
 
 #include <ctype.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -58,15 +66,83 @@ struct query {
 	int	 attrn;
 };
 
+#define	LDAP_POOL_MAX		64
+#define	LDAP_BACKOFF_MAX	60
+
+/*
+ * With pool_size set in the config, lookups and checks are answered
+ * asynchronously.  Each connection of the pool is bound once and then
+ * carries any number of searches at a time, matched to their replies
+ * by message id.  A lost connection fails its searches and is opened
+ * again after a delay that doubles up to a minute.
+ */
+struct ldapreq {
+	TAILQ_ENTRY(ldapreq)	 entry;
+	uint32_t		 id;
+	int			 service;
+	int			 check;
+	char			*key;
+	struct query		*query;
+	int			 found;
+	int			 error;
+	char			**res[MAX_ATTRS];
+};
+
+enum {
+	CONN_CLOSED,
+	CONN_CONNECT,
+	CONN_BIND,
+	CONN_READY
+};
+
+struct ldapconn {
+	struct aldap		*aldap;
+	int			 fd;
+	int			 state;
+	int			 bindid;
+	int			 backoff;
+	struct event		 ev;
+	struct event		 retry;
+	struct tree		 reqs;
+	char			*ibuf;
+	size_t			 ilen;
+	size_t			 isize;
+	char			*obuf;
+	size_t			 olen;
+};
+
 static int table_ldap_update(void);
 static int table_ldap_check(int, const char *);
 static int table_ldap_lookup(int, const char *, char *, size_t);
 static int table_ldap_fetch(int, char *, size_t);
 
+static void table_ldap_async_check(uint32_t, int, const char *);
+static void table_ldap_async_lookup(uint32_t, int, const char *);
+static void table_ldap_async_request(uint32_t, int, const char *, int);
+static void table_ldap_async_run(void);
+static void table_ldap_async_done(struct ldapreq *, int);
+
+static void pool_open(struct ldapconn *);
+static void pool_retry(int, short, void *);
+static void pool_io(int, short, void *);
+static void pool_event(struct ldapconn *);
+static int pool_read(struct ldapconn *);
+static int pool_message(struct ldapconn *, struct aldap_message *);
+static int pool_send(struct ldapconn *, int);
+static int pool_search(struct ldapconn *, struct ldapreq *,
+    struct aldap_page_control *);
+static void pool_fail(struct ldapconn *);
+static void pool_reset(struct ldapconn *);
+
 static int ldap_config(void);
+static int ldap_socket(const char *, int);
 static int ldap_open(void);
 static int ldap_query(const char *, char **, char ***, size_t);
-static int ldap_parse_attributes(char **, const char *, const char *, size_t);
+static int ldap_parse_attributes(struct query *, const char *, const char *,
+    size_t);
+static struct query *ldap_get_query(int);
+static int ldap_filter(struct query *, const char *, char *, size_t);
+static int ldap_format(int, char ***, char *, size_t);
 static int ldap_run_query(int type, const char *, char *, size_t);
 
 static char *config;
@@ -79,9 +155,15 @@ static char *basedn;
 static struct aldap *aldap;
 static struct query queries[LDAP_MAX];
 
+static struct ldapconn *pool;
+static size_t npool;
+
+static TAILQ_HEAD(, ldapreq)	pending = TAILQ_HEAD_INITIALIZER(pending);
+
 int
 main(int argc, char **argv)
 {
+	size_t	i;
 	int	ch;
 
 	log_init(1);
@@ -105,6 +187,8 @@ main(int argc, char **argv)
 
 	config = argv[0];
 
+	event_init();
+
 	if (!ldap_config()) {
 		log_warnx("warn: table-ldap: could not parse config");
 		return (1);
@@ -123,6 +207,19 @@ main(int argc, char **argv)
 	table_api_on_check(table_ldap_check);
 	table_api_on_lookup(table_ldap_lookup);
 	table_api_on_fetch(table_ldap_fetch);
+	if (npool) {
+		/* the server is known to accept us, the pool takes over */
+		aldap_close(aldap);
+		aldap = NULL;
+		for (i = 0; i < npool; i++) {
+			pool[i].fd = -1;
+			tree_init(&pool[i].reqs);
+			evtimer_set(&pool[i].retry, pool_retry, &pool[i]);
+			pool_open(&pool[i]);
+		}
+		table_api_on_async_check(table_ldap_async_check);
+		table_api_on_async_lookup(table_ldap_async_lookup);
+	}
 	table_api_dispatch();
 
 	return (0);
@@ -168,8 +265,12 @@ table_ldap_fetch(int service, char *dst, size_t sz)
 	return (-1);
 }
 
-static struct aldap *
-ldap_connect(const char *addr)
+/*
+ * Connect to the server of the url and return the socket.  With
+ * nonblock set, the connection may still be in progress.
+ */
+static int
+ldap_socket(const char *addr, int nonblock)
 {
 	struct aldap_url lu;
 	struct addrinfo	 hints, *res0, *res;
@@ -177,25 +278,26 @@ ldap_connect(const char *addr)
 	int		 error, fd = -1;
 
 	if ((buf = strdup(addr)) == NULL)
-		return (NULL);
-
-	/* XXX buf leak */
+		return (-1);
 
+	memset(&lu, 0, sizeof(lu));
 	if (aldap_parse_url(buf, &lu) != 1) {
 		log_warnx("warn: table-ldap: ldap_parse_url fail");
-		return (NULL);
+		free(buf);
+		return (-1);
 	}
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM; /* DUMMY */
 	error = getaddrinfo(lu.host, NULL, &hints, &res0);
-	if (error == EAI_AGAIN || error == EAI_NODATA || error == EAI_NONAME)
-		return (NULL);
 	if (error) {
-		log_warnx("warn: table-ldap: could not parse \"%s\": %s",
-		    lu.host, gai_strerror(error));
-		return (NULL);
+		if (error != EAI_AGAIN && error != EAI_NODATA &&
+		    error != EAI_NONAME)
+			log_warnx("warn: table-ldap: could not parse \"%s\": %s",
+			    lu.host, gai_strerror(error));
+		free(lu.buffer);
+		return (-1);
 	}
 
 	for (res = res0; res; res = res->ai_next) {
@@ -205,25 +307,42 @@ ldap_connect(const char *addr)
 		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 		if (fd == -1)
 			continue;
-
-		if (res->ai_family == AF_INET) {
-			struct sockaddr_in sin4 = *(struct sockaddr_in *)res->ai_addr;
-			sin4.sin_port = htons(lu.port);
-			if (connect(fd, (struct sockaddr *)&sin4, res->ai_addrlen) == 0)
-				return aldap_init(fd);
-		}
-		else if (res->ai_family == AF_INET6) {
-			struct sockaddr_in6 sin6 = *(struct sockaddr_in6 *)res->ai_addr;
-			sin6.sin6_port = htons(lu.port);
-			if (connect(fd, (struct sockaddr *)&sin6, res->ai_addrlen) == 0)
-				return aldap_init(fd);
+		if (nonblock && fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			close(fd);
+			fd = -1;
+			continue;
 		}
 
+		if (res->ai_family == AF_INET)
+			((struct sockaddr_in *)res->ai_addr)->sin_port =
+			    htons(lu.port);
+		else
+			((struct sockaddr_in6 *)res->ai_addr)->sin6_port =
+			    htons(lu.port);
+		if (connect(fd, res->ai_addr, res->ai_addrlen) == 0 ||
+		    (nonblock && errno == EINPROGRESS))
+			break;
+
 		close(fd);
 		fd = -1;
 	}
 
-	return (NULL);
+	freeaddrinfo(res0);
+	free(lu.buffer);
+	return (fd);
+}
+
+static struct aldap *
+ldap_connect(const char *addr)
+{
+	struct aldap	*a;
+	int		 fd;
+
+	if ((fd = ldap_socket(addr, 0)) == -1)
+		return (NULL);
+	if ((a = aldap_init(fd)) == NULL)
+		close(fd);
+	return (a);
 }
 
 static int
@@ -246,7 +365,7 @@ read_value(char **store, const char *key, const char *value)
 }
 
 static int
-ldap_parse_attributes(char **attributes, const char *key, const char *line,
+ldap_parse_attributes(struct query *q, const char *key, const char *line,
     size_t expect)
 {
 	char	buffer[1024];
@@ -271,15 +390,16 @@ ldap_parse_attributes(char **attributes, const char *key, const char *line,
 
 	p = buffer;
 	for (n = 0; n < expect; ++n)
-		attributes[n] = NULL;
+		q->attrs[n] = NULL;
 	for (n = 0; n < m; ++n) {
-		attributes[n] = strdup(p);
-		if (attributes[n] == NULL) {
+		q->attrs[n] = strdup(p);
+		if (q->attrs[n] == NULL) {
 			log_warnx("warn: table-ldap: strdup");
 			return (0); /* XXX cleanup */
 		}
 		p += strlen(p) + 1;
 	}
+	q->attrn = expect;
 	return (1);
 }
 
@@ -289,6 +409,7 @@ ldap_config(void)
 	size_t		 flen;
 	FILE		*fp;
 	char		*key, *value, *buf, *lbuf;
+	const char	*e;
 
 	fp = fopen(config, "r");
 	if (fp == NULL)
@@ -340,29 +461,53 @@ ldap_config(void)
 			read_value(&password, key, value);
 		else if (!strcmp(key, "basedn"))
 			read_value(&basedn, key, value);
+		else if (!strcmp(key, "pool_size")) {
+			npool = strtonum(value, 1, LDAP_POOL_MAX, &e);
+			if (e) {
+				log_warnx("warn: table-ldap: bad value for "
+				    "pool_size: %s", e);
+				npool = 0;
+				continue;
+			}
+			free(pool);
+			if ((pool = calloc(npool, sizeof(*pool))) == NULL) {
+				log_warn("warn: table-ldap: calloc");
+				return (0);
+			}
+		}
+		else if (!strcmp(key, "max_pdu_size")) {
+			aldap_pdu_max = strtonum(value, 4096, LDAP_PDU_LIMIT,
+			    &e);
+			if (e) {
+				log_warnx("warn: table-ldap: bad value for "
+				    "max_pdu_size: %s", e);
+				aldap_pdu_max = LDAP_PDU_MAX;
+				continue;
+			}
+		}
 
 		else if (!strcmp(key, "alias_filter"))
 			read_value(&queries[LDAP_ALIAS].filter, key, value);
 		else if (!strcmp(key, "alias_attributes"))
-			ldap_parse_attributes(queries[LDAP_ALIAS].attrs,
+			ldap_parse_attributes(&queries[LDAP_ALIAS],
 			    key, value, 1);
 
 		else if (!strcmp(key, "credentials_filter"))
 			read_value(&queries[LDAP_CREDENTIALS].filter, key, value);
 		else if (!strcmp(key, "credentials_attributes"))
-			ldap_parse_attributes(queries[LDAP_CREDENTIALS].attrs,
+			ldap_parse_attributes(&queries[LDAP_CREDENTIALS],
 			    key, value, 2);
 
 		else if (!strcmp(key, "domain_filter"))
 			read_value(&queries[LDAP_DOMAIN].filter, key, value);
 		else if (!strcmp(key, "domain_attributes"))
-			ldap_parse_attributes(queries[LDAP_DOMAIN].attrs,
+			ldap_parse_attributes(&queries[LDAP_DOMAIN],
 			    key, value, 1);
 
 		else if (!strcmp(key, "userinfo_filter"))
 			read_value(&queries[LDAP_USERINFO].filter, key, value);
 		else if (!strcmp(key, "userinfo_attributes"))
-			ldap_parse_attributes(queries[LDAP_USERINFO].attrs,
+			ldap_parse_attributes(&queries[LDAP_USERINFO],
 			    key, value, 4);
 		else
 			log_warnx("warn: table-ldap: bogus entry \"%s\"", key);
@@ -480,37 +625,42 @@ end:
 	return ret;
 }
 
-static int
-ldap_run_query(int type, const char *key, char *dst, size_t sz)
+static struct query *
+ldap_get_query(int type)
 {
-	struct query	 *q;
-	char		**res[4], filter[MAX_LDAP_FILTERLEN];
-	int		  ret, i;
-
 	switch (type) {
-	case K_ALIAS:		q = &queries[LDAP_ALIAS];	break;
-	case K_DOMAIN:		q = &queries[LDAP_DOMAIN];	break;
-	case K_CREDENTIALS:	q = &queries[LDAP_CREDENTIALS];	break;
-	case K_NETADDR:		q = &queries[LDAP_NETADDR];	break;
-	case K_USERINFO:	q = &queries[LDAP_USERINFO];	break;
-	case K_SOURCE:		q = &queries[LDAP_SOURCE];	break;
-	case K_MAILADDR:	q = &queries[LDAP_MAILADDR];	break;
-	case K_ADDRNAME:	q = &queries[LDAP_ADDRNAME];	break;
+	case K_ALIAS:		return &queries[LDAP_ALIAS];
+	case K_DOMAIN:		return &queries[LDAP_DOMAIN];
+	case K_CREDENTIALS:	return &queries[LDAP_CREDENTIALS];
+	case K_NETADDR:		return &queries[LDAP_NETADDR];
+	case K_USERINFO:	return &queries[LDAP_USERINFO];
+	case K_SOURCE:		return &queries[LDAP_SOURCE];
+	case K_MAILADDR:	return &queries[LDAP_MAILADDR];
+	case K_ADDRNAME:	return &queries[LDAP_ADDRNAME];
 	default:
-		return (-1);
+		return (NULL);
 	}
+}
 
-	if (snprintf(filter, sizeof(filter), q->filter, key)
-	    >= (int)sizeof(filter)) {
+static int
+ldap_filter(struct query *q, const char *key, char *filter, size_t sz)
+{
+	if (q->filter == NULL)
+		return (-1);
+	if (snprintf(filter, sz, q->filter, key) >= (int)sz) {
 		log_warnx("warn: table-ldap: filter too large");
 		return (-1);
 	}
+	return (0);
+}
 
-	memset(res, 0, sizeof(res));
-	ret = ldap_query(filter, q->attrs, res, q->attrn);
-	if (ret <= 0 || dst == NULL)
-		goto end;
+static int
+ldap_format(int type, char ***res, char *dst, size_t sz)
+{
+	int	ret, i;
 
+	ret = 1;
+	dst[0] = '\0';
 	switch (type) {
 
 	case K_ALIAS:
@@ -530,7 +680,7 @@ ldap_run_query(int type, const char *key, char *dst, size_t sz)
 			ret = -1;
 		break;
 	case K_CREDENTIALS:
-		if (snprintf(dst, sz, "%s:%s", res[0][0], res[0][1]) >= (int)sz)
+		if (snprintf(dst, sz, "%s:%s", res[0][0], res[1][0]) >= (int)sz)
 			ret = -1;
 		break;
 	case K_USERINFO:
@@ -543,10 +693,438 @@ ldap_run_query(int type, const char *key, char *dst, size_t sz)
 	if (ret == -1)
 		log_warnx("warn: table-ldap: could not format result");
 
-end:
+	return (ret);
+}
+
+static int
+ldap_run_query(int type, const char *key, char *dst, size_t sz)
+{
+	struct query	 *q;
+	char		**res[MAX_ATTRS], filter[MAX_LDAP_FILTERLEN];
+	int		  ret, i;
+
+	if ((q = ldap_get_query(type)) == NULL)
+		return (-1);
+	if (ldap_filter(q, key, filter, sizeof(filter)) == -1)
+		return (-1);
+
+	memset(res, 0, sizeof(res));
+	ret = ldap_query(filter, q->attrs, res, q->attrn);
+	if (ret > 0 && dst)
+		ret = ldap_format(type, res, dst, sz);
+
 	for (i = 0; i < q->attrn; ++i)
 		if (res[i])
 			aldap_free_attr(res[i]);
 
 	return (ret);
 }
+
+static void
+table_ldap_async_check(uint32_t id, int service, const char *key)
+{
+	table_ldap_async_request(id, service, key, 1);
+}
+
+static void
+table_ldap_async_lookup(uint32_t id, int service, const char *key)
+{
+	table_ldap_async_request(id, service, key, 0);
+}
+
+static void
+table_ldap_async_request(uint32_t id, int service, const char *key, int check)
+{
+	struct ldapreq	*req;
+	struct query	*q;
+
+	q = NULL;
+	switch (service) {
+	case K_ALIAS:
+	case K_DOMAIN:
+	case K_CREDENTIALS:
+	case K_USERINFO:
+		q = ldap_get_query(service);
+		break;
+	}
+
+	req = NULL;
+	if (q == NULL || q->filter == NULL ||
+	    (req = calloc(1, sizeof(*req))) == NULL ||
+	    (req->key = strdup(key)) == NULL) {
+		if (req)
+			log_warn("warn: table-ldap: strdup");
+		free(req);
+		if (check)
+			table_api_check_done(id, -1);
+		else
+			table_api_lookup_done(id, -1, NULL);
+		return;
+	}
+	req->id = id;
+	req->service = service;
+	req->check = check;
+	req->query = q;
+	TAILQ_INSERT_TAIL(&pending, req, entry);
+
+	table_ldap_async_run();
+}
+
+/*
+ * Send the queued requests on the ready connection with the fewest
+ * searches in flight.  They wait while a connection is being opened,
+ * and fail if none is.
+ */
+static void
+table_ldap_async_run(void)
+{
+	struct ldapconn	*c, *best;
+	struct ldapreq	*req;
+	size_t		 i;
+	int		 opening;
+
+	while ((req = TAILQ_FIRST(&pending))) {
+		best = NULL;
+		opening = 0;
+		for (i = 0; i < npool; i++) {
+			c = &pool[i];
+			if (c->state == CONN_CONNECT || c->state == CONN_BIND)
+				opening = 1;
+			if (c->state != CONN_READY)
+				continue;
+			if (best == NULL ||
+			    tree_count(&c->reqs) < tree_count(&best->reqs))
+				best = c;
+		}
+		if (best == NULL && opening)
+			return;
+
+		TAILQ_REMOVE(&pending, req, entry);
+		if (best == NULL || pool_search(best, req, NULL) == -1) {
+			table_ldap_async_done(req, -1);
+			continue;
+		}
+		pool_event(best);
+	}
+}
+
+static void
+table_ldap_async_done(struct ldapreq *req, int r)
+{
+	char	dst[4096];
+	int	i;
+
+	dst[0] = '\0';
+	if (r == 1 && !req->check)
+		r = ldap_format(req->service, req->res, dst, sizeof(dst));
+
+	if (req->check)
+		table_api_check_done(req->id, r);
+	else
+		table_api_lookup_done(req->id, r, dst);
+
+	for (i = 0; i < MAX_ATTRS; i++)
+		if (req->res[i])
+			aldap_free_attr(req->res[i]);
+	free(req->key);
+	free(req);
+}
+
+/*
+ * The aldap handle of a pool connection has no descriptor: it only
+ * encodes requests and decodes the messages read into ibuf, the socket
+ * itself is non-blocking and driven by the event loop.
+ */
+static void
+pool_open(struct ldapconn *c)
+{
+	if ((c->fd = ldap_socket(url, 1)) == -1 ||
+	    (c->aldap = aldap_init(-1)) == NULL) {
+		pool_fail(c);
+		return;
+	}
+
+	c->state = CONN_CONNECT;
+	event_set(&c->ev, c->fd, EV_WRITE, pool_io, c);
+	event_add(&c->ev, NULL);
+}
+
+static void
+pool_retry(int fd, short event, void *arg)
+{
+	pool_open(arg);
+}
+
+static void
+pool_io(int fd, short event, void *arg)
+{
+	struct ldapconn	*c = arg;
+	socklen_t	 len;
+	ssize_t		 n;
+	int		 error;
+
+	if (c->state == CONN_CONNECT) {
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+		if (error) {
+			log_warnx("warn: table-ldap: pool: connect: %s",
+			    strerror(error));
+			goto fail;
+		}
+		c->state = CONN_BIND;
+		c->bindid = pool_send(c, aldap_bind(c->aldap, username,
+		    password));
+		if (c->bindid == -1)
+			goto fail;
+	}
+
+	if (event & EV_WRITE && c->olen) {
+		if ((n = write(fd, c->obuf, c->olen)) == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				log_warn("warn: table-ldap: pool: write");
+				goto fail;
+			}
+		}
+		else {
+			c->olen -= n;
+			memmove(c->obuf, c->obuf + n, c->olen);
+		}
+	}
+
+	if (event & EV_READ && pool_read(c) == -1)
+		goto fail;
+
+	pool_event(c);
+	return;
+
+fail:
+	pool_fail(c);
+}
+
+static void
+pool_event(struct ldapconn *c)
+{
+	short	ev;
+
+	ev = EV_READ;
+	if (c->olen)
+		ev |= EV_WRITE;
+	event_del(&c->ev);
+	event_set(&c->ev, c->fd, ev, pool_io, c);
+	event_add(&c->ev, NULL);
+}
+
+static int
+pool_read(struct ldapconn *c)
+{
+	struct aldap_message	*m;
+	ssize_t			 n;
+	size_t			 len;
+	char			*p;
+
+	if (c->isize - c->ilen < 4096) {
+		len = c->isize ? c->isize * 2 : 8192;
+		if (len > 2 * aldap_pdu_max) {
+			log_warnx("warn: table-ldap: pool: message too large");
+			return (-1);
+		}
+		if ((p = realloc(c->ibuf, len)) == NULL) {
+			log_warn("warn: table-ldap: realloc");
+			return (-1);
+		}
+		c->ibuf = p;
+		c->isize = len;
+	}
+
+	if ((n = read(c->fd, c->ibuf + c->ilen, c->isize - c->ilen)) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (0);
+		log_warn("warn: table-ldap: pool: read");
+		return (-1);
+	}
+	if (n == 0) {
+		log_warnx("warn: table-ldap: pool: connection closed");
+		return (-1);
+	}
+	c->ilen += n;
+
+	while ((len = aldap_pdulen(c->ibuf, c->ilen)) != 0) {
+		if (len == (size_t)-1) {
+			log_warnx("warn: table-ldap: pool: bad message");
+			return (-1);
+		}
+		if (len > c->ilen)
+			break;
+
+		/* the message points into ibuf until pool_message() frees it */
+		ber_set_readbuf(&c->aldap->ber, c->ibuf, len);
+		if ((m = aldap_parse(c->aldap)) == NULL) {
+			log_warnx("warn: table-ldap: pool: aldap_parse");
+			return (-1);
+		}
+		if (pool_message(c, m) == -1)
+			return (-1);
+		c->ilen -= len;
+		memmove(c->ibuf, c->ibuf + len, c->ilen);
+	}
+
+	return (0);
+}
+
+static int
+pool_message(struct ldapconn *c, struct aldap_message *m)
+{
+	struct ldapreq			*req;
+	struct aldap_page_control	*pg;
+	int				 i;
+
+	if (c->state == CONN_BIND) {
+		if (m->msgid != c->bindid ||
+		    m->message_type != LDAP_RES_BIND ||
+		    aldap_get_resultcode(m) != LDAP_SUCCESS) {
+			log_warnx("warn: table-ldap: pool: failed to bind, "
+			    "result #%d", aldap_get_resultcode(m));
+			aldap_freemsg(m);
+			return (-1);
+		}
+		aldap_freemsg(m);
+		log_debug("debug: table-ldap: pool: connection ready");
+		c->state = CONN_READY;
+		c->backoff = 0;
+		table_ldap_async_run();
+		return (0);
+	}
+
+	if ((req = tree_get(&c->reqs, m->msgid)) == NULL) {
+		log_debug("debug: table-ldap: pool: unexpected message #%d",
+		    m->msgid);
+		aldap_freemsg(m);
+		return (0);
+	}
+
+	switch (m->message_type) {
+	case LDAP_RES_SEARCH_ENTRY:
+		/* the first entry answers */
+		if (req->found++ || req->check)
+			break;
+		for (i = 0; i < req->query->attrn; ++i)
+			if (aldap_match_attr(m, req->query->attrs[i],
+			    &req->res[i]) != 1)
+				req->error = 1;
+		break;
+
+	case LDAP_RES_SEARCH_RESULT:
+		tree_xpop(&c->reqs, m->msgid);
+		pg = m->page;
+		if (pg && pg->cookie_len && !req->found) {
+			if (pool_search(c, req, pg) == -1)
+				table_ldap_async_done(req, -1);
+		}
+		else
+			table_ldap_async_done(req,
+			    req->error ? -1 : req->found ? 1 : 0);
+		if (pg)
+			aldap_freepage(pg);
+		break;
+	}
+
+	aldap_freemsg(m);
+	return (0);
+}
+
+/* queue the request aldap just encoded, and return its message id */
+static int
+pool_send(struct ldapconn *c, int msgid)
+{
+	void	*buf;
+	char	*p;
+	ssize_t	 len;
+
+	if (msgid == -1)
+		return (-1);
+	if ((len = ber_get_writebuf(&c->aldap->ber, &buf)) == -1)
+		return (-1);
+
+	if ((p = realloc(c->obuf, c->olen + len)) == NULL) {
+		log_warn("warn: table-ldap: realloc");
+		return (-1);
+	}
+	c->obuf = p;
+	memmove(c->obuf + c->olen, buf, len);
+	c->olen += len;
+
+	return (msgid);
+}
+
+static int
+pool_search(struct ldapconn *c, struct ldapreq *req,
+    struct aldap_page_control *pg)
+{
+	char	base[MAX_LDAP_BASELEN], filter[MAX_LDAP_FILTERLEN];
+	int	msgid;
+
+	if (strlcpy(base, basedn, sizeof base) >= sizeof base)
+		return (-1);
+	if (ldap_filter(req->query, req->key, filter, sizeof filter) == -1)
+		return (-1);
+
+	msgid = aldap_search(c->aldap, base, LDAP_SCOPE_SUBTREE, filter,
+	    NULL, 0, 0, 0, pg);
+	if ((msgid = pool_send(c, msgid)) == -1)
+		return (-1);
+	tree_xset(&c->reqs, msgid, req);
+
+	return (msgid);
+}
+
+static void
+pool_fail(struct ldapconn *c)
+{
+	struct timeval	tv;
+
+	pool_reset(c);
+
+	if (c->backoff == 0)
+		c->backoff = 1;
+	else if ((c->backoff *= 2) > LDAP_BACKOFF_MAX)
+		c->backoff = LDAP_BACKOFF_MAX;
+	log_warnx("warn: table-ldap: pool: connection lost, retrying in %ds",
+	    c->backoff);
+
+	tv.tv_sec = c->backoff;
+	tv.tv_usec = 0;
+	evtimer_add(&c->retry, &tv);
+
+	/* the searches of this connection fail, the queued ones may wait */
+	table_ldap_async_run();
+}
+
+static void
+pool_reset(struct ldapconn *c)
+{
+	struct ldapreq	*req;
+
+	while (tree_poproot(&c->reqs, NULL, (void **)&req))
+		table_ldap_async_done(req, -1);
+
+	if (c->state != CONN_CLOSED)
+		event_del(&c->ev);
+	c->state = CONN_CLOSED;
+
+	if (c->aldap) {
+		c->aldap->ber.fd = c->fd;
+		aldap_close(c->aldap);
+		c->aldap = NULL;
+	}
+	else if (c->fd != -1)
+		close(c->fd);
+	c->fd = -1;
+
+	free(c->ibuf);
+	c->ibuf = NULL;
+	c->ilen = c->isize = 0;
+	free(c->obuf);
+	c->obuf = NULL;
+	c->olen = 0;
+}
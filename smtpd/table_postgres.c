@@ -17,8 +17,10 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
 
 #include <ctype.h>
+#include <event.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,9 +47,34 @@ enum {
 	SQL_MAX
 };
 
+/*
+ * With pool_size set in the config, lookups and checks are answered
+ * asynchronously: requests are queued and sent on the first idle
+ * connection of the pool, so one slow query does not hold the others.
+ */
+struct pgreq {
+	TAILQ_ENTRY(pgreq)	 entry;
+	uint32_t		 id;
+	int			 service;
+	int			 check;
+	char			*key;
+};
+
+struct pgconn {
+	TAILQ_ENTRY(pgconn)	 entry;
+	PGconn			*db;
+	char			*statements[SQL_MAX];
+	struct event		 ev;
+	struct pgreq		*req;
+	PGresult		*res;
+	int			 idle;
+};
+
 struct config {
 	struct dict	 conf;
 	PGconn		*db;
+	struct pgconn	*pool;
+	size_t		 npool;
 	char		*statements[SQL_MAX];
 	char		*stmt_fetch_source;
 	struct dict	 sources;
@@ -64,6 +91,16 @@ static int table_postgres_check(int, const char *);
 static int table_postgres_fetch(int, char *, size_t);
 
 static PGresult *table_postgres_query(const char *, int);
+static int table_postgres_result(int, PGresult *, char *, size_t);
+
+static void table_postgres_async_check(uint32_t, int, const char *);
+static void table_postgres_async_lookup(uint32_t, int, const char *);
+static void table_postgres_async_request(uint32_t, int, const char *, int);
+static void table_postgres_async_run(void);
+static void table_postgres_async_io(int, short, void *);
+static void table_postgres_async_done(struct pgconn *, PGresult *);
+static int pool_connect(struct config *, struct pgconn *);
+static void pool_reset(struct pgconn *);
 
 static struct config 	*config_load(const char *);
 static void		 config_reset(struct config *);
@@ -78,6 +115,9 @@ static void		 config_free(struct config *);
 static char		*conffile;
 static struct config	*config;
 
+static TAILQ_HEAD(, pgreq)	pending = TAILQ_HEAD_INITIALIZER(pending);
+static TAILQ_HEAD(, pgconn)	idle = TAILQ_HEAD_INITIALIZER(idle);
+
 int
 main(int argc, char **argv)
 {
@@ -104,6 +144,8 @@ main(int argc, char **argv)
 
 	conffile = argv[0];
 
+	event_init();
+
 	config = config_load(conffile);
 	if (config == NULL) {
 		log_warnx("warn: table-postgres: error parsing config file");
@@ -118,6 +160,10 @@ main(int argc, char **argv)
 	table_api_on_check(table_postgres_check);
 	table_api_on_lookup(table_postgres_lookup);
 	table_api_on_fetch(table_postgres_fetch);
+	if (config->npool) {
+		table_api_on_async_check(table_postgres_async_check);
+		table_api_on_async_lookup(table_postgres_async_lookup);
+	}
 	table_api_dispatch();
 
 	return (0);
@@ -247,6 +293,20 @@ config_load(const char *path)
 		}
 		conf->source_refresh = ll;
 	}
+	if ((value = dict_get(&conf->conf, "pool_size"))) {
+		e = NULL;
+		ll = strtonum(value, 1, 64, &e);
+		if (e) {
+			log_warnx("warn: table-postgres: bad value for pool_size: %s", e);
+			goto end;
+		}
+		conf->npool = ll;
+		conf->pool = calloc(conf->npool, sizeof(*conf->pool));
+		if (conf->pool == NULL) {
+			log_warn("warn: table-postgres: calloc");
+			goto end;
+		}
+	}
 
 	free(lbuf);
 	fclose(fp);
@@ -278,6 +338,8 @@ config_reset(struct config *conf)
 		PQfinish(conf->db);
 		conf->db = NULL;
 	}
+	for (i = 0; i < conf->npool; i++)
+		pool_reset(&conf->pool[i]);
 }
 
 static int
@@ -329,6 +391,10 @@ config_connect(struct config *conf)
 	    q, 0, 1)) == NULL)
 		goto end;
 
+	for (i = 0; i < conf->npool; i++)
+		if (! pool_connect(conf, &conf->pool[i]))
+			goto end;
+
 	log_debug("debug: table-postgres: connected");
 
 	return (1);
@@ -351,6 +417,7 @@ config_free(struct config *conf)
 	while (dict_poproot(&conf->sources, NULL))
 		;
 
+	free(conf->pool);
 	free(conf);
 }
 
@@ -366,8 +433,10 @@ table_postgres_update(void)
 		return (0);
 	}
 
+	/* queries in flight on the former pool fail, the queued ones wait */
 	config_free(config);
 	config = c;
+	table_postgres_async_run();
 
 	return (1);
 }
@@ -437,7 +506,7 @@ static int
 table_postgres_lookup(int service, const char *key, char *dst, size_t sz)
 {
 	PGresult	*res;
-	int		 r, i;
+	int		 r;
 
 	if (config->db == NULL && config_connect(config) == 0)
 		return (-1);
@@ -446,10 +515,19 @@ table_postgres_lookup(int service, const char *key, char *dst, size_t sz)
 	if (res == NULL)
 		return (-1);
 
-	if (PQntuples(res) == 0) {
-		r = 0;
-		goto end;
-	}
+	r = table_postgres_result(service, res, dst, sz);
+	PQclear(res);
+
+	return (r);
+}
+
+static int
+table_postgres_result(int service, PGresult *res, char *dst, size_t sz)
+{
+	int		 r, i;
+
+	if (PQntuples(res) == 0)
+		return (0);
 
 	r = 1;
 	switch(service) {
@@ -500,9 +578,6 @@ table_postgres_lookup(int service, const char *key, char *dst, size_t sz)
 		r = -1;
 	}
 
-    end:
-	PQclear(res);
-
 	return (r);
 }
 
@@ -576,3 +651,268 @@ table_postgres_fetch(int service, char *dst, size_t sz)
 
 	return (1);
 }
+
+static int
+pool_connect(struct config *conf, struct pgconn *c)
+{
+	char	*conninfo, *q;
+	size_t	 i;
+	static const char *qname[SQL_MAX] = {
+		"query_alias", "query_domain", "query_credentials",
+		"query_netaddr", "query_userinfo", "query_source",
+		"query_mailaddr", "query_addrname"
+	};
+
+	pool_reset(c);
+
+	conninfo = dict_get(&conf->conf, "conninfo");
+	c->db = PQconnectdb(conninfo);
+	if (c->db == NULL || PQstatus(c->db) != CONNECTION_OK) {
+		log_warnx("warn: table-postgres: pool: PQconnectdb: %s",
+		    c->db ? PQerrorMessage(c->db) : "NULL");
+		goto err;
+	}
+
+	for (i = 0; i < SQL_MAX; i++) {
+		q = dict_get(&conf->conf, qname[i]);
+		if (q && (c->statements[i] = table_postgres_prepare_stmt(
+		    c->db, q, 1, 0)) == NULL)
+			goto err;
+	}
+
+	if (PQsetnonblocking(c->db, 1) == -1) {
+		log_warnx("warn: table-postgres: PQsetnonblocking: %s",
+		    PQerrorMessage(c->db));
+		goto err;
+	}
+
+	TAILQ_INSERT_TAIL(&idle, c, entry);
+	c->idle = 1;
+	return (1);
+
+err:
+	pool_reset(c);
+	return (0);
+}
+
+static void
+pool_reset(struct pgconn *c)
+{
+	size_t	i;
+
+	if (c->req) {
+		event_del(&c->ev);
+		if (c->req->check)
+			table_api_check_done(c->req->id, -1);
+		else
+			table_api_lookup_done(c->req->id, -1, NULL);
+		free(c->req->key);
+		free(c->req);
+		c->req = NULL;
+	}
+	if (c->idle) {
+		TAILQ_REMOVE(&idle, c, entry);
+		c->idle = 0;
+	}
+
+	if (c->res) {
+		PQclear(c->res);
+		c->res = NULL;
+	}
+	for (i = 0; i < SQL_MAX; i++) {
+		free(c->statements[i]);
+		c->statements[i] = NULL;
+	}
+	if (c->db) {
+		PQfinish(c->db);
+		c->db = NULL;
+	}
+}
+
+static void
+table_postgres_async_check(uint32_t id, int service, const char *key)
+{
+	table_postgres_async_request(id, service, key, 1);
+}
+
+static void
+table_postgres_async_lookup(uint32_t id, int service, const char *key)
+{
+	table_postgres_async_request(id, service, key, 0);
+}
+
+static void
+table_postgres_async_request(uint32_t id, int service, const char *key,
+    int check)
+{
+	struct pgreq	*req;
+
+	if ((req = calloc(1, sizeof(*req))) == NULL ||
+	    (req->key = strdup(key)) == NULL) {
+		log_warn("warn: table-postgres: calloc");
+		free(req);
+		if (check)
+			table_api_check_done(id, -1);
+		else
+			table_api_lookup_done(id, -1, NULL);
+		return;
+	}
+	req->id = id;
+	req->service = service;
+	req->check = check;
+	TAILQ_INSERT_TAIL(&pending, req, entry);
+
+	table_postgres_async_run();
+}
+
+static void
+table_postgres_async_run(void)
+{
+	struct pgconn	*c;
+	struct pgreq	*req;
+	const char	*key;
+	char		*stmt;
+	size_t		 i;
+	short		 ev;
+
+	while ((req = TAILQ_FIRST(&pending))) {
+		/* reconnect lost connections before giving up */
+		if (TAILQ_EMPTY(&idle))
+			for (i = 0; i < config->npool; i++)
+				if (config->pool[i].db == NULL &&
+				    pool_connect(config, &config->pool[i]))
+					break;
+		if ((c = TAILQ_FIRST(&idle)) == NULL) {
+			for (i = 0; i < config->npool; i++)
+				if (config->pool[i].req)
+					return;
+			/* nothing in flight, nothing will free up */
+			TAILQ_REMOVE(&pending, req, entry);
+			if (req->check)
+				table_api_check_done(req->id, -1);
+			else
+				table_api_lookup_done(req->id, -1, NULL);
+			free(req->key);
+			free(req);
+			continue;
+		}
+
+		TAILQ_REMOVE(&pending, req, entry);
+		TAILQ_REMOVE(&idle, c, entry);
+		c->idle = 0;
+		c->req = req;
+
+		stmt = NULL;
+		for (i = 0; i < SQL_MAX; i++)
+			if (req->service == 1 << i) {
+				stmt = c->statements[i];
+				break;
+			}
+		key = req->key;
+		if (stmt == NULL ||
+		    PQsendQueryPrepared(c->db, stmt, 1, &key, NULL, NULL, 0) == 0) {
+			if (stmt)
+				log_warnx("warn: table-postgres: "
+				    "PQsendQueryPrepared: %s",
+				    PQerrorMessage(c->db));
+			table_postgres_async_done(c, NULL);
+			continue;
+		}
+
+		ev = EV_READ;
+		if (PQflush(c->db) == 1)
+			ev |= EV_WRITE;
+		event_set(&c->ev, PQsocket(c->db), ev, table_postgres_async_io, c);
+		event_add(&c->ev, NULL);
+	}
+}
+
+static void
+table_postgres_async_io(int fd, short event, void *arg)
+{
+	struct pgconn	*c = arg;
+	PGresult	*res;
+	short		 ev;
+
+	if (event & EV_WRITE && PQflush(c->db) == -1)
+		goto fail;
+
+	if (PQconsumeInput(c->db) == 0)
+		goto fail;
+
+	while (! PQisBusy(c->db)) {
+		if ((res = PQgetResult(c->db)) == NULL) {
+			res = c->res;
+			c->res = NULL;
+			table_postgres_async_done(c, res);
+			table_postgres_async_run();
+			return;
+		}
+		if (c->res == NULL)
+			c->res = res;
+		else
+			PQclear(res);
+	}
+
+	ev = EV_READ;
+	if (PQflush(c->db) == 1)
+		ev |= EV_WRITE;
+	event_set(&c->ev, fd, ev, table_postgres_async_io, c);
+	event_add(&c->ev, NULL);
+	return;
+
+fail:
+	log_warnx("warn: table-postgres: connection lost: %s",
+	    PQerrorMessage(c->db));
+	pool_reset(c);
+	table_postgres_async_run();
+}
+
+/*
+ * Answer the request of a connection with its result, and make the
+ * connection idle again, or drop it if it is broken.
+ */
+static void
+table_postgres_async_done(struct pgconn *c, PGresult *res)
+{
+	struct pgreq	*req = c->req;
+	const char	*errfld;
+	char		 dst[4096];
+	int		 r;
+
+	c->req = NULL;
+	r = -1;
+	dst[0] = '\0';
+	if (res && PQresultStatus(res) == PGRES_TUPLES_OK) {
+		if (req->check)
+			r = (PQntuples(res) == 0) ? 0 : 1;
+		else
+			r = table_postgres_result(req->service, res, dst,
+			    sizeof(dst));
+	}
+	else if (res) {
+		log_warnx("warn: table-postgres: query: %s",
+		    PQresultErrorMessage(res));
+		errfld = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+		if (errfld && errfld[0] == '0' && errfld[1] == '8') {
+			PQfinish(c->db);
+			c->db = NULL;
+		}
+	}
+	if (res)
+		PQclear(res);
+
+	if (req->check)
+		table_api_check_done(req->id, r);
+	else
+		table_api_lookup_done(req->id, r, dst);
+	free(req->key);
+	free(req);
+
+	if (c->db && PQstatus(c->db) == CONNECTION_OK) {
+		TAILQ_INSERT_TAIL(&idle, c, entry);
+		c->idle = 1;
+	}
+	else
+		pool_reset(c);
+}
@@ -39,24 +39,48 @@
 struct table_proc_priv {
 	pid_t		pid;
 	struct imsgbuf	ibuf;
+	uint32_t	reqid;
+	struct tree	replies;
 };
 
-static struct imsg	 imsg;
-static size_t		 rlen;
-static char		*rdata;
+/* a reply read while waiting for another one */
+struct table_proc_reply {
+	size_t		len;
+	char		data[];
+};
+
+static struct imsg		 imsg;
+static struct table_proc_reply	*reply;
+static size_t			 rlen;
+static char			*rdata;
 
 extern char	**environ;
 
+static int table_proc_result(enum table_service, const char *,
+    union lookup *);
+
+/*
+ * Wait for the reply to request id.  The table may answer requests in
+ * any order, replies for other requests still in flight are kept until
+ * they are waited for.
+ */
 static void
-table_proc_call(struct table_proc_priv *p)
+table_proc_call(struct table_proc_priv *p, uint32_t id)
 {
 	ssize_t	n;
+	size_t	len;
 
 	if (imsg_flush(&p->ibuf) == -1) {
 		log_warn("warn: table-proc: imsg_flush");
 		fatalx("table-proc: exiting");
 	}
 
+	if ((reply = tree_pop(&p->replies, id)) != NULL) {
+		rlen = reply->len;
+		rdata = reply->data;
+		return;
+	}
+
 	while (1) {
 		if ((n = imsg_get(&p->ibuf, &imsg)) == -1) {
 			log_warn("warn: table-proc: imsg_get");
@@ -70,7 +94,21 @@ table_proc_call(struct table_proc_priv *p)
 				log_warnx("warn: table-proc: bad response");
 				break;
 			}
-			return;
+			if (imsg.hdr.peerid == id)
+				return;
+			if (imsg.hdr.peerid == 0 || imsg.hdr.peerid > p->reqid ||
+			    tree_check(&p->replies, imsg.hdr.peerid)) {
+				log_warnx("warn: table-proc: bad response id");
+				break;
+			}
+			len = rlen;
+			reply = xmalloc(sizeof(*reply) + len, "table_proc_call");
+			reply->len = len;
+			memmove(reply->data, rdata, len);
+			tree_xset(&p->replies, imsg.hdr.peerid, reply);
+			reply = NULL;
+			imsg_free(&imsg);
+			continue;
 		}
 
 		if ((n = imsg_read(&p->ibuf)) == -1) {
@@ -109,7 +147,11 @@ table_proc_end(void)
 		log_warnx("warn: table-proc: bogus data");
 		fatalx("table-proc: exiting");
 	}
-	imsg_free(&imsg);
+	if (reply) {
+		free(reply);
+		reply = NULL;
+	} else
+		imsg_free(&imsg);
 }
 
 /*
@@ -154,13 +196,15 @@ table_proc_open(struct table *table)
 	/* parent process */
 	close(sp[0]);
 	imsg_init(&priv->ibuf, sp[1]);
+	tree_init(&priv->replies);
 
 	memset(&op, 0, sizeof op);
 	op.version = PROC_TABLE_API_VERSION;
 	(void)strlcpy(op.name, table->t_name, sizeof op.name);
-	imsg_compose(&priv->ibuf, PROC_TABLE_OPEN, 0, 0, -1, &op, sizeof op);
+	imsg_compose(&priv->ibuf, PROC_TABLE_OPEN, ++priv->reqid, 0, -1, &op,
+	    sizeof op);
 
-	table_proc_call(priv);
+	table_proc_call(priv, priv->reqid);
 	table_proc_end();
 
 	return (priv);
@@ -177,9 +221,10 @@ table_proc_update(struct table *table)
 	struct table_proc_priv	*priv = table->t_handle;
 	int r;
 
-	imsg_compose(&priv->ibuf, PROC_TABLE_UPDATE, 0, 0, -1, NULL, 0);
+	imsg_compose(&priv->ibuf, PROC_TABLE_UPDATE, ++priv->reqid, 0, -1,
+	    NULL, 0);
 
-	table_proc_call(priv);
+	table_proc_call(priv, priv->reqid);
 	table_proc_read(&r, sizeof(r));
 	table_proc_end();
 
@@ -204,7 +249,7 @@ table_proc_lookup(void *arg, const char *k, enum table_service s,
 	int			 r;
 
 	buf = imsg_create(&priv->ibuf,
-	    lk ? PROC_TABLE_LOOKUP : PROC_TABLE_CHECK, 0, 0,
+	    lk ? PROC_TABLE_LOOKUP : PROC_TABLE_CHECK, ++priv->reqid, 0,
 	    sizeof(s) + strlen(k) + 1);
 
 	if (buf == NULL)
@@ -215,7 +260,63 @@ table_proc_lookup(void *arg, const char *k, enum table_service s,
 		return (-1);
 	imsg_close(&priv->ibuf, buf);
 
-	table_proc_call(priv);
+	table_proc_call(priv, priv->reqid);
+	return (table_proc_result(s, k, lk));
+}
+
+/*
+ * Send the keys in as few messages as fit, then collect one reply per
+ * key.  Key i of a message is answered with the message id plus i.
+ */
+static int
+table_proc_lookup_batch(void *arg, const char **keys, size_t n,
+    enum table_service s, union lookup *lks, int *res)
+{
+	struct table_proc_priv	*priv = arg;
+	struct ibuf		*buf;
+	size_t			 i, j, len;
+	uint32_t		 id, count;
+
+	for (i = 0; i < n; i = j) {
+		len = sizeof(s) + sizeof(count);
+		for (j = i; j < n; j++) {
+			if (len + strlen(keys[j]) + 1 >
+			    MAX_IMSGSIZE - IMSG_HEADER_SIZE && j > i)
+				break;
+			len += strlen(keys[j]) + 1;
+		}
+		count = j - i;
+		id = priv->reqid + 1;
+
+		buf = imsg_create(&priv->ibuf, lks ? PROC_TABLE_LOOKUP_BATCH :
+		    PROC_TABLE_CHECK_BATCH, id, 0, len);
+		if (buf == NULL)
+			return (-1);
+		if (imsg_add(buf, &s, sizeof(s)) == -1)
+			return (-1);
+		if (imsg_add(buf, &count, sizeof(count)) == -1)
+			return (-1);
+		for (j = i; j < i + count; j++)
+			if (imsg_add(buf, keys[j], strlen(keys[j]) + 1) == -1)
+				return (-1);
+		imsg_close(&priv->ibuf, buf);
+		priv->reqid += count;
+
+		for (j = i; j < i + count; j++) {
+			table_proc_call(priv, id + (j - i));
+			res[j] = table_proc_result(s, keys[j],
+			    lks ? &lks[j] : NULL);
+		}
+	}
+
+	return (0);
+}
+
+static int
+table_proc_result(enum table_service s, const char *k, union lookup *lk)
+{
+	int	r;
+
 	table_proc_read(&r, sizeof(r));
 
 	if (r == 1 && lk) {
@@ -243,14 +344,15 @@ table_proc_fetch(void *arg, enum table_service s, union lookup *lk)
 	struct ibuf		*buf;
 	int			 r;
 
-	buf = imsg_create(&priv->ibuf, PROC_TABLE_FETCH, 0, 0, sizeof(s));
+	buf = imsg_create(&priv->ibuf, PROC_TABLE_FETCH, ++priv->reqid, 0,
+	    sizeof(s));
 	if (buf == NULL)
 		return (-1);
 	if (imsg_add(buf, &s, sizeof(s)) == -1)
 		return (-1);
 	imsg_close(&priv->ibuf, buf);
 
-	table_proc_call(priv);
+	table_proc_call(priv, priv->reqid);
 	table_proc_read(&r, sizeof(r));
 
 	if (r == 1) {
@@ -271,6 +373,33 @@ table_proc_fetch(void *arg, enum table_service s, union lookup *lk)
 	return (r);
 }
 
+static int
+table_proc_store(void *arg, const char *k, enum table_service s,
+    const char *v)
+{
+	struct table_proc_priv	*priv = arg;
+	struct ibuf		*buf;
+	int			 r;
+
+	buf = imsg_create(&priv->ibuf, PROC_TABLE_STORE, ++priv->reqid, 0,
+	    sizeof(s) + strlen(k) + 1 + strlen(v) + 1);
+	if (buf == NULL)
+		return (-1);
+	if (imsg_add(buf, &s, sizeof(s)) == -1)
+		return (-1);
+	if (imsg_add(buf, k, strlen(k) + 1) == -1)
+		return (-1);
+	if (imsg_add(buf, v, strlen(v) + 1) == -1)
+		return (-1);
+	imsg_close(&priv->ibuf, buf);
+
+	table_proc_call(priv, priv->reqid);
+	table_proc_read(&r, sizeof(r));
+	table_proc_end();
+
+	return (r);
+}
+
 struct table_backend table_backend_proc = {
 	K_ANY,
 	NULL,
@@ -279,4 +408,6 @@ struct table_backend table_backend_proc = {
 	table_proc_close,
 	table_proc_lookup,
 	table_proc_fetch,
+	table_proc_lookup_batch,
+	table_proc_store,
 };
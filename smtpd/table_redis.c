@@ -20,6 +20,7 @@
 #include <sys/types.h>
 
 #include <ctype.h>
+#include <event.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +29,8 @@
 #include <unistd.h>
 
 #include <hiredis.h>
+#include <async.h>
+#include <adapters/libevent.h>
 
 #include "smtpd-defines.h"
 #include "smtpd-api.h"
@@ -42,22 +45,50 @@ enum {
 	SQL_SOURCE,
 	SQL_MAILADDR,
 	SQL_ADDRNAME,
+	SQL_MTASTATE,
 
 	SQL_MAX
 };
 
+/*
+ * With pool_size set in the config, lookups and checks are sent on a
+ * pool of asynchronous connections, pipelined and answered as the
+ * replies arrive.
+ */
 struct config {
 	struct dict	 conf;
 	redisContext    *db;
 	char		*statements[SQL_MAX];
+	char		*store_mtastate;
+	char		*host;
+	int		 port;
+	redisAsyncContext **pool;
+	size_t		 npool;
+	size_t		 next;
+};
+
+struct redisreq {
+	uint32_t	 id;
+	int		 service;
+	int		 check;
 };
 
 static int table_redis_update(void);
 static int table_redis_lookup(int, const char *, char *, size_t);
 static int table_redis_check(int, const char *);
 static int table_redis_fetch(int, char *, size_t);
+static int table_redis_store(int, const char *, const char *);
 
 static redisReply *table_redis_query(const char *key, int service);
+static int table_redis_check_reply(redisReply *);
+static int table_redis_result(int, redisReply *, char *, size_t);
+
+static void table_redis_async_check(uint32_t, int, const char *);
+static void table_redis_async_lookup(uint32_t, int, const char *);
+static void table_redis_async_request(uint32_t, int, const char *, int);
+static void table_redis_async_cb(redisAsyncContext *, void *, void *);
+static void table_redis_async_lost(const redisAsyncContext *, int);
+static int pool_connect(struct config *, size_t);
 
 static struct config 	*config_load(const char *);
 static void		 config_reset(struct config *);
@@ -66,6 +97,7 @@ static void		 config_free(struct config *);
 
 static char		*conffile;
 static struct config	*config;
+static struct event_base *evbase;
 
 int
 main(int argc, char **argv)
@@ -93,6 +125,8 @@ main(int argc, char **argv)
 
 	conffile = argv[0];
 
+	evbase = event_init();
+
 	config = config_load(conffile);
 	if (config == NULL) {
 		log_warnx("warn: table-redis: error parsing config file");
@@ -107,6 +141,11 @@ main(int argc, char **argv)
 	table_api_on_check(table_redis_check);
 	table_api_on_lookup(table_redis_lookup);
 	table_api_on_fetch(table_redis_fetch);
+	table_api_on_store(table_redis_store);
+	if (config->npool) {
+		table_api_on_async_check(table_redis_async_check);
+		table_api_on_async_lookup(table_redis_async_lookup);
+	}
 	table_api_dispatch();
 
 	return (0);
@@ -202,18 +241,28 @@ end:
 static void
 config_reset(struct config *conf)
 {
-	size_t	i;
+	redisAsyncContext	*ac;
+	size_t			 i;
 
 	for (i = 0; i < SQL_MAX; i++)
 		if (conf->statements[i]) {
 			free(conf->statements[i]);
 			conf->statements[i] = NULL;
 		}
+	free(conf->store_mtastate);
+	conf->store_mtastate = NULL;
 
 	if (conf->db) {
 		redisFree(conf->db);
 		conf->db = NULL;
 	}
+
+	/* pending callbacks are called with no reply */
+	for (i = 0; i < conf->npool; i++)
+		if ((ac = conf->pool[i])) {
+			conf->pool[i] = NULL;
+			redisAsyncFree(ac);
+		}
 }
 
 static int
@@ -231,6 +280,7 @@ config_connect(struct config *conf)
 		{ "query_source",	"GET source:%s" },
 		{ "query_mailaddr",	"GET mailaddr:%s" },
 		{ "query_addrname",	"GET addrname:%s" },
+		{ "query_mtastate",	"GET mtastate:%s" },
 	};
 	size_t	 i;
 
@@ -264,6 +314,24 @@ config_connect(struct config *conf)
 		port = ll;
 	}
 
+	if ((value = dict_get(&conf->conf, "pool_size")) && conf->pool == NULL) {
+		e = NULL;
+		ll = strtonum(value, 1, 64, &e);
+		if (e) {
+			log_warnx("warn: table-redis: bad value for pool_size: %s", e);
+			goto end;
+		}
+		conf->npool = ll;
+		conf->pool = calloc(conf->npool, sizeof(*conf->pool));
+		if (conf->pool == NULL) {
+			log_warn("warn: table-redis: calloc");
+			conf->npool = 0;
+			goto end;
+		}
+	}
+	conf->host = host;
+	conf->port = port;
+
 	conf->db = redisConnect(host, port);
 	if (conf->db == NULL) {
 		log_warnx("warn: table-redis: redisConnect return NULL");
@@ -277,6 +345,13 @@ config_connect(struct config *conf)
 		else
 			conf->statements[i] = strdup(qspec[i].default_query);
 	}
+	/* the entries expire if no node refreshes them */
+	q = dict_get(&conf->conf, "store_mtastate");
+	conf->store_mtastate = strdup(q ? q : "SET mtastate:%s %s EX 600");
+
+	for (i = 0; i < conf->npool; i++)
+		if (! pool_connect(conf, i))
+			goto end;
 
 	log_debug("debug: table-redis: connected");
 
@@ -297,6 +372,7 @@ config_free(struct config *conf)
 	while (dict_poproot(&conf->conf, &value))
 		free(value);
 
+	free(conf->pool);
 	free(conf);
 }
 
@@ -371,6 +447,17 @@ table_redis_check(int service, const char *key)
 	if (reply == NULL)
 		return (-1);
 
+	r = table_redis_check_reply(reply);
+	freeReplyObject(reply);
+
+	return (r);
+}
+
+static int
+table_redis_check_reply(redisReply *reply)
+{
+	int		 r;
+
 	switch (reply->type) {
 		case REDIS_REPLY_INTEGER:
 		case REDIS_REPLY_STRING:
@@ -389,16 +476,13 @@ table_redis_check(int service, const char *key)
 			break;
 	}
 
-	freeReplyObject(reply);
-
 	return (r);
 }
 
 static int
 table_redis_lookup(int service, const char *key, char *dst, size_t sz)
 {
-	redisReply	*reply, *elmt;
-	unsigned int	i;
+	redisReply	*reply;
 	int		r;
 
 	if (config->db == NULL && config_connect(config) == 0)
@@ -408,6 +492,19 @@ table_redis_lookup(int service, const char *key, char *dst, size_t sz)
 	if (reply == NULL)
 		return (-1);
 
+	r = table_redis_result(service, reply, dst, sz);
+	freeReplyObject(reply);
+
+	return (r);
+}
+
+static int
+table_redis_result(int service, redisReply *reply, char *dst, size_t sz)
+{
+	redisReply	*elmt;
+	unsigned int	i;
+	int		r;
+
 	r = 1;
 	switch(service) {
 	case K_ALIAS:
@@ -461,14 +558,25 @@ table_redis_lookup(int service, const char *key, char *dst, size_t sz)
 		else
 			r = -1;
 		break;
+	case K_MTASTATE:
+		/* no state is no news */
+		if (reply->type == REDIS_REPLY_NIL)
+			r = 0;
+		else if (reply->type == REDIS_REPLY_STRING) {
+			if (strlcpy(dst, reply->str, sz) >= sz) {
+				log_warnx("warn: table-redis: result too large");
+				r = -1;
+			}
+		}
+		else
+			r = -1;
+		break;
 	default:
 		log_warnx("warn: table-redis: unknown service %d",
 		    service);
 		r = -1;
 	}
 
-end:
-	freeReplyObject(reply);
 	return (r);
 }
 
@@ -477,3 +585,138 @@ table_redis_fetch(int service, char *dst, size_t sz)
 {
 	return (-1);
 }
+
+static int
+table_redis_store(int service, const char *key, const char *value)
+{
+	redisReply	*reply;
+	int		 r;
+
+	if (service != K_MTASTATE || config->store_mtastate == NULL)
+		return (-1);
+	if (config->db == NULL && config_connect(config) == 0)
+		return (-1);
+
+	reply = redisCommand(config->db, config->store_mtastate, key, value);
+	if (reply == NULL) {
+		log_warnx("warn: table-redis: redisCommand: %s",
+		    config->db->errstr);
+		config_connect(config);
+		return (-1);
+	}
+	r = (reply->type == REDIS_REPLY_ERROR) ? -1 : 1;
+	freeReplyObject(reply);
+
+	return (r);
+}
+
+static int
+pool_connect(struct config *conf, size_t i)
+{
+	redisAsyncContext	*ac;
+
+	ac = redisAsyncConnect(conf->host, conf->port);
+	if (ac == NULL || ac->err) {
+		log_warnx("warn: table-redis: redisAsyncConnect: %s",
+		    ac ? ac->errstr : "NULL");
+		if (ac)
+			redisAsyncFree(ac);
+		return (0);
+	}
+	ac->data = conf;
+	redisLibeventAttach(ac, evbase);
+	redisAsyncSetDisconnectCallback(ac, table_redis_async_lost);
+	conf->pool[i] = ac;
+
+	return (1);
+}
+
+static void
+table_redis_async_lost(const redisAsyncContext *ac, int status)
+{
+	struct config	*conf = ac->data;
+	size_t		 i;
+
+	if (status != REDIS_OK)
+		log_warnx("warn: table-redis: connection lost: %s", ac->errstr);
+
+	/* hiredis frees the context */
+	for (i = 0; i < conf->npool; i++)
+		if (conf->pool[i] == ac)
+			conf->pool[i] = NULL;
+}
+
+static void
+table_redis_async_check(uint32_t id, int service, const char *key)
+{
+	table_redis_async_request(id, service, key, 1);
+}
+
+static void
+table_redis_async_lookup(uint32_t id, int service, const char *key)
+{
+	table_redis_async_request(id, service, key, 0);
+}
+
+static void
+table_redis_async_request(uint32_t id, int service, const char *key,
+    int check)
+{
+	struct redisreq	*req;
+	char		*stmt;
+	size_t		 i;
+
+	stmt = NULL;
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i) {
+			stmt = config->statements[i];
+			break;
+		}
+
+	/* spread the requests, reconnecting lost connections */
+	i = config->next++ % config->npool;
+	if (stmt == NULL ||
+	    (config->pool[i] == NULL && ! pool_connect(config, i)) ||
+	    (req = calloc(1, sizeof(*req))) == NULL)
+		goto fail;
+
+	req->id = id;
+	req->service = service;
+	req->check = check;
+	if (redisAsyncCommand(config->pool[i], table_redis_async_cb, req, stmt,
+	    key) != REDIS_OK) {
+		log_warnx("warn: table-redis: redisAsyncCommand failed");
+		free(req);
+		goto fail;
+	}
+	return;
+
+fail:
+	if (check)
+		table_api_check_done(id, -1);
+	else
+		table_api_lookup_done(id, -1, NULL);
+}
+
+static void
+table_redis_async_cb(redisAsyncContext *ac, void *r, void *arg)
+{
+	struct redisreq	*req = arg;
+	redisReply	*reply = r;
+	char		 dst[4096];
+	int		 ret;
+
+	dst[0] = '\0';
+	if (reply == NULL)
+		ret = -1;
+	else if (req->check)
+		ret = table_redis_check_reply(reply);
+	else
+		ret = table_redis_result(req->service, reply, dst, sizeof(dst));
+
+	if (req->check)
+		table_api_check_done(req->id, ret);
+	else
+		table_api_lookup_done(req->id, ret, dst);
+	free(req);
+}
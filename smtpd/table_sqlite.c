@@ -53,9 +53,28 @@ static sqlite3_stmt *table_sqlite_query(const char *, int);
 
 #define	DEFAULT_EXPIRE	60
 #define	DEFAULT_REFRESH	1000
+#define	DEFAULT_MMAP	(64 * 1024 * 1024)
+
+/*
+ * The database is opened read-only with the statements of all services
+ * prepared once.  Data changes are seen by the next lookup, so an
+ * update only reopens the database if the path, the queries or the
+ * mapping size changed in the config.
+ */
+struct dbconf {
+	char		*path;
+	char		*queries[SQL_MAX];
+	char		*query_fetch_source;
+	long long	 mmap_size;
+};
+
+static void dbconf_free(struct dbconf *);
+static int dbconf_same(struct dbconf *, struct dbconf *);
+static int dbstrcmp(const char *, const char *);
 
 static char		*config;
 static sqlite3		*db;
+static struct dbconf	 dbconf;
 static sqlite3_stmt	*statements[SQL_MAX];
 static sqlite3_stmt	*stmt_fetch_source;
 static struct dict	 sources;
@@ -162,22 +181,22 @@ table_sqlite_update(void)
 	sqlite3		*_db;
 	sqlite3_stmt	*_statements[SQL_MAX];
 	sqlite3_stmt	*_stmt_fetch_source;
-	char		*_query_fetch_source;
-	char		*queries[SQL_MAX];
+	sqlite3_stmt	*stmt;
+	struct dbconf	 conf;
 	size_t		 flen;
 	size_t		 _source_refresh;
 	int		 _source_expire;
 	FILE		*fp;
-	char		*key, *value, *buf, *lbuf, *dbpath;
-	const char	*e;
+	char		*key, *value, *buf, *lbuf;
+	char		 pragma[64];
+	const char	*e, *mode;
 	int		 i, ret;
 	long long	 ll;
 
-	dbpath = NULL;
 	_db = NULL;
-	memset(queries, 0, sizeof(queries));
+	memset(&conf, 0, sizeof(conf));
+	conf.mmap_size = DEFAULT_MMAP;
 	memset(_statements, 0, sizeof(_statements));
-	_query_fetch_source = NULL;
 	_stmt_fetch_source = NULL;
 
 	_source_refresh = DEFAULT_REFRESH;
@@ -230,12 +249,13 @@ table_sqlite_update(void)
 		}
 
 		if (!strcmp("dbpath", key)) {
-			if (table_sqlite_getconfstr(key, value, &dbpath) == -1)
+			if (table_sqlite_getconfstr(key, value, &conf.path) == -1)
 				goto end;
 			continue;
 		}
 		if (!strcmp("fetch_source", key)) {
-			if (table_sqlite_getconfstr(key, value, &_query_fetch_source) == -1)
+			if (table_sqlite_getconfstr(key, value,
+			    &conf.query_fetch_source) == -1)
 				goto end;
 			continue;
 		}
@@ -259,6 +279,16 @@ table_sqlite_update(void)
 			_source_refresh = ll;
 			continue;
 		}
+		if (!strcmp("mmap_size", key)) {
+			e = NULL;
+			ll = strtonum(value, 0, LLONG_MAX, &e);
+			if (e) {
+				log_warnx("warn: table-sqlite: bad value for %s: %s", key, e);
+				goto end;
+			}
+			conf.mmap_size = ll;
+			continue;
+		}
 
 		for(i = 0; i < SQL_MAX; i++)
 			if (!strcmp(qspec[i].name, key))
@@ -268,37 +298,63 @@ table_sqlite_update(void)
 			continue;
 		}
 
-		if (queries[i]) {
+		if (conf.queries[i]) {
 			log_warnx("warn: table-sqlite: duplicate key %s", key);
 			continue;
 		}
 
-		queries[i] = strdup(value);
-		if (queries[i] == NULL) {
+		conf.queries[i] = strdup(value);
+		if (conf.queries[i] == NULL) {
 			log_warnx("warn: table-sqlite: strdup");
 			goto end;
 		}
 	}
 
+	/* Keep the db if it would be opened and prepared the same */
+
+	if (db && dbconf_same(&conf, &dbconf)) {
+		log_debug("debug: table-sqlite: keeping %s", conf.path);
+		goto done;
+	}
+
 	/* Setup db */
 
-	log_debug("debug: table-sqlite: opening %s", dbpath);
+	log_debug("debug: table-sqlite: opening %s", conf.path);
 
-	if (sqlite3_open(dbpath, &_db) != SQLITE_OK) {
+	if (sqlite3_open_v2(conf.path, &_db, SQLITE_OPEN_READONLY, NULL)
+	    != SQLITE_OK) {
 		log_warnx("warn: table-sqlite: open: %s",
 		    sqlite3_errmsg(_db));
 		goto end;
 	}
 
+	(void)snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size=%lld",
+	    conf.mmap_size);
+	if (sqlite3_exec(_db, pragma, NULL, NULL, NULL) != SQLITE_OK)
+		log_warnx("warn: table-sqlite: %s: %s", pragma,
+		    sqlite3_errmsg(_db));
+
+	/* the journal mode belongs to the database, writers must set it */
+	if (sqlite3_prepare_v2(_db, "PRAGMA journal_mode", -1, &stmt, NULL)
+	    == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW &&
+		    (mode = sqlite3_column_text(stmt, 0)) &&
+		    strcasecmp(mode, "wal") != 0)
+			log_info("info: table-sqlite: %s is in %s journal mode, "
+			    "lookups wait for writers unless it is WAL",
+			    conf.path, mode);
+		sqlite3_finalize(stmt);
+	}
+
 	for (i = 0; i < SQL_MAX; i++) {
-		if (queries[i] == NULL)
+		if (conf.queries[i] == NULL)
 			continue;
-		if ((_statements[i] = table_sqlite_prepare_stmt(_db, queries[i], qspec[i].cols)) == NULL)
+		if ((_statements[i] = table_sqlite_prepare_stmt(_db, conf.queries[i], qspec[i].cols)) == NULL)
 			goto end;
 	}
 
-	if (_query_fetch_source &&
-	    (_stmt_fetch_source = table_sqlite_prepare_stmt(_db, _query_fetch_source, 1)) == NULL)
+	if (conf.query_fetch_source &&
+	    (_stmt_fetch_source = table_sqlite_prepare_stmt(_db, conf.query_fetch_source, 1)) == NULL)
 		goto end;
 
 	/* Replace previous setup */
@@ -315,10 +371,15 @@ table_sqlite_update(void)
 	_stmt_fetch_source = NULL;
 
 	if (db)
-		sqlite3_close(_db);
+		sqlite3_close(db);
 	db = _db;
 	_db = NULL;
 
+	dbconf_free(&dbconf);
+	dbconf = conf;
+	memset(&conf, 0, sizeof(conf));
+
+    done:
 	source_update = 0; /* force update */
 	source_expire = _source_expire;
 	source_refresh = _source_refresh;
@@ -329,22 +390,56 @@ table_sqlite_update(void)
     end:
 
 	/* Cleanup */
-	for (i = 0; i < SQL_MAX; i++) {
+	for (i = 0; i < SQL_MAX; i++)
 		if (_statements[i])
 			sqlite3_finalize(_statements[i]);
-		free(queries[i]);
-	}
+	if (_stmt_fetch_source)
+		sqlite3_finalize(_stmt_fetch_source);
 	if (_db)
 		sqlite3_close(_db);
 
-	free(dbpath);
-	free(_query_fetch_source);
+	dbconf_free(&conf);
 
 	free(lbuf);
 	fclose(fp);
 	return (ret);
 }
 
+static void
+dbconf_free(struct dbconf *c)
+{
+	int	i;
+
+	free(c->path);
+	for (i = 0; i < SQL_MAX; i++)
+		free(c->queries[i]);
+	free(c->query_fetch_source);
+	memset(c, 0, sizeof(*c));
+}
+
+static int
+dbstrcmp(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a != b);
+	return (strcmp(a, b));
+}
+
+static int
+dbconf_same(struct dbconf *a, struct dbconf *b)
+{
+	int	i;
+
+	if (dbstrcmp(a->path, b->path) ||
+	    dbstrcmp(a->query_fetch_source, b->query_fetch_source) ||
+	    a->mmap_size != b->mmap_size)
+		return (0);
+	for (i = 0; i < SQL_MAX; i++)
+		if (dbstrcmp(a->queries[i], b->queries[i]))
+			return (0);
+	return (1);
+}
+
 static sqlite3_stmt *
 table_sqlite_query(const char *key, int service)
 {
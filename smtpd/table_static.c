@@ -21,18 +21,22 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <event.h>
 #include <fcntl.h>
 #include <imsg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "smtpd.h"
 #include "log.h"
@@ -46,6 +50,77 @@ static int table_static_lookup(void *, const char *, enum table_service,
 static int table_static_fetch(void *, enum table_service, union lookup *);
 static void  table_static_close(void *);
 static int table_static_parse(struct table *, const char *, enum table_type);
+static int table_static_load(struct table *, const char *);
+static int table_static_read(struct table *, char **, enum table_type, size_t);
+
+/*
+ * Matching lookups are answered from indexes built over the table keys
+ * on first use: a path-compressed binary trie for networks, and for
+ * domain patterns a dict of exact names plus a dict of the suffixes of
+ * "*.suffix" patterns, which only ever cover a single label.  Patterns
+ * with other wildcards are few and still scanned.  When several keys
+ * match, the smallest one wins, as it did with the linear dict scan.
+ */
+struct static_net {
+	struct static_net	*child[2];
+	const char		*key;
+	uint8_t			 addr[16];
+	int			 bits;
+};
+
+struct static_dom {
+	TAILQ_ENTRY(static_dom)	 entry;
+	char			*pattern;	/* in other only */
+	const char		*any;	/* key with no user part */
+	struct dict		 users;	/* user -> key */
+};
+
+struct static_domidx {
+	struct dict		 exact;
+	struct dict		 wild;
+	struct static_dom	*all;
+	TAILQ_HEAD(, static_dom) other;
+};
+
+/*
+ * An update loads the new version of the file into a scratch table and
+ * parses it a few thousand lines at a time, swaps the dicts when it is
+ * complete, then frees the former entries the same way, so that lookups
+ * go on between the steps.
+ */
+#define	STATIC_UPDATE_STEP	10000
+
+struct static_update {
+	struct table		*table;
+	char			*pos;	/* next line to parse */
+};
+
+struct table_static_priv {
+	struct table		*table;
+	struct static_net	*net[2];
+	int			 hasnet;
+	struct static_domidx	*domain;
+	struct static_domidx	*mailaddr;
+	struct static_update	*update;
+};
+
+static void static_index_free(struct table_static_priv *);
+static void static_net_build(struct table_static_priv *);
+static void static_net_insert(struct static_net **, const uint8_t *, int,
+    const char *);
+static const char *static_net_lookup(struct table_static_priv *,
+    const char *);
+static void static_net_free(struct static_net *);
+static int static_net_parse(const char *, uint8_t *, int *, int *, int);
+static struct static_domidx *static_dom_build(struct table *, int);
+static struct static_dom *static_dom_get(struct static_domidx *,
+    const char *);
+static const char *static_dom_lookup(struct static_domidx *, const char *,
+    const char *);
+static void static_dom_match(struct static_dom *, const char *,
+    const char **);
+static void static_dom_free(struct static_domidx *);
+static void static_best(const char **, const char *);
 
 struct table_backend table_backend_static = {
 	K_ALIAS|K_CREDENTIALS|K_DOMAIN|K_NETADDR|K_USERINFO|K_SOURCE|K_MAILADDR|K_ADDRNAME,
@@ -57,14 +132,6 @@ struct table_backend table_backend_static = {
 	table_static_fetch
 };
 
-static struct keycmp {
-	enum table_service	service;
-	int		       (*func)(const char *, const char *);
-} keycmp[] = {
-	{ K_DOMAIN, table_domain_match },
-	{ K_NETADDR, table_netaddr_match },
-	{ K_MAILADDR, table_mailaddr_match }
-};
 
 
 static int
@@ -80,27 +147,81 @@ table_static_config(struct table *table)
 static int
 table_static_parse(struct table *t, const char *config, enum table_type type)
 {
-	FILE	*fp;
-	char	*buf, *lbuf;
-	size_t	 flen;
-	char	*keyp;
-	char	*valp;
-	size_t	 ret = 0;
+	char	*pos;
 
-	fp = fopen(config, "r");
-	if (fp == NULL)
+	if (! table_static_load(t, config))
 		return 0;
+	pos = t->t_arena;
+	return table_static_read(t, &pos, type, 0);
+}
+
+/*
+ * Read the whole file in one go.  It is parsed in place: the values
+ * point inside the buffer, which becomes the arena of the table.
+ */
+static int
+table_static_load(struct table *t, const char *path)
+{
+	struct stat	 sb;
+	char		*buf;
+	size_t		 len;
+	ssize_t		 n;
+	int		 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	if (fstat(fd, &sb) == -1 || sb.st_size < 0 ||
+	    (uintmax_t)sb.st_size >= SIZE_MAX) {
+		close(fd);
+		return 0;
+	}
+
+	buf = xmalloc(sb.st_size + 1, "table_static_load");
+	for (len = 0; len < (size_t)sb.st_size; len += n) {
+		n = read(fd, buf + len, sb.st_size - len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			free(buf);
+			close(fd);
+			return 0;
+		}
+		if (n == 0)
+			break;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	free(t->t_arena);
+	t->t_arena = buf;
+	t->t_arenalen = len + 1;
+	return 1;
+}
+
+/*
+ * Parse at most max lines from *pos, or all of them if max is 0.  Return
+ * 1 at the end of the arena, 0 on error, or -1 if there are lines left.
+ */
+static int
+table_static_read(struct table *t, char **pos, enum table_type type,
+    size_t max)
+{
+	char	*buf, *end, *nl;
+	size_t	 n;
+	char	*keyp;
+	char	*valp;
 
-	lbuf = NULL;
-	while ((buf = fgetln(fp, &flen))) {
-		if (buf[flen - 1] == '\n')
-			buf[flen - 1] = '\0';
-		else {
-			lbuf = xmalloc(flen + 1, "table_config_parse");
-			memcpy(lbuf, buf, flen);
-			lbuf[flen] = '\0';
-			buf = lbuf;
+	end = t->t_arena + t->t_arenalen - 1;
+	n = 0;
+	while ((buf = *pos) < end) {
+		if ((nl = memchr(buf, '\n', end - buf)) != NULL) {
+			*nl = '\0';
+			*pos = nl + 1;
 		}
+		else
+			*pos = end;
 
 		keyp = buf;
 		while (isspace((unsigned char)*keyp))
@@ -126,52 +247,104 @@ table_static_parse(struct table *t, const char *config, enum table_type type)
 			    T_HASH;
 
 		if (!(t->t_type & type))
-			goto end;
+			return 0;
 
 		if ((valp == keyp || valp == NULL) && t->t_type == T_LIST)
-			table_add(t, keyp, NULL);
+			table_add_nocopy(t, keyp, NULL);
 		else if ((valp != keyp && valp != NULL) && t->t_type == T_HASH)
-			table_add(t, keyp, valp);
+			table_add_nocopy(t, keyp, valp);
 		else
-			goto end;
+			return 0;
+
+		if (max && ++n == max)
+			return -1;
 	}
 	/* Accept empty alias files; treat them as hashes */
 	if (t->t_type == T_NONE && t->t_backend->services & K_ALIAS)
 	    t->t_type = T_HASH;
 
-	ret = 1;
-end:
-	free(lbuf);
-	fclose(fp);
-	return ret;
+	/* the keys are copied in the dict, lists need nothing more */
+	if (t->t_type != T_HASH) {
+		free(t->t_arena);
+		t->t_arena = NULL;
+		t->t_arenalen = 0;
+	}
+	return 1;
 }
 
 static int
 table_static_update(struct table *table)
 {
-	struct table	*t;
-	void		*p = NULL;
+	struct table_static_priv	*priv = table->t_handle;
+	struct static_update		*u;
+	struct dict			 d;
+	void				*p = NULL;
+	char				*arena;
+	size_t				 n, len;
+	int				 r;
 
 	/* no config ? ok */
 	if (table->t_config[0] == '\0')
 		goto ok;
 
-	t = table_create("static", table->t_name, "update", table->t_config);
-	if (!table_config(t))
-		goto err;
+	if ((u = priv->update) == NULL) {
+		u = xcalloc(1, sizeof *u, "table_static_update");
+		u->table = table_create("static", table->t_name, "update",
+		    table->t_config);
+		priv->update = u;
+		if (! table_static_load(u->table, table->t_config))
+			goto err;
+		u->pos = u->table->t_arena;
+	}
+
+	if (u->pos) {
+		r = table_static_read(u->table, &u->pos, T_LIST|T_HASH,
+		    STATIC_UPDATE_STEP);
+		if (r == -1)
+			return TABLE_UPDATE_AGAIN;
+		u->pos = NULL;
+		if (r == 0)
+			goto err;
+
+		/* the indexes point to the keys being replaced */
+		static_index_free(priv);
+
+		d = table->t_dict;
+		table->t_dict = u->table->t_dict;
+		u->table->t_dict = d;
+		arena = table->t_arena;
+		table->t_arena = u->table->t_arena;
+		u->table->t_arena = arena;
+		len = table->t_arenalen;
+		table->t_arenalen = u->table->t_arenalen;
+		u->table->t_arenalen = len;
+		table->t_iter = NULL;
+		log_info("info: Table \"%s\" successfully updated",
+		    table->t_name);
+	}
+
+	/* free the former entries */
+	for (n = 0; n < STATIC_UPDATE_STEP; n++) {
+		if (! dict_poproot(&u->table->t_dict, (void **)&p))
+			break;
+		table_free_value(u->table, p);
+	}
+	if (n == STATIC_UPDATE_STEP)
+		return TABLE_UPDATE_AGAIN;
 
-	/* replace former table, frees t */
-	while (dict_poproot(&table->t_dict, (void **)&p))
-		free(p);
-	dict_merge(&table->t_dict, &t->t_dict);
-	table_destroy(t);
+	table_destroy(u->table);
+	free(u);
+	priv->update = NULL;
+	return 1;
 
 ok:
 	log_info("info: Table \"%s\" successfully updated", table->t_name);
 	return 1;
 
 err:
-	table_destroy(t);
+	table_destroy(u->table);
+	free(u);
+	priv->update = NULL;
 	log_info("info: Failed to update table \"%s\"", table->t_name);
 	return 0;
 }
@@ -179,50 +352,66 @@ err:
 static void *
 table_static_open(struct table *table)
 {
-	return table;
+	struct table_static_priv	*priv;
+
+	priv = xcalloc(1, sizeof *priv, "table_static_open");
+	priv->table = table;
+	return priv;
 }
 
 static void
 table_static_close(void *hdl)
 {
-	return;
+	struct table_static_priv	*priv = hdl;
+
+	if (priv->update) {
+		table_destroy(priv->update->table);
+		free(priv->update);
+	}
+	static_index_free(priv);
+	free(priv);
 }
 
 static int
 table_static_lookup(void *hdl, const char *key, enum table_service service,
     union lookup *lk)
 {
-	struct table   *m  = hdl;
-	char	       *line;
-	int		ret;
-	int	       (*match)(const char *, const char *) = NULL;
-	size_t		i;
-	void	       *iter;
-	const char     *k;
-	char	       *v;
-
-	for (i = 0; i < nitems(keycmp); ++i)
-		if (keycmp[i].service == service)
-			match = keycmp[i].func;
+	struct table_static_priv	*priv = hdl;
+	struct table			*m = priv->table;
+	struct mailaddr			 maddr;
+	char				*line;
+	int				 ret;
+	const char			*k;
 
 	line = NULL;
-	iter = NULL;
+	k = NULL;
 	ret = 0;
-	while (dict_iter(&m->t_dict, &iter, &k, (void **)&v)) {
-		if (match) {
-			if (match(key, k)) {
-				line = v;
-				ret = 1;
-			}
-		}
-		else {
-			if (strcmp(key, k) == 0) {
-				line = v;
-				ret = 1;
-			}
-		}
-		if (ret)
-			break;
+	switch (service) {
+	case K_NETADDR:
+		if (! priv->hasnet)
+			static_net_build(priv);
+		k = static_net_lookup(priv, key);
+		break;
+	case K_DOMAIN:
+		if (priv->domain == NULL)
+			priv->domain = static_dom_build(m, 0);
+		k = static_dom_lookup(priv->domain, key, NULL);
+		break;
+	case K_MAILADDR:
+		if (priv->mailaddr == NULL)
+			priv->mailaddr = static_dom_build(m, 1);
+		if (text_to_mailaddr(&maddr, key))
+			k = static_dom_lookup(priv->mailaddr, maddr.domain,
+			    maddr.user);
+		break;
+	default:
+		if (dict_check(&m->t_dict, key))
+			k = key;
+		break;
+	}
+	if (k) {
+		line = dict_get(&m->t_dict, k);
+		ret = 1;
 	}
 
 	if (lk == NULL)
@@ -237,17 +426,317 @@ table_static_lookup(void *hdl, const char *key, enum table_service service,
 static int
 table_static_fetch(void *hdl, enum table_service service, union lookup *lk)
 {
-	struct table   *t = hdl;
+	struct table_static_priv	*priv = hdl;
+	struct table			*t = priv->table;
 	const char     *k;
+	char	       *v, line[SMTPD_MAXLINESIZE];
 
-	if (! dict_iter(&t->t_dict, &t->t_iter, &k, (void **)NULL)) {
+	if (! dict_iter(&t->t_dict, &t->t_iter, &k, (void **)&v)) {
 		t->t_iter = NULL;
-		if (! dict_iter(&t->t_dict, &t->t_iter, &k, (void **)NULL))
+		if (! dict_iter(&t->t_dict, &t->t_iter, &k, (void **)&v))
 			return 0;
 	}
 
 	if (lk == NULL)
 		return 1;
 
+	/* in a mapping, the value of a source address is its weight */
+	if (service == K_SOURCE && v) {
+		if (!bsnprintf(line, sizeof line, "%s %s", k, v))
+			return (-1);
+		k = line;
+	}
+
 	return table_parse_lookup(service, NULL, k, lk);
 }
+
+static void
+static_index_free(struct table_static_priv *priv)
+{
+	static_net_free(priv->net[0]);
+	static_net_free(priv->net[1]);
+	priv->net[0] = priv->net[1] = NULL;
+	priv->hasnet = 0;
+	if (priv->domain)
+		static_dom_free(priv->domain);
+	if (priv->mailaddr)
+		static_dom_free(priv->mailaddr);
+	priv->domain = priv->mailaddr = NULL;
+}
+
+static void
+static_best(const char **best, const char *key)
+{
+	if (key && (*best == NULL || strcmp(key, *best) < 0))
+		*best = key;
+}
+
+static int
+static_net_parse(const char *s, uint8_t *addr, int *bits, int *family,
+    int mask)
+{
+	struct netaddr	 n;
+	int		 i;
+
+	if (! text_to_netaddr(&n, s))
+		return (0);
+
+	memset(addr, 0, 16);
+	if (n.ss.ss_family == AF_INET) {
+		memcpy(addr, &((struct sockaddr_in *)&n.ss)->sin_addr, 4);
+		*family = 0;
+	}
+	else if (n.ss.ss_family == AF_INET6) {
+		memcpy(addr, &((struct sockaddr_in6 *)&n.ss)->sin6_addr, 16);
+		*family = 1;
+	}
+	else
+		return (0);
+
+	*bits = n.bits;
+	if (*bits < 0 || *bits > (*family ? 128 : 32))
+		return (0);
+
+	/* clear the host part */
+	if (mask)
+		for (i = *bits; i < 128; i++)
+			addr[i / 8] &= ~(0x80 >> (i % 8));
+
+	return (1);
+}
+
+#define	NET_BIT(a, i)	(((a)[(i) / 8] >> (7 - (i) % 8)) & 1)
+
+static void
+static_net_build(struct table_static_priv *priv)
+{
+	void		*iter;
+	const char	*k;
+	uint8_t		 addr[16];
+	int		 bits, family;
+
+	iter = NULL;
+	while (dict_iter(&priv->table->t_dict, &iter, &k, NULL))
+		if (static_net_parse(k, addr, &bits, &family, 1))
+			static_net_insert(&priv->net[family], addr, bits, k);
+	priv->hasnet = 1;
+}
+
+static void
+static_net_insert(struct static_net **np, const uint8_t *addr, int bits,
+    const char *key)
+{
+	struct static_net	*n, *x, *glue;
+	int			 i;
+
+	while ((n = *np)) {
+		for (i = 0; i < bits && i < n->bits; i++)
+			if (NET_BIT(addr, i) != NET_BIT(n->addr, i))
+				break;
+		if (i < n->bits)
+			break;
+		if (i == bits) {
+			static_best(&n->key, key);
+			return;
+		}
+		np = &n->child[NET_BIT(addr, i)];
+	}
+
+	x = xcalloc(1, sizeof *x, "static_net_insert");
+	memcpy(x->addr, addr, sizeof x->addr);
+	x->bits = bits;
+	x->key = key;
+
+	if (n == NULL)
+		*np = x;
+	else if (i == bits) {
+		/* the new network covers the existing node */
+		x->child[NET_BIT(n->addr, i)] = n;
+		*np = x;
+	}
+	else {
+		/* both diverge at bit i */
+		glue = xcalloc(1, sizeof *glue, "static_net_insert");
+		memcpy(glue->addr, addr, sizeof glue->addr);
+		glue->bits = i;
+		glue->child[NET_BIT(n->addr, i)] = n;
+		glue->child[NET_BIT(addr, i)] = x;
+		*np = glue;
+	}
+}
+
+static const char *
+static_net_lookup(struct table_static_priv *priv, const char *key)
+{
+	struct static_net	*n;
+	const char		*best = NULL;
+	uint8_t			 addr[16];
+	int			 bits, family, width, i;
+
+	/* keys are also matched verbatim */
+	if (dict_check(&priv->table->t_dict, key))
+		best = key;
+
+	if (! static_net_parse(key, addr, &bits, &family, 0))
+		return (best);
+
+	/* only the bits of the table entry are compared */
+	width = family ? 128 : 32;
+	for (n = priv->net[family]; n; n = n->child[NET_BIT(addr, n->bits)]) {
+		for (i = 0; i < n->bits; i++)
+			if (NET_BIT(addr, i) != NET_BIT(n->addr, i))
+				return (best);
+		static_best(&best, n->key);
+		if (n->bits == width)
+			break;
+	}
+	return (best);
+}
+
+static void
+static_net_free(struct static_net *n)
+{
+	if (n == NULL)
+		return;
+	static_net_free(n->child[0]);
+	static_net_free(n->child[1]);
+	free(n);
+}
+
+static struct static_domidx *
+static_dom_build(struct table *t, int mailaddr)
+{
+	struct static_domidx	*idx;
+	struct static_dom	*dom;
+	struct mailaddr		 maddr;
+	void			*iter;
+	const char		*k, *domain, *user;
+
+	idx = xcalloc(1, sizeof *idx, "static_dom_build");
+	dict_init(&idx->exact);
+	dict_init(&idx->wild);
+	TAILQ_INIT(&idx->other);
+
+	iter = NULL;
+	while (dict_iter(&t->t_dict, &iter, &k, NULL)) {
+		domain = k;
+		user = NULL;
+		if (mailaddr) {
+			if (! text_to_mailaddr(&maddr, k))
+				continue;
+			domain = maddr.domain;
+			if (maddr.user[0])
+				user = maddr.user;
+		}
+		dom = static_dom_get(idx, domain);
+		if (user == NULL)
+			static_best(&dom->any, k);
+		else if (dict_get(&dom->users, user) == NULL)
+			dict_set(&dom->users, user, (void *)k);
+	}
+
+	return (idx);
+}
+
+static struct static_dom *
+static_dom_get(struct static_domidx *idx, const char *pattern)
+{
+	struct static_dom	*dom;
+	struct dict		*d;
+
+	d = NULL;
+	if (strcmp(pattern, "*") == 0) {
+		if (idx->all)
+			return (idx->all);
+	}
+	else if (strchr(pattern, '*') == NULL)
+		d = &idx->exact;
+	else if (strncmp(pattern, "*.", 2) == 0 &&
+	    strchr(pattern + 2, '*') == NULL) {
+		d = &idx->wild;
+		pattern += 2;
+	}
+	else {
+		TAILQ_FOREACH(dom, &idx->other, entry)
+			if (strcmp(dom->pattern, pattern) == 0)
+				return (dom);
+	}
+
+	if (d && (dom = dict_get(d, pattern)))
+		return (dom);
+
+	dom = xcalloc(1, sizeof *dom, "static_dom_get");
+	dict_init(&dom->users);
+	if (d)
+		dict_set(d, pattern, dom);
+	else if (strcmp(pattern, "*") == 0)
+		idx->all = dom;
+	else {
+		dom->pattern = xstrdup(pattern, "static_dom_get");
+		TAILQ_INSERT_TAIL(&idx->other, dom, entry);
+	}
+	return (dom);
+}
+
+static const char *
+static_dom_lookup(struct static_domidx *idx, const char *domain,
+    const char *user)
+{
+	struct static_dom	*dom;
+	const char		*best = NULL, *p;
+
+	static_dom_match(dict_get(&idx->exact, domain), user, &best);
+
+	/* "*.suffix" stops at the first dot */
+	if ((p = strchr(domain, '.')))
+		static_dom_match(dict_get(&idx->wild, p + 1), user, &best);
+
+	if (domain[0])
+		static_dom_match(idx->all, user, &best);
+
+	TAILQ_FOREACH(dom, &idx->other, entry)
+		if (hostname_match(domain, dom->pattern))
+			static_dom_match(dom, user, &best);
+
+	return (best);
+}
+
+static void
+static_dom_match(struct static_dom *dom, const char *user, const char **best)
+{
+	if (dom == NULL)
+		return;
+	static_best(best, dom->any);
+	if (user && user[0])
+		static_best(best, dict_get(&dom->users, user));
+}
+
+static void
+static_dom_free(struct static_domidx *idx)
+{
+	struct static_dom	*dom;
+
+	while (dict_poproot(&idx->exact, (void **)&dom)) {
+		while (dict_poproot(&dom->users, NULL))
+			;
+		free(dom);
+	}
+	while (dict_poproot(&idx->wild, (void **)&dom)) {
+		while (dict_poproot(&dom->users, NULL))
+			;
+		free(dom);
+	}
+	if ((dom = idx->all)) {
+		while (dict_poproot(&dom->users, NULL))
+			;
+		free(dom);
+	}
+	while ((dom = TAILQ_FIRST(&idx->other))) {
+		TAILQ_REMOVE(&idx->other, dom, entry);
+		while (dict_poproot(&dom->users, NULL))
+			;
+		free(dom->pattern);
+		free(dom);
+	}
+	free(idx);
+}
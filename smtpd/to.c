@@ -37,6 +37,7 @@
 #include <imsg.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <netdb.h>
 #include <pwd.h>
 #include <stdarg.h>
@@ -665,6 +666,49 @@ text_to_credentials(struct credentials *creds, const char *s)
 	return 1;
 }
 
+/* "until window failures", as stored in a shared state table */
+int
+text_to_mtastate(struct mtastate *st, const char *s)
+{
+	char		 buffer[SMTPD_MAXLINESIZE], *p, *f[3];
+	const char	*errstr;
+	int		 i;
+
+	if (strlcpy(buffer, s, sizeof buffer) >= sizeof buffer)
+		return 0;
+
+	p = buffer;
+	for (i = 0; i < 3; i++) {
+		while ((f[i] = strsep(&p, " \t")) != NULL && *f[i] == '\0')
+			;
+		if (f[i] == NULL)
+			return 0;
+	}
+
+	st->until = strtonum(f[0], 0, LLONG_MAX, &errstr);
+	if (errstr)
+		return 0;
+	st->window = strtonum(f[1], 0, UINT32_MAX, &errstr);
+	if (errstr)
+		return 0;
+	st->failures = strtonum(f[2], 0, UINT32_MAX, &errstr);
+	if (errstr)
+		return 0;
+
+	return 1;
+}
+
+const char *
+mtastate_to_text(const struct mtastate *st)
+{
+	static char	buf[64];
+
+	(void)snprintf(buf, sizeof buf, "%lld %zu %" PRIu32,
+	    (long long)st->until, st->window, st->failures);
+
+	return buf;
+}
+
 int
 text_to_expandnode(struct expandnode *expandnode, const char *s)
 {
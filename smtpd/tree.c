@@ -36,33 +36,40 @@ struct treeentry {
 	void			*data;
 };
 
+/*
+ * The hash index is built once a tree holds TREE_HASH_MIN entries and
+ * dropped below half of that.  It is kept at most half full, linear
+ * probing and backward shift deletion do without tombstones.
+ */
+#define	TREE_HASH_MIN	32
+
 static int treeentry_cmp(struct treeentry *, struct treeentry *);
+static struct treeentry *tree_find(struct tree *, uint64_t);
+static int tree_insert(struct tree *, struct treeentry *);
+static void tree_remove(struct tree *, struct treeentry *);
+static size_t tree_slot(struct tree *, uint64_t);
+static void tree_index(struct tree *);
 
 SPLAY_PROTOTYPE(_tree, treeentry, entry, treeentry_cmp);
 
 int
 tree_check(struct tree *t, uint64_t id)
 {
-	struct treeentry	key;
-
-	key.id = id;
-	return (SPLAY_FIND(_tree, &t->tree, &key) != NULL);
+	return (tree_find(t, id) != NULL);
 }
 
 void *
 tree_set(struct tree *t, uint64_t id, void *data)
 {
-	struct treeentry	*entry, key;
+	struct treeentry	*entry;
 	char			*old;
 
-	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL) {
+	if ((entry = tree_find(t, id)) == NULL) {
 		if ((entry = malloc(sizeof *entry)) == NULL)
 			err(1, "tree_set: malloc");
 		entry->id = id;
-		SPLAY_INSERT(_tree, &t->tree, entry);
+		tree_insert(t, entry);
 		old = NULL;
-		t->count += 1;
 	} else
 		old = entry->data;
 
@@ -80,18 +87,16 @@ tree_xset(struct tree *t, uint64_t id, void *data)
 		err(1, "tree_xset: malloc");
 	entry->id = id;
 	entry->data = data;
-	if (SPLAY_INSERT(_tree, &t->tree, entry))
+	if (! tree_insert(t, entry))
 		errx(1, "tree_xset(%p, 0x%016"PRIx64 ")", t, id);
-	t->count += 1;
 }
 
 void *
 tree_get(struct tree *t, uint64_t id)
 {
-	struct treeentry	key, *entry;
+	struct treeentry	*entry;
 
-	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
+	if ((entry = tree_find(t, id)) == NULL)
 		return (NULL);
 
 	return (entry->data);
@@ -100,10 +105,9 @@ tree_get(struct tree *t, uint64_t id)
 void *
 tree_xget(struct tree *t, uint64_t id)
 {
-	struct treeentry	key, *entry;
+	struct treeentry	*entry;
 
-	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
+	if ((entry = tree_find(t, id)) == NULL)
 		errx(1, "tree_get(%p, 0x%016"PRIx64 ")", t, id);
 
 	return (entry->data);
@@ -112,17 +116,15 @@ tree_xget(struct tree *t, uint64_t id)
 void *
 tree_pop(struct tree *t, uint64_t id)
 {
-	struct treeentry	key, *entry;
+	struct treeentry	*entry;
 	void			*data;
 
-	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
+	if ((entry = tree_find(t, id)) == NULL)
 		return (NULL);
 
 	data = entry->data;
-	SPLAY_REMOVE(_tree, &t->tree, entry);
+	tree_remove(t, entry);
 	free(entry);
-	t->count -= 1;
 
 	return (data);
 }
@@ -130,17 +132,15 @@ tree_pop(struct tree *t, uint64_t id)
 void *
 tree_xpop(struct tree *t, uint64_t id)
 {
-	struct treeentry	key, *entry;
+	struct treeentry	*entry;
 	void			*data;
 
-	key.id = id;
-	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
+	if ((entry = tree_find(t, id)) == NULL)
 		errx(1, "tree_xpop(%p, 0x%016" PRIx64 ")", t, id);
 
 	data = entry->data;
-	SPLAY_REMOVE(_tree, &t->tree, entry);
+	tree_remove(t, entry);
 	free(entry);
-	t->count -= 1;
 
 	return (data);
 }
@@ -157,9 +157,8 @@ tree_poproot(struct tree *t, uint64_t *id, void **data)
 		*id = entry->id;
 	if (data)
 		*data = entry->data;
-	SPLAY_REMOVE(_tree, &t->tree, entry);
+	tree_remove(t, entry);
 	free(entry);
-	t->count -= 1;
 
 	return (1);
 }
@@ -238,14 +237,126 @@ tree_merge(struct tree *dst, struct tree *src)
 {
 	struct treeentry	*entry;
 
-	while (!SPLAY_EMPTY(&src->tree)) {
-		entry = SPLAY_ROOT(&src->tree);
-		SPLAY_REMOVE(_tree, &src->tree, entry);
-		if (SPLAY_INSERT(_tree, &dst->tree, entry))
+	while ((entry = SPLAY_ROOT(&src->tree)) != NULL) {
+		tree_remove(src, entry);
+		if (! tree_insert(dst, entry))
 			errx(1, "tree_merge: duplicate");
 	}
-	dst->count += src->count;
-	src->count = 0;
+}
+
+static struct treeentry *
+tree_find(struct tree *t, uint64_t id)
+{
+	struct treeentry	*entry, key;
+	size_t			 i;
+
+	if (t->slots == NULL) {
+		key.id = id;
+		return (SPLAY_FIND(_tree, &t->tree, &key));
+	}
+
+	for (i = tree_slot(t, id); (entry = t->slots[i]) != NULL;
+	    i = (i + 1) & (t->nslots - 1))
+		if (entry->id == id)
+			return (entry);
+	return (NULL);
+}
+
+/* return 0 if the id is already there */
+static int
+tree_insert(struct tree *t, struct treeentry *entry)
+{
+	size_t	i;
+
+	if (SPLAY_INSERT(_tree, &t->tree, entry))
+		return (0);
+	t->count += 1;
+
+	if (t->slots == NULL) {
+		if (t->count >= TREE_HASH_MIN)
+			tree_index(t);
+		return (1);
+	}
+	if (t->count * 2 > t->nslots) {
+		tree_index(t);
+		return (1);
+	}
+	for (i = tree_slot(t, entry->id); t->slots[i];
+	    i = (i + 1) & (t->nslots - 1))
+		;
+	t->slots[i] = entry;
+	return (1);
+}
+
+static void
+tree_remove(struct tree *t, struct treeentry *entry)
+{
+	struct treeentry	*e;
+	size_t			 i, j, k, mask;
+
+	SPLAY_REMOVE(_tree, &t->tree, entry);
+	t->count -= 1;
+
+	if (t->slots == NULL)
+		return;
+	if (t->count < TREE_HASH_MIN / 2 || t->count * 8 < t->nslots) {
+		tree_index(t);
+		return;
+	}
+
+	mask = t->nslots - 1;
+	for (i = tree_slot(t, entry->id); t->slots[i] != entry;
+	    i = (i + 1) & mask)
+		;
+	t->slots[i] = NULL;
+
+	/* move back the entries that probed past the hole */
+	for (j = (i + 1) & mask; (e = t->slots[j]) != NULL; j = (j + 1) & mask) {
+		k = tree_slot(t, e->id);
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && k <= i && k > j)) {
+			t->slots[i] = e;
+			t->slots[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static size_t
+tree_slot(struct tree *t, uint64_t id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+
+	return (id & (t->nslots - 1));
+}
+
+/* size the index for the current count, or drop it */
+static void
+tree_index(struct tree *t)
+{
+	struct treeentry	*entry;
+	size_t			 i, n;
+
+	free(t->slots);
+	t->slots = NULL;
+	t->nslots = 0;
+	if (t->count < TREE_HASH_MIN)
+		return;
+
+	for (n = TREE_HASH_MIN * 2; n < t->count * 4; n *= 2)
+		;
+	if ((t->slots = calloc(n, sizeof *t->slots)) == NULL)
+		err(1, "tree_index: calloc");
+	t->nslots = n;
+
+	SPLAY_FOREACH(entry, _tree, &t->tree) {
+		for (i = tree_slot(t, entry->id); t->slots[i];
+		    i = (i + 1) & (n - 1))
+			;
+		t->slots[i] = entry;
+	}
 }
 
 static int